@@ -0,0 +1,99 @@
+/**
+ * @file usbx.h
+ * @brief Embedding API of libusbx
+ *
+ * libusbx.a holds everything but the service entry point: the device
+ * backends, the handle table, the transfer engine, the codecs and the REST
+ * handlers. A program on the same machine as the hardware links it and
+ * calls in-process instead of going through HTTP:
+ *
+ * - usbx_init() opens libusb, drives its events and catalogs the attached
+ *   devices in the background (usbx_discovery.h), then devices are added
+ *   with usbx_handle_add() (usbx_handles.h) or POST /handles;
+ * - transfers go straight to the device (usbx_backend.h, usbx_bulk.h,
+ *   usbx_ops.h), or
+ * - any REST route is called with usbx_request(), which runs the same
+ *   handler the HTTP server would without a socket or a copy.
+ *
+ * The usbx service itself is a thin front end over this: it reads its
+ * configuration, calls usbx_init() and serves usbx_router() over HTTP.
+ *
+ * Functions declared here and in the headers it includes keep their
+ * signatures within a major version (USBX_VERSION_MAJOR).
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_H
+#define USBX_H
+
+#include <stddef.h>
+
+#include "usbx_backend.h"
+#include "usbx_handles.h"
+#include "usbx_http.h"
+
+/** @brief Major version; changes when the API does */
+#define USBX_VERSION_MAJOR 0
+/** @brief Minor version */
+#define USBX_VERSION_MINOR 3
+/** @brief Patch version */
+#define USBX_VERSION_PATCH 0
+
+/** @brief usbx_init() flag: do not open libusb (simulated devices only) */
+#define USBX_INIT_NO_USB 0x01
+
+/**
+ * @brief Version of the linked library
+ * @return "major.minor.patch"
+ */
+const char *usbx_version(void);
+
+/**
+ * @brief Initialise libusb, its event thread, the device catalog and the router
+ *
+ * Returns without waiting for devices; lookups wait for the ones they need.
+ *
+ * @param flags: USBX_INIT_* flags, 0 for defaults
+ * @return USBX_SUCCESS, USBX_ERROR_BUSY if already initialised,
+ *         USBX_ERROR_NO_MEM, or USBX_ERROR_IO if libusb cannot be initialised
+ */
+int usbx_init(unsigned int flags);
+
+/**
+ * @brief Close every handle, stop the catalog and event thread, release router and libusb
+ *
+ * Stop any HTTP server serving usbx_router() first. Does nothing if the
+ * library is not initialised.
+ */
+void usbx_shutdown(void);
+
+/**
+ * @brief Router with every REST route registered
+ * @return Router, or NULL before usbx_init()
+ */
+struct usbx_http_router *usbx_router(void);
+
+/**
+ * @brief Call a REST route in-process
+ *
+ * Fills in @p resp exactly as the HTTP server would receive it; free it
+ * with usbx_http_response_free(). Streaming responses carry their reader
+ * in @p resp. Requests made this way have no client identity, so they are
+ * neither scheduled per client nor limited by quotas.
+ *
+ * @param method: "GET", "POST", ...
+ * @param path: Path without query string, e.g. "/handles/1/batch"
+ * @param args: Query arguments, or NULL
+ * @param num_args: Entries in @p args
+ * @param body: Request body, or NULL
+ * @param body_length: Body size in bytes
+ * @param resp: Receives the response
+ * @return USBX_SUCCESS, or USBX_ERROR_INVALID_PARAM before usbx_init() or
+ *         for a missing method or path
+ */
+int usbx_request(const char *method, const char *path, const struct usbx_http_pair *args,
+                 int num_args, const void *body, size_t body_length,
+                 struct usbx_http_response *resp);
+
+#endif // USBX_H
@@ -0,0 +1,291 @@
+/**
+ * @file usbx_api.h
+ * @brief REST API handlers of the usbX service
+ *
+ * Each feature area registers its routes on a router. Handlers are plain
+ * functions over struct usbx_http_request / struct usbx_http_response and
+ * can be exercised in unit tests without a running HTTP server.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_API_H
+#define USBX_API_H
+
+#include "usbx_handles.h"
+#include "usbx_http.h"
+
+struct usbx_blob_store;
+struct usbx_buf;
+struct usbx_json;
+struct usbx_op_batch;
+
+/**
+ * @brief Register every route of the service
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_all(struct usbx_http_router *router);
+
+/**
+ * @brief Register the handle routes (GET/POST /handles, DELETE /handles/{id})
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_handles(struct usbx_http_router *router);
+
+/**
+ * @brief Register the interrupt polling routes under /handles/{id}/interrupts/{ep}
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_interrupt(struct usbx_http_router *router);
+
+/**
+ * @brief Register the shared bulk IN stream routes under /handles/{id}/streams/{ep}
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_pubsub(struct usbx_http_router *router);
+
+/**
+ * @brief Register the isochronous stream routes under /handles/{id}/iso/{ep}
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_iso(struct usbx_http_router *router);
+
+/**
+ * @brief Register the operation batch route (POST /handles/{id}/batch)
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_batch(struct usbx_http_router *router);
+
+/**
+ * @brief Register the multi-device route (POST /fanout)
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_fanout(struct usbx_http_router *router);
+
+/**
+ * @brief Register the blob store routes (PUT/GET /blobs, GET/DELETE /blobs/{hash})
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_blobs(struct usbx_http_router *router);
+
+/**
+ * @brief Register the raw bulk upload route (PUT /handles/{id}/bulk/{ep})
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_bulk(struct usbx_http_router *router);
+
+/**
+ * @brief Register the DFU firmware download route (POST /handles/{id}/dfu)
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_dfu(struct usbx_http_router *router);
+
+/**
+ * @brief Register the mass-storage block routes (GET/PUT /handles/{id}/blocks)
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_blocks(struct usbx_http_router *router);
+
+/**
+ * @brief Register the CDC-ACM serial routes (/handles/{id}/serial)
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_serial(struct usbx_http_router *router);
+
+/**
+ * @brief Register the capture routes (/handles/{id}/capture and /debug/capture)
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_capture(struct usbx_http_router *router);
+
+/**
+ * @brief Register the fault injection routes (/handles/{id}/faults); none without
+ *        USBX_FAULT_INJECTION
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_faults(struct usbx_http_router *router);
+
+/**
+ * @brief Register the retry policy routes (/handles/{id}/retry)
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_retry(struct usbx_http_router *router);
+
+/**
+ * @brief Register the circuit breaker routes (/handles/{id}/breaker)
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_breaker(struct usbx_http_router *router);
+
+/**
+ * @brief Register the latency and adaptive timeout routes (/handles/{id}/latency)
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_latency(struct usbx_http_router *router);
+
+/**
+ * @brief Register the statistics routes (/handles/{id}/stats, /metrics)
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_stats(struct usbx_http_router *router);
+
+/**
+ * @brief Register the scheduler routes (/handles/{id}/scheduler)
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_sched(struct usbx_http_router *router);
+
+/**
+ * @brief Register the quota routes (/quotas)
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_quotas(struct usbx_http_router *router);
+
+/**
+ * @brief Register the memory budget routes (/budget)
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_budget(struct usbx_http_router *router);
+
+/**
+ * @brief Register the runtime configuration routes (/admin/config)
+ * @param router: Router
+ * @return 0 on success, -1 on allocation failure
+ */
+int usbx_api_register_config(struct usbx_http_router *router);
+
+/**
+ * @brief Set the blob store used by operations and the /blobs routes
+ * @param store: Open store, or NULL to disable blobs
+ */
+void usbx_api_set_blob_store(struct usbx_blob_store *store);
+
+/**
+ * @brief Blob store set with usbx_api_set_blob_store()
+ * @return Store, or NULL if none is configured
+ */
+struct usbx_blob_store *usbx_api_blob_store(void);
+
+/**
+ * @brief Run a batch on a handle and append the per-device result object
+ *
+ * The object carries the handle id and device identity, the overall
+ * status, the elapsed time and the per-operation results.
+ *
+ * @param handle: Referenced handle
+ * @param batch: Parsed batch
+ * @param out: Buffer the JSON object is appended to
+ * @return USBX_SUCCESS, or the error of the first failed operation
+ */
+int usbx_api_run_batch(struct usbx_handle *handle, const struct usbx_op_batch *batch,
+                       struct usbx_buf *out);
+
+/**
+ * @brief Resolve the {id} path parameter to a handle
+ *
+ * On failure a 400 or 404 error is written to @p resp.
+ *
+ * @param req: Request
+ * @param resp: Response
+ * @return Referenced handle (release with usbx_handle_put()), or NULL
+ */
+struct usbx_handle *usbx_api_get_handle(const struct usbx_http_request *req,
+                                        struct usbx_http_response *resp);
+
+/**
+ * @brief Resolve the {id} path parameter to a handle for a request that uses the device
+ *
+ * Like usbx_api_get_handle(), but while the handle's circuit breaker is
+ * open a 503 error with Retry-After is written instead (usbx_breaker.h).
+ *
+ * @param req: Request
+ * @param resp: Response
+ * @return Referenced handle (release with usbx_handle_put()), or NULL
+ */
+struct usbx_handle *usbx_api_get_device(const struct usbx_http_request *req,
+                                        struct usbx_http_response *resp);
+
+/**
+ * @brief Write the 503 answer to a request refused by an open circuit breaker
+ * @param resp: Response
+ * @param retry_after_ms: Time until the breaker admits a probe
+ */
+void usbx_api_set_circuit_open(struct usbx_http_response *resp, unsigned int retry_after_ms);
+
+/**
+ * @brief Answer a request the memory budget has no room for (usbx_budget.h)
+ *
+ * USBX_ERROR_BUSY (the wait ran out) becomes 503 with Retry-After, anything
+ * else (larger than the whole budget) 413.
+ * @param resp: Response to fill in
+ * @param error: Error from usbx_budget_reserve()
+ */
+void usbx_api_set_budget_exhausted(struct usbx_http_response *resp, int error);
+
+/**
+ * @brief Parse the request body as a JSON object
+ *
+ * On failure a 400 error is written to @p resp.
+ *
+ * @param req: Request
+ * @param resp: Response
+ * @return Document (release with usbx_json_free()), or NULL
+ */
+struct usbx_json *usbx_api_parse_body(const struct usbx_http_request *req,
+                                      struct usbx_http_response *resp);
+
+/**
+ * @brief Parse an endpoint address from a path parameter or query argument value
+ * @param text: Decimal or 0x-prefixed hex address
+ * @return Endpoint address, or -1 if malformed
+ */
+int usbx_api_parse_endpoint(const char *text);
+
+#ifdef USE_DEPS
+/**
+ * @brief Set the libusb context POST /handles opens devices on
+ * @param ctx: Initialised libusb context
+ */
+void usbx_api_set_libusb_context(libusb_context *ctx);
+
+/**
+ * @brief libusb context devices are opened on
+ * @return Context set with usbx_api_set_libusb_context(), or NULL
+ */
+libusb_context *usbx_api_libusb_context(void);
+
+/**
+ * @brief Add an open libusb device to the handle table
+ *
+ * Kernel drivers are detached automatically and the device identity is
+ * read from its descriptors.
+ *
+ * @param usb_handle: Open libusb handle; ownership passes to the table, and
+ *                    it is closed on failure
+ * @return New handle id, or a negative error code
+ */
+int usbx_api_add_usb_handle(libusb_device_handle *usb_handle);
+#endif
+
+#endif // USBX_API_H
@@ -0,0 +1,295 @@
+/**
+ * @file usbx_backend.h
+ * @brief Device backend abstraction for asynchronous USB transfers
+ *
+ * Every device usbX talks to is represented by a struct usbx_device whose
+ * operations table points either at the libusb backend (real hardware,
+ * only available with USE_DEPS) or at the in-process simulated backend
+ * (see usbx_sim.h). Higher layers such as the segmented bulk engine only
+ * use the functions declared here, so they run unchanged on both.
+ *
+ * Error codes and transfer status values deliberately mirror the numbering
+ * of libusb so that values can be passed through without translation.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_BACKEND_H
+#define USBX_BACKEND_H
+
+#include <stdint.h>
+
+/** @brief Error codes returned by usbX device functions (same values as LIBUSB_ERROR_*, plus usbX-specific codes) */
+enum usbx_error {
+    USBX_SUCCESS = 0,
+    USBX_ERROR_IO = -1,
+    USBX_ERROR_INVALID_PARAM = -2,
+    USBX_ERROR_ACCESS = -3,
+    USBX_ERROR_NO_DEVICE = -4,
+    USBX_ERROR_NOT_FOUND = -5,
+    USBX_ERROR_BUSY = -6,
+    USBX_ERROR_TIMEOUT = -7,
+    USBX_ERROR_OVERFLOW = -8,
+    USBX_ERROR_PIPE = -9,
+    USBX_ERROR_INTERRUPTED = -10,
+    USBX_ERROR_NO_MEM = -11,
+    USBX_ERROR_NOT_SUPPORTED = -12,
+    USBX_ERROR_MISMATCH = -13,         /**< Data read back differs from what was expected */
+    USBX_ERROR_OTHER = -99
+};
+
+/** @brief Endpoint transfer types (same values as LIBUSB_TRANSFER_TYPE_*) */
+enum usbx_transfer_type {
+    USBX_TRANSFER_TYPE_CONTROL = 0,
+    USBX_TRANSFER_TYPE_ISOCHRONOUS = 1,
+    USBX_TRANSFER_TYPE_BULK = 2,
+    USBX_TRANSFER_TYPE_INTERRUPT = 3
+};
+
+/** @brief Completion status of a transfer (same values as LIBUSB_TRANSFER_*) */
+enum usbx_transfer_status {
+    USBX_TRANSFER_COMPLETED = 0,
+    USBX_TRANSFER_ERROR = 1,
+    USBX_TRANSFER_TIMED_OUT = 2,
+    USBX_TRANSFER_CANCELLED = 3,
+    USBX_TRANSFER_STALL = 4,
+    USBX_TRANSFER_NO_DEVICE = 5,
+    USBX_TRANSFER_OVERFLOW = 6
+};
+
+/** @brief Transfer flags */
+#define USBX_TRANSFER_SHORT_NOT_OK    (1U << 0)  /**< Treat short IN transfers as errors */
+#define USBX_TRANSFER_ADD_ZERO_PACKET (1U << 1)  /**< Terminate OUT with a zero-length packet */
+
+/** @brief usbx_device::taps bits: observers of every submission and completion */
+#define USBX_TAP_CAPTURE 0x01  /**< usbmon capture (usbx_capture.h) */
+#define USBX_TAP_TRACE   0x02  /**< Session trace (usbx_trace.h) */
+#define USBX_TAP_FAULT   0x04  /**< Fault injection (usbx_fault.h) */
+#define USBX_TAP_BREAKER 0x08  /**< Circuit breaker of the device's handle (usbx_breaker.h) */
+#define USBX_TAP_LATENCY 0x10  /**< Latency estimates and adaptive timeouts (usbx_latency.h) */
+#define USBX_TAP_STATS   0x20  /**< Transfer statistics of the device's handle (usbx_stats.h) */
+#define USBX_TAP_SCHED   0x40  /**< Fair sharing between clients (usbx_sched.h) */
+
+/** @brief Transfer events reported to taps */
+#define USBX_TAP_SUBMIT   'S'  /**< Transfer about to be handed to the backend */
+#define USBX_TAP_COMPLETE 'C'  /**< Transfer completed, before its callback */
+#define USBX_TAP_ERROR    'E'  /**< The backend refused the submission */
+
+/** @brief Direction bit of an endpoint address */
+#define USBX_ENDPOINT_IN 0x80
+
+/** @brief Size of the setup packet at the start of a control transfer buffer */
+#define USBX_CONTROL_SETUP_SIZE 8
+
+struct usbx_device;
+struct usbx_transfer;
+struct usbx_breaker;
+struct usbx_latency_table;
+struct usbx_stats;
+struct usbx_sched;
+struct usbx_quota_client;
+
+/**
+ * @struct usbx_iso_packet
+ * @brief Per-packet descriptor of an isochronous transfer
+ *
+ * Packets are laid out back to back in the transfer buffer, each one
+ * starting where the previous packet's @c length ends.
+ */
+struct usbx_iso_packet {
+    unsigned int length;         /**< Bytes reserved for this packet */
+    unsigned int actual_length;  /**< Bytes transferred, set on completion */
+    int status;                  /**< enum usbx_transfer_status, set on completion */
+};
+
+/** @brief Completion callback, invoked exactly once per successful submission */
+typedef void (*usbx_transfer_cb)(struct usbx_transfer *xfer);
+
+/**
+ * @struct usbx_transfer
+ * @brief One asynchronous transfer, modelled on struct libusb_transfer
+ *
+ * The caller owns the structure and the buffer; both must stay valid until
+ * the callback has run. Control transfers carry the 8-byte setup packet at
+ * the start of @c buffer, exactly like libusb. Isochronous transfers
+ * additionally describe their packets in @c iso_packets.
+ */
+struct usbx_transfer {
+    struct usbx_device *dev;     /**< Device the transfer is submitted to */
+    unsigned char endpoint;      /**< Endpoint address including direction bit */
+    unsigned char type;          /**< enum usbx_transfer_type */
+    unsigned int flags;          /**< USBX_TRANSFER_* flags */
+    unsigned int timeout;        /**< Timeout in milliseconds, 0 for none */
+    int status;                  /**< enum usbx_transfer_status, set on completion */
+    int length;                  /**< Length of @c buffer in bytes */
+    int actual_length;           /**< Bytes actually transferred, set on completion */
+    unsigned char *buffer;       /**< Data buffer */
+    usbx_transfer_cb callback;   /**< Completion callback */
+    void *user_data;             /**< Opaque pointer for the callback */
+    void *backend_priv;          /**< Owned by the backend while in flight */
+    int num_iso_packets;         /**< Isochronous only: entries in @c iso_packets */
+    struct usbx_iso_packet *iso_packets;  /**< Isochronous only: caller-owned descriptors */
+    uint64_t submit_us;          /**< Set on submission while latency or statistics are kept */
+    unsigned int timeout_limit;  /**< Caller's timeout while an adaptive one is applied, else 0 */
+    int scheduled;               /**< Holds a scheduler slot until completion */
+    struct usbx_quota_client *quota;  /**< Client charged on completion, or NULL */
+};
+
+/**
+ * @struct usbx_backend_ops
+ * @brief Operations a device backend has to provide
+ */
+struct usbx_backend_ops {
+    const char *name;                                   /**< Backend name for logs */
+    int (*submit)(struct usbx_transfer *xfer);          /**< Queue a transfer */
+    int (*cancel)(struct usbx_transfer *xfer);          /**< Request cancellation */
+    int (*max_packet_size)(struct usbx_device *dev, unsigned char endpoint);
+    void (*destroy)(struct usbx_device *dev);           /**< Release the device */
+};
+
+/**
+ * @struct usbx_device
+ * @brief Backend-independent device; backends embed it as their first member
+ */
+struct usbx_device {
+    const struct usbx_backend_ops *ops;  /**< Backend operations */
+    int taps;                    /**< USBX_TAP_* bits; 0 keeps the transfer path to one branch */
+    uint16_t capture_bus;        /**< usbmon bus number of captured records */
+    uint8_t capture_address;     /**< usbmon device number of captured records */
+    struct usbx_breaker *breaker;  /**< Breaker fed while USBX_TAP_BREAKER is set */
+    struct usbx_latency_table *latency;  /**< Estimates fed while USBX_TAP_LATENCY is set */
+    struct usbx_stats *stats;    /**< Counters fed while USBX_TAP_STATS is set */
+    struct usbx_sched *sched;    /**< Admission of client transfers while USBX_TAP_SCHED is set */
+};
+
+/**
+ * @brief Descriptive name of a usbX error code
+ * @param error: enum usbx_error value
+ * @return Static string such as "USBX_ERROR_TIMEOUT"
+ */
+const char *usbx_error_name(int error);
+
+/**
+ * @brief Map a transfer completion status to an error code
+ * @param status: enum usbx_transfer_status value
+ * @return USBX_SUCCESS for completed transfers, a negative usbx_error otherwise
+ */
+int usbx_status_to_error(int status);
+
+/**
+ * @brief Submit a transfer to its device
+ * @param xfer: Fully initialised transfer; @c xfer->dev selects the backend
+ * @return USBX_SUCCESS if queued (the callback will run), negative error otherwise
+ */
+int usbx_submit_transfer(struct usbx_transfer *xfer);
+
+/**
+ * @brief Deliver a transfer's completion; backends call this instead of the callback
+ * @param xfer: Transfer whose status and lengths are final
+ */
+void usbx_transfer_complete(struct usbx_transfer *xfer);
+
+/**
+ * @brief Ask the backend to cancel an in-flight transfer
+ *
+ * The callback still runs, normally with USBX_TRANSFER_CANCELLED.
+ *
+ * @param xfer: Previously submitted transfer
+ * @return USBX_SUCCESS, or USBX_ERROR_NOT_FOUND if it already completed
+ */
+int usbx_cancel_transfer(struct usbx_transfer *xfer);
+
+/**
+ * @brief Maximum packet size of an endpoint
+ * @param dev: Device
+ * @param endpoint: Endpoint address including direction bit
+ * @return wMaxPacketSize in bytes, or a negative error code
+ */
+int usbx_get_max_packet_size(struct usbx_device *dev, unsigned char endpoint);
+
+/**
+ * @brief Release a device and its backend resources
+ * @param dev: Device to destroy; NULL is ignored
+ */
+void usbx_device_destroy(struct usbx_device *dev);
+
+/**
+ * @brief Submit a transfer and block until it completes
+ *
+ * The transfer's callback and user_data are used internally and are
+ * overwritten.
+ *
+ * @param xfer: Fully initialised transfer
+ * @return USBX_SUCCESS or a negative error code derived from the status
+ */
+int usbx_transfer_sync(struct usbx_transfer *xfer);
+
+/**
+ * @brief Synchronous bulk transfer, same contract as libusb_bulk_transfer
+ * @param dev: Device
+ * @param endpoint: Endpoint address including direction bit
+ * @param data: Data buffer
+ * @param length: Buffer length in bytes
+ * @param transferred: Receives the number of bytes transferred (may be NULL)
+ * @param timeout: Timeout in milliseconds, 0 for none
+ * @return USBX_SUCCESS or a negative error code
+ */
+int usbx_bulk_transfer(struct usbx_device *dev, unsigned char endpoint,
+                       unsigned char *data, int length, int *transferred,
+                       unsigned int timeout);
+
+/**
+ * @brief Synchronous interrupt transfer, same contract as libusb_interrupt_transfer
+ * @param dev: Device
+ * @param endpoint: Endpoint address including direction bit
+ * @param data: Data buffer
+ * @param length: Buffer length in bytes
+ * @param transferred: Receives the number of bytes transferred (may be NULL)
+ * @param timeout: Timeout in milliseconds, 0 for none
+ * @return USBX_SUCCESS or a negative error code
+ */
+int usbx_interrupt_transfer(struct usbx_device *dev, unsigned char endpoint,
+                            unsigned char *data, int length, int *transferred,
+                            unsigned int timeout);
+
+/**
+ * @brief Synchronous control transfer, same contract as libusb_control_transfer
+ * @param dev: Device
+ * @param request_type: bmRequestType
+ * @param request: bRequest
+ * @param value: wValue
+ * @param index: wIndex
+ * @param data: Data stage buffer (may be NULL when @p length is 0)
+ * @param length: wLength
+ * @param timeout: Timeout in milliseconds, 0 for none
+ * @return Number of bytes transferred in the data stage, or a negative error code
+ */
+int usbx_control_transfer(struct usbx_device *dev, uint8_t request_type, uint8_t request,
+                          uint16_t value, uint16_t index, unsigned char *data,
+                          uint16_t length, unsigned int timeout);
+
+/**
+ * @brief Clear the halt of an endpoint with CLEAR_FEATURE(ENDPOINT_HALT)
+ * @param dev: Device
+ * @param endpoint: Endpoint address including direction bit
+ * @param timeout: Timeout in milliseconds, 0 for none
+ * @return USBX_SUCCESS or a negative error code
+ */
+int usbx_clear_halt(struct usbx_device *dev, unsigned char endpoint, unsigned int timeout);
+
+#ifdef USE_DEPS
+#include <libusb-1.0/libusb.h>
+
+/**
+ * @brief Wrap an open libusb handle in a usbX device
+ *
+ * Completions are delivered from whichever thread runs
+ * libusb_handle_events() on the handle's context.
+ *
+ * @param handle: Open libusb device handle; ownership passes to the device
+ * @return New device, or NULL on allocation failure
+ */
+struct usbx_device *usbx_libusb_device_create(libusb_device_handle *handle);
+#endif
+
+#endif // USBX_BACKEND_H
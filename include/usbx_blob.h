@@ -0,0 +1,147 @@
+/**
+ * @file usbx_blob.h
+ * @brief Content-addressed store for firmware images and other large payloads
+ *
+ * Blobs are files named by the lowercase hex SHA-256 of their contents in
+ * one directory. A blob is read through a shared read-only mapping, so
+ * transfers that reference it are served straight from the page cache and
+ * every client uploads an image once.
+ *
+ * The store keeps the total size under a byte capacity by deleting the
+ * least recently used blobs. Blobs in use (referenced through
+ * usbx_blob_get()) are never evicted. File modification times record use,
+ * so the LRU order survives restarts.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_BLOB_H
+#define USBX_BLOB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usbx_sha256.h"
+
+/** @brief Default store capacity in bytes */
+#define USBX_BLOB_DEFAULT_CAPACITY (1024ULL * 1024 * 1024)
+
+/**
+ * @struct usbx_blob_info
+ * @brief Description of one stored blob
+ */
+struct usbx_blob_info {
+    char hash[USBX_SHA256_HEX_SIZE];  /**< Lowercase hex SHA-256 */
+    uint64_t size;                    /**< Bytes */
+    int users;                        /**< References currently held */
+};
+
+/**
+ * @struct usbx_blob_stats
+ * @brief Store counters
+ */
+struct usbx_blob_stats {
+    uint64_t capacity;           /**< Byte limit */
+    uint64_t bytes;              /**< Bytes stored */
+    int blobs;                   /**< Blobs stored */
+    uint64_t hits;               /**< Lookups that found their blob */
+    uint64_t misses;             /**< Lookups of unknown hashes */
+    uint64_t evictions;          /**< Blobs deleted to make room */
+};
+
+struct usbx_blob_store;
+struct usbx_blob;
+
+/**
+ * @brief Open a store, creating the directory if needed and indexing existing blobs
+ *
+ * Files whose name is not a SHA-256 hex digest are ignored. Existing blobs
+ * are not re-hashed.
+ *
+ * @param directory: Store directory
+ * @param capacity: Byte limit, 0 for USBX_BLOB_DEFAULT_CAPACITY
+ * @param error: Receives the error code on failure (may be NULL)
+ * @return New store, or NULL on failure
+ */
+struct usbx_blob_store *usbx_blob_store_open(const char *directory, uint64_t capacity,
+                                             int *error);
+
+/**
+ * @brief Close a store; blobs stay on disk
+ *
+ * Every reference taken with usbx_blob_get() must have been released.
+ *
+ * @param store: Store; NULL is ignored
+ */
+void usbx_blob_store_close(struct usbx_blob_store *store);
+
+/**
+ * @brief Store bytes under their SHA-256
+ *
+ * The data is written to a temporary file that is renamed into place once
+ * complete, so a crash never leaves a truncated blob. Storing an existing
+ * blob only refreshes its position in the LRU order.
+ *
+ * @param store: Store
+ * @param data: Contents
+ * @param length: Content size
+ * @param hash: Receives the hex digest (USBX_SHA256_HEX_SIZE bytes)
+ * @return 1 if created, 0 if it already existed, USBX_ERROR_OVERFLOW if larger
+ *         than the capacity, USBX_ERROR_NO_MEM if no room can be freed, or
+ *         USBX_ERROR_IO
+ */
+int usbx_blob_put(struct usbx_blob_store *store, const void *data, size_t length, char *hash);
+
+/**
+ * @brief Look up a blob and take a reference
+ * @param store: Store
+ * @param hash: Hex digest (either case)
+ * @return Blob (release with usbx_blob_release()), or NULL if unknown or unreadable
+ */
+struct usbx_blob *usbx_blob_get(struct usbx_blob_store *store, const char *hash);
+
+/**
+ * @brief Release a reference taken by usbx_blob_get()
+ * @param blob: Blob; NULL is ignored
+ */
+void usbx_blob_release(struct usbx_blob *blob);
+
+/**
+ * @brief Contents of a referenced blob
+ * @param blob: Blob
+ * @return Read-only mapping, valid until the reference is released
+ */
+const unsigned char *usbx_blob_data(const struct usbx_blob *blob);
+
+/**
+ * @brief Size of a referenced blob
+ * @param blob: Blob
+ * @return Bytes
+ */
+size_t usbx_blob_size(const struct usbx_blob *blob);
+
+/**
+ * @brief Delete a blob; readers holding a reference keep their mapping
+ * @param store: Store
+ * @param hash: Hex digest
+ * @return USBX_SUCCESS or USBX_ERROR_NOT_FOUND
+ */
+int usbx_blob_remove(struct usbx_blob_store *store, const char *hash);
+
+/**
+ * @brief Describe the stored blobs, most recently used first
+ * @param store: Store
+ * @param info: Destination array
+ * @param max: Entries available in @p info
+ * @return Number of blobs (may exceed @p max; only @p max entries are written)
+ */
+int usbx_blob_list(struct usbx_blob_store *store, struct usbx_blob_info *info, int max);
+
+/**
+ * @brief Snapshot of the store counters
+ * @param store: Store
+ * @param stats: Receives the counters
+ */
+void usbx_blob_get_stats(struct usbx_blob_store *store, struct usbx_blob_stats *stats);
+
+#endif // USBX_BLOB_H
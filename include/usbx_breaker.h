@@ -0,0 +1,166 @@
+/**
+ * @file usbx_breaker.h
+ * @brief Per-device circuit breaker
+ *
+ * Every open handle has a breaker fed by the completions of its device's
+ * transfers. Timeouts, transfer errors and a vanished device count as
+ * failures; completed, stalled and overflowed transfers show a responsive
+ * device and count as successes; cancellations are ignored. Counts are
+ * kept in a sliding window of @c window_ms made of USBX_BREAKER_BUCKETS
+ * buckets.
+ *
+ * - Closed: requests are admitted. Once the window holds at least
+ *   @c min_transfers transfers of which @c failure_pct percent or more
+ *   failed, the breaker opens.
+ * - Open: requests that would reach the device are refused at once (the
+ *   REST layer answers 503 with Retry-After) for @c open_ms.
+ * - Half-open: one probe request is admitted; the first transfer
+ *   completing after it closes the breaker on success and opens it again
+ *   on failure. If nothing completes within @c open_ms, another probe is
+ *   admitted.
+ *
+ * A failing device is thus shed instead of holding workers for its full
+ * timeout on every request, while other devices are not affected.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_BREAKER_H
+#define USBX_BREAKER_H
+
+#include <stdint.h>
+
+#include "usbx_backend.h"
+
+/** @brief Buckets of the sliding window */
+#define USBX_BREAKER_BUCKETS 10
+
+/** @brief Defaults of struct usbx_breaker_config */
+#define USBX_BREAKER_DEFAULT_WINDOW_MS 10000
+#define USBX_BREAKER_DEFAULT_MIN_TRANSFERS 5
+#define USBX_BREAKER_DEFAULT_FAILURE_PCT 50
+#define USBX_BREAKER_DEFAULT_OPEN_MS 5000
+
+/** @brief Upper bound of window_ms and open_ms */
+#define USBX_BREAKER_MAX_MS 600000
+
+/**
+ * @enum usbx_breaker_state
+ * @brief Breaker states
+ */
+enum usbx_breaker_state {
+    USBX_BREAKER_CLOSED = 0,
+    USBX_BREAKER_OPEN,
+    USBX_BREAKER_HALF_OPEN
+};
+
+/**
+ * @struct usbx_breaker_config
+ * @brief Thresholds of a breaker
+ */
+struct usbx_breaker_config {
+    int enabled;                 /**< Zero admits every request */
+    unsigned int window_ms;      /**< Length of the sliding window */
+    unsigned int min_transfers;  /**< Transfers in the window before the breaker may open */
+    unsigned int failure_pct;    /**< Failure percentage that opens the breaker (1-100) */
+    unsigned int open_ms;        /**< Time open before a probe, and between probes */
+};
+
+/**
+ * @struct usbx_breaker_stats
+ * @brief State and counters of a breaker
+ */
+struct usbx_breaker_stats {
+    int state;                   /**< enum usbx_breaker_state */
+    uint64_t transfers;          /**< Transfers in the window */
+    uint64_t failures;           /**< Failed transfers in the window */
+    uint64_t trips;              /**< Times the breaker opened */
+    uint64_t rejected;           /**< Requests refused */
+    uint64_t probes;             /**< Probe requests admitted while half-open */
+    unsigned int retry_after_ms; /**< While open, time until a probe is admitted */
+};
+
+struct usbx_breaker;
+
+/**
+ * @brief Fill in the defaults
+ * @param config: Configuration to initialise
+ */
+void usbx_breaker_config_init(struct usbx_breaker_config *config);
+
+/**
+ * @brief Create a closed breaker with the default configuration
+ * @return Breaker, or NULL on allocation failure
+ */
+struct usbx_breaker *usbx_breaker_create(void);
+
+/**
+ * @brief Free a breaker; its device must have been detached and destroyed
+ * @param breaker: Breaker, or NULL
+ */
+void usbx_breaker_free(struct usbx_breaker *breaker);
+
+/**
+ * @brief Change the thresholds; the window is kept, a disabled breaker closes
+ * @param breaker: Breaker
+ * @param config: Configuration (copied)
+ * @return USBX_SUCCESS or USBX_ERROR_INVALID_PARAM
+ */
+int usbx_breaker_configure(struct usbx_breaker *breaker, const struct usbx_breaker_config *config);
+
+/**
+ * @brief Read the configuration
+ * @param breaker: Breaker
+ * @param config: Receives the configuration
+ */
+void usbx_breaker_get_config(struct usbx_breaker *breaker, struct usbx_breaker_config *config);
+
+/**
+ * @brief Feed a breaker with the transfers of a device
+ * @param breaker: Breaker
+ * @param dev: Device
+ */
+void usbx_breaker_attach(struct usbx_breaker *breaker, struct usbx_device *dev);
+
+/**
+ * @brief Stop feeding a device's breaker; call before destroying the device
+ * @param dev: Device
+ */
+void usbx_breaker_detach(struct usbx_device *dev);
+
+/**
+ * @brief Record a transfer outcome; called from the transfer path of attached devices
+ * @param dev: Device
+ * @param status: enum usbx_transfer_status of the completion
+ */
+void usbx_breaker_record(struct usbx_device *dev, int status);
+
+/**
+ * @brief Decide whether a request may reach the device
+ * @param breaker: Breaker
+ * @param retry_after_ms: Receives, when refused, the time until a probe is admitted
+ * @return Non-zero if admitted
+ */
+int usbx_breaker_admit(struct usbx_breaker *breaker, unsigned int *retry_after_ms);
+
+/**
+ * @brief Close the breaker and empty its window
+ * @param breaker: Breaker
+ */
+void usbx_breaker_reset(struct usbx_breaker *breaker);
+
+/**
+ * @brief Read state and counters
+ * @param breaker: Breaker
+ * @param stats: Receives the state and counters
+ */
+void usbx_breaker_get_stats(struct usbx_breaker *breaker, struct usbx_breaker_stats *stats);
+
+/**
+ * @brief Name of a breaker state
+ * @param state: enum usbx_breaker_state value
+ * @return Static string such as "open"
+ */
+const char *usbx_breaker_state_name(int state);
+
+#endif // USBX_BREAKER_H
@@ -0,0 +1,93 @@
+/**
+ * @file usbx_budget.h
+ * @brief Process-wide budget for memory held on behalf of requests
+ *
+ * Request bodies, decoded base64 payloads, the buffers of IN operations
+ * and the transfer buffers of uploads and streams reserve their size here
+ * before they are allocated and release it when they are freed. While the
+ * reservations would exceed the capacity, further ones wait in arrival
+ * order for up to @c wait_ms and then fail, so a burst of large requests
+ * queues instead of exhausting memory. A request body reserves its
+ * Content-Length before it is read, or as it grows if it is chunked,
+ * which stops its connection from reading the socket while it waits.
+ * Streams (CDC, isochronous, interrupt, pub/sub, mass-storage caches) hold
+ * their buffers for as long as they run and often reserve under a lock or
+ * in a completion callback, so they use usbx_budget_try_reserve() and fail
+ * at once rather than wait.
+ *
+ * A capacity of 0 (the default) never waits but still reports usage, so
+ * the limit can be chosen from the observed peak.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_BUDGET_H
+#define USBX_BUDGET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** @brief Default wait for a reservation in milliseconds */
+#define USBX_BUDGET_DEFAULT_WAIT_MS 5000
+
+/** @brief Longest configurable wait in milliseconds */
+#define USBX_BUDGET_MAX_WAIT_MS 600000
+
+/**
+ * @struct usbx_budget_stats
+ * @brief Budget settings, usage and waiting
+ */
+struct usbx_budget_stats {
+    uint64_t capacity;           /**< Bytes, 0 for unlimited */
+    unsigned int wait_ms;        /**< Longest wait of a reservation */
+    uint64_t in_use;             /**< Bytes reserved now */
+    uint64_t peak;               /**< Most bytes reserved at once */
+    unsigned int waiting;        /**< Reservations waiting now */
+    uint64_t reservations;       /**< Reservations granted */
+    uint64_t waited;             /**< Granted reservations that had to wait */
+    uint64_t wait_us;            /**< Total wait of granted reservations */
+    uint64_t max_wait_us;        /**< Longest wait of a granted reservation */
+    uint64_t timed_out;          /**< Reservations refused after waiting @c wait_ms */
+    uint64_t too_large;          /**< Reservations refused as larger than the capacity */
+    uint64_t declined;           /**< usbx_budget_try_reserve() calls refused */
+};
+
+/**
+ * @brief Change the capacity and the wait; a larger capacity admits waiting reservations
+ * @param capacity: Bytes, 0 for unlimited
+ * @param wait_ms: Longest wait, 0 to fail at once, up to USBX_BUDGET_MAX_WAIT_MS
+ * @return USBX_SUCCESS or USBX_ERROR_INVALID_PARAM
+ */
+int usbx_budget_configure(uint64_t capacity, unsigned int wait_ms);
+
+/**
+ * @brief Reserve memory, waiting while the budget is exhausted
+ * @param bytes: Size about to be allocated
+ * @return USBX_SUCCESS, USBX_ERROR_BUSY if the wait ran out, or
+ *         USBX_ERROR_NO_MEM if @p bytes exceeds the capacity
+ */
+int usbx_budget_reserve(size_t bytes);
+
+/**
+ * @brief Reserve memory only if that needs no wait
+ *
+ * Does not overtake waiting reservations, so it fails while any wait.
+ *
+ * @param bytes: Size about to be allocated
+ * @return USBX_SUCCESS or USBX_ERROR_BUSY
+ */
+int usbx_budget_try_reserve(size_t bytes);
+
+/**
+ * @brief Return a reservation
+ * @param bytes: Size passed to usbx_budget_reserve()
+ */
+void usbx_budget_release(size_t bytes);
+
+/**
+ * @brief Read the settings and counters
+ * @param stats: Receives them
+ */
+void usbx_budget_get_stats(struct usbx_budget_stats *stats);
+
+#endif // USBX_BUDGET_H
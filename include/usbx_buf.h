@@ -0,0 +1,79 @@
+/**
+ * @file usbx_buf.h
+ * @brief Growable byte buffer for building response bodies
+ *
+ * Appends never fail visibly: after an allocation failure the buffer keeps
+ * its @c failed flag set and ignores further appends, so callers can build
+ * a whole document and check once at the end.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_BUF_H
+#define USBX_BUF_H
+
+#include <stddef.h>
+
+/**
+ * @struct usbx_buf
+ * @brief Heap buffer that is always NUL-terminated when non-empty
+ */
+struct usbx_buf {
+    char *data;          /**< Contents, NULL until the first append */
+    size_t length;       /**< Bytes used, excluding the terminator */
+    size_t capacity;     /**< Bytes allocated */
+    int failed;          /**< Set once an allocation failed */
+};
+
+/**
+ * @brief Initialise an empty buffer
+ * @param buf: Buffer
+ */
+void usbx_buf_init(struct usbx_buf *buf);
+
+/**
+ * @brief Release the buffer's memory and reset it
+ * @param buf: Buffer
+ */
+void usbx_buf_free(struct usbx_buf *buf);
+
+/**
+ * @brief Take ownership of the contents and reset the buffer
+ * @param buf: Buffer
+ * @param length: Receives the content length (may be NULL)
+ * @return Contents (caller frees), or NULL if empty or an append failed
+ */
+char *usbx_buf_detach(struct usbx_buf *buf, size_t *length);
+
+/**
+ * @brief Append raw bytes
+ * @param buf: Buffer
+ * @param data: Bytes to append
+ * @param length: Number of bytes
+ */
+void usbx_buf_append(struct usbx_buf *buf, const void *data, size_t length);
+
+/**
+ * @brief Append formatted text
+ * @param buf: Buffer
+ * @param format: printf-style format
+ */
+void usbx_buf_printf(struct usbx_buf *buf, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Append a string as a quoted, escaped JSON string
+ * @param buf: Buffer
+ * @param text: NUL-terminated string
+ */
+void usbx_buf_json_string(struct usbx_buf *buf, const char *text);
+
+/**
+ * @brief Append bytes that may contain NULs as a quoted, escaped JSON string
+ * @param buf: Buffer
+ * @param data: Bytes to append
+ * @param length: Number of bytes
+ */
+void usbx_buf_json_bytes(struct usbx_buf *buf, const void *data, size_t length);
+
+#endif // USBX_BUF_H
@@ -0,0 +1,90 @@
+/**
+ * @file usbx_bulk.h
+ * @brief Segmented bulk transfer engine
+ *
+ * Large bulk requests are split into max-packet-aligned segments that are
+ * submitted as several concurrent transfers on the same endpoint. Every
+ * segment points straight into the caller's buffer at its final offset, so
+ * results are reassembled in order without copying. The engine allocates
+ * no data buffers, so the memory budget (usbx_budget.h) is the caller's to
+ * reserve, once for the whole buffer; the engine's own bookkeeping is a
+ * few bytes per segment and is not reserved, so it never waits on the
+ * budget while the caller holds a reservation.
+ *
+ * Short-packet termination behaves like a single libusb_bulk_transfer: an
+ * IN segment that completes short ends the request at that point and any
+ * later segments still in flight are cancelled. Because segments are
+ * separate transfers, a later segment may already have received data that
+ * belongs to the next device message; such bytes are reported in
+ * usbx_segment_result.discarded rather than returned.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_BULK_H
+#define USBX_BULK_H
+
+#include <stddef.h>
+
+#include "usbx_backend.h"
+
+/** @brief Default segment size in bytes */
+#define USBX_SEGMENT_DEFAULT_SIZE (256 * 1024)
+
+/** @brief Default number of segments kept in flight */
+#define USBX_SEGMENT_DEFAULT_IN_FLIGHT 4
+
+/** @brief Upper bound for max_in_flight */
+#define USBX_SEGMENT_MAX_IN_FLIGHT 64
+
+/** @brief Default per-segment timeout in milliseconds */
+#define USBX_SEGMENT_DEFAULT_TIMEOUT 1000
+
+/** @brief Append a zero-length packet to OUT requests that end on a packet boundary */
+#define USBX_SEGMENT_ZERO_PACKET (1U << 0)
+
+/**
+ * @struct usbx_segment_options
+ * @brief Tuning knobs for usbx_bulk_transfer_segmented()
+ */
+struct usbx_segment_options {
+    size_t segment_size;     /**< Bytes per segment, rounded down to wMaxPacketSize */
+    int max_in_flight;       /**< Segments submitted concurrently (1 = sequential) */
+    unsigned int timeout;    /**< Per-segment timeout in milliseconds, 0 for none */
+    unsigned int flags;      /**< USBX_SEGMENT_* flags */
+};
+
+/**
+ * @struct usbx_segment_result
+ * @brief Outcome of a segmented transfer
+ */
+struct usbx_segment_result {
+    size_t transferred;      /**< Contiguous bytes transferred from offset 0 */
+    size_t discarded;        /**< IN bytes received after a short segment and dropped */
+    int segments;            /**< Segments that completed successfully */
+    int short_packet;        /**< 1 if an IN request ended on a short segment */
+    int status;              /**< USBX_SUCCESS or the error of the first failed segment */
+};
+
+/**
+ * @brief Fill options with the defaults of the current configuration (usbx_config.h)
+ * @param opts: Options to initialise
+ */
+void usbx_segment_options_init(struct usbx_segment_options *opts);
+
+/**
+ * @brief Run a bulk request of arbitrary size as concurrent segments
+ * @param dev: Device
+ * @param endpoint: Bulk endpoint address including direction bit
+ * @param data: Buffer of @p length bytes (read for OUT, written for IN)
+ * @param length: Request size in bytes
+ * @param opts: Tuning options, NULL for defaults
+ * @param result: Receives the outcome (may be NULL)
+ * @return USBX_SUCCESS, or the negative error code also stored in result->status
+ */
+int usbx_bulk_transfer_segmented(struct usbx_device *dev, unsigned char endpoint,
+                                 unsigned char *data, size_t length,
+                                 const struct usbx_segment_options *opts,
+                                 struct usbx_segment_result *result);
+
+#endif // USBX_BULK_H
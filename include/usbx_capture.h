@@ -0,0 +1,136 @@
+/**
+ * @file usbx_capture.h
+ * @brief usbmon-compatible packet capture of transfers passing through usbX
+ *
+ * While capture is enabled on a device, every submission, completion and
+ * failed submission is recorded as a pcap record of link type
+ * LINKTYPE_USB_LINUX_MMAPPED (220), the format Wireshark reads from
+ * usbmon: a 64-byte usbmon header, then the isochronous descriptors, then
+ * up to @c snaplen bytes of data.
+ *
+ * Records are written without locks into a ring owned by the recording
+ * thread (a single producer per ring), so submitting threads and backend
+ * completion threads never contend. When a ring is full, records are
+ * dropped and counted. A single reader merges the rings in timestamp
+ * order, and records are only taken while it is attached. With capture
+ * disabled, the transfer path pays one branch on usbx_device::taps.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_CAPTURE_H
+#define USBX_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usbx_backend.h"
+
+/** @brief pcap link type of usbmon records with the 64-byte header */
+#define USBX_CAPTURE_LINKTYPE 220
+
+/** @brief Size of the pcap file header */
+#define USBX_CAPTURE_FILE_HEADER_SIZE 24
+
+/** @brief Size of a pcap record header */
+#define USBX_CAPTURE_RECORD_HEADER_SIZE 16
+
+/** @brief Size of the usbmon header following each record header */
+#define USBX_CAPTURE_USBMON_SIZE 64
+
+/** @brief Size of one isochronous descriptor after the usbmon header */
+#define USBX_CAPTURE_ISO_DESC_SIZE 16
+
+/** @brief Defaults of usbx_capture_configure() */
+#define USBX_CAPTURE_DEFAULT_RING_SIZE (256 * 1024)
+#define USBX_CAPTURE_DEFAULT_SNAPLEN 1024
+
+/**
+ * @struct usbx_capture_stats
+ * @brief Capture counters since the process started
+ */
+struct usbx_capture_stats {
+    uint64_t records;            /**< Records written to thread rings */
+    uint64_t dropped;            /**< Records lost because a thread ring was full */
+    uint64_t delivered;          /**< Records handed to the reader */
+    int threads;                 /**< Thread rings currently allocated */
+    int reading;                 /**< Non-zero while a reader is attached */
+};
+
+struct usbx_capture_reader;
+
+/**
+ * @brief Set the size of thread rings allocated from now on and the data snapshot length
+ * @param ring_size: Bytes per thread ring; rounded up to a power of two, at least 4 KiB
+ * @param snaplen: Data bytes kept per record, at most 65535
+ * @return USBX_SUCCESS or USBX_ERROR_INVALID_PARAM
+ */
+int usbx_capture_configure(size_t ring_size, unsigned int snaplen);
+
+/**
+ * @brief Start recording a device's transfers
+ * @param dev: Device
+ * @param bus: usbmon bus number written to its records
+ * @param address: usbmon device number written to its records
+ */
+void usbx_capture_enable(struct usbx_device *dev, uint16_t bus, uint8_t address);
+
+/**
+ * @brief Stop recording a device's transfers
+ * @param dev: Device
+ */
+void usbx_capture_disable(struct usbx_device *dev);
+
+/**
+ * @brief Whether a device's transfers are recorded
+ * @param dev: Device
+ * @return Non-zero while enabled
+ */
+int usbx_capture_enabled(const struct usbx_device *dev);
+
+/**
+ * @brief Record a transfer event; called from the transfer path when capture is on
+ * @param xfer: Transfer being submitted or completed
+ * @param type: USBX_TAP_SUBMIT, USBX_TAP_COMPLETE or USBX_TAP_ERROR (the usbmon event types)
+ * @param error: For USBX_TAP_ERROR, the usbx_error the submission failed with
+ */
+void usbx_capture_record(const struct usbx_transfer *xfer, int type, int error);
+
+/**
+ * @brief Attach the reader; records captured before this call are discarded
+ * @param max_records: Records to deliver before the stream ends, 0 for no limit
+ * @param duration_ms: Capture time before the stream ends, 0 for no limit
+ * @return Reader, or NULL if one is already attached (or on allocation failure)
+ */
+struct usbx_capture_reader *usbx_capture_reader_open(uint64_t max_records,
+                                                     unsigned int duration_ms);
+
+/**
+ * @brief Read the pcap stream: the file header first, then the records
+ *
+ * Whole records are returned when they fit; a record larger than @p max
+ * is continued by the next calls.
+ *
+ * @param reader: Reader
+ * @param buffer: Destination
+ * @param max: Destination size
+ * @param timeout_ms: 0 returns immediately, negative waits forever
+ * @return Bytes written, 0 on timeout, or USBX_ERROR_INTERRUPTED once the
+ *         record or time limit was reached and everything was read
+ */
+long usbx_capture_read(struct usbx_capture_reader *reader, unsigned char *buffer, size_t max,
+                       int timeout_ms);
+
+/**
+ * @brief Detach and free the reader
+ * @param reader: Reader, or NULL
+ */
+void usbx_capture_reader_close(struct usbx_capture_reader *reader);
+
+/**
+ * @brief Snapshot of the capture counters
+ * @param stats: Receives the counters
+ */
+void usbx_capture_get_stats(struct usbx_capture_stats *stats);
+
+#endif // USBX_CAPTURE_H
@@ -0,0 +1,237 @@
+/**
+ * @file usbx_cdc.h
+ * @brief CDC-ACM serial channel with a history ring and batched readers
+ *
+ * A struct usbx_cdc configures a CDC-ACM function (SET_LINE_CODING and
+ * SET_CONTROL_LINE_STATE on its communication interface) and keeps bulk
+ * IN transfers submitted on its data interface for as long as it is open.
+ * Received bytes go into a ring indexed by stream offset, like the
+ * interrupt poller's report ring: byte @c n lives at @c n % ring_size and
+ * the oldest bytes are overwritten when the ring is full, so the device is
+ * never throttled by a slow client and a reader joining late can replay
+ * recent output.
+ *
+ * Readers keep their own cursor and batching rules. A read returns when a
+ * complete line is available (USBX_CDC_FLUSH_NEWLINE), when @c batch_size
+ * bytes are waiting, or when the oldest waiting byte is @c batch_interval_ms
+ * old, so a chatty console costs one response chunk per line or batch
+ * instead of one per transfer.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_CDC_H
+#define USBX_CDC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usbx_backend.h"
+
+/** @brief Class requests of the communication interface */
+#define USBX_CDC_REQUEST_OUT 0x21
+#define USBX_CDC_REQUEST_IN 0xa1
+#define USBX_CDC_SET_LINE_CODING 0x20
+#define USBX_CDC_GET_LINE_CODING 0x21
+#define USBX_CDC_SET_CONTROL_LINE_STATE 0x22
+
+/** @brief Size of the line coding structure */
+#define USBX_CDC_LINE_CODING_SIZE 7
+
+/** @brief SET_CONTROL_LINE_STATE bits */
+#define USBX_CDC_CONTROL_DTR 0x01
+#define USBX_CDC_CONTROL_RTS 0x02
+
+/** @brief Defaults of struct usbx_cdc_options */
+#define USBX_CDC_DEFAULT_BAUD 115200
+#define USBX_CDC_DEFAULT_RING_SIZE (256 * 1024)
+#define USBX_CDC_DEFAULT_TRANSFER_SIZE 4096
+#define USBX_CDC_DEFAULT_IN_FLIGHT 2
+#define USBX_CDC_DEFAULT_TIMEOUT 1000
+
+/** @brief Upper bound for transfers_in_flight */
+#define USBX_CDC_MAX_IN_FLIGHT 16
+
+/** @brief Defaults of struct usbx_cdc_batch */
+#define USBX_CDC_DEFAULT_BATCH_SIZE 4096
+#define USBX_CDC_DEFAULT_BATCH_INTERVAL_MS 50
+
+/** @brief Flags of struct usbx_cdc_batch */
+#define USBX_CDC_FLUSH_NEWLINE 0x01  /**< Return as soon as a line is complete */
+
+/**
+ * @enum usbx_cdc_parity
+ * @brief bParityType values
+ */
+enum usbx_cdc_parity {
+    USBX_CDC_PARITY_NONE = 0,
+    USBX_CDC_PARITY_ODD = 1,
+    USBX_CDC_PARITY_EVEN = 2,
+    USBX_CDC_PARITY_MARK = 3,
+    USBX_CDC_PARITY_SPACE = 4
+};
+
+/**
+ * @struct usbx_cdc_line_coding
+ * @brief Serial parameters sent with SET_LINE_CODING
+ */
+struct usbx_cdc_line_coding {
+    uint32_t baud;               /**< dwDTERate in bits per second */
+    int stop_bits;               /**< bCharFormat: 0 = 1, 1 = 1.5, 2 = 2 stop bits */
+    int parity;                  /**< enum usbx_cdc_parity */
+    int data_bits;               /**< bDataBits: 5, 6, 7, 8 or 16 */
+};
+
+/**
+ * @struct usbx_cdc_options
+ * @brief Parameters of a serial channel
+ */
+struct usbx_cdc_options {
+    int interface;               /**< Communication interface number */
+    unsigned char in_endpoint;   /**< Data interface bulk IN endpoint */
+    unsigned char out_endpoint;  /**< Data interface bulk OUT endpoint */
+    struct usbx_cdc_line_coding coding;  /**< Line coding set when opening */
+    int control_lines;           /**< USBX_CDC_CONTROL_* bits set when opening */
+    size_t ring_size;            /**< History ring capacity in bytes */
+    int transfer_size;           /**< Bytes per bulk IN transfer */
+    int transfers_in_flight;     /**< Bulk IN transfers kept submitted */
+    unsigned int timeout;        /**< Timeout of control requests and writes in milliseconds */
+};
+
+/**
+ * @struct usbx_cdc_batch
+ * @brief When a reader returns buffered data
+ */
+struct usbx_cdc_batch {
+    int flags;                   /**< USBX_CDC_FLUSH_* bits */
+    size_t batch_size;           /**< Return once this many bytes are waiting */
+    unsigned int batch_interval_ms;  /**< Return once the oldest waiting byte is this old */
+};
+
+/**
+ * @struct usbx_cdc_reader
+ * @brief Cursor and batching state of one reader
+ */
+struct usbx_cdc_reader {
+    uint64_t cursor;             /**< Stream offset of the next byte to read */
+    uint64_t dropped;            /**< Bytes overwritten before this reader got them */
+    uint64_t waiting_since_us;   /**< When the reader first saw unread data, 0 if none */
+    struct usbx_cdc_batch batch; /**< Batching rules */
+};
+
+/**
+ * @struct usbx_cdc_stats
+ * @brief Channel counters
+ */
+struct usbx_cdc_stats {
+    struct usbx_cdc_line_coding coding;  /**< Current line coding */
+    int control_lines;           /**< Current USBX_CDC_CONTROL_* bits */
+    uint64_t received;           /**< Bytes received (the stream offset of the next byte) */
+    uint64_t sent;               /**< Bytes written to the device */
+    uint64_t transfers;          /**< Completed bulk IN transfers with data */
+    uint64_t oldest;             /**< Stream offset of the oldest byte still in the ring */
+    int running;                 /**< Non-zero while bulk IN transfers are submitted */
+    int last_error;              /**< Error that stopped reception, USBX_SUCCESS if none */
+};
+
+struct usbx_cdc;
+
+/**
+ * @brief Fill options with defaults (interface 0, endpoints 0x81/0x02, 115200 8N1, DTR and RTS)
+ * @param opts: Options to initialise
+ */
+void usbx_cdc_options_init(struct usbx_cdc_options *opts);
+
+/**
+ * @brief Configure the line and start receiving
+ * @param dev: Device; must outlive the channel
+ * @param opts: Options, or NULL for defaults
+ * @param error: Receives the error code on failure (may be NULL)
+ * @return New channel, or NULL
+ */
+struct usbx_cdc *usbx_cdc_open(struct usbx_device *dev, const struct usbx_cdc_options *opts,
+                               int *error);
+
+/**
+ * @brief Stop receiving and wake all readers; buffered data can still be read
+ * @param cdc: Channel
+ */
+void usbx_cdc_stop(struct usbx_cdc *cdc);
+
+/**
+ * @brief Stop the channel and release it; no reader may still use it
+ * @param cdc: Channel, or NULL
+ */
+void usbx_cdc_close(struct usbx_cdc *cdc);
+
+/**
+ * @brief Change the line coding
+ * @param cdc: Channel
+ * @param coding: New serial parameters
+ * @return USBX_SUCCESS, USBX_ERROR_INVALID_PARAM or the control transfer error
+ */
+int usbx_cdc_set_line_coding(struct usbx_cdc *cdc, const struct usbx_cdc_line_coding *coding);
+
+/**
+ * @brief Set DTR and RTS
+ * @param cdc: Channel
+ * @param lines: USBX_CDC_CONTROL_* bits
+ * @return USBX_SUCCESS or the control transfer error
+ */
+int usbx_cdc_set_control_lines(struct usbx_cdc *cdc, int lines);
+
+/**
+ * @brief Send bytes to the device
+ * @param cdc: Channel
+ * @param data: Bytes to send
+ * @param length: Number of bytes
+ * @param transferred: Receives the bytes accepted by the device (may be NULL)
+ * @return USBX_SUCCESS or the transfer error
+ */
+int usbx_cdc_write(struct usbx_cdc *cdc, const unsigned char *data, size_t length,
+                   size_t *transferred);
+
+/**
+ * @brief Fill batch rules with defaults (flush on newline, 4 KiB, 50 ms)
+ * @param batch: Rules to initialise
+ */
+void usbx_cdc_batch_init(struct usbx_cdc_batch *batch);
+
+/**
+ * @brief Start a reader at the current end of the stream
+ * @param cdc: Channel
+ * @param reader: Reader to initialise
+ * @param batch: Batching rules, or NULL for defaults
+ * @param backlog: Bytes of history to replay, limited to what the ring still holds
+ */
+void usbx_cdc_reader_init(struct usbx_cdc *cdc, struct usbx_cdc_reader *reader,
+                          const struct usbx_cdc_batch *batch, size_t backlog);
+
+/**
+ * @brief Read the next batch
+ *
+ * Waits until the reader's batching rules release data, then copies up to
+ * @p max bytes; with USBX_CDC_FLUSH_NEWLINE a batch ends after its last
+ * complete line unless it is longer than @p max or released by size or
+ * age. After the channel stopped, remaining data is returned at once.
+ *
+ * @param cdc: Channel
+ * @param reader: Reader state; only one thread may use it at a time
+ * @param buffer: Destination
+ * @param max: Destination size
+ * @param timeout_ms: 0 returns immediately, negative waits forever
+ * @return Bytes read (> 0), 0 on timeout, or the error that stopped the
+ *         channel (USBX_ERROR_INTERRUPTED after usbx_cdc_stop()) once
+ *         everything was read
+ */
+long usbx_cdc_read(struct usbx_cdc *cdc, struct usbx_cdc_reader *reader, unsigned char *buffer,
+                   size_t max, int timeout_ms);
+
+/**
+ * @brief Snapshot of the channel counters
+ * @param cdc: Channel
+ * @param stats: Receives the counters
+ */
+void usbx_cdc_get_stats(struct usbx_cdc *cdc, struct usbx_cdc_stats *stats);
+
+#endif // USBX_CDC_H
@@ -0,0 +1,55 @@
+/**
+ * @file usbx_codec.h
+ * @brief Binary-to-text codecs used in JSON request and response bodies
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_CODEC_H
+#define USBX_CODEC_H
+
+#include <stddef.h>
+
+/**
+ * @brief Size of the base64 encoding of @p length bytes, excluding the terminator
+ * @param length: Input size
+ * @return Encoded size
+ */
+size_t usbx_base64_encoded_size(size_t length);
+
+/**
+ * @brief Encode bytes as standard base64 with padding
+ * @param data: Input bytes
+ * @param length: Input size
+ * @param out: Destination with room for usbx_base64_encoded_size() + 1 bytes
+ * @return Encoded length; @p out is NUL-terminated
+ */
+size_t usbx_base64_encode(const unsigned char *data, size_t length, char *out);
+
+/**
+ * @brief Decode standard base64; whitespace is ignored, padding is optional
+ * @param text: Encoded text
+ * @param length: Text size
+ * @param out: Destination with room for 3 * ((length + 3) / 4) bytes
+ * @return Decoded length, or -1 on malformed input
+ */
+long usbx_base64_decode(const char *text, size_t length, unsigned char *out);
+
+/**
+ * @brief Encode bytes as lowercase hexadecimal
+ * @param data: Input bytes
+ * @param length: Input size
+ * @param out: Destination with room for 2 * length + 1 bytes
+ */
+void usbx_hex_encode(const unsigned char *data, size_t length, char *out);
+
+/**
+ * @brief Decode hexadecimal text (either case)
+ * @param text: Hex digits
+ * @param length: Text size (must be even)
+ * @param out: Destination with room for length / 2 bytes
+ * @return Decoded length, or -1 on malformed input
+ */
+long usbx_hex_decode(const char *text, size_t length, unsigned char *out);
+
+#endif // USBX_CODEC_H
@@ -0,0 +1,129 @@
+/**
+ * @file usbx_compress.h
+ * @brief Streaming gzip/zstd codecs for HTTP content coding
+ *
+ * Request bodies sent with Content-Encoding are decompressed block by
+ * block, and streaming responses are compressed on the fly when the client
+ * sends a matching Accept-Encoding. gzip is available when the service is
+ * built with zlib (USE_ZLIB) and zstd when built with libzstd (USE_ZSTD);
+ * identity is always available.
+ *
+ * Codec work never runs on a backend event thread. Response compression
+ * runs inline on the HTTP connection thread that sends the body: the front
+ * end has one thread per connection, so a slow level delays only that
+ * client, and its reader is paced by the client anyway. Upload
+ * decompression runs on the bulk route's worker thread (api_bulk.c), where
+ * it overlaps the transfer of the previous chunk.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_COMPRESS_H
+#define USBX_COMPRESS_H
+
+#include <stddef.h>
+
+#include "usbx_http.h"
+
+/** @brief Default compression level (gzip and zstd both accept it) */
+#define USBX_COMPRESS_DEFAULT_LEVEL 3
+
+/**
+ * @enum usbx_encoding
+ * @brief HTTP content codings
+ */
+enum usbx_encoding {
+    USBX_ENCODING_IDENTITY = 0,
+    USBX_ENCODING_GZIP,
+    USBX_ENCODING_ZSTD
+};
+
+/**
+ * @enum usbx_zstream_mode
+ * @brief What usbx_zstream_process() should do with buffered data
+ */
+enum usbx_zstream_mode {
+    USBX_ZSTREAM_RUN = 0,        /**< Consume input, emit output when convenient */
+    USBX_ZSTREAM_FLUSH,          /**< Compress: emit everything consumed so far */
+    USBX_ZSTREAM_FINISH          /**< Compress: emit everything and end the stream */
+};
+
+struct usbx_zstream;
+
+/**
+ * @brief Parse a Content-Encoding value
+ * @param name: Coding name such as "gzip"; NULL or empty means identity
+ * @return enum usbx_encoding value, or USBX_ERROR_NOT_SUPPORTED if unknown or not built in
+ */
+int usbx_encoding_parse(const char *name);
+
+/**
+ * @brief Name of a content coding
+ * @param encoding: enum usbx_encoding value
+ * @return Static string such as "gzip"
+ */
+const char *usbx_encoding_name(int encoding);
+
+/**
+ * @brief Pick the preferred built-in coding from an Accept-Encoding value
+ *
+ * zstd is preferred over gzip at equal quality; codings with q=0 are
+ * never chosen.
+ *
+ * @param accept: Header value, or NULL
+ * @return enum usbx_encoding value (identity if nothing better is acceptable)
+ */
+int usbx_encoding_negotiate(const char *accept);
+
+/**
+ * @brief Create a compressor or decompressor
+ * @param encoding: USBX_ENCODING_GZIP or USBX_ENCODING_ZSTD
+ * @param compress: Non-zero to compress, zero to decompress
+ * @param level: Compression level (ignored when decompressing)
+ * @return New stream, or NULL if the coding is unavailable or allocation failed
+ */
+struct usbx_zstream *usbx_zstream_create(int encoding, int compress, int level);
+
+/**
+ * @brief Destroy a stream
+ * @param z: Stream; NULL is ignored
+ */
+void usbx_zstream_destroy(struct usbx_zstream *z);
+
+/**
+ * @brief Run the codec over as much input and output space as it can use
+ *
+ * The pointers and sizes are advanced past the consumed input and the
+ * produced output. A FLUSH or FINISH must be repeated with more output
+ * space until this returns 1.
+ *
+ * @param z: Stream
+ * @param in: Input cursor
+ * @param in_left: Input bytes left
+ * @param out: Output cursor
+ * @param out_left: Output space left
+ * @param mode: enum usbx_zstream_mode value
+ * @return 1 when a flush or finish completed or the compressed input ended,
+ *         0 if more work remains, USBX_ERROR_INVALID_PARAM for corrupt input
+ *         or another negative error code
+ */
+int usbx_zstream_process(struct usbx_zstream *z, const unsigned char **in, size_t *in_left,
+                         unsigned char **out, size_t *out_left, int mode);
+
+/**
+ * @brief Compress a streaming response if the client accepts a built-in coding
+ *
+ * Wraps the reader of @p resp so that its output is compressed on the
+ * connection thread, flushed whenever the inner reader has nothing new,
+ * and adds the Content-Encoding and Vary headers. The level is the
+ * compression_level of the config snapshot current at this call (usbx_config.h).
+ * Complete bodies and clients without a matching Accept-Encoding are left alone.
+ *
+ * @param req: Request carrying Accept-Encoding
+ * @param resp: Response after the handler set its reader
+ * @return Coding applied (enum usbx_encoding value)
+ */
+int usbx_compress_response(const struct usbx_http_request *req,
+                           struct usbx_http_response *resp);
+
+#endif // USBX_COMPRESS_H
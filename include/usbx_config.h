@@ -0,0 +1,208 @@
+/**
+ * @file usbx_config.h
+ * @brief Tuning settings that can change while the service runs
+ *
+ * The settings form one immutable snapshot. A change builds a new snapshot
+ * from the current one (an update) or from the startup settings plus the
+ * config file (a reload), validates all of it, applies it to the memory
+ * budget and the quotas, and publishes it with a single
+ * atomic store. Hot paths read the current snapshot without a lock, so a
+ * request sees either all of a change or none of it. A change that is
+ * invalid, or that touches a setting only read at startup (the port, the
+ * discovery workers, the blob store), is rejected as a whole.
+ *
+ * A replaced snapshot is freed by a later change once it has been retired
+ * for USBX_CONFIG_GRACE_MS, so a pointer from usbx_config_current() is for
+ * reading the settings a step needs right away, not for keeping. Repeated
+ * changes thus hold at most one grace period's worth of snapshots.
+ *
+ * Files and updates hold one "key = value" per line; blank lines and
+ * lines starting with '#' are ignored. Sizes in megabytes end in _mb,
+ * durations in milliseconds in _ms.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_CONFIG_H
+#define USBX_CONFIG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usbx_quota.h"
+
+/** @brief Default HTTP port */
+#define USBX_DEFAULT_PORT 8080
+
+/** @brief Default blob directory */
+#define USBX_DEFAULT_BLOB_DIR "/var/lib/usbx/blobs"
+
+/** @brief Default wait of a device lookup for the discovery catalog */
+#define USBX_DEFAULT_DISCOVERY_TIMEOUT_MS 5000
+
+/** @brief Default drain time after a handoff */
+#define USBX_DEFAULT_DRAIN_TIMEOUT_MS 30000
+
+/** @brief How long a replaced snapshot stays readable before it may be freed */
+#define USBX_CONFIG_GRACE_MS 1000
+
+/** @brief Longest configurable path */
+#define USBX_CONFIG_PATH_MAX 256
+
+/**
+ * @struct usbx_config
+ * @brief One snapshot of the settings
+ */
+struct usbx_config {
+    uint64_t version;                  /**< 0 for the built-in defaults, then one per change */
+    /* Live */
+    size_t segment_size;               /**< Default bulk segment size (usbx_bulk.h) */
+    int segment_in_flight;             /**< Default bulk segments in flight */
+    unsigned int segment_timeout_ms;   /**< Default per-segment timeout */
+    int compression_level;             /**< Compressed download level, 1-9 */
+    struct usbx_quota_limits quota;    /**< Default per-client quotas */
+    uint64_t memory_budget;            /**< Memory budget in bytes, 0 for unlimited */
+    unsigned int memory_budget_wait_ms;  /**< Longest wait for the memory budget */
+    unsigned int discovery_timeout_ms;   /**< Longest wait of a device lookup */
+    unsigned int drain_timeout_ms;     /**< Drain time after a handoff */
+    unsigned int sched_max_in_flight;  /**< Default scheduler slots of a device (usbx_sched.h) */
+    unsigned int sched_quantum;        /**< Default scheduler quantum in bytes */
+    int interrupt_slots;               /**< Default interrupt reports kept per poller */
+    /* Read at startup only */
+    unsigned int port;                 /**< HTTP port */
+    unsigned int discovery_workers;    /**< Buses probed at once */
+    char blob_dir[USBX_CONFIG_PATH_MAX];  /**< Blob store directory */
+    uint64_t blob_capacity;            /**< Blob store capacity in bytes, 0 for the default */
+};
+
+/**
+ * @struct usbx_config_key
+ * @brief Description of one setting
+ */
+struct usbx_config_key {
+    const char *name;    /**< Key in files and updates, e.g. "segment_size" */
+    int live;            /**< 0 if a change needs a restart */
+    int text;            /**< 1 for a string, 0 for a number */
+};
+
+/**
+ * @struct usbx_config_stats
+ * @brief Changes applied and rejected
+ */
+struct usbx_config_stats {
+    uint64_t version;    /**< Version of the current snapshot */
+    uint64_t applied;    /**< Reloads and updates applied */
+    uint64_t rejected;   /**< Reloads and updates rejected */
+    uint64_t retained;   /**< Snapshots allocated: current and in their grace period */
+};
+
+/**
+ * @brief Fill in the built-in defaults
+ * @param config: Receives them, version 0
+ */
+void usbx_config_defaults(struct usbx_config *config);
+
+/**
+ * @brief Number of settings
+ * @return Count, for usbx_config_key()
+ */
+int usbx_config_num_keys(void);
+
+/**
+ * @brief Describe a setting
+ * @param index: 0 to usbx_config_num_keys() - 1
+ * @return Description, or NULL if @p index is out of range
+ */
+const struct usbx_config_key *usbx_config_key(int index);
+
+/**
+ * @brief Change one setting of a snapshot being built
+ * @param config: Snapshot
+ * @param name: Key
+ * @param value: Value as text
+ * @return USBX_SUCCESS, USBX_ERROR_NOT_FOUND for an unknown key, or
+ *         USBX_ERROR_INVALID_PARAM for a value out of range
+ */
+int usbx_config_set(struct usbx_config *config, const char *name, const char *value);
+
+/**
+ * @brief Format one setting as text, as usbx_config_set() accepts it
+ * @param config: Snapshot
+ * @param name: Key
+ * @param value: Receives the text
+ * @param size: Capacity of @p value
+ * @return USBX_SUCCESS or USBX_ERROR_NOT_FOUND
+ */
+int usbx_config_format(const struct usbx_config *config, const char *name, char *value,
+                       size_t size);
+
+/**
+ * @brief Apply "key = value" lines to a snapshot being built
+ * @param config: Snapshot; partly changed on failure
+ * @param text: Lines
+ * @param length: Bytes in @p text
+ * @param error: Receives a message naming the line on failure (may be NULL)
+ * @param error_size: Capacity of @p error
+ * @return USBX_SUCCESS, USBX_ERROR_NOT_FOUND or USBX_ERROR_INVALID_PARAM
+ */
+int usbx_config_parse(struct usbx_config *config, const char *text, size_t length, char *error,
+                      size_t error_size);
+
+/**
+ * @brief Publish the startup settings plus the config file and apply them
+ *
+ * Every setting may be given here. The startup settings and @p path are
+ * kept for usbx_config_reload().
+ *
+ * @param startup: Startup settings, e.g. defaults and environment
+ * @param path: Config file, or NULL for none
+ * @param error: Receives a message on failure (may be NULL)
+ * @param error_size: Capacity of @p error
+ * @return USBX_SUCCESS, USBX_ERROR_IO if the file cannot be read, or a
+ *         usbx_config_parse() error; nothing is applied on failure
+ */
+int usbx_config_start(const struct usbx_config *startup, const char *path, char *error,
+                      size_t error_size);
+
+/**
+ * @brief Read the config file again on top of the startup settings and apply it
+ * @param error: Receives a message on failure (may be NULL)
+ * @param error_size: Capacity of @p error
+ * @return USBX_SUCCESS, USBX_ERROR_NOT_FOUND if there is no config file,
+ *         USBX_ERROR_IO, USBX_ERROR_NOT_SUPPORTED if a startup-only setting
+ *         changed, or a usbx_config_parse() error; nothing is applied on failure
+ */
+int usbx_config_reload(char *error, size_t error_size);
+
+/**
+ * @brief Apply "key = value" lines on top of the current snapshot
+ * @param text: Lines
+ * @param length: Bytes in @p text
+ * @param error: Receives a message on failure (may be NULL)
+ * @param error_size: Capacity of @p error
+ * @return As usbx_config_reload()
+ */
+int usbx_config_update(const char *text, size_t length, char *error, size_t error_size);
+
+/**
+ * @brief Current snapshot, read without a lock
+ * @return Snapshot, never NULL; valid for USBX_CONFIG_GRACE_MS after the next
+ *         change, or until usbx_config_reset()
+ */
+const struct usbx_config *usbx_config_current(void);
+
+/**
+ * @brief Read the version and counters
+ * @param stats: Receives them
+ */
+void usbx_config_get_stats(struct usbx_config_stats *stats);
+
+/**
+ * @brief Return to the built-in defaults and free every snapshot
+ *
+ * Only while nothing reads the snapshots, e.g. after usbx_shutdown().
+ * The subsystems keep the settings last applied.
+ */
+void usbx_config_reset(void);
+
+#endif // USBX_CONFIG_H
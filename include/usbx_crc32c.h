@@ -0,0 +1,50 @@
+/**
+ * @file usbx_crc32c.h
+ * @brief CRC-32C (Castagnoli), used to verify device readback
+ *
+ * On x86-64 CPUs with SSE4.2 the CRC instruction is used, on three
+ * interleaved lanes merged with PCLMULQDQ when that is available too;
+ * other CPUs use a slicing-by-8 table. The choice is made once at run time.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_CRC32C_H
+#define USBX_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Extend a CRC-32C over more data
+ *
+ * Start with 0; the result of one call can be passed to the next to
+ * checksum data that arrives in pieces.
+ *
+ * @param crc: CRC of the preceding data, 0 for none
+ * @param data: Input bytes
+ * @param length: Input size
+ * @return CRC of the preceding data followed by @p data
+ */
+uint32_t usbx_crc32c(uint32_t crc, const void *data, size_t length);
+
+/**
+ * @brief Portable CRC-32C, regardless of the CPU
+ *
+ * Gives the same result as usbx_crc32c(); exposed to cross-check the
+ * accelerated implementation.
+ *
+ * @param crc: CRC of the preceding data, 0 for none
+ * @param data: Input bytes
+ * @param length: Input size
+ * @return CRC of the preceding data followed by @p data
+ */
+uint32_t usbx_crc32c_portable(uint32_t crc, const void *data, size_t length);
+
+/**
+ * @brief Name of the implementation usbx_crc32c() uses on this CPU
+ * @return "sse4.2+pclmul", "sse4.2" or "table"
+ */
+const char *usbx_crc32c_implementation(void);
+
+#endif // USBX_CRC32C_H
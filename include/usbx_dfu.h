@@ -0,0 +1,146 @@
+/**
+ * @file usbx_dfu.h
+ * @brief DFU 1.1 firmware download engine
+ *
+ * Runs the whole DFU_DNLOAD / DFU_GETSTATUS exchange of a firmware
+ * download next to the device instead of one client round trip per
+ * request. After every block the device is polled again exactly
+ * bwPollTimeout after its previous status response arrived: never
+ * earlier, which the specification forbids, and without the coarse
+ * sleeps a remote client would add.
+ *
+ * The device must already be in DFU mode (dfuIDLE, or a state the
+ * engine can return to dfuIDLE with DFU_CLRSTATUS / DFU_ABORT).
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_DFU_H
+#define USBX_DFU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usbx_backend.h"
+
+/** @brief DFU class requests (bRequest) */
+enum usbx_dfu_request {
+    USBX_DFU_DETACH = 0,
+    USBX_DFU_DNLOAD = 1,
+    USBX_DFU_UPLOAD = 2,
+    USBX_DFU_GETSTATUS = 3,
+    USBX_DFU_CLRSTATUS = 4,
+    USBX_DFU_GETSTATE = 5,
+    USBX_DFU_ABORT = 6
+};
+
+/** @brief Device states (bState) */
+enum usbx_dfu_state {
+    USBX_DFU_STATE_APP_IDLE = 0,
+    USBX_DFU_STATE_APP_DETACH = 1,
+    USBX_DFU_STATE_IDLE = 2,
+    USBX_DFU_STATE_DNLOAD_SYNC = 3,
+    USBX_DFU_STATE_DNBUSY = 4,
+    USBX_DFU_STATE_DNLOAD_IDLE = 5,
+    USBX_DFU_STATE_MANIFEST_SYNC = 6,
+    USBX_DFU_STATE_MANIFEST = 7,
+    USBX_DFU_STATE_MANIFEST_WAIT_RESET = 8,
+    USBX_DFU_STATE_UPLOAD_IDLE = 9,
+    USBX_DFU_STATE_ERROR = 10
+};
+
+/** @brief Device status codes (bStatus); only the ones usbX acts on are named */
+enum usbx_dfu_status {
+    USBX_DFU_STATUS_OK = 0x00,
+    USBX_DFU_STATUS_ERR_WRITE = 0x03,
+    USBX_DFU_STATUS_ERR_ADDRESS = 0x08,
+    USBX_DFU_STATUS_ERR_UNKNOWN = 0x0e,
+    USBX_DFU_STATUS_ERR_STALLEDPKT = 0x0f
+};
+
+/** @brief Class-specific interface request types */
+#define USBX_DFU_REQUEST_OUT 0x21
+#define USBX_DFU_REQUEST_IN 0xa1
+
+/** @brief Size of the DFU_GETSTATUS response */
+#define USBX_DFU_STATUS_SIZE 6
+
+/** @brief Default and largest block size (wTransferSize) */
+#define USBX_DFU_DEFAULT_TRANSFER_SIZE 1024
+#define USBX_DFU_MAX_TRANSFER_SIZE 4096
+
+/** @brief Default timeout of each DFU control request in milliseconds */
+#define USBX_DFU_DEFAULT_TIMEOUT 5000
+
+/** @brief Largest bwPollTimeout honoured before the device is considered hung (ms) */
+#define USBX_DFU_MAX_POLL_TIMEOUT 60000
+
+/**
+ * @struct usbx_dfu_options
+ * @brief Parameters of a download
+ */
+struct usbx_dfu_options {
+    int interface;              /**< bInterfaceNumber of the DFU interface */
+    int alt_setting;            /**< Alternate setting selected first, -1 to keep */
+    int transfer_size;          /**< Bytes per DFU_DNLOAD block (the device's wTransferSize) */
+    unsigned int timeout;       /**< Timeout of each control request in milliseconds */
+};
+
+/**
+ * @struct usbx_dfu_progress
+ * @brief Progress of a download, also its final result
+ */
+struct usbx_dfu_progress {
+    size_t total;               /**< Image size */
+    size_t written;             /**< Bytes acknowledged by the device */
+    uint32_t blocks;            /**< DFU_DNLOAD requests with data */
+    uint32_t polls;             /**< DFU_GETSTATUS requests */
+    uint64_t poll_wait_us;      /**< Time spent waiting out bwPollTimeout */
+    uint64_t elapsed_us;        /**< Time since the download started */
+    int state;                  /**< Last bState reported, -1 before the first */
+    int status;                 /**< Last bStatus reported */
+};
+
+/**
+ * @brief Progress callback, invoked on the downloading thread after every block
+ * @param cls: Closure passed to usbx_dfu_download()
+ * @param progress: Snapshot of the progress
+ */
+typedef void (*usbx_dfu_progress_cb)(void *cls, const struct usbx_dfu_progress *progress);
+
+/**
+ * @brief Fill options with defaults (interface 0, 1024-byte blocks)
+ * @param opts: Options to initialise
+ */
+void usbx_dfu_options_init(struct usbx_dfu_options *opts);
+
+/**
+ * @brief Download a firmware image and wait for manifestation
+ *
+ * Returns once the device reports dfuIDLE (manifestation tolerant) or
+ * dfuMANIFEST-WAIT-RESET, or when a device that resets itself stops
+ * answering after the final zero-length DFU_DNLOAD.
+ *
+ * @param dev: Device in DFU mode
+ * @param image: Firmware image
+ * @param size: Image size in bytes
+ * @param opts: Options, or NULL for defaults
+ * @param callback: Progress callback, or NULL
+ * @param cls: Closure passed to @p callback
+ * @param progress: Receives the final progress (may be NULL)
+ * @return USBX_SUCCESS, USBX_ERROR_IO when the device reported an error
+ *         status (see progress->status), USBX_ERROR_NOT_SUPPORTED when it is
+ *         not in DFU mode, or a transfer error
+ */
+int usbx_dfu_download(struct usbx_device *dev, const unsigned char *image, size_t size,
+                      const struct usbx_dfu_options *opts, usbx_dfu_progress_cb callback,
+                      void *cls, struct usbx_dfu_progress *progress);
+
+/**
+ * @brief Name of a DFU state
+ * @param state: enum usbx_dfu_state value
+ * @return Static string such as "dfuDNBUSY", or "unknown"
+ */
+const char *usbx_dfu_state_name(int state);
+
+#endif // USBX_DFU_H
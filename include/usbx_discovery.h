@@ -0,0 +1,152 @@
+/**
+ * @file usbx_discovery.h
+ * @brief Background catalog of attached devices
+ *
+ * Reading a device's serial number means opening it and issuing a string
+ * descriptor request, which can take tens of milliseconds per device on a
+ * slow hub. Instead of doing that serially before the service listens, the
+ * catalog lists the attached devices once (bus, address, vid and pid come
+ * from cached descriptors and are cheap) and then probes their serial
+ * numbers in the background, one worker per bus, up to @c max_workers
+ * buses at a time.
+ *
+ * A lookup waits only for the devices it can match: one without a serial
+ * number is answered as soon as the list is read, and one with a serial
+ * number probes a matching device that no worker has reached yet itself
+ * instead of waiting behind the rest of its bus. A lookup that matches
+ * nothing rescans once, so devices attached later are found too.
+ *
+ * Devices come from a source, the libusb one for hardware or any other
+ * (the unit tests use a simulated one), much like device backends.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_DISCOVERY_H
+#define USBX_DISCOVERY_H
+
+#include <stdint.h>
+
+#include "usbx_handles.h"
+
+/** @brief Default number of buses probed at once */
+#define USBX_DISCOVERY_DEFAULT_WORKERS 8
+
+/** @brief Upper bound of the number of buses probed at once */
+#define USBX_DISCOVERY_MAX_WORKERS 64
+
+/**
+ * @struct usbx_discovery_device
+ * @brief One attached device as listed by a source
+ */
+struct usbx_discovery_device {
+    struct usbx_device_info info;   /**< Identity; serial empty until probed */
+    void *ref;                      /**< Source's reference to the device */
+};
+
+/**
+ * @struct usbx_discovery_source
+ * @brief Where devices come from; every callback may block
+ */
+struct usbx_discovery_source {
+    const char *name;    /**< Source name for diagnostics */
+
+    /**
+     * @brief List the attached devices without opening them
+     * @param cls: Source closure
+     * @param devices: Receives a malloc'd array the catalog frees; each
+     *                 @c ref is owned by the catalog and given back to @c unref
+     * @return Number of devices, or a negative error code
+     */
+    int (*list)(void *cls, struct usbx_discovery_device **devices);
+
+    /**
+     * @brief Read the serial number of a listed device into @c info.serial
+     * @return USBX_SUCCESS, or a negative error code
+     */
+    int (*probe)(void *cls, struct usbx_discovery_device *device);
+
+    /** @brief Take another reference to a listed device */
+    void (*ref)(void *cls, void *ref);
+
+    /** @brief Drop a reference to a listed device */
+    void (*unref)(void *cls, void *ref);
+
+    void *cls;           /**< Passed to every callback */
+};
+
+/**
+ * @struct usbx_discovery_stats
+ * @brief Progress of the catalog
+ */
+struct usbx_discovery_stats {
+    unsigned int devices;        /**< Devices in the catalog */
+    unsigned int buses;          /**< Distinct buses among them */
+    unsigned int probed;         /**< Serial numbers read */
+    unsigned int failed;         /**< Devices whose serial number could not be read */
+    unsigned int probed_inline;  /**< Probes done by a lookup rather than a worker */
+    unsigned int scans;          /**< Times the device list was read */
+    int complete;                /**< Non-zero once every device was probed */
+    uint64_t list_us;            /**< Time from start to the first list */
+    uint64_t complete_us;        /**< Time from start to the last probe, 0 until then */
+};
+
+/**
+ * @brief Start cataloguing devices in the background; returns at once
+ * @param source: Device source, copied
+ * @param max_workers: Buses probed at once, 1 to USBX_DISCOVERY_MAX_WORKERS
+ * @return USBX_SUCCESS, USBX_ERROR_BUSY if already running,
+ *         USBX_ERROR_INVALID_PARAM or USBX_ERROR_NO_MEM
+ */
+int usbx_discovery_start(const struct usbx_discovery_source *source, unsigned int max_workers);
+
+/**
+ * @brief Stop the workers and drop the catalog; waits for running probes
+ */
+void usbx_discovery_stop(void);
+
+/**
+ * @brief Whether the catalog is running
+ * @return Non-zero after usbx_discovery_start() until usbx_discovery_stop()
+ */
+int usbx_discovery_running(void);
+
+/**
+ * @brief Find an attached device, waiting only for the devices that could match
+ * @param vid: idVendor, or -1 for any
+ * @param pid: idProduct, or -1 for any
+ * @param serial: Serial number, or NULL for any
+ * @param timeout_ms: Longest wait for the list and for matching probes
+ * @param device: Receives the device with a reference of its own; release
+ *                it with usbx_discovery_put()
+ * @return USBX_SUCCESS, USBX_ERROR_NOT_FOUND, USBX_ERROR_TIMEOUT if a
+ *         matching device was still being probed, or USBX_ERROR_NOT_SUPPORTED
+ *         if the catalog is not running
+ */
+int usbx_discovery_find(int vid, int pid, const char *serial, unsigned int timeout_ms,
+                        struct usbx_discovery_device *device);
+
+/**
+ * @brief Release a device returned by usbx_discovery_find()
+ * @param device: Device
+ */
+void usbx_discovery_put(struct usbx_discovery_device *device);
+
+/**
+ * @brief Read the progress counters
+ * @param stats: Receives them, zeroed if the catalog is not running
+ */
+void usbx_discovery_get_stats(struct usbx_discovery_stats *stats);
+
+#ifdef USE_DEPS
+#include <libusb-1.0/libusb.h>
+
+/**
+ * @brief Source listing the devices of a libusb context; @c ref is a libusb_device
+ * @param source: Receives the source
+ * @param ctx: libusb context
+ */
+void usbx_discovery_libusb_source(struct usbx_discovery_source *source, libusb_context *ctx);
+#endif
+
+#endif // USBX_DISCOVERY_H
@@ -0,0 +1,175 @@
+/**
+ * @file usbx_fault.h
+ * @brief Fault and latency injection in the device layer
+ *
+ * Rules attached to a device, for one endpoint or as the device default,
+ * make its transfers misbehave the way broken hardware does:
+ *
+ * - Latency: every completion is held back by @c latency_us plus a uniform
+ *   0..@c jitter_us, and @c tail_ppm completions per million by a further
+ *   @c tail_us, so that tail latency can be benchmarked. A transfer whose
+ *   timeout expires while it is held completes as timed out at its
+ *   deadline. Completions of one endpoint stay in submission order.
+ * - Errors: @c error_ppm transfers per million never reach the device and
+ *   complete with @c error_status (a stall by default) after the latency.
+ * - Disconnects: @c disconnect_ppm transfers per million, or an explicit
+ *   usbx_fault_disconnect(), unplug the device: transfers in flight
+ *   complete with USBX_TRANSFER_NO_DEVICE and submissions fail with
+ *   USBX_ERROR_NO_DEVICE until the rules are cleared.
+ *
+ * Injection is compiled in only with USBX_FAULT_INJECTION
+ * (make FAULT_INJECTION=1). Without it every function here returns
+ * USBX_ERROR_NOT_SUPPORTED and the transfer path has no hooks. With it, a
+ * device without rules pays nothing beyond the usbx_device::taps branch.
+ * Random draws come from one generator, so a seeded run is repeatable as
+ * long as transfers are submitted in the same order.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_FAULT_H
+#define USBX_FAULT_H
+
+#include <stdint.h>
+
+#include "usbx_backend.h"
+
+/** @brief Hook return value: the fault layer did not take the transfer */
+#define USBX_FAULT_PASS 1
+
+/** @brief usbx_fault_rule::endpoint of the rule applying to endpoints without their own */
+#define USBX_FAULT_ALL_ENDPOINTS (-1)
+
+/** @brief Rules per device: the default plus one per endpoint address */
+#define USBX_FAULT_MAX_RULES 33
+
+/**
+ * @struct usbx_fault_rule
+ * @brief Misbehaviour of one endpoint, or of a device's other endpoints
+ */
+struct usbx_fault_rule {
+    int endpoint;                /**< Endpoint address, or USBX_FAULT_ALL_ENDPOINTS */
+    unsigned int latency_us;     /**< Added to every completion */
+    unsigned int jitter_us;      /**< Uniform extra latency, 0..jitter_us */
+    unsigned int tail_ppm;       /**< Completions per million delayed by @c tail_us more */
+    unsigned int tail_us;        /**< Extra latency of the tail */
+    unsigned int error_ppm;      /**< Transfers per million failed without reaching the device */
+    int error_status;            /**< enum usbx_transfer_status of injected failures */
+    unsigned int disconnect_ppm; /**< Transfers per million that unplug the device */
+};
+
+/**
+ * @struct usbx_fault_stats
+ * @brief Counters of a device since its rules were first set
+ */
+struct usbx_fault_stats {
+    uint64_t transfers;          /**< Transfers submitted while rules were set */
+    uint64_t delayed;            /**< Completions held back */
+    uint64_t errors;             /**< Injected failures */
+    uint64_t timeouts;           /**< Completions turned into timeouts by injected latency */
+    uint64_t disconnects;        /**< Times the device was unplugged */
+    uint64_t rejected;           /**< Submissions refused while unplugged */
+    int disconnected;            /**< Non-zero while unplugged */
+};
+
+/**
+ * @brief Initialise a rule that injects nothing
+ * @param rule: Rule to fill in
+ * @param endpoint: Endpoint address, or USBX_FAULT_ALL_ENDPOINTS
+ */
+void usbx_fault_rule_init(struct usbx_fault_rule *rule, int endpoint);
+
+/**
+ * @brief Set or replace the rule of an endpoint (a rule injecting nothing removes it)
+ * @param dev: Device
+ * @param rule: Rule (copied)
+ * @return USBX_SUCCESS, USBX_ERROR_INVALID_PARAM, USBX_ERROR_NO_MEM or USBX_ERROR_NOT_SUPPORTED
+ */
+int usbx_fault_set_rule(struct usbx_device *dev, const struct usbx_fault_rule *rule);
+
+/**
+ * @brief Rules currently set on a device, the device default first
+ * @param dev: Device
+ * @param rules: Destination
+ * @param max: Entries available in @p rules
+ * @return Number of rules (at most @p max are written), or USBX_ERROR_NOT_SUPPORTED
+ */
+int usbx_fault_get_rules(struct usbx_device *dev, struct usbx_fault_rule *rules, int max);
+
+/**
+ * @brief Unplug a device now
+ * @param dev: Device
+ * @return USBX_SUCCESS, USBX_ERROR_NO_MEM or USBX_ERROR_NOT_SUPPORTED
+ */
+int usbx_fault_disconnect(struct usbx_device *dev);
+
+/**
+ * @brief Remove every rule, plug the device back in and reset its counters
+ *
+ * Completions still held back are delivered before this returns.
+ *
+ * @param dev: Device
+ * @return USBX_SUCCESS or USBX_ERROR_NOT_SUPPORTED
+ */
+int usbx_fault_clear(struct usbx_device *dev);
+
+/**
+ * @brief Read a device's counters
+ * @param dev: Device
+ * @param stats: Receives the counters (all zero for a device without rules)
+ * @return USBX_SUCCESS or USBX_ERROR_NOT_SUPPORTED
+ */
+int usbx_fault_get_stats(struct usbx_device *dev, struct usbx_fault_stats *stats);
+
+/**
+ * @brief Restart the random draws from a seed
+ * @param seed: Seed; 0 selects the built-in one
+ * @return USBX_SUCCESS or USBX_ERROR_NOT_SUPPORTED
+ */
+int usbx_fault_seed(uint64_t seed);
+
+/**
+ * @brief Name of a transfer status as used by the fault routes ("stall", "timeout", ...)
+ * @param status: enum usbx_transfer_status
+ * @return Static name
+ */
+const char *usbx_fault_status_name(int status);
+
+/**
+ * @brief Parse a transfer status name
+ * @param name: Name as returned by usbx_fault_status_name()
+ * @return enum usbx_transfer_status, or -1 if unknown
+ */
+int usbx_fault_parse_status(const char *name);
+
+#ifdef USBX_FAULT_INJECTION
+/**
+ * @brief Submission hook, called for devices with USBX_TAP_FAULT set
+ * @param xfer: Transfer being submitted
+ * @return USBX_FAULT_PASS to submit it to the backend, USBX_SUCCESS if an
+ *         injected failure took it, or USBX_ERROR_NO_DEVICE while unplugged
+ */
+int usbx_fault_submit(struct usbx_transfer *xfer);
+
+/**
+ * @brief Completion hook, called for devices with USBX_TAP_FAULT set
+ * @param xfer: Transfer the backend completed
+ * @return Non-zero if the completion is held back and delivered later
+ */
+int usbx_fault_complete(struct usbx_transfer *xfer);
+
+/**
+ * @brief Cancellation hook, called for devices with USBX_TAP_FAULT set
+ * @param xfer: Transfer to cancel
+ * @return USBX_FAULT_PASS to cancel it in the backend, or the cancellation result
+ */
+int usbx_fault_cancel(struct usbx_transfer *xfer);
+
+/**
+ * @brief Drop a device's rules before it is destroyed
+ * @param dev: Device
+ */
+void usbx_fault_release(struct usbx_device *dev);
+#endif
+
+#endif // USBX_FAULT_H
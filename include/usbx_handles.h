@@ -0,0 +1,128 @@
+/**
+ * @file usbx_handles.h
+ * @brief Process-wide table of open device handles
+ *
+ * Open devices are stored in a uthash table keyed by handle id and
+ * protected by a mutex. Lookups return a counted reference so a handle
+ * that is closed while a request still uses it stays valid until the
+ * last reference is released; only then are its services stopped and the
+ * device destroyed.
+ *
+ * Services that attach per-handle state (such as interrupt pollers) keep
+ * it in struct usbx_handle under the handle's own lock.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_HANDLES_H
+#define USBX_HANDLES_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "uthash.h"
+#include "usbx_backend.h"
+
+struct usbx_interrupt_poller;
+struct usbx_pubsub;
+struct usbx_iso_stream;
+struct usbx_msc;
+struct usbx_cdc;
+struct usbx_retry_table;
+struct usbx_breaker;
+struct usbx_latency_table;
+struct usbx_stats;
+struct usbx_sched;
+
+/** @brief Maximum length of a serial number string, including the terminator */
+#define USBX_HANDLE_SERIAL_MAX 128
+
+/**
+ * @struct usbx_device_info
+ * @brief Identity of the device behind a handle, used to select devices
+ */
+struct usbx_device_info {
+    uint16_t vid;                           /**< idVendor */
+    uint16_t pid;                           /**< idProduct */
+    char serial[USBX_HANDLE_SERIAL_MAX];    /**< iSerialNumber string, empty if none */
+    int bus;                                /**< Bus number, -1 if unknown */
+    int address;                            /**< Device address, -1 if unknown */
+};
+
+/** @brief Number of IN endpoints a handle can poll or publish (0x81-0x8f) */
+#define USBX_HANDLE_MAX_POLLERS 15
+
+/**
+ * @struct usbx_handle
+ * @brief One open device
+ */
+struct usbx_handle {
+    int handle_id;                  /**< Unique handle identifier (key) */
+    struct usbx_device *dev;        /**< Device; destroyed with the handle */
+    struct usbx_device_info info;   /**< Identity; immutable after usbx_handle_add() */
+    int refcount;                   /**< References, guarded by the table lock */
+    int closed;                     /**< Removed from the table, guarded by the table lock */
+    pthread_mutex_t lock;           /**< Guards the service state below */
+    struct usbx_interrupt_poller *pollers[USBX_HANDLE_MAX_POLLERS];  /**< By endpoint number - 1 */
+    int poller_users[USBX_HANDLE_MAX_POLLERS];  /**< Requests and streams using each poller */
+    struct usbx_pubsub *pubsubs[USBX_HANDLE_MAX_POLLERS];  /**< Shared bulk IN streams */
+    int pubsub_users[USBX_HANDLE_MAX_POLLERS];  /**< Requests and streams using each pubsub */
+    struct usbx_iso_stream *iso_streams[USBX_HANDLE_MAX_POLLERS];  /**< Iso IN, one reader each */
+    struct usbx_iso_stream *iso_out_streams[USBX_HANDLE_MAX_POLLERS];  /**< Iso OUT, one writer each */
+    int dfu_active;                 /**< A firmware download is running */
+    struct usbx_msc *msc;           /**< Mass-storage unit, opened on first block access */
+    struct usbx_cdc *cdc;           /**< Serial channel, opened by POST /handles/{id}/serial */
+    struct usbx_retry_table *retry; /**< Stall and timeout retry policies (own lock) */
+    struct usbx_breaker *breaker;   /**< Circuit breaker fed by the device (own lock) */
+    struct usbx_latency_table *latency;  /**< Latency estimates and adaptive timeouts (own lock) */
+    struct usbx_stats *stats;       /**< Transfer counters of the device (atomic) */
+    struct usbx_sched *sched;       /**< Fair sharing between clients (own lock) */
+    UT_hash_handle hh;              /**< uthash handle - makes structure hashable */
+};
+
+/**
+ * @brief Add a device to the table
+ * @param dev: Device; ownership passes to the table
+ * @param info: Device identity (copied), or NULL if unknown
+ * @return New handle id (>= 1), or USBX_ERROR_NO_MEM
+ */
+int usbx_handle_add(struct usbx_device *dev, const struct usbx_device_info *info);
+
+/**
+ * @brief Look up an open handle and take a reference
+ * @param handle_id: Handle id
+ * @return Handle (release with usbx_handle_put()), or NULL if unknown or closed
+ */
+struct usbx_handle *usbx_handle_get(int handle_id);
+
+/**
+ * @brief Release a reference taken by usbx_handle_get()
+ * @param handle: Handle; NULL is ignored
+ */
+void usbx_handle_put(struct usbx_handle *handle);
+
+/**
+ * @brief Remove a handle from the table and stop its services
+ *
+ * Streams still attached to the handle end; the handle and its device are
+ * destroyed once the last reference is released.
+ *
+ * @param handle_id: Handle id
+ * @return USBX_SUCCESS or USBX_ERROR_NOT_FOUND
+ */
+int usbx_handle_remove(int handle_id);
+
+/**
+ * @brief Ids of all open handles in ascending order
+ * @param ids: Destination array
+ * @param max: Entries available in @p ids
+ * @return Number of open handles (may exceed @p max; only @p max ids are written)
+ */
+int usbx_handle_list(int *ids, int max);
+
+/**
+ * @brief Remove every handle (used at shutdown)
+ */
+void usbx_handle_remove_all(void);
+
+#endif // USBX_HANDLES_H
@@ -0,0 +1,82 @@
+/**
+ * @file usbx_handoff.h
+ * @brief Passing listening sockets to a successor process
+ *
+ * For a restart without downtime the running process listens on a unix
+ * socket, starts its successor and sends it its listening sockets there
+ * (SCM_RIGHTS). The successor starts serving on them and answers that it
+ * is ready; only then does the predecessor stop accepting and drain. Both
+ * processes accept from the same socket while they overlap, so clients
+ * never see a refused connection.
+ *
+ * If the successor does not answer in time the predecessor keeps serving
+ * as before.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_HANDOFF_H
+#define USBX_HANDOFF_H
+
+/** @brief Most sockets passed in one handoff */
+#define USBX_HANDOFF_MAX_FDS 16
+
+/** @brief Environment variable naming the handoff socket of a successor */
+#define USBX_HANDOFF_ENV "USBX_HANDOFF_SOCKET"
+
+/**
+ * @struct usbx_handoff
+ * @brief Predecessor side of a handoff
+ */
+struct usbx_handoff {
+    int listener;        /**< Unix socket the successor connects to */
+    char path[108];      /**< Its path, removed by usbx_handoff_close() */
+};
+
+/**
+ * @brief Listen for the successor on a unix socket only this user can connect to
+ * @param handoff: Receives the listener
+ * @param path: Socket path; an existing socket there is replaced
+ * @return USBX_SUCCESS, USBX_ERROR_INVALID_PARAM if the path is too long, or USBX_ERROR_IO
+ */
+int usbx_handoff_listen(struct usbx_handoff *handoff, const char *path);
+
+/**
+ * @brief Send sockets to the successor and wait until it serves on them
+ * @param handoff: Listening handoff
+ * @param fds: Sockets to pass; they stay open in this process
+ * @param num_fds: Entries in @p fds, 1 to USBX_HANDOFF_MAX_FDS
+ * @param timeout_ms: Longest wait for the successor to connect and to answer
+ * @return USBX_SUCCESS once the successor is ready, USBX_ERROR_TIMEOUT,
+ *         USBX_ERROR_INVALID_PARAM, or USBX_ERROR_IO if it hung up
+ */
+int usbx_handoff_send(struct usbx_handoff *handoff, const int *fds, int num_fds,
+                      unsigned int timeout_ms);
+
+/**
+ * @brief Close the listener and remove its path
+ * @param handoff: Handoff
+ */
+void usbx_handoff_close(struct usbx_handoff *handoff);
+
+/**
+ * @brief Successor side: receive the predecessor's sockets
+ * @param path: Socket path, usually from USBX_HANDOFF_ENV
+ * @param fds: Receives the sockets
+ * @param max_fds: Capacity of @p fds
+ * @param timeout_ms: Longest wait for the sockets
+ * @param conn: Receives the connection to answer with usbx_handoff_ready()
+ * @return Number of sockets received, or USBX_ERROR_IO, USBX_ERROR_TIMEOUT
+ *         or USBX_ERROR_INVALID_PARAM
+ */
+int usbx_handoff_receive(const char *path, int *fds, int max_fds, unsigned int timeout_ms,
+                         int *conn);
+
+/**
+ * @brief Successor side: tell the predecessor it may stop accepting; closes @p conn
+ * @param conn: Connection from usbx_handoff_receive()
+ * @return USBX_SUCCESS, or USBX_ERROR_IO if the predecessor is gone
+ */
+int usbx_handoff_ready(int conn);
+
+#endif // USBX_HANDOFF_H
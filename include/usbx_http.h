@@ -0,0 +1,345 @@
+/**
+ * @file usbx_http.h
+ * @brief Transport-independent HTTP request router
+ *
+ * Handlers see a plain request structure and fill in a response; they never
+ * touch the HTTP server library. The libmicrohttpd front end (http_mhd.c)
+ * translates connections into these structures, and unit tests call
+ * usbx_http_dispatch() directly.
+ *
+ * Route patterns are literal paths in which a segment written as @c {name}
+ * matches any single segment, e.g. "/handles/{id}/stats". Matched values
+ * are available through usbx_http_param().
+ *
+ * A response either carries a complete body or a streaming reader that the
+ * front end calls whenever the client can take more data, which is how
+ * server-sent event streams and long downloads are served. Likewise a
+ * request body is normally complete before dispatch, but a route
+ * registered with usbx_http_route_streaming() may be dispatched while its
+ * body is still arriving and reads it with usbx_http_read_body().
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_HTTP_H
+#define USBX_HTTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/** @brief Maximum number of path parameters in a route */
+#define USBX_HTTP_MAX_PARAMS 4
+
+/** @brief Maximum number of extra response headers */
+#define USBX_HTTP_MAX_HEADERS 8
+
+/** @brief Streaming reader return value: the body is complete */
+#define USBX_HTTP_END_OF_STREAM ((ssize_t)-1)
+
+/** @brief Streaming reader return value: abort the response */
+#define USBX_HTTP_STREAM_ERROR ((ssize_t)-2)
+
+/**
+ * @struct usbx_http_pair
+ * @brief Name/value pair for query arguments, headers and path parameters
+ */
+struct usbx_http_pair {
+    const char *name;    /**< Name (case-insensitive for headers) */
+    const char *value;   /**< Value */
+};
+
+/**
+ * @brief Producer of a request body that is still arriving
+ * @param cls: Closure given with the request
+ * @param buf: Destination
+ * @param max: Destination size
+ * @return Bytes read, waiting until some arrive; 0 at the end of the body, or a
+ *         negative usbx_error if the client went away
+ */
+typedef long (*usbx_http_body_source)(void *cls, void *buf, size_t max);
+
+/**
+ * @struct usbx_http_request
+ * @brief Request as seen by handlers; all strings are owned by the caller
+ */
+struct usbx_http_request {
+    const char *method;                       /**< "GET", "POST", ... */
+    const char *path;                         /**< Path without query string */
+    const char *client_id;                    /**< Client identity (API key or peer address) */
+    const char *address;                      /**< Peer address, NULL if unknown */
+    const struct usbx_http_pair *args;        /**< Query arguments */
+    int num_args;                             /**< Entries in @c args */
+    const struct usbx_http_pair *headers;     /**< Request headers */
+    int num_headers;                          /**< Entries in @c headers */
+    const unsigned char *body;                /**< Request body, NULL if none */
+    size_t body_length;                       /**< Body size in bytes */
+    usbx_http_body_source body_source;        /**< Body still arriving, or NULL if @c body is all */
+    void *body_cls;                           /**< Closure for @c body_source */
+    struct usbx_http_pair params[USBX_HTTP_MAX_PARAMS];  /**< Path parameters, set by dispatch */
+    int num_params;                           /**< Entries in @c params */
+    char param_storage[256];                  /**< Backing store for @c params values */
+};
+
+/**
+ * @brief Streaming body producer
+ *
+ * Called by the front end with the number of body bytes already sent. It
+ * may block briefly (e.g. waiting for the next event) but should return 0
+ * after a bounded time so the connection can be checked for liveness.
+ *
+ * @param cls: Closure given with the response
+ * @param pos: Body bytes already produced
+ * @param buf: Destination
+ * @param max: Destination size
+ * @return Bytes written, 0 for "nothing yet", USBX_HTTP_END_OF_STREAM or USBX_HTTP_STREAM_ERROR
+ */
+typedef ssize_t (*usbx_http_reader)(void *cls, uint64_t pos, char *buf, size_t max);
+
+/**
+ * @brief Release a streaming reader's closure when the response is done
+ * @param cls: Closure given with the response
+ */
+typedef void (*usbx_http_reader_free)(void *cls);
+
+/**
+ * @struct usbx_http_response
+ * @brief Response filled in by handlers
+ */
+struct usbx_http_response {
+    int status;                                /**< HTTP status code */
+    const char *content_type;                  /**< Static string, e.g. "application/json" */
+    struct usbx_http_pair headers[USBX_HTTP_MAX_HEADERS];  /**< Extra headers (owned copies) */
+    int num_headers;                           /**< Entries in @c headers */
+    char *body;                                /**< Complete body (malloc'd), or NULL */
+    size_t body_length;                        /**< Body size in bytes */
+    usbx_http_reader reader;                   /**< Streaming producer, or NULL */
+    void *reader_cls;                          /**< Closure for @c reader */
+    usbx_http_reader_free reader_free;         /**< Closure destructor, or NULL */
+};
+
+/**
+ * @brief Route handler
+ * @param cls: Closure given at registration
+ * @param req: Request with path parameters filled in
+ * @param resp: Response to fill in (status defaults to 200)
+ */
+typedef void (*usbx_http_handler)(void *cls, const struct usbx_http_request *req,
+                                  struct usbx_http_response *resp);
+
+struct usbx_http_router;
+
+/**
+ * @brief Create an empty router
+ * @return New router, or NULL on allocation failure
+ */
+struct usbx_http_router *usbx_http_router_create(void);
+
+/**
+ * @brief Destroy a router
+ * @param router: Router; NULL is ignored
+ */
+void usbx_http_router_destroy(struct usbx_http_router *router);
+
+/**
+ * @brief Register a route
+ * @param router: Router
+ * @param method: HTTP method
+ * @param pattern: Path pattern with optional {name} segments; must stay valid
+ * @param handler: Handler to call
+ * @param cls: Closure passed to @p handler
+ * @return 0 on success, -1 on allocation failure or too many parameters
+ */
+int usbx_http_route(struct usbx_http_router *router, const char *method, const char *pattern,
+                    usbx_http_handler handler, void *cls);
+
+/**
+ * @brief Register a route whose handler reads the body as it arrives
+ *
+ * The front end may dispatch such a request as soon as its headers are
+ * in, with @c body NULL and @c body_source set, so the body never has to
+ * fit in memory. The handler must read it with usbx_http_read_body(),
+ * which also serves complete bodies, e.g. from unit tests.
+ *
+ * @param router: Router
+ * @param method: HTTP method
+ * @param pattern: Path pattern as for usbx_http_route()
+ * @param handler: Handler to call
+ * @param cls: Closure passed to @p handler
+ * @return 0 on success, -1 on allocation failure or too many parameters
+ */
+int usbx_http_route_streaming(struct usbx_http_router *router, const char *method,
+                              const char *pattern, usbx_http_handler handler, void *cls);
+
+/**
+ * @brief Whether a request would be routed to a usbx_http_route_streaming() route
+ * @param router: Router
+ * @param method: HTTP method
+ * @param path: Path without query string
+ * @return 1 if so, 0 otherwise
+ */
+int usbx_http_route_streams_body(struct usbx_http_router *router, const char *method,
+                                 const char *path);
+
+/**
+ * @brief Route a request to its handler
+ *
+ * Unknown paths produce 404, known paths with another method 405.
+ *
+ * @param router: Router
+ * @param req: Request; its path parameters are filled in
+ * @param resp: Initialised by this call, then filled in by the handler
+ */
+void usbx_http_dispatch(struct usbx_http_router *router, struct usbx_http_request *req,
+                        struct usbx_http_response *resp);
+
+/**
+ * @brief Release everything a response owns, including a streaming closure
+ * @param resp: Response
+ */
+void usbx_http_response_free(struct usbx_http_response *resp);
+
+/**
+ * @brief Look up a query argument
+ * @param req: Request
+ * @param name: Argument name
+ * @return Value, or NULL if absent
+ */
+const char *usbx_http_arg(const struct usbx_http_request *req, const char *name);
+
+/**
+ * @brief Look up a query argument as an integer (decimal or 0x-prefixed hex)
+ * @param req: Request
+ * @param name: Argument name
+ * @param fallback: Value returned if the argument is absent or malformed
+ * @return Parsed value or @p fallback
+ */
+long usbx_http_arg_long(const struct usbx_http_request *req, const char *name, long fallback);
+
+/**
+ * @brief Look up a request header (case-insensitive)
+ * @param req: Request
+ * @param name: Header name
+ * @return Value, or NULL if absent
+ */
+const char *usbx_http_header(const struct usbx_http_request *req, const char *name);
+
+/**
+ * @brief Read the next part of the request body, complete or still arriving
+ * @param req: Request
+ * @param pos: Body bytes the handler has read so far
+ * @param buf: Destination
+ * @param max: Destination size
+ * @return Bytes read, 0 at the end of the body, or a negative usbx_error if the
+ *         client went away
+ */
+long usbx_http_read_body(const struct usbx_http_request *req, uint64_t pos, void *buf,
+                         size_t max);
+
+/**
+ * @brief Look up a path parameter
+ * @param req: Request after dispatch
+ * @param name: Parameter name from the route pattern
+ * @return Value, or NULL if absent
+ */
+const char *usbx_http_param(const struct usbx_http_request *req, const char *name);
+
+/**
+ * @brief Add a response header; the strings are copied
+ * @param resp: Response
+ * @param name: Header name
+ * @param value: Header value
+ * @return 0 on success, -1 if the header table is full or allocation failed
+ */
+int usbx_http_add_header(struct usbx_http_response *resp, const char *name, const char *value);
+
+/**
+ * @brief Set a complete JSON body, taking ownership of @p body
+ * @param resp: Response
+ * @param status: HTTP status code
+ * @param body: malloc'd JSON text; NULL turns the response into a 500
+ * @param length: Body length
+ */
+void usbx_http_set_json(struct usbx_http_response *resp, int status, char *body, size_t length);
+
+struct usbx_buf;
+
+/**
+ * @brief Set a complete JSON body from a buffer, taking over its contents
+ * @param resp: Response
+ * @param status: HTTP status code
+ * @param buf: Buffer with the JSON text; reset by this call
+ */
+void usbx_http_set_json_buf(struct usbx_http_response *resp, int status, struct usbx_buf *buf);
+
+/**
+ * @brief Set a JSON error body {"error": message, "code": code}
+ * @param resp: Response
+ * @param status: HTTP status code
+ * @param message: Human-readable message
+ * @param code: usbX error code, included when non-zero
+ */
+void usbx_http_set_error(struct usbx_http_response *resp, int status, const char *message,
+                         int code);
+
+/**
+ * @brief Map a usbX error code to the HTTP status reported to clients
+ * @param error: enum usbx_error value
+ * @return HTTP status code
+ */
+int usbx_http_status_for_error(int error);
+
+/**
+ * @brief Attach a streaming body
+ * @param resp: Response
+ * @param content_type: Static content type string
+ * @param reader: Producer callback
+ * @param cls: Closure for @p reader
+ * @param reader_free: Closure destructor, or NULL
+ */
+void usbx_http_set_reader(struct usbx_http_response *resp, const char *content_type,
+                          usbx_http_reader reader, void *cls, usbx_http_reader_free reader_free);
+
+#ifdef USE_DEPS
+/**
+ * @brief Start the libmicrohttpd front end
+ * @param router: Router serving all requests
+ * @param port: TCP port to listen on
+ * @return 0 on success, -1 if the daemon could not be started
+ */
+int usbx_http_server_start(struct usbx_http_router *router, uint16_t port);
+
+/**
+ * @brief Start the libmicrohttpd front end on a socket that is already listening
+ * @param router: Router serving all requests
+ * @param listen_fd: Bound, listening TCP socket, e.g. inherited from a predecessor;
+ *                   closed by usbx_http_server_stop()
+ * @return 0 on success, -1 if the daemon could not be started
+ */
+int usbx_http_server_start_socket(struct usbx_http_router *router, int listen_fd);
+
+/**
+ * @brief Listening socket of the running front end
+ * @return Socket, or -1 if no server is running or it stopped accepting
+ */
+int usbx_http_server_listen_fd(void);
+
+/**
+ * @brief Stop accepting connections; open connections are still served
+ * @return The listening socket, now owned by the caller, or -1
+ */
+int usbx_http_server_quiesce(void);
+
+/**
+ * @brief Number of open connections
+ * @return Connections, 0 if no server is running
+ */
+unsigned int usbx_http_server_connections(void);
+
+/**
+ * @brief Stop the libmicrohttpd front end
+ */
+void usbx_http_server_stop(void);
+#endif
+
+#endif // USBX_HTTP_H
@@ -0,0 +1,183 @@
+/**
+ * @file usbx_interrupt.h
+ * @brief Continuous interrupt IN polling with broadcast to many subscribers
+ *
+ * A poller keeps interrupt transfers permanently submitted on one endpoint
+ * and appends every report it receives to a fixed-size broadcast ring.
+ * Subscribers read the ring independently through their own cursor, so a
+ * report is read from the device once no matter how many clients consume
+ * it, and a slow subscriber never holds back the poller or other clients.
+ *
+ * A subscriber that falls more than the ring size behind is moved forward
+ * to the oldest retained report; the skipped reports are counted as
+ * dropped for that subscriber only.
+ *
+ * With an idle timeout, a subscriber that has not read for that long and
+ * has no reader waiting is removed, and polling stops with
+ * USBX_ERROR_TIMEOUT once the last subscriber has been removed this way,
+ * so clients that vanish without unsubscribing do not keep the endpoint
+ * busy.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_INTERRUPT_H
+#define USBX_INTERRUPT_H
+
+#include <stdint.h>
+
+#include "usbx_backend.h"
+
+/** @brief Largest report a poller can carry */
+#define USBX_INTERRUPT_MAX_REPORT 4096
+
+/** @brief Built-in default of reports retained in the ring (interrupt_slots, usbx_config.h) */
+#define USBX_INTERRUPT_DEFAULT_SLOTS 256
+
+/** @brief Default number of transfers kept submitted */
+#define USBX_INTERRUPT_DEFAULT_IN_FLIGHT 2
+
+/**
+ * @struct usbx_interrupt_options
+ * @brief Tuning knobs for a poller
+ */
+struct usbx_interrupt_options {
+    int slots;                  /**< Reports retained for subscribers */
+    int transfers_in_flight;    /**< Transfers kept submitted */
+    int report_size;            /**< Transfer length, 0 = endpoint max packet size */
+    unsigned int idle_timeout_ms;  /**< Drop subscribers that do not read for this long, 0 never */
+};
+
+/**
+ * @struct usbx_interrupt_report
+ * @brief One report as delivered to a subscriber
+ */
+struct usbx_interrupt_report {
+    uint64_t sequence;          /**< Position in the endpoint's report stream */
+    uint64_t timestamp_us;      /**< Completion time, monotonic microseconds */
+    int length;                 /**< Bytes in @c data */
+    unsigned char data[USBX_INTERRUPT_MAX_REPORT];  /**< Report payload */
+};
+
+/**
+ * @struct usbx_interrupt_stats
+ * @brief Poller counters
+ */
+struct usbx_interrupt_stats {
+    uint64_t reports;           /**< Reports received */
+    uint64_t bytes;             /**< Report bytes received */
+    uint64_t timeouts;          /**< Transfers that timed out and were resubmitted */
+    int subscribers;            /**< Current subscribers */
+    int running;                /**< Non-zero while transfers are being submitted */
+    int last_error;             /**< Error that stopped polling, USBX_SUCCESS if none */
+};
+
+/**
+ * @struct usbx_interrupt_subscriber_stats
+ * @brief Per-subscriber counters
+ */
+struct usbx_interrupt_subscriber_stats {
+    int id;                     /**< Subscriber id */
+    uint64_t delivered;         /**< Reports handed to this subscriber */
+    uint64_t dropped;           /**< Reports overwritten before this subscriber read them */
+    uint64_t lag;               /**< Reports currently waiting for this subscriber */
+};
+
+struct usbx_interrupt_poller;
+
+/**
+ * @brief Fill options with the defaults; slots come from the current config snapshot
+ * @param opts: Options to initialise
+ */
+void usbx_interrupt_options_init(struct usbx_interrupt_options *opts);
+
+/**
+ * @brief Start polling an interrupt IN endpoint
+ * @param dev: Device
+ * @param endpoint: Interrupt IN endpoint address
+ * @param opts: Tuning options, NULL for defaults
+ * @param error: Receives the error code on failure (may be NULL)
+ * @return New poller, or NULL on failure
+ */
+struct usbx_interrupt_poller *usbx_interrupt_poller_start(struct usbx_device *dev,
+                                                          unsigned char endpoint,
+                                                          const struct usbx_interrupt_options *opts,
+                                                          int *error);
+
+/**
+ * @brief Stop polling: cancel the transfers and wake all readers
+ *
+ * Retained reports can still be read; afterwards readers get
+ * USBX_ERROR_INTERRUPTED. Waits until no transfer is in flight.
+ *
+ * @param poller: Poller
+ */
+void usbx_interrupt_poller_stop(struct usbx_interrupt_poller *poller);
+
+/**
+ * @brief Stop polling if needed and release the poller
+ *
+ * Waits until no reader is inside usbx_interrupt_read().
+ *
+ * @param poller: Poller; NULL is ignored
+ */
+void usbx_interrupt_poller_destroy(struct usbx_interrupt_poller *poller);
+
+/**
+ * @brief Snapshot of the poller counters
+ * @param poller: Poller
+ * @param stats: Receives the counters
+ */
+void usbx_interrupt_get_stats(struct usbx_interrupt_poller *poller,
+                              struct usbx_interrupt_stats *stats);
+
+/**
+ * @brief Add a subscriber
+ * @param poller: Poller
+ * @param backlog: Number of already retained reports to deliver first, 0 for new reports only
+ * @return Subscriber id (> 0, never reused by any poller), or USBX_ERROR_NO_MEM
+ */
+int usbx_interrupt_subscribe(struct usbx_interrupt_poller *poller, int backlog);
+
+/**
+ * @brief Remove a subscriber; a reader blocked on it returns USBX_ERROR_NOT_FOUND
+ * @param poller: Poller
+ * @param subscriber: Subscriber id
+ * @return Remaining subscriber count, or USBX_ERROR_NOT_FOUND
+ */
+int usbx_interrupt_unsubscribe(struct usbx_interrupt_poller *poller, int subscriber);
+
+/**
+ * @brief Take the subscriber's next report
+ * @param poller: Poller
+ * @param subscriber: Subscriber id
+ * @param report: Receives the report
+ * @param timeout_ms: 0 returns immediately, negative waits forever
+ * @return 1 if a report was delivered, 0 on timeout, USBX_ERROR_NOT_FOUND for an
+ *         unknown subscriber, or the error that stopped polling once the ring is drained
+ *         (USBX_ERROR_INTERRUPTED when the poller was stopped)
+ */
+int usbx_interrupt_read(struct usbx_interrupt_poller *poller, int subscriber,
+                        struct usbx_interrupt_report *report, int timeout_ms);
+
+/**
+ * @brief Counters of one subscriber
+ * @param poller: Poller
+ * @param subscriber: Subscriber id
+ * @param stats: Receives the counters
+ * @return USBX_SUCCESS or USBX_ERROR_NOT_FOUND
+ */
+int usbx_interrupt_subscriber_stats(struct usbx_interrupt_poller *poller, int subscriber,
+                                    struct usbx_interrupt_subscriber_stats *stats);
+
+/**
+ * @brief Counters of all subscribers
+ * @param poller: Poller
+ * @param stats: Destination array
+ * @param max: Entries available in @p stats
+ * @return Number of subscribers (may exceed @p max; only @p max entries are written)
+ */
+int usbx_interrupt_list_subscribers(struct usbx_interrupt_poller *poller,
+                                    struct usbx_interrupt_subscriber_stats *stats, int max);
+
+#endif // USBX_INTERRUPT_H
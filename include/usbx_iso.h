@@ -0,0 +1,229 @@
+/**
+ * @file usbx_iso.h
+ * @brief Isochronous streaming engine and packet-descriptor frame format
+ *
+ * An isochronous stream keeps a fixed number of transfers in flight on one
+ * endpoint and resubmits each transfer from its completion callback. A
+ * transfer that is cancelled from outside the stream or fails to resubmit
+ * leaves the pipeline one shorter; the counters record it, and the stream
+ * stops once no transfer is left.
+ *
+ * IN streams encode every completed transfer as one frame of the compact
+ * binary format below and queue it for the reader. OUT streams take raw
+ * payload bytes from the writer and cut them into packets.
+ *
+ * Frame format (all integers little-endian):
+ *
+ *     offset  size  field
+ *          0     4  magic "UXI1"
+ *          4     4  sequence number of the transfer
+ *          8     8  completion timestamp, monotonic microseconds
+ *         16     2  number of packets (n)
+ *         18     2  flags (USBX_ISO_FRAME_*)
+ *         20     4  payload length in bytes
+ *         24   4*n  packet descriptors: u16 actual_length, u8 status, u8 reserved
+ *     24+4*n     -  payload: the packets' actual bytes back to back
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_ISO_H
+#define USBX_ISO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usbx_backend.h"
+
+/** @brief Frame magic, "UXI1" in little-endian byte order */
+#define USBX_ISO_FRAME_MAGIC 0x31495855U
+
+/** @brief Size of the fixed frame header */
+#define USBX_ISO_FRAME_HEADER_SIZE 24
+
+/** @brief Size of one packet descriptor in a frame */
+#define USBX_ISO_PACKET_DESC_SIZE 4
+
+/** @brief Frame flag: the pipeline drained before this transfer, data may be missing */
+#define USBX_ISO_FRAME_GAP (1U << 0)
+
+/** @brief Default packets per transfer */
+#define USBX_ISO_DEFAULT_PACKETS 8
+
+/** @brief Default transfers kept in flight */
+#define USBX_ISO_DEFAULT_IN_FLIGHT 4
+
+/** @brief Default capacity of the stream buffer in bytes */
+#define USBX_ISO_DEFAULT_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * @struct usbx_iso_options
+ * @brief Tuning knobs for an isochronous stream
+ */
+struct usbx_iso_options {
+    int packets_per_transfer;   /**< Packets in each transfer */
+    int transfers_in_flight;    /**< Transfers kept submitted */
+    int packet_size;            /**< Bytes per packet, 0 = endpoint maximum */
+    size_t buffer_size;         /**< Stream buffer between engine and client */
+};
+
+/**
+ * @struct usbx_iso_counters
+ * @brief Running counters of an isochronous stream
+ */
+struct usbx_iso_counters {
+    uint64_t transfers;         /**< Completed transfers */
+    uint64_t packets;           /**< Completed packets */
+    uint64_t bytes;             /**< Payload bytes moved */
+    uint64_t packets_lost;      /**< Packets that completed with an error status */
+    uint64_t underruns;         /**< OUT packets sent empty because the writer fell behind */
+    uint64_t overruns;          /**< IN packets dropped because the reader fell behind */
+    uint64_t pipeline_drains;   /**< Completions that left no transfer in flight */
+    uint64_t cancelled;         /**< Transfers cancelled while running, not resubmitted */
+    uint64_t resubmit_failures; /**< Resubmissions that failed, each shrinking the pipeline */
+    int in_flight;              /**< Transfers submitted when the snapshot was taken */
+};
+
+/**
+ * @struct usbx_iso_frame
+ * @brief Decoded view of one frame; pointers reference the input buffer
+ */
+struct usbx_iso_frame {
+    uint32_t sequence;                  /**< Transfer sequence number */
+    uint64_t timestamp_us;              /**< Completion time */
+    uint16_t num_packets;               /**< Packet descriptors in the frame */
+    uint16_t flags;                     /**< USBX_ISO_FRAME_* flags */
+    uint32_t data_length;               /**< Payload bytes */
+    const unsigned char *descriptors;   /**< Raw packet descriptors */
+    const unsigned char *data;          /**< Payload */
+};
+
+struct usbx_iso_stream;
+
+/**
+ * @brief Fill options with the defaults
+ * @param opts: Options to initialise
+ */
+void usbx_iso_options_init(struct usbx_iso_options *opts);
+
+/**
+ * @brief Encode a completed transfer as a frame
+ * @param out: Destination with room for usbx_iso_frame_size() bytes
+ * @param sequence: Transfer sequence number
+ * @param timestamp_us: Completion timestamp
+ * @param flags: USBX_ISO_FRAME_* flags
+ * @param xfer: Completed isochronous transfer
+ * @return Number of bytes written
+ */
+size_t usbx_iso_encode_frame(unsigned char *out, uint32_t sequence, uint64_t timestamp_us,
+                             uint16_t flags, const struct usbx_transfer *xfer);
+
+/**
+ * @brief Upper bound of the encoded size of a transfer
+ * @param num_packets: Packets in the transfer
+ * @param buffer_length: Transfer buffer length
+ * @return Bytes needed by usbx_iso_encode_frame()
+ */
+size_t usbx_iso_frame_size(int num_packets, size_t buffer_length);
+
+/**
+ * @brief Decode the frame at the start of a byte stream
+ * @param in: Stream bytes
+ * @param length: Bytes available
+ * @param frame: Receives the decoded view
+ * @return Frame size in bytes, 0 if more input is needed, -1 if the data is not a frame
+ */
+long usbx_iso_decode_frame(const unsigned char *in, size_t length, struct usbx_iso_frame *frame);
+
+/**
+ * @brief Read one packet descriptor of a decoded frame
+ * @param frame: Decoded frame
+ * @param index: Packet index, below frame->num_packets
+ * @param actual_length: Receives the packet's byte count
+ * @param status: Receives the packet's enum usbx_transfer_status
+ */
+void usbx_iso_frame_packet(const struct usbx_iso_frame *frame, int index,
+                           unsigned int *actual_length, int *status);
+
+/**
+ * @brief Start streaming on an isochronous endpoint
+ * @param dev: Device
+ * @param endpoint: Isochronous endpoint address; direction selects IN or OUT mode
+ * @param opts: Tuning options, NULL for defaults
+ * @param error: Receives the error code on failure (may be NULL)
+ * @return New stream, or NULL on failure
+ */
+struct usbx_iso_stream *usbx_iso_stream_start(struct usbx_device *dev, unsigned char endpoint,
+                                              const struct usbx_iso_options *opts, int *error);
+
+/**
+ * @brief Read encoded frames from an IN stream
+ * @param stream: IN stream
+ * @param buffer: Destination
+ * @param max: Destination size
+ * @param timeout_ms: 0 returns immediately, negative waits forever
+ * @return Bytes read; 0 on timeout or once the stream has stopped and drained
+ *         (usbx_iso_stream_error() then tells whether it died on its own)
+ */
+size_t usbx_iso_stream_read(struct usbx_iso_stream *stream, void *buffer, size_t max,
+                            int timeout_ms);
+
+/**
+ * @brief Queue payload bytes on an OUT stream
+ * @param stream: OUT stream
+ * @param data: Payload
+ * @param length: Payload size
+ * @param timeout_ms: 0 returns immediately, negative waits forever
+ * @return Bytes queued
+ */
+size_t usbx_iso_stream_write(struct usbx_iso_stream *stream, const void *data, size_t length,
+                             int timeout_ms);
+
+/**
+ * @brief Payload bytes queued on an OUT stream that no transfer has taken yet
+ * @param stream: OUT stream
+ * @return Bytes still waiting in the stream buffer
+ */
+size_t usbx_iso_stream_queued(struct usbx_iso_stream *stream);
+
+/**
+ * @brief Why the stream stopped by itself
+ * @param stream: Stream
+ * @return USBX_SUCCESS while it runs or if it was stopped, USBX_ERROR_NO_DEVICE
+ *         after a disconnect, USBX_ERROR_INTERRUPTED if the last transfer was
+ *         cancelled from outside, or the error of the resubmission that left
+ *         no transfer in flight
+ */
+int usbx_iso_stream_error(struct usbx_iso_stream *stream);
+
+/**
+ * @brief Whether an IN stream has stopped and every queued frame was read
+ * @param stream: IN stream
+ * @return 1 once usbx_iso_stream_read() can return no more data, 0 otherwise
+ */
+int usbx_iso_stream_finished(struct usbx_iso_stream *stream);
+
+/**
+ * @brief Snapshot of the stream counters
+ * @param stream: Stream
+ * @param counters: Receives the counters
+ */
+void usbx_iso_stream_get_counters(struct usbx_iso_stream *stream,
+                                  struct usbx_iso_counters *counters);
+
+/**
+ * @brief Cancel all transfers and wait until none is in flight
+ *
+ * Already queued IN frames can still be read afterwards.
+ *
+ * @param stream: Stream
+ */
+void usbx_iso_stream_stop(struct usbx_iso_stream *stream);
+
+/**
+ * @brief Stop the stream if needed and release it
+ * @param stream: Stream; NULL is ignored
+ */
+void usbx_iso_stream_destroy(struct usbx_iso_stream *stream);
+
+#endif // USBX_ISO_H
@@ -0,0 +1,110 @@
+/**
+ * @file usbx_json.h
+ * @brief Minimal JSON reader for request bodies
+ *
+ * Parses a complete document into a tree of nodes. Responses are written
+ * with usbx_buf, so only reading is provided. The reader works in minimal
+ * builds, which keeps request handlers testable without json-c.
+ *
+ * Integers may also be given as strings ("0x81"), since JSON has no hex
+ * literals and USB fields are conventionally written in hex.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_JSON_H
+#define USBX_JSON_H
+
+#include <stddef.h>
+
+/** @brief Deepest nesting accepted by the parser */
+#define USBX_JSON_MAX_DEPTH 32
+
+/**
+ * @enum usbx_json_type
+ * @brief Node types
+ */
+enum usbx_json_type {
+    USBX_JSON_NULL = 0,
+    USBX_JSON_BOOL,
+    USBX_JSON_NUMBER,
+    USBX_JSON_STRING,
+    USBX_JSON_ARRAY,
+    USBX_JSON_OBJECT
+};
+
+/**
+ * @struct usbx_json
+ * @brief One parsed value
+ */
+struct usbx_json {
+    int type;                    /**< enum usbx_json_type */
+    int boolean;                 /**< BOOL: value */
+    double number;               /**< NUMBER: value */
+    char *string;                /**< STRING: NUL-terminated UTF-8 value */
+    size_t length;               /**< STRING: bytes; ARRAY/OBJECT: children */
+    char *key;                   /**< Member name when the parent is an object */
+    struct usbx_json *child;     /**< ARRAY/OBJECT: first child */
+    struct usbx_json *next;      /**< Next sibling */
+};
+
+/**
+ * @brief Parse a JSON document
+ * @param text: Document text (need not be NUL-terminated)
+ * @param length: Text size
+ * @param error_offset: Receives the offset of a syntax error (may be NULL)
+ * @return Root node (release with usbx_json_free()), or NULL on error
+ */
+struct usbx_json *usbx_json_parse(const char *text, size_t length, size_t *error_offset);
+
+/**
+ * @brief Release a parsed document
+ * @param json: Root node; NULL is ignored
+ */
+void usbx_json_free(struct usbx_json *json);
+
+/**
+ * @brief Look up an object member
+ * @param object: Object node (other types yield NULL)
+ * @param key: Member name
+ * @return Member value, or NULL
+ */
+const struct usbx_json *usbx_json_get(const struct usbx_json *object, const char *key);
+
+/**
+ * @brief Read an integer from a number or a numeric string (decimal or 0x hex)
+ * @param json: Node (may be NULL)
+ * @param out: Receives the value
+ * @return 0 on success, -1 if absent, fractional or not a number
+ */
+int usbx_json_int(const struct usbx_json *json, long long *out);
+
+/**
+ * @brief Read an integer member within bounds
+ * @param object: Object node
+ * @param key: Member name
+ * @param min: Smallest accepted value
+ * @param max: Largest accepted value
+ * @param fallback: Value used when the member is absent
+ * @param out: Receives the value
+ * @return 0 on success, -1 if present but malformed or out of range
+ */
+int usbx_json_get_int(const struct usbx_json *object, const char *key, long long min,
+                      long long max, long long fallback, long long *out);
+
+/**
+ * @brief String value of a node
+ * @param json: Node (may be NULL)
+ * @return The string, or NULL if @p json is not a string
+ */
+const char *usbx_json_string(const struct usbx_json *json);
+
+/**
+ * @brief Boolean value of a node
+ * @param json: Node (may be NULL)
+ * @param fallback: Value returned if @p json is absent or not a boolean
+ * @return 0 or 1
+ */
+int usbx_json_bool(const struct usbx_json *json, int fallback);
+
+#endif // USBX_JSON_H
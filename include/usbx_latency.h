@@ -0,0 +1,163 @@
+/**
+ * @file usbx_latency.h
+ * @brief Latency estimates and adaptive transfer timeouts
+ *
+ * Every open handle keeps streaming latency estimates of its device: one
+ * per bulk endpoint, and one per control request (bmRequestType and
+ * bRequest), so a slow flash erase does not share an estimate with a fast
+ * status read. Each estimate is fed with the time from submission to
+ * completion of transfers that got an answer (completed, stalled or
+ * overflowed) and keeps a smoothed mean and mean deviation as in TCP's
+ * retransmission timer (RFC 6298), plus a slowly decaying peak.
+ *
+ * When adaptive timeouts are enabled on the handle, a transfer whose
+ * estimate has at least @c min_samples samples is submitted with
+ *
+ *     max(mean + multiplier * deviation, 1.5 * peak, min_timeout_ms)
+ *
+ * doubled once for every timeout in a row under an adaptive deadline, and
+ * never more than the timeout the caller asked for, which stays the upper
+ * bound. A hung transfer is thus noticed after a few typical latencies
+ * instead of the caller's full timeout, and a retry policy (usbx_retry.h)
+ * can repeat it sooner.
+ *
+ * Transfers without a timeout, interrupt transfers (which wait for device
+ * events rather than answers) and isochronous transfers are neither
+ * measured nor shortened.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_LATENCY_H
+#define USBX_LATENCY_H
+
+#include <stdint.h>
+
+#include "usbx_backend.h"
+
+/** @brief Defaults of struct usbx_latency_config */
+#define USBX_LATENCY_DEFAULT_MULTIPLIER 4
+#define USBX_LATENCY_DEFAULT_MIN_TIMEOUT_MS 10
+#define USBX_LATENCY_DEFAULT_MIN_SAMPLES 16
+
+/** @brief Upper bounds of the configuration */
+#define USBX_LATENCY_MAX_MULTIPLIER 64
+#define USBX_LATENCY_MAX_MIN_TIMEOUT_MS 60000
+#define USBX_LATENCY_MAX_MIN_SAMPLES 10000
+
+/** @brief Estimates per table; further endpoints and requests are not tracked */
+#define USBX_LATENCY_MAX_ESTIMATES 256
+
+/** @brief Doublings of an adaptive timeout after timeouts in a row */
+#define USBX_LATENCY_MAX_BACKOFF 6
+
+/**
+ * @struct usbx_latency_config
+ * @brief Adaptive timeout settings of a handle
+ */
+struct usbx_latency_config {
+    int enabled;                 /**< Shorten timeouts; estimates are kept either way */
+    unsigned int multiplier;     /**< Mean deviations above the mean */
+    unsigned int min_timeout_ms; /**< Lower bound of an adaptive timeout */
+    unsigned int min_samples;    /**< Samples before an estimate is used */
+};
+
+/**
+ * @struct usbx_latency_estimate
+ * @brief One endpoint's or control request's estimate
+ */
+struct usbx_latency_estimate {
+    unsigned char endpoint;      /**< Endpoint address, 0 for control requests */
+    uint8_t request_type;        /**< Control: bmRequestType */
+    uint8_t request;             /**< Control: bRequest */
+    uint64_t samples;            /**< Latencies measured */
+    uint64_t mean_us;            /**< Smoothed latency */
+    uint64_t deviation_us;       /**< Smoothed mean deviation */
+    uint64_t peak_us;            /**< Decaying maximum */
+    unsigned int timeout_ms;     /**< Adaptive timeout now, 0 while too few samples */
+    unsigned int backoff;        /**< Timeouts in a row under an adaptive deadline */
+    uint64_t adapted;            /**< Transfers submitted with a shortened timeout */
+    uint64_t early_timeouts;     /**< Of these, transfers that timed out */
+};
+
+struct usbx_latency_table;
+
+/**
+ * @brief Fill in the defaults (adaptive timeouts disabled)
+ * @param config: Configuration to initialise
+ */
+void usbx_latency_config_init(struct usbx_latency_config *config);
+
+/**
+ * @brief Create an empty table with the default configuration
+ * @return Table, or NULL on allocation failure
+ */
+struct usbx_latency_table *usbx_latency_table_create(void);
+
+/**
+ * @brief Free a table; its device must have been detached and destroyed
+ * @param table: Table, or NULL
+ */
+void usbx_latency_table_free(struct usbx_latency_table *table);
+
+/**
+ * @brief Change the settings; estimates are kept
+ * @param table: Table
+ * @param config: Configuration (copied)
+ * @return USBX_SUCCESS or USBX_ERROR_INVALID_PARAM
+ */
+int usbx_latency_configure(struct usbx_latency_table *table,
+                           const struct usbx_latency_config *config);
+
+/**
+ * @brief Read the settings
+ * @param table: Table
+ * @param config: Receives the configuration
+ */
+void usbx_latency_get_config(struct usbx_latency_table *table, struct usbx_latency_config *config);
+
+/**
+ * @brief Feed a table with the transfers of a device
+ * @param table: Table
+ * @param dev: Device
+ */
+void usbx_latency_attach(struct usbx_latency_table *table, struct usbx_device *dev);
+
+/**
+ * @brief Stop feeding a device's table; call before destroying the device
+ * @param dev: Device
+ */
+void usbx_latency_detach(struct usbx_device *dev);
+
+/**
+ * @brief Apply a transfer's adaptive timeout; called on submission
+ * @param xfer: Transfer of an attached device, stamped with @c submit_us
+ */
+void usbx_latency_submit(struct usbx_transfer *xfer);
+
+/**
+ * @brief Restore the caller's timeout and record the outcome; called on completion
+ *        or when the backend refused the submission
+ * @param xfer: Transfer passed to usbx_latency_submit()
+ * @param completed: Non-zero if @c xfer->status is the transfer's outcome
+ * @param now_us: Completion time
+ */
+void usbx_latency_complete(struct usbx_transfer *xfer, int completed, uint64_t now_us);
+
+/**
+ * @brief Copy the estimates, bulk endpoints first, then control requests
+ * @param table: Table
+ * @param estimates: Receives up to @p max estimates
+ * @param max: Capacity of @p estimates
+ * @return Number of estimates in the table (may exceed @p max)
+ */
+int usbx_latency_get_estimates(struct usbx_latency_table *table,
+                               struct usbx_latency_estimate *estimates, int max);
+
+/**
+ * @brief Forget every estimate
+ * @param table: Table
+ */
+void usbx_latency_reset(struct usbx_latency_table *table);
+
+#endif // USBX_LATENCY_H
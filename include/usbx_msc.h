@@ -0,0 +1,145 @@
+/**
+ * @file usbx_msc.h
+ * @brief USB mass-storage block access (Bulk-Only Transport, SCSI READ/WRITE(10))
+ *
+ * A struct usbx_msc drives one logical unit of a mass-storage device.
+ * Each command is pipelined: the CBW and every data chunk are submitted
+ * together (for writes the CSW read as well), so a command costs one
+ * round of completions instead of one per BOT phase. Reads go through an
+ * LRU cache of fixed-size lines; sequential reads fetch
+ * @c read_ahead_blocks beyond the request in the same command. Writes are
+ * written through and update cached lines.
+ *
+ * A stalled pipe or phase error triggers Bulk-Only reset recovery and the
+ * command is retried once. Commands on one unit are serialised.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_MSC_H
+#define USBX_MSC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usbx_backend.h"
+
+/** @brief Command and status wrapper layout */
+#define USBX_MSC_CBW_SIGNATURE 0x43425355U   /**< "USBC" */
+#define USBX_MSC_CSW_SIGNATURE 0x53425355U   /**< "USBS" */
+#define USBX_MSC_CBW_SIZE 31
+#define USBX_MSC_CSW_SIZE 13
+
+/** @brief bCSWStatus values */
+enum usbx_msc_csw_status {
+    USBX_MSC_CSW_PASSED = 0,
+    USBX_MSC_CSW_FAILED = 1,
+    USBX_MSC_CSW_PHASE_ERROR = 2
+};
+
+/** @brief Class requests on the mass-storage interface */
+#define USBX_MSC_REQUEST_RESET 0xff
+#define USBX_MSC_REQUEST_GET_MAX_LUN 0xfe
+
+/** @brief SCSI operation codes used by usbX */
+enum usbx_scsi_opcode {
+    USBX_SCSI_TEST_UNIT_READY = 0x00,
+    USBX_SCSI_REQUEST_SENSE = 0x03,
+    USBX_SCSI_INQUIRY = 0x12,
+    USBX_SCSI_READ_CAPACITY_10 = 0x25,
+    USBX_SCSI_READ_10 = 0x28,
+    USBX_SCSI_WRITE_10 = 0x2a
+};
+
+/** @brief Defaults of struct usbx_msc_options */
+#define USBX_MSC_DEFAULT_MAX_TRANSFER (1024 * 1024)
+#define USBX_MSC_DEFAULT_CACHE_SIZE (8 * 1024 * 1024)
+#define USBX_MSC_DEFAULT_READ_AHEAD 256
+#define USBX_MSC_DEFAULT_TIMEOUT 10000
+
+/**
+ * @struct usbx_msc_options
+ * @brief Parameters of a mass-storage unit
+ */
+struct usbx_msc_options {
+    unsigned char in_endpoint;   /**< Bulk IN endpoint address */
+    unsigned char out_endpoint;  /**< Bulk OUT endpoint address */
+    int interface;               /**< bInterfaceNumber, for reset recovery */
+    int lun;                     /**< Logical unit number (0-15) */
+    size_t max_transfer;         /**< Largest data phase of one command in bytes */
+    size_t cache_size;           /**< Read cache capacity in bytes, 0 disables caching */
+    uint32_t read_ahead_blocks;  /**< Blocks read beyond a sequential read, 0 disables */
+    unsigned int timeout;        /**< Timeout of each BOT phase in milliseconds */
+};
+
+/**
+ * @struct usbx_msc_stats
+ * @brief Counters of a mass-storage unit
+ */
+struct usbx_msc_stats {
+    uint32_t block_size;         /**< Logical block length in bytes */
+    uint64_t block_count;        /**< Number of logical blocks */
+    uint64_t commands;           /**< SCSI commands sent */
+    uint64_t blocks_read;        /**< Blocks read from the device, including read-ahead */
+    uint64_t blocks_written;     /**< Blocks written to the device */
+    uint64_t cache_hits;         /**< Requested blocks served from the cache */
+    uint64_t cache_misses;       /**< Requested blocks read from the device */
+    uint64_t read_ahead_blocks;  /**< Blocks fetched beyond a request (line fill and read-ahead) */
+    uint64_t recoveries;         /**< Bulk-Only reset recoveries */
+    uint32_t sense;              /**< Last sense as 0x00KKAAQQ (key, ASC, ASCQ), 0 if none */
+};
+
+struct usbx_msc;
+
+/**
+ * @brief Fill options with defaults (endpoints 0x81/0x02, LUN 0, 1 MiB commands)
+ * @param opts: Options to initialise
+ */
+void usbx_msc_options_init(struct usbx_msc_options *opts);
+
+/**
+ * @brief Open a logical unit and read its capacity
+ * @param dev: Device; must outlive the unit
+ * @param opts: Options, or NULL for defaults
+ * @param error: Receives the error code on failure (may be NULL)
+ * @return New unit, or NULL
+ */
+struct usbx_msc *usbx_msc_open(struct usbx_device *dev, const struct usbx_msc_options *opts,
+                               int *error);
+
+/**
+ * @brief Close a unit and drop its cache
+ * @param msc: Unit, or NULL
+ */
+void usbx_msc_close(struct usbx_msc *msc);
+
+/**
+ * @brief Read blocks
+ * @param msc: Unit
+ * @param lba: First logical block
+ * @param count: Number of blocks
+ * @param data: Receives count * block size bytes
+ * @return USBX_SUCCESS, USBX_ERROR_INVALID_PARAM for a range beyond the
+ *         device, USBX_ERROR_IO when the device failed the command (see
+ *         the sense in the stats), or a transfer error
+ */
+int usbx_msc_read(struct usbx_msc *msc, uint64_t lba, uint32_t count, unsigned char *data);
+
+/**
+ * @brief Write blocks
+ * @param msc: Unit
+ * @param lba: First logical block
+ * @param count: Number of blocks
+ * @param data: count * block size bytes
+ * @return Same as usbx_msc_read()
+ */
+int usbx_msc_write(struct usbx_msc *msc, uint64_t lba, uint32_t count, const unsigned char *data);
+
+/**
+ * @brief Read the counters of a unit
+ * @param msc: Unit
+ * @param stats: Receives a snapshot
+ */
+void usbx_msc_get_stats(struct usbx_msc *msc, struct usbx_msc_stats *stats);
+
+#endif // USBX_MSC_H
@@ -0,0 +1,173 @@
+/**
+ * @file usbx_ops.h
+ * @brief Batches of device operations described in JSON
+ *
+ * A batch is parsed and validated once, with OUT payloads decoded up
+ * front, and can then be run against any number of devices; the fan-out
+ * route relies on this to send one request body to many devices.
+ *
+ * Each operation is a JSON object with an "op" member:
+ *
+ * - control:   request_type, request, value, index, and either data (OUT,
+ *              base64) or blob (OUT, SHA-256 of a stored blob) or length
+ *              (IN); optional timeout (ms)
+ * - bulk:      endpoint and either data, blob or length; optional timeout
+ *              and zero_packet. Runs through the segmented bulk engine.
+ * - interrupt: endpoint and either data, blob or length; optional timeout
+ * - delay:     ms
+ * - verify:    reads from the device and returns only a digest of the data:
+ *              either endpoint (bulk IN) or request_type, request, value and
+ *              index (control IN); length (optional with blob); algorithm
+ *              "sha256" (default) or "crc32c"; optional expect (hex digest)
+ *              or blob (the stored blob the data should equal). A bulk verify
+ *              streams the data through the digest, so length may exceed the
+ *              limit of other operations, and ends early on a short packet
+ *              like a bulk read would.
+ *
+ * Control, bulk and interrupt operations take an optional "idempotent"
+ * boolean that overrides the handle's retry policy on whether the operation
+ * may be repeated after a stall or timeout (usbx_retry.h).
+ *
+ * The direction comes from bit 7 of request_type or endpoint. Integer
+ * members may be written as strings such as "0x81". A blob payload is sent
+ * straight from the store's mapping and stays referenced until the batch
+ * is freed.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_OPS_H
+#define USBX_OPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usbx_backend.h"
+#include "usbx_sha256.h"
+
+struct usbx_blob;
+struct usbx_blob_store;
+struct usbx_buf;
+struct usbx_json;
+struct usbx_retry_table;
+
+/** @brief Largest payload or IN length of one operation */
+#define USBX_OPS_MAX_LENGTH (64 * 1024 * 1024)
+
+/** @brief Largest number of operations in a batch */
+#define USBX_OPS_MAX_OPERATIONS 1024
+
+/** @brief Largest length of a bulk verify operation */
+#define USBX_OPS_MAX_VERIFY_LENGTH (4ULL * 1024 * 1024 * 1024)
+
+/** @brief Default transfer timeout in milliseconds */
+#define USBX_OPS_DEFAULT_TIMEOUT 1000
+
+/** @brief Longest delay operation in milliseconds */
+#define USBX_OPS_MAX_DELAY_MS 60000
+
+/**
+ * @enum usbx_op_type
+ * @brief Operation kinds
+ */
+enum usbx_op_type {
+    USBX_OP_CONTROL = 0,
+    USBX_OP_BULK,
+    USBX_OP_INTERRUPT,
+    USBX_OP_DELAY,
+    USBX_OP_VERIFY
+};
+
+/**
+ * @enum usbx_digest
+ * @brief Digests computed by verify operations
+ */
+enum usbx_digest {
+    USBX_DIGEST_SHA256 = 0,
+    USBX_DIGEST_CRC32C
+};
+
+/**
+ * @struct usbx_op
+ * @brief One validated operation
+ */
+struct usbx_op {
+    int type;                    /**< enum usbx_op_type */
+    int in;                      /**< Non-zero for device-to-host transfers */
+    unsigned char endpoint;      /**< Bulk/interrupt endpoint address */
+    uint8_t request_type;        /**< Control: bmRequestType */
+    uint8_t request;             /**< Control: bRequest */
+    uint16_t value;              /**< Control: wValue */
+    uint16_t index;              /**< Control: wIndex */
+    const unsigned char *data;   /**< OUT payload, NULL for IN */
+    unsigned char *decoded;      /**< Owned copy behind @c data for inline payloads */
+    size_t reserved;             /**< Memory budget held for @c decoded (usbx_budget.h) */
+    struct usbx_blob *blob;      /**< Referenced blob behind @c data, or NULL */
+    size_t length;               /**< OUT payload size or IN length */
+    unsigned int timeout;        /**< Transfer timeout in milliseconds */
+    int zero_packet;             /**< Bulk OUT: terminate with a zero-length packet */
+    int idempotent;              /**< "idempotent" as 1 or 0, USBX_RETRY_POLICY_DEFAULT if absent */
+    unsigned int delay_ms;       /**< Delay: duration */
+    int algorithm;               /**< Verify: enum usbx_digest */
+    int has_expected;            /**< Verify: compare against @c expected */
+    unsigned char expected[USBX_SHA256_SIZE];  /**< Verify: expected digest (big-endian CRC) */
+};
+
+/**
+ * @struct usbx_op_batch
+ * @brief Validated sequence of operations
+ */
+struct usbx_op_batch {
+    struct usbx_op *ops;         /**< Operations in order */
+    int count;                   /**< Entries in @c ops */
+    int stop_on_error;           /**< Skip the remaining operations after a failure */
+};
+
+/**
+ * @brief Parse and validate operations
+ * @param operations: Array of operation objects, or a single operation object
+ * @param stop_on_error: Value for batch->stop_on_error
+ * @param blobs: Store that "blob" payloads refer to, or NULL to reject them
+ * @param batch: Receives the batch (release with usbx_op_batch_free())
+ * @param message: Receives a static description of the first problem (may be NULL)
+ * @return 0 on success, -1 if invalid, or USBX_ERROR_BUSY / USBX_ERROR_NO_MEM if the
+ *         memory budget has no room for the payloads (@p batch is left empty)
+ */
+int usbx_op_batch_parse(const struct usbx_json *operations, int stop_on_error,
+                        struct usbx_blob_store *blobs, struct usbx_op_batch *batch,
+                        const char **message);
+
+/**
+ * @brief Release a parsed batch and its blob references
+ * @param batch: Batch; may be empty
+ */
+void usbx_op_batch_free(struct usbx_op_batch *batch);
+
+/**
+ * @brief Run a batch on a device and append the results as a JSON array
+ *
+ * Every executed operation yields {"index", "op", "status", "code",
+ * "transferred"} plus "data" (base64) for IN transfers, or "algorithm",
+ * "digest" (hex) and "match" for verify operations. A verify whose digest
+ * differs fails with USBX_ERROR_MISMATCH. Operations skipped because of
+ * stop_on_error are not listed. Control, bulk and interrupt operations run
+ * under the retry policies of @p retry, and those that were retried also
+ * report "retries".
+ *
+ * @param dev: Device
+ * @param batch: Batch; not modified, so it may be run concurrently
+ * @param retry: Retry policies of the device's handle, or NULL
+ * @param out: Buffer the array is appended to
+ * @return USBX_SUCCESS, or the error of the first failed operation
+ */
+int usbx_op_batch_run(struct usbx_device *dev, const struct usbx_op_batch *batch,
+                      struct usbx_retry_table *retry, struct usbx_buf *out);
+
+/**
+ * @brief Name of an operation kind
+ * @param type: enum usbx_op_type value
+ * @return Static string such as "bulk"
+ */
+const char *usbx_op_name(int type);
+
+#endif // USBX_OPS_H
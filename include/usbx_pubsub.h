@@ -0,0 +1,210 @@
+/**
+ * @file usbx_pubsub.h
+ * @brief Bulk IN stream shared by many subscribers
+ *
+ * A publisher keeps bulk IN transfers submitted on one endpoint. Each
+ * transfer reads straight into a reference-counted chunk that is then
+ * appended to a singly linked chain; subscribers walk the chain through
+ * their own cursor, so every byte is read from the device once and copied
+ * only into each subscriber's output buffer. A chunk is released as soon
+ * as the last subscriber has moved past it.
+ *
+ * Each subscriber chooses what happens when it falls more than @c limit
+ * bytes behind the publisher:
+ *
+ * - USBX_PUBSUB_DROP: the oldest unread data is skipped and counted as dropped.
+ * - USBX_PUBSUB_DISCONNECT: the subscriber is cut off; reads return
+ *   USBX_ERROR_OVERFLOW.
+ * - USBX_PUBSUB_BOUNDED: the publisher stops resubmitting transfers until
+ *   the subscriber catches up, throttling the device for everyone. The
+ *   backlog can exceed the limit by the transfers already in flight.
+ *
+ * Completions on one endpoint arrive in submission order, which keeps the
+ * chain in stream order.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_PUBSUB_H
+#define USBX_PUBSUB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usbx_backend.h"
+
+/** @brief Default bytes per transfer and chunk */
+#define USBX_PUBSUB_DEFAULT_CHUNK_SIZE (64 * 1024)
+
+/** @brief Default number of transfers kept submitted */
+#define USBX_PUBSUB_DEFAULT_IN_FLIGHT 4
+
+/** @brief Upper bound for transfers_in_flight */
+#define USBX_PUBSUB_MAX_IN_FLIGHT 64
+
+/** @brief Default per-subscriber backlog limit in bytes */
+#define USBX_PUBSUB_DEFAULT_LIMIT (4 * 1024 * 1024)
+
+/**
+ * @enum usbx_pubsub_policy
+ * @brief What to do with a subscriber that exceeds its backlog limit
+ */
+enum usbx_pubsub_policy {
+    USBX_PUBSUB_DROP = 0,        /**< Skip the oldest unread data */
+    USBX_PUBSUB_DISCONNECT = 1,  /**< End the subscription */
+    USBX_PUBSUB_BOUNDED = 2      /**< Pause the publisher */
+};
+
+/**
+ * @struct usbx_pubsub_options
+ * @brief Tuning knobs for a publisher
+ */
+struct usbx_pubsub_options {
+    size_t chunk_size;           /**< Bytes per transfer, rounded down to wMaxPacketSize */
+    int transfers_in_flight;     /**< Transfers kept submitted */
+};
+
+/**
+ * @struct usbx_pubsub_stats
+ * @brief Publisher counters
+ */
+struct usbx_pubsub_stats {
+    uint64_t chunks;             /**< Chunks published */
+    uint64_t bytes;              /**< Bytes published */
+    uint64_t retained_chunks;    /**< Chunks still referenced by a subscriber */
+    uint64_t retained_bytes;     /**< Bytes in retained chunks */
+    uint64_t pauses;             /**< Times a bounded subscriber paused the publisher */
+    int paused;                  /**< Non-zero while the publisher is paused */
+    int subscribers;             /**< Current subscribers */
+    int running;                 /**< Non-zero while transfers are being submitted */
+    int last_error;              /**< Error that stopped the stream, USBX_SUCCESS if none */
+};
+
+/**
+ * @struct usbx_pubsub_subscriber_stats
+ * @brief Per-subscriber counters
+ */
+struct usbx_pubsub_subscriber_stats {
+    int id;                      /**< Subscriber id */
+    int policy;                  /**< enum usbx_pubsub_policy */
+    uint64_t limit;              /**< Backlog limit in bytes */
+    uint64_t delivered;          /**< Bytes handed to this subscriber */
+    uint64_t dropped;            /**< Bytes this subscriber lost to its policy */
+    uint64_t backlog;            /**< Published bytes not yet read */
+    int disconnected;            /**< Non-zero once cut off by USBX_PUBSUB_DISCONNECT */
+};
+
+struct usbx_pubsub;
+
+/**
+ * @brief Fill options with the defaults
+ * @param opts: Options to initialise
+ */
+void usbx_pubsub_options_init(struct usbx_pubsub_options *opts);
+
+/**
+ * @brief Start publishing a bulk IN endpoint
+ * @param dev: Device
+ * @param endpoint: Bulk IN endpoint address
+ * @param opts: Tuning options, NULL for defaults
+ * @param error: Receives the error code on failure (may be NULL)
+ * @return New publisher, or NULL on failure
+ */
+struct usbx_pubsub *usbx_pubsub_start(struct usbx_device *dev, unsigned char endpoint,
+                                      const struct usbx_pubsub_options *opts, int *error);
+
+/**
+ * @brief Stop publishing: cancel the transfers and wake all readers
+ *
+ * Published data can still be read; afterwards readers get
+ * USBX_ERROR_INTERRUPTED. Waits until no transfer is in flight.
+ *
+ * @param pubsub: Publisher
+ */
+void usbx_pubsub_stop(struct usbx_pubsub *pubsub);
+
+/**
+ * @brief Stop publishing if needed and release everything
+ *
+ * Waits until no reader is inside usbx_pubsub_read().
+ *
+ * @param pubsub: Publisher; NULL is ignored
+ */
+void usbx_pubsub_destroy(struct usbx_pubsub *pubsub);
+
+/**
+ * @brief Snapshot of the publisher counters
+ * @param pubsub: Publisher
+ * @param stats: Receives the counters
+ */
+void usbx_pubsub_get_stats(struct usbx_pubsub *pubsub, struct usbx_pubsub_stats *stats);
+
+/**
+ * @brief Add a subscriber that receives data published from now on
+ * @param pubsub: Publisher
+ * @param policy: enum usbx_pubsub_policy
+ * @param limit: Backlog limit in bytes, 0 for the default; raised to one chunk at least
+ * @return Subscriber id (> 0), USBX_ERROR_INVALID_PARAM or USBX_ERROR_NO_MEM
+ */
+int usbx_pubsub_subscribe(struct usbx_pubsub *pubsub, int policy, uint64_t limit);
+
+/**
+ * @brief Remove a subscriber; a reader blocked on it returns USBX_ERROR_NOT_FOUND
+ * @param pubsub: Publisher
+ * @param subscriber: Subscriber id
+ * @return Remaining subscriber count, or USBX_ERROR_NOT_FOUND
+ */
+int usbx_pubsub_unsubscribe(struct usbx_pubsub *pubsub, int subscriber);
+
+/**
+ * @brief Read the subscriber's next bytes
+ *
+ * Only one thread may read a given subscriber at a time.
+ *
+ * @param pubsub: Publisher
+ * @param subscriber: Subscriber id
+ * @param buffer: Destination
+ * @param max: Destination size
+ * @param timeout_ms: 0 returns immediately, negative waits forever
+ * @return Bytes read (> 0), 0 on timeout, USBX_ERROR_NOT_FOUND for an unknown
+ *         subscriber, USBX_ERROR_OVERFLOW once disconnected by its policy, or the
+ *         error that stopped the stream once everything was read
+ */
+long usbx_pubsub_read(struct usbx_pubsub *pubsub, int subscriber, unsigned char *buffer,
+                      size_t max, int timeout_ms);
+
+/**
+ * @brief Counters of one subscriber
+ * @param pubsub: Publisher
+ * @param subscriber: Subscriber id
+ * @param stats: Receives the counters
+ * @return USBX_SUCCESS or USBX_ERROR_NOT_FOUND
+ */
+int usbx_pubsub_subscriber_stats(struct usbx_pubsub *pubsub, int subscriber,
+                                 struct usbx_pubsub_subscriber_stats *stats);
+
+/**
+ * @brief Counters of all subscribers
+ * @param pubsub: Publisher
+ * @param stats: Destination array
+ * @param max: Entries available in @p stats
+ * @return Number of subscribers (may exceed @p max; only @p max entries are written)
+ */
+int usbx_pubsub_list_subscribers(struct usbx_pubsub *pubsub,
+                                 struct usbx_pubsub_subscriber_stats *stats, int max);
+
+/**
+ * @brief Parse a policy name ("drop", "disconnect" or "bounded")
+ * @param name: Policy name
+ * @return enum usbx_pubsub_policy value, or -1 if unknown
+ */
+int usbx_pubsub_policy_from_name(const char *name);
+
+/**
+ * @brief Name of a policy
+ * @param policy: enum usbx_pubsub_policy value
+ * @return Static string such as "drop"
+ */
+const char *usbx_pubsub_policy_name(int policy);
+
+#endif // USBX_PUBSUB_H
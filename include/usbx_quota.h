@@ -0,0 +1,151 @@
+/**
+ * @file usbx_quota.h
+ * @brief Per-client request-rate and bandwidth quotas
+ *
+ * A request is charged to its API key (usbx_http_request::client_id) if
+ * the key has limits of its own, and otherwise to its peer address, so
+ * keys a client makes up neither get fresh buckets nor fill the table.
+ * Every client has two token buckets: one refilled at @c requests_per_sec
+ * and one at @c bytes_per_sec, each holding at most its burst. A request
+ * takes one request token when usbx_http_dispatch() admits it; transfers
+ * submitted while serving it take the bytes they moved when they complete,
+ * so a transfer refused on submission or cut short costs only what it
+ * moved. The byte bucket may go into debt, since a transfer is not refused
+ * halfway through a request, and the client's next requests are refused
+ * until it is paid back. Refused requests get 429 with Retry-After.
+ *
+ * Buckets are kept in the GCRA form: a single theoretical arrival time per
+ * bucket, advanced with compare-and-swap, and the client table is
+ * published for lock-free lookups, so admitting and charging take no lock.
+ * Only a client's first request takes a mutex, to add its entry.
+ *
+ * Limits are the defaults unless a client has its own; both can be changed
+ * at runtime. A limit of 0 is unlimited, and with no limit configured
+ * anywhere requests do not look up their client at all.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_QUOTA_H
+#define USBX_QUOTA_H
+
+#include <stdint.h>
+
+/** @brief Clients tracked; further clients share one entry */
+#define USBX_QUOTA_MAX_CLIENTS 1024
+
+/** @brief Length of a client fingerprint including the terminator */
+#define USBX_QUOTA_FINGERPRINT_SIZE 17
+
+/**
+ * @struct usbx_quota_limits
+ * @brief Limits of one client, or the defaults
+ */
+struct usbx_quota_limits {
+    uint64_t requests_per_sec;   /**< Sustained request rate, 0 for unlimited */
+    uint64_t request_burst;      /**< Requests allowed at once, 0 for one second's worth */
+    uint64_t bytes_per_sec;      /**< Sustained transfer bandwidth, 0 for unlimited */
+    uint64_t byte_burst;         /**< Bytes allowed at once, 0 for one second's worth */
+};
+
+/**
+ * @struct usbx_quota_usage
+ * @brief Limits and counters of one client
+ */
+struct usbx_quota_usage {
+    char fingerprint[USBX_QUOTA_FINGERPRINT_SIZE];  /**< Hex prefix of SHA-256(identity), or "other" */
+    int custom;                  /**< Has its own limits */
+    struct usbx_quota_limits limits;  /**< Limits in effect */
+    uint64_t admitted;           /**< Requests admitted */
+    uint64_t rejected;           /**< Requests refused with 429 */
+    uint64_t bytes;              /**< Bytes charged */
+    uint64_t retry_after_ms;     /**< Wait before the next request is admitted, 0 if none */
+};
+
+struct usbx_quota_client;
+
+/**
+ * @brief Admit a request of a client and charge the calling thread's transfers to it
+ * @param client: Client identity, or NULL (always admitted)
+ * @param fallback: Identity charged instead if @p client has no limits of its own (the peer
+ *                  address), or NULL to charge @p client regardless
+ * @param retry_after_ms: Set to the wait before retrying when refused
+ * @return USBX_SUCCESS, or USBX_ERROR_BUSY if a quota is exhausted
+ */
+int usbx_quota_admit(const char *client, const char *fallback, unsigned int *retry_after_ms);
+
+/**
+ * @brief Client the calling thread's transfers are charged to
+ * @return Client, or NULL
+ */
+struct usbx_quota_client *usbx_quota_current(void);
+
+/**
+ * @brief Charge the calling thread's transfers to a client, e.g. in a worker of a request
+ * @param client: From usbx_quota_current(), or NULL to stop charging
+ */
+void usbx_quota_set_current(struct usbx_quota_client *client);
+
+/**
+ * @brief Charge bytes to the calling thread's client
+ * @param bytes: Bytes moved
+ */
+void usbx_quota_charge(uint64_t bytes);
+
+/**
+ * @brief Charge bytes to a client; called on transfer completion
+ * @param client: Client current when the transfer was submitted, or NULL
+ * @param bytes: Bytes the transfer moved
+ */
+void usbx_quota_charge_client(struct usbx_quota_client *client, uint64_t bytes);
+
+/**
+ * @brief Set the defaults used by clients without limits of their own
+ * @param limits: Limits
+ */
+void usbx_quota_set_defaults(const struct usbx_quota_limits *limits);
+
+/**
+ * @brief Read the defaults
+ * @param limits: Receives the limits
+ */
+void usbx_quota_get_defaults(struct usbx_quota_limits *limits);
+
+/**
+ * @brief Give a client its own limits
+ * @param client: Client identity
+ * @param limits: Limits
+ * @return USBX_SUCCESS, USBX_ERROR_INVALID_PARAM or USBX_ERROR_NO_MEM (too many clients)
+ */
+int usbx_quota_set_client(const char *client, const struct usbx_quota_limits *limits);
+
+/**
+ * @brief Return a client to the defaults
+ * @param client: Client identity
+ * @return USBX_SUCCESS or USBX_ERROR_NOT_FOUND
+ */
+int usbx_quota_clear_client(const char *client);
+
+/**
+ * @brief Limits in effect for a client
+ * @param client: Client identity
+ * @param limits: Receives its own limits, or the defaults
+ */
+void usbx_quota_get_client(const char *client, struct usbx_quota_limits *limits);
+
+/**
+ * @brief Read the state of every client seen
+ * @param usage: Receives up to @p max entries
+ * @param max: Capacity of @p usage
+ * @return Number of clients, which may exceed @p max
+ */
+int usbx_quota_get_usage(struct usbx_quota_usage *usage, int max);
+
+/**
+ * @brief Forget every client and reset the defaults to unlimited
+ *
+ * Only call while no request is being served.
+ */
+void usbx_quota_reset(void);
+
+#endif // USBX_QUOTA_H
@@ -0,0 +1,159 @@
+/**
+ * @file usbx_retry.h
+ * @brief Server-side recovery of stalled endpoints and retry of timed-out transfers
+ *
+ * A handle's retry table holds a policy for the device as a whole and
+ * optional policies for single endpoints. When a control, bulk or
+ * interrupt operation fails:
+ *
+ * - with a stall (USBX_ERROR_PIPE), the endpoint's halt is cleared with
+ *   CLEAR_FEATURE(ENDPOINT_HALT) and the operation is repeated, up to
+ *   @c stall_retries times. Endpoint 0 recovers by itself with the next
+ *   setup packet, so control requests are repeated without a clear.
+ * - with a timeout, the operation is repeated up to @c timeout_retries
+ *   times after a backoff that starts at @c backoff_ms and doubles up to
+ *   @c max_backoff_ms.
+ *
+ * Only operations that are safe to repeat are retried: bulk and interrupt
+ * transfers that moved no data, and IN transfers, OUT transfers or control
+ * requests that the policy's USBX_RETRY_* idempotency flags declare safe.
+ * A batch operation's "idempotent" member overrides the flags. Counters of
+ * every retry, recovery and give-up are kept per endpoint.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_RETRY_H
+#define USBX_RETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usbx_backend.h"
+
+/** @brief Idempotency flags: which operations may be repeated after moving data */
+#define USBX_RETRY_IN      0x01  /**< Bulk and interrupt IN transfers */
+#define USBX_RETRY_OUT     0x02  /**< Bulk and interrupt OUT transfers */
+#define USBX_RETRY_CONTROL 0x04  /**< Control requests */
+
+/** @brief usbx_retry_policy::endpoint of the policy for endpoints without their own */
+#define USBX_RETRY_ALL_ENDPOINTS (-1)
+
+/** @brief Policies per table: the device default plus one per endpoint address */
+#define USBX_RETRY_MAX_POLICIES 33
+
+/** @brief Upper bound of stall_retries and timeout_retries */
+#define USBX_RETRY_MAX_ATTEMPTS 16
+
+/** @brief Upper bound of backoff_ms and max_backoff_ms */
+#define USBX_RETRY_MAX_BACKOFF_MS 10000
+
+/** @brief usbx_retry_run() idempotency argument: use the policy's flags */
+#define USBX_RETRY_POLICY_DEFAULT (-1)
+
+/**
+ * @struct usbx_retry_policy
+ * @brief Retry behaviour of one endpoint, or of a device's other endpoints
+ */
+struct usbx_retry_policy {
+    int endpoint;                /**< Endpoint address, or USBX_RETRY_ALL_ENDPOINTS */
+    unsigned int stall_retries;  /**< Clear-halt and retry this many times */
+    unsigned int timeout_retries;  /**< Retry timed-out operations this many times */
+    unsigned int backoff_ms;     /**< Wait before the first timeout retry */
+    unsigned int max_backoff_ms; /**< Upper bound of the doubling backoff */
+    unsigned int idempotent;     /**< USBX_RETRY_* flags */
+};
+
+/**
+ * @struct usbx_retry_stats
+ * @brief Retry counters of an endpoint, or summed over a table
+ */
+struct usbx_retry_stats {
+    uint64_t stall_retries;      /**< Retries after a stall */
+    uint64_t timeout_retries;    /**< Retries after a timeout */
+    uint64_t clear_halts;        /**< CLEAR_FEATURE(ENDPOINT_HALT) requests sent */
+    uint64_t recovered;          /**< Operations that succeeded after retrying */
+    uint64_t exhausted;          /**< Operations that still failed after every retry */
+    uint64_t unsafe;             /**< Failures not retried because repeating was unsafe */
+};
+
+struct usbx_retry_table;
+
+/**
+ * @brief Run one attempt of an operation
+ * @param cls: Closure passed to usbx_retry_run()
+ * @param transferred: Receives the bytes moved by the attempt
+ * @return USBX_SUCCESS or a negative error code
+ */
+typedef int (*usbx_retry_attempt)(void *cls, size_t *transferred);
+
+/**
+ * @brief Initialise a policy that retries nothing
+ * @param policy: Policy to fill in
+ * @param endpoint: Endpoint address, or USBX_RETRY_ALL_ENDPOINTS
+ */
+void usbx_retry_policy_init(struct usbx_retry_policy *policy, int endpoint);
+
+/**
+ * @brief Create an empty table
+ * @return Table, or NULL on allocation failure
+ */
+struct usbx_retry_table *usbx_retry_table_create(void);
+
+/**
+ * @brief Free a table
+ * @param table: Table, or NULL
+ */
+void usbx_retry_table_free(struct usbx_retry_table *table);
+
+/**
+ * @brief Set or replace the policy of an endpoint (a policy retrying nothing removes it)
+ * @param table: Table
+ * @param policy: Policy (copied)
+ * @return USBX_SUCCESS or USBX_ERROR_INVALID_PARAM
+ */
+int usbx_retry_set(struct usbx_retry_table *table, const struct usbx_retry_policy *policy);
+
+/**
+ * @brief Remove every policy and reset the counters
+ * @param table: Table
+ */
+void usbx_retry_clear(struct usbx_retry_table *table);
+
+/**
+ * @brief Policies currently set, the device default first
+ * @param table: Table
+ * @param policies: Destination
+ * @param max: Entries available in @p policies
+ * @return Number of policies (at most @p max are written)
+ */
+int usbx_retry_get_policies(struct usbx_retry_table *table, struct usbx_retry_policy *policies,
+                            int max);
+
+/**
+ * @brief Read counters
+ * @param table: Table
+ * @param endpoint: Endpoint address, or USBX_RETRY_ALL_ENDPOINTS for the sum
+ * @param stats: Receives the counters
+ */
+void usbx_retry_get_stats(struct usbx_retry_table *table, int endpoint,
+                          struct usbx_retry_stats *stats);
+
+/**
+ * @brief Run an operation under the policy of its endpoint
+ * @param table: Table, or NULL to run the attempt once
+ * @param dev: Device whose halts are cleared
+ * @param endpoint: Endpoint address, 0 for control requests
+ * @param in: Non-zero for device-to-host operations
+ * @param idempotent: Non-zero if safe to repeat, 0 if not, or USBX_RETRY_POLICY_DEFAULT
+ * @param attempt: Attempt function
+ * @param cls: Closure for @p attempt
+ * @param transferred: Receives the bytes moved by the last attempt
+ * @param retries: Receives the number of retries made (may be NULL)
+ * @return Result of the last attempt
+ */
+int usbx_retry_run(struct usbx_retry_table *table, struct usbx_device *dev,
+                   unsigned char endpoint, int in, int idempotent, usbx_retry_attempt attempt,
+                   void *cls, size_t *transferred, int *retries);
+
+#endif // USBX_RETRY_H
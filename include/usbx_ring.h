@@ -0,0 +1,83 @@
+/**
+ * @file usbx_ring.h
+ * @brief Bounded byte ring buffer connecting transfer engines with readers
+ *
+ * Transfer callbacks use the non-blocking forms: usbx_ring_write_all()
+ * stores a framed record completely or not at all, so records are never
+ * split. Readers and producers may block with a timeout until data or
+ * space is available or the ring is closed.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_RING_H
+#define USBX_RING_H
+
+#include <stddef.h>
+
+struct usbx_ring;
+
+/**
+ * @brief Create a ring buffer
+ * @param capacity: Capacity in bytes (must be > 0)
+ * @return New ring, or NULL on allocation failure
+ */
+struct usbx_ring *usbx_ring_create(size_t capacity);
+
+/**
+ * @brief Destroy a ring buffer; no reader or writer may still use it
+ * @param ring: Ring to destroy; NULL is ignored
+ */
+void usbx_ring_destroy(struct usbx_ring *ring);
+
+/**
+ * @brief Store as many bytes as fit, waiting up to @p timeout_ms for free space
+ * @param ring: Ring buffer
+ * @param data: Bytes to store
+ * @param length: Number of bytes offered
+ * @param timeout_ms: 0 returns immediately, negative waits forever
+ * @return Number of bytes stored; 0 on timeout or when closed
+ */
+size_t usbx_ring_write(struct usbx_ring *ring, const void *data, size_t length,
+                       int timeout_ms);
+
+/**
+ * @brief Store all bytes or none
+ * @param ring: Ring buffer
+ * @param data: Bytes to store
+ * @param length: Number of bytes
+ * @return 0 on success, -1 if there is not enough free space or the ring is closed
+ */
+int usbx_ring_write_all(struct usbx_ring *ring, const void *data, size_t length);
+
+/**
+ * @brief Read up to @p max bytes, waiting up to @p timeout_ms for data
+ * @param ring: Ring buffer
+ * @param buffer: Destination
+ * @param max: Destination size
+ * @param timeout_ms: 0 returns immediately, negative waits forever
+ * @return Number of bytes read; 0 on timeout or when closed and drained
+ */
+size_t usbx_ring_read(struct usbx_ring *ring, void *buffer, size_t max, int timeout_ms);
+
+/**
+ * @brief Bytes currently stored
+ * @param ring: Ring buffer
+ * @return Used bytes
+ */
+size_t usbx_ring_used(struct usbx_ring *ring);
+
+/**
+ * @brief Close the ring: further writes fail and blocked readers wake up
+ * @param ring: Ring buffer
+ */
+void usbx_ring_close(struct usbx_ring *ring);
+
+/**
+ * @brief Whether the ring was closed and all data has been read
+ * @param ring: Ring buffer
+ * @return 1 if closed and empty, 0 otherwise
+ */
+int usbx_ring_finished(struct usbx_ring *ring);
+
+#endif // USBX_RING_H
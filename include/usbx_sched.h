@@ -0,0 +1,194 @@
+/**
+ * @file usbx_sched.h
+ * @brief Weighted fair sharing of a device between clients
+ *
+ * When a handle's scheduler is enabled, at most @c max_in_flight transfers
+ * submitted on behalf of clients are outstanding on the device. Further
+ * submissions wait in a queue per client, and freed slots are handed out
+ * by deficit round robin: each visit adds @c quantum times the client's
+ * weight to its deficit, and queued transfers are admitted while their
+ * length fits in it. A client sending back-to-back bulk segments thus gets
+ * its weighted share of the device instead of all of it.
+ *
+ * Control transfers wait in a separate queue that is served before any
+ * client queue, so a control poll only waits for a slot to free up, not
+ * behind another client's queued bulk segments.
+ *
+ * The client of a transfer is the identity of the HTTP request whose thread
+ * submits it (usbx_http_request::client_id, set by usbx_http_dispatch()).
+ * Transfers submitted by threads without a client, such as completion
+ * callbacks, are neither queued nor counted, so event threads never block
+ * here. Interrupt pollers, serial channels and bulk and isochronous streams
+ * submit without a client even when a request starts them: their transfers
+ * stay pending until stopped and would otherwise hold slots for good.
+ *
+ * A queued transfer waits at most its timeout and then fails with
+ * USBX_ERROR_TIMEOUT without reaching the device.
+ *
+ * Clients are reported by a fingerprint of their identity, since that may
+ * be an API key.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_SCHED_H
+#define USBX_SCHED_H
+
+#include <stdint.h>
+
+#include "usbx_backend.h"
+
+/** @brief Built-in defaults of struct usbx_sched_config (usbx_config.h can change them) */
+#define USBX_SCHED_DEFAULT_MAX_IN_FLIGHT 4
+#define USBX_SCHED_DEFAULT_QUANTUM (64 * 1024)
+
+/** @brief Upper bounds of the configuration */
+#define USBX_SCHED_MAX_IN_FLIGHT 64
+#define USBX_SCHED_MAX_QUANTUM (16 * 1024 * 1024)
+#define USBX_SCHED_MAX_WEIGHT 100
+
+/** @brief Clients tracked per device; further clients share one entry */
+#define USBX_SCHED_MAX_CLIENTS 64
+
+/** @brief Length of a client fingerprint including the terminator */
+#define USBX_SCHED_FINGERPRINT_SIZE 17
+
+/**
+ * @struct usbx_sched_config
+ * @brief Scheduler settings of a device
+ */
+struct usbx_sched_config {
+    int enabled;                 /**< Zero submits every transfer at once */
+    unsigned int max_in_flight;  /**< Client transfers outstanding on the device */
+    unsigned int quantum;        /**< Bytes added to a weight-1 client's deficit per round */
+};
+
+/**
+ * @struct usbx_sched_client_stats
+ * @brief Queue state and counters of one client
+ */
+struct usbx_sched_client_stats {
+    char fingerprint[USBX_SCHED_FINGERPRINT_SIZE];  /**< Hex prefix of SHA-256(identity), or "other" */
+    unsigned int weight;         /**< Share relative to other clients */
+    unsigned int queued;         /**< Transfers waiting now */
+    unsigned int max_queued;     /**< Deepest queue seen */
+    uint64_t admitted;           /**< Transfers admitted */
+    uint64_t bytes;              /**< Length of admitted transfers */
+    uint64_t waited;             /**< Admitted transfers that had to queue */
+    uint64_t wait_us;            /**< Total time queued */
+    uint64_t max_wait_us;        /**< Longest time queued */
+    uint64_t expired;            /**< Transfers that timed out in the queue */
+};
+
+/**
+ * @struct usbx_sched_stats
+ * @brief Device-wide scheduler state
+ */
+struct usbx_sched_stats {
+    unsigned int in_flight;      /**< Client transfers outstanding */
+    unsigned int queued;         /**< Transfers waiting, control included */
+    uint64_t control_first;      /**< Control transfers admitted ahead of queued clients */
+    int clients;                 /**< Client entries */
+};
+
+struct usbx_sched;
+
+/**
+ * @brief Fill in the defaults (disabled) from the current config snapshot
+ * @param config: Configuration to initialise
+ */
+void usbx_sched_config_init(struct usbx_sched_config *config);
+
+/**
+ * @brief Create a disabled scheduler
+ * @return Scheduler, or NULL on allocation failure
+ */
+struct usbx_sched *usbx_sched_create(void);
+
+/**
+ * @brief Free a scheduler; its device must have been detached and destroyed
+ * @param sched: Scheduler, or NULL
+ */
+void usbx_sched_free(struct usbx_sched *sched);
+
+/**
+ * @brief Change the settings; disabling admits every waiting transfer
+ * @param sched: Scheduler
+ * @param config: Configuration (copied)
+ * @return USBX_SUCCESS or USBX_ERROR_INVALID_PARAM
+ */
+int usbx_sched_configure(struct usbx_sched *sched, const struct usbx_sched_config *config);
+
+/**
+ * @brief Read the settings
+ * @param sched: Scheduler
+ * @param config: Receives the configuration
+ */
+void usbx_sched_get_config(struct usbx_sched *sched, struct usbx_sched_config *config);
+
+/**
+ * @brief Set a client's weight, creating its entry if needed
+ * @param sched: Scheduler
+ * @param client: Client identity
+ * @param weight: 1 to USBX_SCHED_MAX_WEIGHT
+ * @return USBX_SUCCESS, USBX_ERROR_INVALID_PARAM or USBX_ERROR_NO_MEM
+ */
+int usbx_sched_set_weight(struct usbx_sched *sched, const char *client, unsigned int weight);
+
+/**
+ * @brief Schedule the transfers of a device
+ * @param sched: Scheduler
+ * @param dev: Device
+ */
+void usbx_sched_attach(struct usbx_sched *sched, struct usbx_device *dev);
+
+/**
+ * @brief Stop scheduling a device; call before destroying the device
+ * @param dev: Device
+ */
+void usbx_sched_detach(struct usbx_device *dev);
+
+/**
+ * @brief Set the client on whose behalf the calling thread submits transfers
+ * @param client: Identity, valid until reset; NULL for none
+ */
+void usbx_sched_set_client(const char *client);
+
+/**
+ * @brief Client of the calling thread
+ * @return Identity, or NULL
+ */
+const char *usbx_sched_client(void);
+
+/**
+ * @brief Wait for the transfer's turn; called on submission
+ * @param xfer: Transfer of an attached device
+ * @return USBX_SUCCESS, or USBX_ERROR_TIMEOUT if its timeout passed while queued
+ */
+int usbx_sched_acquire(struct usbx_transfer *xfer);
+
+/**
+ * @brief Free the slot of an admitted transfer; called on completion or refusal
+ * @param xfer: Transfer
+ */
+void usbx_sched_release(struct usbx_transfer *xfer);
+
+/**
+ * @brief Read the state and the client entries
+ * @param sched: Scheduler
+ * @param stats: Receives the device-wide state
+ * @param clients: Receives up to @p max client entries
+ * @param max: Capacity of @p clients
+ * @return Client entries written
+ */
+int usbx_sched_get_stats(struct usbx_sched *sched, struct usbx_sched_stats *stats,
+                         struct usbx_sched_client_stats *clients, int max);
+
+/**
+ * @brief Fingerprint reported for a client identity
+ * @param client: Identity
+ * @param fingerprint: Receives USBX_SCHED_FINGERPRINT_SIZE bytes
+ */
+void usbx_sched_fingerprint(const char *client, char *fingerprint);
+
+#endif // USBX_SCHED_H
@@ -0,0 +1,67 @@
+/**
+ * @file usbx_sha256.h
+ * @brief SHA-256 (FIPS 180-4), used to address stored blobs and verify readback
+ *
+ * Uses the x86 SHA extensions (SHA-NI) when the CPU has them.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_SHA256_H
+#define USBX_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** @brief Digest size in bytes */
+#define USBX_SHA256_SIZE 32
+
+/** @brief Size of a lowercase hex digest, including the terminator */
+#define USBX_SHA256_HEX_SIZE (2 * USBX_SHA256_SIZE + 1)
+
+/**
+ * @struct usbx_sha256
+ * @brief Incremental hashing state
+ */
+struct usbx_sha256 {
+    uint32_t state[8];           /**< Chaining value */
+    uint64_t length;             /**< Bytes hashed so far */
+    unsigned char block[64];     /**< Partial input block */
+};
+
+/**
+ * @brief Start a new digest
+ * @param ctx: State to initialise
+ */
+void usbx_sha256_init(struct usbx_sha256 *ctx);
+
+/**
+ * @brief Hash more input
+ * @param ctx: State
+ * @param data: Input bytes
+ * @param length: Input size
+ */
+void usbx_sha256_update(struct usbx_sha256 *ctx, const void *data, size_t length);
+
+/**
+ * @brief Finish the digest
+ * @param ctx: State; must be re-initialised before reuse
+ * @param digest: Receives USBX_SHA256_SIZE bytes
+ */
+void usbx_sha256_final(struct usbx_sha256 *ctx, unsigned char *digest);
+
+/**
+ * @brief Hash a buffer and format the digest as lowercase hex
+ * @param data: Input bytes
+ * @param length: Input size
+ * @param hex: Receives USBX_SHA256_HEX_SIZE characters including the terminator
+ */
+void usbx_sha256_hex(const void *data, size_t length, char *hex);
+
+/**
+ * @brief Name of the block function in use on this CPU
+ * @return "sha-ni" or "portable"
+ */
+const char *usbx_sha256_implementation(void);
+
+#endif // USBX_SHA256_H
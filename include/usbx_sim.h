@@ -0,0 +1,358 @@
+/**
+ * @file usbx_sim.h
+ * @brief In-process simulated USB device backend
+ *
+ * The simulated backend lets the transfer engines be tested and benchmarked
+ * without hardware. Each configured endpoint is served by its own thread that
+ * completes transfers in submission order, following a simple bus timing
+ * model:
+ *
+ * - @c latency_us is paid when a transfer arrives at an idle endpoint, i.e.
+ *   when nothing was queued behind the previous transfer (host turnaround).
+ * - @c overhead_us is paid by every transfer.
+ * - @c bytes_per_sec limits the data rate (0 means unlimited).
+ *
+ * Isochronous endpoints instead move one packet per @c interval_us service
+ * interval on a fixed bus schedule. A transfer queued after its slot has
+ * passed misses intervals (counted in missed_intervals), completions are
+ * delivered up to @c jitter_us late, and @c packet_error_ppm packets per
+ * million complete with an error.
+ *
+ * Unless a custom handler is installed, IN endpoints produce the byte stream
+ * of usbx_sim_pattern_byte() split into messages of @c message_size bytes
+ * (a message end is a short packet), and OUT endpoints check incoming data
+ * against the same pattern and count mismatches.
+ *
+ * usbx_sim_dfu_create() provides a control handler that behaves like a
+ * device in DFU mode, for testing firmware downloads, and
+ * usbx_sim_msc_create() a Bulk-Only mass-storage device backed by memory,
+ * and usbx_sim_cdc_create() a CDC-ACM serial loopback.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_SIM_H
+#define USBX_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usbx_backend.h"
+
+/** @brief Handler return value: no data yet, call again at *retry_at_us */
+#define USBX_SIM_RETRY (-1)
+
+/**
+ * @brief Endpoint behaviour hook, called on the endpoint thread
+ *
+ * The handler fills (IN) or consumes (OUT) @c xfer->buffer and sets
+ * @c xfer->actual_length. For control transfers the buffer starts with the
+ * setup packet and actual_length counts the data stage only.
+ *
+ * @param cls: Closure from the endpoint configuration
+ * @param xfer: Transfer being processed
+ * @param now_us: Current monotonic time in microseconds
+ * @param retry_at_us: Set to the wake-up time when returning USBX_SIM_RETRY
+ * @return enum usbx_transfer_status value, or USBX_SIM_RETRY
+ */
+typedef int (*usbx_sim_handler)(void *cls, struct usbx_transfer *xfer,
+                                uint64_t now_us, uint64_t *retry_at_us);
+
+/**
+ * @brief Called on the endpoint thread when a transfer ends without its
+ *        handler completing it (cancelled, timed out or device stopping)
+ * @param cls: Closure from the endpoint configuration
+ * @param xfer: Transfer about to complete with its final status
+ */
+typedef void (*usbx_sim_abort_handler)(void *cls, struct usbx_transfer *xfer);
+
+/**
+ * @struct usbx_sim_endpoint_config
+ * @brief Description of one simulated endpoint
+ */
+struct usbx_sim_endpoint_config {
+    unsigned char address;      /**< Endpoint address including direction bit */
+    unsigned char type;         /**< enum usbx_transfer_type */
+    int max_packet_size;        /**< wMaxPacketSize in bytes */
+    size_t message_size;        /**< Default IN source: bytes per message, 0 = endless */
+    unsigned int latency_us;    /**< Startup latency when the endpoint was idle */
+    unsigned int overhead_us;   /**< Fixed cost of every transfer */
+    uint64_t bytes_per_sec;     /**< Data rate limit, 0 = unlimited */
+    unsigned int interval_us;   /**< Isochronous service interval, 0 = 125 us */
+    unsigned int jitter_us;     /**< Isochronous completion jitter (uniform 0..jitter) */
+    unsigned int packet_error_ppm;  /**< Isochronous packets failing per million */
+    usbx_sim_handler handler;   /**< Custom behaviour, NULL for pattern source/sink */
+    void *handler_cls;          /**< Closure passed to @c handler and @c aborted */
+    usbx_sim_abort_handler aborted;  /**< Abort notification, or NULL */
+};
+
+/**
+ * @struct usbx_sim_config
+ * @brief Description of a simulated device
+ */
+struct usbx_sim_config {
+    const struct usbx_sim_endpoint_config *endpoints;  /**< Non-control endpoints */
+    int num_endpoints;                                 /**< Entries in @c endpoints */
+    usbx_sim_handler control_handler;  /**< Endpoint 0 handler, NULL stalls every request */
+    void *control_cls;                 /**< Closure passed to @c control_handler */
+    usbx_sim_abort_handler control_aborted;  /**< Endpoint 0 abort notification, or NULL */
+};
+
+/**
+ * @struct usbx_sim_endpoint_stats
+ * @brief Counters kept per simulated endpoint
+ */
+struct usbx_sim_endpoint_stats {
+    uint64_t transfers;        /**< Completed transfers */
+    uint64_t bytes;            /**< Bytes moved by completed transfers */
+    uint64_t pattern_errors;   /**< OUT bytes that did not match the pattern */
+    uint64_t missed_intervals; /**< Isochronous service intervals with nothing queued */
+    uint64_t packet_errors;    /**< Isochronous packets completed with an error */
+    int max_queue_depth;       /**< Highest number of queued transfers seen */
+};
+
+/**
+ * @brief Create a simulated device and start its endpoint threads
+ * @param config: Device description; copied, so it may live on the stack
+ * @return New device, or NULL on invalid configuration or allocation failure
+ */
+struct usbx_device *usbx_sim_device_create(const struct usbx_sim_config *config);
+
+/**
+ * @brief Read the counters of a simulated endpoint
+ * @param dev: Device created by usbx_sim_device_create()
+ * @param endpoint: Endpoint address including direction bit
+ * @param stats: Receives a snapshot of the counters
+ * @return USBX_SUCCESS, or USBX_ERROR_NOT_FOUND for unknown endpoints
+ */
+int usbx_sim_get_endpoint_stats(struct usbx_device *dev, unsigned char endpoint,
+                                struct usbx_sim_endpoint_stats *stats);
+
+/**
+ * @brief Byte of the reference pattern at a stream offset
+ * @param offset: Position in the endpoint byte stream
+ * @return Pattern byte
+ */
+unsigned char usbx_sim_pattern_byte(uint64_t offset);
+
+/**
+ * @brief Fill a buffer with the reference pattern
+ * @param buffer: Destination
+ * @param length: Number of bytes to write
+ * @param offset: Stream offset of buffer[0]
+ */
+void usbx_sim_fill_pattern(unsigned char *buffer, size_t length, uint64_t offset);
+
+/**
+ * @struct usbx_sim_dfu_config
+ * @brief Behaviour of a simulated DFU 1.1 device (see usbx_sim_dfu_create())
+ */
+struct usbx_sim_dfu_config {
+    size_t capacity;            /**< Largest image accepted, larger ones fail with errADDRESS */
+    int transfer_size;          /**< wTransferSize; longer DFU_DNLOAD blocks stall */
+    unsigned int poll_timeout_ms;       /**< bwPollTimeout reported while a block is written */
+    unsigned int manifest_timeout_ms;   /**< bwPollTimeout reported during manifestation */
+    int manifestation_tolerant; /**< Return to dfuIDLE after manifestation, else wait for reset */
+};
+
+/**
+ * @struct usbx_sim_dfu_stats
+ * @brief Counters of a simulated DFU device
+ */
+struct usbx_sim_dfu_stats {
+    int state;                  /**< Current bState */
+    uint64_t blocks;            /**< DFU_DNLOAD requests with data */
+    uint64_t status_requests;   /**< DFU_GETSTATUS requests */
+    uint64_t early_polls;       /**< DFU_GETSTATUS requests sent before bwPollTimeout elapsed */
+    uint64_t manifested;        /**< Completed manifestations */
+    size_t image_size;          /**< Bytes of the current or last downloaded image */
+};
+
+struct usbx_sim_dfu;
+
+/**
+ * @brief Create the state of a simulated DFU device in dfuIDLE
+ *
+ * Install it as the control handler of a simulated device:
+ * @code
+ * config.control_handler = usbx_sim_dfu_handler;
+ * config.control_cls = dfu;
+ * @endcode
+ * Each data block takes @c poll_timeout_ms to "write"; a DFU_GETSTATUS
+ * arriving before that is counted in early_polls and answered with
+ * dfuDNBUSY again.
+ *
+ * @param config: Device behaviour; copied
+ * @return New state, or NULL on invalid configuration or allocation failure
+ */
+struct usbx_sim_dfu *usbx_sim_dfu_create(const struct usbx_sim_dfu_config *config);
+
+/**
+ * @brief Free a simulated DFU device; the simulated device using it must be destroyed first
+ * @param dfu: State from usbx_sim_dfu_create(), or NULL
+ */
+void usbx_sim_dfu_destroy(struct usbx_sim_dfu *dfu);
+
+/**
+ * @brief Control handler implementing the DFU 1.1 download state machine
+ * @see usbx_sim_handler
+ */
+int usbx_sim_dfu_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                         uint64_t *retry_at_us);
+
+/**
+ * @brief Read the counters of a simulated DFU device
+ * @param dfu: State from usbx_sim_dfu_create()
+ * @param stats: Receives a snapshot of the counters
+ */
+void usbx_sim_dfu_get_stats(struct usbx_sim_dfu *dfu, struct usbx_sim_dfu_stats *stats);
+
+/**
+ * @brief Image received by a simulated DFU device
+ * @param dfu: State from usbx_sim_dfu_create()
+ * @param size: Receives the number of bytes received so far
+ * @return Image buffer, valid until the next download starts or the device is freed
+ */
+const unsigned char *usbx_sim_dfu_image(struct usbx_sim_dfu *dfu, size_t *size);
+
+/**
+ * @struct usbx_sim_msc_config
+ * @brief Behaviour of a simulated Bulk-Only mass-storage device (see usbx_sim_msc_create())
+ */
+struct usbx_sim_msc_config {
+    uint32_t block_size;        /**< Logical block length, 0 = 512 */
+    uint32_t block_count;       /**< Number of logical blocks */
+    unsigned int latency_us;    /**< Bulk endpoint startup latency (usbx_sim_msc_device_create()) */
+};
+
+/**
+ * @struct usbx_sim_msc_stats
+ * @brief Counters of a simulated mass-storage device
+ */
+struct usbx_sim_msc_stats {
+    uint64_t commands;          /**< Valid CBWs received */
+    uint64_t reads;             /**< READ(10) commands */
+    uint64_t writes;            /**< WRITE(10) commands */
+    uint64_t blocks_read;       /**< Blocks sent by READ(10) */
+    uint64_t blocks_written;    /**< Blocks received by WRITE(10) */
+    uint64_t failed;            /**< Commands answered with a failed CSW */
+    uint64_t invalid_cbws;      /**< Invalid CBWs, after which both pipes stall until reset */
+    uint64_t resets;            /**< Bulk-Only Mass Storage Reset requests */
+};
+
+struct usbx_sim_msc;
+
+/**
+ * @brief Create the state of a simulated mass-storage device with a zeroed disk
+ *
+ * The device implements one logical unit answering TEST UNIT READY,
+ * INQUIRY, REQUEST SENSE, READ CAPACITY(10), READ(10) and WRITE(10).
+ * Install usbx_sim_msc_bulk_handler() on a bulk IN and a bulk OUT endpoint
+ * and usbx_sim_msc_control_handler() on endpoint 0, or use
+ * usbx_sim_msc_device_create().
+ *
+ * @param config: Device behaviour; copied
+ * @return New state, or NULL on invalid configuration or allocation failure
+ */
+struct usbx_sim_msc *usbx_sim_msc_create(const struct usbx_sim_msc_config *config);
+
+/**
+ * @brief Free a simulated mass-storage device; the simulated device using it must be destroyed first
+ * @param msc: State from usbx_sim_msc_create(), or NULL
+ */
+void usbx_sim_msc_destroy(struct usbx_sim_msc *msc);
+
+/**
+ * @brief Bulk handler for both data endpoints; IN transfers wait while the device has nothing to send
+ * @see usbx_sim_handler
+ */
+int usbx_sim_msc_bulk_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                              uint64_t *retry_at_us);
+
+/**
+ * @brief Control handler for reset, GET MAX LUN and CLEAR_FEATURE(ENDPOINT_HALT)
+ * @see usbx_sim_handler
+ */
+int usbx_sim_msc_control_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                                 uint64_t *retry_at_us);
+
+/**
+ * @brief Create a simulated device with bulk endpoints 0x81 and 0x02 served by @p msc
+ * @param msc: State from usbx_sim_msc_create(); must outlive the device
+ * @return New device, or NULL
+ */
+struct usbx_device *usbx_sim_msc_device_create(struct usbx_sim_msc *msc);
+
+/**
+ * @brief Read the counters of a simulated mass-storage device
+ * @param msc: State from usbx_sim_msc_create()
+ * @param stats: Receives a snapshot of the counters
+ */
+void usbx_sim_msc_get_stats(struct usbx_sim_msc *msc, struct usbx_sim_msc_stats *stats);
+
+/**
+ * @brief Disk contents of a simulated mass-storage device
+ * @param msc: State from usbx_sim_msc_create()
+ * @return block_size * block_count bytes, valid until the state is freed
+ */
+unsigned char *usbx_sim_msc_disk(struct usbx_sim_msc *msc);
+
+/**
+ * @struct usbx_sim_cdc_stats
+ * @brief State and counters of a simulated CDC-ACM device
+ */
+struct usbx_sim_cdc_stats {
+    unsigned char line_coding[7];   /**< Last SET_LINE_CODING data */
+    int control_lines;              /**< Last SET_CONTROL_LINE_STATE wValue */
+    uint64_t line_coding_requests;  /**< SET_LINE_CODING requests */
+    uint64_t received;              /**< Bytes received on the OUT endpoint */
+    uint64_t sent;                  /**< Bytes sent on the IN endpoint */
+    uint64_t zero_packets;          /**< Zero-length OUT packets */
+};
+
+struct usbx_sim_cdc;
+
+/**
+ * @brief Create the state of a simulated CDC-ACM serial loopback
+ *
+ * Bytes written to the OUT endpoint, and bytes passed to
+ * usbx_sim_cdc_inject(), are sent back on the IN endpoint; IN transfers
+ * wait while nothing is buffered. The control handler accepts the ACM line
+ * requests.
+ *
+ * @param capacity: Bytes buffered before OUT transfers wait
+ * @return New state, or NULL on allocation failure
+ */
+struct usbx_sim_cdc *usbx_sim_cdc_create(size_t capacity);
+
+/**
+ * @brief Free a simulated CDC-ACM device; the simulated device using it must be destroyed first
+ * @param cdc: State from usbx_sim_cdc_create(), or NULL
+ */
+void usbx_sim_cdc_destroy(struct usbx_sim_cdc *cdc);
+
+/**
+ * @brief Create a simulated device with bulk endpoints 0x81 and 0x02 served by @p cdc
+ * @param cdc: State from usbx_sim_cdc_create(); must outlive the device
+ * @param max_packet_size: wMaxPacketSize of the bulk endpoints
+ * @return New device, or NULL
+ */
+struct usbx_device *usbx_sim_cdc_device_create(struct usbx_sim_cdc *cdc, int max_packet_size);
+
+/**
+ * @brief Queue device output as if the serial line had received it
+ * @param cdc: State from usbx_sim_cdc_create()
+ * @param data: Bytes to send on the IN endpoint
+ * @param length: Number of bytes
+ * @return Bytes queued; less than @p length when the buffer is full
+ */
+size_t usbx_sim_cdc_inject(struct usbx_sim_cdc *cdc, const void *data, size_t length);
+
+/**
+ * @brief Read the state and counters of a simulated CDC-ACM device
+ * @param cdc: State from usbx_sim_cdc_create()
+ * @param stats: Receives a snapshot
+ */
+void usbx_sim_cdc_get_stats(struct usbx_sim_cdc *cdc, struct usbx_sim_cdc_stats *stats);
+
+#endif // USBX_SIM_H
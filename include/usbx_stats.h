@@ -0,0 +1,123 @@
+/**
+ * @file usbx_stats.h
+ * @brief Always-on transfer statistics per handle and endpoint
+ *
+ * Every open handle counts the transfers of its device per endpoint:
+ * completions by status, bytes moved, errors by usbx_error code (the
+ * libusb codes), failed submissions, and a histogram of the time from
+ * submission to completion. Counters are updated with relaxed atomic
+ * additions from the transfer path, without locks, and are never reset,
+ * so they can be exported as Prometheus counters.
+ *
+ * Endpoints are counted in USBX_STATS_ENDPOINTS slots: endpoint 0 (control
+ * requests in both directions) and the 15 OUT and 15 IN endpoints.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_STATS_H
+#define USBX_STATS_H
+
+#include <stdint.h>
+
+#include "usbx_backend.h"
+
+/** @brief Endpoint slots: 0x00-0x0f and 0x80-0x8f (0x80 shares slot 0 with 0x00) */
+#define USBX_STATS_ENDPOINTS 32
+
+/** @brief Completion statuses counted (enum usbx_transfer_status) */
+#define USBX_STATS_STATUSES 7
+
+/** @brief Error slots: index -code for USBX_ERROR_IO..USBX_ERROR_MISMATCH, 0 for others */
+#define USBX_STATS_ERRORS 14
+
+/** @brief Latency histogram buckets, the last one unbounded */
+#define USBX_STATS_LATENCY_BUCKETS 17
+
+/** @brief Upper bounds of the bounded latency buckets in microseconds */
+extern const uint64_t usbx_stats_latency_bounds_us[USBX_STATS_LATENCY_BUCKETS - 1];
+
+/**
+ * @struct usbx_stats_endpoint
+ * @brief Counters of one endpoint, or summed over a device
+ */
+struct usbx_stats_endpoint {
+    unsigned char endpoint;      /**< Endpoint address (0 for control and for sums) */
+    uint64_t transfers;          /**< Completed transfers, whatever their status */
+    uint64_t bytes;              /**< Bytes moved by completed transfers */
+    uint64_t statuses[USBX_STATS_STATUSES];  /**< Completions by enum usbx_transfer_status */
+    uint64_t errors[USBX_STATS_ERRORS];      /**< Failures by -usbx_error, cancellations excluded */
+    uint64_t submit_errors;      /**< Submissions the backend refused (also in @c errors) */
+    uint64_t latency_sum_us;     /**< Sum of submission-to-completion times */
+    uint64_t latency[USBX_STATS_LATENCY_BUCKETS];  /**< Completions per latency bucket */
+};
+
+struct usbx_stats;
+
+/**
+ * @brief Create zeroed statistics
+ * @return Statistics, or NULL on allocation failure
+ */
+struct usbx_stats *usbx_stats_create(void);
+
+/**
+ * @brief Free statistics; their device must have been detached and destroyed
+ * @param stats: Statistics, or NULL
+ */
+void usbx_stats_free(struct usbx_stats *stats);
+
+/**
+ * @brief Count the transfers of a device
+ * @param stats: Statistics
+ * @param dev: Device
+ */
+void usbx_stats_attach(struct usbx_stats *stats, struct usbx_device *dev);
+
+/**
+ * @brief Stop counting a device's transfers; call before destroying the device
+ * @param dev: Device
+ */
+void usbx_stats_detach(struct usbx_device *dev);
+
+/**
+ * @brief Count a completion; called from the transfer path of attached devices
+ * @param xfer: Completed transfer, stamped with @c submit_us on submission
+ * @param now_us: Completion time
+ */
+void usbx_stats_record(struct usbx_transfer *xfer, uint64_t now_us);
+
+/**
+ * @brief Count a submission the backend refused
+ * @param xfer: Transfer
+ * @param error: Negative usbx_error
+ */
+void usbx_stats_record_error(struct usbx_transfer *xfer, int error);
+
+/**
+ * @brief Read the counters of the endpoints that saw traffic, in address order
+ * @param stats: Statistics
+ * @param endpoints: Receives up to USBX_STATS_ENDPOINTS entries
+ * @param total: Receives the sums over all endpoints (may be NULL)
+ * @return Entries written to @p endpoints
+ */
+int usbx_stats_get(struct usbx_stats *stats, struct usbx_stats_endpoint *endpoints,
+                   struct usbx_stats_endpoint *total);
+
+/**
+ * @brief Estimate a latency quantile from a histogram
+ * @param counters: Counters whose histogram is read
+ * @param quantile: Quantile in per mille (500 for the median)
+ * @return Upper bound of the bucket holding the quantile in microseconds, the
+ *         largest bound for the unbounded bucket, or 0 without completions
+ */
+uint64_t usbx_stats_latency_quantile_us(const struct usbx_stats_endpoint *counters,
+                                        unsigned int quantile);
+
+/**
+ * @brief Name of a transfer status for reports
+ * @param status: enum usbx_transfer_status value
+ * @return Static string such as "timed_out"
+ */
+const char *usbx_stats_status_name(int status);
+
+#endif // USBX_STATS_H
@@ -0,0 +1,166 @@
+/**
+ * @file usbx_trace.h
+ * @brief Session recording into a compact binary trace and offline replay
+ *
+ * While recording, every REST request (method, path, query arguments,
+ * headers, body and the status it got) and every control, bulk and
+ * interrupt transfer of the handles opened since the recording started
+ * (submission time, setup and OUT data, completion time, status and IN
+ * data) is appended to a trace file. Transfer data is cut to
+ * @c max_payload bytes per transfer; request bodies are kept whole.
+ * Isochronous transfers are not recorded.
+ *
+ * A loaded trace is replayed against simulated devices that reproduce the
+ * recorded endpoints: each transfer reaching them is matched against the
+ * next recorded transfer on its endpoint and completed with the recorded
+ * status and IN data. Traces with requests are replayed through the REST
+ * router; traces without are replayed by resubmitting the recorded
+ * transfers in their recorded order. Either way the replay runs as fast as
+ * possible, or with USBX_REPLAY_REALTIME at the recorded pace, which makes
+ * a recording a repeatable benchmark workload and a regression test: the
+ * result counts requests and transfers that no longer behave as recorded.
+ *
+ * File layout: the magic "USBXTRC1", a version, then records of one kind
+ * byte and the time since the recording started, all integers as LEB128
+ * varints (signed ones zigzag-encoded) and strings and payloads prefixed
+ * with their length.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_TRACE_H
+#define USBX_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usbx_backend.h"
+#include "usbx_http.h"
+
+/** @brief Format version written after the magic */
+#define USBX_TRACE_VERSION 1
+
+/** @brief Default data bytes kept per transfer */
+#define USBX_TRACE_DEFAULT_MAX_PAYLOAD 4096
+
+/** @brief usbx_trace_replay() flag: keep the recorded pace instead of running flat out */
+#define USBX_REPLAY_REALTIME 0x01
+
+/**
+ * @struct usbx_trace_info
+ * @brief Contents of a loaded trace
+ */
+struct usbx_trace_info {
+    int devices;                 /**< Recorded devices (handles) */
+    uint64_t requests;           /**< REST requests */
+    uint64_t transfers;          /**< Transfer submissions */
+    uint64_t payload_bytes;      /**< Payload bytes kept in the trace */
+    uint64_t duration_us;        /**< Time from the start of recording to the last record */
+};
+
+/**
+ * @struct usbx_replay_result
+ * @brief Outcome of a replay
+ */
+struct usbx_replay_result {
+    uint64_t requests;           /**< Requests dispatched */
+    uint64_t transfers;          /**< Transfers that reached the simulated devices */
+    uint64_t status_mismatches;  /**< Requests or transfers ending with another status */
+    uint64_t data_mismatches;    /**< Transfers whose length or OUT data differed, or unexpected ones */
+    uint64_t elapsed_us;         /**< Replay time */
+    uint64_t recorded_us;        /**< Duration of the recording */
+};
+
+struct usbx_trace;
+
+/**
+ * @brief Start recording to a file (created or truncated)
+ * @param path: Trace file
+ * @param max_payload: Data bytes kept per transfer, 0 for the default
+ * @return USBX_SUCCESS, USBX_ERROR_BUSY if already recording, USBX_ERROR_IO or USBX_ERROR_NO_MEM
+ */
+int usbx_trace_start(const char *path, size_t max_payload);
+
+/**
+ * @brief Stop recording, detach every device and close the file
+ * @return USBX_SUCCESS, USBX_ERROR_NOT_FOUND if not recording, or USBX_ERROR_IO if
+ *         the file could not be written completely
+ */
+int usbx_trace_stop(void);
+
+/**
+ * @brief Whether a recording is running
+ * @return Non-zero while recording
+ */
+int usbx_trace_active(void);
+
+/**
+ * @brief Record the transfers of a device opened as a handle; no-op when not recording
+ * @param dev: Device
+ * @param handle_id: Handle id the REST requests use for it
+ */
+void usbx_trace_attach(struct usbx_device *dev, int handle_id);
+
+/**
+ * @brief Stop recording a device; must be called before the device is destroyed
+ * @param dev: Device
+ */
+void usbx_trace_detach(struct usbx_device *dev);
+
+/**
+ * @brief Record a transfer event; called from the transfer path for traced devices
+ * @param xfer: Transfer being submitted or completed
+ * @param event: USBX_TAP_SUBMIT, USBX_TAP_COMPLETE or USBX_TAP_ERROR
+ * @param error: For USBX_TAP_ERROR, the usbx_error the submission failed with
+ */
+void usbx_trace_transfer(const struct usbx_transfer *xfer, int event, int error);
+
+/**
+ * @brief Record a dispatched request; called by usbx_http_dispatch() while recording
+ * @param req: Request
+ * @param status: HTTP status of the response
+ * @param start_us: usbx_now_us() when dispatch started
+ */
+void usbx_trace_request(const struct usbx_http_request *req, int status, uint64_t start_us);
+
+/**
+ * @brief Load a trace file
+ * @param path: Trace file
+ * @param error: Receives USBX_ERROR_IO, USBX_ERROR_INVALID_PARAM (not a trace or
+ *               corrupt) or USBX_ERROR_NO_MEM on failure; may be NULL
+ * @return Trace, or NULL on failure
+ */
+struct usbx_trace *usbx_trace_load(const char *path, int *error);
+
+/**
+ * @brief Free a loaded trace
+ * @param trace: Trace, or NULL
+ */
+void usbx_trace_free(struct usbx_trace *trace);
+
+/**
+ * @brief Describe a loaded trace
+ * @param trace: Trace
+ * @param info: Receives the description
+ */
+void usbx_trace_get_info(const struct usbx_trace *trace, struct usbx_trace_info *info);
+
+/**
+ * @brief Replay a trace against simulated devices
+ *
+ * The devices are opened as handles for the duration of the replay and
+ * requests for recorded handle ids are rewritten to them; recorded
+ * POST /handles requests are skipped. Response streams are read until
+ * they end or pause. Transfer replays skip submissions that failed in the
+ * recording, and in both modes recorded timeouts take their real time.
+ *
+ * @param trace: Trace
+ * @param flags: USBX_REPLAY_* flags
+ * @param result: Receives the outcome
+ * @return USBX_SUCCESS, USBX_ERROR_NO_MEM, or the error creating a device or
+ *         submitting a transfer
+ */
+int usbx_trace_replay(const struct usbx_trace *trace, unsigned int flags,
+                      struct usbx_replay_result *result);
+
+#endif // USBX_TRACE_H
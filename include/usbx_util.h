@@ -0,0 +1,99 @@
+/**
+ * @file usbx_util.h
+ * @brief Small shared helpers (monotonic time, sleeping, waiting, byte order) for usbX modules
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifndef USBX_UTIL_H
+#define USBX_UTIL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+struct timespec;
+
+/**
+ * @brief Current value of the monotonic clock in microseconds
+ * @return Microseconds since an arbitrary fixed point in the past
+ */
+uint64_t usbx_now_us(void);
+
+/**
+ * @brief Sleep for at least the given number of microseconds
+ * @param usec: Duration to sleep; 0 returns immediately
+ */
+void usbx_sleep_us(uint64_t usec);
+
+/**
+ * @brief Initialise a condition variable that waits against the monotonic clock
+ * @param cond: Condition variable
+ */
+void usbx_cond_init_monotonic(pthread_cond_t *cond);
+
+/**
+ * @brief Absolute monotonic deadline for pthread_cond_timedwait()
+ * @param ts: Receives the deadline
+ * @param timeout_ms: Milliseconds from now
+ */
+void usbx_deadline_ms(struct timespec *ts, int timeout_ms);
+
+/** @brief Store a 16-bit value little-endian */
+static inline void usbx_put_le16(unsigned char *out, uint16_t value) {
+    out[0] = (unsigned char)value;
+    out[1] = (unsigned char)(value >> 8);
+}
+
+/** @brief Store a 32-bit value little-endian */
+static inline void usbx_put_le32(unsigned char *out, uint32_t value) {
+    usbx_put_le16(out, (uint16_t)value);
+    usbx_put_le16(out + 2, (uint16_t)(value >> 16));
+}
+
+/** @brief Store a 64-bit value little-endian */
+static inline void usbx_put_le64(unsigned char *out, uint64_t value) {
+    usbx_put_le32(out, (uint32_t)value);
+    usbx_put_le32(out + 4, (uint32_t)(value >> 32));
+}
+
+/** @brief Load a little-endian 16-bit value */
+static inline uint16_t usbx_get_le16(const unsigned char *in) {
+    return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+/** @brief Load a little-endian 32-bit value */
+static inline uint32_t usbx_get_le32(const unsigned char *in) {
+    return (uint32_t)usbx_get_le16(in) | ((uint32_t)usbx_get_le16(in + 2) << 16);
+}
+
+/** @brief Load a little-endian 64-bit value */
+static inline uint64_t usbx_get_le64(const unsigned char *in) {
+    return (uint64_t)usbx_get_le32(in) | ((uint64_t)usbx_get_le32(in + 4) << 32);
+}
+
+/** @brief Store a 16-bit value big-endian */
+static inline void usbx_put_be16(unsigned char *out, uint16_t value) {
+    out[0] = (unsigned char)(value >> 8);
+    out[1] = (unsigned char)value;
+}
+
+/** @brief Store a 32-bit value big-endian */
+static inline void usbx_put_be32(unsigned char *out, uint32_t value) {
+    out[0] = (unsigned char)(value >> 24);
+    out[1] = (unsigned char)(value >> 16);
+    out[2] = (unsigned char)(value >> 8);
+    out[3] = (unsigned char)value;
+}
+
+/** @brief Load a big-endian 16-bit value */
+static inline uint16_t usbx_get_be16(const unsigned char *in) {
+    return (uint16_t)((in[0] << 8) | in[1]);
+}
+
+/** @brief Load a big-endian 32-bit value */
+static inline uint32_t usbx_get_be32(const unsigned char *in) {
+    return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) |
+           (uint32_t)in[3];
+}
+
+#endif // USBX_UTIL_H
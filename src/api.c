@@ -0,0 +1,307 @@
+/**
+ * @file api.c
+ * @brief Route registration, shared request helpers and the handle routes
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_breaker.h"
+#include "usbx_buf.h"
+#include "usbx_config.h"
+#include "usbx_discovery.h"
+#include "usbx_json.h"
+
+/** @brief Upper bound of handles listed by GET /handles */
+#define API_MAX_LISTED_HANDLES 1024
+
+/** @brief Blob store referenced by operations and served under /blobs */
+static struct usbx_blob_store *api_blob_store = NULL;
+
+int usbx_api_register_all(struct usbx_http_router *router) {
+    if (usbx_api_register_handles(router) < 0 || usbx_api_register_interrupt(router) < 0 ||
+        usbx_api_register_pubsub(router) < 0 || usbx_api_register_batch(router) < 0 ||
+        usbx_api_register_fanout(router) < 0 || usbx_api_register_blobs(router) < 0 ||
+        usbx_api_register_bulk(router) < 0 || usbx_api_register_dfu(router) < 0 ||
+        usbx_api_register_blocks(router) < 0 || usbx_api_register_serial(router) < 0 ||
+        usbx_api_register_capture(router) < 0 || usbx_api_register_faults(router) < 0 ||
+        usbx_api_register_retry(router) < 0 || usbx_api_register_breaker(router) < 0 ||
+        usbx_api_register_latency(router) < 0 || usbx_api_register_stats(router) < 0 ||
+        usbx_api_register_sched(router) < 0 || usbx_api_register_quotas(router) < 0 ||
+        usbx_api_register_budget(router) < 0 || usbx_api_register_config(router) < 0 ||
+        usbx_api_register_iso(router) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void usbx_api_set_blob_store(struct usbx_blob_store *store) {
+    api_blob_store = store;
+}
+
+struct usbx_blob_store *usbx_api_blob_store(void) {
+    return api_blob_store;
+}
+
+struct usbx_handle *usbx_api_get_handle(const struct usbx_http_request *req,
+                                        struct usbx_http_response *resp) {
+    const char *text = usbx_http_param(req, "id");
+    char *end;
+
+    long handle_id = text ? strtol(text, &end, 10) : 0;
+    if (!text || *end != '\0' || handle_id <= 0 || handle_id > 0x7fffffffL) {
+        usbx_http_set_error(resp, 400, "Invalid handle id", 0);
+        return NULL;
+    }
+
+    struct usbx_handle *handle = usbx_handle_get((int)handle_id);
+    if (!handle) {
+        usbx_http_set_error(resp, 404, "Unknown handle", USBX_ERROR_NOT_FOUND);
+    }
+    return handle;
+}
+
+struct usbx_handle *usbx_api_get_device(const struct usbx_http_request *req,
+                                        struct usbx_http_response *resp) {
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    unsigned int retry_after_ms = 0;
+
+    if (handle && !usbx_breaker_admit(handle->breaker, &retry_after_ms)) {
+        usbx_handle_put(handle);
+        usbx_api_set_circuit_open(resp, retry_after_ms);
+        return NULL;
+    }
+    return handle;
+}
+
+void usbx_api_set_circuit_open(struct usbx_http_response *resp, unsigned int retry_after_ms) {
+    char seconds[16];
+
+    usbx_http_set_error(resp, 503, "Device is failing; circuit open", USBX_ERROR_BUSY);
+    snprintf(seconds, sizeof(seconds), "%u", (retry_after_ms + 999) / 1000);
+    usbx_http_add_header(resp, "Retry-After", seconds);
+}
+
+void usbx_api_set_budget_exhausted(struct usbx_http_response *resp, int error) {
+    if (error != USBX_ERROR_BUSY) {
+        usbx_http_set_error(resp, 413, "Request exceeds the memory budget", error);
+        return;
+    }
+    usbx_http_set_error(resp, 503, "Memory budget exhausted", error);
+    usbx_http_add_header(resp, "Retry-After", "1");
+}
+
+int usbx_api_parse_endpoint(const char *text) {
+    char *end;
+
+    if (!text || !*text) {
+        return -1;
+    }
+    long endpoint = strtol(text, &end, 0);
+    if (*end != '\0' || endpoint < 0 || endpoint > 0xff || (endpoint & 0x70) != 0) {
+        return -1;
+    }
+    return (int)endpoint;
+}
+
+struct usbx_json *usbx_api_parse_body(const struct usbx_http_request *req,
+                                      struct usbx_http_response *resp) {
+    size_t error_offset = 0;
+
+    struct usbx_json *json = usbx_json_parse((const char *)req->body, req->body_length,
+                                             &error_offset);
+    if (!json || json->type != USBX_JSON_OBJECT) {
+        char message[64];
+        snprintf(message, sizeof(message), "Body is not a JSON object (offset %zu)",
+                 json ? (size_t)0 : error_offset);
+        usbx_json_free(json);
+        usbx_http_set_error(resp, 400, message, 0);
+        return NULL;
+    }
+    return json;
+}
+
+/* GET /handles */
+static void list_handles(void *cls, const struct usbx_http_request *req,
+                         struct usbx_http_response *resp) {
+    (void)cls;
+    (void)req;
+    int *ids = malloc(API_MAX_LISTED_HANDLES * sizeof(int));
+    if (!ids) {
+        usbx_http_set_json(resp, 500, NULL, 0);
+        return;
+    }
+    int count = usbx_handle_list(ids, API_MAX_LISTED_HANDLES);
+    if (count > API_MAX_LISTED_HANDLES) {
+        count = API_MAX_LISTED_HANDLES;
+    }
+
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"handles\": [");
+    const char *separator = "";
+    for (int i = 0; i < count; i++) {
+        struct usbx_handle *handle = usbx_handle_get(ids[i]);
+        if (!handle) {
+            continue;   // closed meanwhile
+        }
+        usbx_buf_printf(&buf, "%s{\"handle_id\": %d, \"vid\": %u, \"pid\": %u, \"serial\": ",
+                        separator, handle->handle_id, handle->info.vid, handle->info.pid);
+        usbx_buf_json_string(&buf, handle->info.serial);
+        usbx_buf_printf(&buf, ", \"backend\": ");
+        usbx_buf_json_string(&buf, handle->dev->ops->name);
+        usbx_buf_printf(&buf, "}");
+        separator = ", ";
+        usbx_handle_put(handle);
+    }
+    usbx_buf_printf(&buf, "]}");
+    free(ids);
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+#ifdef USE_DEPS
+/** @brief libusb context used to open devices */
+static libusb_context *api_libusb_context = NULL;
+
+void usbx_api_set_libusb_context(libusb_context *ctx) {
+    api_libusb_context = ctx;
+}
+
+/* Read the identity of an open libusb device */
+static void read_device_info(libusb_device_handle *usb_handle, struct usbx_device_info *info) {
+    libusb_device *usb_dev = libusb_get_device(usb_handle);
+    struct libusb_device_descriptor desc;
+
+    memset(info, 0, sizeof(*info));
+    info->bus = libusb_get_bus_number(usb_dev);
+    info->address = libusb_get_device_address(usb_dev);
+    if (libusb_get_device_descriptor(usb_dev, &desc) != LIBUSB_SUCCESS) {
+        return;
+    }
+    info->vid = desc.idVendor;
+    info->pid = desc.idProduct;
+    if (desc.iSerialNumber != 0 &&
+        libusb_get_string_descriptor_ascii(usb_handle, desc.iSerialNumber,
+                                           (unsigned char *)info->serial,
+                                           sizeof(info->serial)) < 0) {
+        info->serial[0] = '\0';
+    }
+}
+
+int usbx_api_add_usb_handle(libusb_device_handle *usb_handle) {
+    int result = libusb_set_auto_detach_kernel_driver(usb_handle, 1);
+    if (result != LIBUSB_SUCCESS && result != LIBUSB_ERROR_NOT_SUPPORTED) {
+        libusb_close(usb_handle);
+        return result;
+    }
+
+    struct usbx_device_info info;
+    read_device_info(usb_handle, &info);
+    struct usbx_device *dev = usbx_libusb_device_create(usb_handle);
+    if (!dev) {
+        libusb_close(usb_handle);
+        return USBX_ERROR_NO_MEM;
+    }
+    int handle_id = usbx_handle_add(dev, &info);
+    if (handle_id < 0) {
+        usbx_device_destroy(dev);
+    }
+    return handle_id;
+}
+
+libusb_context *usbx_api_libusb_context(void) {
+    return api_libusb_context;
+}
+
+/* Open the device through the catalog, which waits only for matching devices */
+static int open_discovered(long vid, long pid, const char *serial,
+                           libusb_device_handle **usb_handle) {
+    struct usbx_discovery_device device;
+    int result = usbx_discovery_find((int)vid, (int)pid, serial,
+                                     usbx_config_current()->discovery_timeout_ms, &device);
+    if (result != USBX_SUCCESS) {
+        return result;
+    }
+    result = libusb_open(device.ref, usb_handle);
+    usbx_discovery_put(&device);
+    return result;
+}
+
+/* POST /handles?vid=&pid=[&serial=] */
+static void open_handle(void *cls, const struct usbx_http_request *req,
+                        struct usbx_http_response *resp) {
+    (void)cls;
+    long vid = usbx_http_arg_long(req, "vid", -1);
+    long pid = usbx_http_arg_long(req, "pid", -1);
+    const char *serial = usbx_http_arg(req, "serial");
+    if (vid < 0 || vid > 0xffff || pid < 0 || pid > 0xffff) {
+        usbx_http_set_error(resp, 400, "vid and pid are required", 0);
+        return;
+    }
+
+    libusb_device_handle *usb_handle = NULL;
+    int result = USBX_ERROR_NOT_FOUND;
+    if (usbx_discovery_running() || serial) {
+        result = open_discovered(vid, pid, serial, &usb_handle);
+    } else {
+        usb_handle = libusb_open_device_with_vid_pid(api_libusb_context, (uint16_t)vid,
+                                                     (uint16_t)pid);
+    }
+    if (!usb_handle) {
+        usbx_http_set_error(resp, result == USBX_ERROR_NOT_FOUND ?
+                            404 : usbx_http_status_for_error(result),
+                            result == USBX_ERROR_NOT_FOUND ? "No matching device" :
+                            "Cannot open the device", result);
+        return;
+    }
+    int handle_id = usbx_api_add_usb_handle(usb_handle);
+    if (handle_id < 0) {
+        usbx_http_set_error(resp, usbx_http_status_for_error(handle_id),
+                            "Cannot open the device", handle_id);
+        return;
+    }
+
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"handle_id\": %d, \"status\": \"opened\"}", handle_id);
+    usbx_http_set_json_buf(resp, 201, &buf);
+}
+#endif
+
+/* DELETE /handles/{id} */
+static void close_handle(void *cls, const struct usbx_http_request *req,
+                         struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (!handle) {
+        return;
+    }
+    int handle_id = handle->handle_id;
+    usbx_handle_put(handle);
+
+    if (usbx_handle_remove(handle_id) != USBX_SUCCESS) {
+        usbx_http_set_error(resp, 404, "Unknown handle", USBX_ERROR_NOT_FOUND);
+        return;
+    }
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"handle_id\": %d, \"status\": \"closed\"}", handle_id);
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+int usbx_api_register_handles(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "GET", "/handles", list_handles, NULL) < 0 ||
+        usbx_http_route(router, "DELETE", "/handles/{id}", close_handle, NULL) < 0) {
+        return -1;
+    }
+#ifdef USE_DEPS
+    if (usbx_http_route(router, "POST", "/handles", open_handle, NULL) < 0) {
+        return -1;
+    }
+#endif
+    return 0;
+}
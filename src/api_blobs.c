@@ -0,0 +1,181 @@
+/**
+ * @file api_blobs.c
+ * @brief REST routes of the content-addressed blob store
+ *
+ * - PUT    /blobs?sha256=hex  store the request body; the optional digest is verified
+ * - GET    /blobs             store counters and blobs, most recently used first
+ * - GET    /blobs/{hash}      blob contents (application/octet-stream)
+ * - DELETE /blobs/{hash}      delete a blob
+ *
+ * Operations refer to stored blobs with "blob": "<sha256>" instead of
+ * inline base64 data (see usbx_ops.h).
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "usbx_api.h"
+#include "usbx_blob.h"
+#include "usbx_buf.h"
+#include "usbx_compress.h"
+
+/** @brief Upper bound of blobs listed by GET /blobs */
+#define API_MAX_LISTED_BLOBS 1024
+
+/* The configured store, or NULL after writing a 503 */
+static struct usbx_blob_store *get_store(struct usbx_http_response *resp) {
+    struct usbx_blob_store *store = usbx_api_blob_store();
+    if (!store) {
+        usbx_http_set_error(resp, 503, "Blob store is not configured", 0);
+    }
+    return store;
+}
+
+/* PUT /blobs?sha256=hex */
+static void put_blob(void *cls, const struct usbx_http_request *req,
+                     struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_blob_store *store = get_store(resp);
+    if (!store) {
+        return;
+    }
+
+    const char *expected = usbx_http_arg(req, "sha256");
+    char hash[USBX_SHA256_HEX_SIZE];
+    if (expected) {
+        usbx_sha256_hex(req->body, req->body_length, hash);
+        if (strcasecmp(expected, hash) != 0) {
+            usbx_http_set_error(resp, 400, "Body does not match the sha256 argument", 0);
+            return;
+        }
+    }
+
+    int result = usbx_blob_put(store, req->body, req->body_length, hash);
+    if (result == USBX_ERROR_OVERFLOW) {
+        usbx_http_set_error(resp, 413, "Blob is larger than the store capacity", result);
+    } else if (result == USBX_ERROR_NO_MEM) {
+        usbx_http_set_error(resp, 507, "Blobs in use leave no room", result);
+    } else if (result < 0) {
+        usbx_http_set_error(resp, 500, "Cannot write the blob", result);
+    } else {
+        struct usbx_buf buf;
+        usbx_buf_init(&buf);
+        usbx_buf_printf(&buf, "{\"sha256\": \"%s\", \"size\": %zu, \"created\": %s}", hash,
+                        req->body_length, result == 1 ? "true" : "false");
+        usbx_http_set_json_buf(resp, result == 1 ? 201 : 200, &buf);
+    }
+}
+
+/* GET /blobs */
+static void list_blobs(void *cls, const struct usbx_http_request *req,
+                       struct usbx_http_response *resp) {
+    (void)cls;
+    (void)req;
+    struct usbx_blob_store *store = get_store(resp);
+    if (!store) {
+        return;
+    }
+    struct usbx_blob_info *info = malloc(API_MAX_LISTED_BLOBS * sizeof(*info));
+    if (!info) {
+        usbx_http_set_json(resp, 500, NULL, 0);
+        return;
+    }
+
+    struct usbx_blob_stats stats;
+    usbx_blob_get_stats(store, &stats);
+    int count = usbx_blob_list(store, info, API_MAX_LISTED_BLOBS);
+    if (count > API_MAX_LISTED_BLOBS) {
+        count = API_MAX_LISTED_BLOBS;
+    }
+
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"capacity\": %llu, \"bytes\": %llu, \"count\": %d, \"hits\": %llu, "
+                    "\"misses\": %llu, \"evictions\": %llu, \"blobs\": [",
+                    (unsigned long long)stats.capacity, (unsigned long long)stats.bytes,
+                    stats.blobs, (unsigned long long)stats.hits,
+                    (unsigned long long)stats.misses, (unsigned long long)stats.evictions);
+    for (int i = 0; i < count; i++) {
+        usbx_buf_printf(&buf, "%s{\"sha256\": \"%s\", \"size\": %llu, \"users\": %d}",
+                        i > 0 ? ", " : "", info[i].hash, (unsigned long long)info[i].size,
+                        info[i].users);
+    }
+    usbx_buf_printf(&buf, "]}");
+    free(info);
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+static ssize_t blob_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    struct usbx_blob *blob = cls;
+    size_t size = usbx_blob_size(blob);
+
+    if (pos >= size) {
+        return USBX_HTTP_END_OF_STREAM;
+    }
+    size_t length = size - (size_t)pos < max ? size - (size_t)pos : max;
+    memcpy(buf, usbx_blob_data(blob) + pos, length);
+    return (ssize_t)length;
+}
+
+static void blob_free(void *cls) {
+    usbx_blob_release(cls);
+}
+
+/* GET /blobs/{hash} */
+static void get_blob(void *cls, const struct usbx_http_request *req,
+                     struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_blob_store *store = get_store(resp);
+    if (!store) {
+        return;
+    }
+    const char *hash = usbx_http_param(req, "hash");
+    struct usbx_blob *blob = usbx_blob_get(store, hash);
+    if (!blob) {
+        usbx_http_set_error(resp, 404, "Unknown blob", USBX_ERROR_NOT_FOUND);
+        return;
+    }
+
+    char etag[USBX_SHA256_HEX_SIZE + 2];
+    snprintf(etag, sizeof(etag), "\"%s\"", hash);
+    usbx_http_add_header(resp, "ETag", etag);
+    usbx_http_set_reader(resp, "application/octet-stream", blob_read, blob, blob_free);
+    usbx_compress_response(req, resp);
+}
+
+/* DELETE /blobs/{hash} */
+static void delete_blob(void *cls, const struct usbx_http_request *req,
+                        struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_blob_store *store = get_store(resp);
+    if (!store) {
+        return;
+    }
+    const char *hash = usbx_http_param(req, "hash");
+    if (usbx_blob_remove(store, hash) != USBX_SUCCESS) {
+        usbx_http_set_error(resp, 404, "Unknown blob", USBX_ERROR_NOT_FOUND);
+        return;
+    }
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"sha256\": ");
+    usbx_buf_json_string(&buf, hash);
+    usbx_buf_printf(&buf, ", \"status\": \"deleted\"}");
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+int usbx_api_register_blobs(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "PUT", "/blobs", put_blob, NULL) < 0 ||
+        usbx_http_route(router, "GET", "/blobs", list_blobs, NULL) < 0 ||
+        usbx_http_route(router, "GET", "/blobs/{hash}", get_blob, NULL) < 0 ||
+        usbx_http_route(router, "DELETE", "/blobs/{hash}", delete_blob, NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
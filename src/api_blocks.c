@@ -0,0 +1,201 @@
+/**
+ * @file api_blocks.c
+ * @brief REST routes for mass-storage block access
+ *
+ * - GET /handles/{id}/blocks                     unit geometry and cache statistics
+ * - GET /handles/{id}/blocks?lba=n&count=n       blocks (application/octet-stream)
+ * - PUT /handles/{id}/blocks?lba=n               body: whole blocks
+ *
+ * The first request on a handle opens the logical unit with the optional
+ * arguments in=ep, out=ep, interface=n and lun=n (defaults 0x81, 0x02, 0,
+ * 0); later requests reuse it, and its cache, until the handle is closed.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdlib.h>
+
+#include "usbx_api.h"
+#include "usbx_buf.h"
+#include "usbx_msc.h"
+#include "usbx_util.h"
+
+/** @brief Largest read or write served by one request */
+#define BLOCKS_MAX_REQUEST_BYTES (64 * 1024 * 1024)
+
+/* Open the handle's unit on first use; writes the error response on failure */
+static struct usbx_msc *get_unit(const struct usbx_http_request *req, struct usbx_handle *handle,
+                                 struct usbx_http_response *resp) {
+    pthread_mutex_lock(&handle->lock);
+    struct usbx_msc *msc = handle->msc;
+    pthread_mutex_unlock(&handle->lock);
+    if (msc) {
+        return msc;
+    }
+
+    struct usbx_msc_options opts;
+    usbx_msc_options_init(&opts);
+    const char *in = usbx_http_arg(req, "in");
+    const char *out = usbx_http_arg(req, "out");
+    int in_endpoint = in ? usbx_api_parse_endpoint(in) : opts.in_endpoint;
+    int out_endpoint = out ? usbx_api_parse_endpoint(out) : opts.out_endpoint;
+    opts.interface = (int)usbx_http_arg_long(req, "interface", 0);
+    opts.lun = (int)usbx_http_arg_long(req, "lun", 0);
+    if (in_endpoint <= 0 || !(in_endpoint & USBX_ENDPOINT_IN) || out_endpoint <= 0 ||
+        (out_endpoint & USBX_ENDPOINT_IN) || opts.interface < 0 || opts.interface > 0xff ||
+        opts.lun < 0 || opts.lun > 15) {
+        usbx_http_set_error(resp, 400, "Expected bulk IN and OUT endpoints, interface and LUN",
+                            USBX_ERROR_INVALID_PARAM);
+        return NULL;
+    }
+    opts.in_endpoint = (unsigned char)in_endpoint;
+    opts.out_endpoint = (unsigned char)out_endpoint;
+
+    // Open without the lock held; a concurrent first request may win the race
+    int error = USBX_SUCCESS;
+    struct usbx_msc *opened = usbx_msc_open(handle->dev, &opts, &error);
+    if (!opened) {
+        usbx_http_set_error(resp, usbx_http_status_for_error(error),
+                            "Could not open the mass-storage unit", error);
+        return NULL;
+    }
+    pthread_mutex_lock(&handle->lock);
+    if (!handle->msc) {
+        handle->msc = opened;
+        opened = NULL;
+    }
+    msc = handle->msc;
+    pthread_mutex_unlock(&handle->lock);
+    usbx_msc_close(opened);
+    return msc;
+}
+
+static void set_stats(struct usbx_http_response *resp, const struct usbx_msc_stats *stats) {
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"block_size\": %u, \"block_count\": %llu, \"commands\": %llu, "
+                    "\"blocks_read\": %llu, \"blocks_written\": %llu, \"cache_hits\": %llu, "
+                    "\"cache_misses\": %llu, \"read_ahead_blocks\": %llu, \"recoveries\": %llu, "
+                    "\"sense\": \"0x%06x\"}",
+                    stats->block_size, (unsigned long long)stats->block_count,
+                    (unsigned long long)stats->commands, (unsigned long long)stats->blocks_read,
+                    (unsigned long long)stats->blocks_written,
+                    (unsigned long long)stats->cache_hits,
+                    (unsigned long long)stats->cache_misses,
+                    (unsigned long long)stats->read_ahead_blocks,
+                    (unsigned long long)stats->recoveries, stats->sense);
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+/* Validate lba and a block count against the unit; writes 400 or 413 on failure */
+static int check_range(struct usbx_http_response *resp, const struct usbx_msc_stats *stats,
+                       long lba, long count) {
+    if (lba < 0 || count <= 0 || (uint64_t)lba >= stats->block_count ||
+        (uint64_t)count > stats->block_count - (uint64_t)lba) {
+        usbx_http_set_error(resp, 400, "Block range is outside the unit",
+                            USBX_ERROR_INVALID_PARAM);
+        return -1;
+    }
+    if ((uint64_t)count * stats->block_size > BLOCKS_MAX_REQUEST_BYTES) {
+        usbx_http_set_error(resp, 413, "Too many blocks for one request",
+                            USBX_ERROR_INVALID_PARAM);
+        return -1;
+    }
+    return 0;
+}
+
+/* GET /handles/{id}/blocks */
+static void get_blocks(void *cls, const struct usbx_http_request *req,
+                       struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_device(req, resp);
+    if (!handle) {
+        return;
+    }
+    struct usbx_msc *msc = get_unit(req, handle, resp);
+    if (!msc) {
+        usbx_handle_put(handle);
+        return;
+    }
+    struct usbx_msc_stats stats;
+    usbx_msc_get_stats(msc, &stats);
+    if (!usbx_http_arg(req, "lba")) {
+        usbx_handle_put(handle);
+        set_stats(resp, &stats);
+        return;
+    }
+
+    long lba = usbx_http_arg_long(req, "lba", -1);
+    long count = usbx_http_arg_long(req, "count", 1);
+    if (check_range(resp, &stats, lba, count) < 0) {
+        usbx_handle_put(handle);
+        return;
+    }
+    size_t length = (size_t)count * stats.block_size;
+    unsigned char *data = malloc(length);
+    if (!data) {
+        usbx_handle_put(handle);
+        usbx_http_set_error(resp, 500, "Out of memory", USBX_ERROR_NO_MEM);
+        return;
+    }
+    int result = usbx_msc_read(msc, (uint64_t)lba, (uint32_t)count, data);
+    usbx_handle_put(handle);
+    if (result < 0) {
+        free(data);
+        usbx_http_set_error(resp, usbx_http_status_for_error(result), "Block read failed",
+                            result);
+        return;
+    }
+    resp->status = 200;
+    resp->content_type = "application/octet-stream";
+    resp->body = (char *)data;
+    resp->body_length = length;
+}
+
+/* PUT /handles/{id}/blocks */
+static void put_blocks(void *cls, const struct usbx_http_request *req,
+                       struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_device(req, resp);
+    if (!handle) {
+        return;
+    }
+    struct usbx_msc *msc = get_unit(req, handle, resp);
+    if (!msc) {
+        usbx_handle_put(handle);
+        return;
+    }
+    struct usbx_msc_stats stats;
+    usbx_msc_get_stats(msc, &stats);
+    long lba = usbx_http_arg_long(req, "lba", -1);
+    if (req->body_length == 0 || req->body_length % stats.block_size != 0) {
+        usbx_handle_put(handle);
+        usbx_http_set_error(resp, 400, "Body must be a non-empty multiple of the block size",
+                            USBX_ERROR_INVALID_PARAM);
+        return;
+    }
+    long count = (long)(req->body_length / stats.block_size);
+    if (check_range(resp, &stats, lba, count) < 0) {
+        usbx_handle_put(handle);
+        return;
+    }
+
+    uint64_t start_us = usbx_now_us();
+    int result = usbx_msc_write(msc, (uint64_t)lba, (uint32_t)count, req->body);
+    usbx_handle_put(handle);
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"lba\": %ld, \"count\": %ld, \"status\": \"%s\", \"code\": %d, "
+                    "\"elapsed_us\": %llu}",
+                    lba, count, usbx_error_name(result), result,
+                    (unsigned long long)(usbx_now_us() - start_us));
+    usbx_http_set_json_buf(resp, usbx_http_status_for_error(result), &buf);
+}
+
+int usbx_api_register_blocks(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "GET", "/handles/{id}/blocks", get_blocks, NULL) < 0 ||
+        usbx_http_route(router, "PUT", "/handles/{id}/blocks", put_blocks, NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
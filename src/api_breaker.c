@@ -0,0 +1,111 @@
+/**
+ * @file api_breaker.c
+ * @brief REST routes for the per-device circuit breaker
+ *
+ * - GET    /handles/{id}/breaker   state, window counts and configuration
+ * - POST   /handles/{id}/breaker   change thresholds: enabled=0|1, window_ms,
+ *                                  min_transfers, failure_pct, open_ms
+ * - DELETE /handles/{id}/breaker   close the breaker and empty its window
+ *
+ * These routes stay available while the breaker is open; requests that
+ * use the device are refused with 503 and Retry-After (usbx_breaker.h).
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_breaker.h"
+#include "usbx_buf.h"
+
+static void respond_state(struct usbx_handle *handle, struct usbx_http_response *resp) {
+    struct usbx_breaker_stats stats;
+    struct usbx_breaker_config config;
+    struct usbx_buf buf;
+
+    usbx_breaker_get_stats(handle->breaker, &stats);
+    usbx_breaker_get_config(handle->breaker, &config);
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"handle\": %d, \"state\": \"%s\", \"transfers\": %llu, "
+                    "\"failures\": %llu, \"trips\": %llu, \"rejected\": %llu, \"probes\": %llu, "
+                    "\"retry_after_ms\": %u, \"enabled\": %s, \"window_ms\": %u, "
+                    "\"min_transfers\": %u, \"failure_pct\": %u, \"open_ms\": %u}",
+                    handle->handle_id, usbx_breaker_state_name(stats.state),
+                    (unsigned long long)stats.transfers, (unsigned long long)stats.failures,
+                    (unsigned long long)stats.trips, (unsigned long long)stats.rejected,
+                    (unsigned long long)stats.probes, stats.retry_after_ms,
+                    config.enabled ? "true" : "false", config.window_ms, config.min_transfers,
+                    config.failure_pct, config.open_ms);
+    usbx_handle_put(handle);
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+/* GET /handles/{id}/breaker */
+static void get_breaker(void *cls, const struct usbx_http_request *req,
+                        struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (handle) {
+        respond_state(handle, resp);
+    }
+}
+
+/* POST /handles/{id}/breaker */
+static void configure_breaker(void *cls, const struct usbx_http_request *req,
+                              struct usbx_http_response *resp) {
+    (void)cls;
+    const char *enabled = usbx_http_arg(req, "enabled");
+    if (enabled && strcmp(enabled, "0") != 0 && strcmp(enabled, "1") != 0) {
+        usbx_http_set_error(resp, 400, "enabled must be 0 or 1", USBX_ERROR_INVALID_PARAM);
+        return;
+    }
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (!handle) {
+        return;
+    }
+    struct usbx_breaker_config config;
+    usbx_breaker_get_config(handle->breaker, &config);
+    long window_ms = usbx_http_arg_long(req, "window_ms", (long)config.window_ms);
+    long min_transfers = usbx_http_arg_long(req, "min_transfers", (long)config.min_transfers);
+    long failure_pct = usbx_http_arg_long(req, "failure_pct", (long)config.failure_pct);
+    long open_ms = usbx_http_arg_long(req, "open_ms", (long)config.open_ms);
+    if (window_ms < USBX_BREAKER_BUCKETS || window_ms > USBX_BREAKER_MAX_MS || open_ms < 0 ||
+        open_ms > USBX_BREAKER_MAX_MS || min_transfers < 1 || min_transfers > 1000000 ||
+        failure_pct < 1 || failure_pct > 100) {
+        usbx_handle_put(handle);
+        usbx_http_set_error(resp, 400, "window_ms must be 10-600000, open_ms 0-600000, "
+                            "min_transfers at least 1 and failure_pct 1-100",
+                            USBX_ERROR_INVALID_PARAM);
+        return;
+    }
+    if (enabled) {
+        config.enabled = enabled[0] == '1';
+    }
+    config.window_ms = (unsigned int)window_ms;
+    config.min_transfers = (unsigned int)min_transfers;
+    config.failure_pct = (unsigned int)failure_pct;
+    config.open_ms = (unsigned int)open_ms;
+    usbx_breaker_configure(handle->breaker, &config);
+    respond_state(handle, resp);
+}
+
+/* DELETE /handles/{id}/breaker */
+static void reset_breaker(void *cls, const struct usbx_http_request *req,
+                          struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (handle) {
+        usbx_breaker_reset(handle->breaker);
+        respond_state(handle, resp);
+    }
+}
+
+int usbx_api_register_breaker(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "GET", "/handles/{id}/breaker", get_breaker, NULL) < 0 ||
+        usbx_http_route(router, "POST", "/handles/{id}/breaker", configure_breaker, NULL) < 0 ||
+        usbx_http_route(router, "DELETE", "/handles/{id}/breaker", reset_breaker, NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
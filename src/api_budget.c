@@ -0,0 +1,93 @@
+/**
+ * @file api_budget.c
+ * @brief REST routes for the memory budget
+ *
+ * - GET  /budget   capacity, usage, utilization and waiting
+ * - POST /budget   change capacity (bytes, 0 = unlimited) and/or wait_ms
+ *
+ * Settings not given keep their current value; see usbx_budget.h.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdlib.h>
+
+#include "usbx_api.h"
+#include "usbx_budget.h"
+#include "usbx_buf.h"
+
+static void respond_state(struct usbx_http_response *resp) {
+    struct usbx_budget_stats s;
+    struct usbx_buf buf;
+
+    usbx_budget_get_stats(&s);
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"capacity\": %llu, \"wait_ms\": %u, \"in_use\": %llu, "
+                    "\"peak\": %llu, \"utilization\": %.4f, \"waiting\": %u, "
+                    "\"reservations\": %llu, \"waited\": %llu, \"mean_wait_us\": %llu, "
+                    "\"max_wait_us\": %llu, \"timed_out\": %llu, \"too_large\": %llu, "
+                    "\"declined\": %llu}",
+                    (unsigned long long)s.capacity, s.wait_ms, (unsigned long long)s.in_use,
+                    (unsigned long long)s.peak,
+                    s.capacity ? (double)s.in_use / (double)s.capacity : 0.0, s.waiting,
+                    (unsigned long long)s.reservations, (unsigned long long)s.waited,
+                    (unsigned long long)(s.waited ? s.wait_us / s.waited : 0),
+                    (unsigned long long)s.max_wait_us, (unsigned long long)s.timed_out,
+                    (unsigned long long)s.too_large, (unsigned long long)s.declined);
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+/* GET /budget */
+static void get_budget(void *cls, const struct usbx_http_request *req,
+                       struct usbx_http_response *resp) {
+    (void)cls;
+    (void)req;
+    respond_state(resp);
+}
+
+/* Read one setting into *value; -1 if it is not a non-negative number */
+static int parse_setting(const struct usbx_http_request *req, const char *name,
+                         uint64_t *value) {
+    const char *text = usbx_http_arg(req, name);
+    char *end;
+
+    if (!text) {
+        return 0;
+    }
+    if (*text < '0' || *text > '9') {
+        return -1;
+    }
+    unsigned long long parsed = strtoull(text, &end, 10);
+    if (*end != '\0') {
+        return -1;
+    }
+    *value = parsed;
+    return 0;
+}
+
+/* POST /budget */
+static void configure_budget(void *cls, const struct usbx_http_request *req,
+                             struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_budget_stats s;
+
+    usbx_budget_get_stats(&s);
+    uint64_t capacity = s.capacity;
+    uint64_t wait_ms = s.wait_ms;
+    if (parse_setting(req, "capacity", &capacity) < 0 ||
+        parse_setting(req, "wait_ms", &wait_ms) < 0 || wait_ms > USBX_BUDGET_MAX_WAIT_MS) {
+        usbx_http_set_error(resp, 400, "capacity must be a non-negative integer and wait_ms "
+                            "at most 600000", USBX_ERROR_INVALID_PARAM);
+        return;
+    }
+    usbx_budget_configure(capacity, (unsigned int)wait_ms);
+    respond_state(resp);
+}
+
+int usbx_api_register_budget(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "GET", "/budget", get_budget, NULL) < 0 ||
+        usbx_http_route(router, "POST", "/budget", configure_budget, NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
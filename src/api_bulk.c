@@ -0,0 +1,319 @@
+/**
+ * @file api_bulk.c
+ * @brief REST route for raw bulk OUT uploads
+ *
+ * - PUT /handles/{id}/bulk/{ep}?timeout=ms&zero_packet=1  body: raw payload
+ *
+ * The body may be sent with Content-Encoding: gzip or zstd. The route
+ * reads its body as it arrives (usbx_http_route_streaming()): a worker
+ * thread pulls it in small blocks, decompressing if needed, into a small
+ * ring of chunks while the request thread sends the previous chunk through
+ * the segmented bulk engine. Neither the body nor the decompressed payload
+ * has to fit in memory, and receiving, decompression and the transfer
+ * overlap. The chunks are reserved in the memory budget for the length of
+ * the upload. A body that is already complete, e.g. while a trace
+ * records, is sent in place if it is not compressed. Chunks are a multiple of every
+ * wMaxPacketSize, so chunk boundaries never produce a short packet.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_budget.h"
+#include "usbx_buf.h"
+#include "usbx_bulk.h"
+#include "usbx_compress.h"
+#include "usbx_config.h"
+#include "usbx_util.h"
+
+/** @brief Decompressed bytes handed to one segmented transfer */
+#define UPLOAD_CHUNK_SIZE (1024 * 1024)
+
+/** @brief Chunks being filled or sent at once */
+#define UPLOAD_CHUNKS 3
+
+/** @brief Body bytes read at a time while the body arrives */
+#define UPLOAD_INPUT_SIZE (64 * 1024)
+
+/** @brief Body reader and decompression worker feeding the transfer loop */
+struct upload_job {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const struct usbx_http_request *req;
+    struct usbx_zstream *z;      /* NULL for an identity body */
+    unsigned char *input_buffer; /* NULL if the body is complete */
+    const unsigned char *input;  /* body bytes not yet consumed */
+    size_t input_left;
+    uint64_t received;           /* body bytes read */
+    int eof;                     /* the whole body was read */
+    unsigned char *chunks[UPLOAD_CHUNKS];
+    size_t lengths[UPLOAD_CHUNKS];
+    int head;                    /* next chunk to send */
+    int filled;                  /* chunks ready to send, starting at head */
+    int finished;                /* the worker produced its last chunk */
+    int status;                  /* USBX_SUCCESS or the error reading or decoding the body */
+    int cancelled;               /* the transfer loop gave up */
+};
+
+/* Refill an empty input block from the body; returns a negative error if the client went away */
+static int read_input(struct upload_job *job) {
+    long n = usbx_http_read_body(job->req, job->received, job->input_buffer, UPLOAD_INPUT_SIZE);
+    if (n < 0) {
+        return (int)n;
+    }
+    job->input = job->input_buffer;
+    job->input_left = (size_t)n;
+    job->received += (uint64_t)n;
+    job->eof = n == 0;
+    return USBX_SUCCESS;
+}
+
+static void *upload_worker(void *arg) {
+    struct upload_job *job = arg;
+    int index = 0;
+    int ended = job->z == NULL;      // an identity body cannot be truncated
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        while (job->filled == UPLOAD_CHUNKS && !job->cancelled) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+        int cancelled = job->cancelled;
+        pthread_mutex_unlock(&job->lock);
+        if (cancelled) {
+            return NULL;
+        }
+
+        unsigned char *out = job->chunks[index];
+        size_t out_left = UPLOAD_CHUNK_SIZE;
+        int result = USBX_SUCCESS, stalled = 0;
+        while (out_left > 0) {
+            if (job->input_left == 0 && !job->eof) {
+                result = read_input(job);
+                if (result < 0) {
+                    break;
+                }
+            }
+            size_t in_before = job->input_left, out_before = out_left;
+            if (job->z) {
+                result = usbx_zstream_process(job->z, &job->input, &job->input_left, &out,
+                                              &out_left, USBX_ZSTREAM_RUN);
+                if (result < 0) {
+                    break;
+                }
+                ended = result == 1;
+            } else {
+                size_t n = job->input_left < out_left ? job->input_left : out_left;
+                memcpy(out, job->input, n);
+                job->input += n;
+                job->input_left -= n;
+                out += n;
+                out_left -= n;
+            }
+            if (job->input_left == in_before && out_left == out_before) {
+                stalled = 1;     // body exhausted and nothing buffered
+                break;
+            }
+        }
+
+        size_t length = UPLOAD_CHUNK_SIZE - out_left;
+        int last = result < 0 || stalled;
+        if (last && result >= 0 && !ended) {
+            result = USBX_ERROR_INVALID_PARAM;      // truncated stream
+        }
+
+        pthread_mutex_lock(&job->lock);
+        if (result >= 0 && length > 0) {
+            job->lengths[index] = length;
+            job->filled++;
+            index = (index + 1) % UPLOAD_CHUNKS;
+        }
+        if (last) {
+            job->finished = 1;
+            job->status = result < 0 ? result : USBX_SUCCESS;
+        }
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+        if (last) {
+            return NULL;
+        }
+    }
+}
+
+/*
+ * Send a body that is compressed or still arriving in chunks; returns the
+ * transfer error or USBX_SUCCESS, and in @p decode_status the error that
+ * ended the body early.
+ */
+static int send_chunked(struct usbx_device *dev, unsigned char endpoint, int encoding,
+                        const struct usbx_http_request *req,
+                        const struct usbx_segment_options *opts, int zero_packet,
+                        uint64_t *received, size_t *transferred, int *decode_status) {
+    struct upload_job job = {.req = req};
+    pthread_t worker;
+    size_t reserved = UPLOAD_CHUNKS * UPLOAD_CHUNK_SIZE +
+                      (req->body_source ? UPLOAD_INPUT_SIZE : 0);
+
+    int result = USBX_SUCCESS;
+    if (usbx_budget_reserve(reserved) != USBX_SUCCESS) {
+        return USBX_ERROR_NO_MEM;
+    }
+    if (req->body_source) {
+        job.input_buffer = malloc(UPLOAD_INPUT_SIZE);
+        if (!job.input_buffer) {
+            result = USBX_ERROR_NO_MEM;
+        }
+    } else {
+        job.input = req->body;
+        job.input_left = req->body_length;
+        job.received = req->body_length;
+        job.eof = 1;
+    }
+    if (encoding != USBX_ENCODING_IDENTITY) {
+        job.z = usbx_zstream_create(encoding, 0, 0);
+        if (!job.z) {
+            result = USBX_ERROR_NO_MEM;
+        }
+    }
+    for (int i = 0; i < UPLOAD_CHUNKS; i++) {
+        job.chunks[i] = malloc(UPLOAD_CHUNK_SIZE);
+        if (!job.chunks[i]) {
+            result = USBX_ERROR_NO_MEM;
+        }
+    }
+    if (result < 0) {
+        result = USBX_ERROR_NO_MEM;
+        goto out;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    if (pthread_create(&worker, NULL, upload_worker, &job) != 0) {
+        pthread_cond_destroy(&job.cond);
+        pthread_mutex_destroy(&job.lock);
+        result = USBX_ERROR_NO_MEM;
+        goto out;
+    }
+
+    for (;;) {
+        // Hold a chunk back until the next one exists, so the final chunk is known
+        pthread_mutex_lock(&job.lock);
+        while (job.filled < 2 && !job.finished) {
+            pthread_cond_wait(&job.cond, &job.lock);
+        }
+        int available = job.finished && job.status < 0 ? 0 : job.filled;
+        int last = job.finished && job.filled == 1;
+        unsigned char *chunk = job.chunks[job.head];
+        size_t length = job.lengths[job.head];
+        pthread_mutex_unlock(&job.lock);
+        if (available == 0) {
+            break;      // done, or the body turned out to be corrupt
+        }
+
+        struct usbx_segment_options chunk_opts = *opts;
+        struct usbx_segment_result segment;
+        chunk_opts.flags = last && zero_packet ? USBX_SEGMENT_ZERO_PACKET : 0;
+        result = usbx_bulk_transfer_segmented(dev, endpoint, chunk, length, &chunk_opts,
+                                              &segment);
+        *transferred += segment.transferred;
+
+        pthread_mutex_lock(&job.lock);
+        job.head = (job.head + 1) % UPLOAD_CHUNKS;
+        job.filled--;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.lock);
+        if (result < 0) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&job.lock);
+    job.cancelled = 1;
+    pthread_cond_broadcast(&job.cond);
+    pthread_mutex_unlock(&job.lock);
+    pthread_join(worker, NULL);
+    *decode_status = job.status;
+    *received = job.received;
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.lock);
+
+out:
+    for (int i = 0; i < UPLOAD_CHUNKS; i++) {
+        free(job.chunks[i]);
+    }
+    free(job.input_buffer);
+    usbx_zstream_destroy(job.z);
+    usbx_budget_release(reserved);
+    return result;
+}
+
+/* PUT /handles/{id}/bulk/{ep} */
+static void upload_bulk(void *cls, const struct usbx_http_request *req,
+                        struct usbx_http_response *resp) {
+    (void)cls;
+    int endpoint = usbx_api_parse_endpoint(usbx_http_param(req, "ep"));
+    long timeout = usbx_http_arg_long(req, "timeout",
+                                      usbx_config_current()->segment_timeout_ms);
+    if (endpoint <= 0 || (endpoint & USBX_ENDPOINT_IN) || timeout < 0) {
+        usbx_http_set_error(resp, 400, "Expected a bulk OUT endpoint and a valid timeout", 0);
+        return;
+    }
+    int encoding = usbx_encoding_parse(usbx_http_header(req, "Content-Encoding"));
+    if (encoding < 0) {
+        usbx_http_set_error(resp, 415, "Unsupported Content-Encoding", encoding);
+        return;
+    }
+    struct usbx_handle *handle = usbx_api_get_device(req, resp);
+    if (!handle) {
+        return;
+    }
+
+    struct usbx_segment_options opts;
+    usbx_segment_options_init(&opts);
+    opts.timeout = (unsigned int)timeout;
+    int zero_packet = usbx_http_arg_long(req, "zero_packet", 0) != 0;
+    uint64_t start_us = usbx_now_us();
+    uint64_t received = 0;
+    size_t transferred = 0;
+    int decode_status = USBX_SUCCESS;
+    int result;
+
+    if (encoding == USBX_ENCODING_IDENTITY && !req->body_source) {
+        struct usbx_segment_result segment;
+        opts.flags = zero_packet ? USBX_SEGMENT_ZERO_PACKET : 0;
+        // OUT buffers are only read
+        result = usbx_bulk_transfer_segmented(handle->dev, (unsigned char)endpoint,
+                                              (unsigned char *)req->body, req->body_length,
+                                              &opts, &segment);
+        received = req->body_length;
+        transferred = segment.transferred;
+    } else {
+        result = send_chunked(handle->dev, (unsigned char)endpoint, encoding, req, &opts,
+                              zero_packet, &received, &transferred, &decode_status);
+    }
+    usbx_handle_put(handle);
+
+    if (decode_status < 0 && result == USBX_SUCCESS) {
+        usbx_http_set_error(resp, 400, "Body is corrupt or truncated", decode_status);
+        return;
+    }
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"endpoint\": %d, \"encoding\": \"%s\", \"received\": %llu, "
+                    "\"transferred\": %zu, \"status\": \"%s\", \"code\": %d, "
+                    "\"elapsed_us\": %llu}",
+                    endpoint, usbx_encoding_name(encoding), (unsigned long long)received,
+                    transferred, usbx_error_name(result), result,
+                    (unsigned long long)(usbx_now_us() - start_us));
+    usbx_http_set_json_buf(resp, usbx_http_status_for_error(result), &buf);
+}
+
+int usbx_api_register_bulk(struct usbx_http_router *router) {
+    return usbx_http_route_streaming(router, "PUT", "/handles/{id}/bulk/{ep}", upload_bulk,
+                                     NULL);
+}
@@ -0,0 +1,123 @@
+/**
+ * @file api_capture.c
+ * @brief REST routes for usbmon-compatible transfer capture
+ *
+ * - POST /handles/{id}/capture?enabled=0|1   start or stop capturing a handle
+ * - GET  /debug/capture                      pcap stream of the captured handles
+ * - GET  /debug/capture/stats                capture counters
+ *
+ * Records of a handle carry its bus number and device address, or bus 0
+ * and the handle id (modulo 128) when they are unknown, so Wireshark's
+ * usb.bus_id and usb.device_address filters tell handles apart. The
+ * stream takes count=n (records) and duration_ms=n to end by itself;
+ * only one stream can be open at a time. Example:
+ *
+ *     curl -o usb.pcap 'http://host:8080/debug/capture?duration_ms=10000'
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_buf.h"
+#include "usbx_capture.h"
+#include "usbx_compress.h"
+
+/** @brief How long a stream read waits for records before returning to the front end */
+#define STREAM_POLL_MS 1000
+
+/* POST /handles/{id}/capture?enabled=0|1 */
+static void set_capture(void *cls, const struct usbx_http_request *req,
+                        struct usbx_http_response *resp) {
+    (void)cls;
+    const char *text = usbx_http_arg(req, "enabled");
+    int enabled = !text || strcmp(text, "1") == 0;
+    if (text && !enabled && strcmp(text, "0") != 0) {
+        usbx_http_set_error(resp, 400, "enabled must be 0 or 1", USBX_ERROR_INVALID_PARAM);
+        return;
+    }
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (!handle) {
+        return;
+    }
+    int bus = handle->info.bus >= 0 ? handle->info.bus : 0;
+    int address = handle->info.address >= 0 ? handle->info.address : handle->handle_id % 128;
+    if (enabled) {
+        usbx_capture_enable(handle->dev, (uint16_t)bus, (uint8_t)address);
+    } else {
+        usbx_capture_disable(handle->dev);
+    }
+
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"handle\": %d, \"enabled\": %s, \"bus\": %d, \"address\": %d}",
+                    handle->handle_id, enabled ? "true" : "false", bus, address);
+    usbx_handle_put(handle);
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+static ssize_t capture_stream_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    (void)pos;
+    long result = usbx_capture_read(cls, (unsigned char *)buf, max, STREAM_POLL_MS);
+    if (result >= 0) {
+        return (ssize_t)result;
+    }
+    return result == USBX_ERROR_INTERRUPTED ? USBX_HTTP_END_OF_STREAM : USBX_HTTP_STREAM_ERROR;
+}
+
+static void capture_stream_free(void *cls) {
+    usbx_capture_reader_close(cls);
+}
+
+/* GET /debug/capture?count=n&duration_ms=n */
+static void open_capture(void *cls, const struct usbx_http_request *req,
+                         struct usbx_http_response *resp) {
+    (void)cls;
+    long count = usbx_http_arg_long(req, "count", 0);
+    long duration_ms = usbx_http_arg_long(req, "duration_ms", 0);
+    if (count < 0 || duration_ms < 0 || duration_ms > 86400000L) {
+        usbx_http_set_error(resp, 400, "count and duration_ms must not be negative",
+                            USBX_ERROR_INVALID_PARAM);
+        return;
+    }
+    struct usbx_capture_reader *reader = usbx_capture_reader_open((uint64_t)count,
+                                                                  (unsigned int)duration_ms);
+    if (!reader) {
+        usbx_http_set_error(resp, 409, "A capture stream is already open", USBX_ERROR_BUSY);
+        return;
+    }
+    usbx_http_add_header(resp, "Cache-Control", "no-cache");
+    usbx_http_add_header(resp, "Content-Disposition", "attachment; filename=\"usbx.pcap\"");
+    usbx_http_set_reader(resp, "application/vnd.tcpdump.pcap", capture_stream_read, reader,
+                         capture_stream_free);
+    usbx_compress_response(req, resp);
+}
+
+/* GET /debug/capture/stats */
+static void capture_stats(void *cls, const struct usbx_http_request *req,
+                          struct usbx_http_response *resp) {
+    (void)cls;
+    (void)req;
+    struct usbx_capture_stats stats;
+    usbx_capture_get_stats(&stats);
+
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"records\": %llu, \"dropped\": %llu, \"delivered\": %llu, "
+                    "\"threads\": %d, \"reading\": %s}",
+                    (unsigned long long)stats.records, (unsigned long long)stats.dropped,
+                    (unsigned long long)stats.delivered, stats.threads,
+                    stats.reading ? "true" : "false");
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+int usbx_api_register_capture(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "POST", "/handles/{id}/capture", set_capture, NULL) < 0 ||
+        usbx_http_route(router, "GET", "/debug/capture", open_capture, NULL) < 0 ||
+        usbx_http_route(router, "GET", "/debug/capture/stats", capture_stats, NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
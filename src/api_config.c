@@ -0,0 +1,98 @@
+/**
+ * @file api_config.c
+ * @brief REST routes for the runtime configuration
+ *
+ * - GET  /admin/config   current settings, version and the settings that need a restart
+ * - POST /admin/config   with "key = value" lines in the body, change those settings;
+ *                        without a body, reload the config file (as SIGHUP does)
+ *
+ * A change is applied entirely or not at all; see usbx_config.h.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdlib.h>
+
+#include "usbx_api.h"
+#include "usbx_buf.h"
+#include "usbx_config.h"
+
+static void respond_config(struct usbx_http_response *resp) {
+    const struct usbx_config *config = usbx_config_current();
+    struct usbx_config_stats stats;
+    struct usbx_buf buf;
+    char value[USBX_CONFIG_PATH_MAX];
+
+    usbx_config_get_stats(&stats);
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"version\": %llu, \"applied\": %llu, \"rejected\": %llu, "
+                    "\"retained\": %llu, \"settings\": {", (unsigned long long)config->version,
+                    (unsigned long long)stats.applied, (unsigned long long)stats.rejected,
+                    (unsigned long long)stats.retained);
+    for (int i = 0; i < usbx_config_num_keys(); i++) {
+        const struct usbx_config_key *key = usbx_config_key(i);
+        usbx_config_format(config, key->name, value, sizeof(value));
+        usbx_buf_printf(&buf, "%s\"%s\": ", i ? ", " : "", key->name);
+        if (key->text) {
+            usbx_buf_json_string(&buf, value);
+        } else {
+            usbx_buf_printf(&buf, "%s", value);
+        }
+    }
+    usbx_buf_printf(&buf, "}, \"restart_required\": [");
+    for (int i = 0, listed = 0; i < usbx_config_num_keys(); i++) {
+        const struct usbx_config_key *key = usbx_config_key(i);
+        if (!key->live) {
+            usbx_buf_printf(&buf, "%s\"%s\"", listed++ ? ", " : "", key->name);
+        }
+    }
+    usbx_buf_printf(&buf, "]}");
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+/* GET /admin/config */
+static void get_config(void *cls, const struct usbx_http_request *req,
+                       struct usbx_http_response *resp) {
+    (void)cls;
+    (void)req;
+    respond_config(resp);
+}
+
+/* POST /admin/config */
+static void change_config(void *cls, const struct usbx_http_request *req,
+                          struct usbx_http_response *resp) {
+    (void)cls;
+    char error[512];
+    int reload = req->body_length == 0;
+    int result = reload ? usbx_config_reload(error, sizeof(error)) :
+                          usbx_config_update((const char *)req->body, req->body_length, error,
+                                             sizeof(error));
+    int status;
+
+    switch (result) {
+    case USBX_SUCCESS:
+        respond_config(resp);
+        return;
+    case USBX_ERROR_NOT_SUPPORTED:
+        status = 409;               // needs a restart
+        break;
+    case USBX_ERROR_NOT_FOUND:
+        status = reload ? 404 : 400;
+        break;
+    case USBX_ERROR_INVALID_PARAM:
+        status = 400;
+        break;
+    default:
+        status = 500;
+        break;
+    }
+    usbx_http_set_error(resp, status, error, result);
+}
+
+int usbx_api_register_config(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "GET", "/admin/config", get_config, NULL) < 0 ||
+        usbx_http_route(router, "POST", "/admin/config", change_config, NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
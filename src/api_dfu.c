@@ -0,0 +1,358 @@
+/**
+ * @file api_dfu.c
+ * @brief REST route for DFU firmware downloads
+ *
+ * - POST /handles/{id}/dfu?interface=n&alt=n&transfer_size=n&timeout=ms  body: raw image
+ * - POST /handles/{id}/dfu?blob=<sha256>&...                            image from the blob store
+ *
+ * Without "Accept: text/event-stream" the request returns when the
+ * download is over, with its result as JSON. With it, the download runs
+ * on a worker thread and the response is a server-sent event stream of
+ * "progress" events (at most one per PROGRESS_INTERVAL_US) ending with a
+ * "done" or "error" event. A closed stream does not stop the download:
+ * abandoning it half way would leave the device without firmware.
+ *
+ * Only one download per handle runs at a time; a second one gets 409.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_blob.h"
+#include "usbx_buf.h"
+#include "usbx_dfu.h"
+#include "usbx_util.h"
+
+/** @brief Minimum spacing of progress events */
+#define PROGRESS_INTERVAL_US 100000ULL
+
+/** @brief How long an event stream waits for progress before checking back */
+#define SSE_POLL_MS 1000
+
+/** @brief Keep-alive comment interval of an idle event stream */
+#define SSE_KEEPALIVE_US 15000000ULL
+
+/** @brief Download shared by the worker thread and the event stream */
+struct dfu_job {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int refs;                           /* worker and stream, guarded by lock */
+    struct usbx_handle *handle;
+    struct usbx_dfu_options opts;
+    const unsigned char *image;
+    size_t size;
+    unsigned char *copy;                /* request body copy, or NULL */
+    struct usbx_blob *blob;             /* blob being flashed, or NULL */
+    struct usbx_dfu_progress progress;  /* latest snapshot, guarded by lock */
+    uint64_t sequence;                  /* bumped when a snapshot is published */
+    uint64_t published_us;
+    int finished;
+    int result;
+    /* Event stream state, used by the reader only */
+    uint64_t sent_sequence;
+    struct usbx_buf pending;
+    size_t pending_offset;
+    uint64_t last_write_us;
+    int ended;
+};
+
+/* Append the progress members shared by every report */
+static void append_progress(struct usbx_buf *buf, const struct usbx_dfu_progress *progress) {
+    usbx_buf_printf(buf, "\"total\": %zu, \"written\": %zu, \"blocks\": %u, \"polls\": %u, "
+                    "\"poll_wait_us\": %llu, \"elapsed_us\": %llu, \"state\": \"%s\", "
+                    "\"dfu_status\": %d",
+                    progress->total, progress->written, progress->blocks, progress->polls,
+                    (unsigned long long)progress->poll_wait_us,
+                    (unsigned long long)progress->elapsed_us,
+                    usbx_dfu_state_name(progress->state), progress->status);
+}
+
+static void append_result(struct usbx_buf *buf, const struct usbx_dfu_progress *progress,
+                          int result) {
+    usbx_buf_printf(buf, "{");
+    append_progress(buf, progress);
+    usbx_buf_printf(buf, ", \"status\": \"%s\", \"code\": %d}", usbx_error_name(result), result);
+}
+
+/* Claim the handle for a download; writes 409 if one is already running */
+static int claim_handle(struct usbx_handle *handle, struct usbx_http_response *resp) {
+    pthread_mutex_lock(&handle->lock);
+    int busy = handle->dfu_active;
+    handle->dfu_active = 1;
+    pthread_mutex_unlock(&handle->lock);
+    if (busy) {
+        usbx_http_set_error(resp, 409, "A firmware download is already running",
+                            USBX_ERROR_BUSY);
+        return -1;
+    }
+    return 0;
+}
+
+static void release_handle(struct usbx_handle *handle) {
+    pthread_mutex_lock(&handle->lock);
+    handle->dfu_active = 0;
+    pthread_mutex_unlock(&handle->lock);
+    usbx_handle_put(handle);
+}
+
+static void job_put(struct dfu_job *job) {
+    pthread_mutex_lock(&job->lock);
+    int refs = --job->refs;
+    pthread_mutex_unlock(&job->lock);
+    if (refs > 0) {
+        return;
+    }
+    pthread_cond_destroy(&job->changed);
+    pthread_mutex_destroy(&job->lock);
+    usbx_buf_free(&job->pending);
+    usbx_blob_release(job->blob);
+    free(job->copy);
+    free(job);
+}
+
+/* Progress callback of a streamed download: publish a snapshot now and then */
+static void publish_progress(void *cls, const struct usbx_dfu_progress *progress) {
+    struct dfu_job *job = cls;
+    uint64_t now = usbx_now_us();
+
+    pthread_mutex_lock(&job->lock);
+    job->progress = *progress;
+    if (now - job->published_us >= PROGRESS_INTERVAL_US) {
+        job->published_us = now;
+        job->sequence++;
+        pthread_cond_broadcast(&job->changed);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void *dfu_worker(void *arg) {
+    struct dfu_job *job = arg;
+    struct usbx_dfu_progress progress;
+
+    int result = usbx_dfu_download(job->handle->dev, job->image, job->size, &job->opts,
+                                   publish_progress, job, &progress);
+    release_handle(job->handle);
+
+    pthread_mutex_lock(&job->lock);
+    job->progress = progress;
+    job->result = result;
+    job->finished = 1;
+    pthread_cond_broadcast(&job->changed);
+    pthread_mutex_unlock(&job->lock);
+    job_put(job);
+    return NULL;
+}
+
+/* Format the next event into job->pending; returns 0 if there is nothing yet */
+static int next_event(struct dfu_job *job) {
+    struct timespec deadline;
+
+    usbx_deadline_ms(&deadline, SSE_POLL_MS);
+    pthread_mutex_lock(&job->lock);
+    while (!job->finished && job->sequence == job->sent_sequence) {
+        if (pthread_cond_timedwait(&job->changed, &job->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    struct usbx_dfu_progress progress = job->progress;
+    int finished = job->finished, result = job->result;
+    int changed = job->sequence != job->sent_sequence;
+    job->sent_sequence = job->sequence;
+    pthread_mutex_unlock(&job->lock);
+
+    if (finished) {
+        usbx_buf_printf(&job->pending, "event: %s\ndata: ",
+                        result == USBX_SUCCESS ? "done" : "error");
+        append_result(&job->pending, &progress, result);
+        usbx_buf_printf(&job->pending, "\n\n");
+        job->ended = 1;
+    } else if (changed) {
+        usbx_buf_printf(&job->pending, "event: progress\ndata: {");
+        append_progress(&job->pending, &progress);
+        usbx_buf_printf(&job->pending, "}\n\n");
+    } else if (usbx_now_us() - job->last_write_us >= SSE_KEEPALIVE_US) {
+        usbx_buf_printf(&job->pending, ": keep-alive\n\n");
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static ssize_t dfu_stream_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    struct dfu_job *job = cls;
+    (void)pos;
+
+    if (job->pending_offset == job->pending.length) {
+        if (job->ended) {
+            return USBX_HTTP_END_OF_STREAM;
+        }
+        usbx_buf_free(&job->pending);
+        job->pending_offset = 0;
+        if (!next_event(job)) {
+            return 0;
+        }
+        if (job->pending.failed) {
+            return USBX_HTTP_STREAM_ERROR;
+        }
+    }
+
+    size_t length = job->pending.length - job->pending_offset;
+    if (length > max) {
+        length = max;
+    }
+    memcpy(buf, job->pending.data + job->pending_offset, length);
+    job->pending_offset += length;
+    job->last_write_us = usbx_now_us();
+    return (ssize_t)length;
+}
+
+static void dfu_stream_free(void *cls) {
+    job_put(cls);
+}
+
+/* Resolve the image from ?blob= or the body; writes an error response on failure */
+static int load_image(const struct usbx_http_request *req, struct usbx_http_response *resp,
+                      struct dfu_job *job) {
+    const char *hash = usbx_http_arg(req, "blob");
+
+    if (hash) {
+        struct usbx_blob_store *store = usbx_api_blob_store();
+        if (req->body_length > 0) {
+            usbx_http_set_error(resp, 400, "Send either a body or a blob argument", 0);
+            return -1;
+        }
+        if (!store) {
+            usbx_http_set_error(resp, 503, "Blob store is not configured", 0);
+            return -1;
+        }
+        job->blob = usbx_blob_get(store, hash);
+        if (!job->blob) {
+            usbx_http_set_error(resp, 404, "Unknown blob", USBX_ERROR_NOT_FOUND);
+            return -1;
+        }
+        job->image = usbx_blob_data(job->blob);
+        job->size = usbx_blob_size(job->blob);
+        return 0;
+    }
+    if (req->body_length == 0) {
+        usbx_http_set_error(resp, 400, "Expected a firmware image body or a blob argument", 0);
+        return -1;
+    }
+    job->image = req->body;
+    job->size = req->body_length;
+    return 0;
+}
+
+static int parse_options(const struct usbx_http_request *req, struct usbx_dfu_options *opts,
+                         struct usbx_http_response *resp) {
+    usbx_dfu_options_init(opts);
+    long interface = usbx_http_arg_long(req, "interface", opts->interface);
+    long alt = usbx_http_arg_long(req, "alt", opts->alt_setting);
+    long transfer_size = usbx_http_arg_long(req, "transfer_size", opts->transfer_size);
+    long timeout = usbx_http_arg_long(req, "timeout", (long)opts->timeout);
+    if (interface < 0 || interface > 0xff || alt < -1 || alt > 0xff || transfer_size < 1 ||
+        transfer_size > USBX_DFU_MAX_TRANSFER_SIZE || timeout < 0) {
+        usbx_http_set_error(resp, 400, "interface and alt must be 0-255, transfer_size 1-4096", 0);
+        return -1;
+    }
+    opts->interface = (int)interface;
+    opts->alt_setting = (int)alt;
+    opts->transfer_size = (int)transfer_size;
+    opts->timeout = (unsigned int)timeout;
+    return 0;
+}
+
+/* Start a streamed download; the job takes over the handle reference */
+static void start_stream(struct dfu_job *job, struct usbx_http_response *resp) {
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    pthread_mutex_init(&job->lock, NULL);
+    usbx_cond_init_monotonic(&job->changed);
+    usbx_buf_init(&job->pending);
+    job->refs = 2;      // worker and response stream
+    job->last_write_us = usbx_now_us();
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int started = pthread_create(&thread, &attr, dfu_worker, job) == 0;
+    pthread_attr_destroy(&attr);
+    if (!started) {
+        release_handle(job->handle);
+        job->refs = 1;
+        job_put(job);
+        usbx_http_set_error(resp, 500, "Cannot start the download", USBX_ERROR_NO_MEM);
+        return;
+    }
+
+    usbx_http_add_header(resp, "Cache-Control", "no-cache");
+    usbx_http_set_reader(resp, "text/event-stream", dfu_stream_read, job, dfu_stream_free);
+}
+
+/* POST /handles/{id}/dfu */
+static void run_dfu(void *cls, const struct usbx_http_request *req,
+                    struct usbx_http_response *resp) {
+    (void)cls;
+    struct dfu_job *job = calloc(1, sizeof(*job));
+    if (!job) {
+        usbx_http_set_json(resp, 500, NULL, 0);
+        return;
+    }
+    if (parse_options(req, &job->opts, resp) < 0 || load_image(req, resp, job) < 0) {
+        usbx_blob_release(job->blob);
+        free(job);
+        return;
+    }
+    job->handle = usbx_api_get_device(req, resp);
+    if (!job->handle) {
+        usbx_blob_release(job->blob);
+        free(job);
+        return;
+    }
+    if (claim_handle(job->handle, resp) < 0) {
+        usbx_handle_put(job->handle);
+        usbx_blob_release(job->blob);
+        free(job);
+        return;
+    }
+
+    const char *accept = usbx_http_header(req, "Accept");
+    if (accept && strstr(accept, "text/event-stream")) {
+        // The body is gone once the handler returns
+        if (!job->blob) {
+            job->copy = malloc(job->size);
+            if (!job->copy) {
+                release_handle(job->handle);
+                free(job);
+                usbx_http_set_error(resp, 500, "No memory for the image", USBX_ERROR_NO_MEM);
+                return;
+            }
+            memcpy(job->copy, job->image, job->size);
+            job->image = job->copy;
+        }
+        start_stream(job, resp);
+        return;
+    }
+
+    struct usbx_dfu_progress progress;
+    int result = usbx_dfu_download(job->handle->dev, job->image, job->size, &job->opts, NULL,
+                                   NULL, &progress);
+    release_handle(job->handle);
+    usbx_blob_release(job->blob);
+    free(job);
+
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    append_result(&buf, &progress, result);
+    usbx_http_set_json_buf(resp, usbx_http_status_for_error(result), &buf);
+}
+
+int usbx_api_register_dfu(struct usbx_http_router *router) {
+    return usbx_http_route(router, "POST", "/handles/{id}/dfu", run_dfu, NULL);
+}
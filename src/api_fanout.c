@@ -0,0 +1,464 @@
+/**
+ * @file api_fanout.c
+ * @brief REST route running one batch of operations on many devices at once
+ *
+ * - POST /fanout
+ *
+ * Body:
+ *
+ *     {"selector": {"vid": "0x1234", "pid": "0x5678", "serials": ["A1", "A2"],
+ *                   "handles": [3, 4], "open": true},
+ *      "operations": [...] (or "operation": {...}),
+ *      "parallelism": 8, "stop_on_error": true}
+ *
+ * Every selector member is optional but at least one of vid, pid, serials
+ * and handles is required; a handle must match all members given. With
+ * "open", matching devices that are not open yet are opened first (libusb
+ * builds only). The operations are parsed once, as in usbx_ops.h, and run
+ * on up to @c parallelism devices concurrently.
+ *
+ * The response is newline-delimited JSON (application/x-ndjson): one line
+ * per device in completion order, in the format of usbx_api_run_batch(),
+ * then {"done": true, "devices": n, "succeeded": n, "failed": n}. Devices
+ * whose circuit breaker is open are skipped with a line reporting
+ * "circuit": "open". Closing the response stops devices that have not
+ * started yet.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_breaker.h"
+#include "usbx_buf.h"
+#include "usbx_json.h"
+#include "usbx_ops.h"
+#include "usbx_quota.h"
+#include "usbx_sched.h"
+#include "usbx_util.h"
+
+/** @brief Default and largest number of devices served concurrently */
+#define FANOUT_DEFAULT_PARALLELISM 8
+#define FANOUT_MAX_PARALLELISM 64
+
+/** @brief Upper bound of devices one request can address */
+#define FANOUT_MAX_DEVICES 1024
+
+/** @brief How long a stream read waits for a device before returning to the front end */
+#define STREAM_POLL_MS 1000
+
+/** @brief Parsed device selector; the JSON members stay owned by the body */
+struct selector {
+    long long vid;                        // -1 matches any
+    long long pid;                        // -1 matches any
+    const struct usbx_json *serials;      // array of strings, or NULL
+    const struct usbx_json *handles;      // array of handle ids, or NULL
+    int open;
+};
+
+static int parse_selector(const struct usbx_json *json, struct selector *sel,
+                          const char **message) {
+    memset(sel, 0, sizeof(*sel));
+    if (!json || json->type != USBX_JSON_OBJECT) {
+        *message = "selector object is required";
+        return -1;
+    }
+    if (usbx_json_get_int(json, "vid", 0, 0xffff, -1, &sel->vid) < 0 ||
+        usbx_json_get_int(json, "pid", 0, 0xffff, -1, &sel->pid) < 0) {
+        *message = "vid and pid must be 16-bit integers";
+        return -1;
+    }
+
+    sel->serials = usbx_json_get(json, "serials");
+    sel->handles = usbx_json_get(json, "handles");
+    if ((sel->serials && sel->serials->type != USBX_JSON_ARRAY) ||
+        (sel->handles && sel->handles->type != USBX_JSON_ARRAY)) {
+        *message = "serials and handles must be arrays";
+        return -1;
+    }
+    if (sel->serials) {
+        for (const struct usbx_json *item = sel->serials->child; item; item = item->next) {
+            if (item->type != USBX_JSON_STRING) {
+                *message = "serials must be strings";
+                return -1;
+            }
+        }
+    }
+    if (sel->handles) {
+        for (const struct usbx_json *item = sel->handles->child; item; item = item->next) {
+            long long id;
+            if (usbx_json_int(item, &id) < 0) {
+                *message = "handles must be handle ids";
+                return -1;
+            }
+        }
+    }
+    if (sel->vid < 0 && sel->pid < 0 && !sel->serials && !sel->handles) {
+        *message = "selector needs vid, pid, serials or handles";
+        return -1;
+    }
+    sel->open = usbx_json_bool(usbx_json_get(json, "open"), 0);
+    return 0;
+}
+
+static int serial_selected(const struct selector *sel, const char *serial) {
+    if (!sel->serials) {
+        return 1;
+    }
+    for (const struct usbx_json *item = sel->serials->child; item; item = item->next) {
+        if (serial[0] != '\0' && strcmp(item->string, serial) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int handle_selected(const struct selector *sel, const struct usbx_handle *handle) {
+    if ((sel->vid >= 0 && handle->info.vid != sel->vid) ||
+        (sel->pid >= 0 && handle->info.pid != sel->pid) ||
+        !serial_selected(sel, handle->info.serial)) {
+        return 0;
+    }
+    if (!sel->handles) {
+        return 1;
+    }
+    for (const struct usbx_json *item = sel->handles->child; item; item = item->next) {
+        long long id;
+        if (usbx_json_int(item, &id) == 0 && id == handle->handle_id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#ifdef USE_DEPS
+static int device_is_open(const int *ids, int count, int bus, int address) {
+    for (int i = 0; i < count; i++) {
+        struct usbx_handle *handle = usbx_handle_get(ids[i]);
+        int match = handle && handle->info.bus == bus && handle->info.address == address;
+        usbx_handle_put(handle);
+        if (match) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Open every attached device the selector matches that has no handle yet */
+static void open_matching_devices(const struct selector *sel, int *ids) {
+    libusb_device **list;
+    ssize_t n = libusb_get_device_list(usbx_api_libusb_context(), &list);
+    if (n < 0) {
+        return;
+    }
+    int count = usbx_handle_list(ids, FANOUT_MAX_DEVICES);
+    if (count > FANOUT_MAX_DEVICES) {
+        count = FANOUT_MAX_DEVICES;
+    }
+
+    for (ssize_t i = 0; i < n; i++) {
+        struct libusb_device_descriptor desc;
+        libusb_device_handle *usb_handle;
+
+        if (libusb_get_device_descriptor(list[i], &desc) != LIBUSB_SUCCESS ||
+            (sel->vid >= 0 && desc.idVendor != sel->vid) ||
+            (sel->pid >= 0 && desc.idProduct != sel->pid) ||
+            device_is_open(ids, count, libusb_get_bus_number(list[i]),
+                           libusb_get_device_address(list[i])) ||
+            libusb_open(list[i], &usb_handle) != LIBUSB_SUCCESS) {
+            continue;
+        }
+        if (sel->serials) {
+            char serial[USBX_HANDLE_SERIAL_MAX] = "";
+            if (desc.iSerialNumber == 0 ||
+                libusb_get_string_descriptor_ascii(usb_handle, desc.iSerialNumber,
+                                                   (unsigned char *)serial,
+                                                   sizeof(serial)) < 0 ||
+                !serial_selected(sel, serial)) {
+                libusb_close(usb_handle);
+                continue;
+            }
+        }
+        usbx_api_add_usb_handle(usb_handle);
+    }
+    libusb_free_device_list(list, 1);
+}
+#endif
+
+/** @brief One fan-out request, shared by its workers and its response stream */
+struct fanout_job {
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;            // signalled whenever a device finishes
+    int refs;                            // workers plus the response stream
+    struct usbx_op_batch batch;
+    struct usbx_handle **targets;        // referenced until the job is freed
+    int count;
+    int next;                            // first target not yet claimed by a worker
+    int completed;
+    int succeeded;
+    int failed;
+    int cancelled;                       // response closed: claim no more targets
+    int summarized;                      // final line queued
+    struct usbx_buf lines;               // finished lines not yet sent
+    size_t lines_offset;
+    char *client;                        // requesting client, for the device schedulers
+    struct usbx_quota_client *quota;     // client charged for the transfers
+};
+
+static void job_put(struct fanout_job *job) {
+    pthread_mutex_lock(&job->lock);
+    int last = --job->refs == 0;
+    pthread_mutex_unlock(&job->lock);
+    if (!last) {
+        return;
+    }
+
+    for (int i = 0; i < job->count; i++) {
+        usbx_handle_put(job->targets[i]);
+    }
+    free(job->targets);
+    usbx_op_batch_free(&job->batch);
+    usbx_buf_free(&job->lines);
+    free(job->client);
+    pthread_cond_destroy(&job->done_cond);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+}
+
+static void *fanout_worker(void *arg) {
+    struct fanout_job *job = arg;
+
+    usbx_sched_set_client(job->client);
+    usbx_quota_set_current(job->quota);
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        if (job->cancelled || job->next == job->count) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        struct usbx_handle *handle = job->targets[job->next++];
+        pthread_mutex_unlock(&job->lock);
+
+        struct usbx_buf line;
+        usbx_buf_init(&line);
+        int result;
+        unsigned int retry_after_ms = 0;
+        if (usbx_breaker_admit(handle->breaker, &retry_after_ms)) {
+            result = usbx_api_run_batch(handle, &job->batch, &line);
+        } else {
+            // Shed without touching the device, like a 503 for a single handle
+            result = USBX_ERROR_BUSY;
+            usbx_buf_printf(&line, "{\"handle_id\": %d, \"status\": \"%s\", \"code\": %d, "
+                            "\"circuit\": \"open\", \"retry_after_ms\": %u}",
+                            handle->handle_id, usbx_error_name(result), result, retry_after_ms);
+        }
+        usbx_buf_printf(&line, "\n");
+        if (line.failed) {
+            usbx_buf_free(&line);
+            usbx_buf_printf(&line, "{\"handle_id\": %d, \"status\": \"%s\", \"code\": %d}\n",
+                            handle->handle_id, usbx_error_name(USBX_ERROR_NO_MEM),
+                            USBX_ERROR_NO_MEM);
+            result = USBX_ERROR_NO_MEM;
+        }
+
+        pthread_mutex_lock(&job->lock);
+        usbx_buf_append(&job->lines, line.data, line.length);
+        job->completed++;
+        if (result == USBX_SUCCESS) {
+            job->succeeded++;
+        } else {
+            job->failed++;
+        }
+        pthread_cond_broadcast(&job->done_cond);
+        pthread_mutex_unlock(&job->lock);
+        usbx_buf_free(&line);
+    }
+    job_put(job);
+    return NULL;
+}
+
+static ssize_t fanout_stream_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    struct fanout_job *job = cls;
+    (void)pos;
+
+    pthread_mutex_lock(&job->lock);
+    if (job->lines_offset == job->lines.length) {
+        usbx_buf_free(&job->lines);
+        job->lines_offset = 0;
+
+        if (job->completed < job->count) {
+            struct timespec deadline;
+            usbx_deadline_ms(&deadline, STREAM_POLL_MS);
+            while (job->lines.length == 0 && job->completed < job->count) {
+                if (pthread_cond_timedwait(&job->done_cond, &job->lock, &deadline) ==
+                    ETIMEDOUT) {
+                    break;
+                }
+            }
+        } else if (!job->summarized) {
+            usbx_buf_printf(&job->lines, "{\"done\": true, \"devices\": %d, \"succeeded\": %d, "
+                            "\"failed\": %d}\n",
+                            job->count, job->succeeded, job->failed);
+            job->summarized = 1;
+        } else {
+            pthread_mutex_unlock(&job->lock);
+            return USBX_HTTP_END_OF_STREAM;
+        }
+    }
+    if (job->lines.failed) {
+        pthread_mutex_unlock(&job->lock);
+        return USBX_HTTP_STREAM_ERROR;
+    }
+
+    size_t length = job->lines.length - job->lines_offset;
+    if (length > max) {
+        length = max;
+    }
+    if (length > 0) {
+        memcpy(buf, job->lines.data + job->lines_offset, length);
+        job->lines_offset += length;
+    }
+    pthread_mutex_unlock(&job->lock);
+    return (ssize_t)length;
+}
+
+static void fanout_stream_free(void *cls) {
+    struct fanout_job *job = cls;
+
+    pthread_mutex_lock(&job->lock);
+    job->cancelled = 1;
+    pthread_mutex_unlock(&job->lock);
+    job_put(job);
+}
+
+/* Reference every open handle the selector matches; returns the count */
+static int collect_targets(const struct selector *sel, int *ids, struct usbx_handle **targets) {
+    int count = usbx_handle_list(ids, FANOUT_MAX_DEVICES);
+    int matched = 0;
+
+    if (count > FANOUT_MAX_DEVICES) {
+        count = FANOUT_MAX_DEVICES;
+    }
+    for (int i = 0; i < count; i++) {
+        struct usbx_handle *handle = usbx_handle_get(ids[i]);
+        if (handle && handle_selected(sel, handle)) {
+            targets[matched++] = handle;
+        } else {
+            usbx_handle_put(handle);
+        }
+    }
+    return matched;
+}
+
+/* Parse the body into a job with its targets; writes an error response on failure */
+static struct fanout_job *create_job(const struct usbx_http_request *req,
+                                     struct usbx_http_response *resp, long long *parallelism) {
+    struct usbx_json *body = usbx_api_parse_body(req, resp);
+    if (!body) {
+        return NULL;
+    }
+
+    struct selector sel;
+    const char *message = NULL;
+    int stop_on_error = usbx_json_bool(usbx_json_get(body, "stop_on_error"), 1);
+    int parsed = 0;
+    const struct usbx_json *operations = usbx_json_get(body, "operations");
+    if (!operations) {
+        operations = usbx_json_get(body, "operation");
+    }
+    struct fanout_job *job = calloc(1, sizeof(*job));
+    int *ids = malloc(FANOUT_MAX_DEVICES * sizeof(int));
+    if (job) {
+        job->targets = malloc(FANOUT_MAX_DEVICES * sizeof(*job->targets));
+    }
+    if (!job || !ids || !job->targets) {
+        usbx_http_set_json(resp, 500, NULL, 0);
+    } else if (parse_selector(usbx_json_get(body, "selector"), &sel, &message) < 0 ||
+               usbx_json_get_int(body, "parallelism", 1, FANOUT_MAX_PARALLELISM,
+                                 FANOUT_DEFAULT_PARALLELISM, parallelism) < 0 ||
+               (parsed = usbx_op_batch_parse(operations, stop_on_error, usbx_api_blob_store(),
+                                             &job->batch, &message)) == -1) {
+        usbx_http_set_error(resp, 400, message ? message : "parallelism must be 1-64", 0);
+    } else if (parsed < 0) {
+        usbx_api_set_budget_exhausted(resp, parsed);
+    } else {
+#ifdef USE_DEPS
+        if (sel.open) {
+            open_matching_devices(&sel, ids);
+        }
+#endif
+        job->count = collect_targets(&sel, ids, job->targets);
+        if (job->count == 0) {
+            usbx_http_set_error(resp, 404, "No open device matches the selector",
+                                USBX_ERROR_NOT_FOUND);
+            usbx_op_batch_free(&job->batch);
+        }
+    }
+    usbx_json_free(body);
+    free(ids);
+
+    if (!job || !job->targets || job->count == 0) {
+        if (job) {
+            free(job->targets);
+            free(job);
+        }
+        return NULL;
+    }
+    return job;
+}
+
+/* POST /fanout */
+static void run_fanout(void *cls, const struct usbx_http_request *req,
+                       struct usbx_http_response *resp) {
+    (void)cls;
+    long long parallelism;
+    struct fanout_job *job = create_job(req, resp, &parallelism);
+    if (!job) {
+        return;
+    }
+    pthread_mutex_init(&job->lock, NULL);
+    usbx_cond_init_monotonic(&job->done_cond);
+    usbx_buf_init(&job->lines);
+    job->refs = 1;      // the response stream
+    job->client = req->client_id ? strdup(req->client_id) : NULL;
+    job->quota = usbx_quota_current();
+
+    int workers = parallelism < job->count ? (int)parallelism : job->count;
+    int started = 0;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < workers; i++) {
+        pthread_t thread;
+        pthread_mutex_lock(&job->lock);
+        job->refs++;
+        pthread_mutex_unlock(&job->lock);
+        if (pthread_create(&thread, &attr, fanout_worker, job) != 0) {
+            job_put(job);
+            break;
+        }
+        started++;
+    }
+    pthread_attr_destroy(&attr);
+    if (started == 0) {
+        job_put(job);
+        usbx_http_set_error(resp, 500, "Cannot start fan-out workers", USBX_ERROR_NO_MEM);
+        return;
+    }
+
+    char devices[16];
+    snprintf(devices, sizeof(devices), "%d", job->count);
+    usbx_http_add_header(resp, "X-Usbx-Devices", devices);
+    usbx_http_set_reader(resp, "application/x-ndjson", fanout_stream_read, job,
+                         fanout_stream_free);
+}
+
+int usbx_api_register_fanout(struct usbx_http_router *router) {
+    return usbx_http_route(router, "POST", "/fanout", run_fanout, NULL);
+}
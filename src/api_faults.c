@@ -0,0 +1,208 @@
+/**
+ * @file api_faults.c
+ * @brief REST routes for fault and latency injection
+ *
+ * - POST   /handles/{id}/faults              set the rule of an endpoint or the default
+ * - POST   /handles/{id}/faults/disconnect   unplug the handle's device
+ * - DELETE /handles/{id}/faults              clear every rule and plug it back in
+ * - GET    /handles/{id}/faults              counters and rules
+ *
+ * A rule is given as query arguments: endpoint (omitted for the default),
+ * latency_us, jitter_us, tail_ppm, tail_us, error_ppm, error (a status name
+ * such as "stall" or "timeout") and disconnect_ppm; seed restarts the
+ * random draws. The routes exist only in builds with USBX_FAULT_INJECTION.
+ * Example:
+ *
+ *     curl -X POST 'http://host:8080/handles/1/faults?endpoint=0x81&latency_us=500&tail_ppm=1000&tail_us=20000'
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_buf.h"
+#include "usbx_fault.h"
+
+#ifdef USBX_FAULT_INJECTION
+
+/** @brief Upper bound of latencies accepted from a request (one minute) */
+#define MAX_LATENCY_US 60000000L
+
+/** @brief Upper bound of the per-million rates */
+#define MAX_PPM 1000000L
+
+static int parse_rule(const struct usbx_http_request *req, struct usbx_fault_rule *rule,
+                      struct usbx_http_response *resp) {
+    const char *text = usbx_http_arg(req, "endpoint");
+    int endpoint = text ? usbx_api_parse_endpoint(text) : USBX_FAULT_ALL_ENDPOINTS;
+    if (text && endpoint < 0) {
+        usbx_http_set_error(resp, 400, "Invalid endpoint", USBX_ERROR_INVALID_PARAM);
+        return -1;
+    }
+    usbx_fault_rule_init(rule, endpoint);
+
+    long latency = usbx_http_arg_long(req, "latency_us", 0);
+    long jitter = usbx_http_arg_long(req, "jitter_us", 0);
+    long tail = usbx_http_arg_long(req, "tail_us", 0);
+    long tail_ppm = usbx_http_arg_long(req, "tail_ppm", 0);
+    long error_ppm = usbx_http_arg_long(req, "error_ppm", 0);
+    long disconnect_ppm = usbx_http_arg_long(req, "disconnect_ppm", 0);
+    if (latency < 0 || latency > MAX_LATENCY_US || jitter < 0 || jitter > MAX_LATENCY_US ||
+        tail < 0 || tail > MAX_LATENCY_US) {
+        usbx_http_set_error(resp, 400, "latency_us, jitter_us and tail_us must be 0-60000000",
+                            USBX_ERROR_INVALID_PARAM);
+        return -1;
+    }
+    if (tail_ppm < 0 || tail_ppm > MAX_PPM || error_ppm < 0 || error_ppm > MAX_PPM ||
+        disconnect_ppm < 0 || disconnect_ppm > MAX_PPM) {
+        usbx_http_set_error(resp, 400, "tail_ppm, error_ppm and disconnect_ppm must be 0-1000000",
+                            USBX_ERROR_INVALID_PARAM);
+        return -1;
+    }
+    text = usbx_http_arg(req, "error");
+    if (text) {
+        int status = usbx_fault_parse_status(text);
+        if (status <= USBX_TRANSFER_COMPLETED) {
+            usbx_http_set_error(resp, 400, "Unknown error status", USBX_ERROR_INVALID_PARAM);
+            return -1;
+        }
+        rule->error_status = status;
+    }
+    rule->latency_us = (unsigned int)latency;
+    rule->jitter_us = (unsigned int)jitter;
+    rule->tail_us = (unsigned int)tail;
+    rule->tail_ppm = (unsigned int)tail_ppm;
+    rule->error_ppm = (unsigned int)error_ppm;
+    rule->disconnect_ppm = (unsigned int)disconnect_ppm;
+    return 0;
+}
+
+static void append_state(struct usbx_buf *buf, const struct usbx_handle *handle) {
+    struct usbx_fault_stats stats;
+    struct usbx_fault_rule rules[USBX_FAULT_MAX_RULES];
+
+    usbx_fault_get_stats(handle->dev, &stats);
+    int count = usbx_fault_get_rules(handle->dev, rules, USBX_FAULT_MAX_RULES);
+    usbx_buf_printf(buf, "{\"handle\": %d, \"disconnected\": %s, \"transfers\": %llu, "
+                    "\"delayed\": %llu, \"errors\": %llu, \"timeouts\": %llu, "
+                    "\"disconnects\": %llu, \"rejected\": %llu, \"rules\": [",
+                    handle->handle_id, stats.disconnected ? "true" : "false",
+                    (unsigned long long)stats.transfers, (unsigned long long)stats.delayed,
+                    (unsigned long long)stats.errors, (unsigned long long)stats.timeouts,
+                    (unsigned long long)stats.disconnects, (unsigned long long)stats.rejected);
+    for (int i = 0; i < count && i < USBX_FAULT_MAX_RULES; i++) {
+        const struct usbx_fault_rule *rule = &rules[i];
+        if (rule->endpoint == USBX_FAULT_ALL_ENDPOINTS) {
+            usbx_buf_printf(buf, "%s{\"endpoint\": null", i ? ", " : "");
+        } else {
+            usbx_buf_printf(buf, "%s{\"endpoint\": %d", i ? ", " : "", rule->endpoint);
+        }
+        usbx_buf_printf(buf, ", \"latency_us\": %u, \"jitter_us\": %u, \"tail_ppm\": %u, "
+                        "\"tail_us\": %u, \"error_ppm\": %u, \"error\": \"%s\", "
+                        "\"disconnect_ppm\": %u}",
+                        rule->latency_us, rule->jitter_us, rule->tail_ppm, rule->tail_us,
+                        rule->error_ppm, usbx_fault_status_name(rule->error_status),
+                        rule->disconnect_ppm);
+    }
+    usbx_buf_append(buf, "]}", 2);
+}
+
+static void respond_state(struct usbx_handle *handle, struct usbx_http_response *resp) {
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    append_state(&buf, handle);
+    usbx_handle_put(handle);
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+/* POST /handles/{id}/faults */
+static void set_fault(void *cls, const struct usbx_http_request *req,
+                      struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_fault_rule rule;
+    if (parse_rule(req, &rule, resp) < 0) {
+        return;
+    }
+    long seed = usbx_http_arg_long(req, "seed", -1);
+    if (usbx_http_arg(req, "seed") && seed < 0) {
+        usbx_http_set_error(resp, 400, "seed must be a non-negative integer",
+                            USBX_ERROR_INVALID_PARAM);
+        return;
+    }
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (!handle) {
+        return;
+    }
+    int result = usbx_fault_set_rule(handle->dev, &rule);
+    if (result != USBX_SUCCESS) {
+        usbx_handle_put(handle);
+        usbx_http_set_error(resp, usbx_http_status_for_error(result), "Cannot set the rule",
+                            result);
+        return;
+    }
+    if (seed >= 0) {
+        usbx_fault_seed((uint64_t)seed);
+    }
+    respond_state(handle, resp);
+}
+
+/* POST /handles/{id}/faults/disconnect */
+static void disconnect(void *cls, const struct usbx_http_request *req,
+                       struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (!handle) {
+        return;
+    }
+    int result = usbx_fault_disconnect(handle->dev);
+    if (result != USBX_SUCCESS) {
+        usbx_handle_put(handle);
+        usbx_http_set_error(resp, usbx_http_status_for_error(result), "Cannot disconnect",
+                            result);
+        return;
+    }
+    respond_state(handle, resp);
+}
+
+/* DELETE /handles/{id}/faults */
+static void clear_faults(void *cls, const struct usbx_http_request *req,
+                         struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (!handle) {
+        return;
+    }
+    usbx_fault_clear(handle->dev);
+    respond_state(handle, resp);
+}
+
+/* GET /handles/{id}/faults */
+static void get_faults(void *cls, const struct usbx_http_request *req,
+                       struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (handle) {
+        respond_state(handle, resp);
+    }
+}
+
+int usbx_api_register_faults(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "POST", "/handles/{id}/faults", set_fault, NULL) < 0 ||
+        usbx_http_route(router, "POST", "/handles/{id}/faults/disconnect", disconnect, NULL) < 0 ||
+        usbx_http_route(router, "DELETE", "/handles/{id}/faults", clear_faults, NULL) < 0 ||
+        usbx_http_route(router, "GET", "/handles/{id}/faults", get_faults, NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+#else
+
+int usbx_api_register_faults(struct usbx_http_router *router) {
+    (void)router;
+    return 0;
+}
+
+#endif // USBX_FAULT_INJECTION
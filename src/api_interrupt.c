@@ -0,0 +1,462 @@
+/**
+ * @file api_interrupt.c
+ * @brief REST routes for shared interrupt endpoint polling
+ *
+ * Routes (ep is an interrupt IN address such as 0x81):
+ *
+ * - GET    /handles/{id}/interrupts/{ep}/events            server-sent event stream
+ * - POST   /handles/{id}/interrupts/{ep}/subscribers       create a long-poll subscriber
+ * - GET    /handles/{id}/interrupts/{ep}/subscribers/{sub} long-poll for reports
+ * - DELETE /handles/{id}/interrupts/{ep}/subscribers/{sub} remove a subscriber
+ * - GET    /handles/{id}/interrupts/{ep}                   poller and subscriber counters
+ *
+ * The first subscriber starts the endpoint's poller (query arguments
+ * slots, in_flight, report_size and idle_timeout tune it); the poller stops
+ * when the last subscriber leaves. A subscriber that has not polled for
+ * idle_timeout milliseconds (default two minutes, 0 never) is removed,
+ * and the poller stops once the last one is. A poller stopped by a stall,
+ * a disconnect or idleness is replaced by the next subscriber; the
+ * subscribers it still had are removed with it. Every request or stream
+ * that uses a poller holds a use count on it, so it is only freed once
+ * nobody can still reach it.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_buf.h"
+#include "usbx_codec.h"
+#include "usbx_interrupt.h"
+#include "usbx_util.h"
+
+/** @brief How long an event stream waits for a report before checking back */
+#define SSE_POLL_MS 1000
+
+/** @brief Keep-alive comment interval of an idle event stream */
+#define SSE_KEEPALIVE_US 15000000ULL
+
+/** @brief Upper bounds of long-poll requests */
+#define LONG_POLL_MAX_TIMEOUT_MS 60000
+#define LONG_POLL_MAX_REPORTS 256
+
+/** @brief Default time a long-poll subscriber may go without polling */
+#define SUBSCRIBER_IDLE_MS 120000
+
+/** @brief Upper bound of subscribers listed in the status response */
+#define STATUS_MAX_SUBSCRIBERS 64
+
+/** @brief Slot index of an interrupt IN endpoint, or -1 */
+static int poller_index(int endpoint) {
+    if (endpoint < 0 || !(endpoint & USBX_ENDPOINT_IN) || (endpoint & 0x0f) == 0) {
+        return -1;
+    }
+    return (endpoint & 0x0f) - 1;
+}
+
+/*
+ * Take a use count on the endpoint's poller, optionally starting it. On
+ * failure an error response is written and NULL returned.
+ */
+static struct usbx_interrupt_poller *acquire_poller(struct usbx_handle *handle, int index,
+                                                    const struct usbx_http_request *req,
+                                                    int create, struct usbx_http_response *resp) {
+    struct usbx_interrupt_poller *poller;
+    struct usbx_interrupt_poller *stopped = NULL;
+
+    pthread_mutex_lock(&handle->lock);
+    poller = handle->pollers[index];
+    if (poller && create) {
+        struct usbx_interrupt_stats stats;
+        usbx_interrupt_get_stats(poller, &stats);
+        if (!stats.running && handle->poller_users[index] > 0) {
+            // Its remaining users see the error and let go of it shortly
+            pthread_mutex_unlock(&handle->lock);
+            usbx_http_set_error(resp, 503, "Polling stopped; retry", USBX_ERROR_BUSY);
+            return NULL;
+        }
+        if (!stats.running) {
+            stopped = poller;               // a new subscriber would never see a report
+            handle->pollers[index] = NULL;
+            poller = NULL;
+        }
+    }
+    if (!poller && create) {
+        struct usbx_interrupt_options opts;
+        int error;
+
+        usbx_interrupt_options_init(&opts);
+        opts.slots = (int)usbx_http_arg_long(req, "slots", opts.slots);
+        opts.transfers_in_flight = (int)usbx_http_arg_long(req, "in_flight",
+                                                           opts.transfers_in_flight);
+        opts.report_size = (int)usbx_http_arg_long(req, "report_size", opts.report_size);
+        long idle_ms = usbx_http_arg_long(req, "idle_timeout", SUBSCRIBER_IDLE_MS);
+        opts.idle_timeout_ms = idle_ms >= 0 && idle_ms <= 0x7fffffffL ? (unsigned int)idle_ms
+                                                                    : SUBSCRIBER_IDLE_MS;
+        poller = usbx_interrupt_poller_start(handle->dev, (unsigned char)(USBX_ENDPOINT_IN | (index + 1)),
+                                             &opts, &error);
+        if (!poller) {
+            pthread_mutex_unlock(&handle->lock);
+            usbx_interrupt_poller_destroy(stopped);
+            usbx_http_set_error(resp, usbx_http_status_for_error(error),
+                                "Cannot start interrupt polling", error);
+            return NULL;
+        }
+        handle->pollers[index] = poller;
+    }
+    if (poller) {
+        handle->poller_users[index]++;
+    }
+    pthread_mutex_unlock(&handle->lock);
+
+    usbx_interrupt_poller_destroy(stopped);
+    if (!poller) {
+        usbx_http_set_error(resp, 404, "Endpoint is not being polled", USBX_ERROR_NOT_FOUND);
+    }
+    return poller;
+}
+
+/* Drop a use count; the last user of a poller without subscribers frees it */
+static void release_poller(struct usbx_handle *handle, int index) {
+    struct usbx_interrupt_poller *poller = NULL;
+
+    pthread_mutex_lock(&handle->lock);
+    handle->poller_users[index]--;
+    if (handle->poller_users[index] == 0) {
+        struct usbx_interrupt_stats stats;
+        usbx_interrupt_get_stats(handle->pollers[index], &stats);
+        if (stats.subscribers == 0) {
+            poller = handle->pollers[index];
+            handle->pollers[index] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&handle->lock);
+
+    usbx_interrupt_poller_destroy(poller);
+}
+
+/** @brief Request context shared by the route handlers */
+struct interrupt_target {
+    struct usbx_handle *handle;
+    int index;
+    struct usbx_interrupt_poller *poller;
+};
+
+static int resolve_target(const struct usbx_http_request *req, struct usbx_http_response *resp,
+                          int create, struct interrupt_target *target) {
+    target->index = poller_index(usbx_api_parse_endpoint(usbx_http_param(req, "ep")));
+    if (target->index < 0) {
+        usbx_http_set_error(resp, 400, "Not an interrupt IN endpoint address", 0);
+        return -1;
+    }
+    target->handle = create ? usbx_api_get_device(req, resp) : usbx_api_get_handle(req, resp);
+    if (!target->handle) {
+        return -1;
+    }
+    target->poller = acquire_poller(target->handle, target->index, req, create, resp);
+    if (!target->poller) {
+        usbx_handle_put(target->handle);
+        return -1;
+    }
+    return 0;
+}
+
+static void release_target(struct interrupt_target *target) {
+    release_poller(target->handle, target->index);
+    usbx_handle_put(target->handle);
+}
+
+static int parse_subscriber(const struct usbx_http_request *req) {
+    const char *text = usbx_http_param(req, "sub");
+    char *end;
+
+    long id = text ? strtol(text, &end, 10) : 0;
+    return text && *end == '\0' && id > 0 && id <= 0x7fffffffL ? (int)id : -1;
+}
+
+/* Append one report as a JSON object */
+static void append_report(struct usbx_buf *buf, const struct usbx_interrupt_report *report) {
+    char encoded[((USBX_INTERRUPT_MAX_REPORT + 2) / 3) * 4 + 1];
+
+    usbx_base64_encode(report->data, (size_t)report->length, encoded);
+    usbx_buf_printf(buf, "{\"sequence\": %llu, \"timestamp_us\": %llu, \"length\": %d, "
+                    "\"data\": \"%s\"}",
+                    (unsigned long long)report->sequence,
+                    (unsigned long long)report->timestamp_us, report->length, encoded);
+}
+
+static void append_subscriber(struct usbx_buf *buf,
+                              const struct usbx_interrupt_subscriber_stats *stats) {
+    usbx_buf_printf(buf, "{\"subscriber\": %d, \"delivered\": %llu, \"dropped\": %llu, "
+                    "\"lag\": %llu}",
+                    stats->id, (unsigned long long)stats->delivered,
+                    (unsigned long long)stats->dropped, (unsigned long long)stats->lag);
+}
+
+/** @brief State of one server-sent event stream */
+struct event_stream {
+    struct interrupt_target target;
+    int subscriber;
+    struct usbx_buf pending;     // formatted text not yet handed to the front end
+    size_t pending_offset;
+    uint64_t last_write_us;
+    int finished;
+};
+
+/* Format the next event into stream->pending; returns 0 if there is nothing yet */
+static int next_event(struct event_stream *stream) {
+    struct usbx_interrupt_report report;
+    struct usbx_interrupt_subscriber_stats stats;
+
+    int result = usbx_interrupt_read(stream->target.poller, stream->subscriber, &report,
+                                     SSE_POLL_MS);
+    if (result == 1) {
+        usbx_interrupt_subscriber_stats(stream->target.poller, stream->subscriber, &stats);
+        usbx_buf_printf(&stream->pending, "id: %llu\nevent: report\ndata: ",
+                        (unsigned long long)report.sequence);
+        append_report(&stream->pending, &report);
+        usbx_buf_printf(&stream->pending, "\n\nevent: lag\ndata: ");
+        append_subscriber(&stream->pending, &stats);
+        usbx_buf_printf(&stream->pending, "\n\n");
+    } else if (result == 0) {
+        if (usbx_now_us() - stream->last_write_us < SSE_KEEPALIVE_US) {
+            return 0;
+        }
+        usbx_buf_printf(&stream->pending, ": keep-alive\n\n");
+    } else {
+        usbx_buf_printf(&stream->pending, "event: end\ndata: {\"code\": %d, \"name\": \"%s\"}\n\n",
+                        result, usbx_error_name(result));
+        stream->finished = 1;
+    }
+    return 1;
+}
+
+static ssize_t event_stream_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    struct event_stream *stream = cls;
+    (void)pos;
+
+    if (stream->pending_offset == stream->pending.length) {
+        if (stream->finished) {
+            return USBX_HTTP_END_OF_STREAM;
+        }
+        usbx_buf_free(&stream->pending);
+        stream->pending_offset = 0;
+        if (!next_event(stream)) {
+            return 0;
+        }
+        if (stream->pending.failed) {
+            return USBX_HTTP_STREAM_ERROR;
+        }
+    }
+
+    size_t length = stream->pending.length - stream->pending_offset;
+    if (length > max) {
+        length = max;
+    }
+    memcpy(buf, stream->pending.data + stream->pending_offset, length);
+    stream->pending_offset += length;
+    stream->last_write_us = usbx_now_us();
+    return (ssize_t)length;
+}
+
+static void event_stream_free(void *cls) {
+    struct event_stream *stream = cls;
+
+    usbx_interrupt_unsubscribe(stream->target.poller, stream->subscriber);
+    release_target(&stream->target);
+    usbx_buf_free(&stream->pending);
+    free(stream);
+}
+
+/* GET /handles/{id}/interrupts/{ep}/events?backlog=n */
+static void open_event_stream(void *cls, const struct usbx_http_request *req,
+                              struct usbx_http_response *resp) {
+    (void)cls;
+    struct event_stream *stream = calloc(1, sizeof(*stream));
+    if (!stream) {
+        usbx_http_set_json(resp, 500, NULL, 0);
+        return;
+    }
+    if (resolve_target(req, resp, 1, &stream->target) < 0) {
+        free(stream);
+        return;
+    }
+    stream->subscriber = usbx_interrupt_subscribe(stream->target.poller,
+                                                  (int)usbx_http_arg_long(req, "backlog", 0));
+    if (stream->subscriber < 0) {
+        release_target(&stream->target);
+        free(stream);
+        usbx_http_set_json(resp, 500, NULL, 0);
+        return;
+    }
+    usbx_buf_init(&stream->pending);
+    stream->last_write_us = usbx_now_us();
+
+    usbx_http_add_header(resp, "Cache-Control", "no-cache");
+    usbx_http_set_reader(resp, "text/event-stream", event_stream_read, stream,
+                         event_stream_free);
+}
+
+/* POST /handles/{id}/interrupts/{ep}/subscribers?backlog=n */
+static void create_subscriber(void *cls, const struct usbx_http_request *req,
+                              struct usbx_http_response *resp) {
+    (void)cls;
+    struct interrupt_target target;
+    if (resolve_target(req, resp, 1, &target) < 0) {
+        return;
+    }
+
+    int subscriber = usbx_interrupt_subscribe(target.poller,
+                                              (int)usbx_http_arg_long(req, "backlog", 0));
+    if (subscriber < 0) {
+        usbx_http_set_json(resp, 500, NULL, 0);
+    } else {
+        struct usbx_buf buf;
+        usbx_buf_init(&buf);
+        usbx_buf_printf(&buf, "{\"subscriber\": %d}", subscriber);
+        usbx_http_set_json_buf(resp, 201, &buf);
+    }
+    release_target(&target);
+}
+
+/* GET /handles/{id}/interrupts/{ep}/subscribers/{sub}?timeout=ms&max=n */
+static void long_poll(void *cls, const struct usbx_http_request *req,
+                      struct usbx_http_response *resp) {
+    (void)cls;
+    struct interrupt_target target;
+    int subscriber = parse_subscriber(req);
+    if (subscriber < 0) {
+        usbx_http_set_error(resp, 400, "Invalid subscriber id", 0);
+        return;
+    }
+    if (resolve_target(req, resp, 0, &target) < 0) {
+        return;
+    }
+
+    long timeout = usbx_http_arg_long(req, "timeout", 30000);
+    long max = usbx_http_arg_long(req, "max", 64);
+    if (timeout < 0 || timeout > LONG_POLL_MAX_TIMEOUT_MS) {
+        timeout = LONG_POLL_MAX_TIMEOUT_MS;
+    }
+    if (max < 1 || max > LONG_POLL_MAX_REPORTS) {
+        max = LONG_POLL_MAX_REPORTS;
+    }
+
+    struct usbx_interrupt_report *report = malloc(sizeof(*report));
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"reports\": [");
+
+    // Wait for the first report only, then take whatever else is already there
+    int result = report ? usbx_interrupt_read(target.poller, subscriber, report, (int)timeout)
+                        : USBX_ERROR_NO_MEM;
+    long count = 0;
+    while (result == 1) {
+        usbx_buf_printf(&buf, count > 0 ? ", " : "");
+        append_report(&buf, report);
+        if (++count == max) {
+            break;
+        }
+        result = usbx_interrupt_read(target.poller, subscriber, report, 0);
+    }
+    free(report);
+
+    struct usbx_interrupt_subscriber_stats stats;
+    if (result < 0 && count == 0) {
+        int status = result == USBX_ERROR_NOT_FOUND ? 404 : usbx_http_status_for_error(result);
+        usbx_buf_free(&buf);
+        usbx_http_set_error(resp, status, result == USBX_ERROR_NOT_FOUND ? "Unknown subscriber"
+                                                                         : "Polling stopped",
+                            result);
+    } else if (usbx_interrupt_subscriber_stats(target.poller, subscriber, &stats) ==
+               USBX_SUCCESS) {
+        usbx_buf_printf(&buf, "], \"counters\": ");
+        append_subscriber(&buf, &stats);
+        usbx_buf_printf(&buf, "}");
+        usbx_http_set_json_buf(resp, 200, &buf);
+    } else {
+        usbx_buf_free(&buf);
+        usbx_http_set_error(resp, 404, "Unknown subscriber", USBX_ERROR_NOT_FOUND);
+    }
+    release_target(&target);
+}
+
+/* DELETE /handles/{id}/interrupts/{ep}/subscribers/{sub} */
+static void delete_subscriber(void *cls, const struct usbx_http_request *req,
+                              struct usbx_http_response *resp) {
+    (void)cls;
+    struct interrupt_target target;
+    int subscriber = parse_subscriber(req);
+    if (subscriber < 0) {
+        usbx_http_set_error(resp, 400, "Invalid subscriber id", 0);
+        return;
+    }
+    if (resolve_target(req, resp, 0, &target) < 0) {
+        return;
+    }
+
+    int remaining = usbx_interrupt_unsubscribe(target.poller, subscriber);
+    if (remaining < 0) {
+        usbx_http_set_error(resp, 404, "Unknown subscriber", remaining);
+    } else {
+        struct usbx_buf buf;
+        usbx_buf_init(&buf);
+        usbx_buf_printf(&buf, "{\"subscriber\": %d, \"status\": \"removed\", "
+                        "\"subscribers\": %d}", subscriber, remaining);
+        usbx_http_set_json_buf(resp, 200, &buf);
+    }
+    release_target(&target);
+}
+
+/* GET /handles/{id}/interrupts/{ep} */
+static void poller_status(void *cls, const struct usbx_http_request *req,
+                          struct usbx_http_response *resp) {
+    (void)cls;
+    struct interrupt_target target;
+    if (resolve_target(req, resp, 0, &target) < 0) {
+        return;
+    }
+
+    struct usbx_interrupt_stats stats;
+    struct usbx_interrupt_subscriber_stats subscribers[STATUS_MAX_SUBSCRIBERS];
+    usbx_interrupt_get_stats(target.poller, &stats);
+    int count = usbx_interrupt_list_subscribers(target.poller, subscribers,
+                                                STATUS_MAX_SUBSCRIBERS);
+    if (count > STATUS_MAX_SUBSCRIBERS) {
+        count = STATUS_MAX_SUBSCRIBERS;
+    }
+
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"endpoint\": %d, \"running\": %s, \"reports\": %llu, "
+                    "\"bytes\": %llu, \"timeouts\": %llu, \"last_error\": \"%s\", "
+                    "\"subscribers\": [",
+                    USBX_ENDPOINT_IN | (target.index + 1), stats.running ? "true" : "false",
+                    (unsigned long long)stats.reports, (unsigned long long)stats.bytes,
+                    (unsigned long long)stats.timeouts, usbx_error_name(stats.last_error));
+    for (int i = 0; i < count; i++) {
+        usbx_buf_printf(&buf, i > 0 ? ", " : "");
+        append_subscriber(&buf, &subscribers[i]);
+    }
+    usbx_buf_printf(&buf, "]}");
+    usbx_http_set_json_buf(resp, 200, &buf);
+    release_target(&target);
+}
+
+int usbx_api_register_interrupt(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "GET", "/handles/{id}/interrupts/{ep}", poller_status,
+                        NULL) < 0 ||
+        usbx_http_route(router, "GET", "/handles/{id}/interrupts/{ep}/events",
+                        open_event_stream, NULL) < 0 ||
+        usbx_http_route(router, "POST", "/handles/{id}/interrupts/{ep}/subscribers",
+                        create_subscriber, NULL) < 0 ||
+        usbx_http_route(router, "GET", "/handles/{id}/interrupts/{ep}/subscribers/{sub}",
+                        long_poll, NULL) < 0 ||
+        usbx_http_route(router, "DELETE", "/handles/{id}/interrupts/{ep}/subscribers/{sub}",
+                        delete_subscriber, NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
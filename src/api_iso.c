@@ -0,0 +1,334 @@
+/**
+ * @file api_iso.c
+ * @brief REST routes for isochronous streams
+ *
+ * Routes (ep is an isochronous endpoint address such as 0x81 or 0x02):
+ *
+ * - GET /handles/{id}/iso/{ep}         IN: frame stream (application/octet-stream)
+ * - PUT /handles/{id}/iso/{ep}         OUT: play the request body, answer with the counters
+ * - GET /handles/{id}/iso/{ep}/status  counters of the stream running on ep
+ *
+ * The GET response body is the sequence of UXI1 frames described in
+ * usbx_iso.h, one per completed transfer. The request starts the stream and
+ * the stream stops when the client goes away, so an endpoint has one reader
+ * at a time; a second request gets 409. Closing the handle ends the body
+ * cleanly once the queued frames are sent; a stream that dies on its own,
+ * e.g. because the device went away, is aborted so the client can tell it
+ * was truncated.
+ *
+ * The PUT body is raw payload, cut into packets as it arrives; the response
+ * is sent once everything queued has been transmitted. An OUT endpoint has
+ * one writer at a time. Both accept the query arguments packets (per
+ * transfer), in_flight, packet_size and buffer_size.
+ *
+ * Lost packets, underruns and overruns cannot be told from the frames
+ * alone, so the status route reports them while a stream runs; see
+ * struct usbx_iso_counters.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdlib.h>
+
+#include "usbx_api.h"
+#include "usbx_buf.h"
+#include "usbx_compress.h"
+#include "usbx_iso.h"
+#include "usbx_util.h"
+
+/** @brief How long a stream read or write waits before checking the stream */
+#define STREAM_POLL_MS 1000
+
+/** @brief Body bytes read per step of an OUT upload */
+#define UPLOAD_BLOCK_SIZE (16 * 1024)
+
+/** @brief Interval at which an OUT upload checks whether its data went out */
+#define DRAIN_POLL_US 1000
+
+/** @brief Whether an address names a non-control endpoint */
+static int is_iso_endpoint(int endpoint) {
+    return endpoint >= 0 && (endpoint & 0x0f) != 0;
+}
+
+/* Where the handle keeps the endpoint's stream (handle lock held) */
+static struct usbx_iso_stream **stream_slot(struct usbx_handle *handle, int endpoint) {
+    int index = (endpoint & 0x0f) - 1;
+    return endpoint & USBX_ENDPOINT_IN ? &handle->iso_streams[index]
+                                       : &handle->iso_out_streams[index];
+}
+
+/* Free the endpoint's slot and destroy its stream */
+static void release_stream(struct usbx_handle *handle, int endpoint,
+                           struct usbx_iso_stream *stream) {
+    pthread_mutex_lock(&handle->lock);
+    *stream_slot(handle, endpoint) = NULL;
+    pthread_mutex_unlock(&handle->lock);
+    usbx_iso_stream_destroy(stream);
+}
+
+static void print_counters(struct usbx_buf *buf, const struct usbx_iso_counters *c) {
+    usbx_buf_printf(buf, "\"transfers\": %llu, \"packets\": %llu, \"bytes\": %llu, "
+                    "\"packets_lost\": %llu, \"underruns\": %llu, \"overruns\": %llu, "
+                    "\"pipeline_drains\": %llu, \"cancelled\": %llu, "
+                    "\"resubmit_failures\": %llu, \"in_flight\": %d",
+                    (unsigned long long)c->transfers, (unsigned long long)c->packets,
+                    (unsigned long long)c->bytes, (unsigned long long)c->packets_lost,
+                    (unsigned long long)c->underruns, (unsigned long long)c->overruns,
+                    (unsigned long long)c->pipeline_drains, (unsigned long long)c->cancelled,
+                    (unsigned long long)c->resubmit_failures, c->in_flight);
+}
+
+/** @brief State of one streaming response */
+struct iso_response {
+    struct usbx_handle *handle;
+    int endpoint;
+    struct usbx_iso_stream *stream;
+};
+
+static ssize_t iso_response_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    struct iso_response *response = cls;
+    (void)pos;
+
+    size_t n = usbx_iso_stream_read(response->stream, buf, max, STREAM_POLL_MS);
+    if (n > 0) {
+        return (ssize_t)n;
+    }
+    if (!usbx_iso_stream_finished(response->stream)) {
+        return 0;
+    }
+    return usbx_iso_stream_error(response->stream) == USBX_SUCCESS ? USBX_HTTP_END_OF_STREAM
+                                                                   : USBX_HTTP_STREAM_ERROR;
+}
+
+static void iso_response_free(void *cls) {
+    struct iso_response *response = cls;
+
+    release_stream(response->handle, response->endpoint, response->stream);
+    usbx_handle_put(response->handle);
+    free(response);
+}
+
+/*
+ * Start the endpoint's stream and claim its slot. On failure an error
+ * response is written and NULL returned.
+ */
+static struct usbx_iso_stream *start_stream(struct usbx_handle *handle, int endpoint,
+                                            const struct usbx_http_request *req,
+                                            struct usbx_http_response *resp) {
+    struct usbx_iso_options opts;
+    struct usbx_iso_stream *stream = NULL;
+    int busy, error;
+
+    usbx_iso_options_init(&opts);
+    opts.packets_per_transfer = (int)usbx_http_arg_long(req, "packets",
+                                                        opts.packets_per_transfer);
+    opts.transfers_in_flight = (int)usbx_http_arg_long(req, "in_flight", opts.transfers_in_flight);
+    opts.packet_size = (int)usbx_http_arg_long(req, "packet_size", opts.packet_size);
+    long buffer_size = usbx_http_arg_long(req, "buffer_size", (long)opts.buffer_size);
+    opts.buffer_size = buffer_size > 0 ? (size_t)buffer_size : 0;
+
+    pthread_mutex_lock(&handle->lock);
+    struct usbx_iso_stream **slot = stream_slot(handle, endpoint);
+    busy = *slot != NULL;
+    if (!busy) {
+        stream = usbx_iso_stream_start(handle->dev, (unsigned char)endpoint, &opts, &error);
+        *slot = stream;
+    }
+    pthread_mutex_unlock(&handle->lock);
+
+    if (busy) {
+        usbx_http_set_error(resp, 409, "Endpoint is already being streamed", USBX_ERROR_BUSY);
+    } else if (!stream) {
+        usbx_http_set_error(resp, usbx_http_status_for_error(error),
+                            "Cannot start the isochronous stream", error);
+    }
+    return stream;
+}
+
+/* GET /handles/{id}/iso/{ep}?packets=n&in_flight=n&packet_size=bytes&buffer_size=bytes */
+static void open_iso_stream(void *cls, const struct usbx_http_request *req,
+                            struct usbx_http_response *resp) {
+    (void)cls;
+    int endpoint = usbx_api_parse_endpoint(usbx_http_param(req, "ep"));
+    if (!is_iso_endpoint(endpoint) || !(endpoint & USBX_ENDPOINT_IN)) {
+        usbx_http_set_error(resp, 400, "Not an IN endpoint address", 0);
+        return;
+    }
+
+    struct iso_response *response = calloc(1, sizeof(*response));
+    if (!response) {
+        usbx_http_set_json(resp, 500, NULL, 0);
+        return;
+    }
+    response->endpoint = endpoint;
+    response->handle = usbx_api_get_device(req, resp);
+    if (!response->handle) {
+        free(response);
+        return;
+    }
+    response->stream = start_stream(response->handle, endpoint, req, resp);
+    if (!response->stream) {
+        usbx_handle_put(response->handle);
+        free(response);
+        return;
+    }
+
+    usbx_http_set_reader(resp, "application/octet-stream", iso_response_read, response,
+                         iso_response_free);
+    usbx_compress_response(req, resp);
+}
+
+/* USBX_SUCCESS while an OUT stream runs, otherwise why it ended */
+static int out_stream_result(struct usbx_iso_stream *stream) {
+    struct usbx_iso_counters counters;
+
+    usbx_iso_stream_get_counters(stream, &counters);
+    if (counters.in_flight > 0) {
+        return USBX_SUCCESS;
+    }
+    int error = usbx_iso_stream_error(stream);
+    return error != USBX_SUCCESS ? error : USBX_ERROR_INTERRUPTED;   // the handle was closed
+}
+
+/* Queue the request body on an OUT stream; *written counts what was queued */
+static int queue_body(struct usbx_iso_stream *stream, const struct usbx_http_request *req,
+                      uint64_t *written) {
+    unsigned char block[UPLOAD_BLOCK_SIZE];
+
+    for (;;) {
+        long n = usbx_http_read_body(req, *written, block, sizeof(block));
+        if (n <= 0) {
+            return n < 0 ? (int)n : USBX_SUCCESS;
+        }
+        size_t queued = 0;
+        while (queued < (size_t)n) {
+            size_t step = usbx_iso_stream_write(stream, block + queued, (size_t)n - queued,
+                                                STREAM_POLL_MS);
+            int result = out_stream_result(stream);
+            if (step == 0 && result != USBX_SUCCESS) {
+                return result;
+            }
+            queued += step;
+        }
+        *written += (uint64_t)n;
+    }
+}
+
+/*
+ * Wait until the queued payload has gone out: the stream buffer is empty
+ * and every transfer that may have taken part of it has completed.
+ */
+static int drain_stream(struct usbx_iso_stream *stream) {
+    struct usbx_iso_counters counters;
+    int result;
+
+    while (usbx_iso_stream_queued(stream) > 0) {
+        if ((result = out_stream_result(stream)) != USBX_SUCCESS) {
+            return result;
+        }
+        usbx_sleep_us(DRAIN_POLL_US);
+    }
+    usbx_iso_stream_get_counters(stream, &counters);
+    uint64_t last = counters.transfers + (uint64_t)counters.in_flight;
+    while (counters.transfers < last) {
+        if ((result = out_stream_result(stream)) != USBX_SUCCESS) {
+            return result;
+        }
+        usbx_sleep_us(DRAIN_POLL_US);
+        usbx_iso_stream_get_counters(stream, &counters);
+    }
+    return USBX_SUCCESS;
+}
+
+/* PUT /handles/{id}/iso/{ep}?packets=n&in_flight=n&packet_size=bytes&buffer_size=bytes */
+static void play_iso_stream(void *cls, const struct usbx_http_request *req,
+                            struct usbx_http_response *resp) {
+    (void)cls;
+    int endpoint = usbx_api_parse_endpoint(usbx_http_param(req, "ep"));
+    if (!is_iso_endpoint(endpoint) || (endpoint & USBX_ENDPOINT_IN)) {
+        usbx_http_set_error(resp, 400, "Not an OUT endpoint address", 0);
+        return;
+    }
+
+    struct usbx_handle *handle = usbx_api_get_device(req, resp);
+    if (!handle) {
+        return;
+    }
+    struct usbx_iso_stream *stream = start_stream(handle, endpoint, req, resp);
+    if (!stream) {
+        usbx_handle_put(handle);
+        return;
+    }
+
+    uint64_t written = 0;
+    int result = queue_body(stream, req, &written);
+    if (result == USBX_SUCCESS) {
+        result = drain_stream(stream);
+    }
+    usbx_iso_stream_stop(stream);
+    struct usbx_iso_counters counters;
+    usbx_iso_stream_get_counters(stream, &counters);
+    release_stream(handle, endpoint, stream);
+    usbx_handle_put(handle);
+
+    if (result != USBX_SUCCESS) {
+        usbx_http_set_error(resp, usbx_http_status_for_error(result),
+                            "Isochronous stream ended before the body was sent", result);
+        return;
+    }
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"written\": %llu, ", (unsigned long long)written);
+    print_counters(&buf, &counters);
+    usbx_buf_printf(&buf, "}");
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+/* GET /handles/{id}/iso/{ep}/status */
+static void get_iso_status(void *cls, const struct usbx_http_request *req,
+                           struct usbx_http_response *resp) {
+    (void)cls;
+    int endpoint = usbx_api_parse_endpoint(usbx_http_param(req, "ep"));
+    if (!is_iso_endpoint(endpoint)) {
+        usbx_http_set_error(resp, 400, "Invalid endpoint address", 0);
+        return;
+    }
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (!handle) {
+        return;
+    }
+
+    // Streams are destroyed only after leaving their slot, so reading under the lock is safe
+    struct usbx_iso_counters counters;
+    int error = USBX_SUCCESS;
+    pthread_mutex_lock(&handle->lock);
+    struct usbx_iso_stream *stream = *stream_slot(handle, endpoint);
+    if (stream) {
+        usbx_iso_stream_get_counters(stream, &counters);
+        error = usbx_iso_stream_error(stream);
+    }
+    pthread_mutex_unlock(&handle->lock);
+    usbx_handle_put(handle);
+
+    if (!stream) {
+        usbx_http_set_error(resp, 404, "No stream on this endpoint", USBX_ERROR_NOT_FOUND);
+        return;
+    }
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"endpoint\": %d, ", endpoint);
+    print_counters(&buf, &counters);
+    usbx_buf_printf(&buf, ", \"error\": %d}", error);
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+int usbx_api_register_iso(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "GET", "/handles/{id}/iso/{ep}", open_iso_stream, NULL) < 0 ||
+        usbx_http_route_streaming(router, "PUT", "/handles/{id}/iso/{ep}", play_iso_stream,
+                                  NULL) < 0 ||
+        usbx_http_route(router, "GET", "/handles/{id}/iso/{ep}/status", get_iso_status,
+                        NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
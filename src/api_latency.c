@@ -0,0 +1,127 @@
+/**
+ * @file api_latency.c
+ * @brief REST routes for latency estimates and adaptive timeouts
+ *
+ * - GET    /handles/{id}/latency   settings and the estimate of every bulk
+ *                                  endpoint and control request seen
+ * - POST   /handles/{id}/latency   change settings: enabled=0|1, multiplier,
+ *                                  min_timeout_ms, min_samples
+ * - DELETE /handles/{id}/latency   forget the estimates
+ *
+ * Timeouts given by clients stay upper bounds; see usbx_latency.h.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_buf.h"
+#include "usbx_latency.h"
+
+static void respond_state(struct usbx_handle *handle, struct usbx_http_response *resp) {
+    struct usbx_latency_config config;
+    struct usbx_latency_estimate *estimates = NULL;
+    struct usbx_buf buf;
+
+    usbx_latency_get_config(handle->latency, &config);
+    int count = usbx_latency_get_estimates(handle->latency, NULL, 0);
+    if (count > 0 && (estimates = malloc((size_t)count * sizeof(*estimates)))) {
+        int now = usbx_latency_get_estimates(handle->latency, estimates, count);
+        count = now < count ? now : count;
+    } else {
+        count = 0;
+    }
+
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"handle\": %d, \"enabled\": %s, \"multiplier\": %u, "
+                    "\"min_timeout_ms\": %u, \"min_samples\": %u, \"estimates\": [",
+                    handle->handle_id, config.enabled ? "true" : "false", config.multiplier,
+                    config.min_timeout_ms, config.min_samples);
+    for (int i = 0; i < count; i++) {
+        const struct usbx_latency_estimate *e = &estimates[i];
+        usbx_buf_printf(&buf, "%s{\"endpoint\": %u", i > 0 ? ", " : "", e->endpoint);
+        if (e->endpoint == 0) {
+            usbx_buf_printf(&buf, ", \"request_type\": %u, \"request\": %u", e->request_type,
+                            e->request);
+        }
+        usbx_buf_printf(&buf, ", \"samples\": %llu, \"mean_us\": %llu, \"deviation_us\": %llu, "
+                        "\"peak_us\": %llu, \"timeout_ms\": %u, \"backoff\": %u, "
+                        "\"adapted\": %llu, \"early_timeouts\": %llu}",
+                        (unsigned long long)e->samples, (unsigned long long)e->mean_us,
+                        (unsigned long long)e->deviation_us, (unsigned long long)e->peak_us,
+                        e->timeout_ms, e->backoff, (unsigned long long)e->adapted,
+                        (unsigned long long)e->early_timeouts);
+    }
+    usbx_buf_printf(&buf, "]}");
+    free(estimates);
+    usbx_handle_put(handle);
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+/* GET /handles/{id}/latency */
+static void get_latency(void *cls, const struct usbx_http_request *req,
+                        struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (handle) {
+        respond_state(handle, resp);
+    }
+}
+
+/* POST /handles/{id}/latency */
+static void configure_latency(void *cls, const struct usbx_http_request *req,
+                              struct usbx_http_response *resp) {
+    (void)cls;
+    const char *enabled = usbx_http_arg(req, "enabled");
+    if (enabled && strcmp(enabled, "0") != 0 && strcmp(enabled, "1") != 0) {
+        usbx_http_set_error(resp, 400, "enabled must be 0 or 1", USBX_ERROR_INVALID_PARAM);
+        return;
+    }
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (!handle) {
+        return;
+    }
+    struct usbx_latency_config config;
+    usbx_latency_get_config(handle->latency, &config);
+    long multiplier = usbx_http_arg_long(req, "multiplier", (long)config.multiplier);
+    long min_timeout = usbx_http_arg_long(req, "min_timeout_ms", (long)config.min_timeout_ms);
+    long min_samples = usbx_http_arg_long(req, "min_samples", (long)config.min_samples);
+    if (multiplier < 1 || multiplier > USBX_LATENCY_MAX_MULTIPLIER || min_timeout < 1 ||
+        min_timeout > USBX_LATENCY_MAX_MIN_TIMEOUT_MS || min_samples < 1 ||
+        min_samples > USBX_LATENCY_MAX_MIN_SAMPLES) {
+        usbx_handle_put(handle);
+        usbx_http_set_error(resp, 400, "multiplier must be 1-64, min_timeout_ms 1-60000 and "
+                            "min_samples 1-10000", USBX_ERROR_INVALID_PARAM);
+        return;
+    }
+    if (enabled) {
+        config.enabled = enabled[0] == '1';
+    }
+    config.multiplier = (unsigned int)multiplier;
+    config.min_timeout_ms = (unsigned int)min_timeout;
+    config.min_samples = (unsigned int)min_samples;
+    usbx_latency_configure(handle->latency, &config);
+    respond_state(handle, resp);
+}
+
+/* DELETE /handles/{id}/latency */
+static void reset_latency(void *cls, const struct usbx_http_request *req,
+                          struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (handle) {
+        usbx_latency_reset(handle->latency);
+        respond_state(handle, resp);
+    }
+}
+
+int usbx_api_register_latency(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "GET", "/handles/{id}/latency", get_latency, NULL) < 0 ||
+        usbx_http_route(router, "POST", "/handles/{id}/latency", configure_latency, NULL) < 0 ||
+        usbx_http_route(router, "DELETE", "/handles/{id}/latency", reset_latency, NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+/**
+ * @file api_ops.c
+ * @brief REST route for running a batch of operations on one handle
+ *
+ * - POST /handles/{id}/batch  body {"operations": [...], "stop_on_error": true}
+ *
+ * The operations are described in usbx_ops.h. The response lists one
+ * result per executed operation; a failed operation does not change the
+ * HTTP status, which only reports problems with the request itself.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include "usbx_api.h"
+#include "usbx_buf.h"
+#include "usbx_json.h"
+#include "usbx_ops.h"
+#include "usbx_util.h"
+
+int usbx_api_run_batch(struct usbx_handle *handle, const struct usbx_op_batch *batch,
+                       struct usbx_buf *out) {
+    uint64_t start_us = usbx_now_us();
+    struct usbx_buf results;
+
+    usbx_buf_init(&results);
+    int result = usbx_op_batch_run(handle->dev, batch, handle->retry, &results);
+
+    usbx_buf_printf(out, "{\"handle_id\": %d, \"vid\": %u, \"pid\": %u, \"serial\": ",
+                    handle->handle_id, handle->info.vid, handle->info.pid);
+    usbx_buf_json_string(out, handle->info.serial);
+    usbx_buf_printf(out, ", \"status\": \"%s\", \"code\": %d, \"elapsed_us\": %llu, "
+                    "\"results\": ",
+                    usbx_error_name(result), result,
+                    (unsigned long long)(usbx_now_us() - start_us));
+    usbx_buf_append(out, results.data, results.length);
+    usbx_buf_printf(out, "}");
+    if (results.failed) {
+        out->failed = 1;
+    }
+    usbx_buf_free(&results);
+    return result;
+}
+
+/* POST /handles/{id}/batch */
+static void run_batch(void *cls, const struct usbx_http_request *req,
+                      struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_json *body = usbx_api_parse_body(req, resp);
+    if (!body) {
+        return;
+    }
+
+    struct usbx_op_batch batch;
+    const char *message;
+    int stop_on_error = usbx_json_bool(usbx_json_get(body, "stop_on_error"), 1);
+    int parsed = usbx_op_batch_parse(usbx_json_get(body, "operations"), stop_on_error,
+                                     usbx_api_blob_store(), &batch, &message);
+    usbx_json_free(body);
+    if (parsed == -1) {
+        usbx_http_set_error(resp, 400, message, 0);
+        return;
+    }
+    if (parsed < 0) {
+        usbx_api_set_budget_exhausted(resp, parsed);
+        return;
+    }
+
+    struct usbx_handle *handle = usbx_api_get_device(req, resp);
+    if (handle) {
+        struct usbx_buf buf;
+        usbx_buf_init(&buf);
+        usbx_api_run_batch(handle, &batch, &buf);
+        usbx_http_set_json_buf(resp, 200, &buf);
+        usbx_handle_put(handle);
+    }
+    usbx_op_batch_free(&batch);
+}
+
+int usbx_api_register_batch(struct usbx_http_router *router) {
+    return usbx_http_route(router, "POST", "/handles/{id}/batch", run_batch, NULL);
+}
@@ -0,0 +1,247 @@
+/**
+ * @file api_pubsub.c
+ * @brief REST routes for bulk IN streams shared by several clients
+ *
+ * Routes (ep is a bulk IN address such as 0x82):
+ *
+ * - GET /handles/{id}/streams/{ep}/data  raw stream (application/octet-stream)
+ * - GET /handles/{id}/streams/{ep}       publisher and subscriber counters
+ *
+ * Each data request is one subscriber. Query arguments: policy (drop,
+ * disconnect or bounded), limit (backlog bytes) and, for the request that
+ * starts the publisher, chunk_size and in_flight. The publisher stops when
+ * its last subscriber goes away. A stream that ends because its policy
+ * disconnected it, or because the device failed, is aborted rather than
+ * closed cleanly so clients can tell it was truncated.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "usbx_api.h"
+#include "usbx_buf.h"
+#include "usbx_compress.h"
+#include "usbx_pubsub.h"
+
+/** @brief How long a stream read waits before returning to the front end */
+#define STREAM_POLL_MS 1000
+
+/** @brief Upper bound of subscribers listed in the status response */
+#define STATUS_MAX_SUBSCRIBERS 64
+
+/** @brief Slot index of an IN endpoint, or -1 */
+static int pubsub_index(int endpoint) {
+    if (endpoint < 0 || !(endpoint & USBX_ENDPOINT_IN) || (endpoint & 0x0f) == 0) {
+        return -1;
+    }
+    return (endpoint & 0x0f) - 1;
+}
+
+/*
+ * Take a use count on the endpoint's publisher, optionally starting it. On
+ * failure an error response is written and NULL returned.
+ */
+static struct usbx_pubsub *acquire_pubsub(struct usbx_handle *handle, int index,
+                                          const struct usbx_http_request *req, int create,
+                                          struct usbx_http_response *resp) {
+    struct usbx_pubsub *pubsub;
+
+    pthread_mutex_lock(&handle->lock);
+    pubsub = handle->pubsubs[index];
+    if (!pubsub && create) {
+        struct usbx_pubsub_options opts;
+        int error;
+
+        usbx_pubsub_options_init(&opts);
+        long chunk_size = usbx_http_arg_long(req, "chunk_size", (long)opts.chunk_size);
+        opts.chunk_size = chunk_size > 0 ? (size_t)chunk_size : 0;
+        opts.transfers_in_flight = (int)usbx_http_arg_long(req, "in_flight",
+                                                           opts.transfers_in_flight);
+        pubsub = usbx_pubsub_start(handle->dev, (unsigned char)(USBX_ENDPOINT_IN | (index + 1)),
+                                   &opts, &error);
+        if (!pubsub) {
+            pthread_mutex_unlock(&handle->lock);
+            usbx_http_set_error(resp, usbx_http_status_for_error(error),
+                                "Cannot start the shared stream", error);
+            return NULL;
+        }
+        handle->pubsubs[index] = pubsub;
+    }
+    if (pubsub) {
+        handle->pubsub_users[index]++;
+    }
+    pthread_mutex_unlock(&handle->lock);
+
+    if (!pubsub) {
+        usbx_http_set_error(resp, 404, "Endpoint is not being streamed", USBX_ERROR_NOT_FOUND);
+    }
+    return pubsub;
+}
+
+/* Drop a use count; the last user of a publisher without subscribers frees it */
+static void release_pubsub(struct usbx_handle *handle, int index) {
+    struct usbx_pubsub *pubsub = NULL;
+
+    pthread_mutex_lock(&handle->lock);
+    handle->pubsub_users[index]--;
+    if (handle->pubsub_users[index] == 0) {
+        struct usbx_pubsub_stats stats;
+        usbx_pubsub_get_stats(handle->pubsubs[index], &stats);
+        if (stats.subscribers == 0) {
+            pubsub = handle->pubsubs[index];
+            handle->pubsubs[index] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&handle->lock);
+
+    usbx_pubsub_destroy(pubsub);
+}
+
+/** @brief Request context shared by the route handlers */
+struct stream_target {
+    struct usbx_handle *handle;
+    int index;
+    struct usbx_pubsub *pubsub;
+};
+
+static int resolve_target(const struct usbx_http_request *req, struct usbx_http_response *resp,
+                          int create, struct stream_target *target) {
+    target->index = pubsub_index(usbx_api_parse_endpoint(usbx_http_param(req, "ep")));
+    if (target->index < 0) {
+        usbx_http_set_error(resp, 400, "Not an IN endpoint address", 0);
+        return -1;
+    }
+    target->handle = create ? usbx_api_get_device(req, resp) : usbx_api_get_handle(req, resp);
+    if (!target->handle) {
+        return -1;
+    }
+    target->pubsub = acquire_pubsub(target->handle, target->index, req, create, resp);
+    if (!target->pubsub) {
+        usbx_handle_put(target->handle);
+        return -1;
+    }
+    return 0;
+}
+
+static void release_target(struct stream_target *target) {
+    release_pubsub(target->handle, target->index);
+    usbx_handle_put(target->handle);
+}
+
+/** @brief State of one streaming response */
+struct data_stream {
+    struct stream_target target;
+    int subscriber;
+};
+
+static ssize_t data_stream_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    struct data_stream *stream = cls;
+    (void)pos;
+
+    long result = usbx_pubsub_read(stream->target.pubsub, stream->subscriber,
+                                   (unsigned char *)buf, max, STREAM_POLL_MS);
+    if (result >= 0) {
+        return (ssize_t)result;
+    }
+    return result == USBX_ERROR_INTERRUPTED ? USBX_HTTP_END_OF_STREAM : USBX_HTTP_STREAM_ERROR;
+}
+
+static void data_stream_free(void *cls) {
+    struct data_stream *stream = cls;
+
+    usbx_pubsub_unsubscribe(stream->target.pubsub, stream->subscriber);
+    release_target(&stream->target);
+    free(stream);
+}
+
+/* GET /handles/{id}/streams/{ep}/data?policy=drop|disconnect|bounded&limit=bytes */
+static void open_data_stream(void *cls, const struct usbx_http_request *req,
+                             struct usbx_http_response *resp) {
+    (void)cls;
+    const char *policy_name = usbx_http_arg(req, "policy");
+    int policy = policy_name ? usbx_pubsub_policy_from_name(policy_name) : USBX_PUBSUB_DROP;
+    long limit = usbx_http_arg_long(req, "limit", 0);
+    if (policy < 0 || limit < 0) {
+        usbx_http_set_error(resp, 400, "policy must be drop, disconnect or bounded", 0);
+        return;
+    }
+
+    struct data_stream *stream = calloc(1, sizeof(*stream));
+    if (!stream) {
+        usbx_http_set_json(resp, 500, NULL, 0);
+        return;
+    }
+    if (resolve_target(req, resp, 1, &stream->target) < 0) {
+        free(stream);
+        return;
+    }
+    stream->subscriber = usbx_pubsub_subscribe(stream->target.pubsub, policy, (uint64_t)limit);
+    if (stream->subscriber < 0) {
+        release_target(&stream->target);
+        free(stream);
+        usbx_http_set_json(resp, 500, NULL, 0);
+        return;
+    }
+
+    char id[16];
+    snprintf(id, sizeof(id), "%d", stream->subscriber);
+    usbx_http_add_header(resp, "X-Usbx-Subscriber", id);
+    usbx_http_set_reader(resp, "application/octet-stream", data_stream_read, stream,
+                         data_stream_free);
+    usbx_compress_response(req, resp);
+}
+
+/* GET /handles/{id}/streams/{ep} */
+static void stream_status(void *cls, const struct usbx_http_request *req,
+                          struct usbx_http_response *resp) {
+    (void)cls;
+    struct stream_target target;
+    if (resolve_target(req, resp, 0, &target) < 0) {
+        return;
+    }
+
+    struct usbx_pubsub_stats stats;
+    struct usbx_pubsub_subscriber_stats subscribers[STATUS_MAX_SUBSCRIBERS];
+    usbx_pubsub_get_stats(target.pubsub, &stats);
+    int count = usbx_pubsub_list_subscribers(target.pubsub, subscribers,
+                                             STATUS_MAX_SUBSCRIBERS);
+    if (count > STATUS_MAX_SUBSCRIBERS) {
+        count = STATUS_MAX_SUBSCRIBERS;
+    }
+
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"endpoint\": %d, \"running\": %s, \"paused\": %s, "
+                    "\"chunks\": %llu, \"bytes\": %llu, \"retained_chunks\": %llu, "
+                    "\"retained_bytes\": %llu, \"pauses\": %llu, \"last_error\": \"%s\", "
+                    "\"subscribers\": [",
+                    USBX_ENDPOINT_IN | (target.index + 1), stats.running ? "true" : "false",
+                    stats.paused ? "true" : "false", (unsigned long long)stats.chunks,
+                    (unsigned long long)stats.bytes, (unsigned long long)stats.retained_chunks,
+                    (unsigned long long)stats.retained_bytes, (unsigned long long)stats.pauses,
+                    usbx_error_name(stats.last_error));
+    for (int i = 0; i < count; i++) {
+        const struct usbx_pubsub_subscriber_stats *sub = &subscribers[i];
+        usbx_buf_printf(&buf, "%s{\"subscriber\": %d, \"policy\": \"%s\", \"limit\": %llu, "
+                        "\"delivered\": %llu, \"dropped\": %llu, \"backlog\": %llu, "
+                        "\"disconnected\": %s}",
+                        i > 0 ? ", " : "", sub->id, usbx_pubsub_policy_name(sub->policy),
+                        (unsigned long long)sub->limit, (unsigned long long)sub->delivered,
+                        (unsigned long long)sub->dropped, (unsigned long long)sub->backlog,
+                        sub->disconnected ? "true" : "false");
+    }
+    usbx_buf_printf(&buf, "]}");
+    usbx_http_set_json_buf(resp, 200, &buf);
+    release_target(&target);
+}
+
+int usbx_api_register_pubsub(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "GET", "/handles/{id}/streams/{ep}", stream_status, NULL) < 0 ||
+        usbx_http_route(router, "GET", "/handles/{id}/streams/{ep}/data", open_data_stream,
+                        NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,151 @@
+/**
+ * @file api_quota.c
+ * @brief REST routes for per-client quotas
+ *
+ * - GET    /quotas   defaults and the limits, counters and current wait of
+ *                    every client seen (by fingerprint)
+ * - POST   /quotas   change limits: requests_per_sec, request_burst,
+ *                    bytes_per_sec, byte_burst (0 = unlimited or one
+ *                    second's worth); with client=<key> for that client
+ *                    only, otherwise the defaults
+ * - DELETE /quotas   client=<key>: return the client to the defaults
+ *
+ * Limits not given keep their current value; see usbx_quota.h.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_buf.h"
+#include "usbx_quota.h"
+
+static void print_limits(struct usbx_buf *buf, const struct usbx_quota_limits *limits) {
+    usbx_buf_printf(buf, "\"requests_per_sec\": %llu, \"request_burst\": %llu, "
+                    "\"bytes_per_sec\": %llu, \"byte_burst\": %llu",
+                    (unsigned long long)limits->requests_per_sec,
+                    (unsigned long long)limits->request_burst,
+                    (unsigned long long)limits->bytes_per_sec,
+                    (unsigned long long)limits->byte_burst);
+}
+
+static void respond_state(struct usbx_http_response *resp) {
+    struct usbx_quota_limits defaults;
+    struct usbx_quota_usage *usage = NULL;
+    struct usbx_buf buf;
+
+    usbx_quota_get_defaults(&defaults);
+    int count = usbx_quota_get_usage(NULL, 0);
+    if (count > 0 && (usage = malloc((size_t)count * sizeof(*usage)))) {
+        int now = usbx_quota_get_usage(usage, count);
+        count = now < count ? now : count;
+    } else {
+        count = 0;
+    }
+
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"defaults\": {");
+    print_limits(&buf, &defaults);
+    usbx_buf_printf(&buf, "}, \"clients\": [");
+    for (int i = 0; i < count; i++) {
+        const struct usbx_quota_usage *u = &usage[i];
+        usbx_buf_printf(&buf, "%s{\"client\": \"%s\", \"custom\": %s, ", i > 0 ? ", " : "",
+                        u->fingerprint, u->custom ? "true" : "false");
+        print_limits(&buf, &u->limits);
+        usbx_buf_printf(&buf, ", \"admitted\": %llu, \"rejected\": %llu, \"bytes\": %llu, "
+                        "\"retry_after_ms\": %llu}",
+                        (unsigned long long)u->admitted, (unsigned long long)u->rejected,
+                        (unsigned long long)u->bytes, (unsigned long long)u->retry_after_ms);
+    }
+    usbx_buf_printf(&buf, "]}");
+    free(usage);
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+/* GET /quotas */
+static void get_quotas(void *cls, const struct usbx_http_request *req,
+                       struct usbx_http_response *resp) {
+    (void)cls;
+    (void)req;
+    respond_state(resp);
+}
+
+/* Read one limit argument into *value; -1 if it is not a non-negative number */
+static int parse_limit(const struct usbx_http_request *req, const char *name, uint64_t *value) {
+    const char *text = usbx_http_arg(req, name);
+    char *end;
+
+    if (!text) {
+        return 0;
+    }
+    if (*text < '0' || *text > '9') {
+        return -1;
+    }
+    unsigned long long parsed = strtoull(text, &end, 10);
+    if (*end != '\0') {
+        return -1;
+    }
+    *value = parsed;
+    return 0;
+}
+
+/* POST /quotas */
+static void configure_quotas(void *cls, const struct usbx_http_request *req,
+                             struct usbx_http_response *resp) {
+    (void)cls;
+    const char *client = usbx_http_arg(req, "client");
+    struct usbx_quota_limits limits;
+
+    if (client && !*client) {
+        usbx_http_set_error(resp, 400, "client must not be empty", USBX_ERROR_INVALID_PARAM);
+        return;
+    }
+    if (client) {
+        usbx_quota_get_client(client, &limits);
+    } else {
+        usbx_quota_get_defaults(&limits);
+    }
+    if (parse_limit(req, "requests_per_sec", &limits.requests_per_sec) < 0 ||
+        parse_limit(req, "request_burst", &limits.request_burst) < 0 ||
+        parse_limit(req, "bytes_per_sec", &limits.bytes_per_sec) < 0 ||
+        parse_limit(req, "byte_burst", &limits.byte_burst) < 0) {
+        usbx_http_set_error(resp, 400, "Limits must be non-negative integers",
+                            USBX_ERROR_INVALID_PARAM);
+        return;
+    }
+    if (!client) {
+        usbx_quota_set_defaults(&limits);
+    } else if (usbx_quota_set_client(client, &limits) != USBX_SUCCESS) {
+        usbx_http_set_error(resp, 503, "Too many clients", USBX_ERROR_NO_MEM);
+        return;
+    }
+    respond_state(resp);
+}
+
+/* DELETE /quotas */
+static void clear_quota(void *cls, const struct usbx_http_request *req,
+                        struct usbx_http_response *resp) {
+    (void)cls;
+    const char *client = usbx_http_arg(req, "client");
+
+    if (!client || !*client) {
+        usbx_http_set_error(resp, 400, "Missing client", USBX_ERROR_INVALID_PARAM);
+        return;
+    }
+    if (usbx_quota_clear_client(client) != USBX_SUCCESS) {
+        usbx_http_set_error(resp, 404, "Client has no limits of its own", USBX_ERROR_NOT_FOUND);
+        return;
+    }
+    respond_state(resp);
+}
+
+int usbx_api_register_quotas(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "GET", "/quotas", get_quotas, NULL) < 0 ||
+        usbx_http_route(router, "POST", "/quotas", configure_quotas, NULL) < 0 ||
+        usbx_http_route(router, "DELETE", "/quotas", clear_quota, NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,202 @@
+/**
+ * @file api_retry.c
+ * @brief REST routes for stall recovery and timeout retry policies
+ *
+ * - POST   /handles/{id}/retry   set the policy of an endpoint or the default
+ * - DELETE /handles/{id}/retry   remove every policy and reset the counters
+ * - GET    /handles/{id}/retry   policies and counters
+ *
+ * A policy is given as query arguments: endpoint (omitted for the
+ * default), stall_retries, timeout_retries, backoff_ms, max_backoff_ms and
+ * idempotent, a comma-separated list of "in", "out" and "control" (or
+ * "none"). The policies apply to batch and fan-out operations on the
+ * handle (usbx_retry.h). Example:
+ *
+ *     curl -X POST 'http://host:8080/handles/1/retry?endpoint=0x81&stall_retries=2&idempotent=in'
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_buf.h"
+#include "usbx_retry.h"
+
+static const struct {
+    unsigned int flag;
+    const char *name;
+} idempotent_names[] = {
+    {USBX_RETRY_IN, "in"},
+    {USBX_RETRY_OUT, "out"},
+    {USBX_RETRY_CONTROL, "control"},
+};
+
+/* Parse "in,out,control" or "none"; returns -1 on an unknown name */
+static int parse_idempotent(const char *text, unsigned int *flags) {
+    *flags = 0;
+    if (strcmp(text, "none") == 0) {
+        return 0;
+    }
+    while (*text) {
+        size_t length = strcspn(text, ",");
+        int found = 0;
+        for (size_t i = 0; i < sizeof(idempotent_names) / sizeof(idempotent_names[0]); i++) {
+            if (strlen(idempotent_names[i].name) == length &&
+                strncmp(idempotent_names[i].name, text, length) == 0) {
+                *flags |= idempotent_names[i].flag;
+                found = 1;
+            }
+        }
+        if (!found) {
+            return -1;
+        }
+        text += length;
+        if (*text == ',') {
+            text++;
+        }
+    }
+    return 0;
+}
+
+static int parse_policy(const struct usbx_http_request *req, struct usbx_retry_policy *policy,
+                        struct usbx_http_response *resp) {
+    const char *text = usbx_http_arg(req, "endpoint");
+    int endpoint = text ? usbx_api_parse_endpoint(text) : USBX_RETRY_ALL_ENDPOINTS;
+    if (text && endpoint < 0) {
+        usbx_http_set_error(resp, 400, "Invalid endpoint", USBX_ERROR_INVALID_PARAM);
+        return -1;
+    }
+    usbx_retry_policy_init(policy, endpoint);
+
+    long stalls = usbx_http_arg_long(req, "stall_retries", 0);
+    long timeouts = usbx_http_arg_long(req, "timeout_retries", 0);
+    long backoff = usbx_http_arg_long(req, "backoff_ms", 0);
+    long max_backoff = usbx_http_arg_long(req, "max_backoff_ms", backoff);
+    if (stalls < 0 || stalls > USBX_RETRY_MAX_ATTEMPTS || timeouts < 0 ||
+        timeouts > USBX_RETRY_MAX_ATTEMPTS) {
+        usbx_http_set_error(resp, 400, "stall_retries and timeout_retries must be 0-16",
+                            USBX_ERROR_INVALID_PARAM);
+        return -1;
+    }
+    if (backoff < 0 || backoff > USBX_RETRY_MAX_BACKOFF_MS || max_backoff < 0 ||
+        max_backoff > USBX_RETRY_MAX_BACKOFF_MS) {
+        usbx_http_set_error(resp, 400, "backoff_ms and max_backoff_ms must be 0-10000",
+                            USBX_ERROR_INVALID_PARAM);
+        return -1;
+    }
+    text = usbx_http_arg(req, "idempotent");
+    if (text && parse_idempotent(text, &policy->idempotent) < 0) {
+        usbx_http_set_error(resp, 400, "idempotent must list in, out and control, or be none",
+                            USBX_ERROR_INVALID_PARAM);
+        return -1;
+    }
+    policy->stall_retries = (unsigned int)stalls;
+    policy->timeout_retries = (unsigned int)timeouts;
+    policy->backoff_ms = (unsigned int)backoff;
+    policy->max_backoff_ms = (unsigned int)max_backoff;
+    return 0;
+}
+
+static void append_stats(struct usbx_buf *buf, const struct usbx_retry_stats *stats) {
+    usbx_buf_printf(buf, "\"stall_retries\": %llu, \"timeout_retries\": %llu, "
+                    "\"clear_halts\": %llu, \"recovered\": %llu, \"exhausted\": %llu, "
+                    "\"unsafe\": %llu",
+                    (unsigned long long)stats->stall_retries,
+                    (unsigned long long)stats->timeout_retries,
+                    (unsigned long long)stats->clear_halts, (unsigned long long)stats->recovered,
+                    (unsigned long long)stats->exhausted, (unsigned long long)stats->unsafe);
+}
+
+static void respond_state(struct usbx_handle *handle, struct usbx_http_response *resp) {
+    struct usbx_retry_policy policies[USBX_RETRY_MAX_POLICIES];
+    struct usbx_retry_stats stats;
+    struct usbx_buf buf;
+
+    usbx_buf_init(&buf);
+    usbx_retry_get_stats(handle->retry, USBX_RETRY_ALL_ENDPOINTS, &stats);
+    usbx_buf_printf(&buf, "{\"handle\": %d, ", handle->handle_id);
+    append_stats(&buf, &stats);
+    usbx_buf_printf(&buf, ", \"policies\": [");
+    int count = usbx_retry_get_policies(handle->retry, policies, USBX_RETRY_MAX_POLICIES);
+    for (int i = 0; i < count && i < USBX_RETRY_MAX_POLICIES; i++) {
+        const struct usbx_retry_policy *policy = &policies[i];
+        if (policy->endpoint == USBX_RETRY_ALL_ENDPOINTS) {
+            usbx_buf_printf(&buf, "%s{\"endpoint\": null", i ? ", " : "");
+        } else {
+            usbx_buf_printf(&buf, "%s{\"endpoint\": %d", i ? ", " : "", policy->endpoint);
+        }
+        usbx_buf_printf(&buf, ", \"stall_retries\": %u, \"timeout_retries\": %u, "
+                        "\"backoff_ms\": %u, \"max_backoff_ms\": %u, \"idempotent\": [",
+                        policy->stall_retries, policy->timeout_retries, policy->backoff_ms,
+                        policy->max_backoff_ms);
+        int listed = 0;
+        for (size_t j = 0; j < sizeof(idempotent_names) / sizeof(idempotent_names[0]); j++) {
+            if (policy->idempotent & idempotent_names[j].flag) {
+                usbx_buf_printf(&buf, "%s\"%s\"", listed++ ? ", " : "", idempotent_names[j].name);
+            }
+        }
+        usbx_buf_printf(&buf, "]");
+        if (policy->endpoint != USBX_RETRY_ALL_ENDPOINTS) {
+            usbx_retry_get_stats(handle->retry, policy->endpoint, &stats);
+            usbx_buf_printf(&buf, ", ");
+            append_stats(&buf, &stats);
+        }
+        usbx_buf_printf(&buf, "}");
+    }
+    usbx_buf_append(&buf, "]}", 2);
+    usbx_handle_put(handle);
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+/* POST /handles/{id}/retry */
+static void set_retry(void *cls, const struct usbx_http_request *req,
+                      struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_retry_policy policy;
+    if (parse_policy(req, &policy, resp) < 0) {
+        return;
+    }
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (!handle) {
+        return;
+    }
+    int result = usbx_retry_set(handle->retry, &policy);
+    if (result != USBX_SUCCESS) {
+        usbx_handle_put(handle);
+        usbx_http_set_error(resp, 400, "Invalid retry policy", result);
+        return;
+    }
+    respond_state(handle, resp);
+}
+
+/* DELETE /handles/{id}/retry */
+static void clear_retry(void *cls, const struct usbx_http_request *req,
+                        struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (handle) {
+        usbx_retry_clear(handle->retry);
+        respond_state(handle, resp);
+    }
+}
+
+/* GET /handles/{id}/retry */
+static void get_retry(void *cls, const struct usbx_http_request *req,
+                      struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (handle) {
+        respond_state(handle, resp);
+    }
+}
+
+int usbx_api_register_retry(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "POST", "/handles/{id}/retry", set_retry, NULL) < 0 ||
+        usbx_http_route(router, "DELETE", "/handles/{id}/retry", clear_retry, NULL) < 0 ||
+        usbx_http_route(router, "GET", "/handles/{id}/retry", get_retry, NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
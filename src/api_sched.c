@@ -0,0 +1,122 @@
+/**
+ * @file api_sched.c
+ * @brief REST routes for fair sharing of a device between clients
+ *
+ * - GET  /handles/{id}/scheduler   settings, slots in use and the queue
+ *                                  depth, weight and wait times per client
+ * - POST /handles/{id}/scheduler   change settings: enabled=0|1,
+ *                                  max_in_flight, quantum; client and weight
+ *                                  together set the weight of one client
+ *
+ * Clients are listed by fingerprint; see usbx_sched.h.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_buf.h"
+#include "usbx_sched.h"
+
+static void respond_state(struct usbx_handle *handle, struct usbx_http_response *resp) {
+    struct usbx_sched_config config;
+    struct usbx_sched_stats stats;
+    struct usbx_sched_client_stats *clients;
+    struct usbx_buf buf;
+
+    usbx_sched_get_config(handle->sched, &config);
+    clients = malloc((USBX_SCHED_MAX_CLIENTS + 1) * sizeof(*clients));
+    int count = usbx_sched_get_stats(handle->sched, &stats, clients,
+                                     clients ? USBX_SCHED_MAX_CLIENTS + 1 : 0);
+
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"handle\": %d, \"enabled\": %s, \"max_in_flight\": %u, "
+                    "\"quantum\": %u, \"in_flight\": %u, \"queued\": %u, "
+                    "\"control_first\": %llu, \"clients\": [",
+                    handle->handle_id, config.enabled ? "true" : "false", config.max_in_flight,
+                    config.quantum, stats.in_flight, stats.queued,
+                    (unsigned long long)stats.control_first);
+    for (int i = 0; i < count; i++) {
+        const struct usbx_sched_client_stats *c = &clients[i];
+        usbx_buf_printf(&buf, "%s{\"client\": \"%s\", \"weight\": %u, \"queued\": %u, "
+                        "\"max_queued\": %u, \"admitted\": %llu, \"bytes\": %llu, "
+                        "\"waited\": %llu, \"mean_wait_us\": %llu, \"max_wait_us\": %llu, "
+                        "\"expired\": %llu}",
+                        i > 0 ? ", " : "", c->fingerprint, c->weight, c->queued, c->max_queued,
+                        (unsigned long long)c->admitted, (unsigned long long)c->bytes,
+                        (unsigned long long)c->waited,
+                        (unsigned long long)(c->waited ? c->wait_us / c->waited : 0),
+                        (unsigned long long)c->max_wait_us, (unsigned long long)c->expired);
+    }
+    usbx_buf_printf(&buf, "]}");
+    free(clients);
+    usbx_handle_put(handle);
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+/* GET /handles/{id}/scheduler */
+static void get_scheduler(void *cls, const struct usbx_http_request *req,
+                          struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (handle) {
+        respond_state(handle, resp);
+    }
+}
+
+/* POST /handles/{id}/scheduler */
+static void configure_scheduler(void *cls, const struct usbx_http_request *req,
+                                struct usbx_http_response *resp) {
+    (void)cls;
+    const char *enabled = usbx_http_arg(req, "enabled");
+    if (enabled && strcmp(enabled, "0") != 0 && strcmp(enabled, "1") != 0) {
+        usbx_http_set_error(resp, 400, "enabled must be 0 or 1", USBX_ERROR_INVALID_PARAM);
+        return;
+    }
+    const char *client = usbx_http_arg(req, "client");
+    long weight = usbx_http_arg_long(req, "weight", 0);
+    if ((client != NULL) != (usbx_http_arg(req, "weight") != NULL) ||
+        (client && (client[0] == '\0' || weight < 1 || weight > USBX_SCHED_MAX_WEIGHT))) {
+        usbx_http_set_error(resp, 400, "client and weight 1-100 go together",
+                            USBX_ERROR_INVALID_PARAM);
+        return;
+    }
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (!handle) {
+        return;
+    }
+    struct usbx_sched_config config;
+    usbx_sched_get_config(handle->sched, &config);
+    long max_in_flight = usbx_http_arg_long(req, "max_in_flight", (long)config.max_in_flight);
+    long quantum = usbx_http_arg_long(req, "quantum", (long)config.quantum);
+    if (max_in_flight < 1 || max_in_flight > USBX_SCHED_MAX_IN_FLIGHT || quantum < 1 ||
+        quantum > USBX_SCHED_MAX_QUANTUM) {
+        usbx_handle_put(handle);
+        usbx_http_set_error(resp, 400, "max_in_flight must be 1-64 and quantum 1-16777216",
+                            USBX_ERROR_INVALID_PARAM);
+        return;
+    }
+    if (client && usbx_sched_set_weight(handle->sched, client, (unsigned int)weight) < 0) {
+        usbx_handle_put(handle);
+        usbx_http_set_error(resp, 503, "Too many clients", USBX_ERROR_NO_MEM);
+        return;
+    }
+    if (enabled) {
+        config.enabled = enabled[0] == '1';
+    }
+    config.max_in_flight = (unsigned int)max_in_flight;
+    config.quantum = (unsigned int)quantum;
+    usbx_sched_configure(handle->sched, &config);
+    respond_state(handle, resp);
+}
+
+int usbx_api_register_sched(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "GET", "/handles/{id}/scheduler", get_scheduler, NULL) < 0 ||
+        usbx_http_route(router, "POST", "/handles/{id}/scheduler", configure_scheduler,
+                        NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
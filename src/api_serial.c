@@ -0,0 +1,388 @@
+/**
+ * @file api_serial.c
+ * @brief REST routes for CDC-ACM serial channels
+ *
+ * - POST /handles/{id}/serial        open the channel, or change its line settings
+ * - GET  /handles/{id}/serial        line settings and counters
+ * - GET  /handles/{id}/serial/data   received data as a stream
+ * - POST /handles/{id}/serial/data   body: bytes to send
+ *
+ * Opening takes interface=n, in=ep, out=ep and ring=bytes; opening and
+ * reconfiguring take baud=n, data_bits=n, parity=none|odd|even|mark|space,
+ * stop_bits=1|1.5|2, dtr=0|1 and rts=0|1.
+ *
+ * A data stream starts at the current end of the output, or backlog=bytes
+ * earlier, and is released in batches: flush=newline (the default) sends
+ * complete lines, flush=batch only batches; either way batch_size=bytes
+ * and batch_ms=ms bound how long data waits. The stream is raw bytes, or
+ * with "Accept: text/event-stream" one "data" event per batch carrying the
+ * stream offset and the text as a JSON string.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_buf.h"
+#include "usbx_cdc.h"
+#include "usbx_compress.h"
+#include "usbx_util.h"
+
+/** @brief How long a stream read waits for a batch before returning to the front end */
+#define STREAM_POLL_MS 1000
+
+/** @brief Keep-alive comment interval of an idle event stream */
+#define SSE_KEEPALIVE_US 15000000ULL
+
+/** @brief Upper bound of one batch handed to the front end */
+#define STREAM_MAX_BATCH (64 * 1024)
+
+/** @brief Upper bound of the history ring */
+#define SERIAL_MAX_RING_SIZE (64 * 1024 * 1024)
+
+static const char *const parity_names[] = {"none", "odd", "even", "mark", "space"};
+static const char *const stop_bits_names[] = {"1", "1.5", "2"};
+
+static int find_name(const char *const *names, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Apply the line arguments to a coding and control lines; returns -1 if one is invalid */
+static int parse_line(const struct usbx_http_request *req, struct usbx_cdc_line_coding *coding,
+                      int *lines) {
+    const char *parity = usbx_http_arg(req, "parity");
+    const char *stop_bits = usbx_http_arg(req, "stop_bits");
+    long baud = usbx_http_arg_long(req, "baud", (long)coding->baud);
+    long dtr = usbx_http_arg_long(req, "dtr", (*lines & USBX_CDC_CONTROL_DTR) != 0);
+    long rts = usbx_http_arg_long(req, "rts", (*lines & USBX_CDC_CONTROL_RTS) != 0);
+
+    if (baud <= 0 || baud > 0x7fffffffL) {
+        return -1;
+    }
+    coding->baud = (uint32_t)baud;
+    coding->data_bits = (int)usbx_http_arg_long(req, "data_bits", coding->data_bits);
+    if (parity) {
+        coding->parity = find_name(parity_names, 5, parity);
+    }
+    if (stop_bits) {
+        coding->stop_bits = find_name(stop_bits_names, 3, stop_bits);
+    }
+    *lines = (dtr ? USBX_CDC_CONTROL_DTR : 0) | (rts ? USBX_CDC_CONTROL_RTS : 0);
+    return coding->parity < 0 || coding->stop_bits < 0 ? -1 : 0;
+}
+
+/* The handle's channel, or NULL with a 404 */
+static struct usbx_cdc *get_channel(struct usbx_handle *handle, struct usbx_http_response *resp) {
+    pthread_mutex_lock(&handle->lock);
+    struct usbx_cdc *cdc = handle->cdc;
+    pthread_mutex_unlock(&handle->lock);
+    if (!cdc) {
+        usbx_http_set_error(resp, 404, "Serial channel is not open", USBX_ERROR_NOT_FOUND);
+    }
+    return cdc;
+}
+
+static void set_status(struct usbx_http_response *resp, int status, struct usbx_cdc *cdc) {
+    struct usbx_cdc_stats stats;
+    usbx_cdc_get_stats(cdc, &stats);
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"baud\": %u, \"data_bits\": %d, \"parity\": \"%s\", "
+                    "\"stop_bits\": \"%s\", \"dtr\": %s, \"rts\": %s, \"received\": %llu, "
+                    "\"sent\": %llu, \"transfers\": %llu, \"oldest\": %llu, \"running\": %s, "
+                    "\"last_error\": \"%s\"}",
+                    stats.coding.baud, stats.coding.data_bits, parity_names[stats.coding.parity],
+                    stop_bits_names[stats.coding.stop_bits],
+                    stats.control_lines & USBX_CDC_CONTROL_DTR ? "true" : "false",
+                    stats.control_lines & USBX_CDC_CONTROL_RTS ? "true" : "false",
+                    (unsigned long long)stats.received, (unsigned long long)stats.sent,
+                    (unsigned long long)stats.transfers, (unsigned long long)stats.oldest,
+                    stats.running ? "true" : "false", usbx_error_name(stats.last_error));
+    usbx_http_set_json_buf(resp, status, &buf);
+}
+
+/* Open a channel from the request arguments (handle not locked) */
+static struct usbx_cdc *open_channel(const struct usbx_http_request *req,
+                                     struct usbx_handle *handle,
+                                     struct usbx_http_response *resp) {
+    struct usbx_cdc_options opts;
+    usbx_cdc_options_init(&opts);
+    const char *in = usbx_http_arg(req, "in");
+    const char *out = usbx_http_arg(req, "out");
+    int in_endpoint = in ? usbx_api_parse_endpoint(in) : opts.in_endpoint;
+    int out_endpoint = out ? usbx_api_parse_endpoint(out) : opts.out_endpoint;
+    long ring = usbx_http_arg_long(req, "ring", (long)opts.ring_size);
+    opts.interface = (int)usbx_http_arg_long(req, "interface", 0);
+    if (in_endpoint <= 0 || !(in_endpoint & USBX_ENDPOINT_IN) || out_endpoint <= 0 ||
+        (out_endpoint & USBX_ENDPOINT_IN) || ring < opts.transfer_size ||
+        ring > SERIAL_MAX_RING_SIZE || parse_line(req, &opts.coding, &opts.control_lines) < 0) {
+        usbx_http_set_error(resp, 400, "Invalid endpoint, ring size or line setting",
+                            USBX_ERROR_INVALID_PARAM);
+        return NULL;
+    }
+    opts.in_endpoint = (unsigned char)in_endpoint;
+    opts.out_endpoint = (unsigned char)out_endpoint;
+    opts.ring_size = (size_t)ring;
+
+    int error = USBX_SUCCESS;
+    struct usbx_cdc *cdc = usbx_cdc_open(handle->dev, &opts, &error);
+    if (!cdc) {
+        usbx_http_set_error(resp, usbx_http_status_for_error(error),
+                            "Could not open the serial channel", error);
+    }
+    return cdc;
+}
+
+/* POST /handles/{id}/serial */
+static void configure_serial(void *cls, const struct usbx_http_request *req,
+                             struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_device(req, resp);
+    if (!handle) {
+        return;
+    }
+    pthread_mutex_lock(&handle->lock);
+    struct usbx_cdc *cdc = handle->cdc;
+    pthread_mutex_unlock(&handle->lock);
+
+    if (!cdc) {
+        // Open without the lock held; a concurrent first request may win the race
+        struct usbx_cdc *opened = open_channel(req, handle, resp);
+        if (!opened) {
+            usbx_handle_put(handle);
+            return;
+        }
+        pthread_mutex_lock(&handle->lock);
+        if (!handle->cdc) {
+            handle->cdc = opened;
+            opened = NULL;
+        }
+        cdc = handle->cdc;
+        pthread_mutex_unlock(&handle->lock);
+        usbx_cdc_close(opened);
+        set_status(resp, 201, cdc);
+        usbx_handle_put(handle);
+        return;
+    }
+
+    struct usbx_cdc_stats stats;
+    usbx_cdc_get_stats(cdc, &stats);
+    int lines = stats.control_lines;
+    int result = USBX_SUCCESS;
+    if (parse_line(req, &stats.coding, &lines) < 0) {
+        result = USBX_ERROR_INVALID_PARAM;
+    }
+    if (result == USBX_SUCCESS) {
+        result = usbx_cdc_set_line_coding(cdc, &stats.coding);
+    }
+    if (result == USBX_SUCCESS && lines != stats.control_lines) {
+        result = usbx_cdc_set_control_lines(cdc, lines);
+    }
+    if (result < 0) {
+        usbx_http_set_error(resp, usbx_http_status_for_error(result),
+                            "Could not change the line settings", result);
+    } else {
+        set_status(resp, 200, cdc);
+    }
+    usbx_handle_put(handle);
+}
+
+/* GET /handles/{id}/serial */
+static void serial_status(void *cls, const struct usbx_http_request *req,
+                          struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (!handle) {
+        return;
+    }
+    struct usbx_cdc *cdc = get_channel(handle, resp);
+    if (cdc) {
+        set_status(resp, 200, cdc);
+    }
+    usbx_handle_put(handle);
+}
+
+/** @brief State of one data stream; holds a handle reference, which keeps the channel */
+struct serial_stream {
+    struct usbx_handle *handle;
+    struct usbx_cdc *cdc;
+    struct usbx_cdc_reader reader;
+    int events;                  // server-sent events instead of raw bytes
+    unsigned char batch[STREAM_MAX_BATCH];
+    struct usbx_buf pending;     // event text not yet handed to the front end
+    size_t pending_offset;
+    uint64_t last_write_us;
+    int finished;
+};
+
+static ssize_t raw_stream_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    struct serial_stream *stream = cls;
+    (void)pos;
+
+    long result = usbx_cdc_read(stream->cdc, &stream->reader, (unsigned char *)buf, max,
+                                STREAM_POLL_MS);
+    if (result >= 0) {
+        return (ssize_t)result;
+    }
+    return result == USBX_ERROR_INTERRUPTED ? USBX_HTTP_END_OF_STREAM : USBX_HTTP_STREAM_ERROR;
+}
+
+/* Format the next event into stream->pending; returns 0 if there is nothing yet */
+static int next_event(struct serial_stream *stream) {
+    uint64_t offset = stream->reader.cursor;
+    uint64_t dropped = stream->reader.dropped;
+    long result = usbx_cdc_read(stream->cdc, &stream->reader, stream->batch,
+                                sizeof(stream->batch), STREAM_POLL_MS);
+
+    if (result > 0) {
+        if (stream->reader.dropped > dropped) {
+            offset += stream->reader.dropped - dropped;
+        }
+        usbx_buf_printf(&stream->pending, "event: data\ndata: {\"offset\": %llu, "
+                        "\"dropped\": %llu, \"text\": ",
+                        (unsigned long long)offset,
+                        (unsigned long long)stream->reader.dropped);
+        usbx_buf_json_bytes(&stream->pending, stream->batch, (size_t)result);
+        usbx_buf_printf(&stream->pending, "}\n\n");
+    } else if (result == 0) {
+        if (usbx_now_us() - stream->last_write_us < SSE_KEEPALIVE_US) {
+            return 0;
+        }
+        usbx_buf_printf(&stream->pending, ": keep-alive\n\n");
+    } else {
+        usbx_buf_printf(&stream->pending, "event: end\ndata: {\"code\": %ld, \"name\": \"%s\"}\n\n",
+                        result, usbx_error_name((int)result));
+        stream->finished = 1;
+    }
+    return 1;
+}
+
+static ssize_t event_stream_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    struct serial_stream *stream = cls;
+    (void)pos;
+
+    if (stream->pending_offset == stream->pending.length) {
+        if (stream->finished) {
+            return USBX_HTTP_END_OF_STREAM;
+        }
+        usbx_buf_free(&stream->pending);
+        stream->pending_offset = 0;
+        if (!next_event(stream)) {
+            return 0;
+        }
+        if (stream->pending.failed) {
+            return USBX_HTTP_STREAM_ERROR;
+        }
+    }
+
+    size_t length = stream->pending.length - stream->pending_offset;
+    if (length > max) {
+        length = max;
+    }
+    memcpy(buf, stream->pending.data + stream->pending_offset, length);
+    stream->pending_offset += length;
+    stream->last_write_us = usbx_now_us();
+    return (ssize_t)length;
+}
+
+static void serial_stream_free(void *cls) {
+    struct serial_stream *stream = cls;
+
+    usbx_handle_put(stream->handle);
+    usbx_buf_free(&stream->pending);
+    free(stream);
+}
+
+/* GET /handles/{id}/serial/data?flush=newline|batch&batch_size=n&batch_ms=n&backlog=n */
+static void open_data_stream(void *cls, const struct usbx_http_request *req,
+                             struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_cdc_batch batch;
+    usbx_cdc_batch_init(&batch);
+    const char *flush = usbx_http_arg(req, "flush");
+    long batch_size = usbx_http_arg_long(req, "batch_size", (long)batch.batch_size);
+    long batch_ms = usbx_http_arg_long(req, "batch_ms", (long)batch.batch_interval_ms);
+    long backlog = usbx_http_arg_long(req, "backlog", 0);
+    if ((flush && strcmp(flush, "newline") != 0 && strcmp(flush, "batch") != 0) ||
+        batch_size <= 0 || batch_ms < 0 || batch_ms > 60000 || backlog < 0) {
+        usbx_http_set_error(resp, 400, "flush must be newline or batch, with valid bounds", 0);
+        return;
+    }
+    batch.flags = flush && strcmp(flush, "batch") == 0 ? 0 : USBX_CDC_FLUSH_NEWLINE;
+    batch.batch_size = (size_t)batch_size;
+    batch.batch_interval_ms = (unsigned int)batch_ms;
+
+    struct usbx_handle *handle = usbx_api_get_device(req, resp);
+    if (!handle) {
+        return;
+    }
+    struct usbx_cdc *cdc = get_channel(handle, resp);
+    struct serial_stream *stream = cdc ? calloc(1, sizeof(*stream)) : NULL;
+    if (!stream) {
+        usbx_handle_put(handle);
+        if (cdc) {
+            usbx_http_set_json(resp, 500, NULL, 0);
+        }
+        return;
+    }
+    stream->handle = handle;
+    stream->cdc = cdc;
+    usbx_cdc_reader_init(cdc, &stream->reader, &batch, (size_t)backlog);
+    usbx_buf_init(&stream->pending);
+    stream->last_write_us = usbx_now_us();
+
+    const char *accept = usbx_http_header(req, "Accept");
+    usbx_http_add_header(resp, "Cache-Control", "no-cache");
+    if (accept && strstr(accept, "text/event-stream")) {
+        stream->events = 1;
+        usbx_http_set_reader(resp, "text/event-stream", event_stream_read, stream,
+                             serial_stream_free);
+    } else {
+        usbx_http_set_reader(resp, "application/octet-stream", raw_stream_read, stream,
+                             serial_stream_free);
+        usbx_compress_response(req, resp);
+    }
+}
+
+/* POST /handles/{id}/serial/data */
+static void send_data(void *cls, const struct usbx_http_request *req,
+                      struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_device(req, resp);
+    if (!handle) {
+        return;
+    }
+    struct usbx_cdc *cdc = get_channel(handle, resp);
+    if (!cdc) {
+        usbx_handle_put(handle);
+        return;
+    }
+    size_t transferred = 0;
+    int result = usbx_cdc_write(cdc, req->body, req->body_length, &transferred);
+    usbx_handle_put(handle);
+
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"received\": %zu, \"transferred\": %zu, \"status\": \"%s\", "
+                    "\"code\": %d}",
+                    req->body_length, transferred, usbx_error_name(result), result);
+    usbx_http_set_json_buf(resp, usbx_http_status_for_error(result), &buf);
+}
+
+int usbx_api_register_serial(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "POST", "/handles/{id}/serial", configure_serial, NULL) < 0 ||
+        usbx_http_route(router, "GET", "/handles/{id}/serial", serial_status, NULL) < 0 ||
+        usbx_http_route(router, "GET", "/handles/{id}/serial/data", open_data_stream,
+                        NULL) < 0 ||
+        usbx_http_route(router, "POST", "/handles/{id}/serial/data", send_data, NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
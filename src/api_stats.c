@@ -0,0 +1,297 @@
+/**
+ * @file api_stats.c
+ * @brief Transfer statistics routes and the Prometheus export
+ *
+ * - GET /handles/{id}/stats   counters of the handle and of every endpoint
+ *                             that saw traffic, with latency quantiles
+ * - GET /metrics              Prometheus text exposition of all handles
+ *                             and of the memory budget and configuration
+ *
+ * Label cardinality of /metrics is bounded: at most METRICS_MAX_HANDLES
+ * handles are exported, each with at most 31 endpoints, and status and
+ * error labels come from fixed sets. The latency histogram is exported per
+ * handle only; per-endpoint histograms are in /handles/{id}/stats.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_budget.h"
+#include "usbx_config.h"
+#include "usbx_buf.h"
+#include "usbx_stats.h"
+
+/** @brief Handles exported by /metrics */
+#define METRICS_MAX_HANDLES 256
+
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4; charset=utf-8"
+
+/** @brief Snapshot of one handle for /metrics */
+struct handle_snapshot {
+    int handle_id;
+    struct usbx_device_info info;
+    const char *backend;
+    int count;
+    struct usbx_stats_endpoint endpoints[USBX_STATS_ENDPOINTS];
+    struct usbx_stats_endpoint total;
+};
+
+static const char *error_name(int slot) {
+    return slot == 0 ? "USBX_ERROR_OTHER" : usbx_error_name(-slot);
+}
+
+static void write_counters(struct usbx_buf *buf, const struct usbx_stats_endpoint *c) {
+    uint64_t completions = 0;
+    for (int i = 0; i < USBX_STATS_LATENCY_BUCKETS; i++) {
+        completions += c->latency[i];
+    }
+
+    usbx_buf_printf(buf, "\"transfers\": %llu, \"bytes\": %llu, \"timeouts\": %llu, "
+                    "\"cancelled\": %llu, \"submit_errors\": %llu, \"statuses\": {",
+                    (unsigned long long)c->transfers, (unsigned long long)c->bytes,
+                    (unsigned long long)c->statuses[USBX_TRANSFER_TIMED_OUT],
+                    (unsigned long long)c->statuses[USBX_TRANSFER_CANCELLED],
+                    (unsigned long long)c->submit_errors);
+    for (int i = 0; i < USBX_STATS_STATUSES; i++) {
+        usbx_buf_printf(buf, "%s\"%s\": %llu", i > 0 ? ", " : "", usbx_stats_status_name(i),
+                        (unsigned long long)c->statuses[i]);
+    }
+    usbx_buf_printf(buf, "}, \"errors\": {");
+    const char *separator = "";
+    for (int i = 0; i < USBX_STATS_ERRORS; i++) {
+        if (c->errors[i] > 0) {
+            usbx_buf_printf(buf, "%s\"%s\": %llu", separator, error_name(i),
+                            (unsigned long long)c->errors[i]);
+            separator = ", ";
+        }
+    }
+    usbx_buf_printf(buf, "}, \"latency\": {\"mean_us\": %llu, \"p50_us\": %llu, "
+                    "\"p90_us\": %llu, \"p99_us\": %llu, \"buckets\": [",
+                    (unsigned long long)(completions ? c->latency_sum_us / completions : 0),
+                    (unsigned long long)usbx_stats_latency_quantile_us(c, 500),
+                    (unsigned long long)usbx_stats_latency_quantile_us(c, 900),
+                    (unsigned long long)usbx_stats_latency_quantile_us(c, 990));
+    for (int i = 0; i < USBX_STATS_LATENCY_BUCKETS; i++) {
+        usbx_buf_printf(buf, "%s%llu", i > 0 ? ", " : "", (unsigned long long)c->latency[i]);
+    }
+    usbx_buf_printf(buf, "]}");
+}
+
+/* GET /handles/{id}/stats */
+static void get_stats(void *cls, const struct usbx_http_request *req,
+                      struct usbx_http_response *resp) {
+    (void)cls;
+    struct usbx_handle *handle = usbx_api_get_handle(req, resp);
+    if (!handle) {
+        return;
+    }
+    struct usbx_stats_endpoint endpoints[USBX_STATS_ENDPOINTS];
+    struct usbx_stats_endpoint total;
+    int count = usbx_stats_get(handle->stats, endpoints, &total);
+
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"handle\": %d, ", handle->handle_id);
+    write_counters(&buf, &total);
+    usbx_buf_printf(&buf, ", \"latency_bounds_us\": [");
+    for (int i = 0; i < USBX_STATS_LATENCY_BUCKETS - 1; i++) {
+        usbx_buf_printf(&buf, "%s%llu", i > 0 ? ", " : "",
+                        (unsigned long long)usbx_stats_latency_bounds_us[i]);
+    }
+    usbx_buf_printf(&buf, "], \"endpoints\": [");
+    for (int i = 0; i < count; i++) {
+        usbx_buf_printf(&buf, "%s{\"endpoint\": %u, ", i > 0 ? ", " : "", endpoints[i].endpoint);
+        write_counters(&buf, &endpoints[i]);
+        usbx_buf_printf(&buf, "}");
+    }
+    usbx_buf_printf(&buf, "]}");
+    usbx_handle_put(handle);
+    usbx_http_set_json_buf(resp, 200, &buf);
+}
+
+/* Label value with \, " and newlines escaped */
+static void write_label(struct usbx_buf *buf, const char *value) {
+    for (const char *p = value; *p; p++) {
+        if (*p == '\\' || *p == '"') {
+            usbx_buf_printf(buf, "\\%c", *p);
+        } else if (*p == '\n') {
+            usbx_buf_printf(buf, "\\n");
+        } else {
+            usbx_buf_append(buf, p, 1);
+        }
+    }
+}
+
+static void write_family(struct usbx_buf *buf, const char *name, const char *type,
+                         const char *help) {
+    usbx_buf_printf(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void write_metrics(struct usbx_buf *buf, const struct handle_snapshot *handles, int count,
+                          int open) {
+    write_family(buf, "usbx_handles", "gauge", "Open device handles.");
+    usbx_buf_printf(buf, "usbx_handles %d\n", open);
+
+    struct usbx_budget_stats budget;
+    usbx_budget_get_stats(&budget);
+    write_family(buf, "usbx_memory_budget_bytes", "gauge", "Memory budget, 0 if unlimited.");
+    usbx_buf_printf(buf, "usbx_memory_budget_bytes %llu\n", (unsigned long long)budget.capacity);
+    write_family(buf, "usbx_memory_in_use_bytes", "gauge", "Memory reserved by requests.");
+    usbx_buf_printf(buf, "usbx_memory_in_use_bytes %llu\n", (unsigned long long)budget.in_use);
+    write_family(buf, "usbx_memory_waiting", "gauge", "Reservations waiting for memory.");
+    usbx_buf_printf(buf, "usbx_memory_waiting %u\n", budget.waiting);
+    write_family(buf, "usbx_memory_wait_seconds_total", "counter",
+                 "Time granted reservations waited for memory.");
+    usbx_buf_printf(buf, "usbx_memory_wait_seconds_total %.6f\n", (double)budget.wait_us / 1e6);
+    write_family(buf, "usbx_memory_refused_total", "counter",
+                 "Reservations refused by the memory budget.");
+    usbx_buf_printf(buf, "usbx_memory_refused_total %llu\n",
+                    (unsigned long long)(budget.timed_out + budget.too_large +
+                                         budget.declined));
+
+    struct usbx_config_stats config;
+    usbx_config_get_stats(&config);
+    write_family(buf, "usbx_config_version", "gauge", "Version of the runtime configuration.");
+    usbx_buf_printf(buf, "usbx_config_version %llu\n", (unsigned long long)config.version);
+    write_family(buf, "usbx_config_changes_total", "counter",
+                 "Configuration reloads and updates by outcome.");
+    usbx_buf_printf(buf, "usbx_config_changes_total{result=\"applied\"} %llu\n",
+                    (unsigned long long)config.applied);
+    usbx_buf_printf(buf, "usbx_config_changes_total{result=\"rejected\"} %llu\n",
+                    (unsigned long long)config.rejected);
+
+    write_family(buf, "usbx_handle_info", "gauge", "Identity of an open device handle.");
+    for (int h = 0; h < count; h++) {
+        const struct handle_snapshot *s = &handles[h];
+        usbx_buf_printf(buf, "usbx_handle_info{handle=\"%d\",vid=\"0x%04x\",pid=\"0x%04x\","
+                        "serial=\"", s->handle_id, s->info.vid, s->info.pid);
+        write_label(buf, s->info.serial);
+        usbx_buf_printf(buf, "\",backend=\"");
+        write_label(buf, s->backend);
+        usbx_buf_printf(buf, "\"} 1\n");
+    }
+
+    write_family(buf, "usbx_transfers_total", "counter", "Completed transfers by status.");
+    for (int h = 0; h < count; h++) {
+        for (int e = 0; e < handles[h].count; e++) {
+            const struct usbx_stats_endpoint *ep = &handles[h].endpoints[e];
+            for (int i = 0; i < USBX_STATS_STATUSES; i++) {
+                usbx_buf_printf(buf, "usbx_transfers_total{handle=\"%d\",endpoint=\"0x%02x\","
+                                "status=\"%s\"} %llu\n", handles[h].handle_id, ep->endpoint,
+                                usbx_stats_status_name(i), (unsigned long long)ep->statuses[i]);
+            }
+        }
+    }
+
+    write_family(buf, "usbx_transfer_bytes_total", "counter", "Bytes moved by transfers.");
+    for (int h = 0; h < count; h++) {
+        for (int e = 0; e < handles[h].count; e++) {
+            const struct usbx_stats_endpoint *ep = &handles[h].endpoints[e];
+            usbx_buf_printf(buf, "usbx_transfer_bytes_total{handle=\"%d\",endpoint=\"0x%02x\"} "
+                            "%llu\n", handles[h].handle_id, ep->endpoint,
+                            (unsigned long long)ep->bytes);
+        }
+    }
+
+    write_family(buf, "usbx_transfer_errors_total", "counter",
+                 "Failed transfers and submissions by error code.");
+    for (int h = 0; h < count; h++) {
+        for (int e = 0; e < handles[h].count; e++) {
+            const struct usbx_stats_endpoint *ep = &handles[h].endpoints[e];
+            for (int i = 0; i < USBX_STATS_ERRORS; i++) {
+                if (ep->errors[i] > 0) {
+                    usbx_buf_printf(buf, "usbx_transfer_errors_total{handle=\"%d\","
+                                    "endpoint=\"0x%02x\",error=\"%s\"} %llu\n",
+                                    handles[h].handle_id, ep->endpoint, error_name(i),
+                                    (unsigned long long)ep->errors[i]);
+                }
+            }
+        }
+    }
+
+    write_family(buf, "usbx_transfer_submit_errors_total", "counter",
+                 "Submissions refused by the backend.");
+    for (int h = 0; h < count; h++) {
+        for (int e = 0; e < handles[h].count; e++) {
+            const struct usbx_stats_endpoint *ep = &handles[h].endpoints[e];
+            usbx_buf_printf(buf, "usbx_transfer_submit_errors_total{handle=\"%d\","
+                            "endpoint=\"0x%02x\"} %llu\n", handles[h].handle_id, ep->endpoint,
+                            (unsigned long long)ep->submit_errors);
+        }
+    }
+
+    write_family(buf, "usbx_transfer_latency_seconds", "histogram",
+                 "Time from submission to completion of a handle's transfers.");
+    for (int h = 0; h < count; h++) {
+        const struct usbx_stats_endpoint *t = &handles[h].total;
+        uint64_t cumulative = 0;
+        for (int i = 0; i < USBX_STATS_LATENCY_BUCKETS; i++) {
+            cumulative += t->latency[i];
+            if (i < USBX_STATS_LATENCY_BUCKETS - 1) {
+                usbx_buf_printf(buf, "usbx_transfer_latency_seconds_bucket{handle=\"%d\","
+                                "le=\"%g\"} %llu\n", handles[h].handle_id,
+                                (double)usbx_stats_latency_bounds_us[i] / 1e6,
+                                (unsigned long long)cumulative);
+            } else {
+                usbx_buf_printf(buf, "usbx_transfer_latency_seconds_bucket{handle=\"%d\","
+                                "le=\"+Inf\"} %llu\n", handles[h].handle_id,
+                                (unsigned long long)cumulative);
+            }
+        }
+        usbx_buf_printf(buf, "usbx_transfer_latency_seconds_sum{handle=\"%d\"} %.6f\n"
+                        "usbx_transfer_latency_seconds_count{handle=\"%d\"} %llu\n",
+                        handles[h].handle_id, (double)t->latency_sum_us / 1e6,
+                        handles[h].handle_id, (unsigned long long)cumulative);
+    }
+}
+
+/* GET /metrics */
+static void get_metrics(void *cls, const struct usbx_http_request *req,
+                        struct usbx_http_response *resp) {
+    (void)cls;
+    (void)req;
+    int *ids = malloc(METRICS_MAX_HANDLES * sizeof(int));
+    struct handle_snapshot *handles = malloc(METRICS_MAX_HANDLES * sizeof(*handles));
+    if (!ids || !handles) {
+        free(ids);
+        free(handles);
+        usbx_http_set_error(resp, 500, "Out of memory", USBX_ERROR_NO_MEM);
+        return;
+    }
+    int open = usbx_handle_list(ids, METRICS_MAX_HANDLES);
+    int listed = open < METRICS_MAX_HANDLES ? open : METRICS_MAX_HANDLES;
+    int count = 0;
+    for (int i = 0; i < listed; i++) {
+        struct usbx_handle *handle = usbx_handle_get(ids[i]);
+        if (!handle) {
+            continue;   // closed meanwhile
+        }
+        struct handle_snapshot *s = &handles[count++];
+        s->handle_id = handle->handle_id;
+        s->info = handle->info;
+        s->backend = handle->dev->ops->name;
+        s->count = usbx_stats_get(handle->stats, s->endpoints, &s->total);
+        usbx_handle_put(handle);
+    }
+
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    write_metrics(&buf, handles, count, open);
+    free(ids);
+    free(handles);
+    usbx_http_set_json_buf(resp, 200, &buf);
+    if (resp->status == 200) {
+        resp->content_type = METRICS_CONTENT_TYPE;
+    }
+}
+
+int usbx_api_register_stats(struct usbx_http_router *router) {
+    if (usbx_http_route(router, "GET", "/handles/{id}/stats", get_stats, NULL) < 0 ||
+        usbx_http_route(router, "GET", "/metrics", get_metrics, NULL) < 0) {
+        return -1;
+    }
+    return 0;
+}
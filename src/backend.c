@@ -0,0 +1,332 @@
+/**
+ * @file backend.c
+ * @brief Backend-independent transfer helpers shared by all device backends
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_backend.h"
+#include "usbx_breaker.h"
+#include "usbx_capture.h"
+#include "usbx_fault.h"
+#include "usbx_latency.h"
+#include "usbx_quota.h"
+#include "usbx_sched.h"
+#include "usbx_stats.h"
+#include "usbx_trace.h"
+#include "usbx_util.h"
+
+/** @brief Standard CLEAR_FEATURE(ENDPOINT_HALT) */
+#define REQUEST_TYPE_ENDPOINT_OUT 0x02
+#define REQUEST_CLEAR_FEATURE 0x01
+#define FEATURE_ENDPOINT_HALT 0x00
+
+/** @brief Completion state used by usbx_transfer_sync() */
+struct sync_state {
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    int done;
+};
+
+const char *usbx_error_name(int error) {
+    switch (error) {
+    case USBX_SUCCESS:             return "USBX_SUCCESS";
+    case USBX_ERROR_IO:            return "USBX_ERROR_IO";
+    case USBX_ERROR_INVALID_PARAM: return "USBX_ERROR_INVALID_PARAM";
+    case USBX_ERROR_ACCESS:        return "USBX_ERROR_ACCESS";
+    case USBX_ERROR_NO_DEVICE:     return "USBX_ERROR_NO_DEVICE";
+    case USBX_ERROR_NOT_FOUND:     return "USBX_ERROR_NOT_FOUND";
+    case USBX_ERROR_BUSY:          return "USBX_ERROR_BUSY";
+    case USBX_ERROR_TIMEOUT:       return "USBX_ERROR_TIMEOUT";
+    case USBX_ERROR_OVERFLOW:      return "USBX_ERROR_OVERFLOW";
+    case USBX_ERROR_PIPE:          return "USBX_ERROR_PIPE";
+    case USBX_ERROR_INTERRUPTED:   return "USBX_ERROR_INTERRUPTED";
+    case USBX_ERROR_NO_MEM:        return "USBX_ERROR_NO_MEM";
+    case USBX_ERROR_NOT_SUPPORTED: return "USBX_ERROR_NOT_SUPPORTED";
+    case USBX_ERROR_MISMATCH:      return "USBX_ERROR_MISMATCH";
+    default:                       return "USBX_ERROR_OTHER";
+    }
+}
+
+int usbx_status_to_error(int status) {
+    switch (status) {
+    case USBX_TRANSFER_COMPLETED: return USBX_SUCCESS;
+    case USBX_TRANSFER_TIMED_OUT: return USBX_ERROR_TIMEOUT;
+    case USBX_TRANSFER_CANCELLED: return USBX_ERROR_INTERRUPTED;
+    case USBX_TRANSFER_STALL:     return USBX_ERROR_PIPE;
+    case USBX_TRANSFER_NO_DEVICE: return USBX_ERROR_NO_DEVICE;
+    case USBX_TRANSFER_OVERFLOW:  return USBX_ERROR_OVERFLOW;
+    default:                      return USBX_ERROR_IO;
+    }
+}
+
+/* Validate the packet layout of an isochronous transfer and clear its results */
+static int reset_iso_packets(struct usbx_transfer *xfer) {
+    if (xfer->num_iso_packets <= 0 || !xfer->iso_packets) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+
+    uint64_t total = 0;
+    for (int i = 0; i < xfer->num_iso_packets; i++) {
+        total += xfer->iso_packets[i].length;
+        xfer->iso_packets[i].actual_length = 0;
+        xfer->iso_packets[i].status = USBX_TRANSFER_ERROR;
+    }
+    return total <= (uint64_t)xfer->length ? USBX_SUCCESS : USBX_ERROR_INVALID_PARAM;
+}
+
+/* Report a transfer event to the taps enabled on its device */
+static void tap_transfer(struct usbx_transfer *xfer, int event, int error) {
+    int taps = __atomic_load_n(&xfer->dev->taps, __ATOMIC_ACQUIRE);
+    uint64_t now = 0;
+    if (taps & (USBX_TAP_LATENCY | USBX_TAP_STATS)) {
+        now = usbx_now_us();
+        if (event == USBX_TAP_SUBMIT) {
+            xfer->submit_us = now;
+        }
+    }
+    // First, so that the other taps see the timeout the backend gets
+    if (taps & USBX_TAP_LATENCY) {
+        if (event == USBX_TAP_SUBMIT) {
+            usbx_latency_submit(xfer);
+        } else {
+            usbx_latency_complete(xfer, event == USBX_TAP_COMPLETE, now);
+        }
+    }
+    if (taps & USBX_TAP_STATS) {
+        if (event == USBX_TAP_COMPLETE) {
+            usbx_stats_record(xfer, now);
+        } else if (event == USBX_TAP_ERROR) {
+            usbx_stats_record_error(xfer, error);
+        }
+    }
+    if (taps & USBX_TAP_CAPTURE) {
+        usbx_capture_record(xfer, event, error);
+    }
+    if (taps & USBX_TAP_TRACE) {
+        usbx_trace_transfer(xfer, event, error);
+    }
+    if (taps & USBX_TAP_BREAKER) {
+        if (event == USBX_TAP_COMPLETE) {
+            usbx_breaker_record(xfer->dev, xfer->status);
+        } else if (event == USBX_TAP_ERROR && error == USBX_ERROR_NO_DEVICE) {
+            usbx_breaker_record(xfer->dev, USBX_TRANSFER_NO_DEVICE);
+        }
+    }
+    // Last, so that the next client's transfer is not admitted before this one is accounted
+    if (event != USBX_TAP_SUBMIT && xfer->scheduled) {
+        usbx_sched_release(xfer);
+    }
+}
+
+int usbx_submit_transfer(struct usbx_transfer *xfer) {
+    if (!xfer || !xfer->dev || !xfer->callback || xfer->length < 0) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    if (xfer->length > 0 && !xfer->buffer) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    if (xfer->type == USBX_TRANSFER_TYPE_ISOCHRONOUS) {
+        int result = reset_iso_packets(xfer);
+        if (result != USBX_SUCCESS) {
+            return result;
+        }
+    }
+    xfer->status = USBX_TRANSFER_ERROR;
+    xfer->actual_length = 0;
+    // Charged on completion whether or not a tap is attached, so byte quotas hold on every device
+    xfer->quota = usbx_quota_current();
+    if (__atomic_load_n(&xfer->dev->taps, __ATOMIC_RELAXED)) {
+        // Queueing happens before the submit tap, so it does not count as device latency
+        if (__atomic_load_n(&xfer->dev->taps, __ATOMIC_ACQUIRE) & USBX_TAP_SCHED) {
+            int admitted = usbx_sched_acquire(xfer);
+            if (admitted != USBX_SUCCESS) {
+                return admitted;
+            }
+        }
+        tap_transfer(xfer, USBX_TAP_SUBMIT, 0);
+        int result = USBX_FAULT_PASS;
+#ifdef USBX_FAULT_INJECTION
+        if (__atomic_load_n(&xfer->dev->taps, __ATOMIC_ACQUIRE) & USBX_TAP_FAULT) {
+            result = usbx_fault_submit(xfer);
+        }
+#endif
+        if (result == USBX_FAULT_PASS) {
+            result = xfer->dev->ops->submit(xfer);
+        }
+        if (result != USBX_SUCCESS) {
+            tap_transfer(xfer, USBX_TAP_ERROR, result);
+        }
+        return result;
+    }
+    return xfer->dev->ops->submit(xfer);
+}
+
+void usbx_transfer_complete(struct usbx_transfer *xfer) {
+    if (xfer->quota && xfer->actual_length > 0) {
+        usbx_quota_charge_client(xfer->quota, (uint64_t)xfer->actual_length);
+    }
+    if (__atomic_load_n(&xfer->dev->taps, __ATOMIC_RELAXED)) {
+#ifdef USBX_FAULT_INJECTION
+        // A held completion comes back through here from the fault layer
+        if ((__atomic_load_n(&xfer->dev->taps, __ATOMIC_ACQUIRE) & USBX_TAP_FAULT) &&
+            usbx_fault_complete(xfer)) {
+            return;
+        }
+#endif
+        tap_transfer(xfer, USBX_TAP_COMPLETE, 0);
+    }
+    xfer->callback(xfer);
+}
+
+int usbx_cancel_transfer(struct usbx_transfer *xfer) {
+    if (!xfer || !xfer->dev) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+#ifdef USBX_FAULT_INJECTION
+    if (__atomic_load_n(&xfer->dev->taps, __ATOMIC_ACQUIRE) & USBX_TAP_FAULT) {
+        int result = usbx_fault_cancel(xfer);
+        if (result != USBX_FAULT_PASS) {
+            return result;
+        }
+    }
+#endif
+    return xfer->dev->ops->cancel(xfer);
+}
+
+int usbx_get_max_packet_size(struct usbx_device *dev, unsigned char endpoint) {
+    if (!dev) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    return dev->ops->max_packet_size(dev, endpoint);
+}
+
+void usbx_device_destroy(struct usbx_device *dev) {
+    if (dev) {
+#ifdef USBX_FAULT_INJECTION
+        usbx_fault_release(dev);
+#endif
+        dev->ops->destroy(dev);
+    }
+}
+
+static void sync_transfer_cb(struct usbx_transfer *xfer) {
+    struct sync_state *state = xfer->user_data;
+
+    pthread_mutex_lock(&state->lock);
+    state->done = 1;
+    pthread_cond_signal(&state->done_cond);
+    pthread_mutex_unlock(&state->lock);
+}
+
+int usbx_transfer_sync(struct usbx_transfer *xfer) {
+    struct sync_state state;
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.done_cond, NULL);
+    state.done = 0;
+
+    xfer->callback = sync_transfer_cb;
+    xfer->user_data = &state;
+
+    int result = usbx_submit_transfer(xfer);
+    if (result == USBX_SUCCESS) {
+        pthread_mutex_lock(&state.lock);
+        while (!state.done) {
+            pthread_cond_wait(&state.done_cond, &state.lock);
+        }
+        pthread_mutex_unlock(&state.lock);
+        result = usbx_status_to_error(xfer->status);
+    }
+
+    pthread_cond_destroy(&state.done_cond);
+    pthread_mutex_destroy(&state.lock);
+    return result;
+}
+
+static int data_transfer_sync(struct usbx_device *dev, unsigned char type, unsigned char endpoint,
+                              unsigned char *data, int length, int *transferred,
+                              unsigned int timeout) {
+    struct usbx_transfer xfer;
+    memset(&xfer, 0, sizeof(xfer));
+    xfer.dev = dev;
+    xfer.endpoint = endpoint;
+    xfer.type = type;
+    xfer.timeout = timeout;
+    xfer.length = length;
+    xfer.buffer = data;
+
+    int result = usbx_transfer_sync(&xfer);
+    if (transferred) {
+        *transferred = xfer.actual_length;
+    }
+    // Like libusb, an overflow still reports the bytes that did arrive
+    return result;
+}
+
+int usbx_bulk_transfer(struct usbx_device *dev, unsigned char endpoint,
+                       unsigned char *data, int length, int *transferred,
+                       unsigned int timeout) {
+    return data_transfer_sync(dev, USBX_TRANSFER_TYPE_BULK, endpoint, data, length,
+                              transferred, timeout);
+}
+
+int usbx_interrupt_transfer(struct usbx_device *dev, unsigned char endpoint,
+                            unsigned char *data, int length, int *transferred,
+                            unsigned int timeout) {
+    return data_transfer_sync(dev, USBX_TRANSFER_TYPE_INTERRUPT, endpoint, data, length,
+                              transferred, timeout);
+}
+
+int usbx_control_transfer(struct usbx_device *dev, uint8_t request_type, uint8_t request,
+                          uint16_t value, uint16_t index, unsigned char *data,
+                          uint16_t length, unsigned int timeout) {
+    unsigned char *buffer = malloc(USBX_CONTROL_SETUP_SIZE + (size_t)length);
+    if (!buffer) {
+        return USBX_ERROR_NO_MEM;
+    }
+
+    // Setup packet, little-endian as on the wire
+    buffer[0] = request_type;
+    buffer[1] = request;
+    buffer[2] = (unsigned char)(value & 0xff);
+    buffer[3] = (unsigned char)(value >> 8);
+    buffer[4] = (unsigned char)(index & 0xff);
+    buffer[5] = (unsigned char)(index >> 8);
+    buffer[6] = (unsigned char)(length & 0xff);
+    buffer[7] = (unsigned char)(length >> 8);
+    if (!(request_type & USBX_ENDPOINT_IN) && length > 0) {
+        memcpy(buffer + USBX_CONTROL_SETUP_SIZE, data, length);
+    }
+
+    struct usbx_transfer xfer;
+    memset(&xfer, 0, sizeof(xfer));
+    xfer.dev = dev;
+    xfer.endpoint = 0;
+    xfer.type = USBX_TRANSFER_TYPE_CONTROL;
+    xfer.timeout = timeout;
+    xfer.length = USBX_CONTROL_SETUP_SIZE + length;
+    xfer.buffer = buffer;
+
+    int result = usbx_transfer_sync(&xfer);
+    if (result == USBX_SUCCESS) {
+        // actual_length counts the data stage only, as in libusb
+        result = xfer.actual_length;
+        if ((request_type & USBX_ENDPOINT_IN) && result > 0) {
+            memcpy(data, buffer + USBX_CONTROL_SETUP_SIZE, (size_t)result);
+        }
+    }
+
+    free(buffer);
+    buffer = NULL;
+    return result;
+}
+
+int usbx_clear_halt(struct usbx_device *dev, unsigned char endpoint, unsigned int timeout) {
+    int result = usbx_control_transfer(dev, REQUEST_TYPE_ENDPOINT_OUT, REQUEST_CLEAR_FEATURE,
+                                       FEATURE_ENDPOINT_HALT, endpoint, NULL, 0, timeout);
+    return result < 0 ? result : USBX_SUCCESS;
+}
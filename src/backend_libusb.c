@@ -0,0 +1,139 @@
+/**
+ * @file backend_libusb.c
+ * @brief libusb device backend
+ *
+ * Maps usbX transfers one-to-one onto libusb asynchronous transfers.
+ * Completion callbacks are delivered from the thread that runs
+ * libusb_handle_events() on the handle's context.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifdef USE_DEPS
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "usbx_backend.h"
+
+/** @brief libusb-backed device; base must stay the first member */
+struct libusb_backend_device {
+    struct usbx_device base;
+    libusb_device_handle *handle;
+    pthread_mutex_t lock;        // guards usbx_transfer.backend_priv
+};
+
+static void LIBUSB_CALL transfer_complete(struct libusb_transfer *ltransfer) {
+    struct usbx_transfer *xfer = ltransfer->user_data;
+    struct libusb_backend_device *dev = (struct libusb_backend_device *)xfer->dev;
+
+    xfer->status = (int)ltransfer->status;
+    xfer->actual_length = ltransfer->actual_length;
+    if (xfer->type == USBX_TRANSFER_TYPE_ISOCHRONOUS) {
+        // libusb leaves actual_length at 0 for iso; report the packet total instead
+        xfer->actual_length = 0;
+        for (int i = 0; i < xfer->num_iso_packets; i++) {
+            xfer->iso_packets[i].actual_length = ltransfer->iso_packet_desc[i].actual_length;
+            xfer->iso_packets[i].status = (int)ltransfer->iso_packet_desc[i].status;
+            xfer->actual_length += (int)ltransfer->iso_packet_desc[i].actual_length;
+        }
+    }
+
+    pthread_mutex_lock(&dev->lock);
+    xfer->backend_priv = NULL;
+    pthread_mutex_unlock(&dev->lock);
+
+    libusb_free_transfer(ltransfer);
+    usbx_transfer_complete(xfer);
+}
+
+static int libusb_backend_submit(struct usbx_transfer *xfer) {
+    struct libusb_backend_device *dev = (struct libusb_backend_device *)xfer->dev;
+    int iso_packets = xfer->type == USBX_TRANSFER_TYPE_ISOCHRONOUS ? xfer->num_iso_packets : 0;
+    struct libusb_transfer *ltransfer = libusb_alloc_transfer(iso_packets);
+    if (!ltransfer) {
+        return USBX_ERROR_NO_MEM;
+    }
+    ltransfer->num_iso_packets = iso_packets;
+    for (int i = 0; i < iso_packets; i++) {
+        ltransfer->iso_packet_desc[i].length = xfer->iso_packets[i].length;
+    }
+
+    ltransfer->dev_handle = dev->handle;
+    ltransfer->endpoint = xfer->endpoint;
+    ltransfer->type = xfer->type;
+    ltransfer->timeout = xfer->timeout;
+    ltransfer->buffer = xfer->buffer;
+    ltransfer->length = xfer->length;
+    ltransfer->callback = transfer_complete;
+    ltransfer->user_data = xfer;
+    ltransfer->flags = 0;
+    if (xfer->flags & USBX_TRANSFER_SHORT_NOT_OK) {
+        ltransfer->flags |= LIBUSB_TRANSFER_SHORT_NOT_OK;
+    }
+    if (xfer->flags & USBX_TRANSFER_ADD_ZERO_PACKET) {
+        ltransfer->flags |= LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+    }
+
+    // Publish before submitting: the callback may run before submit returns
+    pthread_mutex_lock(&dev->lock);
+    xfer->backend_priv = ltransfer;
+    pthread_mutex_unlock(&dev->lock);
+
+    int result = libusb_submit_transfer(ltransfer);
+    if (result < 0) {
+        pthread_mutex_lock(&dev->lock);
+        xfer->backend_priv = NULL;
+        pthread_mutex_unlock(&dev->lock);
+        libusb_free_transfer(ltransfer);
+    }
+    return result;
+}
+
+static int libusb_backend_cancel(struct usbx_transfer *xfer) {
+    struct libusb_backend_device *dev = (struct libusb_backend_device *)xfer->dev;
+    int result = USBX_ERROR_NOT_FOUND;
+
+    pthread_mutex_lock(&dev->lock);
+    if (xfer->backend_priv) {
+        result = libusb_cancel_transfer(xfer->backend_priv);
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return result;
+}
+
+static int libusb_backend_max_packet_size(struct usbx_device *base, unsigned char endpoint) {
+    struct libusb_backend_device *dev = (struct libusb_backend_device *)base;
+    // Accounts for high-bandwidth multipliers on isochronous/interrupt endpoints
+    return libusb_get_max_iso_packet_size(libusb_get_device(dev->handle), endpoint);
+}
+
+static void libusb_backend_destroy(struct usbx_device *base) {
+    struct libusb_backend_device *dev = (struct libusb_backend_device *)base;
+
+    libusb_close(dev->handle);
+    dev->handle = NULL;
+    pthread_mutex_destroy(&dev->lock);
+    free(dev);
+}
+
+static const struct usbx_backend_ops libusb_ops = {
+    .name = "libusb",
+    .submit = libusb_backend_submit,
+    .cancel = libusb_backend_cancel,
+    .max_packet_size = libusb_backend_max_packet_size,
+    .destroy = libusb_backend_destroy,
+};
+
+struct usbx_device *usbx_libusb_device_create(libusb_device_handle *handle) {
+    struct libusb_backend_device *dev = calloc(1, sizeof(*dev));
+    if (!dev) {
+        return NULL;
+    }
+    dev->base.ops = &libusb_ops;
+    dev->handle = handle;
+    pthread_mutex_init(&dev->lock, NULL);
+    return &dev->base;
+}
+
+#endif // USE_DEPS
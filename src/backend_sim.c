@@ -0,0 +1,561 @@
+/**
+ * @file backend_sim.c
+ * @brief In-process simulated USB device backend
+ *
+ * Each endpoint owns a FIFO of submitted transfers and a worker thread that
+ * completes them one after another according to the timing model described
+ * in usbx_sim.h. Completion callbacks run on the endpoint thread with no
+ * backend lock held, so they may resubmit or cancel transfers.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbx_sim.h"
+#include "usbx_util.h"
+
+/** @brief Endpoint slots: index 0 is the control pipe, 1-15 OUT, 17-31 IN */
+#define SIM_MAX_ENDPOINTS 32
+
+/** @brief Maximum packet size of the simulated control endpoint */
+#define SIM_CONTROL_PACKET_SIZE 64
+
+/** @brief Default isochronous service interval (one high-speed microframe) */
+#define SIM_DEFAULT_INTERVAL_US 125
+
+/** @brief One queued transfer */
+struct sim_request {
+    struct usbx_transfer *xfer;
+    uint64_t submit_us;
+    uint64_t deadline_us;        // 0 when the transfer has no timeout
+    int cancelled;
+    int handled;                 // the handler produced the status
+    struct sim_request *next;
+};
+
+struct sim_device;
+
+/** @brief Runtime state of one endpoint */
+struct sim_endpoint {
+    struct sim_device *dev;
+    struct usbx_sim_endpoint_config config;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct sim_request *head;
+    struct sim_request *tail;
+    int depth;
+    int stopping;
+    uint64_t busy_until_us;      // simulated time at which the endpoint goes idle
+    uint64_t stream_offset;      // default source/sink position
+    size_t message_left;         // default source bytes left in current message
+    uint64_t next_slot_us;       // isochronous: next service interval on the bus
+    uint32_t rng_state;          // isochronous: jitter and packet error generator
+    struct usbx_sim_endpoint_stats stats;
+};
+
+/** @brief Simulated device; base must stay the first member */
+struct sim_device {
+    struct usbx_device base;
+    struct sim_endpoint *endpoints[SIM_MAX_ENDPOINTS];
+};
+
+static int endpoint_index(unsigned char address) {
+    if ((address & 0x0f) == 0) {
+        return 0;  // control pipe is bidirectional
+    }
+    return (address & 0x0f) | ((address & USBX_ENDPOINT_IN) ? 0x10 : 0);
+}
+
+static struct sim_endpoint *find_endpoint(struct usbx_device *dev, unsigned char address) {
+    struct sim_device *sim = (struct sim_device *)dev;
+    return sim->endpoints[endpoint_index(address)];
+}
+
+unsigned char usbx_sim_pattern_byte(uint64_t offset) {
+    return (unsigned char)((offset * 7) ^ (offset >> 9) ^ (offset >> 17));
+}
+
+void usbx_sim_fill_pattern(unsigned char *buffer, size_t length, uint64_t offset) {
+    for (size_t i = 0; i < length; i++) {
+        buffer[i] = usbx_sim_pattern_byte(offset + i);
+    }
+}
+
+/*
+ * Default IN behaviour: pattern stream cut into messages. A transfer that
+ * reaches the end of a message completes short, like a device ending a
+ * reply with a short packet.
+ */
+static int default_source(struct sim_endpoint *ep, struct usbx_transfer *xfer) {
+    size_t length = (size_t)xfer->length;
+
+    if (ep->config.message_size > 0) {
+        if (ep->message_left == 0) {
+            ep->message_left = ep->config.message_size;
+        }
+        if (length > ep->message_left) {
+            length = ep->message_left;
+        }
+        ep->message_left -= length;
+    }
+
+    usbx_sim_fill_pattern(xfer->buffer, length, ep->stream_offset);
+    ep->stream_offset += length;
+    xfer->actual_length = (int)length;
+    return USBX_TRANSFER_COMPLETED;
+}
+
+/* Default OUT behaviour: accept everything and verify it against the pattern */
+static int default_sink(struct sim_endpoint *ep, struct usbx_transfer *xfer) {
+    uint64_t errors = 0;
+
+    for (int i = 0; i < xfer->length; i++) {
+        if (xfer->buffer[i] != usbx_sim_pattern_byte(ep->stream_offset + (uint64_t)i)) {
+            errors++;
+        }
+    }
+    ep->stream_offset += (uint64_t)xfer->length;
+    if (errors > 0) {
+        __atomic_add_fetch(&ep->stats.pattern_errors, errors, __ATOMIC_RELAXED);
+    }
+    xfer->actual_length = xfer->length;
+    return USBX_TRANSFER_COMPLETED;
+}
+
+static uint32_t next_random(struct sim_endpoint *ep) {
+    // xorshift32: cheap and deterministic per endpoint
+    uint32_t x = ep->rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    ep->rng_state = x;
+    return x;
+}
+
+/* Default isochronous behaviour: pattern source or sink, packet by packet */
+static int default_iso(struct sim_endpoint *ep, struct usbx_transfer *xfer) {
+    unsigned char *packet = xfer->buffer;
+    int is_in = ep->config.address & USBX_ENDPOINT_IN;
+    uint64_t errors = 0;
+    uint64_t mismatches = 0;
+
+    xfer->actual_length = 0;
+    for (int i = 0; i < xfer->num_iso_packets; i++) {
+        struct usbx_iso_packet *desc = &xfer->iso_packets[i];
+        unsigned int length = desc->length;
+        if (length > (unsigned int)ep->config.max_packet_size) {
+            length = (unsigned int)ep->config.max_packet_size;
+        }
+
+        if (ep->config.packet_error_ppm > 0 &&
+            next_random(ep) % 1000000U < ep->config.packet_error_ppm) {
+            desc->status = USBX_TRANSFER_ERROR;
+            desc->actual_length = 0;
+            errors++;
+        } else {
+            if (is_in) {
+                usbx_sim_fill_pattern(packet, length, ep->stream_offset);
+            }
+            for (unsigned int j = 0; !is_in && j < length; j++) {
+                if (packet[j] != usbx_sim_pattern_byte(ep->stream_offset + j)) {
+                    mismatches++;
+                }
+            }
+            desc->status = USBX_TRANSFER_COMPLETED;
+            desc->actual_length = length;
+            xfer->actual_length += (int)length;
+        }
+        // The stream advances even for lost packets, like real-time media
+        ep->stream_offset += length;
+        packet += desc->length;
+    }
+
+    if (errors > 0) {
+        __atomic_add_fetch(&ep->stats.packet_errors, errors, __ATOMIC_RELAXED);
+    }
+    if (mismatches > 0) {
+        __atomic_add_fetch(&ep->stats.pattern_errors, mismatches, __ATOMIC_RELAXED);
+    }
+    return USBX_TRANSFER_COMPLETED;
+}
+
+static int run_handler(struct sim_endpoint *ep, struct usbx_transfer *xfer,
+                       uint64_t now_us, uint64_t *retry_at_us) {
+    if (ep->config.handler) {
+        return ep->config.handler(ep->config.handler_cls, xfer, now_us, retry_at_us);
+    }
+    if (ep->config.type == USBX_TRANSFER_TYPE_CONTROL) {
+        return USBX_TRANSFER_STALL;
+    }
+    if (ep->config.type == USBX_TRANSFER_TYPE_ISOCHRONOUS) {
+        return default_iso(ep, xfer);
+    }
+    if (ep->config.address & USBX_ENDPOINT_IN) {
+        return default_source(ep, xfer);
+    }
+    return default_sink(ep, xfer);
+}
+
+static void timed_wait(struct sim_endpoint *ep, uint64_t wake_us) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)(wake_us / 1000000ULL);
+    ts.tv_nsec = (long)(wake_us % 1000000ULL) * 1000L;
+    pthread_cond_timedwait(&ep->cond, &ep->lock, &ts);
+}
+
+/*
+ * Wait (lock held) until the given time, returning early with a transfer
+ * status if the request is cancelled, times out or the device goes away.
+ * Returns -1 when the time was reached normally.
+ */
+static int wait_until(struct sim_endpoint *ep, struct sim_request *req, uint64_t until_us) {
+    for (;;) {
+        if (ep->stopping) {
+            return USBX_TRANSFER_NO_DEVICE;
+        }
+        if (req->cancelled) {
+            return USBX_TRANSFER_CANCELLED;
+        }
+        uint64_t now = usbx_now_us();
+        if (now >= until_us) {
+            return -1;
+        }
+        uint64_t wake = until_us;
+        if (req->deadline_us) {
+            if (now >= req->deadline_us) {
+                return USBX_TRANSFER_TIMED_OUT;
+            }
+            if (req->deadline_us < wake) {
+                wake = req->deadline_us;
+            }
+        }
+        timed_wait(ep, wake);
+    }
+}
+
+/*
+ * Isochronous timing: packets occupy consecutive service intervals. If the
+ * transfer was queued after its first slot had already passed, the bus ran
+ * dry and the skipped intervals are counted as missed.
+ */
+static int process_iso_request(struct sim_endpoint *ep, struct sim_request *req) {
+    struct usbx_transfer *xfer = req->xfer;
+    uint64_t interval = ep->config.interval_us ? ep->config.interval_us : SIM_DEFAULT_INTERVAL_US;
+
+    if (ep->next_slot_us == 0) {
+        ep->next_slot_us = req->submit_us + ep->config.latency_us;
+    } else if (req->submit_us > ep->next_slot_us) {
+        uint64_t missed = (req->submit_us - ep->next_slot_us) / interval + 1;
+        ep->stats.missed_intervals += missed;
+        ep->next_slot_us += missed * interval;
+    }
+    uint64_t end = ep->next_slot_us + (uint64_t)xfer->num_iso_packets * interval;
+    ep->next_slot_us = end;
+
+    uint64_t jitter = 0;
+    if (ep->config.jitter_us > 0) {
+        jitter = next_random(ep) % (ep->config.jitter_us + 1U);
+    }
+    int status = wait_until(ep, req, end + jitter);
+    if (status >= 0) {
+        return status;
+    }
+
+    uint64_t retry_at = 0;
+    pthread_mutex_unlock(&ep->lock);
+    status = run_handler(ep, xfer, usbx_now_us(), &retry_at);
+    pthread_mutex_lock(&ep->lock);
+    req->handled = 1;
+    // Isochronous data cannot be late: a handler without data loses the transfer
+    return status == USBX_SIM_RETRY ? USBX_TRANSFER_ERROR : status;
+}
+
+/* Process the request at the head of the queue (lock held); returns its status */
+static int process_request(struct sim_endpoint *ep, struct sim_request *req) {
+    struct usbx_transfer *xfer = req->xfer;
+    int status;
+
+    if (ep->config.type == USBX_TRANSFER_TYPE_ISOCHRONOUS) {
+        return process_iso_request(ep, req);
+    }
+
+    // Transfers arriving at an idle endpoint pay the startup latency
+    uint64_t start = ep->busy_until_us;
+    if (req->submit_us > start) {
+        start = req->submit_us + ep->config.latency_us;
+    }
+    uint64_t ready = start + ep->config.overhead_us;
+    status = wait_until(ep, req, ready);
+    if (status >= 0) {
+        return status;
+    }
+
+    for (;;) {
+        uint64_t retry_at = 0;
+        pthread_mutex_unlock(&ep->lock);
+        status = run_handler(ep, xfer, usbx_now_us(), &retry_at);
+        pthread_mutex_lock(&ep->lock);
+        if (status != USBX_SIM_RETRY) {
+            req->handled = 1;
+            break;
+        }
+        ready = retry_at;
+        status = wait_until(ep, req, retry_at);
+        if (status >= 0) {
+            return status;
+        }
+    }
+
+    /*
+     * Occupy the bus for the time the payload takes at the configured rate.
+     * Scheduling against the ideal timeline keeps wake-up jitter from
+     * accumulating over back-to-back transfers.
+     */
+    uint64_t finish = ready;
+    if (ep->config.bytes_per_sec > 0 && xfer->actual_length > 0) {
+        finish += (uint64_t)xfer->actual_length * 1000000ULL / ep->config.bytes_per_sec;
+    }
+    ep->busy_until_us = finish;
+    int wait_status = wait_until(ep, req, finish);
+    if (wait_status >= 0) {
+        return wait_status;
+    }
+    return status;
+}
+
+static void *endpoint_thread(void *arg) {
+    struct sim_endpoint *ep = arg;
+
+    pthread_mutex_lock(&ep->lock);
+    for (;;) {
+        while (!ep->head && !ep->stopping) {
+            pthread_cond_wait(&ep->cond, &ep->lock);
+        }
+        if (!ep->head) {
+            break;  // stopping and drained
+        }
+
+        struct sim_request *req = ep->head;
+        int status;
+        if (req->cancelled) {
+            status = USBX_TRANSFER_CANCELLED;
+        } else if (ep->stopping) {
+            status = USBX_TRANSFER_NO_DEVICE;
+        } else {
+            status = process_request(ep, req);
+        }
+
+        ep->head = req->next;
+        if (!ep->head) {
+            ep->tail = NULL;
+        }
+        ep->depth--;
+
+        struct usbx_transfer *xfer = req->xfer;
+        int aborted = !req->handled && ep->config.aborted;
+        xfer->status = status;
+        xfer->backend_priv = NULL;
+        if (status == USBX_TRANSFER_COMPLETED) {
+            ep->stats.transfers++;
+            ep->stats.bytes += (uint64_t)xfer->actual_length;
+        }
+        free(req);
+
+        pthread_mutex_unlock(&ep->lock);
+        if (aborted) {
+            ep->config.aborted(ep->config.handler_cls, xfer);
+        }
+        usbx_transfer_complete(xfer);
+        pthread_mutex_lock(&ep->lock);
+    }
+    pthread_mutex_unlock(&ep->lock);
+    return NULL;
+}
+
+static int sim_submit(struct usbx_transfer *xfer) {
+    struct sim_endpoint *ep = find_endpoint(xfer->dev, xfer->endpoint);
+    if (!ep) {
+        return USBX_ERROR_NOT_FOUND;
+    }
+    if (ep->config.type != xfer->type) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    if (xfer->type == USBX_TRANSFER_TYPE_CONTROL && xfer->length < USBX_CONTROL_SETUP_SIZE) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+
+    struct sim_request *req = calloc(1, sizeof(*req));
+    if (!req) {
+        return USBX_ERROR_NO_MEM;
+    }
+    req->xfer = xfer;
+    req->submit_us = usbx_now_us();
+    if (xfer->timeout > 0) {
+        req->deadline_us = req->submit_us + (uint64_t)xfer->timeout * 1000ULL;
+    }
+
+    pthread_mutex_lock(&ep->lock);
+    if (ep->stopping) {
+        pthread_mutex_unlock(&ep->lock);
+        free(req);
+        return USBX_ERROR_NO_DEVICE;
+    }
+    xfer->backend_priv = req;
+    if (ep->tail) {
+        ep->tail->next = req;
+    } else {
+        ep->head = req;
+    }
+    ep->tail = req;
+    ep->depth++;
+    if (ep->depth > ep->stats.max_queue_depth) {
+        ep->stats.max_queue_depth = ep->depth;
+    }
+    pthread_cond_signal(&ep->cond);
+    pthread_mutex_unlock(&ep->lock);
+    return USBX_SUCCESS;
+}
+
+static int sim_cancel(struct usbx_transfer *xfer) {
+    struct sim_endpoint *ep = find_endpoint(xfer->dev, xfer->endpoint);
+    if (!ep) {
+        return USBX_ERROR_NOT_FOUND;
+    }
+
+    int result = USBX_ERROR_NOT_FOUND;
+    pthread_mutex_lock(&ep->lock);
+    struct sim_request *req = xfer->backend_priv;
+    if (req && !req->cancelled) {
+        req->cancelled = 1;
+        pthread_cond_signal(&ep->cond);
+        result = USBX_SUCCESS;
+    }
+    pthread_mutex_unlock(&ep->lock);
+    return result;
+}
+
+static int sim_max_packet_size(struct usbx_device *dev, unsigned char endpoint) {
+    struct sim_endpoint *ep = find_endpoint(dev, endpoint);
+    if (!ep) {
+        return USBX_ERROR_NOT_FOUND;
+    }
+    return ep->config.max_packet_size;
+}
+
+static void stop_endpoint(struct sim_endpoint *ep) {
+    pthread_mutex_lock(&ep->lock);
+    ep->stopping = 1;
+    pthread_cond_signal(&ep->cond);
+    pthread_mutex_unlock(&ep->lock);
+    pthread_join(ep->thread, NULL);
+
+    pthread_cond_destroy(&ep->cond);
+    pthread_mutex_destroy(&ep->lock);
+    free(ep);
+}
+
+static void sim_destroy(struct usbx_device *dev) {
+    struct sim_device *sim = (struct sim_device *)dev;
+
+    for (int i = 0; i < SIM_MAX_ENDPOINTS; i++) {
+        if (sim->endpoints[i]) {
+            stop_endpoint(sim->endpoints[i]);
+            sim->endpoints[i] = NULL;
+        }
+    }
+    free(sim);
+}
+
+static const struct usbx_backend_ops sim_ops = {
+    .name = "sim",
+    .submit = sim_submit,
+    .cancel = sim_cancel,
+    .max_packet_size = sim_max_packet_size,
+    .destroy = sim_destroy,
+};
+
+static int start_endpoint(struct sim_device *sim, const struct usbx_sim_endpoint_config *config) {
+    int index = endpoint_index(config->address);
+    if (sim->endpoints[index] || config->max_packet_size <= 0) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+
+    struct sim_endpoint *ep = calloc(1, sizeof(*ep));
+    if (!ep) {
+        return USBX_ERROR_NO_MEM;
+    }
+    ep->dev = sim;
+    ep->config = *config;
+    ep->rng_state = 0x9e3779b9U ^ config->address;
+
+    usbx_cond_init_monotonic(&ep->cond);
+    pthread_mutex_init(&ep->lock, NULL);
+
+    if (pthread_create(&ep->thread, NULL, endpoint_thread, ep) != 0) {
+        pthread_cond_destroy(&ep->cond);
+        pthread_mutex_destroy(&ep->lock);
+        free(ep);
+        return USBX_ERROR_NO_MEM;
+    }
+    sim->endpoints[index] = ep;
+    return USBX_SUCCESS;
+}
+
+struct usbx_device *usbx_sim_device_create(const struct usbx_sim_config *config) {
+    if (!config || config->num_endpoints < 0 ||
+        (config->num_endpoints > 0 && !config->endpoints)) {
+        return NULL;
+    }
+
+    struct sim_device *sim = calloc(1, sizeof(*sim));
+    if (!sim) {
+        return NULL;
+    }
+    sim->base.ops = &sim_ops;
+
+    struct usbx_sim_endpoint_config control;
+    memset(&control, 0, sizeof(control));
+    control.address = 0;
+    control.type = USBX_TRANSFER_TYPE_CONTROL;
+    control.max_packet_size = SIM_CONTROL_PACKET_SIZE;
+    control.handler = config->control_handler;
+    control.handler_cls = config->control_cls;
+    control.aborted = config->control_aborted;
+
+    int result = start_endpoint(sim, &control);
+    for (int i = 0; result == USBX_SUCCESS && i < config->num_endpoints; i++) {
+        if (endpoint_index(config->endpoints[i].address) == 0) {
+            result = USBX_ERROR_INVALID_PARAM;
+            break;
+        }
+        result = start_endpoint(sim, &config->endpoints[i]);
+    }
+
+    if (result != USBX_SUCCESS) {
+        sim_destroy(&sim->base);
+        return NULL;
+    }
+    return &sim->base;
+}
+
+int usbx_sim_get_endpoint_stats(struct usbx_device *dev, unsigned char endpoint,
+                                struct usbx_sim_endpoint_stats *stats) {
+    struct sim_endpoint *ep = find_endpoint(dev, endpoint);
+    if (!ep || !stats) {
+        return USBX_ERROR_NOT_FOUND;
+    }
+
+    pthread_mutex_lock(&ep->lock);
+    *stats = ep->stats;
+    pthread_mutex_unlock(&ep->lock);
+    stats->pattern_errors = __atomic_load_n(&ep->stats.pattern_errors, __ATOMIC_RELAXED);
+    stats->packet_errors = __atomic_load_n(&ep->stats.packet_errors, __ATOMIC_RELAXED);
+    return USBX_SUCCESS;
+}
@@ -0,0 +1,421 @@
+/**
+ * @file blob_store.c
+ * @brief Content-addressed store for firmware images and other large payloads
+ *
+ * The index is a uthash table whose insertion order doubles as the LRU
+ * list: a blob that is used is deleted and re-added, which moves it to the
+ * tail, and eviction walks from the head. A blob is mapped while it has
+ * users and unmapped when the last one releases it; the page cache keeps
+ * the contents warm in between.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "uthash.h"
+#include "usbx_backend.h"
+#include "usbx_blob.h"
+
+/** @brief Prefix of partially written uploads */
+#define UPLOAD_PREFIX ".upload-"
+
+/** @brief Longest path of a file in the store */
+#define BLOB_PATH_MAX 4096
+
+/** @brief Room a file name needs after the directory ("/" + digest + terminator) */
+#define BLOB_NAME_ROOM (USBX_SHA256_HEX_SIZE + 1)
+
+struct usbx_blob {
+    char hash[USBX_SHA256_HEX_SIZE];     // key
+    uint64_t size;
+    struct usbx_blob_store *store;
+    int users;                           // references, guarded by the store lock
+    int removed;                         // no longer indexed; freed by the last user
+    unsigned char *data;                 // mapping while users > 0
+    struct timespec used;                // file mtime, for ordering at startup
+    UT_hash_handle hh;
+};
+
+struct usbx_blob_store {
+    pthread_mutex_t lock;
+    char *directory;
+    uint64_t capacity;
+    uint64_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    struct usbx_blob *blobs;             // least recently used first
+};
+
+/** @brief Zero-length blobs cannot be mapped; they all share this */
+static unsigned char empty_blob[1];
+
+/* Normalise a hex digest to lowercase; returns -1 if it is not one */
+static int normalize_hash(const char *text, char *hash) {
+    for (int i = 0; i < USBX_SHA256_HEX_SIZE - 1; i++) {
+        char c = text[i];
+        if (c >= 'A' && c <= 'F') {
+            c = (char)(c - 'A' + 'a');
+        }
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return -1;
+        }
+        hash[i] = c;
+    }
+    if (text[USBX_SHA256_HEX_SIZE - 1] != '\0') {
+        return -1;
+    }
+    hash[USBX_SHA256_HEX_SIZE - 1] = '\0';
+    return 0;
+}
+
+static void blob_path(const struct usbx_blob_store *store, const char *name, char *path,
+                      size_t size) {
+    snprintf(path, size, "%s/%s", store->directory, name);
+}
+
+/* Move a blob to the most recently used end and record the use on disk (lock held) */
+static void touch(struct usbx_blob_store *store, struct usbx_blob *blob) {
+    char path[BLOB_PATH_MAX];
+
+    HASH_DEL(store->blobs, blob);
+    HASH_ADD(hh, store->blobs, hash, USBX_SHA256_HEX_SIZE - 1, blob);
+    blob_path(store, blob->hash, path, sizeof(path));
+    utimensat(AT_FDCWD, path, NULL, 0);
+}
+
+/* Drop a blob from the index and the disk; users keep their mapping (lock held) */
+static void unlink_blob(struct usbx_blob_store *store, struct usbx_blob *blob) {
+    char path[BLOB_PATH_MAX];
+
+    HASH_DEL(store->blobs, blob);
+    store->bytes -= blob->size;
+    blob_path(store, blob->hash, path, sizeof(path));
+    unlink(path);
+    if (blob->users > 0) {
+        blob->removed = 1;
+    } else {
+        free(blob);
+    }
+}
+
+/* Evict unused blobs, oldest first, until @p extra more bytes fit (lock held) */
+static int make_room(struct usbx_blob_store *store, uint64_t extra) {
+    struct usbx_blob *blob, *tmp;
+
+    HASH_ITER(hh, store->blobs, blob, tmp) {
+        if (store->bytes + extra <= store->capacity) {
+            break;
+        }
+        if (blob->users == 0) {
+            unlink_blob(store, blob);
+            store->evictions++;
+        }
+    }
+    return store->bytes + extra <= store->capacity ? 0 : -1;
+}
+
+static int compare_used(const struct usbx_blob *a, const struct usbx_blob *b) {
+    if (a->used.tv_sec != b->used.tv_sec) {
+        return a->used.tv_sec < b->used.tv_sec ? -1 : 1;
+    }
+    return (a->used.tv_nsec > b->used.tv_nsec) - (a->used.tv_nsec < b->used.tv_nsec);
+}
+
+/* Index the blobs already in the directory and delete abandoned uploads */
+static int scan_directory(struct usbx_blob_store *store) {
+    DIR *dir = opendir(store->directory);
+    struct dirent *entry;
+    char path[BLOB_PATH_MAX];
+
+    if (!dir) {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        char hash[USBX_SHA256_HEX_SIZE];
+
+        if (strlen(entry->d_name) > 64) {
+            continue;
+        }
+        blob_path(store, entry->d_name, path, sizeof(path));
+        if (strncmp(entry->d_name, UPLOAD_PREFIX, strlen(UPLOAD_PREFIX)) == 0) {
+            unlink(path);
+            continue;
+        }
+        if (normalize_hash(entry->d_name, hash) < 0 || strcmp(hash, entry->d_name) != 0 ||
+            stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        struct usbx_blob *blob = calloc(1, sizeof(*blob));
+        if (!blob) {
+            closedir(dir);
+            return -1;
+        }
+        memcpy(blob->hash, hash, sizeof(hash));
+        blob->size = (uint64_t)st.st_size;
+        blob->store = store;
+        blob->used = st.st_mtim;
+        HASH_ADD(hh, store->blobs, hash, USBX_SHA256_HEX_SIZE - 1, blob);
+        store->bytes += blob->size;
+    }
+    closedir(dir);
+    HASH_SRT(hh, store->blobs, compare_used);
+    return 0;
+}
+
+struct usbx_blob_store *usbx_blob_store_open(const char *directory, uint64_t capacity,
+                                             int *error) {
+    struct usbx_blob_store *store = calloc(1, sizeof(*store));
+    int result = USBX_ERROR_NO_MEM;
+
+    if (strlen(directory) + BLOB_NAME_ROOM > BLOB_PATH_MAX) {
+        free(store);
+        store = NULL;
+        result = USBX_ERROR_INVALID_PARAM;
+    } else if (store && (store->directory = strdup(directory)) != NULL) {
+        store->capacity = capacity > 0 ? capacity : USBX_BLOB_DEFAULT_CAPACITY;
+        pthread_mutex_init(&store->lock, NULL);
+        if ((mkdir(directory, 0755) < 0 && errno != EEXIST) || scan_directory(store) < 0) {
+            result = errno == EACCES ? USBX_ERROR_ACCESS : USBX_ERROR_IO;
+            usbx_blob_store_close(store);
+            store = NULL;
+        } else {
+            make_room(store, 0);    // the capacity may have shrunk since the last run
+            result = USBX_SUCCESS;
+        }
+    } else if (store) {
+        free(store);
+        store = NULL;
+    }
+    if (error) {
+        *error = result;
+    }
+    return store;
+}
+
+void usbx_blob_store_close(struct usbx_blob_store *store) {
+    struct usbx_blob *blob, *tmp;
+
+    if (!store) {
+        return;
+    }
+    HASH_ITER(hh, store->blobs, blob, tmp) {
+        HASH_DEL(store->blobs, blob);
+        free(blob);
+    }
+    pthread_mutex_destroy(&store->lock);
+    free(store->directory);
+    free(store);
+}
+
+/* Write @p data to a new temporary file in the store, whose name lands in @p path */
+static int write_upload(struct usbx_blob_store *store, const unsigned char *data,
+                        size_t length, char *path) {
+    blob_path(store, UPLOAD_PREFIX "XXXXXX", path, BLOB_PATH_MAX);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = write(fd, data + done, length - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+    fchmod(fd, 0644);
+    if (done < length || fsync(fd) < 0) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+int usbx_blob_put(struct usbx_blob_store *store, const void *data, size_t length, char *hash) {
+    usbx_sha256_hex(data, length, hash);
+    if (length > store->capacity) {
+        return USBX_ERROR_OVERFLOW;
+    }
+
+    struct usbx_blob *blob;
+    pthread_mutex_lock(&store->lock);
+    HASH_FIND(hh, store->blobs, hash, USBX_SHA256_HEX_SIZE - 1, blob);
+    if (blob) {
+        touch(store, blob);
+        pthread_mutex_unlock(&store->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    // Write outside the lock so lookups are not held up by a large upload
+    char upload[BLOB_PATH_MAX];
+    if (write_upload(store, data, length, upload) < 0) {
+        return USBX_ERROR_IO;
+    }
+
+    char path[BLOB_PATH_MAX];
+    int result = 1;
+    blob_path(store, hash, path, sizeof(path));
+    pthread_mutex_lock(&store->lock);
+    HASH_FIND(hh, store->blobs, hash, USBX_SHA256_HEX_SIZE - 1, blob);
+    if (blob) {
+        touch(store, blob);     // a concurrent upload of the same contents won
+        result = 0;
+    } else if (make_room(store, length) < 0) {
+        result = USBX_ERROR_NO_MEM;
+    } else if (!(blob = calloc(1, sizeof(*blob)))) {
+        result = USBX_ERROR_NO_MEM;
+    } else if (rename(upload, path) < 0) {
+        free(blob);
+        result = USBX_ERROR_IO;
+    } else {
+        memcpy(blob->hash, hash, USBX_SHA256_HEX_SIZE);
+        blob->size = length;
+        blob->store = store;
+        HASH_ADD(hh, store->blobs, hash, USBX_SHA256_HEX_SIZE - 1, blob);
+        store->bytes += length;
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    if (result != 1) {
+        unlink(upload);
+    }
+    return result;
+}
+
+/* Map a blob's file read-only; returns NULL on failure */
+static unsigned char *map_blob(struct usbx_blob_store *store, const struct usbx_blob *blob) {
+    char path[BLOB_PATH_MAX];
+
+    if (blob->size == 0) {
+        return empty_blob;
+    }
+    blob_path(store, blob->hash, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    void *data = mmap(NULL, (size_t)blob->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    // Transfers read a blob front to back
+    posix_madvise(data, (size_t)blob->size, POSIX_MADV_SEQUENTIAL);
+    return data;
+}
+
+struct usbx_blob *usbx_blob_get(struct usbx_blob_store *store, const char *text) {
+    char hash[USBX_SHA256_HEX_SIZE];
+    struct usbx_blob *blob;
+
+    if (!text || normalize_hash(text, hash) < 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&store->lock);
+    HASH_FIND(hh, store->blobs, hash, USBX_SHA256_HEX_SIZE - 1, blob);
+    if (!blob) {
+        store->misses++;
+    } else if (blob->users == 0 && !(blob->data = map_blob(store, blob))) {
+        blob = NULL;
+    } else {
+        store->hits++;
+        blob->users++;
+        touch(store, blob);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return blob;
+}
+
+void usbx_blob_release(struct usbx_blob *blob) {
+    if (!blob) {
+        return;
+    }
+
+    struct usbx_blob_store *store = blob->store;
+    pthread_mutex_lock(&store->lock);
+    if (--blob->users == 0) {
+        if (blob->data != empty_blob) {
+            munmap(blob->data, (size_t)blob->size);
+        }
+        blob->data = NULL;
+        if (blob->removed) {
+            free(blob);
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+const unsigned char *usbx_blob_data(const struct usbx_blob *blob) {
+    return blob->data;
+}
+
+size_t usbx_blob_size(const struct usbx_blob *blob) {
+    return (size_t)blob->size;
+}
+
+int usbx_blob_remove(struct usbx_blob_store *store, const char *text) {
+    char hash[USBX_SHA256_HEX_SIZE];
+    struct usbx_blob *blob = NULL;
+
+    if (!text || normalize_hash(text, hash) < 0) {
+        return USBX_ERROR_NOT_FOUND;
+    }
+    pthread_mutex_lock(&store->lock);
+    HASH_FIND(hh, store->blobs, hash, USBX_SHA256_HEX_SIZE - 1, blob);
+    if (blob) {
+        unlink_blob(store, blob);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return blob ? USBX_SUCCESS : USBX_ERROR_NOT_FOUND;
+}
+
+int usbx_blob_list(struct usbx_blob_store *store, struct usbx_blob_info *info, int max) {
+    struct usbx_blob *blob, *tmp;
+
+    pthread_mutex_lock(&store->lock);
+    int count = (int)HASH_COUNT(store->blobs);
+    int index = count;
+    HASH_ITER(hh, store->blobs, blob, tmp) {
+        index--;
+        if (index < max) {
+            memcpy(info[index].hash, blob->hash, USBX_SHA256_HEX_SIZE);
+            info[index].size = blob->size;
+            info[index].users = blob->users;
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+    return count;
+}
+
+void usbx_blob_get_stats(struct usbx_blob_store *store, struct usbx_blob_stats *stats) {
+    pthread_mutex_lock(&store->lock);
+    stats->capacity = store->capacity;
+    stats->bytes = store->bytes;
+    stats->blobs = (int)HASH_COUNT(store->blobs);
+    stats->hits = store->hits;
+    stats->misses = store->misses;
+    stats->evictions = store->evictions;
+    pthread_mutex_unlock(&store->lock);
+}
@@ -0,0 +1,235 @@
+/**
+ * @file breaker.c
+ * @brief Per-device circuit breaker
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_breaker.h"
+#include "usbx_util.h"
+
+/** @brief Transfers of one slice of the window */
+struct bucket {
+    uint64_t epoch;              // time / bucket length when the counts started
+    uint32_t transfers;
+    uint32_t failures;
+};
+
+struct usbx_breaker {
+    pthread_mutex_t lock;
+    struct usbx_breaker_config config;
+    struct bucket buckets[USBX_BREAKER_BUCKETS];
+    int state;
+    uint64_t until_us;           // open: end of the cooldown; half-open: end of the probe
+    uint64_t trips;
+    uint64_t rejected;
+    uint64_t probes;
+};
+
+static const char *const state_names[] = {"closed", "open", "half_open"};
+
+const char *usbx_breaker_state_name(int state) {
+    if (state < 0 || state >= (int)(sizeof(state_names) / sizeof(state_names[0]))) {
+        return "unknown";
+    }
+    return state_names[state];
+}
+
+void usbx_breaker_config_init(struct usbx_breaker_config *config) {
+    config->enabled = 1;
+    config->window_ms = USBX_BREAKER_DEFAULT_WINDOW_MS;
+    config->min_transfers = USBX_BREAKER_DEFAULT_MIN_TRANSFERS;
+    config->failure_pct = USBX_BREAKER_DEFAULT_FAILURE_PCT;
+    config->open_ms = USBX_BREAKER_DEFAULT_OPEN_MS;
+}
+
+struct usbx_breaker *usbx_breaker_create(void) {
+    struct usbx_breaker *breaker = calloc(1, sizeof(*breaker));
+    if (breaker) {
+        pthread_mutex_init(&breaker->lock, NULL);
+        usbx_breaker_config_init(&breaker->config);
+    }
+    return breaker;
+}
+
+void usbx_breaker_free(struct usbx_breaker *breaker) {
+    if (breaker) {
+        pthread_mutex_destroy(&breaker->lock);
+        free(breaker);
+    }
+}
+
+/* Current bucket epoch (lock held) */
+static uint64_t current_epoch(const struct usbx_breaker *breaker, uint64_t now_us) {
+    uint64_t bucket_us = (uint64_t)breaker->config.window_ms * 1000 / USBX_BREAKER_BUCKETS;
+    return now_us / (bucket_us > 0 ? bucket_us : 1);
+}
+
+/* Sum the buckets still inside the window (lock held) */
+static void window_counts(const struct usbx_breaker *breaker, uint64_t now_us,
+                          uint64_t *transfers, uint64_t *failures) {
+    uint64_t epoch = current_epoch(breaker, now_us);
+    *transfers = 0;
+    *failures = 0;
+    for (int i = 0; i < USBX_BREAKER_BUCKETS; i++) {
+        const struct bucket *b = &breaker->buckets[i];
+        if (b->epoch + USBX_BREAKER_BUCKETS > epoch) {
+            *transfers += b->transfers;
+            *failures += b->failures;
+        }
+    }
+}
+
+/* Close and forget the window (lock held) */
+static void close_breaker(struct usbx_breaker *breaker) {
+    breaker->state = USBX_BREAKER_CLOSED;
+    memset(breaker->buckets, 0, sizeof(breaker->buckets));
+}
+
+static void open_breaker(struct usbx_breaker *breaker, uint64_t now_us) {
+    breaker->state = USBX_BREAKER_OPEN;
+    breaker->until_us = now_us + (uint64_t)breaker->config.open_ms * 1000;
+}
+
+int usbx_breaker_configure(struct usbx_breaker *breaker, const struct usbx_breaker_config *config) {
+    if (!breaker || !config || config->window_ms < USBX_BREAKER_BUCKETS ||
+        config->window_ms > USBX_BREAKER_MAX_MS || config->open_ms > USBX_BREAKER_MAX_MS ||
+        config->failure_pct < 1 || config->failure_pct > 100 || config->min_transfers < 1) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    pthread_mutex_lock(&breaker->lock);
+    // Bucket epochs depend on the window length
+    if (config->window_ms != breaker->config.window_ms) {
+        memset(breaker->buckets, 0, sizeof(breaker->buckets));
+    }
+    breaker->config = *config;
+    if (!config->enabled) {
+        close_breaker(breaker);
+    }
+    pthread_mutex_unlock(&breaker->lock);
+    return USBX_SUCCESS;
+}
+
+void usbx_breaker_get_config(struct usbx_breaker *breaker, struct usbx_breaker_config *config) {
+    pthread_mutex_lock(&breaker->lock);
+    *config = breaker->config;
+    pthread_mutex_unlock(&breaker->lock);
+}
+
+void usbx_breaker_attach(struct usbx_breaker *breaker, struct usbx_device *dev) {
+    dev->breaker = breaker;
+    __atomic_or_fetch(&dev->taps, USBX_TAP_BREAKER, __ATOMIC_RELEASE);
+}
+
+void usbx_breaker_detach(struct usbx_device *dev) {
+    __atomic_and_fetch(&dev->taps, ~USBX_TAP_BREAKER, __ATOMIC_RELEASE);
+}
+
+void usbx_breaker_record(struct usbx_device *dev, int status) {
+    struct usbx_breaker *breaker = dev->breaker;
+    int failed;
+
+    switch (status) {
+    case USBX_TRANSFER_ERROR:
+    case USBX_TRANSFER_TIMED_OUT:
+    case USBX_TRANSFER_NO_DEVICE:
+        failed = 1;
+        break;
+    case USBX_TRANSFER_CANCELLED:
+        return;
+    default:
+        failed = 0;
+        break;
+    }
+
+    uint64_t now = usbx_now_us();
+    pthread_mutex_lock(&breaker->lock);
+    if (!breaker->config.enabled) {
+        pthread_mutex_unlock(&breaker->lock);
+        return;
+    }
+    switch (breaker->state) {
+    case USBX_BREAKER_HALF_OPEN:
+        // The probe decides
+        if (failed) {
+            open_breaker(breaker, now);
+        } else {
+            close_breaker(breaker);
+        }
+        break;
+    case USBX_BREAKER_CLOSED: {
+        uint64_t epoch = current_epoch(breaker, now);
+        struct bucket *b = &breaker->buckets[epoch % USBX_BREAKER_BUCKETS];
+        if (b->epoch != epoch) {
+            b->epoch = epoch;
+            b->transfers = 0;
+            b->failures = 0;
+        }
+        b->transfers++;
+        b->failures += failed;
+        if (!failed) {
+            break;
+        }
+        uint64_t transfers, failures;
+        window_counts(breaker, now, &transfers, &failures);
+        if (transfers >= breaker->config.min_transfers &&
+            failures * 100 >= transfers * breaker->config.failure_pct) {
+            open_breaker(breaker, now);
+            breaker->trips++;
+        }
+        break;
+    }
+    default:
+        break;                      // completions of requests admitted before opening
+    }
+    pthread_mutex_unlock(&breaker->lock);
+}
+
+int usbx_breaker_admit(struct usbx_breaker *breaker, unsigned int *retry_after_ms) {
+    uint64_t now = usbx_now_us();
+    int admitted = 1;
+
+    pthread_mutex_lock(&breaker->lock);
+    if (breaker->config.enabled && breaker->state != USBX_BREAKER_CLOSED) {
+        if (now >= breaker->until_us) {
+            // Let one probe through, and another if it never completes a transfer
+            breaker->state = USBX_BREAKER_HALF_OPEN;
+            breaker->until_us = now + (uint64_t)breaker->config.open_ms * 1000;
+            breaker->probes++;
+        } else {
+            admitted = 0;
+            breaker->rejected++;
+            if (retry_after_ms) {
+                *retry_after_ms = (unsigned int)((breaker->until_us - now + 999) / 1000);
+            }
+        }
+    }
+    pthread_mutex_unlock(&breaker->lock);
+    return admitted;
+}
+
+void usbx_breaker_reset(struct usbx_breaker *breaker) {
+    pthread_mutex_lock(&breaker->lock);
+    close_breaker(breaker);
+    pthread_mutex_unlock(&breaker->lock);
+}
+
+void usbx_breaker_get_stats(struct usbx_breaker *breaker, struct usbx_breaker_stats *stats) {
+    uint64_t now = usbx_now_us();
+
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&breaker->lock);
+    stats->state = breaker->state;
+    window_counts(breaker, now, &stats->transfers, &stats->failures);
+    stats->trips = breaker->trips;
+    stats->rejected = breaker->rejected;
+    stats->probes = breaker->probes;
+    if (breaker->state != USBX_BREAKER_CLOSED && breaker->until_us > now) {
+        stats->retry_after_ms = (unsigned int)((breaker->until_us - now + 999) / 1000);
+    }
+    pthread_mutex_unlock(&breaker->lock);
+}
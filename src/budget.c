@@ -0,0 +1,163 @@
+/**
+ * @file budget.c
+ * @brief Process-wide budget for memory held on behalf of requests
+ *
+ * Waiting reservations form a FIFO; each sleeps on its own condition
+ * variable and is woken when it reaches the head and fits, so a large
+ * reservation is not starved by a stream of small ones.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbx_backend.h"
+#include "usbx_budget.h"
+#include "usbx_util.h"
+
+/** @brief One waiting reservation */
+struct waiter {
+    struct waiter *next;
+    pthread_cond_t cond;
+    size_t bytes;
+    int granted;
+};
+
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct usbx_budget_stats budget = {.wait_ms = USBX_BUDGET_DEFAULT_WAIT_MS};
+static struct waiter *head = NULL, *tail = NULL;
+
+static int fits(size_t bytes) {
+    return budget.capacity == 0 || budget.in_use + bytes <= budget.capacity;
+}
+
+static void grant(size_t bytes) {
+    budget.in_use += bytes;
+    if (budget.in_use > budget.peak) {
+        budget.peak = budget.in_use;
+    }
+    budget.reservations++;
+}
+
+/* Admit waiting reservations from the head while they fit (lock held) */
+static void admit_waiters(void) {
+    while (head && fits(head->bytes)) {
+        struct waiter *w = head;
+        head = w->next;
+        if (!head) {
+            tail = NULL;
+        }
+        budget.waiting--;
+        grant(w->bytes);
+        w->granted = 1;
+        pthread_cond_signal(&w->cond);
+    }
+}
+
+int usbx_budget_configure(uint64_t capacity, unsigned int wait_ms) {
+    if (wait_ms > USBX_BUDGET_MAX_WAIT_MS) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    pthread_mutex_lock(&budget_lock);
+    budget.capacity = capacity;
+    budget.wait_ms = wait_ms;
+    admit_waiters();
+    // Waiters that can never fit now fail at their deadline like any other
+    pthread_mutex_unlock(&budget_lock);
+    return USBX_SUCCESS;
+}
+
+int usbx_budget_reserve(size_t bytes) {
+    pthread_mutex_lock(&budget_lock);
+    if (budget.capacity > 0 && bytes > budget.capacity) {
+        budget.too_large++;
+        pthread_mutex_unlock(&budget_lock);
+        return USBX_ERROR_NO_MEM;
+    }
+    // No overtaking: a reservation that fits still queues behind earlier ones
+    if (!head && fits(bytes)) {
+        grant(bytes);
+        pthread_mutex_unlock(&budget_lock);
+        return USBX_SUCCESS;
+    }
+    if (budget.wait_ms == 0) {
+        budget.timed_out++;
+        pthread_mutex_unlock(&budget_lock);
+        return USBX_ERROR_BUSY;
+    }
+
+    struct waiter w = {.bytes = bytes};
+    struct timespec deadline;
+    uint64_t start = usbx_now_us();
+    usbx_cond_init_monotonic(&w.cond);
+    usbx_deadline_ms(&deadline, (int)budget.wait_ms);
+    if (tail) {
+        tail->next = &w;
+    } else {
+        head = &w;
+    }
+    tail = &w;
+    budget.waiting++;
+
+    while (!w.granted) {
+        if (pthread_cond_timedwait(&w.cond, &budget_lock, &deadline) == ETIMEDOUT && !w.granted) {
+            struct waiter *prev = NULL;
+            for (struct waiter *it = head; it != &w; prev = it, it = it->next) {
+            }
+            if (prev) {
+                prev->next = w.next;
+            } else {
+                head = w.next;
+            }
+            if (tail == &w) {
+                tail = prev;
+            }
+            budget.waiting--;
+            budget.timed_out++;
+            admit_waiters();        // the next one may fit where this one did not
+            pthread_mutex_unlock(&budget_lock);
+            pthread_cond_destroy(&w.cond);
+            return USBX_ERROR_BUSY;
+        }
+    }
+    uint64_t waited = usbx_now_us() - start;
+    budget.waited++;
+    budget.wait_us += waited;
+    if (waited > budget.max_wait_us) {
+        budget.max_wait_us = waited;
+    }
+    pthread_mutex_unlock(&budget_lock);
+    pthread_cond_destroy(&w.cond);
+    return USBX_SUCCESS;
+}
+
+int usbx_budget_try_reserve(size_t bytes) {
+    pthread_mutex_lock(&budget_lock);
+    int granted = !head && fits(bytes);
+    if (granted) {
+        grant(bytes);
+    } else {
+        budget.declined++;
+    }
+    pthread_mutex_unlock(&budget_lock);
+    return granted ? USBX_SUCCESS : USBX_ERROR_BUSY;
+}
+
+void usbx_budget_release(size_t bytes) {
+    if (bytes == 0) {
+        return;
+    }
+    pthread_mutex_lock(&budget_lock);
+    budget.in_use = bytes < budget.in_use ? budget.in_use - bytes : 0;
+    admit_waiters();
+    pthread_mutex_unlock(&budget_lock);
+}
+
+void usbx_budget_get_stats(struct usbx_budget_stats *stats) {
+    pthread_mutex_lock(&budget_lock);
+    *stats = budget;
+    pthread_mutex_unlock(&budget_lock);
+}
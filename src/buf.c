@@ -0,0 +1,113 @@
+/**
+ * @file buf.c
+ * @brief Growable byte buffer for building response bodies
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_buf.h"
+
+void usbx_buf_init(struct usbx_buf *buf) {
+    memset(buf, 0, sizeof(*buf));
+}
+
+void usbx_buf_free(struct usbx_buf *buf) {
+    free(buf->data);
+    usbx_buf_init(buf);
+}
+
+char *usbx_buf_detach(struct usbx_buf *buf, size_t *length) {
+    char *data = buf->failed ? NULL : buf->data;
+
+    if (buf->failed) {
+        free(buf->data);
+    }
+    if (length) {
+        *length = data ? buf->length : 0;
+    }
+    usbx_buf_init(buf);
+    return data;
+}
+
+/* Make room for @p extra more bytes plus the terminator */
+static int reserve(struct usbx_buf *buf, size_t extra) {
+    if (buf->failed) {
+        return -1;
+    }
+    if (buf->length + extra < buf->capacity) {
+        return 0;
+    }
+
+    size_t capacity = buf->capacity ? buf->capacity : 256;
+    while (capacity <= buf->length + extra) {
+        capacity *= 2;
+    }
+    char *data = realloc(buf->data, capacity);
+    if (!data) {
+        buf->failed = 1;
+        return -1;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+void usbx_buf_append(struct usbx_buf *buf, const void *data, size_t length) {
+    if (reserve(buf, length) < 0) {
+        return;
+    }
+    if (length > 0) {
+        // data may be NULL for an empty payload, which memcpy() does not allow
+        memcpy(buf->data + buf->length, data, length);
+    }
+    buf->length += length;
+    buf->data[buf->length] = '\0';
+}
+
+void usbx_buf_printf(struct usbx_buf *buf, const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    int needed = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (needed < 0 || reserve(buf, (size_t)needed) < 0) {
+        return;
+    }
+
+    va_start(args, format);
+    vsnprintf(buf->data + buf->length, (size_t)needed + 1, format, args);
+    va_end(args);
+    buf->length += (size_t)needed;
+}
+
+void usbx_buf_json_string(struct usbx_buf *buf, const char *text) {
+    usbx_buf_json_bytes(buf, text, strlen(text));
+}
+
+void usbx_buf_json_bytes(struct usbx_buf *buf, const void *data, size_t length) {
+    const unsigned char *end = (const unsigned char *)data + length;
+
+    usbx_buf_append(buf, "\"", 1);
+    for (const unsigned char *p = data; p < end; p++) {
+        switch (*p) {
+        case '"':  usbx_buf_append(buf, "\\\"", 2); break;
+        case '\\': usbx_buf_append(buf, "\\\\", 2); break;
+        case '\n': usbx_buf_append(buf, "\\n", 2); break;
+        case '\r': usbx_buf_append(buf, "\\r", 2); break;
+        case '\t': usbx_buf_append(buf, "\\t", 2); break;
+        default:
+            if (*p < 0x20) {
+                usbx_buf_printf(buf, "\\u%04x", *p);
+            } else {
+                usbx_buf_append(buf, p, 1);
+            }
+            break;
+        }
+    }
+    usbx_buf_append(buf, "\"", 1);
+}
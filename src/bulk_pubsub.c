@@ -0,0 +1,696 @@
+/**
+ * @file bulk_pubsub.c
+ * @brief Bulk IN stream shared by many subscribers
+ *
+ * Reference counting (all under pubsub->lock): a chunk is referenced by
+ * the @c next link of its predecessor, by the publisher while it is the
+ * tail, and by every subscriber whose cursor points at it. A cursor is the
+ * last chunk the subscriber has fully consumed; it reads on from
+ * cursor->next at @c offset. The chain starts with an empty sentinel.
+ *
+ * Copying to subscribers happens outside the lock: published chunks are
+ * immutable and every @c next link up to the tail is already set, so a
+ * reader may walk and copy them unlocked while its cursor pins the chain.
+ * Policies skip a subscriber during that window and catch up on the next
+ * publish.
+ *
+ * Every allocated chunk holds a reservation of chunk_bytes() in the memory
+ * budget until it is freed; pooled chunks keep theirs. Chunks are taken
+ * in completion callbacks, so the reservation never waits: a backlog the
+ * budget cannot hold ends the stream with USBX_ERROR_NO_MEM.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbx_budget.h"
+#include "usbx_pubsub.h"
+#include "usbx_sched.h"
+#include "usbx_util.h"
+
+/** @brief Shared piece of the stream */
+struct chunk {
+    int refcount;
+    uint64_t offset;             // stream offset of data[0]
+    size_t length;
+    struct chunk *next;
+    unsigned char data[];
+};
+
+/** @brief Submitted transfer and the chunk it fills */
+struct publish_slot {
+    struct usbx_transfer xfer;
+    struct usbx_pubsub *pubsub;
+    struct chunk *chunk;
+};
+
+struct subscriber {
+    int id;
+    int policy;
+    uint64_t limit;
+    struct chunk *cursor;        // NULL once disconnected
+    size_t offset;               // bytes of cursor->next already read
+    uint64_t delivered;
+    uint64_t dropped;
+    int copying;                 // reader is copying outside the lock
+    struct subscriber *next;
+};
+
+struct usbx_pubsub {
+    struct usbx_device *dev;
+    unsigned char endpoint;
+    struct usbx_pubsub_options opts;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;      // new data, subscriber change, stopped
+    struct chunk *tail;
+    struct chunk *pool;          // released chunks kept for reuse
+    int pool_size;
+    uint64_t published;          // stream offset after the tail
+    struct publish_slot *slots;
+    struct publish_slot **parked;  // completed slots held back by a bounded subscriber
+    int num_parked;
+    int in_flight;
+    int readers;
+    int stopping;
+    int last_error;
+    struct subscriber *subscribers;
+    int num_subscribers;
+    int next_subscriber_id;
+    struct usbx_pubsub_stats stats;
+};
+
+void usbx_pubsub_options_init(struct usbx_pubsub_options *opts) {
+    opts->chunk_size = USBX_PUBSUB_DEFAULT_CHUNK_SIZE;
+    opts->transfers_in_flight = USBX_PUBSUB_DEFAULT_IN_FLIGHT;
+}
+
+int usbx_pubsub_policy_from_name(const char *name) {
+    if (strcmp(name, "drop") == 0) {
+        return USBX_PUBSUB_DROP;
+    } else if (strcmp(name, "disconnect") == 0) {
+        return USBX_PUBSUB_DISCONNECT;
+    } else if (strcmp(name, "bounded") == 0) {
+        return USBX_PUBSUB_BOUNDED;
+    }
+    return -1;
+}
+
+const char *usbx_pubsub_policy_name(int policy) {
+    switch (policy) {
+    case USBX_PUBSUB_DROP:
+        return "drop";
+    case USBX_PUBSUB_DISCONNECT:
+        return "disconnect";
+    case USBX_PUBSUB_BOUNDED:
+        return "bounded";
+    default:
+        return "unknown";
+    }
+}
+
+static size_t chunk_bytes(const struct usbx_pubsub *pubsub) {
+    return sizeof(struct chunk) + pubsub->opts.chunk_size;
+}
+
+static void free_chunk(struct usbx_pubsub *pubsub, struct chunk *chunk) {
+    if (chunk) {
+        free(chunk);
+        usbx_budget_release(chunk_bytes(pubsub));
+    }
+}
+
+/* Take a chunk from the pool or allocate one (lock held) */
+static struct chunk *get_chunk(struct usbx_pubsub *pubsub) {
+    struct chunk *chunk = pubsub->pool;
+    if (chunk) {
+        pubsub->pool = chunk->next;
+        pubsub->pool_size--;
+    } else {
+        if (usbx_budget_try_reserve(chunk_bytes(pubsub)) != USBX_SUCCESS) {
+            return NULL;
+        }
+        chunk = malloc(chunk_bytes(pubsub));
+        if (!chunk) {
+            usbx_budget_release(chunk_bytes(pubsub));
+            return NULL;
+        }
+    }
+    chunk->refcount = 0;
+    chunk->offset = 0;
+    chunk->length = 0;
+    chunk->next = NULL;
+    return chunk;
+}
+
+/* Drop a reference; releasing a chunk drops its link to the next one (lock held) */
+static void put_chunk(struct usbx_pubsub *pubsub, struct chunk *chunk) {
+    while (chunk && --chunk->refcount == 0) {
+        struct chunk *next = chunk->next;
+        pubsub->stats.retained_chunks--;
+        pubsub->stats.retained_bytes -= chunk->length;
+        if (pubsub->pool_size < pubsub->opts.transfers_in_flight) {
+            chunk->next = pubsub->pool;
+            pubsub->pool = chunk;
+            pubsub->pool_size++;
+        } else {
+            free_chunk(pubsub, chunk);
+        }
+        chunk = next;
+    }
+}
+
+/* Move a subscriber's cursor to @p chunk (lock held) */
+static void move_cursor(struct usbx_pubsub *pubsub, struct subscriber *sub, struct chunk *chunk,
+                        size_t offset) {
+    if (chunk != sub->cursor) {
+        chunk->refcount++;
+        put_chunk(pubsub, sub->cursor);
+        sub->cursor = chunk;
+    }
+    sub->offset = offset;
+}
+
+/* Published bytes the subscriber has not read yet (lock held) */
+static uint64_t backlog(const struct usbx_pubsub *pubsub, const struct subscriber *sub) {
+    if (!sub->cursor) {
+        return 0;
+    }
+    return pubsub->published - (sub->cursor->offset + sub->cursor->length + sub->offset);
+}
+
+/* Apply a subscriber's policy after a publish (lock held) */
+static void enforce_limit(struct usbx_pubsub *pubsub, struct subscriber *sub) {
+    uint64_t pending = backlog(pubsub, sub);
+    if (sub->copying || pending <= sub->limit) {
+        return;
+    }
+
+    if (sub->policy == USBX_PUBSUB_DISCONNECT) {
+        sub->dropped += pending;
+        put_chunk(pubsub, sub->cursor);
+        sub->cursor = NULL;
+        sub->offset = 0;
+    } else if (sub->policy == USBX_PUBSUB_DROP) {
+        // Skip whole chunks from the old end until the rest fits
+        while (pending > sub->limit && sub->cursor->next) {
+            struct chunk *skipped = sub->cursor->next;
+            size_t unread = skipped->length - sub->offset;
+            sub->dropped += unread;
+            pending -= unread;
+            move_cursor(pubsub, sub, skipped, 0);
+        }
+    }
+}
+
+/* Non-zero while a bounded subscriber is over its limit (lock held) */
+static int publisher_blocked(const struct usbx_pubsub *pubsub) {
+    for (const struct subscriber *sub = pubsub->subscribers; sub; sub = sub->next) {
+        if (sub->policy == USBX_PUBSUB_BOUNDED && backlog(pubsub, sub) >= sub->limit) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void publish(struct usbx_pubsub *pubsub, struct chunk *chunk, size_t length) {
+    chunk->offset = pubsub->published;
+    chunk->length = length;
+    chunk->refcount = 2;          // predecessor's link and the tail reference
+    pubsub->tail->next = chunk;
+    put_chunk(pubsub, pubsub->tail);
+    pubsub->tail = chunk;
+
+    pubsub->published += length;
+    pubsub->stats.chunks++;
+    pubsub->stats.bytes += length;
+    pubsub->stats.retained_chunks++;
+    pubsub->stats.retained_bytes += length;
+
+    for (struct subscriber *sub = pubsub->subscribers; sub; sub = sub->next) {
+        enforce_limit(pubsub, sub);
+    }
+    pthread_cond_broadcast(&pubsub->changed);
+}
+
+/* End the stream with @p error unless it is already ending (lock held) */
+static void fail(struct usbx_pubsub *pubsub, int error) {
+    if (!pubsub->stopping) {
+        pubsub->last_error = error;
+        pubsub->stopping = 1;
+    }
+    pthread_cond_broadcast(&pubsub->changed);
+}
+
+/* Submit slots taken out of the parked list (lock not held) */
+static void submit_slots(struct usbx_pubsub *pubsub, struct publish_slot **slots, int count) {
+    for (int i = 0; i < count; i++) {
+        int result = usbx_submit_transfer(&slots[i]->xfer);
+        if (result != USBX_SUCCESS) {
+            pthread_mutex_lock(&pubsub->lock);
+            pubsub->in_flight--;
+            fail(pubsub, result);
+            pthread_mutex_unlock(&pubsub->lock);
+        }
+    }
+}
+
+/*
+ * Move parked slots to @p out for resubmission once no bounded subscriber
+ * blocks the publisher (lock held).
+ */
+static int take_parked(struct usbx_pubsub *pubsub, struct publish_slot **out) {
+    if (pubsub->num_parked == 0 || pubsub->stopping || publisher_blocked(pubsub)) {
+        return 0;
+    }
+    int count = pubsub->num_parked;
+    memcpy(out, pubsub->parked, (size_t)count * sizeof(*out));
+    pubsub->num_parked = 0;
+    pubsub->in_flight += count;
+    pubsub->stats.paused = 0;
+    return count;
+}
+
+static void publish_complete(struct usbx_transfer *xfer) {
+    struct publish_slot *slot = xfer->user_data;
+    struct usbx_pubsub *pubsub = slot->pubsub;
+
+    pthread_mutex_lock(&pubsub->lock);
+    pubsub->in_flight--;
+
+    if (xfer->status == USBX_TRANSFER_COMPLETED && xfer->actual_length > 0) {
+        struct chunk *next = get_chunk(pubsub);
+        if (next) {
+            publish(pubsub, slot->chunk, (size_t)xfer->actual_length);
+            slot->chunk = next;
+            xfer->buffer = next->data;
+        } else {
+            fail(pubsub, USBX_ERROR_NO_MEM);
+        }
+    } else if (xfer->status != USBX_TRANSFER_COMPLETED &&
+               xfer->status != USBX_TRANSFER_TIMED_OUT &&
+               xfer->status != USBX_TRANSFER_CANCELLED) {
+        fail(pubsub, usbx_status_to_error(xfer->status));
+    }
+
+    if (pubsub->stopping || xfer->status == USBX_TRANSFER_CANCELLED) {
+        pthread_cond_broadcast(&pubsub->changed);
+        pthread_mutex_unlock(&pubsub->lock);
+        return;
+    }
+    if (publisher_blocked(pubsub)) {
+        if (pubsub->num_parked == 0) {
+            pubsub->stats.pauses++;
+        }
+        pubsub->parked[pubsub->num_parked++] = slot;
+        pubsub->stats.paused = 1;
+        pthread_mutex_unlock(&pubsub->lock);
+        return;
+    }
+    pubsub->in_flight++;
+    pthread_mutex_unlock(&pubsub->lock);
+
+    submit_slots(pubsub, &slot, 1);
+}
+
+static void free_pubsub(struct usbx_pubsub *pubsub) {
+    struct subscriber *sub = pubsub->subscribers;
+    while (sub) {
+        struct subscriber *next = sub->next;
+        put_chunk(pubsub, sub->cursor);
+        free(sub);
+        sub = next;
+    }
+    put_chunk(pubsub, pubsub->tail);
+    if (pubsub->slots) {
+        for (int i = 0; i < pubsub->opts.transfers_in_flight; i++) {
+            free_chunk(pubsub, pubsub->slots[i].chunk);
+        }
+    }
+    while (pubsub->pool) {
+        struct chunk *next = pubsub->pool->next;
+        free_chunk(pubsub, pubsub->pool);
+        pubsub->pool = next;
+    }
+    free(pubsub->slots);
+    free(pubsub->parked);
+    pthread_cond_destroy(&pubsub->changed);
+    pthread_mutex_destroy(&pubsub->lock);
+    free(pubsub);
+}
+
+static int allocate_pubsub(struct usbx_pubsub *pubsub) {
+    int count = pubsub->opts.transfers_in_flight;
+
+    pubsub->slots = calloc((size_t)count, sizeof(struct publish_slot));
+    pubsub->parked = calloc((size_t)count, sizeof(struct publish_slot *));
+    pubsub->tail = get_chunk(pubsub);
+    if (!pubsub->slots || !pubsub->parked || !pubsub->tail) {
+        return USBX_ERROR_NO_MEM;
+    }
+    pubsub->tail->refcount = 1;
+    pubsub->stats.retained_chunks = 1;
+
+    for (int i = 0; i < count; i++) {
+        struct publish_slot *slot = &pubsub->slots[i];
+        slot->pubsub = pubsub;
+        slot->chunk = get_chunk(pubsub);
+        if (!slot->chunk) {
+            return USBX_ERROR_NO_MEM;
+        }
+        slot->xfer.dev = pubsub->dev;
+        slot->xfer.endpoint = pubsub->endpoint;
+        slot->xfer.type = USBX_TRANSFER_TYPE_BULK;
+        slot->xfer.timeout = 0;        // the device sends when it has data
+        slot->xfer.buffer = slot->chunk->data;
+        slot->xfer.length = (int)pubsub->opts.chunk_size;
+        slot->xfer.callback = publish_complete;
+        slot->xfer.user_data = slot;
+    }
+    return USBX_SUCCESS;
+}
+
+static struct usbx_pubsub *create_pubsub(struct usbx_device *dev, unsigned char endpoint,
+                                         const struct usbx_pubsub_options *opts, int *error) {
+    struct usbx_pubsub *pubsub = calloc(1, sizeof(*pubsub));
+    if (!pubsub) {
+        *error = USBX_ERROR_NO_MEM;
+        return NULL;
+    }
+    pubsub->dev = dev;
+    pubsub->endpoint = endpoint;
+    pubsub->opts = *opts;
+    pubsub->next_subscriber_id = 1;
+    pthread_mutex_init(&pubsub->lock, NULL);
+    usbx_cond_init_monotonic(&pubsub->changed);
+
+    int max_packet = usbx_get_max_packet_size(dev, endpoint);
+    if (max_packet <= 0) {
+        *error = max_packet < 0 ? max_packet : USBX_ERROR_INVALID_PARAM;
+        free_pubsub(pubsub);
+        return NULL;
+    }
+    // Whole packets only, so a transfer never ends in the middle of one
+    pubsub->opts.chunk_size -= pubsub->opts.chunk_size % (size_t)max_packet;
+    if (pubsub->opts.chunk_size == 0) {
+        pubsub->opts.chunk_size = (size_t)max_packet;
+    }
+
+    *error = allocate_pubsub(pubsub);
+    if (*error != USBX_SUCCESS) {
+        free_pubsub(pubsub);
+        return NULL;
+    }
+    return pubsub;
+}
+
+struct usbx_pubsub *usbx_pubsub_start(struct usbx_device *dev, unsigned char endpoint,
+                                      const struct usbx_pubsub_options *opts, int *error) {
+    struct usbx_pubsub_options defaults;
+    int local_error;
+
+    if (!error) {
+        error = &local_error;
+    }
+    if (!opts) {
+        usbx_pubsub_options_init(&defaults);
+        opts = &defaults;
+    }
+    if (!dev || !(endpoint & USBX_ENDPOINT_IN) || opts->transfers_in_flight < 1 ||
+        opts->transfers_in_flight > USBX_PUBSUB_MAX_IN_FLIGHT || opts->chunk_size == 0 || opts->chunk_size > 0x7fffffff) {
+        *error = USBX_ERROR_INVALID_PARAM;
+        return NULL;
+    }
+
+    struct usbx_pubsub *pubsub = create_pubsub(dev, endpoint, opts, error);
+    if (!pubsub) {
+        return NULL;
+    }
+
+    // The publisher serves every subscriber for as long as it runs, not the starting client
+    const char *client = usbx_sched_client();
+    usbx_sched_set_client(NULL);
+    int result = USBX_SUCCESS;
+    pthread_mutex_lock(&pubsub->lock);
+    for (int i = 0; i < pubsub->opts.transfers_in_flight; i++) {
+        pubsub->in_flight++;
+        pthread_mutex_unlock(&pubsub->lock);
+        result = usbx_submit_transfer(&pubsub->slots[i].xfer);
+        pthread_mutex_lock(&pubsub->lock);
+        if (result != USBX_SUCCESS) {
+            pubsub->in_flight--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pubsub->lock);
+    usbx_sched_set_client(client);
+
+    *error = result;
+    if (result != USBX_SUCCESS) {
+        usbx_pubsub_destroy(pubsub);
+        return NULL;
+    }
+    return pubsub;
+}
+
+void usbx_pubsub_stop(struct usbx_pubsub *pubsub) {
+    pthread_mutex_lock(&pubsub->lock);
+    fail(pubsub, USBX_ERROR_INTERRUPTED);
+    pthread_mutex_unlock(&pubsub->lock);
+
+    for (int i = 0; i < pubsub->opts.transfers_in_flight; i++) {
+        usbx_cancel_transfer(&pubsub->slots[i].xfer);
+    }
+
+    pthread_mutex_lock(&pubsub->lock);
+    while (pubsub->in_flight > 0) {
+        pthread_cond_wait(&pubsub->changed, &pubsub->lock);
+    }
+    pthread_mutex_unlock(&pubsub->lock);
+}
+
+void usbx_pubsub_destroy(struct usbx_pubsub *pubsub) {
+    if (!pubsub) {
+        return;
+    }
+    usbx_pubsub_stop(pubsub);
+
+    pthread_mutex_lock(&pubsub->lock);
+    while (pubsub->readers > 0) {
+        pthread_cond_wait(&pubsub->changed, &pubsub->lock);
+    }
+    pthread_mutex_unlock(&pubsub->lock);
+    free_pubsub(pubsub);
+}
+
+void usbx_pubsub_get_stats(struct usbx_pubsub *pubsub, struct usbx_pubsub_stats *stats) {
+    pthread_mutex_lock(&pubsub->lock);
+    *stats = pubsub->stats;
+    stats->subscribers = pubsub->num_subscribers;
+    stats->running = !pubsub->stopping;
+    stats->last_error = pubsub->last_error;
+    pthread_mutex_unlock(&pubsub->lock);
+}
+
+static struct subscriber *find_subscriber(struct usbx_pubsub *pubsub, int id) {
+    for (struct subscriber *sub = pubsub->subscribers; sub; sub = sub->next) {
+        if (sub->id == id) {
+            return sub;
+        }
+    }
+    return NULL;
+}
+
+int usbx_pubsub_subscribe(struct usbx_pubsub *pubsub, int policy, uint64_t limit) {
+    if (policy < USBX_PUBSUB_DROP || policy > USBX_PUBSUB_BOUNDED) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    struct subscriber *sub = calloc(1, sizeof(*sub));
+    if (!sub) {
+        return USBX_ERROR_NO_MEM;
+    }
+    sub->policy = policy;
+    sub->limit = limit ? limit : USBX_PUBSUB_DEFAULT_LIMIT;
+    if (sub->limit < pubsub->opts.chunk_size) {
+        sub->limit = pubsub->opts.chunk_size;
+    }
+
+    pthread_mutex_lock(&pubsub->lock);
+    sub->id = pubsub->next_subscriber_id++;
+    move_cursor(pubsub, sub, pubsub->tail, 0);
+    sub->next = pubsub->subscribers;
+    pubsub->subscribers = sub;
+    pubsub->num_subscribers++;
+    int id = sub->id;
+    pthread_mutex_unlock(&pubsub->lock);
+    return id;
+}
+
+int usbx_pubsub_unsubscribe(struct usbx_pubsub *pubsub, int subscriber) {
+    struct publish_slot *resume[USBX_PUBSUB_MAX_IN_FLIGHT];
+    int result = USBX_ERROR_NOT_FOUND;
+    int count = 0;
+
+    pthread_mutex_lock(&pubsub->lock);
+    for (struct subscriber **link = &pubsub->subscribers; *link; link = &(*link)->next) {
+        if ((*link)->id == subscriber) {
+            struct subscriber *sub = *link;
+            *link = sub->next;
+            while (sub->copying) {          // a reader still copies through its cursor
+                pthread_cond_wait(&pubsub->changed, &pubsub->lock);
+            }
+            put_chunk(pubsub, sub->cursor);
+            free(sub);
+            pubsub->num_subscribers--;
+            result = pubsub->num_subscribers;
+            pthread_cond_broadcast(&pubsub->changed);  // wake a reader blocked on it
+            count = take_parked(pubsub, resume);       // it may have been the bounded one
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pubsub->lock);
+
+    submit_slots(pubsub, resume, count);
+    return result;
+}
+
+/*
+ * Copy from the chain after @p cursor without the lock. Returns the bytes
+ * copied and the new cursor position in @p cursor / @p offset.
+ */
+static size_t copy_out(struct chunk **cursor, size_t *offset, const struct chunk *tail,
+                       unsigned char *buffer, size_t max) {
+    struct chunk *chunk = *cursor;
+    size_t position = *offset;
+    size_t copied = 0;
+
+    while (copied < max && chunk != tail) {
+        struct chunk *next = chunk->next;
+        size_t n = next->length - position;
+        if (n > max - copied) {
+            n = max - copied;
+        }
+        memcpy(buffer + copied, next->data + position, n);
+        copied += n;
+        position += n;
+        if (position == next->length) {
+            chunk = next;
+            position = 0;
+        }
+    }
+    *cursor = chunk;
+    *offset = position;
+    return copied;
+}
+
+long usbx_pubsub_read(struct usbx_pubsub *pubsub, int subscriber, unsigned char *buffer,
+                      size_t max, int timeout_ms) {
+    struct publish_slot *resume[USBX_PUBSUB_MAX_IN_FLIGHT];
+    struct timespec deadline;
+    long result = 0;
+    int count = 0;
+
+    if (timeout_ms > 0) {
+        usbx_deadline_ms(&deadline, timeout_ms);
+    }
+
+    pthread_mutex_lock(&pubsub->lock);
+    pubsub->readers++;
+    for (;;) {
+        struct subscriber *sub = find_subscriber(pubsub, subscriber);
+        if (!sub) {
+            result = USBX_ERROR_NOT_FOUND;
+            break;
+        }
+        if (!sub->cursor) {
+            result = USBX_ERROR_OVERFLOW;
+            break;
+        }
+
+        if (sub->cursor != pubsub->tail && max > 0) {
+            struct chunk *cursor = sub->cursor;
+            size_t offset = sub->offset;
+            const struct chunk *tail = pubsub->tail;
+
+            sub->copying = 1;
+            pthread_mutex_unlock(&pubsub->lock);
+            size_t copied = copy_out(&cursor, &offset, tail, buffer, max);
+            pthread_mutex_lock(&pubsub->lock);
+            sub->copying = 0;
+
+            move_cursor(pubsub, sub, cursor, offset);
+            sub->delivered += copied;
+            enforce_limit(pubsub, sub);          // publishes seen while copying
+            pthread_cond_broadcast(&pubsub->changed);  // unsubscribe may wait for us
+            count = take_parked(pubsub, resume);
+            result = (long)copied;
+            break;
+        }
+        if (pubsub->stopping) {
+            result = pubsub->last_error;
+            break;
+        }
+
+        if (timeout_ms == 0) {
+            break;
+        } else if (timeout_ms < 0) {
+            pthread_cond_wait(&pubsub->changed, &pubsub->lock);
+        } else if (pthread_cond_timedwait(&pubsub->changed, &pubsub->lock, &deadline) != 0) {
+            break;
+        }
+    }
+    pubsub->readers--;
+    if (pubsub->readers == 0 && pubsub->stopping) {
+        pthread_cond_broadcast(&pubsub->changed);  // usbx_pubsub_destroy() may wait
+    }
+    pthread_mutex_unlock(&pubsub->lock);
+
+    submit_slots(pubsub, resume, count);
+    return result;
+}
+
+/* Fill one stats entry (lock held) */
+static void subscriber_snapshot(const struct usbx_pubsub *pubsub, const struct subscriber *sub,
+                                struct usbx_pubsub_subscriber_stats *stats) {
+    stats->id = sub->id;
+    stats->policy = sub->policy;
+    stats->limit = sub->limit;
+    stats->delivered = sub->delivered;
+    stats->dropped = sub->dropped;
+    stats->backlog = backlog(pubsub, sub);
+    stats->disconnected = sub->cursor == NULL;
+}
+
+int usbx_pubsub_subscriber_stats(struct usbx_pubsub *pubsub, int subscriber,
+                                 struct usbx_pubsub_subscriber_stats *stats) {
+    int result = USBX_ERROR_NOT_FOUND;
+
+    pthread_mutex_lock(&pubsub->lock);
+    struct subscriber *sub = find_subscriber(pubsub, subscriber);
+    if (sub) {
+        subscriber_snapshot(pubsub, sub, stats);
+        result = USBX_SUCCESS;
+    }
+    pthread_mutex_unlock(&pubsub->lock);
+    return result;
+}
+
+int usbx_pubsub_list_subscribers(struct usbx_pubsub *pubsub,
+                                 struct usbx_pubsub_subscriber_stats *stats, int max) {
+    int count = 0;
+
+    pthread_mutex_lock(&pubsub->lock);
+    for (struct subscriber *sub = pubsub->subscribers; sub; sub = sub->next) {
+        if (count < max) {
+            subscriber_snapshot(pubsub, sub, &stats[count]);
+        }
+        count++;
+    }
+    pthread_mutex_unlock(&pubsub->lock);
+    return count;
+}
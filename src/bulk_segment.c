@@ -0,0 +1,285 @@
+/**
+ * @file bulk_segment.c
+ * @brief Segmented bulk transfer engine
+ *
+ * The calling thread submits segments in order while fewer than
+ * max_in_flight are outstanding and then sleeps until a completion frees a
+ * slot. Completion callbacks only record the per-segment outcome; all
+ * submissions and cancellations happen on the calling thread, so a slot is
+ * never reused behind the engine's back.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_bulk.h"
+#include "usbx_config.h"
+
+/** @brief Marker for segments that have not completed yet */
+#define SEGMENT_PENDING 1
+
+/** @brief Packet size assumed when the backend cannot report one */
+#define FALLBACK_PACKET_SIZE 512
+
+struct segment_job;
+
+/** @brief One reusable in-flight transfer slot */
+struct segment_slot {
+    struct usbx_transfer xfer;
+    struct segment_job *job;
+    size_t index;               // segment currently using the slot
+    int busy;
+    int cancel_sent;
+};
+
+/** @brief Shared state of one segmented request */
+struct segment_job {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct segment_slot slots[USBX_SEGMENT_MAX_IN_FLIGHT];
+    int in_flight;
+    size_t stop_index;          // first segment that ended the request, SIZE_MAX if none
+    size_t segment_size;
+    size_t length;
+    int *seg_result;            // usbx_error per segment, SEGMENT_PENDING until done
+    int *seg_actual;            // bytes transferred per segment
+};
+
+void usbx_segment_options_init(struct usbx_segment_options *opts) {
+    const struct usbx_config *config = usbx_config_current();
+    opts->segment_size = config->segment_size;
+    opts->max_in_flight = config->segment_in_flight;
+    opts->timeout = config->segment_timeout_ms;
+    opts->flags = 0;
+}
+
+static size_t segment_length(const struct segment_job *job, size_t index) {
+    size_t offset = index * job->segment_size;
+    size_t left = job->length - offset;
+    return left < job->segment_size ? left : job->segment_size;
+}
+
+/* Round the requested segment size to a whole number of packets */
+static size_t aligned_segment_size(size_t requested, int packet_size) {
+    size_t packet = packet_size > 0 ? (size_t)packet_size : FALLBACK_PACKET_SIZE;
+    size_t limit = (size_t)INT_MAX - (size_t)INT_MAX % packet;
+
+    if (requested > limit) {
+        requested = limit;
+    }
+    requested -= requested % packet;
+    return requested < packet ? packet : requested;
+}
+
+static void segment_done(struct usbx_transfer *xfer) {
+    struct segment_slot *slot = xfer->user_data;
+    struct segment_job *job = slot->job;
+
+    pthread_mutex_lock(&job->lock);
+    int result = usbx_status_to_error(xfer->status);
+    job->seg_result[slot->index] = result;
+    job->seg_actual[slot->index] = xfer->actual_length;
+
+    // A failed or short segment ends the request; later segments get cancelled
+    int ended = result != USBX_SUCCESS ||
+                (size_t)xfer->actual_length < segment_length(job, slot->index);
+    if (ended && slot->index < job->stop_index) {
+        job->stop_index = slot->index;
+    }
+
+    slot->busy = 0;
+    job->in_flight--;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Idle slot of the window; called with fewer than window segments in flight, so one exists */
+static struct segment_slot *free_slot(struct segment_job *job, int window) {
+    int i = 0;
+    while (i < window - 1 && job->slots[i].busy) {
+        i++;
+    }
+    return &job->slots[i];
+}
+
+/* Cancel in-flight segments behind the stop point (lock held on entry and exit) */
+static void cancel_after_stop(struct segment_job *job, int window) {
+    struct segment_slot *to_cancel[USBX_SEGMENT_MAX_IN_FLIGHT];
+    int count = 0;
+
+    for (int i = 0; i < window; i++) {
+        struct segment_slot *slot = &job->slots[i];
+        if (slot->busy && !slot->cancel_sent && slot->index > job->stop_index) {
+            slot->cancel_sent = 1;
+            to_cancel[count++] = slot;
+        }
+    }
+
+    // Only this thread reuses slots, so they stay valid while unlocked
+    pthread_mutex_unlock(&job->lock);
+    for (int i = 0; i < count; i++) {
+        usbx_cancel_transfer(&to_cancel[i]->xfer);
+    }
+    pthread_mutex_lock(&job->lock);
+}
+
+static void run_segments(struct segment_job *job, struct usbx_device *dev,
+                         unsigned char endpoint, unsigned char *data,
+                         const struct usbx_segment_options *opts, size_t count) {
+    int window = opts->max_in_flight;
+    size_t next = 0;
+
+    pthread_mutex_lock(&job->lock);
+    for (;;) {
+        while (job->in_flight < window && next < count && next < job->stop_index) {
+            struct segment_slot *slot = free_slot(job, window);
+            struct usbx_transfer *xfer = &slot->xfer;
+
+            memset(xfer, 0, sizeof(*xfer));
+            xfer->dev = dev;
+            xfer->endpoint = endpoint;
+            xfer->type = USBX_TRANSFER_TYPE_BULK;
+            xfer->timeout = opts->timeout;
+            xfer->buffer = data + next * job->segment_size;
+            xfer->length = (int)segment_length(job, next);
+            xfer->callback = segment_done;
+            xfer->user_data = slot;
+            if (next == count - 1 && !(endpoint & USBX_ENDPOINT_IN) &&
+                (opts->flags & USBX_SEGMENT_ZERO_PACKET)) {
+                xfer->flags |= USBX_TRANSFER_ADD_ZERO_PACKET;
+            }
+            slot->job = job;
+            slot->index = next;
+            slot->busy = 1;
+            slot->cancel_sent = 0;
+            job->in_flight++;
+
+            pthread_mutex_unlock(&job->lock);
+            int result = usbx_submit_transfer(xfer);
+            pthread_mutex_lock(&job->lock);
+
+            if (result != USBX_SUCCESS) {
+                job->seg_result[next] = result;
+                slot->busy = 0;
+                job->in_flight--;
+                if (next < job->stop_index) {
+                    job->stop_index = next;
+                }
+            }
+            next++;
+        }
+
+        if (job->in_flight == 0 && (next >= count || next >= job->stop_index)) {
+            break;
+        }
+        if (job->stop_index != SIZE_MAX) {
+            cancel_after_stop(job, window);
+            if (job->in_flight == 0) {
+                continue;
+            }
+        }
+        pthread_cond_wait(&job->cond, &job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Walk the segments in order and fold them into the caller-visible result */
+static void collect_result(const struct segment_job *job, unsigned char endpoint,
+                           size_t count, struct usbx_segment_result *result) {
+    int stopped = 0;
+
+    memset(result, 0, sizeof(*result));
+    result->status = USBX_SUCCESS;
+    for (size_t i = 0; i < count; i++) {
+        int seg_result = job->seg_result[i];
+        size_t actual = job->seg_actual[i] > 0 ? (size_t)job->seg_actual[i] : 0;
+
+        if (stopped || seg_result == SEGMENT_PENDING) {
+            stopped = 1;
+            result->discarded += actual;
+            continue;
+        }
+
+        result->transferred += actual;
+        if (seg_result != USBX_SUCCESS) {
+            result->status = seg_result;
+            stopped = 1;
+            continue;
+        }
+
+        result->segments++;
+        if (actual < segment_length(job, i)) {
+            stopped = 1;
+            if (endpoint & USBX_ENDPOINT_IN) {
+                result->short_packet = 1;
+            } else {
+                result->status = USBX_ERROR_IO;  // OUT segments only end early on errors
+            }
+        }
+    }
+}
+
+int usbx_bulk_transfer_segmented(struct usbx_device *dev, unsigned char endpoint,
+                                 unsigned char *data, size_t length,
+                                 const struct usbx_segment_options *opts,
+                                 struct usbx_segment_result *result) {
+    struct usbx_segment_options defaults;
+    struct usbx_segment_result local_result;
+
+    if (!result) {
+        result = &local_result;
+    }
+    memset(result, 0, sizeof(*result));
+    if (!opts) {
+        usbx_segment_options_init(&defaults);
+        opts = &defaults;
+    }
+    if (!dev || (length > 0 && !data) || opts->max_in_flight < 1 ||
+        opts->max_in_flight > USBX_SEGMENT_MAX_IN_FLIGHT) {
+        result->status = USBX_ERROR_INVALID_PARAM;
+        return result->status;
+    }
+
+    struct segment_job *job = calloc(1, sizeof(*job));
+    if (!job) {
+        result->status = USBX_ERROR_NO_MEM;
+        return result->status;
+    }
+    job->length = length;
+    job->segment_size = aligned_segment_size(opts->segment_size,
+                                             usbx_get_max_packet_size(dev, endpoint));
+    job->stop_index = SIZE_MAX;
+
+    // A zero-length request still issues one (zero-length) transfer
+    size_t count = length == 0 ? 1 : (length + job->segment_size - 1) / job->segment_size;
+    job->seg_result = malloc(count * sizeof(int));
+    job->seg_actual = calloc(count, sizeof(int));
+    if (!job->seg_result || !job->seg_actual) {
+        free(job->seg_result);
+        free(job->seg_actual);
+        free(job);
+        result->status = USBX_ERROR_NO_MEM;
+        return result->status;
+    }
+    for (size_t i = 0; i < count; i++) {
+        job->seg_result[i] = SEGMENT_PENDING;
+    }
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+
+    run_segments(job, dev, endpoint, data, opts, count);
+    collect_result(job, endpoint, count, result);
+
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->lock);
+    free(job->seg_result);
+    free(job->seg_actual);
+    free(job);
+    job = NULL;
+    return result->status;
+}
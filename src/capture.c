@@ -0,0 +1,468 @@
+/**
+ * @file capture.c
+ * @brief usbmon-compatible capture into per-thread lock-free rings
+ *
+ * Each recording thread owns one ring and is its only producer; the
+ * attached reader is the only consumer. The producer publishes a record by
+ * advancing @c head with release semantics after writing it, and the
+ * consumer frees space by advancing @c tail the same way, so neither side
+ * takes a lock once a thread's ring exists. In the ring every record is
+ * preceded by an 8-byte sort key (capture time in nanoseconds) that the
+ * reader uses to merge the rings and does not emit.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbx_capture.h"
+#include "usbx_util.h"
+
+/** @brief Isochronous descriptors kept per record; the rest are only counted */
+#define MAX_ISO_DESCRIPTORS 128
+
+/** @brief Bytes of the sort key in front of each record in a ring */
+#define SORT_KEY_SIZE 8
+
+/** @brief Largest record: headers, descriptors and a maximal snapshot */
+#define MAX_RECORD_SIZE (USBX_CAPTURE_RECORD_HEADER_SIZE + USBX_CAPTURE_USBMON_SIZE + \
+                         MAX_ISO_DESCRIPTORS * USBX_CAPTURE_ISO_DESC_SIZE + 65535)
+
+/** @brief How often a waiting reader looks at the rings again */
+#define READER_POLL_US 10000
+
+/** @brief Ring of one recording thread */
+struct thread_ring {
+    unsigned char *data;
+    size_t size;                 // power of two
+    uint64_t head;               // producer position, published with release
+    uint64_t tail;               // consumer position, published with release
+    int orphaned;                // the owning thread exited
+    struct thread_ring *next;
+};
+
+struct usbx_capture_reader {
+    uint64_t max_records;
+    uint64_t end_us;             // 0 if there is no time limit
+    uint64_t records;
+    int header_sent;
+    unsigned char record[MAX_RECORD_SIZE];  // record being handed out
+    size_t record_length;
+    size_t record_offset;
+};
+
+static pthread_once_t capture_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;  // list membership only
+static struct thread_ring *rings = NULL;
+static int ring_count = 0;
+static size_t ring_size_setting = USBX_CAPTURE_DEFAULT_RING_SIZE;
+static unsigned int snaplen_setting = USBX_CAPTURE_DEFAULT_SNAPLEN;
+static int reader_attached = 0;
+static uint64_t records_written = 0;
+static uint64_t records_dropped = 0;
+static uint64_t records_delivered = 0;
+
+static void thread_exit(void *value) {
+    struct thread_ring *ring = value;
+    __atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static void capture_setup(void) {
+    pthread_key_create(&ring_key, thread_exit);
+}
+
+int usbx_capture_configure(size_t ring_size, unsigned int snaplen) {
+    if (ring_size == 0 || ring_size > ((size_t)1 << 30) || snaplen > 65535) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    size_t size = 4096;
+    while (size < ring_size) {
+        size <<= 1;
+    }
+    pthread_mutex_lock(&rings_lock);
+    ring_size_setting = size;
+    __atomic_store_n(&snaplen_setting, snaplen, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&rings_lock);
+    return USBX_SUCCESS;
+}
+
+void usbx_capture_enable(struct usbx_device *dev, uint16_t bus, uint8_t address) {
+    dev->capture_bus = bus;
+    dev->capture_address = address;
+    __atomic_or_fetch(&dev->taps, USBX_TAP_CAPTURE, __ATOMIC_RELEASE);
+}
+
+void usbx_capture_disable(struct usbx_device *dev) {
+    __atomic_and_fetch(&dev->taps, ~USBX_TAP_CAPTURE, __ATOMIC_RELEASE);
+}
+
+int usbx_capture_enabled(const struct usbx_device *dev) {
+    return (__atomic_load_n(&dev->taps, __ATOMIC_ACQUIRE) & USBX_TAP_CAPTURE) != 0;
+}
+
+/* The calling thread's ring, allocated on its first record */
+static struct thread_ring *thread_ring(void) {
+    pthread_once(&capture_once, capture_setup);
+    struct thread_ring *ring = pthread_getspecific(ring_key);
+    if (ring) {
+        return ring;
+    }
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+    pthread_mutex_lock(&rings_lock);
+    ring->size = ring_size_setting;
+    ring->data = malloc(ring->size);
+    if (ring->data) {
+        ring->next = rings;
+        rings = ring;
+        ring_count++;
+    }
+    pthread_mutex_unlock(&rings_lock);
+    if (!ring->data) {
+        free(ring);
+        return NULL;
+    }
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+static void ring_put(struct thread_ring *ring, uint64_t position, const void *data,
+                     size_t length) {
+    size_t at = (size_t)(position & (ring->size - 1));
+    size_t first = ring->size - at < length ? ring->size - at : length;
+    memcpy(ring->data + at, data, first);
+    memcpy(ring->data, (const unsigned char *)data + first, length - first);
+}
+
+static void ring_get(const struct thread_ring *ring, uint64_t position, void *data,
+                     size_t length) {
+    size_t at = (size_t)(position & (ring->size - 1));
+    size_t first = ring->size - at < length ? ring->size - at : length;
+    memcpy(data, ring->data + at, first);
+    memcpy((unsigned char *)data + first, ring->data, length - first);
+}
+
+static void put_u16(unsigned char *p, uint16_t value) {
+    memcpy(p, &value, sizeof(value));
+}
+
+static void put_u32(unsigned char *p, uint32_t value) {
+    memcpy(p, &value, sizeof(value));
+}
+
+static void put_u64(unsigned char *p, uint64_t value) {
+    memcpy(p, &value, sizeof(value));
+}
+
+/* usbmon status of a completed transfer: a negative errno as the kernel reports it */
+static int32_t completion_errno(int status) {
+    switch (status) {
+    case USBX_TRANSFER_COMPLETED: return 0;
+    case USBX_TRANSFER_TIMED_OUT: return -ETIMEDOUT;
+    case USBX_TRANSFER_CANCELLED: return -ENOENT;
+    case USBX_TRANSFER_STALL:     return -EPIPE;
+    case USBX_TRANSFER_NO_DEVICE: return -ENODEV;
+    case USBX_TRANSFER_OVERFLOW:  return -EOVERFLOW;
+    default:                      return -EPROTO;
+    }
+}
+
+/* usbmon status of a failed submission */
+static int32_t submit_errno(int error) {
+    switch (error) {
+    case USBX_ERROR_INVALID_PARAM: return -EINVAL;
+    case USBX_ERROR_NO_DEVICE:     return -ENODEV;
+    case USBX_ERROR_NOT_FOUND:     return -ENOENT;
+    case USBX_ERROR_BUSY:          return -EBUSY;
+    case USBX_ERROR_NO_MEM:        return -ENOMEM;
+    case USBX_ERROR_PIPE:          return -EPIPE;
+    case USBX_ERROR_NOT_SUPPORTED: return -ENOSYS;
+    default:                       return -EIO;
+    }
+}
+
+void usbx_capture_record(const struct usbx_transfer *xfer, int type, int error) {
+    // Nobody would read the record; dev->taps alone keeps the fast path to one branch
+    if (!__atomic_load_n(&reader_attached, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    struct thread_ring *ring = thread_ring();
+    if (!ring) {
+        __atomic_add_fetch(&records_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // usbmon numbers transfer types ISO, interrupt, control, bulk
+    static const unsigned char usbmon_types[4] = {2, 0, 3, 1};
+    const struct usbx_device *dev = xfer->dev;
+    const unsigned char *data = xfer->buffer;
+    size_t length = xfer->length > 0 ? (size_t)xfer->length : 0;
+    int in = (xfer->endpoint & USBX_ENDPOINT_IN) != 0;
+    const unsigned char *setup = NULL;
+    if (xfer->type == USBX_TRANSFER_TYPE_CONTROL && length >= USBX_CONTROL_SETUP_SIZE) {
+        setup = data;
+        in = (setup[0] & USBX_ENDPOINT_IN) != 0;
+        data += USBX_CONTROL_SETUP_SIZE;
+        length -= USBX_CONTROL_SETUP_SIZE;
+    }
+
+    // Submissions carry OUT data, completions IN data; iso completions the whole buffer
+    int iso = xfer->type == USBX_TRANSFER_TYPE_ISOCHRONOUS;
+    int32_t status = -EINPROGRESS;
+    size_t data_length = length;
+    if (type == USBX_TAP_COMPLETE) {
+        status = completion_errno(xfer->status);
+        if (!iso) {
+            data_length = xfer->actual_length > 0 ? (size_t)xfer->actual_length : 0;
+        }
+    } else if (type == USBX_TAP_ERROR) {
+        status = submit_errno(error);
+    }
+    int with_data = type == USBX_TAP_COMPLETE ? in : !in;
+    size_t captured = 0;
+    if (with_data && type != USBX_TAP_ERROR && data) {
+        unsigned int snaplen = __atomic_load_n(&snaplen_setting, __ATOMIC_RELAXED);
+        captured = data_length < snaplen ? data_length : snaplen;
+    }
+    int descriptors = iso ? xfer->num_iso_packets : 0;
+    if (descriptors > MAX_ISO_DESCRIPTORS) {
+        descriptors = MAX_ISO_DESCRIPTORS;
+    }
+
+    size_t headers = USBX_CAPTURE_RECORD_HEADER_SIZE + USBX_CAPTURE_USBMON_SIZE +
+                     (size_t)descriptors * USBX_CAPTURE_ISO_DESC_SIZE;
+    size_t total = SORT_KEY_SIZE + headers + captured;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (ring->head - tail + total > ring->size) {
+        __atomic_add_fetch(&records_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    unsigned char header[SORT_KEY_SIZE + USBX_CAPTURE_RECORD_HEADER_SIZE +
+                         USBX_CAPTURE_USBMON_SIZE + MAX_ISO_DESCRIPTORS *
+                         USBX_CAPTURE_ISO_DESC_SIZE];
+    memset(header, 0, SORT_KEY_SIZE + headers);
+    put_u64(header, (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec);
+
+    // pcap record header
+    unsigned char *p = header + SORT_KEY_SIZE;
+    size_t descriptor_bytes = (size_t)descriptors * USBX_CAPTURE_ISO_DESC_SIZE;
+    put_u32(p, (uint32_t)now.tv_sec);
+    put_u32(p + 4, (uint32_t)(now.tv_nsec / 1000));
+    put_u32(p + 8, (uint32_t)(USBX_CAPTURE_USBMON_SIZE + descriptor_bytes + captured));
+    put_u32(p + 12, (uint32_t)(USBX_CAPTURE_USBMON_SIZE + descriptor_bytes +
+                               (with_data ? data_length : 0)));
+
+    // usbmon header (struct usbmon_packet of the Linux mmap interface)
+    p += USBX_CAPTURE_RECORD_HEADER_SIZE;
+    put_u64(p, (uint64_t)(uintptr_t)xfer);
+    p[8] = (unsigned char)type;
+    p[9] = usbmon_types[xfer->type & 3];
+    p[10] = (unsigned char)((xfer->endpoint & 0x7f) | (in ? USBX_ENDPOINT_IN : 0));
+    p[11] = dev->capture_address;
+    put_u16(p + 12, dev->capture_bus);
+    p[14] = setup && type == USBX_TAP_SUBMIT ? 0 : '-';
+    p[15] = captured > 0 ? 0 : type == USBX_TAP_SUBMIT ? '<' :
+            type == USBX_TAP_COMPLETE ? '>' : '=';
+    put_u64(p + 16, (uint64_t)now.tv_sec);
+    put_u32(p + 24, (uint32_t)(now.tv_nsec / 1000));
+    put_u32(p + 28, (uint32_t)status);
+    put_u32(p + 32, (uint32_t)data_length);
+    put_u32(p + 36, (uint32_t)captured);
+    if (setup && type == USBX_TAP_SUBMIT) {
+        memcpy(p + 40, setup, USBX_CONTROL_SETUP_SIZE);
+    } else if (iso) {
+        int errors = 0;
+        for (int i = 0; type == USBX_TAP_COMPLETE && i < xfer->num_iso_packets; i++) {
+            errors += xfer->iso_packets[i].status != USBX_TRANSFER_COMPLETED;
+        }
+        put_u32(p + 40, (uint32_t)errors);
+        put_u32(p + 44, (uint32_t)xfer->num_iso_packets);
+    }
+    put_u32(p + 56, (xfer->flags & USBX_TRANSFER_SHORT_NOT_OK ? 0x0001 : 0) |
+                    (xfer->flags & USBX_TRANSFER_ADD_ZERO_PACKET ? 0x0040 : 0) |
+                    (in ? 0x0200 : 0));
+    put_u32(p + 60, (uint32_t)descriptors);
+
+    // Descriptors: status, offset into the buffer, length
+    p += USBX_CAPTURE_USBMON_SIZE;
+    uint32_t offset = 0;
+    for (int i = 0; i < descriptors; i++) {
+        const struct usbx_iso_packet *packet = &xfer->iso_packets[i];
+        int done = type == USBX_TAP_COMPLETE;
+        put_u32(p, (uint32_t)(done ? completion_errno(packet->status) : -EXDEV));
+        put_u32(p + 4, offset);
+        put_u32(p + 8, done ? packet->actual_length : packet->length);
+        offset += packet->length;
+        p += USBX_CAPTURE_ISO_DESC_SIZE;
+    }
+
+    uint64_t head = ring->head;
+    ring_put(ring, head, header, SORT_KEY_SIZE + headers);
+    ring_put(ring, head + SORT_KEY_SIZE + headers, data, captured);
+    __atomic_store_n(&ring->head, head + total, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&records_written, 1, __ATOMIC_RELAXED);
+}
+
+struct usbx_capture_reader *usbx_capture_reader_open(uint64_t max_records,
+                                                     unsigned int duration_ms) {
+    struct usbx_capture_reader *reader = calloc(1, sizeof(*reader));
+    if (!reader) {
+        return NULL;
+    }
+    reader->max_records = max_records;
+    reader->end_us = duration_ms > 0 ? usbx_now_us() + duration_ms * 1000ULL : 0;
+
+    pthread_mutex_lock(&rings_lock);
+    if (reader_attached) {
+        pthread_mutex_unlock(&rings_lock);
+        free(reader);
+        return NULL;
+    }
+    // Leftovers of an earlier reader are stale
+    for (struct thread_ring *ring = rings; ring; ring = ring->next) {
+        __atomic_store_n(&ring->tail, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&reader_attached, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rings_lock);
+    return reader;
+}
+
+void usbx_capture_reader_close(struct usbx_capture_reader *reader) {
+    if (!reader) {
+        return;
+    }
+    pthread_mutex_lock(&rings_lock);
+    __atomic_store_n(&reader_attached, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rings_lock);
+    free(reader);
+}
+
+/* Move the oldest available record into reader->record; returns 0 if there is none */
+static int take_record(struct usbx_capture_reader *reader) {
+    struct thread_ring *oldest = NULL;
+    uint64_t oldest_key = 0;
+
+    pthread_mutex_lock(&rings_lock);
+    struct thread_ring **link = &rings;
+    while (*link) {
+        struct thread_ring *ring = *link;
+        // Check orphaned first: a ring found empty afterwards stays empty
+        int orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head == ring->tail && orphaned) {
+            *link = ring->next;
+            ring_count--;
+            free(ring->data);
+            free(ring);
+            continue;
+        }
+        if (head != ring->tail) {
+            unsigned char key[SORT_KEY_SIZE];
+            uint64_t value;
+            ring_get(ring, ring->tail, key, sizeof(key));
+            memcpy(&value, key, sizeof(value));
+            if (!oldest || value < oldest_key) {
+                oldest = ring;
+                oldest_key = value;
+            }
+        }
+        link = &ring->next;
+    }
+
+    if (oldest) {
+        unsigned char header[USBX_CAPTURE_RECORD_HEADER_SIZE];
+        uint32_t included;
+        ring_get(oldest, oldest->tail + SORT_KEY_SIZE, header, sizeof(header));
+        memcpy(&included, header + 8, sizeof(included));
+        size_t length = USBX_CAPTURE_RECORD_HEADER_SIZE + included;
+        ring_get(oldest, oldest->tail + SORT_KEY_SIZE, reader->record, length);
+        __atomic_store_n(&oldest->tail, oldest->tail + SORT_KEY_SIZE + length,
+                         __ATOMIC_RELEASE);
+        reader->record_length = length;
+        reader->record_offset = 0;
+        reader->records++;
+        __atomic_add_fetch(&records_delivered, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&rings_lock);
+    return oldest != NULL;
+}
+
+static size_t file_header(unsigned char *buffer) {
+    put_u32(buffer, 0xa1b2c3d4);     // microsecond timestamps, host byte order
+    put_u16(buffer + 4, 2);
+    put_u16(buffer + 6, 4);
+    put_u32(buffer + 8, 0);
+    put_u32(buffer + 12, 0);
+    put_u32(buffer + 16, USBX_CAPTURE_USBMON_SIZE +
+                         MAX_ISO_DESCRIPTORS * USBX_CAPTURE_ISO_DESC_SIZE +
+                         __atomic_load_n(&snaplen_setting, __ATOMIC_RELAXED));
+    put_u32(buffer + 20, USBX_CAPTURE_LINKTYPE);
+    return USBX_CAPTURE_FILE_HEADER_SIZE;
+}
+
+long usbx_capture_read(struct usbx_capture_reader *reader, unsigned char *buffer, size_t max,
+                       int timeout_ms) {
+    uint64_t end_us = usbx_now_us() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0) * 1000ULL;
+    size_t length = 0;
+
+    if (!reader->header_sent) {
+        if (max < USBX_CAPTURE_FILE_HEADER_SIZE) {
+            return USBX_ERROR_INVALID_PARAM;
+        }
+        reader->header_sent = 1;
+        length = file_header(buffer);
+    }
+    for (;;) {
+        // Hand out the current record, then as many whole records as fit
+        if (reader->record_offset < reader->record_length) {
+            size_t rest = reader->record_length - reader->record_offset;
+            if (rest > max - length) {
+                if (length > 0) {
+                    return (long)length;
+                }
+                rest = max;
+            }
+            memcpy(buffer + length, reader->record + reader->record_offset, rest);
+            reader->record_offset += rest;
+            length += rest;
+            continue;
+        }
+        uint64_t now = usbx_now_us();
+        int finished = (reader->max_records > 0 && reader->records >= reader->max_records) ||
+                       (reader->end_us > 0 && now >= reader->end_us);
+        if (finished) {
+            return length > 0 ? (long)length : USBX_ERROR_INTERRUPTED;
+        }
+        if (take_record(reader)) {
+            continue;
+        }
+        if (length > 0 || (timeout_ms >= 0 && now >= end_us)) {
+            return (long)length;
+        }
+        usbx_sleep_us(READER_POLL_US);
+    }
+}
+
+void usbx_capture_get_stats(struct usbx_capture_stats *stats) {
+    stats->records = __atomic_load_n(&records_written, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&records_dropped, __ATOMIC_RELAXED);
+    stats->delivered = __atomic_load_n(&records_delivered, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&rings_lock);
+    stats->threads = ring_count;
+    stats->reading = reader_attached;
+    pthread_mutex_unlock(&rings_lock);
+}
@@ -0,0 +1,454 @@
+/**
+ * @file cdc.c
+ * @brief CDC-ACM serial channel with a history ring and batched readers
+ *
+ * The ring is indexed by stream offset: byte @c n lives at @c n % ring_size
+ * and bytes older than received - ring_size have been overwritten. Readers
+ * only store the offset they want next and catch up past overwritten data.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbx_budget.h"
+#include "usbx_bulk.h"
+#include "usbx_cdc.h"
+#include "usbx_sched.h"
+#include "usbx_util.h"
+
+/** @brief Submitted bulk IN transfer and its buffer */
+struct cdc_slot {
+    struct usbx_transfer xfer;
+    struct usbx_cdc *cdc;
+    unsigned char *buffer;
+};
+
+struct usbx_cdc {
+    struct usbx_device *dev;
+    struct usbx_cdc_options opts;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;      // new data, or stopped
+    pthread_mutex_t write_lock;  // keeps concurrent writes from interleaving
+    unsigned char *ring;
+    size_t reserved;             // budget held for the ring and the transfer buffers
+    uint64_t received;
+    struct cdc_slot *slots;
+    int in_flight;
+    int readers;                 // threads inside usbx_cdc_read()
+    int stopping;
+    int last_error;
+    struct usbx_cdc_stats stats;
+};
+
+void usbx_cdc_options_init(struct usbx_cdc_options *opts) {
+    opts->interface = 0;
+    opts->in_endpoint = 0x81;
+    opts->out_endpoint = 0x02;
+    opts->coding.baud = USBX_CDC_DEFAULT_BAUD;
+    opts->coding.stop_bits = 0;
+    opts->coding.parity = USBX_CDC_PARITY_NONE;
+    opts->coding.data_bits = 8;
+    opts->control_lines = USBX_CDC_CONTROL_DTR | USBX_CDC_CONTROL_RTS;
+    opts->ring_size = USBX_CDC_DEFAULT_RING_SIZE;
+    opts->transfer_size = USBX_CDC_DEFAULT_TRANSFER_SIZE;
+    opts->transfers_in_flight = USBX_CDC_DEFAULT_IN_FLIGHT;
+    opts->timeout = USBX_CDC_DEFAULT_TIMEOUT;
+}
+
+void usbx_cdc_batch_init(struct usbx_cdc_batch *batch) {
+    batch->flags = USBX_CDC_FLUSH_NEWLINE;
+    batch->batch_size = USBX_CDC_DEFAULT_BATCH_SIZE;
+    batch->batch_interval_ms = USBX_CDC_DEFAULT_BATCH_INTERVAL_MS;
+}
+
+static int valid_coding(const struct usbx_cdc_line_coding *coding) {
+    return coding->baud > 0 && coding->stop_bits >= 0 && coding->stop_bits <= 2 &&
+           coding->parity >= USBX_CDC_PARITY_NONE && coding->parity <= USBX_CDC_PARITY_SPACE &&
+           ((coding->data_bits >= 5 && coding->data_bits <= 8) || coding->data_bits == 16);
+}
+
+/* Oldest stream offset still held by the ring (lock held) */
+static uint64_t oldest_offset(const struct usbx_cdc *cdc) {
+    uint64_t size = (uint64_t)cdc->opts.ring_size;
+    return cdc->received > size ? cdc->received - size : 0;
+}
+
+/* Append received bytes, overwriting the oldest (lock held) */
+static void store_bytes(struct usbx_cdc *cdc, const unsigned char *data, size_t length) {
+    size_t size = cdc->opts.ring_size;
+    size_t at = (size_t)(cdc->received % size);
+    size_t first = size - at < length ? size - at : length;
+
+    memcpy(cdc->ring + at, data, first);
+    memcpy(cdc->ring, data + first, length - first);
+    cdc->received += length;
+    cdc->stats.transfers++;
+    pthread_cond_broadcast(&cdc->changed);
+}
+
+static void receive_complete(struct usbx_transfer *xfer) {
+    struct cdc_slot *slot = xfer->user_data;
+    struct usbx_cdc *cdc = slot->cdc;
+
+    pthread_mutex_lock(&cdc->lock);
+    cdc->in_flight--;
+    if (xfer->status == USBX_TRANSFER_COMPLETED) {
+        if (xfer->actual_length > 0) {
+            store_bytes(cdc, xfer->buffer, (size_t)xfer->actual_length);
+        }
+    } else if (xfer->status != USBX_TRANSFER_CANCELLED &&
+               xfer->status != USBX_TRANSFER_TIMED_OUT && !cdc->stopping) {
+        // Stalls and disconnects end reception; readers see the error
+        cdc->last_error = usbx_status_to_error(xfer->status);
+        cdc->stopping = 1;
+    }
+
+    if (cdc->stopping || xfer->status == USBX_TRANSFER_CANCELLED) {
+        pthread_cond_broadcast(&cdc->changed);
+        pthread_mutex_unlock(&cdc->lock);
+        return;
+    }
+    cdc->in_flight++;
+    pthread_mutex_unlock(&cdc->lock);
+
+    int result = usbx_submit_transfer(xfer);
+    if (result != USBX_SUCCESS) {
+        pthread_mutex_lock(&cdc->lock);
+        cdc->in_flight--;
+        if (!cdc->stopping) {
+            cdc->last_error = result;
+            cdc->stopping = 1;
+        }
+        pthread_cond_broadcast(&cdc->changed);
+        pthread_mutex_unlock(&cdc->lock);
+    }
+}
+
+static void free_cdc(struct usbx_cdc *cdc) {
+    if (cdc->slots) {
+        for (int i = 0; i < cdc->opts.transfers_in_flight; i++) {
+            free(cdc->slots[i].buffer);
+        }
+    }
+    free(cdc->slots);
+    free(cdc->ring);
+    usbx_budget_release(cdc->reserved);
+    pthread_mutex_destroy(&cdc->write_lock);
+    pthread_cond_destroy(&cdc->changed);
+    pthread_mutex_destroy(&cdc->lock);
+    free(cdc);
+}
+
+static int allocate_cdc(struct usbx_cdc *cdc) {
+    size_t reserved = cdc->opts.ring_size +
+                      (size_t)cdc->opts.transfers_in_flight * (size_t)cdc->opts.transfer_size;
+    if (usbx_budget_try_reserve(reserved) != USBX_SUCCESS) {
+        return USBX_ERROR_NO_MEM;
+    }
+    cdc->reserved = reserved;
+    cdc->ring = malloc(cdc->opts.ring_size);
+    cdc->slots = calloc((size_t)cdc->opts.transfers_in_flight, sizeof(struct cdc_slot));
+    if (!cdc->ring || !cdc->slots) {
+        return USBX_ERROR_NO_MEM;
+    }
+    for (int i = 0; i < cdc->opts.transfers_in_flight; i++) {
+        struct cdc_slot *slot = &cdc->slots[i];
+        slot->cdc = cdc;
+        slot->buffer = malloc((size_t)cdc->opts.transfer_size);
+        if (!slot->buffer) {
+            return USBX_ERROR_NO_MEM;
+        }
+        slot->xfer.dev = cdc->dev;
+        slot->xfer.endpoint = cdc->opts.in_endpoint;
+        slot->xfer.type = USBX_TRANSFER_TYPE_BULK;
+        slot->xfer.timeout = 0;        // a console may stay silent for hours
+        slot->xfer.buffer = slot->buffer;
+        slot->xfer.length = cdc->opts.transfer_size;
+        slot->xfer.callback = receive_complete;
+        slot->xfer.user_data = slot;
+    }
+    return USBX_SUCCESS;
+}
+
+int usbx_cdc_set_line_coding(struct usbx_cdc *cdc, const struct usbx_cdc_line_coding *coding) {
+    unsigned char data[USBX_CDC_LINE_CODING_SIZE];
+
+    if (!valid_coding(coding)) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    usbx_put_le32(data, coding->baud);
+    data[4] = (unsigned char)coding->stop_bits;
+    data[5] = (unsigned char)coding->parity;
+    data[6] = (unsigned char)coding->data_bits;
+    int result = usbx_control_transfer(cdc->dev, USBX_CDC_REQUEST_OUT, USBX_CDC_SET_LINE_CODING,
+                                       0, (uint16_t)cdc->opts.interface, data, sizeof(data),
+                                       cdc->opts.timeout);
+    if (result < 0) {
+        return result;
+    }
+    pthread_mutex_lock(&cdc->lock);
+    cdc->stats.coding = *coding;
+    pthread_mutex_unlock(&cdc->lock);
+    return USBX_SUCCESS;
+}
+
+int usbx_cdc_set_control_lines(struct usbx_cdc *cdc, int lines) {
+    lines &= USBX_CDC_CONTROL_DTR | USBX_CDC_CONTROL_RTS;
+    int result = usbx_control_transfer(cdc->dev, USBX_CDC_REQUEST_OUT,
+                                       USBX_CDC_SET_CONTROL_LINE_STATE, (uint16_t)lines,
+                                       (uint16_t)cdc->opts.interface, NULL, 0, cdc->opts.timeout);
+    if (result < 0) {
+        return result;
+    }
+    pthread_mutex_lock(&cdc->lock);
+    cdc->stats.control_lines = lines;
+    pthread_mutex_unlock(&cdc->lock);
+    return USBX_SUCCESS;
+}
+
+struct usbx_cdc *usbx_cdc_open(struct usbx_device *dev, const struct usbx_cdc_options *opts,
+                               int *error) {
+    struct usbx_cdc_options defaults;
+    int local_error;
+
+    if (!error) {
+        error = &local_error;
+    }
+    if (!opts) {
+        usbx_cdc_options_init(&defaults);
+        opts = &defaults;
+    }
+    if (!dev || !(opts->in_endpoint & USBX_ENDPOINT_IN) ||
+        (opts->out_endpoint & USBX_ENDPOINT_IN) || opts->interface < 0 ||
+        opts->interface > 0xff || opts->transfer_size <= 0 ||
+        (size_t)opts->transfer_size > opts->ring_size || opts->transfers_in_flight < 1 ||
+        opts->transfers_in_flight > USBX_CDC_MAX_IN_FLIGHT || !valid_coding(&opts->coding)) {
+        *error = USBX_ERROR_INVALID_PARAM;
+        return NULL;
+    }
+
+    struct usbx_cdc *cdc = calloc(1, sizeof(*cdc));
+    if (!cdc) {
+        *error = USBX_ERROR_NO_MEM;
+        return NULL;
+    }
+    cdc->dev = dev;
+    cdc->opts = *opts;
+    pthread_mutex_init(&cdc->lock, NULL);
+    pthread_mutex_init(&cdc->write_lock, NULL);
+    usbx_cond_init_monotonic(&cdc->changed);
+    *error = allocate_cdc(cdc);
+    if (*error == USBX_SUCCESS) {
+        *error = usbx_cdc_set_line_coding(cdc, &opts->coding);
+    }
+    if (*error == USBX_SUCCESS) {
+        *error = usbx_cdc_set_control_lines(cdc, opts->control_lines);
+    }
+    if (*error != USBX_SUCCESS) {
+        free_cdc(cdc);
+        return NULL;
+    }
+
+    // Reads wait for console output with no timeout and must not take scheduler slots
+    const char *client = usbx_sched_client();
+    usbx_sched_set_client(NULL);
+    int result = USBX_SUCCESS;
+    pthread_mutex_lock(&cdc->lock);
+    for (int i = 0; i < cdc->opts.transfers_in_flight; i++) {
+        cdc->in_flight++;
+        pthread_mutex_unlock(&cdc->lock);
+        result = usbx_submit_transfer(&cdc->slots[i].xfer);
+        pthread_mutex_lock(&cdc->lock);
+        if (result != USBX_SUCCESS) {
+            cdc->in_flight--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cdc->lock);
+    usbx_sched_set_client(client);
+
+    *error = result;
+    if (result != USBX_SUCCESS) {
+        usbx_cdc_close(cdc);
+        return NULL;
+    }
+    return cdc;
+}
+
+void usbx_cdc_stop(struct usbx_cdc *cdc) {
+    pthread_mutex_lock(&cdc->lock);
+    if (!cdc->stopping) {
+        cdc->last_error = USBX_ERROR_INTERRUPTED;
+        cdc->stopping = 1;
+    }
+    pthread_cond_broadcast(&cdc->changed);
+    pthread_mutex_unlock(&cdc->lock);
+
+    for (int i = 0; i < cdc->opts.transfers_in_flight; i++) {
+        usbx_cancel_transfer(&cdc->slots[i].xfer);
+    }
+
+    pthread_mutex_lock(&cdc->lock);
+    while (cdc->in_flight > 0) {
+        pthread_cond_wait(&cdc->changed, &cdc->lock);
+    }
+    pthread_mutex_unlock(&cdc->lock);
+}
+
+void usbx_cdc_close(struct usbx_cdc *cdc) {
+    if (!cdc) {
+        return;
+    }
+    usbx_cdc_stop(cdc);
+
+    pthread_mutex_lock(&cdc->lock);
+    while (cdc->readers > 0) {
+        pthread_cond_wait(&cdc->changed, &cdc->lock);
+    }
+    pthread_mutex_unlock(&cdc->lock);
+    free_cdc(cdc);
+}
+
+int usbx_cdc_write(struct usbx_cdc *cdc, const unsigned char *data, size_t length,
+                   size_t *transferred) {
+    struct usbx_segment_options opts;
+    struct usbx_segment_result segment;
+
+    // A write that fills its last packet needs a zero-length packet to be seen
+    usbx_segment_options_init(&opts);
+    opts.timeout = cdc->opts.timeout;
+    opts.flags = USBX_SEGMENT_ZERO_PACKET;
+    pthread_mutex_lock(&cdc->write_lock);
+    // OUT buffers are only read
+    int result = usbx_bulk_transfer_segmented(cdc->dev, cdc->opts.out_endpoint,
+                                              (unsigned char *)data, length, &opts, &segment);
+    pthread_mutex_unlock(&cdc->write_lock);
+
+    pthread_mutex_lock(&cdc->lock);
+    cdc->stats.sent += segment.transferred;
+    pthread_mutex_unlock(&cdc->lock);
+    if (transferred) {
+        *transferred = segment.transferred;
+    }
+    return result;
+}
+
+void usbx_cdc_reader_init(struct usbx_cdc *cdc, struct usbx_cdc_reader *reader,
+                          const struct usbx_cdc_batch *batch, size_t backlog) {
+    memset(reader, 0, sizeof(*reader));
+    if (batch) {
+        reader->batch = *batch;
+    } else {
+        usbx_cdc_batch_init(&reader->batch);
+    }
+    pthread_mutex_lock(&cdc->lock);
+    uint64_t oldest = oldest_offset(cdc);
+    reader->cursor = cdc->received - oldest > backlog ? cdc->received - backlog : oldest;
+    pthread_mutex_unlock(&cdc->lock);
+}
+
+/* Bytes to release now, or 0 while the batch is still filling (lock held) */
+static size_t batch_length(const struct usbx_cdc *cdc, const struct usbx_cdc_reader *reader,
+                           size_t available, size_t max, uint64_t now_us) {
+    size_t take = available < max ? available : max;
+
+    if (cdc->stopping || take == max || available >= reader->batch.batch_size ||
+        now_us - reader->waiting_since_us >= reader->batch.batch_interval_ms * 1000ULL) {
+        return take;
+    }
+    if (reader->batch.flags & USBX_CDC_FLUSH_NEWLINE) {
+        size_t size = cdc->opts.ring_size;
+        for (size_t i = take; i > 0; i--) {
+            if (cdc->ring[(size_t)((reader->cursor + i - 1) % size)] == '\n') {
+                return i;
+            }
+        }
+    }
+    return 0;
+}
+
+long usbx_cdc_read(struct usbx_cdc *cdc, struct usbx_cdc_reader *reader, unsigned char *buffer,
+                   size_t max, int timeout_ms) {
+    uint64_t end_us = usbx_now_us() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0) * 1000ULL;
+    long result = 0;
+
+    pthread_mutex_lock(&cdc->lock);
+    cdc->readers++;
+    for (;;) {
+        uint64_t oldest = oldest_offset(cdc);
+        if (reader->cursor < oldest) {
+            reader->dropped += oldest - reader->cursor;
+            reader->cursor = oldest;
+        }
+
+        uint64_t now = usbx_now_us();
+        size_t available = (size_t)(cdc->received - reader->cursor);
+        if (available > 0 && max > 0) {
+            if (reader->waiting_since_us == 0) {
+                reader->waiting_since_us = now;
+            }
+            size_t take = batch_length(cdc, reader, available, max, now);
+            if (take > 0) {
+                size_t size = cdc->opts.ring_size;
+                size_t at = (size_t)(reader->cursor % size);
+                size_t first = size - at < take ? size - at : take;
+                memcpy(buffer, cdc->ring + at, first);
+                memcpy(buffer + first, cdc->ring, take - first);
+                reader->cursor += take;
+                // A partial line left behind gets a full interval to complete
+                reader->waiting_since_us = take == available ? 0 : now;
+                result = (long)take;
+                break;
+            }
+        } else if (cdc->stopping) {
+            result = cdc->last_error;
+            break;
+        }
+
+        // Sleep until new data, the end of the batch interval or the caller's timeout
+        int wait_ms = -1;
+        if (timeout_ms >= 0) {
+            if (now >= end_us) {
+                break;
+            }
+            wait_ms = (int)((end_us - now + 999) / 1000);
+        }
+        if (available > 0) {
+            uint64_t release_us = reader->waiting_since_us +
+                                  reader->batch.batch_interval_ms * 1000ULL;
+            int batch_ms = release_us > now ? (int)((release_us - now + 999) / 1000) : 0;
+            if (wait_ms < 0 || batch_ms < wait_ms) {
+                wait_ms = batch_ms;
+            }
+        }
+        if (wait_ms < 0) {
+            pthread_cond_wait(&cdc->changed, &cdc->lock);
+        } else if (wait_ms > 0) {
+            struct timespec deadline;
+            usbx_deadline_ms(&deadline, wait_ms);
+            pthread_cond_timedwait(&cdc->changed, &cdc->lock, &deadline);
+        }
+    }
+    cdc->readers--;
+    if (cdc->readers == 0 && cdc->stopping) {
+        pthread_cond_broadcast(&cdc->changed);  // usbx_cdc_close() may wait
+    }
+    pthread_mutex_unlock(&cdc->lock);
+    return result;
+}
+
+void usbx_cdc_get_stats(struct usbx_cdc *cdc, struct usbx_cdc_stats *stats) {
+    pthread_mutex_lock(&cdc->lock);
+    *stats = cdc->stats;
+    stats->received = cdc->received;
+    stats->oldest = oldest_offset(cdc);
+    stats->running = !cdc->stopping;
+    stats->last_error = cdc->last_error;
+    pthread_mutex_unlock(&cdc->lock);
+}
@@ -0,0 +1,131 @@
+/**
+ * @file codec.c
+ * @brief Binary-to-text codecs used in JSON request and response bodies
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include "usbx_codec.h"
+
+static const char base64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const char hex_digits[] = "0123456789abcdef";
+
+size_t usbx_base64_encoded_size(size_t length) {
+    return (length + 2) / 3 * 4;
+}
+
+size_t usbx_base64_encode(const unsigned char *data, size_t length, char *out) {
+    char *p = out;
+    size_t i = 0;
+
+    for (; i + 2 < length; i += 3) {
+        unsigned long v = ((unsigned long)data[i] << 16) | ((unsigned long)data[i + 1] << 8) |
+                          data[i + 2];
+        *p++ = base64_alphabet[(v >> 18) & 0x3f];
+        *p++ = base64_alphabet[(v >> 12) & 0x3f];
+        *p++ = base64_alphabet[(v >> 6) & 0x3f];
+        *p++ = base64_alphabet[v & 0x3f];
+    }
+    if (i < length) {
+        unsigned long v = (unsigned long)data[i] << 16;
+        if (i + 1 < length) {
+            v |= (unsigned long)data[i + 1] << 8;
+        }
+        *p++ = base64_alphabet[(v >> 18) & 0x3f];
+        *p++ = base64_alphabet[(v >> 12) & 0x3f];
+        *p++ = i + 1 < length ? base64_alphabet[(v >> 6) & 0x3f] : '=';
+        *p++ = '=';
+    }
+    *p = '\0';
+    return (size_t)(p - out);
+}
+
+static int base64_value(char c) {
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+    if (c == '+') {
+        return 62;
+    }
+    if (c == '/') {
+        return 63;
+    }
+    return -1;
+}
+
+long usbx_base64_decode(const char *text, size_t length, unsigned char *out) {
+    unsigned long accumulator = 0;
+    int bits = 0;
+    int padding = 0;
+    long written = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        char c = text[i];
+        if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+            continue;
+        }
+        if (c == '=') {
+            padding++;
+            continue;
+        }
+        int value = base64_value(c);
+        if (value < 0 || padding > 0) {
+            return -1;          // bad character, or data after padding
+        }
+        accumulator = (accumulator << 6) | (unsigned long)value;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[written++] = (unsigned char)(accumulator >> bits);
+        }
+    }
+    // Leftover bits must be the zero fill of a partial group
+    if (padding > 2 || bits >= 6 || (accumulator & ((1UL << bits) - 1)) != 0) {
+        return -1;
+    }
+    return written;
+}
+
+void usbx_hex_encode(const unsigned char *data, size_t length, char *out) {
+    for (size_t i = 0; i < length; i++) {
+        out[2 * i] = hex_digits[data[i] >> 4];
+        out[2 * i + 1] = hex_digits[data[i] & 0x0f];
+    }
+    out[2 * length] = '\0';
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+long usbx_hex_decode(const char *text, size_t length, unsigned char *out) {
+    if (length % 2 != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < length; i += 2) {
+        int high = hex_value(text[i]);
+        int low = hex_value(text[i + 1]);
+        if (high < 0 || low < 0) {
+            return -1;
+        }
+        out[i / 2] = (unsigned char)((high << 4) | low);
+    }
+    return (long)(length / 2);
+}
@@ -0,0 +1,442 @@
+/**
+ * @file compress.c
+ * @brief Streaming gzip/zstd codecs and compressed streaming responses
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "usbx_backend.h"
+#include "usbx_compress.h"
+#include "usbx_config.h"
+
+/** @brief Inner reader block fed to the compressor */
+#define ENCODE_BLOCK 16384
+
+/** @brief gzip framing for deflateInit2/inflateInit2 */
+#define GZIP_WINDOW_BITS (15 + 16)
+
+struct usbx_zstream {
+    int encoding;
+    int compress;
+    int ended;               /* decompress: the last member or frame is complete */
+#ifdef USE_ZLIB
+    z_stream zlib;
+#endif
+#ifdef USE_ZSTD
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+#endif
+};
+
+static int encoding_available(int encoding) {
+    switch (encoding) {
+    case USBX_ENCODING_IDENTITY:
+        return 1;
+#ifdef USE_ZLIB
+    case USBX_ENCODING_GZIP:
+        return 1;
+#endif
+#ifdef USE_ZSTD
+    case USBX_ENCODING_ZSTD:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+/* Coding for a token (without parameters), or -1 */
+static int encoding_from_token(const char *token, size_t length) {
+    static const struct {
+        const char *name;
+        int encoding;
+    } names[] = {
+        {"identity", USBX_ENCODING_IDENTITY},
+        {"gzip", USBX_ENCODING_GZIP},
+        {"x-gzip", USBX_ENCODING_GZIP},
+        {"zstd", USBX_ENCODING_ZSTD},
+    };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i].name) == length && strncasecmp(names[i].name, token, length) == 0) {
+            return names[i].encoding;
+        }
+    }
+    return -1;
+}
+
+int usbx_encoding_parse(const char *name) {
+    if (!name) {
+        return USBX_ENCODING_IDENTITY;
+    }
+    while (isspace((unsigned char)*name)) {
+        name++;
+    }
+    size_t length = strlen(name);
+    while (length > 0 && isspace((unsigned char)name[length - 1])) {
+        length--;
+    }
+    if (length == 0) {
+        return USBX_ENCODING_IDENTITY;
+    }
+    int encoding = encoding_from_token(name, length);
+    return encoding >= 0 && encoding_available(encoding) ? encoding : USBX_ERROR_NOT_SUPPORTED;
+}
+
+const char *usbx_encoding_name(int encoding) {
+    switch (encoding) {
+    case USBX_ENCODING_GZIP:
+        return "gzip";
+    case USBX_ENCODING_ZSTD:
+        return "zstd";
+    default:
+        return "identity";
+    }
+}
+
+/* Quality of one Accept-Encoding element in thousandths ("q=0.5" -> 500) */
+static int element_quality(const char *params, const char *end) {
+    const char *q = params;
+
+    while (q < end && (q = strchr(q, ';')) != NULL && q < end) {
+        q++;
+        while (q < end && isspace((unsigned char)*q)) {
+            q++;
+        }
+        if (end - q >= 2 && (q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+            double value = strtod(q + 2, NULL);
+            return value <= 0 ? 0 : value >= 1 ? 1000 : (int)(value * 1000 + 0.5);
+        }
+    }
+    return 1000;
+}
+
+int usbx_encoding_negotiate(const char *accept) {
+    int quality[USBX_ENCODING_ZSTD + 1] = {-1, -1, -1};
+    int wildcard = -1;
+
+    for (const char *p = accept; p && *p;) {
+        const char *end = strchr(p, ',');
+        if (!end) {
+            end = p + strlen(p);
+        }
+        while (p < end && isspace((unsigned char)*p)) {
+            p++;
+        }
+        const char *token_end = p;
+        while (token_end < end && *token_end != ';' && !isspace((unsigned char)*token_end)) {
+            token_end++;
+        }
+
+        int q = element_quality(token_end, end);
+        int encoding = encoding_from_token(p, (size_t)(token_end - p));
+        if (encoding >= 0) {
+            quality[encoding] = q;
+        } else if (token_end - p == 1 && *p == '*') {
+            wildcard = q;
+        }
+        p = *end ? end + 1 : end;
+    }
+
+    // Named codings override the wildcard; zstd wins ties because it is tried last
+    int best = USBX_ENCODING_IDENTITY;
+    int best_quality = 0;
+    for (int encoding = USBX_ENCODING_GZIP; encoding <= USBX_ENCODING_ZSTD; encoding++) {
+        int q = quality[encoding] >= 0 ? quality[encoding] : wildcard;
+        if (encoding_available(encoding) && q > 0 && q >= best_quality) {
+            best = encoding;
+            best_quality = q;
+        }
+    }
+    return best;
+}
+
+struct usbx_zstream *usbx_zstream_create(int encoding, int compress, int level) {
+    if (encoding == USBX_ENCODING_IDENTITY || !encoding_available(encoding)) {
+        return NULL;
+    }
+    struct usbx_zstream *z = calloc(1, sizeof(*z));
+    if (!z) {
+        return NULL;
+    }
+    z->encoding = encoding;
+    z->compress = compress;
+    (void)level;
+
+#ifdef USE_ZLIB
+    if (encoding == USBX_ENCODING_GZIP) {
+        int result = compress
+                         ? deflateInit2(&z->zlib, level, Z_DEFLATED, GZIP_WINDOW_BITS, 8,
+                                        Z_DEFAULT_STRATEGY)
+                         : inflateInit2(&z->zlib, GZIP_WINDOW_BITS);
+        if (result != Z_OK) {
+            free(z);
+            return NULL;
+        }
+    }
+#endif
+#ifdef USE_ZSTD
+    if (encoding == USBX_ENCODING_ZSTD) {
+        if (compress) {
+            z->cctx = ZSTD_createCCtx();
+            if (!z->cctx ||
+                ZSTD_isError(ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_compressionLevel, level))) {
+                ZSTD_freeCCtx(z->cctx);
+                free(z);
+                return NULL;
+            }
+        } else if (!(z->dctx = ZSTD_createDCtx())) {
+            free(z);
+            return NULL;
+        }
+    }
+#endif
+    return z;
+}
+
+void usbx_zstream_destroy(struct usbx_zstream *z) {
+    if (!z) {
+        return;
+    }
+#ifdef USE_ZLIB
+    if (z->encoding == USBX_ENCODING_GZIP) {
+        if (z->compress) {
+            deflateEnd(&z->zlib);
+        } else {
+            inflateEnd(&z->zlib);
+        }
+    }
+#endif
+#ifdef USE_ZSTD
+    ZSTD_freeCCtx(z->cctx);
+    ZSTD_freeDCtx(z->dctx);
+#endif
+    free(z);
+}
+
+#ifdef USE_ZLIB
+static int process_zlib(struct usbx_zstream *z, const unsigned char **in, size_t *in_left,
+                        unsigned char **out, size_t *out_left, int mode) {
+    // zlib counts in uInt; larger buffers are simply processed in several calls
+    uInt in_size = *in_left > 0x40000000 ? 0x40000000 : (uInt)*in_left;
+    uInt out_size = *out_left > 0x40000000 ? 0x40000000 : (uInt)*out_left;
+    int result;
+
+    z->zlib.next_in = (Bytef *)*in;     // zlib does not modify the input
+    z->zlib.avail_in = in_size;
+    z->zlib.next_out = *out;
+    z->zlib.avail_out = out_size;
+    if (z->compress) {
+        int flush = mode == USBX_ZSTREAM_FINISH ? Z_FINISH
+                    : mode == USBX_ZSTREAM_FLUSH ? Z_SYNC_FLUSH
+                                                 : Z_NO_FLUSH;
+        result = deflate(&z->zlib, flush);
+    } else {
+        result = inflate(&z->zlib, Z_NO_FLUSH);
+    }
+    *in += in_size - z->zlib.avail_in;
+    *in_left -= in_size - z->zlib.avail_in;
+    *out += out_size - z->zlib.avail_out;
+    *out_left -= out_size - z->zlib.avail_out;
+
+    if (result == Z_STREAM_END) {
+        z->ended = !z->compress;
+        return 1;
+    }
+    if (result == Z_DATA_ERROR || result == Z_NEED_DICT) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    if (result == Z_MEM_ERROR) {
+        return USBX_ERROR_NO_MEM;
+    }
+    if (result != Z_OK && result != Z_BUF_ERROR) {
+        return USBX_ERROR_OTHER;
+    }
+    // A sync flush is complete once deflate stops filling the output
+    return z->compress && mode == USBX_ZSTREAM_FLUSH && z->zlib.avail_out > 0 ? 1 : 0;
+}
+#endif
+
+#ifdef USE_ZSTD
+static int process_zstd(struct usbx_zstream *z, const unsigned char **in, size_t *in_left,
+                        unsigned char **out, size_t *out_left, int mode) {
+    ZSTD_inBuffer input = {*in, *in_left, 0};
+    ZSTD_outBuffer output = {*out, *out_left, 0};
+    size_t result;
+
+    if (z->compress) {
+        ZSTD_EndDirective directive = mode == USBX_ZSTREAM_FINISH ? ZSTD_e_end
+                                      : mode == USBX_ZSTREAM_FLUSH ? ZSTD_e_flush
+                                                                   : ZSTD_e_continue;
+        result = ZSTD_compressStream2(z->cctx, &output, &input, directive);
+    } else {
+        result = ZSTD_decompressStream(z->dctx, &output, &input);
+    }
+    *in += input.pos;
+    *in_left -= input.pos;
+    *out += output.pos;
+    *out_left -= output.pos;
+
+    if (ZSTD_isError(result)) {
+        return z->compress ? USBX_ERROR_OTHER : USBX_ERROR_INVALID_PARAM;
+    }
+    if (z->compress) {
+        return mode != USBX_ZSTREAM_RUN && result == 0 ? 1 : 0;
+    }
+    // 0 means a frame ended and was completely flushed
+    z->ended = result == 0;
+    return z->ended;
+}
+#endif
+
+int usbx_zstream_process(struct usbx_zstream *z, const unsigned char **in, size_t *in_left,
+                         unsigned char **out, size_t *out_left, int mode) {
+    // Input after the end of a gzip member or zstd frame starts the next one
+    if (!z->compress && z->ended && *in_left > 0) {
+#ifdef USE_ZLIB
+        if (z->encoding == USBX_ENCODING_GZIP && inflateReset(&z->zlib) != Z_OK) {
+            return USBX_ERROR_OTHER;
+        }
+#endif
+        z->ended = 0;
+    }
+#ifdef USE_ZLIB
+    if (z->encoding == USBX_ENCODING_GZIP) {
+        return process_zlib(z, in, in_left, out, out_left, mode);
+    }
+#endif
+#ifdef USE_ZSTD
+    if (z->encoding == USBX_ENCODING_ZSTD) {
+        return process_zstd(z, in, in_left, out, out_left, mode);
+    }
+#endif
+    (void)in;
+    (void)in_left;
+    (void)out;
+    (void)out_left;
+    (void)mode;
+    return USBX_ERROR_NOT_SUPPORTED;
+}
+
+/** @brief Compressing wrapper around a streaming reader */
+struct encoded_reader {
+    usbx_http_reader reader;
+    void *cls;
+    usbx_http_reader_free reader_free;
+    struct usbx_zstream *z;
+    uint64_t inner_pos;              /* bytes produced by the inner reader */
+    unsigned char input[ENCODE_BLOCK];
+    size_t input_start;
+    size_t input_end;
+    int mode;                        /* enum usbx_zstream_mode in progress */
+    int unflushed;                   /* input consumed since the last flush */
+    int done;
+};
+
+static ssize_t encoded_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    struct encoded_reader *er = cls;
+    (void)pos;
+
+    for (;;) {
+        if (er->input_start < er->input_end || er->mode != USBX_ZSTREAM_RUN) {
+            const unsigned char *in = er->input + er->input_start;
+            size_t in_left = er->input_end - er->input_start;
+            unsigned char *out = (unsigned char *)buf;
+            size_t out_left = max;
+
+            int result = usbx_zstream_process(er->z, &in, &in_left, &out, &out_left, er->mode);
+            if (result < 0) {
+                return USBX_HTTP_STREAM_ERROR;
+            }
+            er->input_start = er->input_end - in_left;
+            if (result == 1) {
+                er->done = er->mode == USBX_ZSTREAM_FINISH;
+                er->mode = USBX_ZSTREAM_RUN;
+            }
+            if (out_left < max) {
+                return (ssize_t)(max - out_left);
+            }
+            if (er->input_start < er->input_end || er->mode != USBX_ZSTREAM_RUN) {
+                continue;
+            }
+        }
+        if (er->done) {
+            return USBX_HTTP_END_OF_STREAM;
+        }
+
+        ssize_t n = er->reader(er->cls, er->inner_pos, (char *)er->input, sizeof(er->input));
+        if (n > 0) {
+            er->inner_pos += (uint64_t)n;
+            er->input_start = 0;
+            er->input_end = (size_t)n;
+            er->unflushed = 1;
+        } else if (n == 0) {
+            // Nothing new: push out what the client has not seen yet
+            if (!er->unflushed) {
+                return 0;
+            }
+            er->mode = USBX_ZSTREAM_FLUSH;
+            er->unflushed = 0;
+        } else if (n == USBX_HTTP_END_OF_STREAM) {
+            er->mode = USBX_ZSTREAM_FINISH;
+        } else {
+            return n;
+        }
+    }
+}
+
+static void encoded_free(void *cls) {
+    struct encoded_reader *er = cls;
+
+    if (er->reader_free) {
+        er->reader_free(er->cls);
+    }
+    usbx_zstream_destroy(er->z);
+    free(er);
+}
+
+int usbx_compress_response(const struct usbx_http_request *req,
+                           struct usbx_http_response *resp) {
+    if (!resp->reader || resp->status >= 300) {
+        return USBX_ENCODING_IDENTITY;
+    }
+    int encoding = usbx_encoding_negotiate(usbx_http_header(req, "Accept-Encoding"));
+    if (encoding == USBX_ENCODING_IDENTITY) {
+        return encoding;
+    }
+
+    struct encoded_reader *er = calloc(1, sizeof(*er));
+    if (!er) {
+        return USBX_ENCODING_IDENTITY;
+    }
+    er->z = usbx_zstream_create(encoding, 1, usbx_config_current()->compression_level);
+    if (!er->z || usbx_http_add_header(resp, "Content-Encoding",
+                                       usbx_encoding_name(encoding)) < 0) {
+        usbx_zstream_destroy(er->z);
+        free(er);
+        return USBX_ENCODING_IDENTITY;
+    }
+    usbx_http_add_header(resp, "Vary", "Accept-Encoding");
+
+    er->reader = resp->reader;
+    er->cls = resp->reader_cls;
+    er->reader_free = resp->reader_free;
+    resp->reader = encoded_read;
+    resp->reader_cls = er;
+    resp->reader_free = encoded_free;
+    return encoding;
+}
@@ -0,0 +1,466 @@
+/**
+ * @file config.c
+ * @brief Tuning settings that can change while the service runs (see usbx_config.h)
+ *
+ * Writers serialize on a mutex, build a candidate snapshot, apply it to
+ * the subsystems that keep their own copy and publish it with a release
+ * store; readers only load the pointer. Published snapshots are kept on a
+ * list, and each change frees those retired more than a grace period ago.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_backend.h"
+#include "usbx_budget.h"
+#include "usbx_buf.h"
+#include "usbx_bulk.h"
+#include "usbx_compress.h"
+#include "usbx_config.h"
+#include "usbx_discovery.h"
+#include "usbx_interrupt.h"
+#include "usbx_sched.h"
+#include "usbx_util.h"
+
+#define MB (1024ULL * 1024)
+
+/** @brief Longest configurable duration in milliseconds */
+#define MAX_MS 600000
+
+/** @brief Largest config file read */
+#define MAX_FILE_SIZE (1024 * 1024)
+
+#define FIELD(member) offsetof(struct usbx_config, member)
+
+enum knob_type { KNOB_SIZE, KNOB_INT, KNOB_UINT, KNOB_U64, KNOB_TEXT };
+
+/** @brief One setting: where it lives in the snapshot and its range */
+struct knob {
+    struct usbx_config_key key;
+    enum knob_type type;
+    size_t offset;
+    uint64_t min;
+    uint64_t max;
+    uint64_t scale;          /**< Stored value per unit of the key, e.g. MB for _mb */
+};
+
+static const struct knob knobs[] = {
+    {{"segment_size", 1, 0}, KNOB_SIZE, FIELD(segment_size), 1, 1ULL << 30, 1},
+    {{"segment_in_flight", 1, 0}, KNOB_INT, FIELD(segment_in_flight), 1,
+     USBX_SEGMENT_MAX_IN_FLIGHT, 1},
+    {{"segment_timeout_ms", 1, 0}, KNOB_UINT, FIELD(segment_timeout_ms), 0, MAX_MS, 1},
+    {{"compression_level", 1, 0}, KNOB_INT, FIELD(compression_level), 1, 9, 1},
+    {{"quota_requests_per_sec", 1, 0}, KNOB_U64, FIELD(quota.requests_per_sec), 0, UINT64_MAX, 1},
+    {{"quota_request_burst", 1, 0}, KNOB_U64, FIELD(quota.request_burst), 0, UINT64_MAX, 1},
+    {{"quota_bytes_per_sec", 1, 0}, KNOB_U64, FIELD(quota.bytes_per_sec), 0, UINT64_MAX, 1},
+    {{"quota_byte_burst", 1, 0}, KNOB_U64, FIELD(quota.byte_burst), 0, UINT64_MAX, 1},
+    {{"memory_budget_mb", 1, 0}, KNOB_U64, FIELD(memory_budget), 0, UINT64_MAX / MB, MB},
+    {{"memory_budget_wait_ms", 1, 0}, KNOB_UINT, FIELD(memory_budget_wait_ms), 0,
+     USBX_BUDGET_MAX_WAIT_MS, 1},
+    {{"discovery_timeout_ms", 1, 0}, KNOB_UINT, FIELD(discovery_timeout_ms), 0, MAX_MS, 1},
+    {{"drain_timeout_ms", 1, 0}, KNOB_UINT, FIELD(drain_timeout_ms), 0, MAX_MS, 1},
+    {{"sched_max_in_flight", 1, 0}, KNOB_UINT, FIELD(sched_max_in_flight), 1,
+     USBX_SCHED_MAX_IN_FLIGHT, 1},
+    {{"sched_quantum", 1, 0}, KNOB_UINT, FIELD(sched_quantum), 1, USBX_SCHED_MAX_QUANTUM, 1},
+    {{"interrupt_slots", 1, 0}, KNOB_INT, FIELD(interrupt_slots), 1, 1 << 20, 1},
+    {{"port", 0, 0}, KNOB_UINT, FIELD(port), 1, 65535, 1},
+    {{"discovery_workers", 0, 0}, KNOB_UINT, FIELD(discovery_workers), 1,
+     USBX_DISCOVERY_MAX_WORKERS, 1},
+    {{"blob_dir", 0, 1}, KNOB_TEXT, FIELD(blob_dir), 1, USBX_CONFIG_PATH_MAX - 1, 1},
+    {{"blob_capacity_mb", 0, 0}, KNOB_U64, FIELD(blob_capacity), 0, UINT64_MAX / MB, MB},
+};
+
+#define NUM_KNOBS ((int)(sizeof(knobs) / sizeof(knobs[0])))
+
+#define BUILTIN_CONFIG {                                        \
+    .segment_size = USBX_SEGMENT_DEFAULT_SIZE,                  \
+    .segment_in_flight = USBX_SEGMENT_DEFAULT_IN_FLIGHT,        \
+    .segment_timeout_ms = USBX_SEGMENT_DEFAULT_TIMEOUT,         \
+    .compression_level = USBX_COMPRESS_DEFAULT_LEVEL,           \
+    .memory_budget_wait_ms = USBX_BUDGET_DEFAULT_WAIT_MS,       \
+    .discovery_timeout_ms = USBX_DEFAULT_DISCOVERY_TIMEOUT_MS,  \
+    .drain_timeout_ms = USBX_DEFAULT_DRAIN_TIMEOUT_MS,          \
+    .sched_max_in_flight = USBX_SCHED_DEFAULT_MAX_IN_FLIGHT,    \
+    .sched_quantum = USBX_SCHED_DEFAULT_QUANTUM,                \
+    .interrupt_slots = USBX_INTERRUPT_DEFAULT_SLOTS,            \
+    .port = USBX_DEFAULT_PORT,                                  \
+    .discovery_workers = USBX_DISCOVERY_DEFAULT_WORKERS,        \
+    .blob_dir = USBX_DEFAULT_BLOB_DIR,                          \
+}
+
+/** @brief A published snapshot */
+struct snapshot {
+    struct snapshot *next;
+    uint64_t retired_us;     /**< When a newer snapshot replaced it, 0 while current */
+    struct usbx_config config;
+};
+
+static const struct usbx_config builtin = BUILTIN_CONFIG;
+
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+static const struct usbx_config *current = &builtin;
+static struct snapshot *snapshots = NULL;       // newest first
+static struct usbx_config base = BUILTIN_CONFIG;
+static char config_path[USBX_CONFIG_PATH_MAX];
+static uint64_t applied = 0, rejected = 0, retained = 0;
+
+static void set_error(char *error, size_t error_size, const char *format, ...) {
+    if (!error || error_size == 0) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    vsnprintf(error, error_size, format, args);
+    va_end(args);
+}
+
+static const struct knob *find_knob(const char *name) {
+    for (int i = 0; i < NUM_KNOBS; i++) {
+        if (strcmp(knobs[i].key.name, name) == 0) {
+            return &knobs[i];
+        }
+    }
+    return NULL;
+}
+
+static void format_knob(const struct knob *knob, const struct usbx_config *config, char *value,
+                        size_t size) {
+    const char *field = (const char *)config + knob->offset;
+    unsigned long long number = 0;
+
+    switch (knob->type) {
+    case KNOB_SIZE:
+        number = *(const size_t *)field;
+        break;
+    case KNOB_INT:
+        number = (unsigned long long)*(const int *)field;
+        break;
+    case KNOB_UINT:
+        number = *(const unsigned int *)field;
+        break;
+    case KNOB_U64:
+        number = *(const uint64_t *)field;
+        break;
+    case KNOB_TEXT:
+        snprintf(value, size, "%s", field);
+        return;
+    }
+    snprintf(value, size, "%llu", number / knob->scale);
+}
+
+void usbx_config_defaults(struct usbx_config *config) {
+    *config = builtin;
+}
+
+int usbx_config_num_keys(void) {
+    return NUM_KNOBS;
+}
+
+const struct usbx_config_key *usbx_config_key(int index) {
+    return index >= 0 && index < NUM_KNOBS ? &knobs[index].key : NULL;
+}
+
+int usbx_config_set(struct usbx_config *config, const char *name, const char *value) {
+    const struct knob *knob = find_knob(name);
+    char *field = (char *)config + (knob ? knob->offset : 0);
+    char *end;
+
+    if (!knob) {
+        return USBX_ERROR_NOT_FOUND;
+    }
+    if (knob->type == KNOB_TEXT) {
+        size_t length = strlen(value);
+        if (length < knob->min || length > knob->max) {
+            return USBX_ERROR_INVALID_PARAM;
+        }
+        memcpy(field, value, length + 1);
+        return USBX_SUCCESS;
+    }
+    if (*value < '0' || *value > '9') {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    errno = 0;
+    unsigned long long number = strtoull(value, &end, 10);
+    if (*end != '\0' || errno == ERANGE || number < knob->min || number > knob->max) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    uint64_t stored = (uint64_t)number * knob->scale;
+    switch (knob->type) {
+    case KNOB_SIZE:
+        *(size_t *)field = (size_t)stored;
+        break;
+    case KNOB_INT:
+        *(int *)field = (int)stored;
+        break;
+    case KNOB_UINT:
+        *(unsigned int *)field = (unsigned int)stored;
+        break;
+    case KNOB_U64:
+        *(uint64_t *)field = stored;
+        break;
+    case KNOB_TEXT:
+        break;
+    }
+    return USBX_SUCCESS;
+}
+
+int usbx_config_format(const struct usbx_config *config, const char *name, char *value,
+                       size_t size) {
+    const struct knob *knob = find_knob(name);
+    if (!knob) {
+        return USBX_ERROR_NOT_FOUND;
+    }
+    format_knob(knob, config, value, size);
+    return USBX_SUCCESS;
+}
+
+/* Trim leading and trailing blanks in place */
+static char *trim(char *text) {
+    while (*text == ' ' || *text == '\t') {
+        text++;
+    }
+    size_t length = strlen(text);
+    while (length > 0 && (text[length - 1] == ' ' || text[length - 1] == '\t' ||
+                          text[length - 1] == '\r')) {
+        text[--length] = '\0';
+    }
+    return text;
+}
+
+int usbx_config_parse(struct usbx_config *config, const char *text, size_t length, char *error,
+                      size_t error_size) {
+    char line[USBX_CONFIG_PATH_MAX + 64];
+    size_t pos = 0;
+    int number = 0;
+
+    while (pos < length) {
+        const char *start = text + pos;
+        const char *newline = memchr(start, '\n', length - pos);
+        size_t line_length = newline ? (size_t)(newline - start) : length - pos;
+        pos += line_length + 1;
+        number++;
+        if (line_length >= sizeof(line)) {
+            set_error(error, error_size, "line %d: too long", number);
+            return USBX_ERROR_INVALID_PARAM;
+        }
+        memcpy(line, start, line_length);
+        line[line_length] = '\0';
+
+        char *key = trim(line);
+        if (*key == '\0' || *key == '#') {
+            continue;
+        }
+        char *equals = strchr(key, '=');
+        if (!equals) {
+            set_error(error, error_size, "line %d: expected key = value", number);
+            return USBX_ERROR_INVALID_PARAM;
+        }
+        *equals = '\0';
+        key = trim(key);
+        int result = usbx_config_set(config, key, trim(equals + 1));
+        if (result == USBX_ERROR_NOT_FOUND) {
+            set_error(error, error_size, "line %d: unknown setting '%s'", number, key);
+            return result;
+        }
+        if (result != USBX_SUCCESS) {
+            set_error(error, error_size, "line %d: invalid value for '%s'", number, key);
+            return result;
+        }
+    }
+    return USBX_SUCCESS;
+}
+
+/* Apply the file at path on top of config */
+static int parse_file(struct usbx_config *config, const char *path, char *error,
+                      size_t error_size) {
+    FILE *file = fopen(path, "r");
+    struct usbx_buf buf;
+    char chunk[4096];
+    size_t got;
+
+    if (!file) {
+        set_error(error, error_size, "cannot read '%s': %s", path, strerror(errno));
+        return USBX_ERROR_IO;
+    }
+    usbx_buf_init(&buf);
+    while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0 && buf.length <= MAX_FILE_SIZE) {
+        usbx_buf_append(&buf, chunk, got);
+    }
+    int failed = ferror(file) || buf.length > MAX_FILE_SIZE;
+    fclose(file);
+    if (failed) {
+        usbx_buf_free(&buf);
+        set_error(error, error_size, "cannot read '%s'", path);
+        return USBX_ERROR_IO;
+    }
+    char prefix[USBX_CONFIG_PATH_MAX + 16];
+    int result = usbx_config_parse(config, buf.data ? buf.data : "", buf.length, error,
+                                   error_size);
+    usbx_buf_free(&buf);
+    if (result != USBX_SUCCESS && error && error_size > 0) {
+        snprintf(prefix, sizeof(prefix), "%s", error);
+        set_error(error, error_size, "%s: %s", path, prefix);
+    }
+    return result;
+}
+
+/* Free the snapshots no reader can still be using (lock held) */
+static void reclaim(uint64_t now) {
+    struct snapshot **link = &snapshots;
+
+    while (*link) {
+        struct snapshot *s = *link;
+        if (s->retired_us != 0 && now - s->retired_us >= USBX_CONFIG_GRACE_MS * 1000ULL) {
+            *link = s->next;
+            free(s);
+            retained--;
+        } else {
+            link = &s->next;
+        }
+    }
+}
+
+/* Apply the candidate to the subsystems and publish it (lock held) */
+static int publish(const struct usbx_config *candidate, int startup, char *error,
+                   size_t error_size) {
+    char was[USBX_CONFIG_PATH_MAX], now[USBX_CONFIG_PATH_MAX];
+
+    for (int i = 0; i < NUM_KNOBS && !startup; i++) {
+        if (knobs[i].key.live) {
+            continue;
+        }
+        format_knob(&knobs[i], current, was, sizeof(was));
+        format_knob(&knobs[i], candidate, now, sizeof(now));
+        if (strcmp(was, now) != 0) {
+            set_error(error, error_size, "'%s' cannot change without a restart",
+                      knobs[i].key.name);
+            return USBX_ERROR_NOT_SUPPORTED;
+        }
+    }
+    struct snapshot *s = malloc(sizeof(*s));
+    if (!s) {
+        set_error(error, error_size, "out of memory");
+        return USBX_ERROR_NO_MEM;
+    }
+    s->config = *candidate;
+    s->config.version = current->version + 1;
+
+    // Validated above, so none of these can fail
+    usbx_budget_configure(s->config.memory_budget, s->config.memory_budget_wait_ms);
+    usbx_quota_set_defaults(&s->config.quota);
+
+    uint64_t retired_us = usbx_now_us();
+    if (snapshots && current == &snapshots->config) {
+        snapshots->retired_us = retired_us;
+    }
+    s->retired_us = 0;
+    s->next = snapshots;
+    snapshots = s;
+    retained++;
+    __atomic_store_n(&current, &s->config, __ATOMIC_RELEASE);
+    reclaim(retired_us);
+    return USBX_SUCCESS;
+}
+
+/* Count the outcome of a change (lock held) */
+static int finish(int result) {
+    if (result == USBX_SUCCESS) {
+        applied++;
+    } else {
+        rejected++;
+    }
+    return result;
+}
+
+int usbx_config_start(const struct usbx_config *startup, const char *path, char *error,
+                      size_t error_size) {
+    struct usbx_config candidate = *startup;
+    int result = USBX_SUCCESS;
+
+    if (path && strlen(path) >= sizeof(config_path)) {
+        set_error(error, error_size, "config path too long");
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    pthread_mutex_lock(&config_lock);
+    if (path) {
+        result = parse_file(&candidate, path, error, error_size);
+    }
+    if (result == USBX_SUCCESS) {
+        result = publish(&candidate, 1, error, error_size);
+    }
+    if (result == USBX_SUCCESS) {
+        base = *startup;
+        snprintf(config_path, sizeof(config_path), "%s", path ? path : "");
+    }
+    result = finish(result);
+    pthread_mutex_unlock(&config_lock);
+    return result;
+}
+
+int usbx_config_reload(char *error, size_t error_size) {
+    int result;
+
+    pthread_mutex_lock(&config_lock);
+    struct usbx_config candidate = base;
+    if (config_path[0] == '\0') {
+        set_error(error, error_size, "no config file");
+        result = USBX_ERROR_NOT_FOUND;
+    } else {
+        result = parse_file(&candidate, config_path, error, error_size);
+    }
+    if (result == USBX_SUCCESS) {
+        result = publish(&candidate, 0, error, error_size);
+    }
+    result = finish(result);
+    pthread_mutex_unlock(&config_lock);
+    return result;
+}
+
+int usbx_config_update(const char *text, size_t length, char *error, size_t error_size) {
+    pthread_mutex_lock(&config_lock);
+    struct usbx_config candidate = *current;
+    int result = usbx_config_parse(&candidate, text, length, error, error_size);
+    if (result == USBX_SUCCESS) {
+        result = publish(&candidate, 0, error, error_size);
+    }
+    result = finish(result);
+    pthread_mutex_unlock(&config_lock);
+    return result;
+}
+
+const struct usbx_config *usbx_config_current(void) {
+    return __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+}
+
+void usbx_config_get_stats(struct usbx_config_stats *stats) {
+    pthread_mutex_lock(&config_lock);
+    stats->version = current->version;
+    stats->applied = applied;
+    stats->rejected = rejected;
+    stats->retained = retained;
+    pthread_mutex_unlock(&config_lock);
+}
+
+void usbx_config_reset(void) {
+    pthread_mutex_lock(&config_lock);
+    __atomic_store_n(&current, &builtin, __ATOMIC_RELEASE);
+    while (snapshots) {
+        struct snapshot *s = snapshots;
+        snapshots = s->next;
+        free(s);
+    }
+    base = builtin;
+    config_path[0] = '\0';
+    applied = 0;
+    rejected = 0;
+    retained = 0;
+    pthread_mutex_unlock(&config_lock);
+}
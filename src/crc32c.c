@@ -0,0 +1,163 @@
+/**
+ * @file crc32c.c
+ * @brief CRC-32C with SSE4.2/PCLMULQDQ acceleration and a portable fallback
+ *
+ * The accelerated path runs the CRC instruction on three independent
+ * lanes to hide its latency, then merges the lane CRCs by multiplying
+ * each by x^(8 * distance) mod P with one carry-less multiply and one
+ * more CRC instruction.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "usbx_crc32c.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32C_X86 1
+#include <cpuid.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+/** @brief Reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82f63b78U
+
+/** @brief Bytes per lane of the three-lane loop (a multiple of 8) */
+#define LANE_BYTES 8192
+
+static uint32_t table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32c_raw)(uint32_t crc, const unsigned char *p, size_t n);
+static const char *crc32c_name = "table";
+
+/* Slicing-by-8 over the raw (not inverted) register */
+static uint32_t raw_table(uint32_t crc, const unsigned char *p, size_t n) {
+    for (; n > 0 && ((uintptr_t)p & 7) != 0; n--) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+    }
+    for (; n >= 8; p += 8, n -= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+                             (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 |
+                      (uint32_t)p[7] << 24;
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^
+              table[4][lo >> 24] ^ table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+              table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    }
+    for (; n > 0; n--) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+/** @brief x^(8 * LANE_BYTES - 33) and x^(16 * LANE_BYTES - 33) mod P, see shift_crc() */
+static uint64_t lane_shift[2];
+
+/* x^n mod P in the reflected representation */
+static uint32_t x_pow_mod(uint64_t n) {
+    uint32_t p = 0x80000000U;     // x^0
+
+    while (n--) {
+        p = p & 1 ? (p >> 1) ^ CRC32C_POLY : p >> 1;
+    }
+    return p;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t raw_sse42(uint32_t crc, const unsigned char *p, size_t n) {
+    uint64_t c = crc;
+
+    for (; n > 0 && ((uintptr_t)p & 7) != 0; n--) {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    }
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    for (; n > 0; n--) {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    }
+    return (uint32_t)c;
+}
+
+/*
+ * Multiply a CRC by x^(k + 33) mod P. The carry-less product of two
+ * reflected 32-bit values is x * crc * k, and the CRC instruction over
+ * those 64 bits multiplies by x^32 and reduces.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t shift_crc(uint32_t crc, uint64_t k) {
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)crc),
+                                           _mm_cvtsi64_si128((long long)k), 0);
+    return (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(product));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t raw_sse42_pclmul(uint32_t crc, const unsigned char *p, size_t n) {
+    for (; n >= 3 * LANE_BYTES; p += 3 * LANE_BYTES, n -= 3 * LANE_BYTES) {
+        uint64_t c0 = crc, c1 = 0, c2 = 0;
+        for (size_t i = 0; i < LANE_BYTES; i += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p + i, sizeof(v0));
+            memcpy(&v1, p + LANE_BYTES + i, sizeof(v1));
+            memcpy(&v2, p + 2 * LANE_BYTES + i, sizeof(v2));
+            c0 = _mm_crc32_u64(c0, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+        crc = shift_crc((uint32_t)c0, lane_shift[1]) ^ shift_crc((uint32_t)c1, lane_shift[0]) ^
+              (uint32_t)c2;
+    }
+    return raw_sse42(crc, p, n);
+}
+#endif
+
+static void crc32c_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        table[0][n] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int n = 0; n < 256; n++) {
+            table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xff];
+        }
+    }
+    crc32c_raw = raw_table;
+
+#ifdef CRC32C_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2)) {
+        crc32c_raw = raw_sse42;
+        crc32c_name = "sse4.2";
+        if (ecx & bit_PCLMUL) {
+            lane_shift[0] = x_pow_mod(8ULL * LANE_BYTES - 33);
+            lane_shift[1] = x_pow_mod(16ULL * LANE_BYTES - 33);
+            crc32c_raw = raw_sse42_pclmul;
+            crc32c_name = "sse4.2+pclmul";
+        }
+    }
+#endif
+}
+
+uint32_t usbx_crc32c(uint32_t crc, const void *data, size_t length) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_raw(~crc, data, length);
+}
+
+uint32_t usbx_crc32c_portable(uint32_t crc, const void *data, size_t length) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~raw_table(~crc, data, length);
+}
+
+const char *usbx_crc32c_implementation(void) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_name;
+}
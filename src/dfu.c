@@ -0,0 +1,242 @@
+/**
+ * @file dfu.c
+ * @brief DFU 1.1 firmware download engine
+ *
+ * Every block is sent with DFU_DNLOAD and then polled with DFU_GETSTATUS
+ * until the device is back in dfuDNLOAD-IDLE. The next poll is scheduled
+ * from the moment the previous status response completed, so the wait is
+ * bwPollTimeout exactly rather than bwPollTimeout plus request overhead
+ * rounded up to a sleep granularity.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stddef.h>
+
+#include "usbx_dfu.h"
+#include "usbx_util.h"
+
+/** @brief Standard SET_INTERFACE request (host to device, interface recipient) */
+#define REQUEST_TYPE_SET_INTERFACE 0x01
+#define REQUEST_SET_INTERFACE 0x0b
+
+static const char *const state_names[] = {
+    "appIDLE", "appDETACH", "dfuIDLE", "dfuDNLOAD-SYNC", "dfuDNBUSY", "dfuDNLOAD-IDLE",
+    "dfuMANIFEST-SYNC", "dfuMANIFEST", "dfuMANIFEST-WAIT-RESET", "dfuUPLOAD-IDLE", "dfuERROR",
+};
+
+/** @brief State of one download */
+struct dfu_session {
+    struct usbx_device *dev;
+    struct usbx_dfu_options opts;
+    struct usbx_dfu_progress *progress;
+    uint64_t start_us;
+    uint64_t next_poll_us;      /* earliest time the device may be polled again */
+};
+
+void usbx_dfu_options_init(struct usbx_dfu_options *opts) {
+    opts->interface = 0;
+    opts->alt_setting = -1;
+    opts->transfer_size = USBX_DFU_DEFAULT_TRANSFER_SIZE;
+    opts->timeout = USBX_DFU_DEFAULT_TIMEOUT;
+}
+
+const char *usbx_dfu_state_name(int state) {
+    if (state < 0 || state >= (int)(sizeof(state_names) / sizeof(state_names[0]))) {
+        return "unknown";
+    }
+    return state_names[state];
+}
+
+static int send_request(struct dfu_session *s, uint8_t request, uint16_t value,
+                        const unsigned char *data, uint16_t length) {
+    // OUT data is only read
+    int result = usbx_control_transfer(s->dev, USBX_DFU_REQUEST_OUT, request, value,
+                                       (uint16_t)s->opts.interface, (unsigned char *)data,
+                                       length, s->opts.timeout);
+    return result < 0 ? result : USBX_SUCCESS;
+}
+
+/*
+ * Wait out the previous bwPollTimeout, then DFU_GETSTATUS. Updates the
+ * progress state and status and schedules the next poll.
+ */
+static int get_status(struct dfu_session *s) {
+    unsigned char response[USBX_DFU_STATUS_SIZE];
+
+    uint64_t now = usbx_now_us();
+    if (s->next_poll_us > now) {
+        usbx_sleep_us(s->next_poll_us - now);
+        s->progress->poll_wait_us += usbx_now_us() - now;
+    }
+
+    int result = usbx_control_transfer(s->dev, USBX_DFU_REQUEST_IN, USBX_DFU_GETSTATUS, 0,
+                                       (uint16_t)s->opts.interface, response,
+                                       sizeof(response), s->opts.timeout);
+    uint64_t answered_us = usbx_now_us();
+    if (result < 0) {
+        return result;
+    }
+    if (result < USBX_DFU_STATUS_SIZE) {
+        return USBX_ERROR_IO;
+    }
+    s->progress->polls++;
+    s->progress->status = response[0];
+    s->progress->state = response[4];
+
+    uint32_t poll_timeout = (uint32_t)response[1] | (uint32_t)response[2] << 8 |
+                            (uint32_t)response[3] << 16;
+    if (poll_timeout > USBX_DFU_MAX_POLL_TIMEOUT) {
+        return USBX_ERROR_TIMEOUT;
+    }
+    s->next_poll_us = answered_us + poll_timeout * 1000ULL;
+    return s->progress->status == USBX_DFU_STATUS_OK ? USBX_SUCCESS : USBX_ERROR_IO;
+}
+
+/* Bring the device to dfuIDLE, clearing an error or abandoning an earlier download */
+static int enter_idle(struct dfu_session *s) {
+    int result;
+
+    if (s->opts.alt_setting >= 0) {
+        result = usbx_control_transfer(s->dev, REQUEST_TYPE_SET_INTERFACE, REQUEST_SET_INTERFACE,
+                                       (uint16_t)s->opts.alt_setting,
+                                       (uint16_t)s->opts.interface, NULL, 0, s->opts.timeout);
+        if (result < 0) {
+            return result;
+        }
+    }
+
+    result = get_status(s);
+    if (result < 0 && result != USBX_ERROR_IO) {
+        return result;
+    }
+    if (s->progress->state == USBX_DFU_STATE_APP_IDLE ||
+        s->progress->state == USBX_DFU_STATE_APP_DETACH) {
+        return USBX_ERROR_NOT_SUPPORTED;
+    }
+    if (s->progress->state == USBX_DFU_STATE_IDLE && result == USBX_SUCCESS) {
+        return USBX_SUCCESS;
+    }
+
+    result = send_request(s, s->progress->state == USBX_DFU_STATE_ERROR ? USBX_DFU_CLRSTATUS
+                                                                        : USBX_DFU_ABORT,
+                          0, NULL, 0);
+    if (result == USBX_SUCCESS) {
+        result = get_status(s);
+    }
+    if (result == USBX_SUCCESS && s->progress->state != USBX_DFU_STATE_IDLE) {
+        result = USBX_ERROR_IO;
+    }
+    return result;
+}
+
+/* Poll after a data block until the device has written it */
+static int wait_block(struct dfu_session *s) {
+    for (;;) {
+        int result = get_status(s);
+        if (result < 0) {
+            return result;
+        }
+        switch (s->progress->state) {
+        case USBX_DFU_STATE_DNLOAD_IDLE:
+            return USBX_SUCCESS;
+        case USBX_DFU_STATE_DNLOAD_SYNC:
+        case USBX_DFU_STATE_DNBUSY:
+            break;
+        default:
+            return USBX_ERROR_IO;
+        }
+    }
+}
+
+/* Poll after the zero-length block until manifestation is over */
+static int wait_manifest(struct dfu_session *s) {
+    for (;;) {
+        int result = get_status(s);
+        if (result == USBX_ERROR_PIPE || result == USBX_ERROR_NO_DEVICE ||
+            (result == USBX_ERROR_IO && s->progress->status == USBX_DFU_STATUS_OK)) {
+            // Devices that are not manifestation tolerant may reset without answering
+            s->progress->state = USBX_DFU_STATE_MANIFEST_WAIT_RESET;
+            return USBX_SUCCESS;
+        }
+        if (result < 0) {
+            return result;
+        }
+        switch (s->progress->state) {
+        case USBX_DFU_STATE_IDLE:
+        case USBX_DFU_STATE_MANIFEST_WAIT_RESET:
+            return USBX_SUCCESS;
+        case USBX_DFU_STATE_MANIFEST_SYNC:
+        case USBX_DFU_STATE_MANIFEST:
+            break;
+        default:
+            return USBX_ERROR_IO;
+        }
+    }
+}
+
+static void report(struct dfu_session *s, usbx_dfu_progress_cb callback, void *cls) {
+    s->progress->elapsed_us = usbx_now_us() - s->start_us;
+    if (callback) {
+        callback(cls, s->progress);
+    }
+}
+
+int usbx_dfu_download(struct usbx_device *dev, const unsigned char *image, size_t size,
+                      const struct usbx_dfu_options *opts, usbx_dfu_progress_cb callback,
+                      void *cls, struct usbx_dfu_progress *progress) {
+    struct usbx_dfu_progress local;
+    struct dfu_session s = {.dev = dev, .progress = progress ? progress : &local};
+
+    if (opts) {
+        s.opts = *opts;
+    } else {
+        usbx_dfu_options_init(&s.opts);
+    }
+    s.progress->total = size;
+    s.progress->written = 0;
+    s.progress->blocks = 0;
+    s.progress->polls = 0;
+    s.progress->poll_wait_us = 0;
+    s.progress->elapsed_us = 0;
+    s.progress->state = -1;
+    s.progress->status = USBX_DFU_STATUS_OK;
+    if (!dev || (!image && size > 0) || s.opts.interface < 0 || s.opts.interface > 0xff ||
+        s.opts.transfer_size < 1 || s.opts.transfer_size > USBX_DFU_MAX_TRANSFER_SIZE) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    s.start_us = usbx_now_us();
+
+    int result = enter_idle(&s);
+    uint16_t block = 0;
+    while (result == USBX_SUCCESS && s.progress->written < size) {
+        size_t length = size - s.progress->written;
+        if (length > (size_t)s.opts.transfer_size) {
+            length = (size_t)s.opts.transfer_size;
+        }
+        result = send_request(&s, USBX_DFU_DNLOAD, block++, image + s.progress->written,
+                              (uint16_t)length);
+        if (result == USBX_SUCCESS) {
+            // The first status request of a block is due at once
+            s.next_poll_us = 0;
+            result = wait_block(&s);
+        }
+        if (result == USBX_SUCCESS) {
+            s.progress->written += length;
+            s.progress->blocks++;
+            report(&s, callback, cls);
+        }
+    }
+
+    if (result == USBX_SUCCESS) {
+        result = send_request(&s, USBX_DFU_DNLOAD, block, NULL, 0);
+        if (result == USBX_SUCCESS) {
+            s.next_poll_us = 0;
+            result = wait_manifest(&s);
+        }
+    }
+    report(&s, callback, cls);
+    return result;
+}
@@ -0,0 +1,445 @@
+/**
+ * @file discovery.c
+ * @brief Background catalog of attached devices (see usbx_discovery.h)
+ *
+ * Entries are only ever appended, so workers and lookups refer to them by
+ * index across the unlocked probe; a device that disappears on a rescan is
+ * marked gone rather than removed. Every state change broadcasts one
+ * condition variable that lookups wait on.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_discovery.h"
+#include "usbx_util.h"
+
+enum entry_state {
+    ENTRY_QUEUED,       // serial not read yet and nobody reading it
+    ENTRY_PROBING,
+    ENTRY_READY,
+    ENTRY_FAILED
+};
+
+struct entry {
+    struct usbx_discovery_device device;
+    enum entry_state state;
+    int gone;           // missing from the latest list
+    int seen;           // present in the list being merged
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed;
+static pthread_once_t changed_once = PTHREAD_ONCE_INIT;
+
+static struct usbx_discovery_source source;
+static int running = 0;
+static int stopping = 0;
+static int listed = 0;              // the first list is merged
+static int scanning = 0;            // a list is being read
+static int probes_active = 0;
+static struct entry *entries = NULL;
+static int count = 0;
+static int buses[USBX_DISCOVERY_MAX_WORKERS * 4];
+static int num_buses = 0;
+static int next_bus = 0;            // next index into buses for a worker
+static unsigned int max_workers = 1;
+static pthread_t scanner;
+static uint64_t start_us = 0;
+static struct usbx_discovery_stats stats;
+
+static void init_changed(void) {
+    usbx_cond_init_monotonic(&changed);
+}
+
+static int same_device(const struct usbx_device_info *a, const struct usbx_device_info *b) {
+    return a->bus == b->bus && a->address == b->address && a->vid == b->vid &&
+           a->pid == b->pid;
+}
+
+/* Merge a fresh list into the catalog (lock held); takes over the references */
+static void merge(struct usbx_discovery_device *devices, int n) {
+    struct entry *grown = n > 0 ? realloc(entries, (size_t)(count + n) * sizeof(*entries)) :
+                                  entries;
+    if (!grown) {
+        for (int i = 0; i < n; i++) {
+            source.unref(source.cls, devices[i].ref);
+        }
+        return;
+    }
+    entries = grown;
+    for (int i = 0; i < count; i++) {
+        entries[i].seen = 0;
+    }
+    for (int d = 0; d < n; d++) {
+        int known = 0;
+        for (int i = 0; i < count && !known; i++) {
+            if (!entries[i].seen && same_device(&entries[i].device.info, &devices[d].info)) {
+                entries[i].seen = 1;
+                entries[i].gone = 0;
+                known = 1;
+            }
+        }
+        if (known) {
+            source.unref(source.cls, devices[d].ref);
+            continue;
+        }
+        struct entry *e = &entries[count++];
+        memset(e, 0, sizeof(*e));
+        e->device = devices[d];
+        e->device.info.serial[0] = '\0';
+        e->state = ENTRY_QUEUED;
+        e->seen = 1;
+
+        int b = 0;
+        while (b < num_buses && buses[b] != e->device.info.bus) {
+            b++;
+        }
+        if (b == num_buses && num_buses < (int)(sizeof(buses) / sizeof(buses[0]))) {
+            buses[num_buses++] = e->device.info.bus;
+        }
+    }
+    int present = 0;
+    for (int i = 0; i < count; i++) {
+        entries[i].gone = !entries[i].seen;
+        present += !entries[i].gone;
+    }
+    stats.devices = (unsigned int)present;
+    stats.buses = (unsigned int)num_buses;
+}
+
+/* Whether every present device was probed (lock held) */
+static int all_probed(void) {
+    for (int i = 0; i < count; i++) {
+        if (!entries[i].gone &&
+            (entries[i].state == ENTRY_QUEUED || entries[i].state == ENTRY_PROBING)) {
+            return 0;
+        }
+    }
+    return listed && !scanning;
+}
+
+/* Read the device list and merge it (lock held, released while listing) */
+static void scan(void) {
+    if (scanning) {
+        // Another thread is listing; its result serves this caller too
+        while (scanning && !stopping) {
+            pthread_cond_wait(&changed, &lock);
+        }
+        return;
+    }
+    scanning = 1;
+    pthread_mutex_unlock(&lock);
+    struct usbx_discovery_device *devices = NULL;
+    int n = source.list(source.cls, &devices);
+    pthread_mutex_lock(&lock);
+    if (n > 0) {
+        merge(devices, n);
+    }
+    free(devices);
+    stats.scans++;
+    if (!listed) {
+        listed = 1;
+        stats.list_us = usbx_now_us() - start_us;
+    }
+    scanning = 0;
+    if (stats.complete_us == 0 && all_probed()) {
+        stats.complete_us = usbx_now_us() - start_us;     // nothing to probe
+    }
+    pthread_cond_broadcast(&changed);
+}
+
+/* Read the serial number of a queued entry (lock held, released while probing) */
+static void probe(int index, int inline_probe) {
+    struct usbx_discovery_device device = entries[index].device;
+
+    entries[index].state = ENTRY_PROBING;
+    probes_active++;
+    pthread_mutex_unlock(&lock);
+    int result = source.probe(source.cls, &device);
+    pthread_mutex_lock(&lock);
+    probes_active--;
+    if (result == USBX_SUCCESS) {
+        memcpy(entries[index].device.info.serial, device.info.serial,
+               sizeof(device.info.serial));
+        entries[index].device.info.serial[sizeof(device.info.serial) - 1] = '\0';
+        entries[index].state = ENTRY_READY;
+        stats.probed++;
+    } else {
+        entries[index].state = ENTRY_FAILED;
+        stats.failed++;
+    }
+    if (inline_probe) {
+        stats.probed_inline++;
+    }
+    if (stats.complete_us == 0 && all_probed()) {
+        stats.complete_us = usbx_now_us() - start_us;
+    }
+    pthread_cond_broadcast(&changed);
+}
+
+/* Probe the devices of one bus after another until every bus is taken */
+static void *worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    while (!stopping && next_bus < num_buses) {
+        int bus = buses[next_bus++];
+        for (int i = 0; i < count && !stopping; i++) {
+            if (entries[i].device.info.bus == bus && entries[i].state == ENTRY_QUEUED &&
+                !entries[i].gone) {
+                probe(i, 0);
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/* List the devices, then probe the buses in parallel */
+static void *scanner_thread(void *arg) {
+    (void)arg;
+    pthread_t workers[USBX_DISCOVERY_MAX_WORKERS];
+    unsigned int started = 0;
+
+    pthread_mutex_lock(&lock);
+    scan();
+    unsigned int wanted = (unsigned int)num_buses < max_workers ? (unsigned int)num_buses :
+                                                                  max_workers;
+    pthread_mutex_unlock(&lock);
+
+    while (started < wanted && pthread_create(&workers[started], NULL, worker, NULL) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        worker(NULL);
+    }
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    return NULL;
+}
+
+int usbx_discovery_start(const struct usbx_discovery_source *src, unsigned int workers) {
+    if (!src || !src->list || !src->probe || !src->ref || !src->unref || workers < 1 ||
+        workers > USBX_DISCOVERY_MAX_WORKERS) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    pthread_once(&changed_once, init_changed);
+    pthread_mutex_lock(&lock);
+    if (running) {
+        pthread_mutex_unlock(&lock);
+        return USBX_ERROR_BUSY;
+    }
+    source = *src;
+    max_workers = workers;
+    memset(&stats, 0, sizeof(stats));
+    start_us = usbx_now_us();
+    if (pthread_create(&scanner, NULL, scanner_thread, NULL) != 0) {
+        pthread_mutex_unlock(&lock);
+        return USBX_ERROR_NO_MEM;
+    }
+    running = 1;
+    pthread_mutex_unlock(&lock);
+    return USBX_SUCCESS;
+}
+
+void usbx_discovery_stop(void) {
+    pthread_mutex_lock(&lock);
+    if (!running || stopping) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    stopping = 1;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    pthread_join(scanner, NULL);
+
+    pthread_mutex_lock(&lock);
+    while (probes_active > 0 || scanning) {
+        pthread_cond_wait(&changed, &lock);
+    }
+    for (int i = 0; i < count; i++) {
+        source.unref(source.cls, entries[i].device.ref);
+    }
+    free(entries);
+    entries = NULL;
+    count = 0;
+    num_buses = 0;
+    next_bus = 0;
+    listed = 0;
+    running = 0;
+    stopping = 0;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+}
+
+int usbx_discovery_running(void) {
+    pthread_mutex_lock(&lock);
+    int result = running && !stopping;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+/* Wait for a change until the deadline (lock held); USBX_ERROR_TIMEOUT once it passed */
+static int wait_changed(const struct timespec *deadline) {
+    if (pthread_cond_timedwait(&changed, &lock, deadline) == ETIMEDOUT) {
+        return USBX_ERROR_TIMEOUT;
+    }
+    return USBX_SUCCESS;
+}
+
+int usbx_discovery_find(int vid, int pid, const char *serial, unsigned int timeout_ms,
+                        struct usbx_discovery_device *device) {
+    struct timespec deadline;
+    int rescanned = 0;
+
+    pthread_once(&changed_once, init_changed);
+    usbx_deadline_ms(&deadline, (int)timeout_ms);
+    pthread_mutex_lock(&lock);
+    while (running && !stopping && !listed) {
+        if (wait_changed(&deadline) != USBX_SUCCESS && !listed) {
+            pthread_mutex_unlock(&lock);
+            return USBX_ERROR_TIMEOUT;
+        }
+    }
+
+    for (;;) {
+        if (!running || stopping) {
+            pthread_mutex_unlock(&lock);
+            return USBX_ERROR_NOT_SUPPORTED;
+        }
+        int pending = 0, probed = 0;
+        for (int i = 0; i < count && !probed; i++) {
+            const struct entry *e = &entries[i];
+            if (e->gone || (vid >= 0 && e->device.info.vid != vid) ||
+                (pid >= 0 && e->device.info.pid != pid)) {
+                continue;
+            }
+            if (!serial || (e->state == ENTRY_READY &&
+                            strcmp(e->device.info.serial, serial) == 0)) {
+                *device = e->device;
+                source.ref(source.cls, device->ref);
+                pthread_mutex_unlock(&lock);
+                return USBX_SUCCESS;
+            }
+            if (e->state == ENTRY_QUEUED) {
+                probe(i, 1);        // this device only, not the rest of its bus
+                probed = 1;         // entries may have grown meanwhile: look again
+            } else if (e->state == ENTRY_PROBING) {
+                pending = 1;
+            }
+        }
+        if (probed) {
+            continue;
+        }
+        if (pending) {
+            if (wait_changed(&deadline) != USBX_SUCCESS) {
+                pthread_mutex_unlock(&lock);
+                return USBX_ERROR_TIMEOUT;
+            }
+            continue;
+        }
+        if (rescanned) {
+            pthread_mutex_unlock(&lock);
+            return USBX_ERROR_NOT_FOUND;
+        }
+        scan();                     // attached since the last list?
+        rescanned = 1;
+    }
+}
+
+void usbx_discovery_put(struct usbx_discovery_device *device) {
+    if (device && device->ref) {
+        source.unref(source.cls, device->ref);
+        device->ref = NULL;
+    }
+}
+
+void usbx_discovery_get_stats(struct usbx_discovery_stats *out) {
+    pthread_mutex_lock(&lock);
+    if (!running) {
+        memset(out, 0, sizeof(*out));
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    *out = stats;
+    out->complete = all_probed();
+    pthread_mutex_unlock(&lock);
+}
+
+#ifdef USE_DEPS
+static int libusb_list(void *cls, struct usbx_discovery_device **devices) {
+    libusb_device **list;
+    ssize_t n = libusb_get_device_list(cls, &list);
+    if (n < 0) {
+        return (int)n;
+    }
+    *devices = calloc(n > 0 ? (size_t)n : 1, sizeof(**devices));
+    if (!*devices) {
+        libusb_free_device_list(list, 1);
+        return USBX_ERROR_NO_MEM;
+    }
+    int listed_devices = 0;
+    for (ssize_t i = 0; i < n; i++) {
+        struct libusb_device_descriptor desc;
+        // Descriptors are cached by libusb; this does not touch the device
+        if (libusb_get_device_descriptor(list[i], &desc) != LIBUSB_SUCCESS) {
+            continue;
+        }
+        struct usbx_discovery_device *d = &(*devices)[listed_devices++];
+        d->info.vid = desc.idVendor;
+        d->info.pid = desc.idProduct;
+        d->info.bus = libusb_get_bus_number(list[i]);
+        d->info.address = libusb_get_device_address(list[i]);
+        d->ref = libusb_ref_device(list[i]);
+    }
+    libusb_free_device_list(list, 1);
+    return listed_devices;
+}
+
+static int libusb_probe(void *cls, struct usbx_discovery_device *device) {
+    (void)cls;
+    struct libusb_device_descriptor desc;
+    libusb_device_handle *usb_handle;
+
+    if (libusb_get_device_descriptor(device->ref, &desc) != LIBUSB_SUCCESS ||
+        libusb_open(device->ref, &usb_handle) != LIBUSB_SUCCESS) {
+        return USBX_ERROR_IO;
+    }
+    int result = USBX_SUCCESS;
+    if (desc.iSerialNumber != 0 &&
+        libusb_get_string_descriptor_ascii(usb_handle, desc.iSerialNumber,
+                                           (unsigned char *)device->info.serial,
+                                           sizeof(device->info.serial)) < 0) {
+        result = USBX_ERROR_IO;
+    }
+    libusb_close(usb_handle);
+    return result;
+}
+
+static void libusb_ref(void *cls, void *ref) {
+    (void)cls;
+    libusb_ref_device(ref);
+}
+
+static void libusb_unref(void *cls, void *ref) {
+    (void)cls;
+    libusb_unref_device(ref);
+}
+
+void usbx_discovery_libusb_source(struct usbx_discovery_source *src, libusb_context *ctx) {
+    memset(src, 0, sizeof(*src));
+    src->name = "libusb";
+    src->list = libusb_list;
+    src->probe = libusb_probe;
+    src->ref = libusb_ref;
+    src->unref = libusb_unref;
+    src->cls = ctx;
+}
+#endif
@@ -0,0 +1,475 @@
+/**
+ * @file fault.c
+ * @brief Fault and latency injection in the device layer
+ *
+ * Each device with rules gets a delivery thread. Transfers submitted to it
+ * are tracked from submission to completion; a completion that has to be
+ * held back, and an injected failure, is queued by due time and handed to
+ * usbx_transfer_complete() by that thread once due. All state sits under
+ * one mutex: injection is a debugging aid and never on a production path.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbx_fault.h"
+
+static const struct {
+    int status;
+    const char *name;
+} status_names[] = {
+    {USBX_TRANSFER_COMPLETED, "completed"},
+    {USBX_TRANSFER_ERROR, "error"},
+    {USBX_TRANSFER_TIMED_OUT, "timeout"},
+    {USBX_TRANSFER_CANCELLED, "cancelled"},
+    {USBX_TRANSFER_STALL, "stall"},
+    {USBX_TRANSFER_NO_DEVICE, "no_device"},
+    {USBX_TRANSFER_OVERFLOW, "overflow"},
+};
+
+void usbx_fault_rule_init(struct usbx_fault_rule *rule, int endpoint) {
+    memset(rule, 0, sizeof(*rule));
+    rule->endpoint = endpoint;
+    rule->error_status = USBX_TRANSFER_STALL;
+}
+
+const char *usbx_fault_status_name(int status) {
+    for (size_t i = 0; i < sizeof(status_names) / sizeof(status_names[0]); i++) {
+        if (status_names[i].status == status) {
+            return status_names[i].name;
+        }
+    }
+    return "unknown";
+}
+
+int usbx_fault_parse_status(const char *name) {
+    for (size_t i = 0; name && i < sizeof(status_names) / sizeof(status_names[0]); i++) {
+        if (strcmp(status_names[i].name, name) == 0) {
+            return status_names[i].status;
+        }
+    }
+    return -1;
+}
+
+#ifdef USBX_FAULT_INJECTION
+
+#include "uthash.h"
+#include "usbx_util.h"
+
+/** @brief Seed used until usbx_fault_seed() is called */
+#define DEFAULT_SEED 0x9e3779b97f4a7c15ULL
+
+/** @brief A transfer of a faulted device between submission and delivery */
+struct tracked {
+    struct usbx_transfer *xfer;  // key
+    uint64_t submit_us;
+    unsigned int latency_us;     // drawn at submission
+    int injected;                // never reached the device
+    int queued;                  // waiting in the delivery queue
+    uint64_t due_us;
+    struct tracked *next;        // delivery queue, by due time
+    UT_hash_handle hh;
+};
+
+struct fault_device {
+    struct usbx_device *dev;
+    struct usbx_fault_rule rules[USBX_FAULT_MAX_RULES];  // [0] default, [1 + slot] endpoints
+    int has_rule[USBX_FAULT_MAX_RULES];
+    struct usbx_fault_stats stats;
+    struct tracked *tracked;
+    struct tracked *queue;
+    uint64_t last_due_us[USBX_FAULT_MAX_RULES - 1];  // keeps each endpoint in order
+    pthread_t thread;
+    pthread_cond_t cond;
+    int stopping;
+    struct fault_device *next;
+};
+
+static pthread_mutex_t fault_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fault_device *fault_devices = NULL;
+static uint64_t random_state = DEFAULT_SEED;
+
+/* Endpoint index: control, then OUT 1-15, then IN 1-15 */
+static int endpoint_slot(unsigned char endpoint) {
+    int number = endpoint & 0x0f;
+    if (number == 0) {
+        return 0;
+    }
+    return number + ((endpoint & USBX_ENDPOINT_IN) ? 16 : 0);
+}
+
+/* xorshift64* (lock held) */
+static uint64_t next_random(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545f4914f6cdd1dULL;
+}
+
+static int chance(unsigned int ppm) {
+    return ppm > 0 && next_random() % 1000000U < ppm;
+}
+
+static struct fault_device *find_device(const struct usbx_device *dev) {
+    for (struct fault_device *state = fault_devices; state; state = state->next) {
+        if (state->dev == dev) {
+            return state;
+        }
+    }
+    return NULL;
+}
+
+static const struct usbx_fault_rule *rule_for(const struct fault_device *state,
+                                              unsigned char endpoint) {
+    int index = 1 + endpoint_slot(endpoint);
+    if (state->has_rule[index]) {
+        return &state->rules[index];
+    }
+    return state->has_rule[0] ? &state->rules[0] : NULL;
+}
+
+static unsigned int draw_latency(const struct usbx_fault_rule *rule) {
+    uint64_t latency = rule->latency_us;
+    if (rule->jitter_us) {
+        latency += next_random() % ((uint64_t)rule->jitter_us + 1);
+    }
+    if (chance(rule->tail_ppm)) {
+        latency += rule->tail_us;
+    }
+    return latency > 0xffffffffULL ? 0xffffffffU : (unsigned int)latency;
+}
+
+/* Queue a transfer for delivery, after the ones of its endpoint (lock held) */
+static void enqueue(struct fault_device *state, struct tracked *entry, uint64_t due_us) {
+    uint64_t *last = &state->last_due_us[endpoint_slot(entry->xfer->endpoint)];
+    if (due_us < *last) {
+        due_us = *last;
+    }
+    *last = due_us;
+    entry->due_us = due_us;
+    entry->queued = 1;
+
+    struct tracked **link = &state->queue;
+    while (*link && (*link)->due_us <= due_us) {
+        link = &(*link)->next;
+    }
+    entry->next = *link;
+    *link = entry;
+    pthread_cond_signal(&state->cond);
+}
+
+static void *delivery_thread(void *arg) {
+    struct fault_device *state = arg;
+
+    pthread_mutex_lock(&fault_lock);
+    for (;;) {
+        uint64_t now = usbx_now_us();
+        struct tracked *entry = state->queue;
+        if (!entry && state->stopping) {
+            break;
+        }
+        if (!entry || (entry->due_us > now && !state->stopping)) {
+            if (entry) {
+                struct timespec ts;
+                ts.tv_sec = (time_t)(entry->due_us / 1000000ULL);
+                ts.tv_nsec = (long)(entry->due_us % 1000000ULL) * 1000L;
+                pthread_cond_timedwait(&state->cond, &fault_lock, &ts);
+            } else {
+                pthread_cond_wait(&state->cond, &fault_lock);
+            }
+            continue;
+        }
+        state->queue = entry->next;
+        HASH_DEL(state->tracked, entry);
+        struct usbx_transfer *xfer = entry->xfer;
+        free(entry);
+
+        // The completion hook lets this thread's deliveries through
+        pthread_mutex_unlock(&fault_lock);
+        usbx_transfer_complete(xfer);
+        pthread_mutex_lock(&fault_lock);
+    }
+    pthread_mutex_unlock(&fault_lock);
+    return NULL;
+}
+
+/* Rules state of a device, created with its thread on first use (lock held) */
+static struct fault_device *get_device(struct usbx_device *dev) {
+    struct fault_device *state = find_device(dev);
+    if (state) {
+        return state;
+    }
+    state = calloc(1, sizeof(*state));
+    if (!state) {
+        return NULL;
+    }
+    state->dev = dev;
+    usbx_cond_init_monotonic(&state->cond);
+    if (pthread_create(&state->thread, NULL, delivery_thread, state) != 0) {
+        pthread_cond_destroy(&state->cond);
+        free(state);
+        return NULL;
+    }
+    state->next = fault_devices;
+    fault_devices = state;
+    __atomic_or_fetch(&dev->taps, USBX_TAP_FAULT, __ATOMIC_RELEASE);
+    return state;
+}
+
+int usbx_fault_set_rule(struct usbx_device *dev, const struct usbx_fault_rule *rule) {
+    if (!dev || !rule || rule->endpoint < USBX_FAULT_ALL_ENDPOINTS || rule->endpoint > 0xff ||
+        rule->tail_ppm > 1000000 || rule->error_ppm > 1000000 ||
+        rule->disconnect_ppm > 1000000 || rule->error_status <= USBX_TRANSFER_COMPLETED ||
+        rule->error_status > USBX_TRANSFER_OVERFLOW) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    int index = rule->endpoint == USBX_FAULT_ALL_ENDPOINTS
+                ? 0 : 1 + endpoint_slot((unsigned char)rule->endpoint);
+    int empty = !rule->latency_us && !rule->jitter_us && !(rule->tail_ppm && rule->tail_us) &&
+                !rule->error_ppm && !rule->disconnect_ppm;
+
+    pthread_mutex_lock(&fault_lock);
+    struct fault_device *state = empty ? find_device(dev) : get_device(dev);
+    if (state) {
+        state->rules[index] = *rule;
+        state->has_rule[index] = !empty;
+    }
+    pthread_mutex_unlock(&fault_lock);
+    return state || empty ? USBX_SUCCESS : USBX_ERROR_NO_MEM;
+}
+
+int usbx_fault_get_rules(struct usbx_device *dev, struct usbx_fault_rule *rules, int max) {
+    int count = 0;
+    pthread_mutex_lock(&fault_lock);
+    struct fault_device *state = find_device(dev);
+    for (int i = 0; state && i < USBX_FAULT_MAX_RULES; i++) {
+        if (state->has_rule[i]) {
+            if (count < max) {
+                rules[count] = state->rules[i];
+            }
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&fault_lock);
+    return count;
+}
+
+int usbx_fault_disconnect(struct usbx_device *dev) {
+    pthread_mutex_lock(&fault_lock);
+    struct fault_device *state = get_device(dev);
+    if (state && !state->stats.disconnected) {
+        state->stats.disconnected = 1;
+        state->stats.disconnects++;
+    }
+    pthread_mutex_unlock(&fault_lock);
+    return state ? USBX_SUCCESS : USBX_ERROR_NO_MEM;
+}
+
+void usbx_fault_release(struct usbx_device *dev) {
+    pthread_mutex_lock(&fault_lock);
+    struct fault_device *state = find_device(dev);
+    if (!state) {
+        pthread_mutex_unlock(&fault_lock);
+        return;
+    }
+    __atomic_and_fetch(&dev->taps, ~USBX_TAP_FAULT, __ATOMIC_RELEASE);
+    struct fault_device **link = &fault_devices;
+    while (*link != state) {
+        link = &(*link)->next;
+    }
+    *link = state->next;
+    state->stopping = 1;
+    pthread_cond_signal(&state->cond);
+    pthread_mutex_unlock(&fault_lock);
+
+    // The thread delivers what is still queued, then exits
+    pthread_join(state->thread, NULL);
+    struct tracked *entry, *tmp;
+    HASH_ITER(hh, state->tracked, entry, tmp) {
+        HASH_DEL(state->tracked, entry);
+        free(entry);
+    }
+    pthread_cond_destroy(&state->cond);
+    free(state);
+}
+
+int usbx_fault_clear(struct usbx_device *dev) {
+    usbx_fault_release(dev);
+    return USBX_SUCCESS;
+}
+
+int usbx_fault_get_stats(struct usbx_device *dev, struct usbx_fault_stats *stats) {
+    pthread_mutex_lock(&fault_lock);
+    struct fault_device *state = find_device(dev);
+    if (state) {
+        *stats = state->stats;
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+    pthread_mutex_unlock(&fault_lock);
+    return USBX_SUCCESS;
+}
+
+int usbx_fault_seed(uint64_t seed) {
+    pthread_mutex_lock(&fault_lock);
+    random_state = seed ? seed : DEFAULT_SEED;
+    pthread_mutex_unlock(&fault_lock);
+    return USBX_SUCCESS;
+}
+
+int usbx_fault_submit(struct usbx_transfer *xfer) {
+    pthread_mutex_lock(&fault_lock);
+    struct fault_device *state = find_device(xfer->dev);
+    if (!state) {
+        pthread_mutex_unlock(&fault_lock);
+        return USBX_FAULT_PASS;
+    }
+    state->stats.transfers++;
+    if (state->stats.disconnected) {
+        state->stats.rejected++;
+        pthread_mutex_unlock(&fault_lock);
+        return USBX_ERROR_NO_DEVICE;
+    }
+    // Left behind by a submission the backend refused
+    struct tracked *entry;
+    HASH_FIND_PTR(state->tracked, &xfer, entry);
+    if (entry && !entry->queued) {
+        HASH_DEL(state->tracked, entry);
+        free(entry);
+    }
+    const struct usbx_fault_rule *rule = rule_for(state, xfer->endpoint);
+    entry = rule ? calloc(1, sizeof(*entry)) : NULL;
+    if (!entry) {
+        // Without a rule (or memory) the transfer is left alone
+        pthread_mutex_unlock(&fault_lock);
+        return USBX_FAULT_PASS;
+    }
+    entry->xfer = xfer;
+    entry->submit_us = usbx_now_us();
+    entry->latency_us = draw_latency(rule);
+    HASH_ADD_PTR(state->tracked, xfer, entry);
+
+    // The transfer that unplugs the device is lost with it
+    if (chance(rule->disconnect_ppm)) {
+        state->stats.disconnected = 1;
+        state->stats.disconnects++;
+    }
+    int result = USBX_FAULT_PASS;
+    if (chance(rule->error_ppm)) {
+        state->stats.errors++;
+        entry->injected = 1;
+        xfer->status = rule->error_status;
+        xfer->actual_length = 0;
+        enqueue(state, entry, entry->submit_us + entry->latency_us);
+        result = USBX_SUCCESS;
+    }
+    pthread_mutex_unlock(&fault_lock);
+    return result;
+}
+
+int usbx_fault_complete(struct usbx_transfer *xfer) {
+    pthread_mutex_lock(&fault_lock);
+    struct fault_device *state = find_device(xfer->dev);
+    if (!state || pthread_equal(pthread_self(), state->thread)) {
+        pthread_mutex_unlock(&fault_lock);
+        return 0;
+    }
+    if (state->stats.disconnected) {
+        xfer->status = USBX_TRANSFER_NO_DEVICE;
+    }
+    struct tracked *entry;
+    HASH_FIND_PTR(state->tracked, &xfer, entry);
+    if (!entry) {
+        pthread_mutex_unlock(&fault_lock);
+        return 0;
+    }
+    uint64_t now = usbx_now_us();
+    uint64_t due = now + entry->latency_us;
+    uint64_t *last = &state->last_due_us[endpoint_slot(xfer->endpoint)];
+    if (entry->latency_us == 0 && *last <= now) {
+        HASH_DEL(state->tracked, entry);
+        free(entry);
+        pthread_mutex_unlock(&fault_lock);
+        return 0;
+    }
+    // A host would have given up at the transfer's deadline
+    uint64_t deadline = entry->submit_us + (uint64_t)xfer->timeout * 1000;
+    if (xfer->timeout && xfer->status == USBX_TRANSFER_COMPLETED && due > deadline) {
+        due = deadline > now ? deadline : now;
+        xfer->status = USBX_TRANSFER_TIMED_OUT;
+        state->stats.timeouts++;
+    }
+    state->stats.delayed++;
+    enqueue(state, entry, due);
+    pthread_mutex_unlock(&fault_lock);
+    return 1;
+}
+
+int usbx_fault_cancel(struct usbx_transfer *xfer) {
+    pthread_mutex_lock(&fault_lock);
+    struct fault_device *state = find_device(xfer->dev);
+    struct tracked *entry = NULL;
+    if (state) {
+        HASH_FIND_PTR(state->tracked, &xfer, entry);
+    }
+    int result = USBX_FAULT_PASS;
+    if (entry && entry->injected) {
+        // Never reached the device: cancelling it is up to the fault layer
+        struct tracked **link = &state->queue;
+        while (*link != entry) {
+            link = &(*link)->next;
+        }
+        *link = entry->next;
+        xfer->status = USBX_TRANSFER_CANCELLED;
+        enqueue(state, entry, usbx_now_us());
+        result = USBX_SUCCESS;
+    } else if (entry && entry->queued) {
+        result = USBX_ERROR_NOT_FOUND;      // the device already completed it
+    }
+    pthread_mutex_unlock(&fault_lock);
+    return result;
+}
+
+#else
+
+int usbx_fault_set_rule(struct usbx_device *dev, const struct usbx_fault_rule *rule) {
+    (void)dev;
+    (void)rule;
+    return USBX_ERROR_NOT_SUPPORTED;
+}
+
+int usbx_fault_get_rules(struct usbx_device *dev, struct usbx_fault_rule *rules, int max) {
+    (void)dev;
+    (void)rules;
+    (void)max;
+    return USBX_ERROR_NOT_SUPPORTED;
+}
+
+int usbx_fault_disconnect(struct usbx_device *dev) {
+    (void)dev;
+    return USBX_ERROR_NOT_SUPPORTED;
+}
+
+int usbx_fault_clear(struct usbx_device *dev) {
+    (void)dev;
+    return USBX_ERROR_NOT_SUPPORTED;
+}
+
+int usbx_fault_get_stats(struct usbx_device *dev, struct usbx_fault_stats *stats) {
+    (void)dev;
+    memset(stats, 0, sizeof(*stats));
+    return USBX_ERROR_NOT_SUPPORTED;
+}
+
+int usbx_fault_seed(uint64_t seed) {
+    (void)seed;
+    return USBX_ERROR_NOT_SUPPORTED;
+}
+
+#endif // USBX_FAULT_INJECTION
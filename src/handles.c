@@ -0,0 +1,198 @@
+/**
+ * @file handles.c
+ * @brief Process-wide table of open device handles
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdlib.h>
+
+#include "usbx_handles.h"
+#include "usbx_breaker.h"
+#include "usbx_cdc.h"
+#include "usbx_interrupt.h"
+#include "usbx_iso.h"
+#include "usbx_latency.h"
+#include "usbx_msc.h"
+#include "usbx_pubsub.h"
+#include "usbx_retry.h"
+#include "usbx_sched.h"
+#include "usbx_stats.h"
+#include "usbx_trace.h"
+
+/** @brief Device handle hash table */
+static struct usbx_handle *device_handles = NULL;
+
+/** @brief Guards device_handles, next_handle_id and every handle's refcount */
+static pthread_mutex_t handles_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Next id to hand out; ids are never reused */
+static int next_handle_id = 1;
+
+/* Stop the handle's services and release it (no references left) */
+static void destroy_handle(struct usbx_handle *handle) {
+    for (int i = 0; i < USBX_HANDLE_MAX_POLLERS; i++) {
+        usbx_interrupt_poller_destroy(handle->pollers[i]);
+        handle->pollers[i] = NULL;
+        usbx_pubsub_destroy(handle->pubsubs[i]);
+        handle->pubsubs[i] = NULL;
+    }
+    usbx_msc_close(handle->msc);
+    usbx_cdc_close(handle->cdc);
+    usbx_trace_detach(handle->dev);
+    usbx_breaker_detach(handle->dev);
+    usbx_latency_detach(handle->dev);
+    usbx_stats_detach(handle->dev);
+    usbx_sched_detach(handle->dev);
+    usbx_device_destroy(handle->dev);
+    usbx_sched_free(handle->sched);
+    usbx_stats_free(handle->stats);
+    usbx_breaker_free(handle->breaker);
+    usbx_latency_table_free(handle->latency);
+    usbx_retry_table_free(handle->retry);
+    pthread_mutex_destroy(&handle->lock);
+    free(handle);
+}
+
+int usbx_handle_add(struct usbx_device *dev, const struct usbx_device_info *info) {
+    struct usbx_handle *handle = calloc(1, sizeof(*handle));
+    if (handle) {
+        handle->retry = usbx_retry_table_create();
+        handle->breaker = usbx_breaker_create();
+        handle->latency = usbx_latency_table_create();
+        handle->stats = usbx_stats_create();
+        handle->sched = usbx_sched_create();
+    }
+    if (!handle || !handle->retry || !handle->breaker || !handle->latency || !handle->stats ||
+        !handle->sched) {
+        if (handle) {
+            usbx_retry_table_free(handle->retry);
+            usbx_breaker_free(handle->breaker);
+            usbx_latency_table_free(handle->latency);
+            usbx_stats_free(handle->stats);
+            usbx_sched_free(handle->sched);
+        }
+        free(handle);
+        return USBX_ERROR_NO_MEM;
+    }
+    handle->dev = dev;
+    if (info) {
+        handle->info = *info;
+        handle->info.serial[USBX_HANDLE_SERIAL_MAX - 1] = '\0';
+    } else {
+        handle->info.bus = -1;
+        handle->info.address = -1;
+    }
+    usbx_breaker_attach(handle->breaker, dev);
+    usbx_latency_attach(handle->latency, dev);
+    usbx_stats_attach(handle->stats, dev);
+    usbx_sched_attach(handle->sched, dev);
+    handle->refcount = 1;           // the table's own reference
+    pthread_mutex_init(&handle->lock, NULL);
+
+    pthread_mutex_lock(&handles_mutex);
+    handle->handle_id = next_handle_id++;
+    HASH_ADD_INT(device_handles, handle_id, handle);
+    int handle_id = handle->handle_id;
+    pthread_mutex_unlock(&handles_mutex);
+    usbx_trace_attach(dev, handle_id);
+    return handle_id;
+}
+
+struct usbx_handle *usbx_handle_get(int handle_id) {
+    struct usbx_handle *handle = NULL;
+
+    pthread_mutex_lock(&handles_mutex);
+    HASH_FIND_INT(device_handles, &handle_id, handle);
+    if (handle) {
+        handle->refcount++;
+    }
+    pthread_mutex_unlock(&handles_mutex);
+    return handle;
+}
+
+void usbx_handle_put(struct usbx_handle *handle) {
+    if (!handle) {
+        return;
+    }
+
+    pthread_mutex_lock(&handles_mutex);
+    int last = --handle->refcount == 0;
+    pthread_mutex_unlock(&handles_mutex);
+    if (last) {
+        destroy_handle(handle);
+    }
+}
+
+int usbx_handle_remove(int handle_id) {
+    struct usbx_handle *handle = NULL;
+
+    pthread_mutex_lock(&handles_mutex);
+    HASH_FIND_INT(device_handles, &handle_id, handle);
+    if (handle) {
+        HASH_DEL(device_handles, handle);
+        handle->closed = 1;
+    }
+    pthread_mutex_unlock(&handles_mutex);
+
+    if (!handle) {
+        return USBX_ERROR_NOT_FOUND;
+    }
+
+    pthread_mutex_lock(&handle->lock);
+    for (int i = 0; i < USBX_HANDLE_MAX_POLLERS; i++) {
+        if (handle->pollers[i]) {
+            usbx_interrupt_poller_stop(handle->pollers[i]);
+        }
+        if (handle->pubsubs[i]) {
+            usbx_pubsub_stop(handle->pubsubs[i]);
+        }
+        if (handle->iso_streams[i]) {
+            usbx_iso_stream_stop(handle->iso_streams[i]);
+        }
+        if (handle->iso_out_streams[i]) {
+            usbx_iso_stream_stop(handle->iso_out_streams[i]);
+        }
+    }
+    if (handle->cdc) {
+        usbx_cdc_stop(handle->cdc);
+    }
+    pthread_mutex_unlock(&handle->lock);
+    usbx_handle_put(handle);        // drop the table's reference
+    return USBX_SUCCESS;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+int usbx_handle_list(int *ids, int max) {
+    struct usbx_handle *handle, *tmp;
+    int count = 0;
+
+    pthread_mutex_lock(&handles_mutex);
+    HASH_ITER(hh, device_handles, handle, tmp) {
+        if (count < max) {
+            ids[count] = handle->handle_id;
+        }
+        count++;
+    }
+    pthread_mutex_unlock(&handles_mutex);
+
+    qsort(ids, (size_t)(count < max ? count : max), sizeof(int), compare_ids);
+    return count;
+}
+
+void usbx_handle_remove_all(void) {
+    for (;;) {
+        pthread_mutex_lock(&handles_mutex);
+        int handle_id = device_handles ? device_handles->handle_id : 0;
+        pthread_mutex_unlock(&handles_mutex);
+        if (handle_id == 0) {
+            break;
+        }
+        usbx_handle_remove(handle_id);
+    }
+}
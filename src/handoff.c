@@ -0,0 +1,209 @@
+/**
+ * @file handoff.c
+ * @brief Passing listening sockets to a successor process (see usbx_handoff.h)
+ *
+ * The predecessor sends a 4-byte tag with the descriptors attached and the
+ * successor answers with one byte once it serves on them.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "usbx_backend.h"
+#include "usbx_handoff.h"
+#include "usbx_util.h"
+
+#define HANDOFF_TAG "UXH1"
+#define HANDOFF_READY 'R'
+
+/* Wait until fd is readable within the deadline; USBX_SUCCESS, USBX_ERROR_TIMEOUT or _IO */
+static int wait_readable(int fd, uint64_t deadline_us) {
+    for (;;) {
+        uint64_t now = usbx_now_us();
+        if (now >= deadline_us) {
+            return USBX_ERROR_TIMEOUT;
+        }
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int ready = poll(&pfd, 1, (int)((deadline_us - now + 999) / 1000));
+        if (ready > 0) {
+            return USBX_SUCCESS;
+        }
+        if (ready < 0 && errno != EINTR) {
+            return USBX_ERROR_IO;
+        }
+    }
+}
+
+static int make_address(const char *path, struct sockaddr_un *addr) {
+    if (!path || strlen(path) >= sizeof(addr->sun_path)) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return USBX_SUCCESS;
+}
+
+/* Keep a handoff socket out of processes started by exec, such as the successor */
+static int set_cloexec(int fd) {
+    int flags = fcntl(fd, F_GETFD);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+int usbx_handoff_listen(struct usbx_handoff *handoff, const char *path) {
+    struct sockaddr_un addr;
+
+    handoff->listener = -1;
+    if (make_address(path, &addr) != USBX_SUCCESS || strlen(path) >= sizeof(handoff->path)) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return USBX_ERROR_IO;
+    }
+    if (set_cloexec(fd) < 0) {
+        close(fd);
+        return USBX_ERROR_IO;
+    }
+    unlink(path);
+    // Only this user may connect: the sockets passed carry the service's port
+    mode_t mask = umask(077);
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (bound < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return USBX_ERROR_IO;
+    }
+    handoff->listener = fd;
+    strcpy(handoff->path, path);
+    return USBX_SUCCESS;
+}
+
+int usbx_handoff_send(struct usbx_handoff *handoff, const int *fds, int num_fds,
+                      unsigned int timeout_ms) {
+    uint64_t deadline = usbx_now_us() + (uint64_t)timeout_ms * 1000;
+
+    if (handoff->listener < 0 || num_fds < 1 || num_fds > USBX_HANDOFF_MAX_FDS) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    int result = wait_readable(handoff->listener, deadline);
+    if (result != USBX_SUCCESS) {
+        return result;
+    }
+    int conn = accept(handoff->listener, NULL, NULL);
+    if (conn < 0) {
+        return USBX_ERROR_IO;
+    }
+    set_cloexec(conn);
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * USBX_HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    char tag[] = HANDOFF_TAG;
+    struct iovec iov = {.iov_base = tag, .iov_len = sizeof(tag) - 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)num_fds);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)num_fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t)num_fds);
+
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != (ssize_t)iov.iov_len) {
+        close(conn);
+        return USBX_ERROR_IO;
+    }
+    result = wait_readable(conn, deadline);
+    char answer = 0;
+    if (result == USBX_SUCCESS && (read(conn, &answer, 1) != 1 || answer != HANDOFF_READY)) {
+        result = USBX_ERROR_IO;             // the successor failed before serving
+    }
+    close(conn);
+    return result;
+}
+
+void usbx_handoff_close(struct usbx_handoff *handoff) {
+    if (handoff->listener >= 0) {
+        close(handoff->listener);
+        unlink(handoff->path);
+        handoff->listener = -1;
+    }
+}
+
+int usbx_handoff_receive(const char *path, int *fds, int max_fds, unsigned int timeout_ms,
+                         int *conn) {
+    uint64_t deadline = usbx_now_us() + (uint64_t)timeout_ms * 1000;
+    struct sockaddr_un addr;
+
+    if (make_address(path, &addr) != USBX_SUCCESS || max_fds < 1) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return USBX_ERROR_IO;
+    }
+    set_cloexec(fd);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return USBX_ERROR_IO;
+    }
+    int result = wait_readable(fd, deadline);
+    if (result != USBX_SUCCESS) {
+        close(fd);
+        return result;
+    }
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * USBX_HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    char tag[sizeof(HANDOFF_TAG) - 1];
+    struct iovec iov = {.iov_base = tag, .iov_len = sizeof(tag)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t got = recvmsg(fd, &msg, 0);
+    struct cmsghdr *cmsg = got == (ssize_t)sizeof(tag) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || memcmp(tag, HANDOFF_TAG, sizeof(tag)) != 0 || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS) {
+        close(fd);
+        return USBX_ERROR_IO;
+    }
+
+    int received = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    int passed[USBX_HANDOFF_MAX_FDS];
+    memcpy(passed, CMSG_DATA(cmsg), sizeof(int) * (size_t)received);
+    for (int i = max_fds; i < received; i++) {
+        close(passed[i]);                   // more than the caller can take
+    }
+    received = received < max_fds ? received : max_fds;
+    memcpy(fds, passed, sizeof(int) * (size_t)received);
+    *conn = fd;
+    return received;
+}
+
+int usbx_handoff_ready(int conn) {
+    char answer = HANDOFF_READY;
+    int result = send(conn, &answer, 1, MSG_NOSIGNAL) == 1 ? USBX_SUCCESS : USBX_ERROR_IO;
+    close(conn);
+    return result;
+}
@@ -0,0 +1,361 @@
+/**
+ * @file http.c
+ * @brief Transport-independent HTTP request router
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "usbx_backend.h"
+#include "usbx_buf.h"
+#include "usbx_http.h"
+#include "usbx_quota.h"
+#include "usbx_sched.h"
+#include "usbx_trace.h"
+#include "usbx_util.h"
+
+/** @brief One registered route */
+struct route {
+    const char *method;
+    const char *pattern;
+    usbx_http_handler handler;
+    void *cls;
+    int streams_body;            // registered with usbx_http_route_streaming()
+    struct route *next;
+};
+
+struct usbx_http_router {
+    struct route *routes;        // registration order
+    struct route **tail;
+};
+
+struct usbx_http_router *usbx_http_router_create(void) {
+    struct usbx_http_router *router = calloc(1, sizeof(*router));
+    if (router) {
+        router->tail = &router->routes;
+    }
+    return router;
+}
+
+void usbx_http_router_destroy(struct usbx_http_router *router) {
+    if (!router) {
+        return;
+    }
+    struct route *route = router->routes;
+    while (route) {
+        struct route *next = route->next;
+        free(route);
+        route = next;
+    }
+    free(router);
+}
+
+static int add_route(struct usbx_http_router *router, const char *method, const char *pattern,
+                     usbx_http_handler handler, void *cls, int streams_body) {
+    int params = 0;
+    for (const char *p = pattern; *p; p++) {
+        params += *p == '{';
+    }
+    if (params > USBX_HTTP_MAX_PARAMS) {
+        return -1;
+    }
+
+    struct route *route = calloc(1, sizeof(*route));
+    if (!route) {
+        return -1;
+    }
+    route->method = method;
+    route->pattern = pattern;
+    route->handler = handler;
+    route->cls = cls;
+    route->streams_body = streams_body;
+    *router->tail = route;
+    router->tail = &route->next;
+    return 0;
+}
+
+int usbx_http_route(struct usbx_http_router *router, const char *method, const char *pattern,
+                    usbx_http_handler handler, void *cls) {
+    return add_route(router, method, pattern, handler, cls, 0);
+}
+
+int usbx_http_route_streaming(struct usbx_http_router *router, const char *method,
+                              const char *pattern, usbx_http_handler handler, void *cls) {
+    return add_route(router, method, pattern, handler, cls, 1);
+}
+
+/*
+ * Match @p path against @p pattern segment by segment, copying parameter
+ * values into the request's storage. Returns 1 on a match.
+ */
+static int match_route(const char *pattern, const char *path, struct usbx_http_request *req) {
+    size_t used = 0;
+
+    req->num_params = 0;
+    while (*pattern && *path) {
+        if (*pattern == '{') {
+            const char *name_end = strchr(pattern, '}');
+            size_t value_length = strcspn(path, "/");
+            size_t name_length = (size_t)(name_end - pattern - 1);
+            if (value_length == 0 ||
+                used + name_length + value_length + 2 > sizeof(req->param_storage)) {
+                return 0;
+            }
+
+            char *name = req->param_storage + used;
+            memcpy(name, pattern + 1, name_length);
+            name[name_length] = '\0';
+            used += name_length + 1;
+            char *value = req->param_storage + used;
+            memcpy(value, path, value_length);
+            value[value_length] = '\0';
+            used += value_length + 1;
+
+            req->params[req->num_params].name = name;
+            req->params[req->num_params].value = value;
+            req->num_params++;
+            pattern = name_end + 1;
+            path += value_length;
+        } else if (*pattern == *path) {
+            pattern++;
+            path++;
+        } else {
+            return 0;
+        }
+    }
+    return *pattern == '\0' && *path == '\0';
+}
+
+/* Find the route of a request and run its handler */
+static void route_request(struct usbx_http_router *router, struct usbx_http_request *req,
+                          struct usbx_http_response *resp) {
+    int path_known = 0;
+
+    memset(resp, 0, sizeof(*resp));
+    resp->status = 200;
+    resp->content_type = "application/json";
+
+    for (struct route *route = router->routes; route; route = route->next) {
+        if (!match_route(route->pattern, req->path, req)) {
+            continue;
+        }
+        if (strcmp(route->method, req->method) != 0) {
+            path_known = 1;
+            continue;
+        }
+        route->handler(route->cls, req, resp);
+        return;
+    }
+
+    req->num_params = 0;
+    if (path_known) {
+        usbx_http_set_error(resp, 405, "Method not allowed", 0);
+    } else {
+        usbx_http_set_error(resp, 404, "Not found", 0);
+    }
+}
+
+int usbx_http_route_streams_body(struct usbx_http_router *router, const char *method,
+                                 const char *path) {
+    struct usbx_http_request scratch;   // receives the path parameters
+
+    for (struct route *route = router->routes; route; route = route->next) {
+        if (strcmp(route->method, method) == 0 && match_route(route->pattern, path, &scratch)) {
+            return route->streams_body;
+        }
+    }
+    return 0;
+}
+
+/* Route a request its client's quota admits, else answer 429 */
+static void admit_request(struct usbx_http_router *router, struct usbx_http_request *req,
+                          struct usbx_http_response *resp) {
+    unsigned int retry_after_ms = 0;
+    char seconds[16];
+
+    if (usbx_quota_admit(req->client_id, req->address, &retry_after_ms) == USBX_SUCCESS) {
+        route_request(router, req, resp);
+        return;
+    }
+    memset(resp, 0, sizeof(*resp));
+    usbx_http_set_error(resp, 429, "Quota exceeded", USBX_ERROR_BUSY);
+    snprintf(seconds, sizeof(seconds), "%u", (retry_after_ms + 999) / 1000);
+    usbx_http_add_header(resp, "Retry-After", seconds);
+}
+
+void usbx_http_dispatch(struct usbx_http_router *router, struct usbx_http_request *req,
+                        struct usbx_http_response *resp) {
+    // Transfers the handler submits on this thread are queued and charged as this client's
+    usbx_sched_set_client(req->client_id);
+    if (!usbx_trace_active()) {
+        admit_request(router, req, resp);
+    } else {
+        uint64_t start = usbx_now_us();
+        admit_request(router, req, resp);
+        usbx_trace_request(req, resp->status, start);
+    }
+    usbx_quota_set_current(NULL);
+    usbx_sched_set_client(NULL);
+}
+
+void usbx_http_response_free(struct usbx_http_response *resp) {
+    for (int i = 0; i < resp->num_headers; i++) {
+        free((char *)resp->headers[i].name);
+        free((char *)resp->headers[i].value);
+    }
+    resp->num_headers = 0;
+    free(resp->body);
+    resp->body = NULL;
+    if (resp->reader_free) {
+        resp->reader_free(resp->reader_cls);
+    }
+    resp->reader = NULL;
+    resp->reader_cls = NULL;
+    resp->reader_free = NULL;
+}
+
+static const char *find_pair(const struct usbx_http_pair *pairs, int count, const char *name,
+                             int ignore_case) {
+    for (int i = 0; i < count; i++) {
+        int equal = ignore_case ? strcasecmp(pairs[i].name, name) == 0
+                                : strcmp(pairs[i].name, name) == 0;
+        if (equal) {
+            return pairs[i].value;
+        }
+    }
+    return NULL;
+}
+
+const char *usbx_http_arg(const struct usbx_http_request *req, const char *name) {
+    return find_pair(req->args, req->num_args, name, 0);
+}
+
+long usbx_http_arg_long(const struct usbx_http_request *req, const char *name, long fallback) {
+    const char *value = usbx_http_arg(req, name);
+    char *end;
+
+    if (!value || !*value) {
+        return fallback;
+    }
+    long result = strtol(value, &end, 0);
+    return *end == '\0' ? result : fallback;
+}
+
+const char *usbx_http_header(const struct usbx_http_request *req, const char *name) {
+    return find_pair(req->headers, req->num_headers, name, 1);
+}
+
+long usbx_http_read_body(const struct usbx_http_request *req, uint64_t pos, void *buf,
+                         size_t max) {
+    if (req->body_source) {
+        return req->body_source(req->body_cls, buf, max);
+    }
+    if (pos >= req->body_length) {
+        return 0;
+    }
+    size_t length = req->body_length - (size_t)pos;
+    if (length > max) {
+        length = max;
+    }
+    memcpy(buf, req->body + pos, length);
+    return (long)length;
+}
+
+const char *usbx_http_param(const struct usbx_http_request *req, const char *name) {
+    return find_pair(req->params, req->num_params, name, 0);
+}
+
+int usbx_http_add_header(struct usbx_http_response *resp, const char *name, const char *value) {
+    if (resp->num_headers >= USBX_HTTP_MAX_HEADERS) {
+        return -1;
+    }
+    char *name_copy = strdup(name);
+    char *value_copy = strdup(value);
+    if (!name_copy || !value_copy) {
+        free(name_copy);
+        free(value_copy);
+        return -1;
+    }
+    resp->headers[resp->num_headers].name = name_copy;
+    resp->headers[resp->num_headers].value = value_copy;
+    resp->num_headers++;
+    return 0;
+}
+
+void usbx_http_set_json(struct usbx_http_response *resp, int status, char *body, size_t length) {
+    static const char out_of_memory[] = "{\"error\": \"Out of memory\"}";
+
+    free(resp->body);
+    resp->content_type = "application/json";
+    if (!body) {
+        resp->status = 500;
+        resp->body = strdup(out_of_memory);
+        resp->body_length = resp->body ? sizeof(out_of_memory) - 1 : 0;
+        return;
+    }
+    resp->status = status;
+    resp->body = body;
+    resp->body_length = length;
+}
+
+void usbx_http_set_json_buf(struct usbx_http_response *resp, int status, struct usbx_buf *buf) {
+    size_t length;
+    char *body = usbx_buf_detach(buf, &length);
+    usbx_http_set_json(resp, status, body, length);
+}
+
+void usbx_http_set_error(struct usbx_http_response *resp, int status, const char *message,
+                         int code) {
+    struct usbx_buf buf;
+
+    usbx_buf_init(&buf);
+    usbx_buf_printf(&buf, "{\"error\": ");
+    usbx_buf_json_string(&buf, message);
+    if (code != 0) {
+        usbx_buf_printf(&buf, ", \"code\": %d, \"name\": \"%s\"", code, usbx_error_name(code));
+    }
+    usbx_buf_printf(&buf, "}");
+    usbx_http_set_json_buf(resp, status, &buf);
+}
+
+int usbx_http_status_for_error(int error) {
+    switch (error) {
+    case USBX_SUCCESS:
+        return 200;
+    case USBX_ERROR_INVALID_PARAM:
+        return 400;
+    case USBX_ERROR_ACCESS:
+        return 403;
+    case USBX_ERROR_NOT_FOUND:
+        return 404;
+    case USBX_ERROR_NO_DEVICE:
+        return 410;
+    case USBX_ERROR_BUSY:
+        return 409;
+    case USBX_ERROR_TIMEOUT:
+        return 504;
+    case USBX_ERROR_NOT_SUPPORTED:
+        return 501;
+    case USBX_ERROR_NO_MEM:
+        return 503;
+    default:
+        return 502;   // the device misbehaved
+    }
+}
+
+void usbx_http_set_reader(struct usbx_http_response *resp, const char *content_type,
+                          usbx_http_reader reader, void *cls, usbx_http_reader_free reader_free) {
+    free(resp->body);
+    resp->body = NULL;
+    resp->body_length = 0;
+    resp->content_type = content_type;
+    resp->reader = reader;
+    resp->reader_cls = cls;
+    resp->reader_free = reader_free;
+}
@@ -0,0 +1,497 @@
+/**
+ * @file http_mhd.c
+ * @brief libmicrohttpd front end for the request router
+ *
+ * Runs one thread per connection so that handlers may block on device I/O
+ * and streaming readers may wait for events without stalling other
+ * clients. The request body is accumulated before dispatch. A body with a
+ * Content-Length reserves that size in the memory budget once, before any
+ * of it is read, so a connection never holds part of a body while waiting
+ * for the rest; a chunked body reserves as it grows. While the budget is
+ * exhausted the connection's thread waits and the socket is not read.
+ *
+ * Routes registered with usbx_http_route_streaming() are dispatched on a
+ * handler thread as soon as the headers are in, and the connection's
+ * thread feeds the body to it through a bounded pipe, so such a body is
+ * not limited by HTTP_MAX_BODY. While a trace is recording, bodies are
+ * accumulated for every route, since a recording keeps them whole.
+ *
+ * For a restart without downtime the listening socket can be taken over
+ * from a predecessor (usbx_http_server_start_socket()) and handed on after
+ * the server stops accepting (usbx_http_server_quiesce()).
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#ifdef USE_DEPS
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <microhttpd.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "usbx_backend.h"
+#include "usbx_budget.h"
+#include "usbx_http.h"
+#include "usbx_ring.h"
+#include "usbx_trace.h"
+
+#if MHD_VERSION < 0x00097002
+typedef int MHD_RESULT;
+#else
+typedef enum MHD_Result MHD_RESULT;
+#endif
+
+#if MHD_VERSION < 0x00095300
+#define MHD_USE_ITC MHD_USE_PIPE_FOR_SHUTDOWN
+#endif
+
+/** @brief Daemon flags; the inter-thread channel lets MHD_quiesce_daemon() wake the poller */
+#define DAEMON_FLAGS \
+    (MHD_USE_THREAD_PER_CONNECTION | MHD_USE_INTERNAL_POLLING_THREAD | MHD_USE_ITC)
+
+/** @brief Largest request body accepted */
+#define HTTP_MAX_BODY (64 * 1024 * 1024)
+
+/** @brief Largest number of query arguments or headers passed to handlers */
+#define HTTP_MAX_PAIRS 64
+
+/** @brief Block size used for streaming responses */
+#define HTTP_STREAM_BLOCK 16384
+
+/** @brief Body bytes buffered between the connection and a streaming handler */
+#define HTTP_BODY_PIPE_SIZE (256 * 1024)
+
+/** @brief Collected key/value pairs of one kind */
+struct pair_list {
+    struct usbx_http_pair pairs[HTTP_MAX_PAIRS];
+    int count;
+};
+
+/** @brief Request whose handler runs while the body arrives */
+struct body_stream {
+    struct usbx_http_router *router;
+    struct usbx_ring *pipe;
+    pthread_t handler;
+    int aborted;                 // the client went away before the end of the body (atomic)
+    struct usbx_http_request req;
+    struct usbx_http_response *resp;   // until the handler is joined
+    struct pair_list args;
+    struct pair_list headers;
+    char address[INET6_ADDRSTRLEN];
+};
+
+/** @brief Per-connection request state */
+struct connection_state {
+    unsigned char *body;
+    size_t body_length;
+    size_t body_capacity;
+    int too_large;
+    int over_budget;             // reservation error; the rest of the body is dropped
+    struct body_stream *stream;  // NULL unless the body is streamed to the handler
+};
+
+static struct MHD_Daemon *http_daemon = NULL;
+static int quiesced = 0;                 // the listening socket was handed to the caller
+
+static MHD_RESULT collect_pair(void *cls, enum MHD_ValueKind kind, const char *key,
+                               const char *value) {
+    struct pair_list *list = cls;
+    (void)kind;
+
+    if (list->count < HTTP_MAX_PAIRS) {
+        list->pairs[list->count].name = key;
+        list->pairs[list->count].value = value ? value : "";
+        list->count++;
+    }
+    return MHD_YES;
+}
+
+/* Reserve and allocate a body of announced size in one step (first call) */
+static int reserve_body(struct connection_state *state, uint64_t length) {
+    if (length > HTTP_MAX_BODY) {
+        state->too_large = 1;
+        return 0;
+    }
+    int reserved = usbx_budget_reserve((size_t)length);
+    if (reserved != USBX_SUCCESS) {
+        state->over_budget = reserved;
+        return 0;
+    }
+    state->body = malloc((size_t)length);
+    if (!state->body) {
+        usbx_budget_release((size_t)length);
+        return -1;
+    }
+    state->body_capacity = (size_t)length;
+    return 0;
+}
+
+static int append_body(struct connection_state *state, const char *data, size_t size) {
+    if (state->body_length + size > HTTP_MAX_BODY) {
+        state->too_large = 1;
+        return 0;
+    }
+    if (state->body_length + size > state->body_capacity) {      // chunked body
+        size_t capacity = state->body_capacity ? state->body_capacity : 4096;
+        while (capacity < state->body_length + size) {
+            capacity *= 2;
+        }
+        int reserved = usbx_budget_reserve(capacity - state->body_capacity);
+        if (reserved != USBX_SUCCESS) {
+            state->over_budget = reserved;
+            return 0;
+        }
+        unsigned char *body = realloc(state->body, capacity);
+        if (!body) {
+            usbx_budget_release(capacity - state->body_capacity);
+            return -1;
+        }
+        state->body = body;
+        state->body_capacity = capacity;
+    }
+    memcpy(state->body + state->body_length, data, size);
+    state->body_length += size;
+    return 0;
+}
+
+/* Peer address as text, used as the client identity without an API key */
+static void client_address(struct MHD_Connection *connection, char *out, size_t size) {
+    const union MHD_ConnectionInfo *info =
+        MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+
+    out[0] = '\0';
+    if (!info || !info->client_addr) {
+        return;
+    }
+    if (info->client_addr->sa_family == AF_INET) {
+        const struct sockaddr_in *addr = (const struct sockaddr_in *)info->client_addr;
+        inet_ntop(AF_INET, &addr->sin_addr, out, (socklen_t)size);
+    } else if (info->client_addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *addr = (const struct sockaddr_in6 *)info->client_addr;
+        inet_ntop(AF_INET6, &addr->sin6_addr, out, (socklen_t)size);
+    }
+}
+
+/* Fill in the parts of a request MHD has by the first call; the strings live in @p args etc. */
+static void prepare_request(struct MHD_Connection *connection, const char *url,
+                            const char *method, struct usbx_http_request *req,
+                            struct pair_list *args, struct pair_list *headers, char *address) {
+    MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND, collect_pair, args);
+    MHD_get_connection_values(connection, MHD_HEADER_KIND, collect_pair, headers);
+    client_address(connection, address, INET6_ADDRSTRLEN);
+    const char *api_key = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "X-API-Key");
+
+    memset(req, 0, sizeof(*req));
+    req->method = method;
+    req->path = url;
+    req->client_id = api_key ? api_key : address;
+    req->address = address[0] ? address : NULL;
+    req->args = args->pairs;
+    req->num_args = args->count;
+    req->headers = headers->pairs;
+    req->num_headers = headers->count;
+}
+
+/* Announced body size, or -1 if there is no Content-Length */
+static long long content_length(struct MHD_Connection *connection) {
+    const char *length = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                                     MHD_HTTP_HEADER_CONTENT_LENGTH);
+    return length ? (long long)strtoull(length, NULL, 10) : -1;
+}
+
+static int has_body(struct MHD_Connection *connection) {
+    long long length = content_length(connection);
+    if (length >= 0) {
+        return length > 0;
+    }
+    return MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                       MHD_HTTP_HEADER_TRANSFER_ENCODING) != NULL;
+}
+
+/* Body source of a streamed request: blocks on the pipe */
+static long read_pipe(void *cls, void *buf, size_t max) {
+    struct body_stream *stream = cls;
+
+    size_t n = usbx_ring_read(stream->pipe, buf, max, -1);
+    if (n > 0) {
+        return (long)n;
+    }
+    return __atomic_load_n(&stream->aborted, __ATOMIC_ACQUIRE) ? USBX_ERROR_IO : 0;
+}
+
+static void *run_handler(void *cls) {
+    struct body_stream *stream = cls;
+
+    usbx_http_dispatch(stream->router, &stream->req, stream->resp);
+    usbx_ring_close(stream->pipe);      // the rest of the body is dropped
+    return NULL;
+}
+
+static void free_stream(struct body_stream *stream) {
+    if (stream) {
+        usbx_ring_destroy(stream->pipe);
+        free(stream->resp);
+        free(stream);
+        usbx_budget_release(HTTP_BODY_PIPE_SIZE);
+    }
+}
+
+/*
+ * Dispatch a streaming route's request on its own thread. Returns NULL
+ * with @p state->over_budget set if the pipe does not fit the budget, and
+ * NULL without it if a resource is missing; the body is then accumulated
+ * as for any other route.
+ */
+static struct body_stream *start_stream(struct usbx_http_router *router,
+                                        struct MHD_Connection *connection, const char *url,
+                                        const char *method, struct connection_state *state) {
+    int reserved = usbx_budget_reserve(HTTP_BODY_PIPE_SIZE);
+    if (reserved != USBX_SUCCESS) {
+        state->over_budget = reserved;
+        return NULL;
+    }
+    struct body_stream *stream = calloc(1, sizeof(*stream));
+    if (!stream) {
+        usbx_budget_release(HTTP_BODY_PIPE_SIZE);
+        return NULL;
+    }
+    stream->router = router;
+    stream->pipe = usbx_ring_create(HTTP_BODY_PIPE_SIZE);
+    stream->resp = calloc(1, sizeof(*stream->resp));
+    if (!stream->pipe || !stream->resp) {
+        free_stream(stream);
+        return NULL;
+    }
+    prepare_request(connection, url, method, &stream->req, &stream->args, &stream->headers,
+                    stream->address);
+    stream->req.body_source = read_pipe;
+    stream->req.body_cls = stream;
+    if (pthread_create(&stream->handler, NULL, run_handler, stream) != 0) {
+        free_stream(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+/* Push upload data into the pipe; once the handler is done with the body the rest is dropped */
+static void feed_stream(struct body_stream *stream, const char *data, size_t size) {
+    size_t done = 0;
+
+    while (done < size) {
+        size_t n = usbx_ring_write(stream->pipe, data + done, size - done, -1);
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+}
+
+static void free_reader(void *cls) {
+    struct usbx_http_response *resp = cls;
+    usbx_http_response_free(resp);
+    free(resp);
+}
+
+static ssize_t call_reader(void *cls, uint64_t pos, char *buf, size_t max) {
+    struct usbx_http_response *resp = cls;
+    return resp->reader(resp->reader_cls, pos, buf, max);
+}
+
+/* Hand a filled-in response to MHD; takes ownership of @p resp */
+static MHD_RESULT send_response(struct MHD_Connection *connection,
+                                struct usbx_http_response *resp) {
+    struct MHD_Response *response;
+
+    if (resp->reader) {
+        response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, HTTP_STREAM_BLOCK,
+                                                     call_reader, resp, free_reader);
+        if (!response) {
+            free_reader(resp);
+            return MHD_NO;
+        }
+    } else {
+        response = MHD_create_response_from_buffer(resp->body_length, resp->body,
+                                                   MHD_RESPMEM_MUST_FREE);
+        if (!response) {
+            usbx_http_response_free(resp);
+            free(resp);
+            return MHD_NO;
+        }
+        resp->body = NULL;          // owned by MHD now
+    }
+
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, resp->content_type);
+    for (int i = 0; i < resp->num_headers; i++) {
+        MHD_add_response_header(response, resp->headers[i].name, resp->headers[i].value);
+    }
+    int status = resp->status;
+    if (!resp->reader) {
+        usbx_http_response_free(resp);
+        free(resp);
+    }
+
+    MHD_RESULT result = MHD_queue_response(connection, (unsigned int)status, response);
+    MHD_destroy_response(response);
+    return result;
+}
+
+static MHD_RESULT handle_connection(void *cls, struct MHD_Connection *connection,
+                                    const char *url, const char *method, const char *version,
+                                    const char *upload_data, size_t *upload_data_size,
+                                    void **con_cls) {
+    struct usbx_http_router *router = cls;
+    struct connection_state *state = *con_cls;
+    (void)version;
+
+    if (!state) {
+        state = calloc(1, sizeof(*state));
+        if (!state) {
+            return MHD_NO;
+        }
+        *con_cls = state;
+        if (!usbx_trace_active() && usbx_http_route_streams_body(router, method, url) &&
+            has_body(connection)) {
+            state->stream = start_stream(router, connection, url, method, state);
+        }
+        long long length = content_length(connection);
+        if (!state->stream && !state->over_budget && length > 0 &&
+            reserve_body(state, (uint64_t)length) < 0) {
+            return MHD_NO;
+        }
+        return MHD_YES;
+    }
+    if (*upload_data_size > 0) {
+        if (state->stream) {
+            feed_stream(state->stream, upload_data, *upload_data_size);
+        } else if (!state->too_large && !state->over_budget &&
+            append_body(state, upload_data, *upload_data_size) < 0) {
+            return MHD_NO;
+        }
+        *upload_data_size = 0;
+        return MHD_YES;
+    }
+    if (state->stream) {
+        usbx_ring_close(state->stream->pipe);      // end of the body
+        pthread_join(state->stream->handler, NULL);
+        struct usbx_http_response *resp = state->stream->resp;
+        state->stream->resp = NULL;
+        return send_response(connection, resp);
+    }
+
+    struct usbx_http_response *resp = calloc(1, sizeof(*resp));
+    if (!resp) {
+        return MHD_NO;
+    }
+    if (state->too_large) {
+        usbx_http_set_error(resp, 413, "Request body too large", 0);
+        return send_response(connection, resp);
+    }
+    if (state->over_budget == USBX_ERROR_BUSY) {
+        usbx_http_set_error(resp, 503, "Memory budget exhausted", USBX_ERROR_BUSY);
+        usbx_http_add_header(resp, "Retry-After", "1");
+        return send_response(connection, resp);
+    }
+    if (state->over_budget) {
+        usbx_http_set_error(resp, 413, "Request exceeds the memory budget", state->over_budget);
+        return send_response(connection, resp);
+    }
+
+    struct pair_list args = {.count = 0};
+    struct pair_list headers = {.count = 0};
+    char address[INET6_ADDRSTRLEN];
+    struct usbx_http_request req;
+    prepare_request(connection, url, method, &req, &args, &headers, address);
+    req.body = state->body;
+    req.body_length = state->body_length;
+
+    usbx_http_dispatch(router, &req, resp);
+    return send_response(connection, resp);
+}
+
+static void request_completed(void *cls, struct MHD_Connection *connection, void **con_cls,
+                              enum MHD_RequestTerminationCode toe) {
+    struct connection_state *state = *con_cls;
+    (void)cls;
+    (void)connection;
+    (void)toe;
+
+    if (state) {
+        struct body_stream *stream = state->stream;
+        if (stream && stream->resp) {
+            // The client went away mid-body: fail the handler's reads and wait for it
+            __atomic_store_n(&stream->aborted, 1, __ATOMIC_RELEASE);
+            usbx_ring_close(stream->pipe);
+            pthread_join(stream->handler, NULL);
+            usbx_http_response_free(stream->resp);
+        }
+        free_stream(stream);
+        free(state->body);
+        usbx_budget_release(state->body_capacity);
+        free(state);
+        *con_cls = NULL;
+    }
+}
+
+int usbx_http_server_start(struct usbx_http_router *router, uint16_t port) {
+    if (http_daemon) {
+        return -1;
+    }
+    http_daemon = MHD_start_daemon(DAEMON_FLAGS, port, NULL, NULL, handle_connection, router,
+                                   MHD_OPTION_NOTIFY_COMPLETED, request_completed, NULL,
+                                   MHD_OPTION_END);
+    quiesced = 0;
+    return http_daemon ? 0 : -1;
+}
+
+int usbx_http_server_start_socket(struct usbx_http_router *router, int listen_fd) {
+    if (http_daemon || listen_fd < 0) {
+        return -1;
+    }
+    http_daemon = MHD_start_daemon(DAEMON_FLAGS, 0, NULL, NULL, handle_connection, router,
+                                   MHD_OPTION_LISTEN_SOCKET, (MHD_socket)listen_fd,
+                                   MHD_OPTION_NOTIFY_COMPLETED, request_completed, NULL,
+                                   MHD_OPTION_END);
+    quiesced = 0;
+    return http_daemon ? 0 : -1;
+}
+
+int usbx_http_server_listen_fd(void) {
+    if (!http_daemon || quiesced) {
+        return -1;
+    }
+    const union MHD_DaemonInfo *info = MHD_get_daemon_info(http_daemon,
+                                                           MHD_DAEMON_INFO_LISTEN_FD);
+    return info ? (int)info->listen_fd : -1;
+}
+
+int usbx_http_server_quiesce(void) {
+    if (!http_daemon || quiesced) {
+        return -1;
+    }
+    quiesced = 1;
+    return (int)MHD_quiesce_daemon(http_daemon);
+}
+
+unsigned int usbx_http_server_connections(void) {
+    if (!http_daemon) {
+        return 0;
+    }
+    const union MHD_DaemonInfo *info = MHD_get_daemon_info(http_daemon,
+                                                           MHD_DAEMON_INFO_CURRENT_CONNECTIONS);
+    return info ? info->num_connections : 0;
+}
+
+void usbx_http_server_stop(void) {
+    if (http_daemon) {
+        MHD_stop_daemon(http_daemon);
+        http_daemon = NULL;
+    }
+}
+
+#endif // USE_DEPS
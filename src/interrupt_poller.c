@@ -0,0 +1,586 @@
+/**
+ * @file interrupt_poller.c
+ * @brief Continuous interrupt IN polling with broadcast to many subscribers
+ *
+ * The ring is indexed by report sequence number: report @c n lives in slot
+ * @c n % slots, and reports older than next_sequence - slots have been
+ * overwritten. Subscribers only store the sequence they want next.
+ *
+ * With an idle timeout a watch thread wakes when the least recently active
+ * subscriber would expire, removes the expired ones and stops polling when
+ * it has removed the last.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbx_interrupt.h"
+#include "usbx_budget.h"
+#include "usbx_config.h"
+#include "usbx_sched.h"
+#include "usbx_util.h"
+
+/** @brief Longest single wait of the idle watch; it re-checks afterwards */
+#define IDLE_WATCH_MAX_WAIT_MS 60000
+
+/** @brief Retained report */
+struct report_slot {
+    uint64_t timestamp_us;
+    int length;
+    unsigned char *data;         // points into usbx_interrupt_poller.report_data
+};
+
+/** @brief Submitted transfer and its buffer */
+struct poll_slot {
+    struct usbx_transfer xfer;
+    struct usbx_interrupt_poller *poller;
+    unsigned char *buffer;
+};
+
+struct subscriber {
+    int id;
+    uint64_t cursor;             // next sequence this subscriber wants
+    uint64_t delivered;
+    uint64_t dropped;
+    uint64_t active_us;          // subscribed, or last left usbx_interrupt_read()
+    int readers;                 // threads inside usbx_interrupt_read() for it
+    struct subscriber *next;
+};
+
+struct usbx_interrupt_poller {
+    struct usbx_device *dev;
+    unsigned char endpoint;
+    struct usbx_interrupt_options opts;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;      // new report, subscriber removed, or stopped
+    struct report_slot *ring;
+    unsigned char *report_data;
+    size_t reserved;             // budget held for the ring and the transfer buffers
+    uint64_t next_sequence;
+    struct poll_slot *polls;
+    int in_flight;
+    int readers;                 // threads inside usbx_interrupt_read()
+    int stopping;
+    int last_error;
+    struct subscriber *subscribers;
+    int num_subscribers;
+    struct usbx_interrupt_stats stats;
+    pthread_t watch;             // idle watch, when opts.idle_timeout_ms is set
+    int watching;
+};
+
+/** @brief Last subscriber id handed out, by any poller */
+static unsigned int last_subscriber_id;
+
+/*
+ * Ids are unique across pollers, so the id of a subscriber removed with a
+ * stopped poller never names a subscriber of the poller that replaces it.
+ */
+static int new_subscriber_id(void) {
+    int id;
+    do {
+        id = (int)(__atomic_add_fetch(&last_subscriber_id, 1, __ATOMIC_RELAXED) & 0x7fffffffu);
+    } while (id == 0);
+    return id;
+}
+
+void usbx_interrupt_options_init(struct usbx_interrupt_options *opts) {
+    opts->slots = usbx_config_current()->interrupt_slots;
+    opts->transfers_in_flight = USBX_INTERRUPT_DEFAULT_IN_FLIGHT;
+    opts->report_size = 0;
+    opts->idle_timeout_ms = 0;
+}
+
+/* Oldest sequence still held by the ring (lock held) */
+static uint64_t oldest_sequence(const struct usbx_interrupt_poller *poller) {
+    uint64_t slots = (uint64_t)poller->opts.slots;
+    return poller->next_sequence > slots ? poller->next_sequence - slots : 0;
+}
+
+static void store_report(struct usbx_interrupt_poller *poller, const struct usbx_transfer *xfer) {
+    struct report_slot *slot = &poller->ring[poller->next_sequence % (uint64_t)poller->opts.slots];
+
+    memcpy(slot->data, xfer->buffer, (size_t)xfer->actual_length);
+    slot->length = xfer->actual_length;
+    slot->timestamp_us = usbx_now_us();
+    poller->next_sequence++;
+    poller->stats.reports++;
+    poller->stats.bytes += (uint64_t)xfer->actual_length;
+    pthread_cond_broadcast(&poller->changed);
+}
+
+static void poll_complete(struct usbx_transfer *xfer) {
+    struct poll_slot *slot = xfer->user_data;
+    struct usbx_interrupt_poller *poller = slot->poller;
+
+    pthread_mutex_lock(&poller->lock);
+    poller->in_flight--;
+
+    if (xfer->status == USBX_TRANSFER_COMPLETED) {
+        store_report(poller, xfer);
+    } else if (xfer->status == USBX_TRANSFER_TIMED_OUT) {
+        poller->stats.timeouts++;
+    } else if (xfer->status != USBX_TRANSFER_CANCELLED && !poller->stopping) {
+        // Stalls and disconnects end polling; subscribers see the error
+        poller->last_error = usbx_status_to_error(xfer->status);
+        poller->stopping = 1;
+    }
+
+    if (poller->stopping || xfer->status == USBX_TRANSFER_CANCELLED) {
+        pthread_cond_broadcast(&poller->changed);
+        pthread_mutex_unlock(&poller->lock);
+        return;
+    }
+    poller->in_flight++;
+    pthread_mutex_unlock(&poller->lock);
+
+    int result = usbx_submit_transfer(xfer);
+    if (result != USBX_SUCCESS) {
+        pthread_mutex_lock(&poller->lock);
+        poller->in_flight--;
+        if (!poller->stopping) {
+            poller->last_error = result;
+            poller->stopping = 1;
+        }
+        pthread_cond_broadcast(&poller->changed);
+        pthread_mutex_unlock(&poller->lock);
+    }
+}
+
+static void free_poller(struct usbx_interrupt_poller *poller) {
+    struct subscriber *sub = poller->subscribers;
+    while (sub) {
+        struct subscriber *next = sub->next;
+        free(sub);
+        sub = next;
+    }
+    if (poller->polls) {
+        for (int i = 0; i < poller->opts.transfers_in_flight; i++) {
+            free(poller->polls[i].buffer);
+        }
+    }
+    free(poller->polls);
+    free(poller->ring);
+    free(poller->report_data);
+    usbx_budget_release(poller->reserved);
+    pthread_cond_destroy(&poller->changed);
+    pthread_mutex_destroy(&poller->lock);
+    free(poller);
+}
+
+static int allocate_poller(struct usbx_interrupt_poller *poller) {
+    size_t slots = (size_t)poller->opts.slots;
+    size_t report_size = (size_t)poller->opts.report_size;
+    size_t reserved = slots * (sizeof(struct report_slot) + report_size) +
+                      (size_t)poller->opts.transfers_in_flight * report_size;
+    if (usbx_budget_try_reserve(reserved) != USBX_SUCCESS) {
+        return USBX_ERROR_NO_MEM;
+    }
+    poller->reserved = reserved;
+
+    poller->ring = calloc(slots, sizeof(struct report_slot));
+    poller->report_data = malloc(slots * report_size);
+    poller->polls = calloc((size_t)poller->opts.transfers_in_flight, sizeof(struct poll_slot));
+    if (!poller->ring || !poller->report_data || !poller->polls) {
+        return USBX_ERROR_NO_MEM;
+    }
+    for (size_t i = 0; i < slots; i++) {
+        poller->ring[i].data = poller->report_data + i * report_size;
+    }
+
+    for (int i = 0; i < poller->opts.transfers_in_flight; i++) {
+        struct poll_slot *slot = &poller->polls[i];
+        slot->poller = poller;
+        slot->buffer = malloc(report_size);
+        if (!slot->buffer) {
+            return USBX_ERROR_NO_MEM;
+        }
+        slot->xfer.dev = poller->dev;
+        slot->xfer.endpoint = poller->endpoint;
+        slot->xfer.type = USBX_TRANSFER_TYPE_INTERRUPT;
+        slot->xfer.timeout = 0;        // a report may be minutes away
+        slot->xfer.buffer = slot->buffer;
+        slot->xfer.length = poller->opts.report_size;
+        slot->xfer.callback = poll_complete;
+        slot->xfer.user_data = slot;
+    }
+    return USBX_SUCCESS;
+}
+
+static struct usbx_interrupt_poller *create_poller(struct usbx_device *dev, unsigned char endpoint,
+                                                   const struct usbx_interrupt_options *opts,
+                                                   int *error) {
+    struct usbx_interrupt_poller *poller = calloc(1, sizeof(*poller));
+    if (!poller) {
+        *error = USBX_ERROR_NO_MEM;
+        return NULL;
+    }
+    poller->dev = dev;
+    poller->endpoint = endpoint;
+    poller->opts = *opts;
+    pthread_mutex_init(&poller->lock, NULL);
+    usbx_cond_init_monotonic(&poller->changed);
+
+    if (poller->opts.report_size <= 0) {
+        poller->opts.report_size = usbx_get_max_packet_size(dev, endpoint);
+    }
+    if (poller->opts.report_size <= 0 || poller->opts.report_size > USBX_INTERRUPT_MAX_REPORT) {
+        *error = poller->opts.report_size < 0 ? poller->opts.report_size
+                                              : USBX_ERROR_INVALID_PARAM;
+        free_poller(poller);
+        return NULL;
+    }
+
+    *error = allocate_poller(poller);
+    if (*error != USBX_SUCCESS) {
+        free_poller(poller);
+        return NULL;
+    }
+    return poller;
+}
+
+/* Cancel the transfers and wait for them; @p error is reported unless polling already ended */
+static void stop_polling(struct usbx_interrupt_poller *poller, int error) {
+    pthread_mutex_lock(&poller->lock);
+    if (!poller->stopping) {
+        poller->last_error = error;
+        poller->stopping = 1;
+    }
+    pthread_cond_broadcast(&poller->changed);
+    pthread_mutex_unlock(&poller->lock);
+
+    for (int i = 0; i < poller->opts.transfers_in_flight; i++) {
+        usbx_cancel_transfer(&poller->polls[i].xfer);
+    }
+
+    pthread_mutex_lock(&poller->lock);
+    while (poller->in_flight > 0) {
+        pthread_cond_wait(&poller->changed, &poller->lock);
+    }
+    pthread_mutex_unlock(&poller->lock);
+}
+
+/*
+ * Remove the subscribers nobody has read for the idle timeout (lock held).
+ * Returns how many were removed; *next_us receives when the next may expire.
+ */
+static int expire_idle(struct usbx_interrupt_poller *poller, uint64_t now_us, uint64_t *next_us) {
+    uint64_t idle_us = (uint64_t)poller->opts.idle_timeout_ms * 1000;
+    int removed = 0;
+
+    *next_us = now_us + idle_us;
+    for (struct subscriber **link = &poller->subscribers; *link;) {
+        struct subscriber *sub = *link;
+        if (sub->readers > 0) {
+            link = &sub->next;
+        } else if (now_us - sub->active_us >= idle_us) {
+            *link = sub->next;
+            free(sub);
+            poller->num_subscribers--;
+            removed++;
+        } else {
+            if (sub->active_us + idle_us < *next_us) {
+                *next_us = sub->active_us + idle_us;
+            }
+            link = &sub->next;
+        }
+    }
+    return removed;
+}
+
+/* Idle watch: stops polling once it has removed the last subscriber */
+static void *idle_watch(void *arg) {
+    struct usbx_interrupt_poller *poller = arg;
+    uint64_t next_us = usbx_now_us() + (uint64_t)poller->opts.idle_timeout_ms * 1000;
+    int expired = 0;
+
+    pthread_mutex_lock(&poller->lock);
+    while (!poller->stopping) {
+        uint64_t now_us = usbx_now_us();
+        if (now_us >= next_us) {
+            if (expire_idle(poller, now_us, &next_us) > 0 && poller->num_subscribers == 0) {
+                // Set under the lock, so nobody subscribes to a poller about to stop
+                poller->last_error = USBX_ERROR_TIMEOUT;
+                poller->stopping = 1;
+                expired = 1;
+                break;
+            }
+            continue;
+        }
+        struct timespec deadline;
+        uint64_t wait_ms = (next_us - now_us + 999) / 1000;
+        usbx_deadline_ms(&deadline, wait_ms < IDLE_WATCH_MAX_WAIT_MS ? (int)wait_ms
+                                                                     : IDLE_WATCH_MAX_WAIT_MS);
+        pthread_cond_timedwait(&poller->changed, &poller->lock, &deadline);
+    }
+    pthread_mutex_unlock(&poller->lock);
+
+    if (expired) {
+        stop_polling(poller, USBX_ERROR_TIMEOUT);
+    }
+    return NULL;
+}
+
+struct usbx_interrupt_poller *usbx_interrupt_poller_start(struct usbx_device *dev,
+                                                          unsigned char endpoint,
+                                                          const struct usbx_interrupt_options *opts,
+                                                          int *error) {
+    struct usbx_interrupt_options defaults;
+    int local_error;
+
+    if (!error) {
+        error = &local_error;
+    }
+    if (!opts) {
+        usbx_interrupt_options_init(&defaults);
+        opts = &defaults;
+    }
+    if (!dev || !(endpoint & USBX_ENDPOINT_IN) || opts->slots < 1 ||
+        opts->transfers_in_flight < 1) {
+        *error = USBX_ERROR_INVALID_PARAM;
+        return NULL;
+    }
+
+    struct usbx_interrupt_poller *poller = create_poller(dev, endpoint, opts, error);
+    if (!poller) {
+        return NULL;
+    }
+
+    // Polls stay pending until stopped; counted for the caller they would hold its
+    // scheduler slots for good (usbx_sched.h), so they are submitted without a client
+    const char *client = usbx_sched_client();
+    usbx_sched_set_client(NULL);
+    int result = USBX_SUCCESS;
+    pthread_mutex_lock(&poller->lock);
+    for (int i = 0; i < poller->opts.transfers_in_flight; i++) {
+        poller->in_flight++;
+        pthread_mutex_unlock(&poller->lock);
+        result = usbx_submit_transfer(&poller->polls[i].xfer);
+        pthread_mutex_lock(&poller->lock);
+        if (result != USBX_SUCCESS) {
+            poller->in_flight--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&poller->lock);
+    usbx_sched_set_client(client);
+
+    if (result == USBX_SUCCESS && poller->opts.idle_timeout_ms > 0) {
+        if (pthread_create(&poller->watch, NULL, idle_watch, poller) == 0) {
+            poller->watching = 1;
+        } else {
+            result = USBX_ERROR_NO_MEM;
+        }
+    }
+
+    *error = result;
+    if (result != USBX_SUCCESS) {
+        usbx_interrupt_poller_destroy(poller);
+        return NULL;
+    }
+    return poller;
+}
+
+void usbx_interrupt_poller_stop(struct usbx_interrupt_poller *poller) {
+    stop_polling(poller, USBX_ERROR_INTERRUPTED);
+}
+
+void usbx_interrupt_poller_destroy(struct usbx_interrupt_poller *poller) {
+    if (!poller) {
+        return;
+    }
+    usbx_interrupt_poller_stop(poller);
+    if (poller->watching) {
+        pthread_join(poller->watch, NULL);
+    }
+
+    pthread_mutex_lock(&poller->lock);
+    while (poller->readers > 0) {
+        pthread_cond_wait(&poller->changed, &poller->lock);
+    }
+    pthread_mutex_unlock(&poller->lock);
+    free_poller(poller);
+}
+
+void usbx_interrupt_get_stats(struct usbx_interrupt_poller *poller,
+                              struct usbx_interrupt_stats *stats) {
+    pthread_mutex_lock(&poller->lock);
+    *stats = poller->stats;
+    stats->subscribers = poller->num_subscribers;
+    stats->running = !poller->stopping;
+    stats->last_error = poller->last_error;
+    pthread_mutex_unlock(&poller->lock);
+}
+
+static struct subscriber *find_subscriber(struct usbx_interrupt_poller *poller, int id) {
+    for (struct subscriber *sub = poller->subscribers; sub; sub = sub->next) {
+        if (sub->id == id) {
+            return sub;
+        }
+    }
+    return NULL;
+}
+
+int usbx_interrupt_subscribe(struct usbx_interrupt_poller *poller, int backlog) {
+    struct subscriber *sub = calloc(1, sizeof(*sub));
+    if (!sub) {
+        return USBX_ERROR_NO_MEM;
+    }
+
+    pthread_mutex_lock(&poller->lock);
+    sub->id = new_subscriber_id();
+    sub->cursor = poller->next_sequence;
+    sub->active_us = usbx_now_us();
+    if (backlog > 0) {
+        uint64_t oldest = oldest_sequence(poller);
+        sub->cursor = poller->next_sequence - (uint64_t)backlog;
+        if (poller->next_sequence < (uint64_t)backlog || sub->cursor < oldest) {
+            sub->cursor = oldest;
+        }
+    }
+    sub->next = poller->subscribers;
+    poller->subscribers = sub;
+    poller->num_subscribers++;
+    int id = sub->id;
+    pthread_mutex_unlock(&poller->lock);
+    return id;
+}
+
+int usbx_interrupt_unsubscribe(struct usbx_interrupt_poller *poller, int subscriber) {
+    int result = USBX_ERROR_NOT_FOUND;
+
+    pthread_mutex_lock(&poller->lock);
+    for (struct subscriber **link = &poller->subscribers; *link; link = &(*link)->next) {
+        if ((*link)->id == subscriber) {
+            struct subscriber *sub = *link;
+            *link = sub->next;
+            free(sub);
+            poller->num_subscribers--;
+            result = poller->num_subscribers;
+            pthread_cond_broadcast(&poller->changed);  // wake a reader blocked on it
+            break;
+        }
+    }
+    pthread_mutex_unlock(&poller->lock);
+    return result;
+}
+
+/* Move a lapped subscriber to the oldest retained report (lock held) */
+static void catch_up(struct usbx_interrupt_poller *poller, struct subscriber *sub) {
+    uint64_t oldest = oldest_sequence(poller);
+    if (sub->cursor < oldest) {
+        sub->dropped += oldest - sub->cursor;
+        sub->cursor = oldest;
+    }
+}
+
+int usbx_interrupt_read(struct usbx_interrupt_poller *poller, int subscriber,
+                        struct usbx_interrupt_report *report, int timeout_ms) {
+    struct timespec deadline;
+    int result = 0;
+
+    if (timeout_ms > 0) {
+        usbx_deadline_ms(&deadline, timeout_ms);
+    }
+
+    pthread_mutex_lock(&poller->lock);
+    poller->readers++;
+    struct subscriber *waiting = find_subscriber(poller, subscriber);
+    if (waiting) {
+        waiting->readers++;              // not idle while a reader waits for it
+    }
+    for (;;) {
+        struct subscriber *sub = find_subscriber(poller, subscriber);
+        if (!sub) {
+            result = USBX_ERROR_NOT_FOUND;
+            break;
+        }
+
+        catch_up(poller, sub);
+        if (sub->cursor < poller->next_sequence) {
+            const struct report_slot *slot =
+                &poller->ring[sub->cursor % (uint64_t)poller->opts.slots];
+            report->sequence = sub->cursor;
+            report->timestamp_us = slot->timestamp_us;
+            report->length = slot->length;
+            memcpy(report->data, slot->data, (size_t)slot->length);
+            sub->cursor++;
+            sub->delivered++;
+            result = 1;
+            break;
+        }
+        if (poller->stopping) {
+            result = poller->last_error;
+            break;
+        }
+
+        if (timeout_ms == 0) {
+            break;
+        } else if (timeout_ms < 0) {
+            pthread_cond_wait(&poller->changed, &poller->lock);
+        } else if (pthread_cond_timedwait(&poller->changed, &poller->lock, &deadline) != 0) {
+            break;
+        }
+    }
+    // Ids are not reused, so a subscriber found again is the one counted above
+    struct subscriber *sub = find_subscriber(poller, subscriber);
+    if (sub) {
+        sub->readers--;
+        sub->active_us = usbx_now_us();
+    }
+    poller->readers--;
+    if (poller->readers == 0 && poller->stopping) {
+        pthread_cond_broadcast(&poller->changed);  // usbx_interrupt_poller_destroy() may wait
+    }
+    pthread_mutex_unlock(&poller->lock);
+    return result;
+}
+
+/* Fill one stats entry (lock held) */
+static void subscriber_snapshot(const struct usbx_interrupt_poller *poller,
+                                const struct subscriber *sub,
+                                struct usbx_interrupt_subscriber_stats *stats) {
+    uint64_t oldest = oldest_sequence(poller);
+    uint64_t cursor = sub->cursor < oldest ? oldest : sub->cursor;
+
+    stats->id = sub->id;
+    stats->delivered = sub->delivered;
+    // Reports already overwritten count as dropped even before the next read
+    stats->dropped = sub->dropped + (cursor - sub->cursor);
+    stats->lag = poller->next_sequence - cursor;
+}
+
+int usbx_interrupt_subscriber_stats(struct usbx_interrupt_poller *poller, int subscriber,
+                                    struct usbx_interrupt_subscriber_stats *stats) {
+    int result = USBX_ERROR_NOT_FOUND;
+
+    pthread_mutex_lock(&poller->lock);
+    struct subscriber *sub = find_subscriber(poller, subscriber);
+    if (sub) {
+        subscriber_snapshot(poller, sub, stats);
+        result = USBX_SUCCESS;
+    }
+    pthread_mutex_unlock(&poller->lock);
+    return result;
+}
+
+int usbx_interrupt_list_subscribers(struct usbx_interrupt_poller *poller,
+                                    struct usbx_interrupt_subscriber_stats *stats, int max) {
+    int count = 0;
+
+    pthread_mutex_lock(&poller->lock);
+    for (struct subscriber *sub = poller->subscribers; sub; sub = sub->next) {
+        if (count < max) {
+            subscriber_snapshot(poller, sub, &stats[count]);
+        }
+        count++;
+    }
+    pthread_mutex_unlock(&poller->lock);
+    return count;
+}
@@ -0,0 +1,454 @@
+/**
+ * @file iso_stream.c
+ * @brief Isochronous streaming engine and packet-descriptor frame format
+ *
+ * Transfers are resubmitted straight from their completion callback so the
+ * bus schedule stays fed. Callbacks of one endpoint are serialised by the
+ * backends, but the stream lock is still taken because readers, writers and
+ * usbx_iso_stream_stop() run on other threads.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_budget.h"
+#include "usbx_iso.h"
+#include "usbx_ring.h"
+#include "usbx_sched.h"
+#include "usbx_util.h"
+
+/** @brief One transfer of the stream with its buffer and packet descriptors */
+struct iso_slot {
+    struct usbx_transfer xfer;
+    struct usbx_iso_stream *stream;
+    struct usbx_iso_packet *packets;
+    unsigned char *buffer;
+};
+
+struct usbx_iso_stream {
+    struct usbx_device *dev;
+    unsigned char endpoint;
+    struct usbx_iso_options opts;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    struct iso_slot *slots;
+    int in_flight;
+    int stopping;
+    int primed;                  // OUT: the writer has queued data at least once
+    int gap_pending;             // IN: next frame follows a pipeline drain
+    int error;                   // why the stream died on its own, USBX_SUCCESS if it did not
+    uint32_t sequence;
+    unsigned char *frame;        // IN: encode scratch buffer
+    struct usbx_ring *ring;
+    size_t reserved;             // budget held for the buffers
+    struct usbx_iso_counters counters;
+};
+
+void usbx_iso_options_init(struct usbx_iso_options *opts) {
+    opts->packets_per_transfer = USBX_ISO_DEFAULT_PACKETS;
+    opts->transfers_in_flight = USBX_ISO_DEFAULT_IN_FLIGHT;
+    opts->packet_size = 0;
+    opts->buffer_size = USBX_ISO_DEFAULT_BUFFER_SIZE;
+}
+
+size_t usbx_iso_frame_size(int num_packets, size_t buffer_length) {
+    return USBX_ISO_FRAME_HEADER_SIZE + (size_t)num_packets * USBX_ISO_PACKET_DESC_SIZE +
+           buffer_length;
+}
+
+size_t usbx_iso_encode_frame(unsigned char *out, uint32_t sequence, uint64_t timestamp_us,
+                             uint16_t flags, const struct usbx_transfer *xfer) {
+    unsigned char *desc = out + USBX_ISO_FRAME_HEADER_SIZE;
+    unsigned char *data = desc + (size_t)xfer->num_iso_packets * USBX_ISO_PACKET_DESC_SIZE;
+    const unsigned char *packet = xfer->buffer;
+    uint32_t data_length = 0;
+
+    for (int i = 0; i < xfer->num_iso_packets; i++) {
+        const struct usbx_iso_packet *p = &xfer->iso_packets[i];
+        unsigned int actual = p->status == USBX_TRANSFER_COMPLETED ? p->actual_length : 0;
+
+        usbx_put_le16(desc, (uint16_t)actual);
+        desc[2] = (unsigned char)p->status;
+        desc[3] = 0;
+        desc += USBX_ISO_PACKET_DESC_SIZE;
+
+        memcpy(data + data_length, packet, actual);
+        data_length += actual;
+        packet += p->length;
+    }
+
+    usbx_put_le32(out, USBX_ISO_FRAME_MAGIC);
+    usbx_put_le32(out + 4, sequence);
+    usbx_put_le64(out + 8, timestamp_us);
+    usbx_put_le16(out + 16, (uint16_t)xfer->num_iso_packets);
+    usbx_put_le16(out + 18, flags);
+    usbx_put_le32(out + 20, data_length);
+    return (size_t)(data - out) + data_length;
+}
+
+long usbx_iso_decode_frame(const unsigned char *in, size_t length, struct usbx_iso_frame *frame) {
+    if (length < USBX_ISO_FRAME_HEADER_SIZE) {
+        return 0;
+    }
+    if (usbx_get_le32(in) != USBX_ISO_FRAME_MAGIC) {
+        return -1;
+    }
+
+    frame->sequence = usbx_get_le32(in + 4);
+    frame->timestamp_us = usbx_get_le64(in + 8);
+    frame->num_packets = usbx_get_le16(in + 16);
+    frame->flags = usbx_get_le16(in + 18);
+    frame->data_length = usbx_get_le32(in + 20);
+
+    size_t total = usbx_iso_frame_size(frame->num_packets, frame->data_length);
+    if (length < total) {
+        return 0;
+    }
+    frame->descriptors = in + USBX_ISO_FRAME_HEADER_SIZE;
+    frame->data = frame->descriptors + (size_t)frame->num_packets * USBX_ISO_PACKET_DESC_SIZE;
+    return (long)total;
+}
+
+void usbx_iso_frame_packet(const struct usbx_iso_frame *frame, int index,
+                           unsigned int *actual_length, int *status) {
+    const unsigned char *desc = frame->descriptors + (size_t)index * USBX_ISO_PACKET_DESC_SIZE;
+    *actual_length = usbx_get_le16(desc);
+    *status = desc[2];
+}
+
+/* OUT: cut queued payload into packets; returns the number of empty packets */
+static int fill_out_packets(struct usbx_iso_stream *stream, struct iso_slot *slot) {
+    unsigned char *packet = slot->buffer;
+    int empty = 0;
+
+    for (int i = 0; i < stream->opts.packets_per_transfer; i++) {
+        size_t length = usbx_ring_read(stream->ring, packet, (size_t)stream->opts.packet_size, 0);
+        slot->packets[i].length = (unsigned int)length;
+        packet += length;
+        if (length == 0) {
+            empty++;
+        }
+    }
+    return empty;
+}
+
+static void reset_in_packets(struct usbx_iso_stream *stream, struct iso_slot *slot) {
+    for (int i = 0; i < stream->opts.packets_per_transfer; i++) {
+        slot->packets[i].length = (unsigned int)stream->opts.packet_size;
+    }
+}
+
+/* Account a completed transfer and hand its data to the reader (lock held) */
+static void consume_completion(struct usbx_iso_stream *stream, struct usbx_transfer *xfer) {
+    stream->counters.transfers++;
+    for (int i = 0; i < xfer->num_iso_packets; i++) {
+        struct usbx_iso_packet *packet = &xfer->iso_packets[i];
+        if (xfer->status != USBX_TRANSFER_COMPLETED) {
+            packet->status = xfer->status;  // the whole transfer failed
+        }
+
+        stream->counters.packets++;
+        if (packet->status == USBX_TRANSFER_COMPLETED) {
+            stream->counters.bytes += packet->actual_length;
+        } else {
+            stream->counters.packets_lost++;
+        }
+    }
+
+    if (!(stream->endpoint & USBX_ENDPOINT_IN)) {
+        return;
+    }
+
+    uint16_t flags = stream->gap_pending ? USBX_ISO_FRAME_GAP : 0;
+    size_t size = usbx_iso_encode_frame(stream->frame, stream->sequence++, usbx_now_us(),
+                                        flags, xfer);
+    if (usbx_ring_write_all(stream->ring, stream->frame, size) == 0) {
+        stream->gap_pending = 0;
+    } else {
+        stream->counters.overruns += (uint64_t)xfer->num_iso_packets;
+        stream->gap_pending = 1;  // the reader will see a hole in the sequence
+    }
+}
+
+/* Prepare a slot for (re)submission (lock held) */
+static void prepare_slot(struct usbx_iso_stream *stream, struct iso_slot *slot) {
+    if (stream->endpoint & USBX_ENDPOINT_IN) {
+        reset_in_packets(stream, slot);
+        return;
+    }
+    int empty = fill_out_packets(stream, slot);
+    if (stream->primed) {
+        stream->counters.underruns += (uint64_t)empty;
+    }
+}
+
+/*
+ * A slot left the pipeline while the stream runs (lock held). The others
+ * keep the stream going; once none is left the reader is woken with error.
+ */
+static void drop_slot(struct usbx_iso_stream *stream, int error) {
+    if (stream->in_flight == 0) {
+        stream->stopping = 1;
+        stream->error = error;
+        usbx_ring_close(stream->ring);
+    }
+}
+
+static void iso_complete(struct usbx_transfer *xfer) {
+    struct iso_slot *slot = xfer->user_data;
+    struct usbx_iso_stream *stream = slot->stream;
+
+    pthread_mutex_lock(&stream->lock);
+    stream->in_flight--;
+
+    if (xfer->status == USBX_TRANSFER_NO_DEVICE && !stream->stopping) {
+        stream->stopping = 1;
+        stream->error = USBX_ERROR_NO_DEVICE;
+        usbx_ring_close(stream->ring);
+    }
+    if (stream->stopping || xfer->status == USBX_TRANSFER_CANCELLED) {
+        if (!stream->stopping) {
+            stream->counters.cancelled++;   // cancelled by someone else, e.g. a reset
+            drop_slot(stream, USBX_ERROR_INTERRUPTED);
+        }
+        pthread_cond_broadcast(&stream->idle);
+        pthread_mutex_unlock(&stream->lock);
+        return;
+    }
+
+    if (stream->in_flight == 0) {
+        stream->counters.pipeline_drains++;
+        stream->gap_pending = 1;
+    }
+    consume_completion(stream, xfer);
+    prepare_slot(stream, slot);
+    stream->in_flight++;
+    pthread_mutex_unlock(&stream->lock);
+
+    int result = usbx_submit_transfer(xfer);
+    if (result != USBX_SUCCESS) {
+        pthread_mutex_lock(&stream->lock);
+        stream->in_flight--;
+        if (!stream->stopping) {
+            stream->counters.resubmit_failures++;
+            drop_slot(stream, result);
+        }
+        pthread_cond_broadcast(&stream->idle);
+        pthread_mutex_unlock(&stream->lock);
+    }
+}
+
+static void free_stream(struct usbx_iso_stream *stream) {
+    if (stream->slots) {
+        for (int i = 0; i < stream->opts.transfers_in_flight; i++) {
+            free(stream->slots[i].packets);
+            free(stream->slots[i].buffer);
+        }
+    }
+    free(stream->slots);
+    free(stream->frame);
+    usbx_ring_destroy(stream->ring);
+    usbx_budget_release(stream->reserved);
+    pthread_cond_destroy(&stream->idle);
+    pthread_mutex_destroy(&stream->lock);
+    free(stream);
+}
+
+static int allocate_slots(struct usbx_iso_stream *stream) {
+    size_t buffer_length = (size_t)stream->opts.packets_per_transfer *
+                           (size_t)stream->opts.packet_size;
+    size_t reserved = stream->opts.buffer_size +
+                      (size_t)stream->opts.transfers_in_flight * buffer_length;
+    if (stream->endpoint & USBX_ENDPOINT_IN) {
+        reserved += usbx_iso_frame_size(stream->opts.packets_per_transfer, buffer_length);
+    }
+    if (usbx_budget_try_reserve(reserved) != USBX_SUCCESS) {
+        return USBX_ERROR_NO_MEM;
+    }
+    stream->reserved = reserved;
+
+    stream->slots = calloc((size_t)stream->opts.transfers_in_flight, sizeof(struct iso_slot));
+    stream->ring = usbx_ring_create(stream->opts.buffer_size);
+    if (stream->endpoint & USBX_ENDPOINT_IN) {
+        stream->frame = malloc(usbx_iso_frame_size(stream->opts.packets_per_transfer,
+                                                   buffer_length));
+        if (!stream->frame) {
+            return USBX_ERROR_NO_MEM;
+        }
+    }
+    if (!stream->slots || !stream->ring) {
+        return USBX_ERROR_NO_MEM;
+    }
+
+    for (int i = 0; i < stream->opts.transfers_in_flight; i++) {
+        struct iso_slot *slot = &stream->slots[i];
+        slot->stream = stream;
+        slot->packets = calloc((size_t)stream->opts.packets_per_transfer,
+                               sizeof(struct usbx_iso_packet));
+        slot->buffer = malloc(buffer_length);
+        if (!slot->packets || !slot->buffer) {
+            return USBX_ERROR_NO_MEM;
+        }
+
+        struct usbx_transfer *xfer = &slot->xfer;
+        xfer->dev = stream->dev;
+        xfer->endpoint = stream->endpoint;
+        xfer->type = USBX_TRANSFER_TYPE_ISOCHRONOUS;
+        xfer->buffer = slot->buffer;
+        xfer->length = (int)buffer_length;
+        xfer->num_iso_packets = stream->opts.packets_per_transfer;
+        xfer->iso_packets = slot->packets;
+        xfer->callback = iso_complete;
+        xfer->user_data = slot;
+    }
+    return USBX_SUCCESS;
+}
+
+static struct usbx_iso_stream *create_stream(struct usbx_device *dev, unsigned char endpoint,
+                                            const struct usbx_iso_options *opts, int *error) {
+    struct usbx_iso_stream *stream = calloc(1, sizeof(*stream));
+    if (!stream) {
+        *error = USBX_ERROR_NO_MEM;
+        return NULL;
+    }
+    stream->dev = dev;
+    stream->endpoint = endpoint;
+    stream->opts = *opts;
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->idle, NULL);
+
+    if (stream->opts.packet_size <= 0) {
+        stream->opts.packet_size = usbx_get_max_packet_size(dev, endpoint);
+    }
+    if (stream->opts.packet_size <= 0 || stream->opts.packet_size > UINT16_MAX) {
+        *error = stream->opts.packet_size < 0 ? stream->opts.packet_size
+                                              : USBX_ERROR_INVALID_PARAM;
+        free_stream(stream);
+        return NULL;
+    }
+
+    *error = allocate_slots(stream);
+    if (*error != USBX_SUCCESS) {
+        free_stream(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+struct usbx_iso_stream *usbx_iso_stream_start(struct usbx_device *dev, unsigned char endpoint,
+                                              const struct usbx_iso_options *opts, int *error) {
+    struct usbx_iso_options defaults;
+    int local_error;
+
+    if (!error) {
+        error = &local_error;
+    }
+    if (!opts) {
+        usbx_iso_options_init(&defaults);
+        opts = &defaults;
+    }
+    if (!dev || opts->packets_per_transfer < 1 || opts->packets_per_transfer > UINT16_MAX ||
+        opts->transfers_in_flight < 1 || opts->buffer_size == 0) {
+        *error = USBX_ERROR_INVALID_PARAM;
+        return NULL;
+    }
+
+    struct usbx_iso_stream *stream = create_stream(dev, endpoint, opts, error);
+    if (!stream) {
+        return NULL;
+    }
+
+    // Resubmitted until the stream stops, so not counted against the caller's scheduler share
+    const char *client = usbx_sched_client();
+    usbx_sched_set_client(NULL);
+    int result = USBX_SUCCESS;
+    pthread_mutex_lock(&stream->lock);
+    for (int i = 0; i < stream->opts.transfers_in_flight; i++) {
+        prepare_slot(stream, &stream->slots[i]);
+        stream->in_flight++;
+        pthread_mutex_unlock(&stream->lock);
+        result = usbx_submit_transfer(&stream->slots[i].xfer);
+        pthread_mutex_lock(&stream->lock);
+        if (result != USBX_SUCCESS) {
+            stream->in_flight--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stream->lock);
+    usbx_sched_set_client(client);
+
+    *error = result;
+    if (result != USBX_SUCCESS) {
+        usbx_iso_stream_destroy(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+size_t usbx_iso_stream_read(struct usbx_iso_stream *stream, void *buffer, size_t max,
+                            int timeout_ms) {
+    return usbx_ring_read(stream->ring, buffer, max, timeout_ms);
+}
+
+size_t usbx_iso_stream_write(struct usbx_iso_stream *stream, const void *data, size_t length,
+                             int timeout_ms) {
+    size_t written = usbx_ring_write(stream->ring, data, length, timeout_ms);
+    if (written > 0) {
+        pthread_mutex_lock(&stream->lock);
+        stream->primed = 1;
+        pthread_mutex_unlock(&stream->lock);
+    }
+    return written;
+}
+
+size_t usbx_iso_stream_queued(struct usbx_iso_stream *stream) {
+    return usbx_ring_used(stream->ring);
+}
+
+int usbx_iso_stream_error(struct usbx_iso_stream *stream) {
+    pthread_mutex_lock(&stream->lock);
+    int error = stream->error;
+    pthread_mutex_unlock(&stream->lock);
+    return error;
+}
+
+int usbx_iso_stream_finished(struct usbx_iso_stream *stream) {
+    return usbx_ring_finished(stream->ring);
+}
+
+void usbx_iso_stream_get_counters(struct usbx_iso_stream *stream,
+                                  struct usbx_iso_counters *counters) {
+    pthread_mutex_lock(&stream->lock);
+    *counters = stream->counters;
+    counters->in_flight = stream->in_flight;
+    pthread_mutex_unlock(&stream->lock);
+}
+
+void usbx_iso_stream_stop(struct usbx_iso_stream *stream) {
+    pthread_mutex_lock(&stream->lock);
+    stream->stopping = 1;
+    pthread_mutex_unlock(&stream->lock);
+
+    // Slots are never freed while the stream lives, so cancelling unlocked is safe
+    for (int i = 0; i < stream->opts.transfers_in_flight; i++) {
+        usbx_cancel_transfer(&stream->slots[i].xfer);
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    while (stream->in_flight > 0) {
+        pthread_cond_wait(&stream->idle, &stream->lock);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    usbx_ring_close(stream->ring);
+}
+
+void usbx_iso_stream_destroy(struct usbx_iso_stream *stream) {
+    if (!stream) {
+        return;
+    }
+    usbx_iso_stream_stop(stream);
+    free_stream(stream);
+}
@@ -0,0 +1,384 @@
+/**
+ * @file json.c
+ * @brief Minimal JSON reader for request bodies
+ *
+ * Recursive descent over RFC 8259 with a nesting limit; \\u escapes are
+ * decoded to UTF-8, including surrogate pairs.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_json.h"
+
+/** @brief Parser position */
+struct parser {
+    const char *text;
+    size_t length;
+    size_t pos;
+    int depth;
+};
+
+static struct usbx_json *parse_value(struct parser *p);
+
+static void skip_space(struct parser *p) {
+    while (p->pos < p->length) {
+        char c = p->text[p->pos];
+        if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+            break;
+        }
+        p->pos++;
+    }
+}
+
+static int peek(struct parser *p) {
+    skip_space(p);
+    return p->pos < p->length ? (unsigned char)p->text[p->pos] : -1;
+}
+
+static int literal(struct parser *p, const char *word) {
+    size_t n = strlen(word);
+    if (p->length - p->pos < n || memcmp(p->text + p->pos, word, n) != 0) {
+        return 0;
+    }
+    p->pos += n;
+    return 1;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* Read the four hex digits of a \u escape */
+static long read_u16(struct parser *p) {
+    long value = 0;
+    if (p->length - p->pos < 4) {
+        return -1;
+    }
+    for (int i = 0; i < 4; i++) {
+        int digit = hex_digit(p->text[p->pos++]);
+        if (digit < 0) {
+            return -1;
+        }
+        value = value * 16 + digit;
+    }
+    return value;
+}
+
+static size_t put_utf8(char *out, unsigned long cp) {
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = (char)(0xc0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3f));
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = (char)(0xe0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (cp & 0x3f));
+        return 3;
+    }
+    out[0] = (char)(0xf0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (cp & 0x3f));
+    return 4;
+}
+
+/* Parse a string starting at the opening quote; the result is malloc'd */
+static char *parse_string(struct parser *p, size_t *length) {
+    p->pos++;   // opening quote
+
+    // Escapes only shrink the text, so the raw span bounds the decoded size
+    size_t end = p->pos;
+    while (end < p->length && p->text[end] != '"') {
+        end += p->text[end] == '\\' ? 2 : 1;
+    }
+    if (end >= p->length) {
+        return NULL;
+    }
+    char *out = malloc(end - p->pos + 1);
+    if (!out) {
+        return NULL;
+    }
+
+    size_t n = 0;
+    while (p->text[p->pos] != '"') {
+        unsigned char c = (unsigned char)p->text[p->pos++];
+        if (c < 0x20) {
+            free(out);
+            return NULL;
+        }
+        if (c != '\\') {
+            out[n++] = (char)c;
+            continue;
+        }
+        char escape = p->text[p->pos++];
+        switch (escape) {
+        case '"': out[n++] = '"'; break;
+        case '\\': out[n++] = '\\'; break;
+        case '/': out[n++] = '/'; break;
+        case 'b': out[n++] = '\b'; break;
+        case 'f': out[n++] = '\f'; break;
+        case 'n': out[n++] = '\n'; break;
+        case 'r': out[n++] = '\r'; break;
+        case 't': out[n++] = '\t'; break;
+        case 'u': {
+            long cp = read_u16(p);
+            if (cp >= 0xd800 && cp < 0xdc00) {
+                long low = -1;
+                if (literal(p, "\\u")) {
+                    low = read_u16(p);
+                }
+                if (low < 0xdc00 || low > 0xdfff) {
+                    cp = -1;
+                } else {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                }
+            } else if (cp >= 0xdc00 && cp <= 0xdfff) {
+                cp = -1;
+            }
+            if (cp < 0) {
+                free(out);
+                return NULL;
+            }
+            n += put_utf8(out + n, (unsigned long)cp);
+            break;
+        }
+        default:
+            free(out);
+            return NULL;
+        }
+    }
+    p->pos++;   // closing quote
+    out[n] = '\0';
+    *length = n;
+    return out;
+}
+
+static struct usbx_json *new_node(int type) {
+    struct usbx_json *node = calloc(1, sizeof(*node));
+    if (node) {
+        node->type = type;
+    }
+    return node;
+}
+
+static struct usbx_json *parse_number(struct parser *p) {
+    size_t start = p->pos;
+    char buffer[64];
+
+    if (p->pos < p->length && p->text[p->pos] == '-') {
+        p->pos++;
+    }
+    if (p->pos >= p->length || p->text[p->pos] < '0' || p->text[p->pos] > '9') {
+        return NULL;
+    }
+    while (p->pos < p->length && p->text[p->pos] != '\0' &&
+           strchr("0123456789+-.eE", p->text[p->pos])) {
+        p->pos++;
+    }
+    size_t n = p->pos - start;
+    if (n >= sizeof(buffer)) {
+        return NULL;
+    }
+    memcpy(buffer, p->text + start, n);
+    buffer[n] = '\0';
+
+    char *end;
+    double value = strtod(buffer, &end);
+    if (*end != '\0') {
+        return NULL;
+    }
+    struct usbx_json *node = new_node(USBX_JSON_NUMBER);
+    if (node) {
+        node->number = value;
+    }
+    return node;
+}
+
+/* Parse the members or items of an object or array after the opening bracket */
+static struct usbx_json *parse_container(struct parser *p, int type) {
+    char close = type == USBX_JSON_OBJECT ? '}' : ']';
+    struct usbx_json *node = new_node(type);
+    struct usbx_json **tail;
+
+    if (!node || ++p->depth > USBX_JSON_MAX_DEPTH) {
+        usbx_json_free(node);
+        return NULL;
+    }
+    p->pos++;
+    tail = &node->child;
+    if (peek(p) == close) {
+        p->pos++;
+        p->depth--;
+        return node;
+    }
+
+    for (;;) {
+        char *key = NULL;
+        if (type == USBX_JSON_OBJECT) {
+            size_t key_length;
+            if (peek(p) != '"' || !(key = parse_string(p, &key_length)) || peek(p) != ':') {
+                free(key);
+                usbx_json_free(node);
+                return NULL;
+            }
+            p->pos++;
+        }
+        struct usbx_json *value = parse_value(p);
+        if (!value) {
+            free(key);
+            usbx_json_free(node);
+            return NULL;
+        }
+        value->key = key;
+        *tail = value;
+        tail = &value->next;
+        node->length++;
+
+        int c = peek(p);
+        if (c != close && c != ',') {
+            usbx_json_free(node);
+            return NULL;
+        }
+        p->pos++;
+        if (c == close) {
+            break;
+        }
+    }
+    p->depth--;
+    return node;
+}
+
+static struct usbx_json *parse_value(struct parser *p) {
+    struct usbx_json *node;
+    int c = peek(p);
+
+    switch (c) {
+    case '{':
+        return parse_container(p, USBX_JSON_OBJECT);
+    case '[':
+        return parse_container(p, USBX_JSON_ARRAY);
+    case '"': {
+        size_t length;
+        char *string = parse_string(p, &length);
+        if (!string || !(node = new_node(USBX_JSON_STRING))) {
+            free(string);
+            return NULL;
+        }
+        node->string = string;
+        node->length = length;
+        return node;
+    }
+    case 't':
+    case 'f':
+        if (!literal(p, c == 't' ? "true" : "false")) {
+            return NULL;
+        }
+        node = new_node(USBX_JSON_BOOL);
+        if (node) {
+            node->boolean = c == 't';
+        }
+        return node;
+    case 'n':
+        return literal(p, "null") ? new_node(USBX_JSON_NULL) : NULL;
+    default:
+        return parse_number(p);
+    }
+}
+
+struct usbx_json *usbx_json_parse(const char *text, size_t length, size_t *error_offset) {
+    struct parser p = {text, length, 0, 0};
+
+    struct usbx_json *root = text ? parse_value(&p) : NULL;
+    if (root && peek(&p) != -1) {
+        usbx_json_free(root);
+        root = NULL;
+    }
+    if (!root && error_offset) {
+        *error_offset = p.pos;
+    }
+    return root;
+}
+
+void usbx_json_free(struct usbx_json *json) {
+    while (json) {
+        struct usbx_json *next = json->next;
+        usbx_json_free(json->child);
+        free(json->string);
+        free(json->key);
+        free(json);
+        json = next;
+    }
+}
+
+const struct usbx_json *usbx_json_get(const struct usbx_json *object, const char *key) {
+    if (!object || object->type != USBX_JSON_OBJECT) {
+        return NULL;
+    }
+    for (const struct usbx_json *member = object->child; member; member = member->next) {
+        if (strcmp(member->key, key) == 0) {
+            return member;
+        }
+    }
+    return NULL;
+}
+
+int usbx_json_int(const struct usbx_json *json, long long *out) {
+    if (!json) {
+        return -1;
+    }
+    if (json->type == USBX_JSON_NUMBER) {
+        // Doubles hold integers exactly up to 2^53
+        if (json->number < -9.0e15 || json->number > 9.0e15 ||
+            (double)(long long)json->number != json->number) {
+            return -1;
+        }
+        *out = (long long)json->number;
+        return 0;
+    }
+    if (json->type == USBX_JSON_STRING && json->length > 0) {
+        char *end;
+        errno = 0;
+        long long value = strtoll(json->string, &end, 0);
+        if (*end != '\0' || errno == ERANGE) {
+            return -1;
+        }
+        *out = value;
+        return 0;
+    }
+    return -1;
+}
+
+int usbx_json_get_int(const struct usbx_json *object, const char *key, long long min,
+                      long long max, long long fallback, long long *out) {
+    const struct usbx_json *member = usbx_json_get(object, key);
+    if (!member) {
+        *out = fallback;
+        return 0;
+    }
+    if (usbx_json_int(member, out) < 0 || *out < min || *out > max) {
+        return -1;
+    }
+    return 0;
+}
+
+const char *usbx_json_string(const struct usbx_json *json) {
+    return json && json->type == USBX_JSON_STRING ? json->string : NULL;
+}
+
+int usbx_json_bool(const struct usbx_json *json, int fallback) {
+    return json && json->type == USBX_JSON_BOOL ? json->boolean : fallback;
+}
@@ -0,0 +1,256 @@
+/**
+ * @file latency.c
+ * @brief Latency estimates and adaptive transfer timeouts
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "usbx_latency.h"
+#include "uthash.h"
+
+/** @brief Key bit of control request estimates; endpoint estimates use the address */
+#define CONTROL_KEY 0x10000u
+
+struct estimate {
+    uint32_t key;
+    struct usbx_latency_estimate e;
+    UT_hash_handle hh;
+};
+
+struct usbx_latency_table {
+    pthread_mutex_t lock;
+    struct usbx_latency_config config;
+    struct estimate *estimates;  // uthash by key
+    int count;
+};
+
+void usbx_latency_config_init(struct usbx_latency_config *config) {
+    config->enabled = 0;
+    config->multiplier = USBX_LATENCY_DEFAULT_MULTIPLIER;
+    config->min_timeout_ms = USBX_LATENCY_DEFAULT_MIN_TIMEOUT_MS;
+    config->min_samples = USBX_LATENCY_DEFAULT_MIN_SAMPLES;
+}
+
+struct usbx_latency_table *usbx_latency_table_create(void) {
+    struct usbx_latency_table *table = calloc(1, sizeof(*table));
+    if (table) {
+        pthread_mutex_init(&table->lock, NULL);
+        usbx_latency_config_init(&table->config);
+    }
+    return table;
+}
+
+static void clear_estimates(struct usbx_latency_table *table) {
+    struct estimate *est, *tmp;
+    HASH_ITER(hh, table->estimates, est, tmp) {
+        HASH_DEL(table->estimates, est);
+        free(est);
+    }
+    table->count = 0;
+}
+
+void usbx_latency_table_free(struct usbx_latency_table *table) {
+    if (table) {
+        clear_estimates(table);
+        pthread_mutex_destroy(&table->lock);
+        free(table);
+    }
+}
+
+int usbx_latency_configure(struct usbx_latency_table *table,
+                           const struct usbx_latency_config *config) {
+    if (!table || !config || config->multiplier < 1 ||
+        config->multiplier > USBX_LATENCY_MAX_MULTIPLIER || config->min_timeout_ms < 1 ||
+        config->min_timeout_ms > USBX_LATENCY_MAX_MIN_TIMEOUT_MS || config->min_samples < 1 ||
+        config->min_samples > USBX_LATENCY_MAX_MIN_SAMPLES) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    pthread_mutex_lock(&table->lock);
+    table->config = *config;
+    pthread_mutex_unlock(&table->lock);
+    return USBX_SUCCESS;
+}
+
+void usbx_latency_get_config(struct usbx_latency_table *table, struct usbx_latency_config *config) {
+    pthread_mutex_lock(&table->lock);
+    *config = table->config;
+    pthread_mutex_unlock(&table->lock);
+}
+
+void usbx_latency_attach(struct usbx_latency_table *table, struct usbx_device *dev) {
+    dev->latency = table;
+    __atomic_or_fetch(&dev->taps, USBX_TAP_LATENCY, __ATOMIC_RELEASE);
+}
+
+void usbx_latency_detach(struct usbx_device *dev) {
+    __atomic_and_fetch(&dev->taps, ~USBX_TAP_LATENCY, __ATOMIC_RELEASE);
+}
+
+/* Estimate key of a transfer, or 0 if it is not measured */
+static uint32_t transfer_key(const struct usbx_transfer *xfer) {
+    if (xfer->timeout == 0) {
+        return 0;
+    }
+    switch (xfer->type) {
+    case USBX_TRANSFER_TYPE_CONTROL:
+        if (xfer->length < USBX_CONTROL_SETUP_SIZE) {
+            return 0;
+        }
+        return CONTROL_KEY | (uint32_t)xfer->buffer[0] << 8 | xfer->buffer[1];
+    case USBX_TRANSFER_TYPE_BULK:
+        return xfer->endpoint;
+    default:
+        return 0;
+    }
+}
+
+/* Timeout an estimate allows now, or 0 while it has too few samples (lock held) */
+static unsigned int adaptive_timeout(const struct usbx_latency_table *table,
+                                     const struct usbx_latency_estimate *e) {
+    if (e->samples < table->config.min_samples) {
+        return 0;
+    }
+    uint64_t us = e->mean_us + (uint64_t)table->config.multiplier * e->deviation_us;
+    if (us < e->peak_us + e->peak_us / 2) {
+        us = e->peak_us + e->peak_us / 2;
+    }
+    uint64_t ms = (us + 999) / 1000;
+    if (ms < table->config.min_timeout_ms) {
+        ms = table->config.min_timeout_ms;
+    }
+    ms <<= e->backoff;
+    return ms > 0xffffffffULL ? 0xffffffffu : (unsigned int)ms;
+}
+
+void usbx_latency_submit(struct usbx_transfer *xfer) {
+    struct usbx_latency_table *table = xfer->dev->latency;
+    uint32_t key = transfer_key(xfer);
+
+    xfer->timeout_limit = 0;
+    if (!key) {
+        return;
+    }
+    pthread_mutex_lock(&table->lock);
+    if (table->config.enabled) {
+        struct estimate *est;
+        HASH_FIND(hh, table->estimates, &key, sizeof(key), est);
+        unsigned int timeout = est ? adaptive_timeout(table, &est->e) : 0;
+        if (timeout > 0 && timeout < xfer->timeout) {
+            xfer->timeout_limit = xfer->timeout;
+            xfer->timeout = timeout;
+            est->e.adapted++;
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+/* Fold one latency into an estimate, as RFC 6298 does for round-trip times */
+static void add_sample(struct usbx_latency_estimate *e, uint64_t us) {
+    if (e->samples == 0) {
+        e->mean_us = us;
+        e->deviation_us = us / 2;
+    } else {
+        uint64_t error = us > e->mean_us ? us - e->mean_us : e->mean_us - us;
+        // deviation += (error - deviation) / 4, mean += (us - mean) / 8
+        e->deviation_us = e->deviation_us - e->deviation_us / 4 + error / 4;
+        e->mean_us = us > e->mean_us ? e->mean_us + (us - e->mean_us) / 8
+                                     : e->mean_us - (e->mean_us - us) / 8;
+    }
+    // The peak halves over roughly 90 samples
+    e->peak_us -= e->peak_us / 128;
+    if (us > e->peak_us) {
+        e->peak_us = us;
+    }
+    e->samples++;
+    e->backoff = 0;
+}
+
+void usbx_latency_complete(struct usbx_transfer *xfer, int completed, uint64_t now_us) {
+    struct usbx_latency_table *table = xfer->dev->latency;
+    int adapted = xfer->timeout_limit != 0;
+
+    if (adapted) {
+        xfer->timeout = xfer->timeout_limit;
+        xfer->timeout_limit = 0;
+    }
+    uint32_t key = transfer_key(xfer);
+    if (!completed || !key) {
+        return;
+    }
+    uint64_t elapsed = now_us > xfer->submit_us ? now_us - xfer->submit_us : 0;
+    int status = xfer->status;
+    if (status != USBX_TRANSFER_COMPLETED && status != USBX_TRANSFER_STALL &&
+        status != USBX_TRANSFER_OVERFLOW && !(status == USBX_TRANSFER_TIMED_OUT && adapted)) {
+        return;                     // no answer to learn from
+    }
+
+    pthread_mutex_lock(&table->lock);
+    struct estimate *est;
+    HASH_FIND(hh, table->estimates, &key, sizeof(key), est);
+    if (!est && table->count < USBX_LATENCY_MAX_ESTIMATES && (est = calloc(1, sizeof(*est)))) {
+        est->key = key;
+        if (key & CONTROL_KEY) {
+            est->e.request_type = (uint8_t)(key >> 8);
+            est->e.request = (uint8_t)key;
+        } else {
+            est->e.endpoint = (unsigned char)key;
+        }
+        HASH_ADD(hh, table->estimates, key, sizeof(key), est);
+        table->count++;
+    }
+    if (est) {
+        if (status != USBX_TRANSFER_TIMED_OUT) {
+            add_sample(&est->e, elapsed);
+        } else {
+            // Cut short by the estimate: allow twice as long next time
+            est->e.early_timeouts++;
+            if (est->e.backoff < USBX_LATENCY_MAX_BACKOFF) {
+                est->e.backoff++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+static int compare_keys(const void *a, const void *b) {
+    uint32_t x = ((const struct estimate *)a)->key, y = ((const struct estimate *)b)->key;
+    return x < y ? -1 : x > y;
+}
+
+int usbx_latency_get_estimates(struct usbx_latency_table *table,
+                               struct usbx_latency_estimate *estimates, int max) {
+    struct estimate *sorted = NULL, *est, *tmp;
+    int n = 0;
+
+    pthread_mutex_lock(&table->lock);
+    int count = table->count;
+    if (max > 0 && count > 0 && (sorted = malloc((size_t)count * sizeof(*sorted)))) {
+        HASH_ITER(hh, table->estimates, est, tmp) {
+            sorted[n] = *est;
+            sorted[n].e.timeout_ms = adaptive_timeout(table, &est->e);
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    if (max > 0 && count > 0 && !sorted) {
+        return 0;
+    }
+    if (sorted) {
+        qsort(sorted, (size_t)n, sizeof(*sorted), compare_keys);
+        for (int i = 0; i < n && i < max; i++) {
+            estimates[i] = sorted[i].e;
+        }
+        free(sorted);
+    }
+    return count;
+}
+
+void usbx_latency_reset(struct usbx_latency_table *table) {
+    pthread_mutex_lock(&table->lock);
+    clear_estimates(table);
+    pthread_mutex_unlock(&table->lock);
+}
@@ -11,17 +11,26 @@
  * 
  * Current implementation includes:
  * - libusb context initialization and cleanup
- * - uthash integration for device handle storage
+ * - uthash-based device handle storage (usbx_handles.h)
  * - Comprehensive error handling with descriptive messages
+ * - REST API served by libmicrohttpd (see usbx_api.h)
+ *
+ * Everything but this entry point is built into libusbx.a (see usbx.h);
+ * the service reads its configuration from the environment and serves the
+ * library's router over HTTP.
  * 
  * @copyright GNU General Public License v3.0
  */
 
+#ifdef USE_DEPS
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-// Include uthash - will work from either include/ or src/
+// The handle table is built on uthash - fail early with a hint if it is missing
 #ifdef __has_include
     #if __has_include("uthash.h")
         #include "uthash.h"
@@ -34,90 +43,337 @@
 #endif
 
 #ifdef USE_DEPS
-#include <libusb-1.0/libusb.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "usbx.h"
+#include "usbx_api.h"
+#include "usbx_blob.h"
+#include "usbx_config.h"
+#include "usbx_handoff.h"
+#include "usbx_handles.h"
+#include "usbx_http.h"
+#include "usbx_trace.h"
+#include "usbx_util.h"
+
+/** @brief Longest wait for a successor to take over the listening socket */
+#define USBX_HANDOFF_TIMEOUT_MS 10000
 #endif
 
+#ifdef USE_DEPS
 /**
- * @struct device_handle
- * @brief Structure for managing USB device handles with hash table storage
- * 
- * This structure is used with uthash to provide efficient storage and
- * lookup of USB device handles by integer ID.
+ * @brief Startup settings: the built-in defaults, each overridden by the environment
+ *        variable USBX_ plus its upper-case key (e.g. USBX_PORT for "port")
+ * @param config: Receives them
  */
-struct device_handle {
-    int handle_id;           /**< Unique device handle identifier */
-    void *device_ptr;        /**< Pointer to libusb device handle (placeholder) */
-    UT_hash_handle hh;       /**< uthash handle - makes structure hashable */
-};
+static void environment_config(struct usbx_config *config) {
+    char name[64];
 
-/** @brief Global libusb context for USB operations */
-#ifdef USE_DEPS
-libusb_context *ctx = NULL;
+    usbx_config_defaults(config);
+    for (int i = 0; i < usbx_config_num_keys(); i++) {
+        const char *key = usbx_config_key(i)->name;
+        size_t length = (size_t)snprintf(name, sizeof(name), "USBX_");
+        for (const char *c = key; *c && length + 1 < sizeof(name); c++) {
+            name[length++] = (char)toupper((unsigned char)*c);
+        }
+        name[length] = '\0';
+
+        const char *value = getenv(name);
+        if (value && *value && usbx_config_set(config, key, value) != USBX_SUCCESS) {
+            fprintf(stderr, "Warning: ignoring invalid %s '%s'\n", name, value);
+        }
+    }
+}
+
+/**
+ * @brief Publish the startup settings plus the file named by USBX_CONFIG
+ * @return 0, or -1 if the file cannot be read or holds an invalid setting
+ */
+static int configure(void) {
+    const char *path = getenv("USBX_CONFIG");
+    struct usbx_config startup;
+    char error[512];
+
+    environment_config(&startup);
+    if (usbx_config_start(&startup, path && *path ? path : NULL, error, sizeof(error)) !=
+        USBX_SUCCESS) {
+        fprintf(stderr, "Error: configuration: %s\n", error);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reload the config file; a rejected file leaves the settings unchanged
+ */
+static void reload_config(void) {
+    char error[512];
+
+    if (usbx_config_reload(error, sizeof(error)) != USBX_SUCCESS) {
+        fprintf(stderr, "Warning: configuration not reloaded: %s\n", error);
+        return;
+    }
+    printf("Configuration reloaded (version %llu)\n",
+           (unsigned long long)usbx_config_current()->version);
+}
+
+/**
+ * @brief Open the blob store of the configuration
+ * @return Store, or NULL (the service then runs without blobs)
+ */
+static struct usbx_blob_store *open_blob_store(void) {
+    const struct usbx_config *config = usbx_config_current();
+    int error;
+
+    struct usbx_blob_store *store = usbx_blob_store_open(config->blob_dir,
+                                                         config->blob_capacity, &error);
+    if (!store) {
+        fprintf(stderr, "Warning: blob store '%s' unavailable (%s); blobs disabled\n",
+                config->blob_dir, usbx_error_name(error));
+    }
+    return store;
+}
+
+/**
+ * @brief Serve on the listening socket of a predecessor if USBX_HANDOFF_SOCKET is set,
+ *        otherwise on the configured port
+ * @return 0 when serving, -1 on failure
+ */
+static int start_server(void) {
+    const char *path = getenv(USBX_HANDOFF_ENV);
+    int fd, conn;
+
+    if (!path || !*path) {
+        uint16_t port = (uint16_t)usbx_config_current()->port;
+        if (usbx_http_server_start(usbx_router(), port) < 0) {
+            fprintf(stderr, "Error: Failed to start HTTP server on port %u\n", port);
+            return -1;
+        }
+        printf("Listening on port %u\n", port);
+        return 0;
+    }
+    int received = usbx_handoff_receive(path, &fd, 1, USBX_HANDOFF_TIMEOUT_MS, &conn);
+    unsetenv(USBX_HANDOFF_ENV);     // our own successor gets a socket of its own
+    if (received < 1) {
+        fprintf(stderr, "Error: No listening socket from the predecessor at '%s' (%s)\n", path,
+                usbx_error_name(received < 0 ? received : USBX_ERROR_IO));
+        return -1;
+    }
+    if (usbx_http_server_start_socket(usbx_router(), fd) < 0) {
+        fprintf(stderr, "Error: Failed to serve on the inherited socket\n");
+        close(fd);
+        close(conn);
+        return -1;
+    }
+    if (usbx_handoff_ready(conn) != USBX_SUCCESS) {
+        fprintf(stderr, "Warning: predecessor gone before the handoff completed\n");
+    }
+    printf("Took over the listening socket from the predecessor\n");
+    return 0;
+}
+
+/**
+ * @brief Start a successor from the same executable and hand it the listening socket
+ * @param argv: Arguments this process was started with
+ * @return Non-zero if the successor serves and this process should drain and exit
+ */
+static int hand_off(char **argv) {
+    const char *configured = getenv(USBX_HANDOFF_ENV "_PATH");
+    char path[108];
+    struct usbx_handoff handoff;
+
+    if (configured && *configured) {
+        snprintf(path, sizeof(path), "%s", configured);
+    } else {
+        snprintf(path, sizeof(path), "/tmp/usbx-handoff.%ld.sock", (long)getpid());
+    }
+    int fd = usbx_http_server_listen_fd();
+    if (fd < 0 || usbx_handoff_listen(&handoff, path) != USBX_SUCCESS) {
+        fprintf(stderr, "Warning: cannot hand off the listening socket at '%s'\n", path);
+        return 0;
+    }
+
+    pid_t child = fork();
+    if (child == 0) {
+        sigset_t none;
+        sigemptyset(&none);
+        pthread_sigmask(SIG_SETMASK, &none, NULL);
+        setenv(USBX_HANDOFF_ENV, path, 1);
+        // The trace is still being written here; reopening it would truncate it
+        unsetenv("USBX_TRACE_FILE");
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    int result = child < 0 ? USBX_ERROR_IO :
+                             usbx_handoff_send(&handoff, &fd, 1, USBX_HANDOFF_TIMEOUT_MS);
+    usbx_handoff_close(&handoff);
+    if (result != USBX_SUCCESS) {
+        fprintf(stderr, "Warning: successor did not take over (%s); still serving\n",
+                usbx_error_name(result));
+        if (child > 0) {
+            kill(child, SIGTERM);
+            waitpid(child, NULL, 0);
+        }
+        return 0;
+    }
+    printf("Successor %ld serving, draining...\n", (long)child);
+    return 1;
+}
+
+/**
+ * @brief Stop accepting and wait up to drain_timeout_ms for open connections to finish
+ */
+static void drain(void) {
+    unsigned int timeout_ms = usbx_config_current()->drain_timeout_ms;
+    int fd = usbx_http_server_quiesce();
+    if (fd >= 0) {
+        close(fd);                  // the successor holds its own copy
+    }
+    uint64_t deadline = usbx_now_us() + (uint64_t)timeout_ms * 1000;
+    while (usbx_http_server_connections() > 0 && usbx_now_us() < deadline) {
+        struct timespec pause = {.tv_sec = 0, .tv_nsec = 10000000L};
+        nanosleep(&pause, NULL);
+    }
+    unsigned int left = usbx_http_server_connections();
+    if (left > 0) {
+        fprintf(stderr, "Warning: closing %u connections still open after draining\n", left);
+    }
+}
+
+/**
+ * @brief Record the session to USBX_TRACE_FILE if it is set
+ * @return Non-zero if recording started
+ */
+static int start_trace(void) {
+    const char *path = getenv("USBX_TRACE_FILE");
+    if (!path || !*path) {
+        return 0;
+    }
+    int result = usbx_trace_start(path, 0);
+    if (result != USBX_SUCCESS) {
+        fprintf(stderr, "Warning: cannot record trace '%s' (%s)\n", path, usbx_error_name(result));
+        return 0;
+    }
+    printf("Recording session trace to %s\n", path);
+    return 1;
+}
 #endif
 
 /**
  * @brief Main entry point for the usbX microservice
  * 
- * Initializes the usbX microservice by setting up uthash functionality
- * and initializing libusb context for USB device operations.
+ * Initializes libusbx and starts listening right after libusb_init();
+ * attached devices are catalogued in the background (usbx_discovery.h),
+ * so a restart does not wait for slow devices to answer.
  * 
  * Current implementation demonstrates:
- * - uthash hash table operations with device handles
  * - libusb context initialization with error handling
  * - Proper resource cleanup and exit code handling
  * 
  * @return EXIT_SUCCESS on successful initialization, EXIT_FAILURE on error
  * 
- * @note This is the current foundation implementation. Future versions will
- *       include HTTP server initialization and RESTful API endpoints.
+ * With dependencies available the service then runs the REST API until
+ * SIGINT or SIGTERM, listening on USBX_PORT (default 8080). Blobs are kept
+ * in USBX_BLOB_DIR (default /var/lib/usbx/blobs), capped at
+ * USBX_BLOB_CAPACITY_MB (default 1024). Compressed downloads use
+ * USBX_COMPRESSION_LEVEL (1-9, default 3). If USBX_TRACE_FILE is set, the
+ * session is recorded there for offline replay (see usbx_trace.h). Each
+ * client is limited to USBX_QUOTA_REQUESTS_PER_SEC and
+ * USBX_QUOTA_BYTES_PER_SEC, with bursts of USBX_QUOTA_REQUEST_BURST and
+ * USBX_QUOTA_BYTE_BURST (default unlimited; see usbx_quota.h). Request
+ * bodies and transfer buffers share USBX_MEMORY_BUDGET_MB (default
+ * unlimited), waiting up to USBX_MEMORY_BUDGET_WAIT_MS (default 5000) when
+ * it is exhausted (see usbx_budget.h).
+ *
+ * These variables set the startup values of the settings in usbx_config.h
+ * (USBX_ plus the upper-case key). The file named by USBX_CONFIG overrides
+ * them; SIGHUP or an empty POST /admin/config reloads it without a restart
+ * and rejects it, keeping the current settings, if it changes a setting
+ * that is only read at startup.
+ *
+ * SIGUSR2 restarts without downtime: a new process is started from the
+ * same command line and takes over the listening socket (usbx_handoff.h,
+ * through /tmp/usbx-handoff.<pid>.sock or USBX_HANDOFF_SOCKET_PATH); once
+ * it serves, this process stops accepting, drains open connections for up
+ * to USBX_DRAIN_TIMEOUT_MS (default 30000), closes its handles and exits.
+ * The successor does not record a trace: USBX_TRACE_FILE stays with this
+ * process until it has finished writing it.
+ *
+ * @param argc: Argument count
+ * @param argv: Arguments, reused to start the successor
  */
-int main(void) {
+int main(int argc, char **argv) {
+    (void)argc;
     printf("usbX microservice starting...\n");
     
-    // Demonstrate uthash functionality
-    printf("Testing uthash integration...\n");
-    struct device_handle *handles = NULL;
-    
-    // Create a test handle
-    struct device_handle *handle = malloc(sizeof(struct device_handle));
-    handle->handle_id = 1;
-    handle->device_ptr = (void*)0xDEADBEEF; // Dummy pointer
-    
-    // Add to hash table
-    HASH_ADD_INT(handles, handle_id, handle);
-    
-    // Find in hash table
-    struct device_handle *found_handle;
-    HASH_FIND_INT(handles, &handle->handle_id, found_handle);
-    
-    if (found_handle) {
-        printf("✓ uthash working: Found handle with ID %d\n", found_handle->handle_id);
-    } else {
-        printf("✗ uthash test failed\n");
-    }
-    
-    // Clean up uthash
-    HASH_DEL(handles, handle);
-    free(handle);
-    
     // TDD libusb initialization with proper error handling
 #ifdef USE_DEPS
+    uint64_t start_us = usbx_now_us();
     printf("Initializing libusb...\n");
-    int result = libusb_init(&ctx);
-    
-    if (result < 0) {
+    // Block the shutdown signals in every thread; main waits for them below
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if (configure() < 0) {
+        return EXIT_FAILURE;
+    }
+    int result = usbx_init(0);
+    if (result != USBX_SUCCESS) {
         // Log error to stderr with specific error information
-        fprintf(stderr, "Error: Failed to initialize libusb: %s (code: %d)\n", 
-                libusb_error_name(result), result);
+        fprintf(stderr, "Error: Failed to initialize libusbx %s: %s\n", usbx_version(),
+                usbx_error_name(result));
         return EXIT_FAILURE;
     }
-    
     printf("✓ libusb initialized successfully\n");
-    printf("usbX service ready!\n");
-    
-    // Cleanup and exit with success
-    libusb_exit(ctx);
+
+    struct usbx_blob_store *blobs = open_blob_store();
+    usbx_api_set_blob_store(blobs);
+    int tracing = start_trace();
+    int exit_code = EXIT_SUCCESS;
+    if (start_server() < 0) {
+        exit_code = EXIT_FAILURE;
+    } else {
+        printf("usbX service ready after %llu ms!\n",
+               (unsigned long long)((usbx_now_us() - start_us) / 1000));
+        int signal_number;
+        for (;;) {
+            sigwait(&signals, &signal_number);
+            if (signal_number == SIGHUP) {
+                reload_config();
+                continue;
+            }
+            if (signal_number != SIGUSR2) {
+                printf("Received signal %d, shutting down...\n", signal_number);
+                break;
+            }
+            printf("Received SIGUSR2, handing off to a new process...\n");
+            if (hand_off(argv)) {
+                drain();
+                break;
+            }
+        }
+        usbx_http_server_stop();
+    }
+
+    usbx_shutdown();
+    if (tracing && usbx_trace_stop() != USBX_SUCCESS) {
+        fprintf(stderr, "Warning: session trace is incomplete\n");
+    }
+    usbx_api_set_blob_store(NULL);
+    usbx_blob_store_close(blobs);
+    usbx_config_reset();
+    return exit_code;
 #else
+    (void)argv;
     printf("✓ Minimal build mode - libusb functionality not available\n");
     printf("usbX service ready! (minimal mode)\n");
 #endif
@@ -0,0 +1,690 @@
+/**
+ * @file msc.c
+ * @brief Bulk-Only Transport mass-storage access with an LRU read cache
+ *
+ * A command submits its CBW and all data chunks at once; a write also
+ * submits its CSW read, which the device only answers after the data. A
+ * read cannot queue the CSW behind its data, because a device that ends
+ * the data phase early would deliver the CSW into a data chunk; instead a
+ * short chunk cancels the chunks behind it and a CSW found in one of them
+ * is used. The cache is a uthash table in LRU order (oldest first) of
+ * CACHE_LINE_BLOCKS-block lines.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_budget.h"
+#include "usbx_msc.h"
+#include "usbx_util.h"
+#include "uthash.h"
+
+/** @brief Blocks per cache line; commands that fill the cache are aligned to lines */
+#define CACHE_LINE_BLOCKS 64
+
+/** @brief Bytes per data transfer of a command (a multiple of every bulk packet size) */
+#define DATA_CHUNK_SIZE (64 * 1024)
+
+/** @brief Upper bound of max_transfer */
+#define MAX_TRANSFER_LIMIT (16 * 1024 * 1024)
+
+/** @brief Largest transfer length of READ(10) / WRITE(10), rounded down to whole lines */
+#define MAX_BLOCKS_PER_COMMAND (65535 / CACHE_LINE_BLOCKS * CACHE_LINE_BLOCKS)
+
+/** @brief Size of the fixed-format REQUEST SENSE response */
+#define SENSE_SIZE 18
+
+/** @brief Marker for a slot whose transfer has not completed */
+#define SLOT_PENDING 0
+
+struct usbx_msc;
+
+/** @brief One transfer of a command */
+struct msc_slot {
+    struct usbx_transfer xfer;
+    struct usbx_msc *msc;
+    int done;
+};
+
+/** @brief Cached line of blocks */
+struct cache_line {
+    uint64_t index;             // first block / CACHE_LINE_BLOCKS (key)
+    unsigned char *data;
+    UT_hash_handle hh;
+};
+
+struct usbx_msc {
+    struct usbx_device *dev;
+    struct usbx_msc_options opts;
+    pthread_mutex_t lock;       // serialises commands; guards the cache and stats
+    uint32_t tag;
+    uint32_t block_size;
+    uint64_t block_count;
+    uint32_t max_blocks;        // per command, a multiple of CACHE_LINE_BLOCKS
+    unsigned char *scratch;     // max_blocks blocks
+    size_t scratch_reserved;    // budget held for scratch; each cache line holds its own
+    struct cache_line *cache;   // LRU order, oldest first
+    size_t cache_lines;
+    size_t max_cache_lines;
+    uint64_t next_sequential;   // block after the previous read
+    struct usbx_msc_stats stats;
+    /* Transfers of the running command */
+    struct msc_slot *slots;
+    int num_slots;
+    pthread_mutex_t done_lock;
+    pthread_cond_t done_cond;
+    int pending;
+    unsigned char cbw[USBX_MSC_CBW_SIZE];
+    unsigned char csw[USBX_MSC_CSW_SIZE];
+};
+
+void usbx_msc_options_init(struct usbx_msc_options *opts) {
+    opts->in_endpoint = 0x81;
+    opts->out_endpoint = 0x02;
+    opts->interface = 0;
+    opts->lun = 0;
+    opts->max_transfer = USBX_MSC_DEFAULT_MAX_TRANSFER;
+    opts->cache_size = USBX_MSC_DEFAULT_CACHE_SIZE;
+    opts->read_ahead_blocks = USBX_MSC_DEFAULT_READ_AHEAD;
+    opts->timeout = USBX_MSC_DEFAULT_TIMEOUT;
+}
+
+static void slot_done(struct usbx_transfer *xfer) {
+    struct msc_slot *slot = xfer->user_data;
+    struct usbx_msc *msc = slot->msc;
+
+    pthread_mutex_lock(&msc->done_lock);
+    slot->done = 1;
+    msc->pending--;
+    pthread_cond_broadcast(&msc->done_cond);
+    pthread_mutex_unlock(&msc->done_lock);
+}
+
+static void prepare_slot(struct usbx_msc *msc, int index, unsigned char endpoint,
+                         unsigned char *buffer, size_t length) {
+    struct msc_slot *slot = &msc->slots[index];
+
+    memset(&slot->xfer, 0, sizeof(slot->xfer));
+    slot->xfer.dev = msc->dev;
+    slot->xfer.endpoint = endpoint;
+    slot->xfer.type = USBX_TRANSFER_TYPE_BULK;
+    slot->xfer.timeout = msc->opts.timeout;
+    slot->xfer.length = (int)length;
+    slot->xfer.buffer = buffer;
+    slot->xfer.callback = slot_done;
+    slot->xfer.user_data = slot;
+    slot->msc = msc;
+    slot->done = SLOT_PENDING;
+}
+
+/* Submit slots [0, count); returns the number submitted */
+static int submit_slots(struct usbx_msc *msc, int count, int *error) {
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_lock(&msc->done_lock);
+        msc->pending++;
+        pthread_mutex_unlock(&msc->done_lock);
+        int result = usbx_submit_transfer(&msc->slots[i].xfer);
+        if (result < 0) {
+            pthread_mutex_lock(&msc->done_lock);
+            msc->pending--;
+            pthread_mutex_unlock(&msc->done_lock);
+            *error = result;
+            return i;
+        }
+    }
+    return count;
+}
+
+/* Cancel submitted slots in [first, last) that are still pending (done_lock not held) */
+static void cancel_slots(struct usbx_msc *msc, int first, int last) {
+    for (int i = first; i < last; i++) {
+        pthread_mutex_lock(&msc->done_lock);
+        int done = msc->slots[i].done;
+        pthread_mutex_unlock(&msc->done_lock);
+        if (!done) {
+            usbx_cancel_transfer(&msc->slots[i].xfer);
+        }
+    }
+}
+
+static int slot_ok(const struct msc_slot *slot) {
+    return slot->xfer.status == USBX_TRANSFER_COMPLETED &&
+           slot->xfer.actual_length == slot->xfer.length;
+}
+
+static int slot_error(const struct msc_slot *slot) {
+    return slot->xfer.status == USBX_TRANSFER_COMPLETED ? USBX_SUCCESS
+                                                        : usbx_status_to_error(slot->xfer.status);
+}
+
+/* A valid CSW for the current tag */
+static int parse_csw(struct usbx_msc *msc, const unsigned char *csw, int length,
+                     uint32_t *residue, int *status) {
+    if (length != USBX_MSC_CSW_SIZE || usbx_get_le32(csw) != USBX_MSC_CSW_SIGNATURE ||
+        usbx_get_le32(csw + 4) != msc->tag) {
+        return 0;
+    }
+    *residue = usbx_get_le32(csw + 8);
+    *status = csw[12];
+    return 1;
+}
+
+static int clear_halt(struct usbx_msc *msc, unsigned char endpoint) {
+    return usbx_clear_halt(msc->dev, endpoint, msc->opts.timeout);
+}
+
+/* Read the CSW on its own, clearing one stall first as BOT allows */
+static int read_csw(struct usbx_msc *msc, uint32_t *residue, int *status) {
+    int transferred = 0;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int result = usbx_bulk_transfer(msc->dev, msc->opts.in_endpoint, msc->csw,
+                                        USBX_MSC_CSW_SIZE, &transferred, msc->opts.timeout);
+        if (result == USBX_ERROR_PIPE && attempt == 0) {
+            clear_halt(msc, msc->opts.in_endpoint);
+            continue;
+        }
+        if (result < 0) {
+            return result;
+        }
+        return parse_csw(msc, msc->csw, transferred, residue, status) ? USBX_SUCCESS
+                                                                       : USBX_ERROR_PIPE;
+    }
+    return USBX_ERROR_PIPE;
+}
+
+/*
+ * Run one command through the BOT phases. Returns USBX_SUCCESS with the
+ * CSW status and residue, USBX_ERROR_PIPE when reset recovery is needed,
+ * or a transfer error.
+ */
+static int bot_command(struct usbx_msc *msc, const unsigned char *cb, size_t cb_length, int in,
+                       unsigned char *data, size_t length, uint32_t *residue, int *status) {
+    int chunks = (int)((length + DATA_CHUNK_SIZE - 1) / DATA_CHUNK_SIZE);
+    int csw_slot = in ? -1 : chunks + 1;
+    int count = chunks + (in ? 1 : 2);
+    unsigned char data_endpoint = in ? msc->opts.in_endpoint : msc->opts.out_endpoint;
+
+    msc->tag++;
+    msc->stats.commands++;
+    memset(msc->cbw, 0, sizeof(msc->cbw));
+    usbx_put_le32(msc->cbw, USBX_MSC_CBW_SIGNATURE);
+    usbx_put_le32(msc->cbw + 4, msc->tag);
+    usbx_put_le32(msc->cbw + 8, (uint32_t)length);
+    msc->cbw[12] = in ? USBX_ENDPOINT_IN : 0;
+    msc->cbw[13] = (unsigned char)msc->opts.lun;
+    msc->cbw[14] = (unsigned char)cb_length;
+    memcpy(msc->cbw + 15, cb, cb_length);
+
+    prepare_slot(msc, 0, msc->opts.out_endpoint, msc->cbw, sizeof(msc->cbw));
+    for (int i = 0; i < chunks; i++) {
+        size_t offset = (size_t)i * DATA_CHUNK_SIZE;
+        size_t chunk = length - offset < DATA_CHUNK_SIZE ? length - offset : DATA_CHUNK_SIZE;
+        prepare_slot(msc, i + 1, data_endpoint, data + offset, chunk);
+    }
+    if (csw_slot > 0) {
+        prepare_slot(msc, csw_slot, msc->opts.in_endpoint, msc->csw, sizeof(msc->csw));
+    }
+
+    int error = USBX_SUCCESS;
+    int submitted = submit_slots(msc, count, &error);
+    if (submitted < count) {
+        cancel_slots(msc, 0, submitted);
+    }
+
+    // Stop the transfers that can no longer complete normally
+    int stopped = submitted < count;
+    pthread_mutex_lock(&msc->done_lock);
+    while (msc->pending > 0) {
+        int stop = 0;
+        if (!stopped) {
+            stop = msc->slots[0].done && !slot_ok(&msc->slots[0]);
+            for (int i = 1; i <= chunks && !stop; i++) {
+                stop = msc->slots[i].done && !slot_ok(&msc->slots[i]);
+            }
+            // A CSW before the end of the data phase ends it
+            stop = stop || (csw_slot > 0 && msc->slots[csw_slot].done);
+        }
+        if (stop) {
+            // The CBW is never cancelled; it completes or times out on its own
+            stopped = 1;
+            pthread_mutex_unlock(&msc->done_lock);
+            cancel_slots(msc, 1, submitted);
+            pthread_mutex_lock(&msc->done_lock);
+            continue;
+        }
+        pthread_cond_wait(&msc->done_cond, &msc->done_lock);
+    }
+    pthread_mutex_unlock(&msc->done_lock);
+    if (submitted < count) {
+        return error;
+    }
+
+    struct msc_slot *cbw = &msc->slots[0];
+    if (!slot_ok(cbw)) {
+        return cbw->xfer.status == USBX_TRANSFER_COMPLETED ? USBX_ERROR_PIPE : slot_error(cbw);
+    }
+
+    // Find where the data phase ended and whether the CSW already arrived
+    int found = 0, data_stall = 0;
+    for (int i = 1; i <= chunks; i++) {
+        struct msc_slot *slot = &msc->slots[i];
+        if (slot_ok(slot)) {
+            continue;
+        }
+        if (slot->xfer.status == USBX_TRANSFER_STALL) {
+            data_stall = 1;
+        } else if (slot->xfer.status != USBX_TRANSFER_COMPLETED &&
+                   slot->xfer.status != USBX_TRANSFER_CANCELLED) {
+            return slot_error(slot);
+        }
+        // Reads only: a short chunk or one behind it may hold the CSW
+        for (int j = i; in && j <= chunks && !found; j++) {
+            struct msc_slot *later = &msc->slots[j];
+            found = later->xfer.status == USBX_TRANSFER_COMPLETED &&
+                    parse_csw(msc, later->xfer.buffer, later->xfer.actual_length, residue,
+                              status);
+        }
+        break;
+    }
+    if (!found && csw_slot > 0 && msc->slots[csw_slot].done &&
+        msc->slots[csw_slot].xfer.status == USBX_TRANSFER_COMPLETED) {
+        found = parse_csw(msc, msc->csw, msc->slots[csw_slot].xfer.actual_length, residue,
+                          status);
+        if (!found) {
+            return USBX_ERROR_PIPE;
+        }
+    }
+    if (data_stall) {
+        clear_halt(msc, data_endpoint);
+    }
+    if (!found) {
+        int result = read_csw(msc, residue, status);
+        if (result < 0) {
+            return result;
+        }
+    }
+    return *status == USBX_MSC_CSW_PHASE_ERROR ? USBX_ERROR_PIPE : USBX_SUCCESS;
+}
+
+/* Bulk-Only Mass Storage Reset followed by clearing both halts */
+static void reset_recovery(struct usbx_msc *msc) {
+    msc->stats.recoveries++;
+    usbx_control_transfer(msc->dev, 0x21, USBX_MSC_REQUEST_RESET, 0,
+                          (uint16_t)msc->opts.interface, NULL, 0, msc->opts.timeout);
+    clear_halt(msc, msc->opts.in_endpoint);
+    clear_halt(msc, msc->opts.out_endpoint);
+}
+
+/*
+ * Run a SCSI command with one retry after reset recovery. A failed
+ * command fetches the sense data and returns USBX_ERROR_IO.
+ */
+static int scsi_command(struct usbx_msc *msc, const unsigned char *cb, size_t cb_length, int in,
+                        unsigned char *data, size_t length) {
+    uint32_t residue = 0;
+    int status = USBX_MSC_CSW_PASSED;
+    int result = bot_command(msc, cb, cb_length, in, data, length, &residue, &status);
+
+    if (result == USBX_ERROR_PIPE) {
+        reset_recovery(msc);
+        result = bot_command(msc, cb, cb_length, in, data, length, &residue, &status);
+        if (result == USBX_ERROR_PIPE) {
+            reset_recovery(msc);
+        }
+    }
+    if (result < 0) {
+        return result;
+    }
+    if (status == USBX_MSC_CSW_FAILED) {
+        unsigned char sense_cb[6] = {USBX_SCSI_REQUEST_SENSE, 0, 0, 0, SENSE_SIZE, 0};
+        unsigned char sense[SENSE_SIZE];
+        memset(sense, 0, sizeof(sense));
+        if (bot_command(msc, sense_cb, sizeof(sense_cb), 1, sense, sizeof(sense), &residue,
+                        &status) == USBX_SUCCESS && status == USBX_MSC_CSW_PASSED) {
+            msc->stats.sense = (uint32_t)(sense[2] & 0x0f) << 16 | (uint32_t)sense[12] << 8 |
+                               sense[13];
+        }
+        return USBX_ERROR_IO;
+    }
+    return residue == 0 ? USBX_SUCCESS : USBX_ERROR_IO;
+}
+
+static int rw10(struct usbx_msc *msc, int opcode, uint64_t lba, uint32_t count,
+                unsigned char *data) {
+    unsigned char cb[10];
+
+    memset(cb, 0, sizeof(cb));
+    cb[0] = (unsigned char)opcode;
+    usbx_put_be32(cb + 2, (uint32_t)lba);
+    usbx_put_be16(cb + 7, (uint16_t)count);
+    int result = scsi_command(msc, cb, sizeof(cb), opcode == USBX_SCSI_READ_10, data,
+                              (size_t)count * msc->block_size);
+    if (result == USBX_SUCCESS) {
+        if (opcode == USBX_SCSI_READ_10) {
+            msc->stats.blocks_read += count;
+        } else {
+            msc->stats.blocks_written += count;
+        }
+    }
+    return result;
+}
+
+struct usbx_msc *usbx_msc_open(struct usbx_device *dev, const struct usbx_msc_options *opts,
+                               int *error) {
+    struct usbx_msc *msc = calloc(1, sizeof(*msc));
+    int result = USBX_ERROR_NO_MEM;
+
+    if (!msc) {
+        goto fail;
+    }
+    msc->dev = dev;
+    if (opts) {
+        msc->opts = *opts;
+    } else {
+        usbx_msc_options_init(&msc->opts);
+    }
+    if (!dev || msc->opts.lun < 0 || msc->opts.lun > 15 || msc->opts.interface < 0 ||
+        msc->opts.interface > 0xff || !(msc->opts.in_endpoint & USBX_ENDPOINT_IN) ||
+        (msc->opts.out_endpoint & USBX_ENDPOINT_IN) || msc->opts.max_transfer == 0) {
+        free(msc);
+        msc = NULL;
+        result = USBX_ERROR_INVALID_PARAM;
+        goto fail;
+    }
+    if (msc->opts.max_transfer > MAX_TRANSFER_LIMIT) {
+        msc->opts.max_transfer = MAX_TRANSFER_LIMIT;
+    }
+    msc->num_slots = (int)((msc->opts.max_transfer + DATA_CHUNK_SIZE - 1) / DATA_CHUNK_SIZE) + 2;
+    msc->slots = calloc((size_t)msc->num_slots, sizeof(*msc->slots));
+    if (!msc->slots) {
+        free(msc);
+        msc = NULL;
+        goto fail;
+    }
+    pthread_mutex_init(&msc->lock, NULL);
+    pthread_mutex_init(&msc->done_lock, NULL);
+    pthread_cond_init(&msc->done_cond, NULL);
+
+    // A unit attention after power-on fails the first TEST UNIT READY
+    unsigned char cb[10];
+    memset(cb, 0, sizeof(cb));
+    for (int attempt = 0; attempt < 3; attempt++) {
+        result = scsi_command(msc, cb, 6, 0, NULL, 0);
+        if (result != USBX_ERROR_IO) {
+            break;
+        }
+    }
+    unsigned char capacity[8];
+    if (result == USBX_SUCCESS) {
+        cb[0] = USBX_SCSI_READ_CAPACITY_10;
+        result = scsi_command(msc, cb, 10, 1, capacity, sizeof(capacity));
+    }
+    if (result == USBX_SUCCESS) {
+        uint32_t last = usbx_get_be32(capacity);
+        msc->block_size = usbx_get_be32(capacity + 4);
+        msc->block_count = (uint64_t)last + 1;
+        if (last == 0xffffffffU) {
+            result = USBX_ERROR_NOT_SUPPORTED;     // needs READ CAPACITY(16) and READ(16)
+        } else if (msc->block_size == 0 || msc->block_size > DATA_CHUNK_SIZE) {
+            result = USBX_ERROR_NOT_SUPPORTED;
+        }
+    }
+    if (result == USBX_SUCCESS) {
+        size_t max_blocks = msc->opts.max_transfer / msc->block_size;
+        max_blocks -= max_blocks % CACHE_LINE_BLOCKS;
+        if (max_blocks < CACHE_LINE_BLOCKS) {
+            max_blocks = CACHE_LINE_BLOCKS;
+        }
+        if (max_blocks > MAX_BLOCKS_PER_COMMAND) {
+            max_blocks = MAX_BLOCKS_PER_COMMAND;
+        }
+        // Lines must fit in one command even when max_transfer is small
+        size_t needed = (max_blocks * msc->block_size + DATA_CHUNK_SIZE - 1) / DATA_CHUNK_SIZE + 2;
+        if (needed > (size_t)msc->num_slots) {
+            struct msc_slot *slots = realloc(msc->slots, needed * sizeof(*slots));
+            if (slots) {
+                msc->slots = slots;
+                msc->num_slots = (int)needed;
+            } else {
+                result = USBX_ERROR_NO_MEM;
+            }
+        }
+        msc->max_blocks = (uint32_t)max_blocks;
+        msc->max_cache_lines = msc->opts.cache_size /
+                               ((size_t)CACHE_LINE_BLOCKS * msc->block_size);
+        msc->next_sequential = UINT64_MAX;
+        if (result == USBX_SUCCESS &&
+            usbx_budget_try_reserve(max_blocks * msc->block_size) == USBX_SUCCESS) {
+            msc->scratch_reserved = max_blocks * msc->block_size;
+            msc->scratch = malloc(msc->scratch_reserved);
+        }
+        if (!msc->scratch) {
+            result = USBX_ERROR_NO_MEM;
+        }
+    }
+    if (result == USBX_SUCCESS) {
+        return msc;
+    }
+    usbx_msc_close(msc);
+    msc = NULL;
+
+fail:
+    if (error) {
+        *error = result;
+    }
+    return msc;
+}
+
+void usbx_msc_close(struct usbx_msc *msc) {
+    struct cache_line *line, *tmp;
+
+    if (!msc) {
+        return;
+    }
+    HASH_ITER(hh, msc->cache, line, tmp) {
+        HASH_DEL(msc->cache, line);
+        free(line->data);
+        free(line);
+        usbx_budget_release((size_t)CACHE_LINE_BLOCKS * msc->block_size);
+    }
+    pthread_cond_destroy(&msc->done_cond);
+    pthread_mutex_destroy(&msc->done_lock);
+    pthread_mutex_destroy(&msc->lock);
+    free(msc->scratch);
+    usbx_budget_release(msc->scratch_reserved);
+    free(msc->slots);
+    free(msc);
+}
+
+/* Look a line up and mark it most recently used (lock held) */
+static struct cache_line *cache_find(struct usbx_msc *msc, uint64_t index) {
+    struct cache_line *line;
+
+    HASH_FIND(hh, msc->cache, &index, sizeof(index), line);
+    if (line) {
+        HASH_DEL(msc->cache, line);
+        HASH_ADD(hh, msc->cache, index, sizeof(line->index), line);
+    }
+    return line;
+}
+
+/* Store a line read from the device, evicting the least recently used one (lock held) */
+static void cache_store(struct usbx_msc *msc, uint64_t index, const unsigned char *data,
+                        size_t length) {
+    struct cache_line *line = NULL;
+    size_t line_bytes = (size_t)CACHE_LINE_BLOCKS * msc->block_size;
+
+    if (msc->cache_lines >= msc->max_cache_lines) {
+        line = msc->cache;
+        HASH_DEL(msc->cache, line);
+        msc->cache_lines--;
+    } else {
+        // Caching is optional: without budget the read is simply not cached
+        if (usbx_budget_try_reserve(line_bytes) != USBX_SUCCESS) {
+            return;
+        }
+        line = calloc(1, sizeof(*line));
+        if (line) {
+            line->data = malloc(line_bytes);
+        }
+        if (!line || !line->data) {
+            free(line);
+            usbx_budget_release(line_bytes);
+            return;
+        }
+    }
+    line->index = index;
+    memcpy(line->data, data, length);
+    HASH_ADD(hh, msc->cache, index, sizeof(line->index), line);
+    msc->cache_lines++;
+}
+
+static int check_range(struct usbx_msc *msc, uint64_t lba, uint32_t count) {
+    return lba <= msc->block_count && count <= msc->block_count - lba ? USBX_SUCCESS
+                                                                       : USBX_ERROR_INVALID_PARAM;
+}
+
+/* Read without the cache (lock held) */
+static int read_direct(struct usbx_msc *msc, uint64_t lba, uint32_t count, unsigned char *data) {
+    while (count > 0) {
+        uint32_t blocks = count < msc->max_blocks ? count : msc->max_blocks;
+        int result = rw10(msc, USBX_SCSI_READ_10, lba, blocks, data);
+        if (result < 0) {
+            return result;
+        }
+        msc->stats.cache_misses += blocks;
+        lba += blocks;
+        count -= blocks;
+        data += (size_t)blocks * msc->block_size;
+    }
+    return USBX_SUCCESS;
+}
+
+int usbx_msc_read(struct usbx_msc *msc, uint64_t lba, uint32_t count, unsigned char *data) {
+    int result = check_range(msc, lba, count);
+    if (result < 0 || count == 0) {
+        return result;
+    }
+
+    pthread_mutex_lock(&msc->lock);
+    uint64_t end = lba + count;
+    if (msc->max_cache_lines == 0) {
+        result = read_direct(msc, lba, count, data);
+        pthread_mutex_unlock(&msc->lock);
+        return result;
+    }
+
+    // Sequential reads fetch ahead, up to the end of the device
+    uint64_t fetch_end = end;
+    if (lba == msc->next_sequential) {
+        fetch_end = end + msc->opts.read_ahead_blocks;
+        if (fetch_end > msc->block_count) {
+            fetch_end = msc->block_count;
+        }
+    }
+    msc->next_sequential = end;
+
+    size_t block_size = msc->block_size;
+    uint64_t pos = lba;
+    while (pos < end) {
+        uint64_t index = pos / CACHE_LINE_BLOCKS;
+        uint64_t line_start = index * CACHE_LINE_BLOCKS;
+        uint64_t line_end = line_start + CACHE_LINE_BLOCKS;
+        struct cache_line *line = cache_find(msc, index);
+        if (line) {
+            uint64_t stop = line_end < end ? line_end : end;
+            memcpy(data + (pos - lba) * block_size, line->data + (pos - line_start) * block_size,
+                   (size_t)(stop - pos) * block_size);
+            msc->stats.cache_hits += stop - pos;
+            pos = stop;
+            continue;
+        }
+
+        // One command for the run of missing lines, including read-ahead
+        uint64_t run_end = line_start;
+        struct cache_line *cached = NULL;
+        do {
+            run_end += CACHE_LINE_BLOCKS;
+            uint64_t next = run_end / CACHE_LINE_BLOCKS;
+            HASH_FIND(hh, msc->cache, &next, sizeof(next), cached);
+        } while (run_end < fetch_end && run_end - line_start < msc->max_blocks && !cached);
+        if (run_end > msc->block_count) {
+            run_end = msc->block_count;
+        }
+        result = rw10(msc, USBX_SCSI_READ_10, line_start, (uint32_t)(run_end - line_start),
+                      msc->scratch);
+        if (result < 0) {
+            break;
+        }
+        for (uint64_t start = line_start; start < run_end; start += CACHE_LINE_BLOCKS) {
+            uint64_t stop = start + CACHE_LINE_BLOCKS < run_end ? start + CACHE_LINE_BLOCKS
+                                                                : run_end;
+            cache_store(msc, start / CACHE_LINE_BLOCKS,
+                        msc->scratch + (start - line_start) * block_size,
+                        (size_t)(stop - start) * block_size);
+        }
+        uint64_t stop = run_end < end ? run_end : end;
+        memcpy(data + (pos - lba) * block_size, msc->scratch + (pos - line_start) * block_size,
+               (size_t)(stop - pos) * block_size);
+        msc->stats.cache_misses += stop - pos;
+        if (run_end > end) {
+            msc->stats.read_ahead_blocks += run_end - (end > line_start ? end : line_start);
+        }
+        pos = stop;
+    }
+    pthread_mutex_unlock(&msc->lock);
+    return result;
+}
+
+int usbx_msc_write(struct usbx_msc *msc, uint64_t lba, uint32_t count, const unsigned char *data) {
+    int result = check_range(msc, lba, count);
+    if (result < 0) {
+        return result;
+    }
+
+    pthread_mutex_lock(&msc->lock);
+    size_t block_size = msc->block_size;
+    for (uint32_t done = 0; done < count && result == USBX_SUCCESS;) {
+        uint32_t blocks = count - done < msc->max_blocks ? count - done : msc->max_blocks;
+        // OUT buffers are only read
+        result = rw10(msc, USBX_SCSI_WRITE_10, lba + done, blocks,
+                      (unsigned char *)data + (size_t)done * block_size);
+        done += blocks;
+    }
+
+    // Keep cached lines in step with what was written, even after a partial failure
+    uint64_t end = lba + count;
+    for (uint64_t pos = lba; pos < end;) {
+        uint64_t index = pos / CACHE_LINE_BLOCKS;
+        uint64_t line_start = index * CACHE_LINE_BLOCKS;
+        uint64_t stop = line_start + CACHE_LINE_BLOCKS < end ? line_start + CACHE_LINE_BLOCKS
+                                                             : end;
+        struct cache_line *line;
+        HASH_FIND(hh, msc->cache, &index, sizeof(index), line);
+        if (line && result == USBX_SUCCESS) {
+            memcpy(line->data + (pos - line_start) * block_size,
+                   data + (pos - lba) * block_size, (size_t)(stop - pos) * block_size);
+        } else if (line) {
+            HASH_DEL(msc->cache, line);
+            msc->cache_lines--;
+            free(line->data);
+            free(line);
+            usbx_budget_release((size_t)CACHE_LINE_BLOCKS * block_size);
+        }
+        pos = stop;
+    }
+    pthread_mutex_unlock(&msc->lock);
+    return result;
+}
+
+void usbx_msc_get_stats(struct usbx_msc *msc, struct usbx_msc_stats *stats) {
+    pthread_mutex_lock(&msc->lock);
+    *stats = msc->stats;
+    stats->block_size = msc->block_size;
+    stats->block_count = msc->block_count;
+    pthread_mutex_unlock(&msc->lock);
+}
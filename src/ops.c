@@ -0,0 +1,532 @@
+/**
+ * @file ops.c
+ * @brief Batches of device operations described in JSON
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_blob.h"
+#include "usbx_buf.h"
+#include "usbx_budget.h"
+#include "usbx_bulk.h"
+#include "usbx_codec.h"
+#include "usbx_crc32c.h"
+#include "usbx_json.h"
+#include "usbx_ops.h"
+#include "usbx_retry.h"
+#include "usbx_util.h"
+
+static const char *const op_names[] = {"control", "bulk", "interrupt", "delay", "verify"};
+
+/** @brief Bytes read per segmented transfer of a bulk verify */
+#define VERIFY_CHUNK_SIZE (1024 * 1024)
+
+const char *usbx_op_name(int type) {
+    if (type < 0 || type >= (int)(sizeof(op_names) / sizeof(op_names[0]))) {
+        return "unknown";
+    }
+    return op_names[type];
+}
+
+/* Read a non-negative integer member; absent members yield @p fallback */
+static int get_field(const struct usbx_json *object, const char *key, long long max,
+                     long long fallback, long long *out, const char **message,
+                     const char *problem) {
+    if (usbx_json_get_int(object, key, 0, max, fallback, out) < 0) {
+        *message = problem;
+        return -1;
+    }
+    return 0;
+}
+
+/* Decode the "data" member or resolve the "blob" of an OUT operation, or read "length" of an IN one */
+static int parse_payload(const struct usbx_json *object, struct usbx_op *op, size_t max,
+                         struct usbx_blob_store *blobs, const char **message) {
+    const struct usbx_json *data = usbx_json_get(object, "data");
+    const struct usbx_json *blob = usbx_json_get(object, "blob");
+    long long length;
+
+    if (op->in) {
+        if (data || blob) {
+            *message = "IN operations take length, not data";
+            return -1;
+        }
+        if (get_field(object, "length", (long long)max, -1, &length, message,
+                      "length is out of range") < 0) {
+            return -1;
+        }
+        if (length < 0) {
+            *message = "IN operations need a length";
+            return -1;
+        }
+        op->length = (size_t)length;
+        return 0;
+    }
+
+    if (usbx_json_get(object, "length") || (data && blob)) {
+        *message = "OUT operations take either data or blob";
+        return -1;
+    }
+    if (blob) {
+        if (!blobs) {
+            *message = "No blob store is configured";
+            return -1;
+        }
+        op->blob = usbx_blob_get(blobs, usbx_json_string(blob));
+        if (!op->blob) {
+            *message = "blob does not name a stored blob";
+            return -1;
+        }
+        if (usbx_blob_size(op->blob) > max) {
+            *message = "blob exceeds the size limit of the operation";
+            return -1;
+        }
+        op->data = usbx_blob_data(op->blob);
+        op->length = usbx_blob_size(op->blob);
+        return 0;
+    }
+    if (!data) {
+        op->length = 0;
+        return 0;
+    }
+    if (data->type != USBX_JSON_STRING || data->length / 4 * 3 > max + 2) {
+        *message = "data must be base64 within the size limit";
+        return -1;
+    }
+    size_t size = 3 * ((data->length + 3) / 4) + 1;
+    int reserved = usbx_budget_reserve(size);
+    if (reserved != USBX_SUCCESS) {
+        *message = "Memory budget exhausted";
+        return reserved;
+    }
+    op->reserved = size;
+    op->decoded = malloc(size);
+    if (!op->decoded) {
+        *message = "Out of memory";
+        return -1;
+    }
+    long decoded = usbx_base64_decode(data->string, data->length, op->decoded);
+    if (decoded < 0 || (size_t)decoded > max) {
+        *message = "data must be base64 within the size limit";
+        return -1;
+    }
+    op->data = op->decoded;
+    op->length = (size_t)decoded;
+    return 0;
+}
+
+static size_t digest_size(int algorithm) {
+    return algorithm == USBX_DIGEST_CRC32C ? 4 : USBX_SHA256_SIZE;
+}
+
+/* Read the length, algorithm and expected digest of a verify operation */
+static int parse_verify(const struct usbx_json *object, struct usbx_op *op,
+                        unsigned long long max, struct usbx_blob_store *blobs,
+                        const char **message) {
+    const char *algorithm = usbx_json_string(usbx_json_get(object, "algorithm"));
+    const struct usbx_json *expect = usbx_json_get(object, "expect");
+    const char *blob_hash = usbx_json_string(usbx_json_get(object, "blob"));
+    long long length;
+
+    if (!op->in) {
+        *message = "verify reads from an IN endpoint or control request";
+        return -1;
+    }
+    if (!algorithm || strcmp(algorithm, "sha256") == 0) {
+        op->algorithm = USBX_DIGEST_SHA256;
+    } else if (strcmp(algorithm, "crc32c") == 0) {
+        op->algorithm = USBX_DIGEST_CRC32C;
+    } else {
+        *message = "algorithm must be sha256 or crc32c";
+        return -1;
+    }
+    if (get_field(object, "length", (long long)max, -1, &length, message,
+                  "length is out of range") < 0) {
+        return -1;
+    }
+    if (expect && blob_hash) {
+        *message = "verify takes either expect or blob";
+        return -1;
+    }
+
+    size_t size = digest_size(op->algorithm);
+    if (expect) {
+        const char *hex = usbx_json_string(expect);
+        if (!hex || strlen(hex) != 2 * size || usbx_hex_decode(hex, 2 * size, op->expected) < 0) {
+            *message = "expect must be a hex digest of the chosen algorithm";
+            return -1;
+        }
+        op->has_expected = 1;
+    } else if (blob_hash) {
+        struct usbx_blob *blob = blobs ? usbx_blob_get(blobs, blob_hash) : NULL;
+        if (!blob) {
+            *message = blobs ? "blob does not name a stored blob" : "No blob store is configured";
+            return -1;
+        }
+        size_t blob_size = usbx_blob_size(blob);
+        if (length >= 0 && (unsigned long long)length != blob_size) {
+            usbx_blob_release(blob);
+            *message = "length differs from the blob size";
+            return -1;
+        }
+        length = (long long)blob_size;
+        if (op->algorithm == USBX_DIGEST_SHA256) {
+            usbx_hex_decode(blob_hash, 2 * USBX_SHA256_SIZE, op->expected);
+        } else {
+            usbx_put_be32(op->expected, usbx_crc32c(0, usbx_blob_data(blob), blob_size));
+        }
+        usbx_blob_release(blob);
+        op->has_expected = 1;
+    }
+    if (length < 0 || (unsigned long long)length > max) {
+        *message = "verify needs a length within the limit";
+        return -1;
+    }
+    op->length = (size_t)length;
+    return 0;
+}
+
+static int parse_op(const struct usbx_json *object, struct usbx_op *op,
+                    struct usbx_blob_store *blobs, const char **message) {
+    const char *name = usbx_json_string(usbx_json_get(object, "op"));
+    long long value;
+
+    memset(op, 0, sizeof(*op));
+    if (object->type != USBX_JSON_OBJECT || !name) {
+        *message = "Each operation needs an \"op\" name";
+        return -1;
+    }
+    op->type = -1;
+    for (int i = 0; i < (int)(sizeof(op_names) / sizeof(op_names[0])); i++) {
+        if (strcmp(name, op_names[i]) == 0) {
+            op->type = i;
+        }
+    }
+    if (op->type < 0) {
+        *message = "op must be control, bulk, interrupt, delay or verify";
+        return -1;
+    }
+
+    if (op->type == USBX_OP_DELAY) {
+        if (get_field(object, "ms", USBX_OPS_MAX_DELAY_MS, 0, &value, message,
+                      "ms is out of range") < 0) {
+            return -1;
+        }
+        op->delay_ms = (unsigned int)value;
+        return 0;
+    }
+
+    if (get_field(object, "timeout", 0x7fffffffLL, USBX_OPS_DEFAULT_TIMEOUT, &value, message,
+                  "timeout is out of range") < 0) {
+        return -1;
+    }
+    op->timeout = (unsigned int)value;
+    const struct usbx_json *idempotent = usbx_json_get(object, "idempotent");
+    op->idempotent = idempotent ? usbx_json_bool(idempotent, 0) : USBX_RETRY_POLICY_DEFAULT;
+
+    // A verify without an endpoint reads through a control request
+    if (op->type == USBX_OP_CONTROL ||
+        (op->type == USBX_OP_VERIFY && !usbx_json_get(object, "endpoint"))) {
+        long long request_type, request, wvalue, windex;
+        if (get_field(object, "request_type", 0xff, -1, &request_type, message,
+                      "request_type is required (0-255)") < 0 ||
+            get_field(object, "request", 0xff, -1, &request, message,
+                      "request is required (0-255)") < 0 ||
+            get_field(object, "value", 0xffff, 0, &wvalue, message,
+                      "value is out of range") < 0 ||
+            get_field(object, "index", 0xffff, 0, &windex, message,
+                      "index is out of range") < 0) {
+            return -1;
+        }
+        if (request_type < 0 || request < 0) {
+            *message = "request_type and request are required";
+            return -1;
+        }
+        op->request_type = (uint8_t)request_type;
+        op->request = (uint8_t)request;
+        op->value = (uint16_t)wvalue;
+        op->index = (uint16_t)windex;
+        op->in = (op->request_type & USBX_ENDPOINT_IN) != 0;
+        if (op->type == USBX_OP_VERIFY) {
+            return parse_verify(object, op, 0xffff, blobs, message);
+        }
+        return parse_payload(object, op, 0xffff, blobs, message);
+    }
+
+    if (get_field(object, "endpoint", 0xff, -1, &value, message,
+                  "endpoint is required") < 0) {
+        return -1;
+    }
+    if (value < 0 || (value & 0x70) != 0 || (value & 0x0f) == 0) {
+        *message = "endpoint is not a valid address";
+        return -1;
+    }
+    op->endpoint = (unsigned char)value;
+    op->in = (op->endpoint & USBX_ENDPOINT_IN) != 0;
+    op->zero_packet = usbx_json_bool(usbx_json_get(object, "zero_packet"), 0);
+    if (op->type == USBX_OP_VERIFY) {
+        return parse_verify(object, op, USBX_OPS_MAX_VERIFY_LENGTH, blobs, message);
+    }
+    return parse_payload(object, op, USBX_OPS_MAX_LENGTH, blobs, message);
+}
+
+int usbx_op_batch_parse(const struct usbx_json *operations, int stop_on_error,
+                        struct usbx_blob_store *blobs, struct usbx_op_batch *batch,
+                        const char **message) {
+    const char *ignored;
+    const struct usbx_json *item;
+    int count;
+
+    if (!message) {
+        message = &ignored;
+    }
+    memset(batch, 0, sizeof(*batch));
+    batch->stop_on_error = stop_on_error;
+
+    if (operations && operations->type == USBX_JSON_OBJECT) {
+        item = operations;
+        count = 1;
+    } else if (operations && operations->type == USBX_JSON_ARRAY) {
+        item = operations->child;
+        count = (int)operations->length;
+    } else {
+        *message = "operations must be an array or an object";
+        return -1;
+    }
+    if (count == 0 || count > USBX_OPS_MAX_OPERATIONS) {
+        *message = "Between 1 and 1024 operations are required";
+        return -1;
+    }
+
+    batch->ops = calloc((size_t)count, sizeof(*batch->ops));
+    if (!batch->ops) {
+        *message = "Out of memory";
+        return -1;
+    }
+    for (; batch->count < count; batch->count++, item = item->next) {
+        int result = parse_op(item, &batch->ops[batch->count], blobs, message);
+        if (result < 0) {
+            batch->count++;     // release a partially parsed payload too
+            usbx_op_batch_free(batch);
+            return result;
+        }
+    }
+    return 0;
+}
+
+void usbx_op_batch_free(struct usbx_op_batch *batch) {
+    for (int i = 0; i < batch->count; i++) {
+        free(batch->ops[i].decoded);
+        usbx_budget_release(batch->ops[i].reserved);
+        usbx_blob_release(batch->ops[i].blob);
+    }
+    free(batch->ops);
+    batch->ops = NULL;
+    batch->count = 0;
+}
+
+/** @brief Running digest of a verify operation */
+struct digest {
+    int algorithm;
+    struct usbx_sha256 sha256;
+    uint32_t crc;
+};
+
+static void digest_update(struct digest *d, const unsigned char *data, size_t length) {
+    if (d->algorithm == USBX_DIGEST_CRC32C) {
+        d->crc = usbx_crc32c(d->crc, data, length);
+    } else {
+        usbx_sha256_update(&d->sha256, data, length);
+    }
+}
+
+/*
+ * Read the range of a verify operation into @p digest. Bulk data is read in
+ * chunks and hashed as it arrives, so only one chunk is ever held.
+ */
+static int run_verify(struct usbx_device *dev, const struct usbx_op *op, unsigned char *digest,
+                      size_t *transferred) {
+    size_t chunk = op->length < VERIFY_CHUNK_SIZE ? op->length : VERIFY_CHUNK_SIZE;
+    unsigned char *buffer = malloc(chunk > 0 ? chunk : 1);
+    struct digest d = {.algorithm = op->algorithm, .crc = 0};
+    int result = USBX_SUCCESS;
+
+    *transferred = 0;
+    if (!buffer) {
+        return USBX_ERROR_NO_MEM;
+    }
+    usbx_sha256_init(&d.sha256);
+
+    if (op->endpoint == 0) {
+        result = usbx_control_transfer(dev, op->request_type, op->request, op->value, op->index,
+                                       buffer, (uint16_t)op->length, op->timeout);
+        if (result >= 0) {
+            digest_update(&d, buffer, (size_t)result);
+            *transferred = (size_t)result;
+            result = USBX_SUCCESS;
+        }
+    } else {
+        struct usbx_segment_options opts;
+        struct usbx_segment_result segment;
+        usbx_segment_options_init(&opts);
+        opts.timeout = op->timeout;
+        while (*transferred < op->length) {
+            size_t length = op->length - *transferred < chunk ? op->length - *transferred : chunk;
+            result = usbx_bulk_transfer_segmented(dev, op->endpoint, buffer, length, &opts,
+                                                  &segment);
+            digest_update(&d, buffer, segment.transferred);
+            *transferred += segment.transferred;
+            // A short packet ends the device's message, as for a single bulk read
+            if (result < 0 || segment.short_packet) {
+                break;
+            }
+        }
+    }
+    free(buffer);
+
+    if (op->algorithm == USBX_DIGEST_CRC32C) {
+        usbx_put_be32(digest, d.crc);
+    } else {
+        usbx_sha256_final(&d.sha256, digest);
+    }
+    if (result == USBX_SUCCESS && op->has_expected &&
+        memcmp(digest, op->expected, digest_size(op->algorithm)) != 0) {
+        result = USBX_ERROR_MISMATCH;
+    }
+    return result;
+}
+
+/* Run one operation; IN data lands in @p in_data */
+static int run_op(struct usbx_device *dev, const struct usbx_op *op, unsigned char *in_data,
+                  size_t *transferred) {
+    // OUT buffers are only read, so a read-only blob mapping can be passed on
+    unsigned char *data = op->in ? in_data : (unsigned char *)op->data;
+    int result, actual = 0;
+
+    *transferred = 0;
+    switch (op->type) {
+    case USBX_OP_CONTROL:
+        result = usbx_control_transfer(dev, op->request_type, op->request, op->value, op->index,
+                                       data, (uint16_t)op->length, op->timeout);
+        if (result < 0) {
+            return result;
+        }
+        *transferred = (size_t)result;
+        return USBX_SUCCESS;
+    case USBX_OP_BULK: {
+        struct usbx_segment_options opts;
+        struct usbx_segment_result segment;
+        usbx_segment_options_init(&opts);
+        opts.timeout = op->timeout;
+        opts.flags = op->zero_packet ? USBX_SEGMENT_ZERO_PACKET : 0;
+        result = usbx_bulk_transfer_segmented(dev, op->endpoint, data, op->length, &opts,
+                                              &segment);
+        *transferred = segment.transferred;
+        return result;
+    }
+    case USBX_OP_INTERRUPT:
+        result = usbx_interrupt_transfer(dev, op->endpoint, data, (int)op->length, &actual,
+                                         op->timeout);
+        *transferred = actual > 0 ? (size_t)actual : 0;
+        return result;
+    default:
+        usbx_sleep_us((uint64_t)op->delay_ms * 1000);
+        return USBX_SUCCESS;
+    }
+}
+
+/** @brief One operation as seen by usbx_retry_run() */
+struct op_attempt {
+    struct usbx_device *dev;
+    const struct usbx_op *op;
+    unsigned char *in_data;
+};
+
+static int attempt_op(void *cls, size_t *transferred) {
+    struct op_attempt *attempt = cls;
+    return run_op(attempt->dev, attempt->op, attempt->in_data, transferred);
+}
+
+/* Reserve budget for the data an IN operation reads and its base64 form in the results */
+static int reserve_in(const struct usbx_op *op, size_t *reserved) {
+    size_t size = op->length + usbx_base64_encoded_size(op->length) + 1;
+    int result = usbx_budget_reserve(size);
+    *reserved = result == USBX_SUCCESS ? size : 0;
+    return result;
+}
+
+int usbx_op_batch_run(struct usbx_device *dev, const struct usbx_op_batch *batch,
+                      struct usbx_retry_table *retry, struct usbx_buf *out) {
+    int first_error = USBX_SUCCESS;
+
+    usbx_buf_printf(out, "[");
+    for (int i = 0; i < batch->count; i++) {
+        const struct usbx_op *op = &batch->ops[i];
+        unsigned char *in_data = NULL;
+        unsigned char digest[USBX_SHA256_SIZE];
+        size_t transferred, reserved = 0;
+        int result, retries = 0;
+
+        if (op->type == USBX_OP_VERIFY) {
+            result = run_verify(dev, op, digest, &transferred);
+        } else if (op->in && op->length > 0 && (result = reserve_in(op, &reserved)) < 0) {
+            transferred = 0;
+        } else if (op->in && op->length > 0 && !(in_data = malloc(op->length))) {
+            result = USBX_ERROR_NO_MEM;
+            transferred = 0;
+        } else if (op->type == USBX_OP_DELAY) {
+            result = run_op(dev, op, in_data, &transferred);
+        } else {
+            struct op_attempt attempt = {dev, op, in_data};
+            result = usbx_retry_run(retry, dev, op->type == USBX_OP_CONTROL ? 0 : op->endpoint,
+                                    op->in, op->idempotent, attempt_op, &attempt, &transferred,
+                                    &retries);
+        }
+
+        usbx_buf_printf(out, "%s{\"index\": %d, \"op\": \"%s\", \"status\": \"%s\", "
+                        "\"code\": %d, \"transferred\": %zu",
+                        i > 0 ? ", " : "", i, usbx_op_name(op->type), usbx_error_name(result),
+                        result, transferred);
+        if (retries > 0) {
+            usbx_buf_printf(out, ", \"retries\": %d", retries);
+        }
+        if (op->type == USBX_OP_VERIFY && result != USBX_ERROR_NO_MEM) {
+            char hex[2 * USBX_SHA256_SIZE + 1];
+            usbx_hex_encode(digest, digest_size(op->algorithm), hex);
+            usbx_buf_printf(out, ", \"algorithm\": \"%s\", \"digest\": \"%s\", \"match\": %s",
+                            op->algorithm == USBX_DIGEST_CRC32C ? "crc32c" : "sha256", hex,
+                            !op->has_expected              ? "null"
+                            : result == USBX_SUCCESS       ? "true"
+                            : result == USBX_ERROR_MISMATCH ? "false"
+                                                           : "null");
+        } else if (op->in && op->type != USBX_OP_DELAY) {
+            char *encoded = malloc(usbx_base64_encoded_size(transferred) + 1);
+            if (encoded) {
+                size_t length = usbx_base64_encode(in_data, transferred, encoded);
+                usbx_buf_printf(out, ", \"data\": \"");
+                usbx_buf_append(out, encoded, length);
+                usbx_buf_printf(out, "\"");
+                free(encoded);
+            } else {
+                out->failed = 1;
+            }
+        }
+        usbx_buf_printf(out, "}");
+        free(in_data);
+        usbx_budget_release(reserved);
+
+        if (result != USBX_SUCCESS && first_error == USBX_SUCCESS) {
+            first_error = result;
+        }
+        if (result != USBX_SUCCESS && batch->stop_on_error) {
+            break;
+        }
+    }
+    usbx_buf_printf(out, "]");
+    return first_error;
+}
@@ -0,0 +1,418 @@
+/**
+ * @file quota.c
+ * @brief Per-client request-rate and bandwidth quotas
+ *
+ * A bucket is its theoretical arrival time (TAT) in nanoseconds: taking
+ * @c n tokens moves it @c n/rate seconds ahead of max(TAT, now), which is
+ * allowed while it stays within burst/rate seconds of now. Entries are
+ * never freed while the service runs, so threads may keep pointers to them.
+ *
+ * The index is an open-addressing table that readers probe without a
+ * lock: a slot is filled once with a release store and never cleared.
+ * Writers serialize on a mutex; when the table is half full they publish
+ * a copy twice its size, and free replaced tables once no reader can still
+ * be probing them, as config.c does with its snapshots.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_backend.h"
+#include "usbx_quota.h"
+#include "usbx_sha256.h"
+#include "usbx_util.h"
+
+#define NS_PER_SEC 1000000000.0
+
+/** @brief Slots of the first table */
+#define TABLE_MIN_SLOTS 64
+
+/** @brief How long a replaced table is kept for readers still probing it */
+#define TABLE_GRACE_MS 1000
+
+struct usbx_quota_client {
+    char *id;                    // NULL for the shared entry
+    char fingerprint[USBX_QUOTA_FINGERPRINT_SIZE];
+    int custom;                  // limits below apply instead of the defaults
+    struct usbx_quota_limits limits;
+    uint64_t request_tat;        // bucket state, updated by compare-and-swap
+    uint64_t byte_tat;
+    uint64_t admitted;
+    uint64_t rejected;
+    uint64_t bytes;
+};
+
+/** @brief Index of the entries; a slot is filled once and never cleared */
+struct client_table {
+    struct client_table *next;   // tables still allocated, newest first
+    uint64_t retired_us;         // when a larger table replaced it, 0 while current
+    size_t mask;                 // slot count - 1
+    struct usbx_quota_client *slots[];
+};
+
+/** @brief Serializes writers; readers only load the table and its slots */
+static pthread_mutex_t quota_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct client_table *table = NULL;          // current, published with a release store
+static struct client_table *tables = NULL;
+static int client_count = 0;
+static int custom_count = 0;
+static struct usbx_quota_client other = {.fingerprint = "other"};
+static struct usbx_quota_limits defaults;
+static int limited = 0;          // any limit configured; 0 skips the lookup
+
+static pthread_once_t current_once = PTHREAD_ONCE_INIT;
+static pthread_key_t current_key;
+
+static void current_setup(void) {
+    pthread_key_create(&current_key, NULL);
+}
+
+struct usbx_quota_client *usbx_quota_current(void) {
+    pthread_once(&current_once, current_setup);
+    return pthread_getspecific(current_key);
+}
+
+void usbx_quota_set_current(struct usbx_quota_client *client) {
+    pthread_once(&current_once, current_setup);
+    pthread_setspecific(current_key, client);
+}
+
+static uint64_t load(const uint64_t *value) {
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+static void store_limits(struct usbx_quota_limits *dst, const struct usbx_quota_limits *src) {
+    __atomic_store_n(&dst->requests_per_sec, src->requests_per_sec, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->request_burst, src->request_burst, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->bytes_per_sec, src->bytes_per_sec, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->byte_burst, src->byte_burst, __ATOMIC_RELAXED);
+}
+
+/* Limits in effect for an entry */
+static void effective_limits(const struct usbx_quota_client *c, struct usbx_quota_limits *limits) {
+    const struct usbx_quota_limits *src =
+        __atomic_load_n(&c->custom, __ATOMIC_ACQUIRE) ? &c->limits : &defaults;
+    limits->requests_per_sec = load(&src->requests_per_sec);
+    limits->request_burst = load(&src->request_burst);
+    limits->bytes_per_sec = load(&src->bytes_per_sec);
+    limits->byte_burst = load(&src->byte_burst);
+}
+
+static uint64_t to_ns(uint64_t units, uint64_t rate) {
+    return (uint64_t)((double)units * NS_PER_SEC / (double)rate);
+}
+
+static uint64_t tolerance_ns(uint64_t rate, uint64_t burst) {
+    return to_ns(burst ? burst : rate, rate);
+}
+
+/* Nanoseconds until a bucket at tat can give tokens costing cost, 0 if it can now */
+static uint64_t shortfall(uint64_t tat, uint64_t cost, uint64_t tolerance, uint64_t now) {
+    uint64_t next = (tat > now ? tat : now) + cost;
+    return next - now > tolerance ? next - now - tolerance : 0;
+}
+
+/*
+ * Take tokens from a bucket. Returns 0, or the nanoseconds until they are
+ * available; with force set they are always taken, going into debt if need be.
+ */
+static uint64_t take(uint64_t *tat, uint64_t tokens, uint64_t rate, uint64_t burst,
+                     uint64_t now, int force) {
+    if (rate == 0) {
+        return 0;
+    }
+    uint64_t cost = to_ns(tokens, rate);
+    uint64_t tolerance = tolerance_ns(rate, burst);
+    uint64_t old = __atomic_load_n(tat, __ATOMIC_RELAXED);
+    for (;;) {
+        uint64_t wait = shortfall(old, cost, tolerance, now);
+        if (wait > 0 && !force) {
+            return wait;
+        }
+        uint64_t next = (old > now ? old : now) + cost;
+        if (__atomic_compare_exchange_n(tat, &old, next, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+            return 0;
+        }
+    }
+}
+
+/* Nanoseconds until a bucket is out of debt, 0 if it is not */
+static uint64_t debt(const uint64_t *tat, uint64_t rate, uint64_t burst, uint64_t now) {
+    return rate ? shortfall(load(tat), 0, tolerance_ns(rate, burst), now) : 0;
+}
+
+static void update_limited(void) {
+    int any = defaults.requests_per_sec || defaults.bytes_per_sec || custom_count > 0;
+    __atomic_store_n(&limited, any, __ATOMIC_RELEASE);
+}
+
+static size_t hash_id(const char *id) {
+    uint64_t hash = 14695981039346656037ULL;         // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)id; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+/* Entry of a client, or NULL; takes no lock */
+static struct usbx_quota_client *find_client(const char *id) {
+    struct client_table *t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+    if (!t) {
+        return NULL;
+    }
+    // At most half the slots are filled, so the probe ends at a free one
+    for (size_t i = hash_id(id) & t->mask;; i = (i + 1) & t->mask) {
+        struct usbx_quota_client *c = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+        if (!c || strcmp(c->id, id) == 0) {
+            return c;
+        }
+    }
+}
+
+/* Fill the first free slot of an entry's probe sequence (lock held) */
+static void insert(struct client_table *t, struct usbx_quota_client *c) {
+    size_t i = hash_id(c->id) & t->mask;
+    while (t->slots[i]) {
+        i = (i + 1) & t->mask;
+    }
+    __atomic_store_n(&t->slots[i], c, __ATOMIC_RELEASE);
+}
+
+/* Free the tables no reader can still be probing (lock held) */
+static void reclaim(uint64_t now) {
+    struct client_table **link = &tables;
+
+    while (*link) {
+        struct client_table *t = *link;
+        if (t->retired_us != 0 && now - t->retired_us >= TABLE_GRACE_MS * 1000ULL) {
+            *link = t->next;
+            free(t);
+        } else {
+            link = &t->next;
+        }
+    }
+}
+
+/* Make room for one more entry, publishing a larger table if need be (lock held) */
+static int reserve_slot(void) {
+    size_t slots = table ? table->mask + 1 : 0;
+    if ((size_t)(client_count + 1) * 2 <= slots) {
+        return 0;
+    }
+    size_t grown = slots ? slots * 2 : TABLE_MIN_SLOTS;
+    struct client_table *t = calloc(1, sizeof(*t) + grown * sizeof(t->slots[0]));
+    if (!t) {
+        return -1;
+    }
+    t->mask = grown - 1;
+    uint64_t now = usbx_now_us();
+    if (table) {
+        for (size_t i = 0; i < slots; i++) {
+            if (table->slots[i]) {
+                insert(t, table->slots[i]);
+            }
+        }
+        table->retired_us = now;
+    }
+    t->next = tables;
+    tables = t;
+    __atomic_store_n(&table, t, __ATOMIC_RELEASE);
+    reclaim(now);
+    return 0;
+}
+
+/* Entry of a client, created if need be (lock held) */
+static struct usbx_quota_client *add_client(const char *id) {
+    struct usbx_quota_client *c = find_client(id);
+    if (c) {
+        return c;
+    }
+    if (client_count >= USBX_QUOTA_MAX_CLIENTS || reserve_slot() < 0 ||
+        !(c = calloc(1, sizeof(*c))) || !(c->id = strdup(id))) {
+        free(c);
+        return NULL;
+    }
+    char hex[USBX_SHA256_HEX_SIZE];
+    usbx_sha256_hex(id, strlen(id), hex);
+    memcpy(c->fingerprint, hex, USBX_QUOTA_FINGERPRINT_SIZE - 1);
+    insert(table, c);
+    client_count++;
+    return c;
+}
+
+/* Entry a request is charged to, created on its client's first request */
+static struct usbx_quota_client *lookup(const char *id, const char *fallback) {
+    struct usbx_quota_client *c = find_client(id);
+    if (fallback && !(c && __atomic_load_n(&c->custom, __ATOMIC_ACQUIRE))) {
+        id = fallback;
+        c = find_client(id);
+    }
+    if (c) {
+        return c;
+    }
+    pthread_mutex_lock(&quota_lock);
+    c = add_client(id);
+    pthread_mutex_unlock(&quota_lock);
+    return c ? c : &other;
+}
+
+int usbx_quota_admit(const char *client, const char *fallback, unsigned int *retry_after_ms) {
+    if (!client || !__atomic_load_n(&limited, __ATOMIC_ACQUIRE)) {
+        usbx_quota_set_current(NULL);
+        return USBX_SUCCESS;
+    }
+    struct usbx_quota_client *c = lookup(client, fallback);
+    struct usbx_quota_limits limits;
+    effective_limits(c, &limits);
+    uint64_t now = usbx_now_us() * 1000;
+
+    // Bytes first: a client in debt must not spend request tokens meanwhile
+    uint64_t wait = debt(&c->byte_tat, limits.bytes_per_sec, limits.byte_burst, now);
+    if (wait == 0) {
+        wait = take(&c->request_tat, 1, limits.requests_per_sec, limits.request_burst, now, 0);
+    }
+    if (wait > 0) {
+        __atomic_fetch_add(&c->rejected, 1, __ATOMIC_RELAXED);
+        *retry_after_ms = (unsigned int)((wait + 999999) / 1000000);
+        usbx_quota_set_current(NULL);
+        return USBX_ERROR_BUSY;
+    }
+    __atomic_fetch_add(&c->admitted, 1, __ATOMIC_RELAXED);
+    usbx_quota_set_current(c);
+    return USBX_SUCCESS;
+}
+
+void usbx_quota_charge(uint64_t bytes) {
+    usbx_quota_charge_client(usbx_quota_current(), bytes);
+}
+
+void usbx_quota_charge_client(struct usbx_quota_client *c, uint64_t bytes) {
+    if (!c) {
+        return;
+    }
+    struct usbx_quota_limits limits;
+    effective_limits(c, &limits);
+    __atomic_fetch_add(&c->bytes, bytes, __ATOMIC_RELAXED);
+    take(&c->byte_tat, bytes, limits.bytes_per_sec, limits.byte_burst, usbx_now_us() * 1000, 1);
+}
+
+void usbx_quota_set_defaults(const struct usbx_quota_limits *limits) {
+    pthread_mutex_lock(&quota_lock);
+    store_limits(&defaults, limits);
+    update_limited();
+    pthread_mutex_unlock(&quota_lock);
+}
+
+void usbx_quota_get_defaults(struct usbx_quota_limits *limits) {
+    pthread_mutex_lock(&quota_lock);
+    *limits = defaults;
+    pthread_mutex_unlock(&quota_lock);
+}
+
+int usbx_quota_set_client(const char *client, const struct usbx_quota_limits *limits) {
+    if (!client || !*client || !limits) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    pthread_mutex_lock(&quota_lock);
+    struct usbx_quota_client *c = add_client(client);
+    if (c) {
+        store_limits(&c->limits, limits);
+        if (!c->custom) {
+            custom_count++;
+        }
+        __atomic_store_n(&c->custom, 1, __ATOMIC_RELEASE);
+        update_limited();
+    }
+    pthread_mutex_unlock(&quota_lock);
+    return c ? USBX_SUCCESS : USBX_ERROR_NO_MEM;
+}
+
+int usbx_quota_clear_client(const char *client) {
+    int result = USBX_ERROR_NOT_FOUND;
+
+    pthread_mutex_lock(&quota_lock);
+    struct usbx_quota_client *c = client ? find_client(client) : NULL;
+    if (c && c->custom) {
+        __atomic_store_n(&c->custom, 0, __ATOMIC_RELEASE);
+        custom_count--;
+        update_limited();
+        result = USBX_SUCCESS;
+    }
+    pthread_mutex_unlock(&quota_lock);
+    return result;
+}
+
+void usbx_quota_get_client(const char *client, struct usbx_quota_limits *limits) {
+    struct usbx_quota_client *c = client ? find_client(client) : NULL;
+    effective_limits(c ? c : &other, limits);
+}
+
+static void fill_usage(const struct usbx_quota_client *c, uint64_t now,
+                       struct usbx_quota_usage *usage) {
+    memcpy(usage->fingerprint, c->fingerprint, sizeof(usage->fingerprint));
+    usage->custom = __atomic_load_n(&c->custom, __ATOMIC_ACQUIRE);
+    effective_limits(c, &usage->limits);
+    usage->admitted = load(&c->admitted);
+    usage->rejected = load(&c->rejected);
+    usage->bytes = load(&c->bytes);
+
+    const struct usbx_quota_limits *l = &usage->limits;
+    uint64_t wait = debt(&c->byte_tat, l->bytes_per_sec, l->byte_burst, now);
+    if (wait == 0 && l->requests_per_sec) {
+        wait = shortfall(load(&c->request_tat), to_ns(1, l->requests_per_sec),
+                         tolerance_ns(l->requests_per_sec, l->request_burst), now);
+    }
+    usage->retry_after_ms = (wait + 999999) / 1000000;
+}
+
+int usbx_quota_get_usage(struct usbx_quota_usage *usage, int max) {
+    uint64_t now = usbx_now_us() * 1000;
+    int count = 0;
+
+    pthread_mutex_lock(&quota_lock);
+    for (size_t i = 0; table && i <= table->mask; i++) {
+        if (table->slots[i]) {
+            if (count < max) {
+                fill_usage(table->slots[i], now, &usage[count]);
+            }
+            count++;
+        }
+    }
+    if (load(&other.admitted) > 0 || load(&other.rejected) > 0) {
+        if (count < max) {
+            fill_usage(&other, now, &usage[count]);
+        }
+        count++;
+    }
+    pthread_mutex_unlock(&quota_lock);
+    return count;
+}
+
+void usbx_quota_reset(void) {
+    pthread_mutex_lock(&quota_lock);
+    for (size_t i = 0; table && i <= table->mask; i++) {
+        if (table->slots[i]) {
+            free(table->slots[i]->id);
+            free(table->slots[i]);
+        }
+    }
+    while (tables) {
+        struct client_table *t = tables;
+        tables = t->next;
+        free(t);
+    }
+    table = NULL;
+    client_count = 0;
+    custom_count = 0;
+    memset(&defaults, 0, sizeof(defaults));
+    other.request_tat = other.byte_tat = 0;
+    other.admitted = other.rejected = other.bytes = 0;
+    update_limited();
+    pthread_mutex_unlock(&quota_lock);
+}
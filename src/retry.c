@@ -0,0 +1,212 @@
+/**
+ * @file retry.c
+ * @brief Server-side recovery of stalled endpoints and retry of timed-out transfers
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_retry.h"
+#include "usbx_util.h"
+
+/** @brief Timeout of the CLEAR_FEATURE(ENDPOINT_HALT) request in milliseconds */
+#define CLEAR_HALT_TIMEOUT 1000
+
+/** @brief Endpoint slots: control, OUT 1-15 and IN 1-15 */
+#define RETRY_SLOTS (USBX_RETRY_MAX_POLICIES - 1)
+
+struct usbx_retry_table {
+    pthread_mutex_t lock;
+    struct usbx_retry_policy policies[USBX_RETRY_MAX_POLICIES];  // [0] default, [1 + slot]
+    int has_policy[USBX_RETRY_MAX_POLICIES];
+    struct usbx_retry_stats stats[RETRY_SLOTS];
+};
+
+/* Endpoint index: control, then OUT 1-15, then IN 1-15 */
+static int endpoint_slot(unsigned char endpoint) {
+    int number = endpoint & 0x0f;
+    if (number == 0) {
+        return 0;
+    }
+    return number + ((endpoint & USBX_ENDPOINT_IN) ? 16 : 0);
+}
+
+void usbx_retry_policy_init(struct usbx_retry_policy *policy, int endpoint) {
+    memset(policy, 0, sizeof(*policy));
+    policy->endpoint = endpoint;
+}
+
+struct usbx_retry_table *usbx_retry_table_create(void) {
+    struct usbx_retry_table *table = calloc(1, sizeof(*table));
+    if (table) {
+        pthread_mutex_init(&table->lock, NULL);
+    }
+    return table;
+}
+
+void usbx_retry_table_free(struct usbx_retry_table *table) {
+    if (table) {
+        pthread_mutex_destroy(&table->lock);
+        free(table);
+    }
+}
+
+int usbx_retry_set(struct usbx_retry_table *table, const struct usbx_retry_policy *policy) {
+    if (!table || !policy || policy->endpoint < USBX_RETRY_ALL_ENDPOINTS ||
+        policy->endpoint > 0xff || (policy->endpoint >= 0 && (policy->endpoint & 0x70)) ||
+        policy->stall_retries > USBX_RETRY_MAX_ATTEMPTS ||
+        policy->timeout_retries > USBX_RETRY_MAX_ATTEMPTS ||
+        policy->backoff_ms > USBX_RETRY_MAX_BACKOFF_MS ||
+        policy->max_backoff_ms > USBX_RETRY_MAX_BACKOFF_MS ||
+        (policy->idempotent & ~(unsigned int)(USBX_RETRY_IN | USBX_RETRY_OUT |
+                                              USBX_RETRY_CONTROL))) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    int index = policy->endpoint == USBX_RETRY_ALL_ENDPOINTS
+                ? 0 : 1 + endpoint_slot((unsigned char)policy->endpoint);
+
+    pthread_mutex_lock(&table->lock);
+    table->policies[index] = *policy;
+    table->has_policy[index] = policy->stall_retries > 0 || policy->timeout_retries > 0;
+    pthread_mutex_unlock(&table->lock);
+    return USBX_SUCCESS;
+}
+
+void usbx_retry_clear(struct usbx_retry_table *table) {
+    pthread_mutex_lock(&table->lock);
+    memset(table->has_policy, 0, sizeof(table->has_policy));
+    memset(table->stats, 0, sizeof(table->stats));
+    pthread_mutex_unlock(&table->lock);
+}
+
+int usbx_retry_get_policies(struct usbx_retry_table *table, struct usbx_retry_policy *policies,
+                            int max) {
+    int count = 0;
+    pthread_mutex_lock(&table->lock);
+    for (int i = 0; i < USBX_RETRY_MAX_POLICIES; i++) {
+        if (table->has_policy[i]) {
+            if (count < max) {
+                policies[count] = table->policies[i];
+            }
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+    return count;
+}
+
+void usbx_retry_get_stats(struct usbx_retry_table *table, int endpoint,
+                          struct usbx_retry_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&table->lock);
+    for (int i = 0; i < RETRY_SLOTS; i++) {
+        if (endpoint != USBX_RETRY_ALL_ENDPOINTS && i != endpoint_slot((unsigned char)endpoint)) {
+            continue;
+        }
+        const struct usbx_retry_stats *s = &table->stats[i];
+        stats->stall_retries += s->stall_retries;
+        stats->timeout_retries += s->timeout_retries;
+        stats->clear_halts += s->clear_halts;
+        stats->recovered += s->recovered;
+        stats->exhausted += s->exhausted;
+        stats->unsafe += s->unsafe;
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+/* Policy of an endpoint; returns 0 if nothing is retried there */
+static int lookup(struct usbx_retry_table *table, unsigned char endpoint,
+                  struct usbx_retry_policy *policy) {
+    int index = 1 + endpoint_slot(endpoint);
+    int found = 1;
+
+    pthread_mutex_lock(&table->lock);
+    if (table->has_policy[index]) {
+        *policy = table->policies[index];
+    } else if (table->has_policy[0]) {
+        *policy = table->policies[0];
+    } else {
+        found = 0;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return found;
+}
+
+/* Add to one counter of an endpoint */
+static void count(struct usbx_retry_table *table, unsigned char endpoint, size_t offset) {
+    pthread_mutex_lock(&table->lock);
+    uint64_t *counter = (uint64_t *)((char *)&table->stats[endpoint_slot(endpoint)] + offset);
+    (*counter)++;
+    pthread_mutex_unlock(&table->lock);
+}
+
+int usbx_retry_run(struct usbx_retry_table *table, struct usbx_device *dev,
+                   unsigned char endpoint, int in, int idempotent, usbx_retry_attempt attempt,
+                   void *cls, size_t *transferred, int *retries) {
+    struct usbx_retry_policy policy;
+    unsigned int stalls = 0, timeouts = 0;
+
+    if (retries) {
+        *retries = 0;
+    }
+    int result = attempt(cls, transferred);
+    if (result == USBX_SUCCESS || (result != USBX_ERROR_PIPE && result != USBX_ERROR_TIMEOUT) ||
+        !table || !lookup(table, endpoint, &policy)) {
+        return result;
+    }
+    if (idempotent == USBX_RETRY_POLICY_DEFAULT) {
+        unsigned int flag = endpoint == 0 ? USBX_RETRY_CONTROL
+                            : in          ? USBX_RETRY_IN
+                                          : USBX_RETRY_OUT;
+        idempotent = (policy.idempotent & flag) != 0;
+    }
+    unsigned int backoff_ms = policy.backoff_ms;
+
+    while (result == USBX_ERROR_PIPE || result == USBX_ERROR_TIMEOUT) {
+        int stalled = result == USBX_ERROR_PIPE;
+        if (stalled ? stalls >= policy.stall_retries : timeouts >= policy.timeout_retries) {
+            if (stalls + timeouts > 0) {
+                count(table, endpoint, offsetof(struct usbx_retry_stats, exhausted));
+            }
+            return result;
+        }
+        // Data already moved would be lost or sent twice
+        if (!idempotent && (endpoint == 0 || *transferred > 0)) {
+            count(table, endpoint, offsetof(struct usbx_retry_stats, unsafe));
+            return result;
+        }
+        if (stalled) {
+            stalls++;
+            count(table, endpoint, offsetof(struct usbx_retry_stats, stall_retries));
+            if (endpoint != 0) {
+                count(table, endpoint, offsetof(struct usbx_retry_stats, clear_halts));
+                int cleared = usbx_clear_halt(dev, endpoint, CLEAR_HALT_TIMEOUT);
+                if (cleared != USBX_SUCCESS) {
+                    count(table, endpoint, offsetof(struct usbx_retry_stats, exhausted));
+                    return result;
+                }
+            }
+        } else {
+            timeouts++;
+            count(table, endpoint, offsetof(struct usbx_retry_stats, timeout_retries));
+            if (backoff_ms > 0) {
+                usbx_sleep_us((uint64_t)backoff_ms * 1000);
+            }
+            if (backoff_ms * 2 <= policy.max_backoff_ms) {
+                backoff_ms *= 2;
+            }
+        }
+        if (retries) {
+            (*retries)++;
+        }
+        result = attempt(cls, transferred);
+    }
+    if (result == USBX_SUCCESS) {
+        count(table, endpoint, offsetof(struct usbx_retry_stats, recovered));
+    }
+    return result;
+}
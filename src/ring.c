@@ -0,0 +1,167 @@
+/**
+ * @file ring.c
+ * @brief Bounded byte ring buffer connecting transfer engines with readers
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbx_ring.h"
+#include "usbx_util.h"
+
+struct usbx_ring {
+    pthread_mutex_t lock;
+    pthread_cond_t readable;
+    pthread_cond_t writable;
+    unsigned char *data;
+    size_t capacity;
+    size_t head;                 // next byte to read
+    size_t used;
+    int closed;
+};
+
+struct usbx_ring *usbx_ring_create(size_t capacity) {
+    if (capacity == 0) {
+        return NULL;
+    }
+
+    struct usbx_ring *ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+    ring->data = malloc(capacity);
+    if (!ring->data) {
+        free(ring);
+        return NULL;
+    }
+    ring->capacity = capacity;
+
+    usbx_cond_init_monotonic(&ring->readable);
+    usbx_cond_init_monotonic(&ring->writable);
+    pthread_mutex_init(&ring->lock, NULL);
+    return ring;
+}
+
+void usbx_ring_destroy(struct usbx_ring *ring) {
+    if (!ring) {
+        return;
+    }
+    pthread_cond_destroy(&ring->readable);
+    pthread_cond_destroy(&ring->writable);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring->data);
+    free(ring);
+}
+
+/* Copy into the ring at the tail (lock held, space already checked) */
+static void put_bytes(struct usbx_ring *ring, const unsigned char *src, size_t length) {
+    size_t tail = (ring->head + ring->used) % ring->capacity;
+    size_t first = ring->capacity - tail;
+
+    if (first > length) {
+        first = length;
+    }
+    memcpy(ring->data + tail, src, first);
+    memcpy(ring->data, src + first, length - first);
+    ring->used += length;
+}
+
+size_t usbx_ring_write(struct usbx_ring *ring, const void *data, size_t length,
+                       int timeout_ms) {
+    struct timespec deadline;
+    if (timeout_ms > 0) {
+        usbx_deadline_ms(&deadline, timeout_ms);
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    while (ring->used == ring->capacity && !ring->closed && timeout_ms != 0) {
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&ring->writable, &ring->lock);
+        } else if (pthread_cond_timedwait(&ring->writable, &ring->lock, &deadline) != 0) {
+            break;
+        }
+    }
+
+    size_t space = ring->closed ? 0 : ring->capacity - ring->used;
+    if (length > space) {
+        length = space;
+    }
+    if (length > 0) {
+        put_bytes(ring, data, length);
+        pthread_cond_broadcast(&ring->readable);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return length;
+}
+
+int usbx_ring_write_all(struct usbx_ring *ring, const void *data, size_t length) {
+    int result = -1;
+
+    pthread_mutex_lock(&ring->lock);
+    if (!ring->closed && ring->capacity - ring->used >= length) {
+        put_bytes(ring, data, length);
+        pthread_cond_broadcast(&ring->readable);
+        result = 0;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return result;
+}
+
+size_t usbx_ring_read(struct usbx_ring *ring, void *buffer, size_t max, int timeout_ms) {
+    struct timespec deadline;
+    if (timeout_ms > 0) {
+        usbx_deadline_ms(&deadline, timeout_ms);
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    while (ring->used == 0 && !ring->closed && timeout_ms != 0) {
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&ring->readable, &ring->lock);
+        } else if (pthread_cond_timedwait(&ring->readable, &ring->lock, &deadline) != 0) {
+            break;
+        }
+    }
+
+    size_t length = ring->used < max ? ring->used : max;
+    size_t first = ring->capacity - ring->head;
+    if (first > length) {
+        first = length;
+    }
+    memcpy(buffer, ring->data + ring->head, first);
+    memcpy((unsigned char *)buffer + first, ring->data, length - first);
+    ring->head = (ring->head + length) % ring->capacity;
+    ring->used -= length;
+    if (length > 0) {
+        pthread_cond_broadcast(&ring->writable);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return length;
+}
+
+size_t usbx_ring_used(struct usbx_ring *ring) {
+    pthread_mutex_lock(&ring->lock);
+    size_t used = ring->used;
+    pthread_mutex_unlock(&ring->lock);
+    return used;
+}
+
+void usbx_ring_close(struct usbx_ring *ring) {
+    pthread_mutex_lock(&ring->lock);
+    ring->closed = 1;
+    pthread_cond_broadcast(&ring->readable);
+    pthread_cond_broadcast(&ring->writable);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+int usbx_ring_finished(struct usbx_ring *ring) {
+    pthread_mutex_lock(&ring->lock);
+    int finished = ring->closed && ring->used == 0;
+    pthread_mutex_unlock(&ring->lock);
+    return finished;
+}
@@ -0,0 +1,409 @@
+/**
+ * @file sched.c
+ * @brief Weighted fair sharing of a device between clients
+ *
+ * Waiting submitters sleep on their own condition variable and are woken
+ * only when a slot is handed to them. Clients with queued transfers form a
+ * circular list that the round robin walks; a client leaves it, and its
+ * deficit is dropped, when its queue empties.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbx_sched.h"
+#include "usbx_config.h"
+#include "usbx_sha256.h"
+#include "usbx_util.h"
+#include "uthash.h"
+
+struct client;
+
+/** @brief One blocked submission */
+struct waiter {
+    struct waiter *next;
+    struct client *client;
+    pthread_cond_t cond;
+    size_t cost;
+    uint64_t queued_us;
+    int granted;
+};
+
+struct client {
+    char *id;                    // NULL for the shared entry
+    struct usbx_sched_client_stats stats;
+    int64_t deficit;
+    struct waiter *head, *tail;  // bulk, interrupt and isochronous transfers
+    struct client *prev, *next;  // round robin list while queued
+    int active;
+    UT_hash_handle hh;
+};
+
+struct usbx_sched {
+    pthread_mutex_t lock;
+    struct usbx_sched_config config;
+    int enabled;                 // lock-free hint of config.enabled
+    unsigned int in_flight;
+    struct client *clients;      // uthash by id
+    int client_count;
+    struct client other;         // clients beyond USBX_SCHED_MAX_CLIENTS
+    struct waiter *control_head, *control_tail;
+    unsigned int control_queued;
+    struct client *current;      // round robin position
+    int current_topped;          // current got its quantum this visit
+    uint64_t control_first;
+};
+
+static pthread_once_t client_once = PTHREAD_ONCE_INIT;
+static pthread_key_t client_key;
+
+static void client_setup(void) {
+    pthread_key_create(&client_key, NULL);
+}
+
+void usbx_sched_set_client(const char *client) {
+    pthread_once(&client_once, client_setup);
+    pthread_setspecific(client_key, client);
+}
+
+const char *usbx_sched_client(void) {
+    pthread_once(&client_once, client_setup);
+    return pthread_getspecific(client_key);
+}
+
+void usbx_sched_fingerprint(const char *client, char *fingerprint) {
+    char hex[USBX_SHA256_HEX_SIZE];
+    usbx_sha256_hex(client, strlen(client), hex);
+    memcpy(fingerprint, hex, USBX_SCHED_FINGERPRINT_SIZE - 1);
+    fingerprint[USBX_SCHED_FINGERPRINT_SIZE - 1] = '\0';
+}
+
+void usbx_sched_config_init(struct usbx_sched_config *config) {
+    const struct usbx_config *current = usbx_config_current();
+    config->enabled = 0;
+    config->max_in_flight = current->sched_max_in_flight;
+    config->quantum = current->sched_quantum;
+}
+
+struct usbx_sched *usbx_sched_create(void) {
+    struct usbx_sched *sched = calloc(1, sizeof(*sched));
+    if (sched) {
+        pthread_mutex_init(&sched->lock, NULL);
+        usbx_sched_config_init(&sched->config);
+        strcpy(sched->other.stats.fingerprint, "other");
+        sched->other.stats.weight = 1;
+    }
+    return sched;
+}
+
+void usbx_sched_free(struct usbx_sched *sched) {
+    if (!sched) {
+        return;
+    }
+    struct client *c, *tmp;
+    HASH_ITER(hh, sched->clients, c, tmp) {
+        HASH_DEL(sched->clients, c);
+        free(c->id);
+        free(c);
+    }
+    pthread_mutex_destroy(&sched->lock);
+    free(sched);
+}
+
+/* Client entry of an identity, created on first use (lock held) */
+static struct client *find_client(struct usbx_sched *sched, const char *id, int create) {
+    struct client *c;
+    HASH_FIND_STR(sched->clients, id, c);
+    if (c || !create) {
+        return c;
+    }
+    if (sched->client_count >= USBX_SCHED_MAX_CLIENTS || !(c = calloc(1, sizeof(*c))) ||
+        !(c->id = strdup(id))) {
+        free(c);
+        return &sched->other;
+    }
+    usbx_sched_fingerprint(id, c->stats.fingerprint);
+    c->stats.weight = 1;
+    HASH_ADD_KEYPTR(hh, sched->clients, c->id, strlen(c->id), c);
+    sched->client_count++;
+    return c;
+}
+
+static void activate(struct usbx_sched *sched, struct client *c) {
+    c->active = 1;
+    c->deficit = 0;
+    if (!sched->current) {
+        c->prev = c->next = c;
+        sched->current = c;
+        sched->current_topped = 0;
+        return;
+    }
+    // Join just behind the current position, i.e. at the end of this round
+    c->next = sched->current;
+    c->prev = sched->current->prev;
+    c->prev->next = c;
+    sched->current->prev = c;
+}
+
+static void deactivate(struct usbx_sched *sched, struct client *c) {
+    c->active = 0;
+    c->deficit = 0;
+    if (c->next == c) {
+        sched->current = NULL;
+    } else {
+        c->prev->next = c->next;
+        c->next->prev = c->prev;
+        if (sched->current == c) {
+            sched->current = c->next;
+            sched->current_topped = 0;
+        }
+    }
+    c->prev = c->next = NULL;
+}
+
+static void admit(struct client *c, size_t cost) {
+    c->stats.admitted++;
+    c->stats.bytes += cost;
+}
+
+static void grant(struct usbx_sched *sched, struct waiter *w) {
+    struct usbx_sched_client_stats *stats = &w->client->stats;
+    uint64_t waited = usbx_now_us() - w->queued_us;
+
+    admit(w->client, w->cost);
+    stats->queued--;
+    stats->waited++;
+    stats->wait_us += waited;
+    if (waited > stats->max_wait_us) {
+        stats->max_wait_us = waited;
+    }
+    sched->in_flight++;
+    w->granted = 1;
+    pthread_cond_signal(&w->cond);
+}
+
+/* Hand free slots to waiting transfers: control first, then round robin (lock held) */
+static void dispatch(struct usbx_sched *sched) {
+    while (!sched->config.enabled || sched->in_flight < sched->config.max_in_flight) {
+        struct waiter *w = sched->control_head;
+        if (w) {
+            sched->control_head = w->next;
+            if (!sched->control_head) {
+                sched->control_tail = NULL;
+            }
+            sched->control_queued--;
+            if (sched->current) {
+                sched->control_first++;
+            }
+            grant(sched, w);
+            continue;
+        }
+        struct client *c = sched->current;
+        if (!c) {
+            break;
+        }
+        if (!sched->current_topped) {
+            c->deficit += (int64_t)sched->config.quantum * c->stats.weight;
+            sched->current_topped = 1;
+        }
+        w = c->head;
+        if ((int64_t)w->cost <= c->deficit || !sched->config.enabled) {
+            c->head = w->next;
+            if (!c->head) {
+                c->tail = NULL;
+            }
+            c->deficit -= (int64_t)w->cost;
+            if (!c->head) {
+                deactivate(sched, c);
+            }
+            grant(sched, w);
+        } else {
+            sched->current = c->next;
+            sched->current_topped = 0;
+        }
+    }
+}
+
+int usbx_sched_configure(struct usbx_sched *sched, const struct usbx_sched_config *config) {
+    if (!sched || !config || config->max_in_flight < 1 ||
+        config->max_in_flight > USBX_SCHED_MAX_IN_FLIGHT || config->quantum < 1 ||
+        config->quantum > USBX_SCHED_MAX_QUANTUM) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    pthread_mutex_lock(&sched->lock);
+    sched->config = *config;
+    __atomic_store_n(&sched->enabled, config->enabled, __ATOMIC_RELEASE);
+    dispatch(sched);
+    pthread_mutex_unlock(&sched->lock);
+    return USBX_SUCCESS;
+}
+
+void usbx_sched_get_config(struct usbx_sched *sched, struct usbx_sched_config *config) {
+    pthread_mutex_lock(&sched->lock);
+    *config = sched->config;
+    pthread_mutex_unlock(&sched->lock);
+}
+
+int usbx_sched_set_weight(struct usbx_sched *sched, const char *client, unsigned int weight) {
+    if (!client || weight < 1 || weight > USBX_SCHED_MAX_WEIGHT) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    pthread_mutex_lock(&sched->lock);
+    struct client *c = find_client(sched, client, 1);
+    int result = USBX_ERROR_NO_MEM;
+    if (c != &sched->other) {
+        c->stats.weight = weight;
+        result = USBX_SUCCESS;
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return result;
+}
+
+void usbx_sched_attach(struct usbx_sched *sched, struct usbx_device *dev) {
+    dev->sched = sched;
+    __atomic_or_fetch(&dev->taps, USBX_TAP_SCHED, __ATOMIC_RELEASE);
+}
+
+void usbx_sched_detach(struct usbx_device *dev) {
+    __atomic_and_fetch(&dev->taps, ~USBX_TAP_SCHED, __ATOMIC_RELEASE);
+}
+
+/* Remove a waiter that gave up from its queue (lock held) */
+static void unlink_waiter(struct usbx_sched *sched, struct waiter *w, int control) {
+    struct waiter **head = control ? &sched->control_head : &w->client->head;
+    struct waiter **tail = control ? &sched->control_tail : &w->client->tail;
+    struct waiter *prev = NULL;
+    for (struct waiter *it = *head; it; prev = it, it = it->next) {
+        if (it == w) {
+            if (prev) {
+                prev->next = w->next;
+            } else {
+                *head = w->next;
+            }
+            if (*tail == w) {
+                *tail = prev;
+            }
+            break;
+        }
+    }
+    w->client->stats.queued--;
+    if (control) {
+        sched->control_queued--;
+    } else if (!w->client->head) {
+        deactivate(sched, w->client);
+    }
+}
+
+int usbx_sched_acquire(struct usbx_transfer *xfer) {
+    struct usbx_sched *sched = xfer->dev->sched;
+    const char *id = usbx_sched_client();
+
+    xfer->scheduled = 0;
+    if (!id || !__atomic_load_n(&sched->enabled, __ATOMIC_ACQUIRE)) {
+        return USBX_SUCCESS;
+    }
+    int control = xfer->type == USBX_TRANSFER_TYPE_CONTROL;
+    size_t cost = xfer->length > 0 ? (size_t)xfer->length : 0;
+
+    pthread_mutex_lock(&sched->lock);
+    struct client *c = find_client(sched, id, 1);
+    int idle = control ? !sched->control_head : !sched->control_head && !sched->current;
+    if (!sched->config.enabled || (idle && sched->in_flight < sched->config.max_in_flight)) {
+        sched->in_flight++;
+        admit(c, cost);
+        xfer->scheduled = 1;
+        pthread_mutex_unlock(&sched->lock);
+        return USBX_SUCCESS;
+    }
+
+    struct waiter w = {.client = c, .cost = cost, .queued_us = usbx_now_us()};
+    usbx_cond_init_monotonic(&w.cond);
+    if (control) {
+        if (sched->control_tail) {
+            sched->control_tail->next = &w;
+        } else {
+            sched->control_head = &w;
+        }
+        sched->control_tail = &w;
+        sched->control_queued++;
+    } else {
+        if (c->tail) {
+            c->tail->next = &w;
+        } else {
+            c->head = &w;
+        }
+        c->tail = &w;
+        if (!c->active) {
+            activate(sched, c);
+        }
+    }
+    if (++c->stats.queued > c->stats.max_queued) {
+        c->stats.max_queued = c->stats.queued;
+    }
+    dispatch(sched);
+
+    struct timespec deadline;
+    if (xfer->timeout > 0) {
+        usbx_deadline_ms(&deadline, xfer->timeout);
+    }
+    while (!w.granted) {
+        if (xfer->timeout == 0) {
+            pthread_cond_wait(&w.cond, &sched->lock);
+        } else if (pthread_cond_timedwait(&w.cond, &sched->lock, &deadline) == ETIMEDOUT &&
+                   !w.granted) {
+            unlink_waiter(sched, &w, control);
+            c->stats.expired++;
+            pthread_mutex_unlock(&sched->lock);
+            pthread_cond_destroy(&w.cond);
+            return USBX_ERROR_TIMEOUT;
+        }
+    }
+    xfer->scheduled = 1;
+    pthread_mutex_unlock(&sched->lock);
+    pthread_cond_destroy(&w.cond);
+    return USBX_SUCCESS;
+}
+
+void usbx_sched_release(struct usbx_transfer *xfer) {
+    struct usbx_sched *sched = xfer->dev->sched;
+
+    xfer->scheduled = 0;
+    pthread_mutex_lock(&sched->lock);
+    sched->in_flight--;
+    dispatch(sched);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+int usbx_sched_get_stats(struct usbx_sched *sched, struct usbx_sched_stats *stats,
+                         struct usbx_sched_client_stats *clients, int max) {
+    struct client *c, *tmp;
+    int n = 0;
+
+    pthread_mutex_lock(&sched->lock);
+    stats->in_flight = sched->in_flight;
+    stats->queued = 0;
+    stats->control_first = sched->control_first;
+    stats->clients = sched->client_count;
+    HASH_ITER(hh, sched->clients, c, tmp) {
+        stats->queued += c->stats.queued;
+        if (n < max) {
+            clients[n++] = c->stats;
+        }
+    }
+    if (sched->other.stats.admitted > 0 || sched->other.stats.queued > 0) {
+        stats->queued += sched->other.stats.queued;
+        stats->clients++;
+        if (n < max) {
+            clients[n++] = sched->other.stats;
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return n;
+}
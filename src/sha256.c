@@ -0,0 +1,209 @@
+/**
+ * @file sha256.c
+ * @brief SHA-256 (FIPS 180-4)
+ *
+ * Blocks are compressed with the x86 SHA extensions when the CPU has them
+ * and with portable C otherwise; the choice is made once at run time.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "usbx_codec.h"
+#include "usbx_sha256.h"
+
+static const uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2
+};
+
+static uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void compress_block(uint32_t state[8], const unsigned char *block) {
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | (uint32_t)block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) +
+                      round_constants[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+static void compress_portable(uint32_t state[8], const unsigned char *data, size_t blocks) {
+    for (; blocks > 0; blocks--, data += 64) {
+        compress_block(state, data);
+    }
+}
+
+#ifdef SHA256_X86
+/* Four rounds per step; the message schedule lives in a ring of four vectors */
+__attribute__((target("sha,sse4.1")))
+static void compress_shani(uint32_t state[8], const unsigned char *data, size_t blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+
+    // The instructions keep the state as ABEF and CDGH
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+    __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+    __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+    for (; blocks > 0; blocks--, data += 64) {
+        __m128i abef_saved = abef, cdgh_saved = cdgh;
+        __m128i w[4];
+
+        for (int step = 0; step < 16; step++) {
+            if (step < 4) {
+                w[step] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * step)),
+                                           byte_swap);
+            } else {
+                __m128i next = _mm_sha256msg1_epu32(w[step & 3], w[(step + 1) & 3]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(w[(step + 3) & 3],
+                                                           w[(step + 2) & 3], 4));
+                w[step & 3] = _mm_sha256msg2_epu32(next, w[(step + 3) & 3]);
+            }
+            __m128i msg = _mm_add_epi32(
+                w[step & 3], _mm_loadu_si128((const __m128i *)&round_constants[4 * step]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0e));
+        }
+        abef = _mm_add_epi32(abef, abef_saved);
+        cdgh = _mm_add_epi32(cdgh, cdgh_saved);
+    }
+
+    tmp = _mm_shuffle_epi32(abef, 0x1b);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, cdgh, 0xf0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+#endif
+
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+static void (*compress)(uint32_t state[8], const unsigned char *data, size_t blocks);
+static const char *sha256_name = "portable";
+
+static void sha256_select(void) {
+    compress = compress_portable;
+#ifdef SHA256_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1) &&
+        __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA)) {
+        compress = compress_shani;
+        sha256_name = "sha-ni";
+    }
+#endif
+}
+
+const char *usbx_sha256_implementation(void) {
+    pthread_once(&sha256_once, sha256_select);
+    return sha256_name;
+}
+
+void usbx_sha256_init(struct usbx_sha256 *ctx) {
+    pthread_once(&sha256_once, sha256_select);
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+}
+
+void usbx_sha256_update(struct usbx_sha256 *ctx, const void *data, size_t length) {
+    const unsigned char *in = data;
+    size_t used = (size_t)(ctx->length % 64);
+
+    ctx->length += length;
+    if (used > 0) {
+        size_t take = 64 - used < length ? 64 - used : length;
+        memcpy(ctx->block + used, in, take);
+        in += take;
+        length -= take;
+        if (used + take < 64) {
+            return;
+        }
+        compress(ctx->state, ctx->block, 1);
+    }
+    compress(ctx->state, in, length / 64);
+    in += length / 64 * 64;
+    memcpy(ctx->block, in, length % 64);
+}
+
+void usbx_sha256_final(struct usbx_sha256 *ctx, unsigned char *digest) {
+    uint64_t bits = ctx->length * 8;
+    size_t used = (size_t)(ctx->length % 64);
+
+    ctx->block[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->block + used, 0, 64 - used);
+        compress(ctx->state, ctx->block, 1);
+        used = 0;
+    }
+    memset(ctx->block + used, 0, 56 - used);
+    for (int i = 0; i < 8; i++) {
+        ctx->block[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    compress(ctx->state, ctx->block, 1);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (unsigned char)(ctx->state[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(ctx->state[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(ctx->state[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)ctx->state[i];
+    }
+}
+
+void usbx_sha256_hex(const void *data, size_t length, char *hex) {
+    struct usbx_sha256 ctx;
+    unsigned char digest[USBX_SHA256_SIZE];
+
+    usbx_sha256_init(&ctx);
+    usbx_sha256_update(&ctx, data, length);
+    usbx_sha256_final(&ctx, digest);
+    usbx_hex_encode(digest, sizeof(digest), hex);
+}
@@ -0,0 +1,182 @@
+/**
+ * @file sim_cdc.c
+ * @brief Simulated CDC-ACM serial loopback for the in-process backend
+ *
+ * Everything written to the OUT endpoint or injected by a test comes back
+ * on the IN endpoint, like a serial port with TX wired to RX. An IN
+ * transfer arriving while the buffer is empty is held (USBX_SIM_RETRY) as
+ * a real device would NAK it, and completes short with whatever is
+ * buffered once data shows up.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_cdc.h"
+#include "usbx_sim.h"
+
+/** @brief How often a held transfer checks the buffer again */
+#define POLL_INTERVAL_US 50
+
+struct usbx_sim_cdc {
+    pthread_mutex_t lock;
+    unsigned char *buffer;
+    size_t capacity;
+    size_t head;                 // next byte to send
+    size_t used;
+    int max_packet_size;         // of the bulk endpoints, for zero-length packets
+    struct usbx_sim_cdc_stats stats;
+};
+
+struct usbx_sim_cdc *usbx_sim_cdc_create(size_t capacity) {
+    if (capacity == 0) {
+        return NULL;
+    }
+    struct usbx_sim_cdc *cdc = calloc(1, sizeof(*cdc));
+    if (!cdc) {
+        return NULL;
+    }
+    cdc->buffer = malloc(capacity);
+    if (!cdc->buffer) {
+        free(cdc);
+        return NULL;
+    }
+    cdc->capacity = capacity;
+    pthread_mutex_init(&cdc->lock, NULL);
+    return cdc;
+}
+
+void usbx_sim_cdc_destroy(struct usbx_sim_cdc *cdc) {
+    if (!cdc) {
+        return;
+    }
+    pthread_mutex_destroy(&cdc->lock);
+    free(cdc->buffer);
+    free(cdc);
+}
+
+/* Append bytes (lock held); returns the number stored */
+static size_t put_bytes(struct usbx_sim_cdc *cdc, const unsigned char *data, size_t length) {
+    size_t free_space = cdc->capacity - cdc->used;
+    if (length > free_space) {
+        length = free_space;
+    }
+    for (size_t i = 0; i < length; i++) {
+        cdc->buffer[(cdc->head + cdc->used + i) % cdc->capacity] = data[i];
+    }
+    cdc->used += length;
+    return length;
+}
+
+size_t usbx_sim_cdc_inject(struct usbx_sim_cdc *cdc, const void *data, size_t length) {
+    pthread_mutex_lock(&cdc->lock);
+    length = put_bytes(cdc, data, length);
+    pthread_mutex_unlock(&cdc->lock);
+    return length;
+}
+
+static int bulk_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                        uint64_t *retry_at_us) {
+    struct usbx_sim_cdc *cdc = cls;
+    size_t length = (size_t)xfer->length;
+    int status = USBX_TRANSFER_COMPLETED;
+
+    pthread_mutex_lock(&cdc->lock);
+    if (xfer->endpoint & USBX_ENDPOINT_IN) {
+        if (cdc->used == 0) {
+            status = USBX_SIM_RETRY;
+        } else {
+            if (length > cdc->used) {
+                length = cdc->used;
+            }
+            for (size_t i = 0; i < length; i++) {
+                xfer->buffer[i] = cdc->buffer[(cdc->head + i) % cdc->capacity];
+            }
+            cdc->head = (cdc->head + length) % cdc->capacity;
+            cdc->used -= length;
+            cdc->stats.sent += length;
+            xfer->actual_length = (int)length;
+        }
+    } else if (length > cdc->capacity - cdc->used) {
+        status = USBX_SIM_RETRY;        // the loopback is full: NAK until it drains
+    } else {
+        put_bytes(cdc, xfer->buffer, length);
+        cdc->stats.received += length;
+        // A flagged transfer filling its last packet is followed by a zero-length one
+        cdc->stats.zero_packets += length == 0 ||
+                                   ((xfer->flags & USBX_TRANSFER_ADD_ZERO_PACKET) &&
+                                    length % (size_t)cdc->max_packet_size == 0);
+        xfer->actual_length = (int)length;
+    }
+    pthread_mutex_unlock(&cdc->lock);
+
+    if (status == USBX_SIM_RETRY) {
+        *retry_at_us = now_us + POLL_INTERVAL_US;
+    }
+    return status;
+}
+
+static int control_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                           uint64_t *retry_at_us) {
+    struct usbx_sim_cdc *cdc = cls;
+    unsigned char *setup = xfer->buffer;
+    unsigned char *data = xfer->buffer + USBX_CONTROL_SETUP_SIZE;
+    unsigned int value = setup[2] | setup[3] << 8;
+    size_t length = (size_t)(setup[6] | setup[7] << 8);
+    int status = USBX_TRANSFER_COMPLETED;
+    (void)now_us;
+    (void)retry_at_us;
+
+    if (length > (size_t)xfer->length - USBX_CONTROL_SETUP_SIZE) {
+        return USBX_TRANSFER_ERROR;
+    }
+    xfer->actual_length = 0;
+    pthread_mutex_lock(&cdc->lock);
+    if (setup[0] == USBX_CDC_REQUEST_OUT && setup[1] == USBX_CDC_SET_LINE_CODING &&
+        length == USBX_CDC_LINE_CODING_SIZE) {
+        memcpy(cdc->stats.line_coding, data, USBX_CDC_LINE_CODING_SIZE);
+        cdc->stats.line_coding_requests++;
+        xfer->actual_length = (int)length;
+    } else if (setup[0] == USBX_CDC_REQUEST_IN && setup[1] == USBX_CDC_GET_LINE_CODING &&
+               length >= USBX_CDC_LINE_CODING_SIZE) {
+        memcpy(data, cdc->stats.line_coding, USBX_CDC_LINE_CODING_SIZE);
+        xfer->actual_length = USBX_CDC_LINE_CODING_SIZE;
+    } else if (setup[0] == USBX_CDC_REQUEST_OUT && setup[1] == USBX_CDC_SET_CONTROL_LINE_STATE) {
+        cdc->stats.control_lines = (int)value;
+    } else {
+        status = USBX_TRANSFER_STALL;
+    }
+    pthread_mutex_unlock(&cdc->lock);
+    return status;
+}
+
+struct usbx_device *usbx_sim_cdc_device_create(struct usbx_sim_cdc *cdc, int max_packet_size) {
+    struct usbx_sim_endpoint_config endpoints[2];
+    struct usbx_sim_config config;
+
+    cdc->max_packet_size = max_packet_size;
+    memset(endpoints, 0, sizeof(endpoints));
+    endpoints[0].address = 0x81;
+    endpoints[1].address = 0x02;
+    for (int i = 0; i < 2; i++) {
+        endpoints[i].type = USBX_TRANSFER_TYPE_BULK;
+        endpoints[i].max_packet_size = max_packet_size;
+        endpoints[i].handler = bulk_handler;
+        endpoints[i].handler_cls = cdc;
+    }
+    memset(&config, 0, sizeof(config));
+    config.endpoints = endpoints;
+    config.num_endpoints = 2;
+    config.control_handler = control_handler;
+    config.control_cls = cdc;
+    return usbx_sim_device_create(&config);
+}
+
+void usbx_sim_cdc_get_stats(struct usbx_sim_cdc *cdc, struct usbx_sim_cdc_stats *stats) {
+    pthread_mutex_lock(&cdc->lock);
+    *stats = cdc->stats;
+    pthread_mutex_unlock(&cdc->lock);
+}
@@ -0,0 +1,223 @@
+/**
+ * @file sim_dfu.c
+ * @brief Simulated DFU 1.1 device for the in-process backend
+ *
+ * Implements the download half of the DFU state machine on endpoint 0.
+ * Writing a block and manifestation take simulated time, reported to the
+ * host as bwPollTimeout; status requests arriving before that time are
+ * counted so tests can check that the host honours the poll timeout.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_dfu.h"
+#include "usbx_sim.h"
+
+/** @brief Standard SET_INTERFACE request, accepted for any alternate setting */
+#define REQUEST_TYPE_SET_INTERFACE 0x01
+#define REQUEST_SET_INTERFACE 0x0b
+
+struct usbx_sim_dfu {
+    struct usbx_sim_dfu_config config;
+    pthread_mutex_t lock;
+    int state;                  /* enum usbx_dfu_state */
+    int status;                 /* bStatus reported by DFU_GETSTATUS */
+    uint64_t busy_until_us;     /* end of the current write or manifestation */
+    unsigned int next_block;    /* wValue expected in the next DFU_DNLOAD */
+    unsigned char *image;
+    size_t image_size;
+    struct usbx_sim_dfu_stats stats;
+};
+
+struct usbx_sim_dfu *usbx_sim_dfu_create(const struct usbx_sim_dfu_config *config) {
+    if (!config || config->capacity == 0 || config->transfer_size < 0 ||
+        config->transfer_size > 0xffff) {
+        return NULL;
+    }
+    struct usbx_sim_dfu *dfu = calloc(1, sizeof(*dfu));
+    if (!dfu) {
+        return NULL;
+    }
+    dfu->config = *config;
+    if (dfu->config.transfer_size == 0) {
+        dfu->config.transfer_size = USBX_DFU_DEFAULT_TRANSFER_SIZE;
+    }
+    dfu->image = malloc(config->capacity);
+    if (!dfu->image) {
+        free(dfu);
+        return NULL;
+    }
+    pthread_mutex_init(&dfu->lock, NULL);
+    dfu->state = USBX_DFU_STATE_IDLE;
+    dfu->status = USBX_DFU_STATUS_OK;
+    return dfu;
+}
+
+void usbx_sim_dfu_destroy(struct usbx_sim_dfu *dfu) {
+    if (!dfu) {
+        return;
+    }
+    pthread_mutex_destroy(&dfu->lock);
+    free(dfu->image);
+    free(dfu);
+}
+
+/* Enter dfuERROR (lock held); the request that caused it stalls */
+static int fail(struct usbx_sim_dfu *dfu, int status) {
+    dfu->state = USBX_DFU_STATE_ERROR;
+    dfu->status = status;
+    return USBX_TRANSFER_STALL;
+}
+
+/* DFU_DNLOAD (lock held) */
+static int download(struct usbx_sim_dfu *dfu, unsigned int block, const unsigned char *data,
+                    size_t length) {
+    if (dfu->state != USBX_DFU_STATE_IDLE && dfu->state != USBX_DFU_STATE_DNLOAD_IDLE) {
+        return fail(dfu, USBX_DFU_STATUS_ERR_STALLEDPKT);
+    }
+    if (length == 0) {
+        if (dfu->state == USBX_DFU_STATE_IDLE) {
+            return fail(dfu, USBX_DFU_STATUS_ERR_STALLEDPKT);
+        }
+        dfu->state = USBX_DFU_STATE_MANIFEST_SYNC;
+        return USBX_TRANSFER_COMPLETED;
+    }
+    if (length > (size_t)dfu->config.transfer_size) {
+        return fail(dfu, USBX_DFU_STATUS_ERR_STALLEDPKT);
+    }
+    if (dfu->state == USBX_DFU_STATE_IDLE) {
+        dfu->image_size = 0;
+        dfu->next_block = block;
+    }
+    if (block != dfu->next_block) {
+        return fail(dfu, USBX_DFU_STATUS_ERR_UNKNOWN);
+    }
+    if (length > dfu->config.capacity - dfu->image_size) {
+        return fail(dfu, USBX_DFU_STATUS_ERR_ADDRESS);
+    }
+    memcpy(dfu->image + dfu->image_size, data, length);
+    dfu->image_size += length;
+    dfu->next_block = (block + 1) & 0xffff;
+    dfu->stats.blocks++;
+    dfu->state = USBX_DFU_STATE_DNLOAD_SYNC;
+    return USBX_TRANSFER_COMPLETED;
+}
+
+/* Time left until @p until in whole milliseconds, rounded up */
+static unsigned int remaining_ms(uint64_t until, uint64_t now_us) {
+    return until > now_us ? (unsigned int)((until - now_us + 999) / 1000) : 0;
+}
+
+/* DFU_GETSTATUS (lock held): advance the state machine and fill the response */
+static void get_status(struct usbx_sim_dfu *dfu, uint64_t now_us, unsigned char *response) {
+    unsigned int poll_timeout = 0;
+
+    dfu->stats.status_requests++;
+    switch (dfu->state) {
+    case USBX_DFU_STATE_DNLOAD_SYNC:
+        dfu->busy_until_us = now_us + dfu->config.poll_timeout_ms * 1000ULL;
+        dfu->state = dfu->config.poll_timeout_ms ? USBX_DFU_STATE_DNBUSY
+                                                 : USBX_DFU_STATE_DNLOAD_IDLE;
+        poll_timeout = dfu->config.poll_timeout_ms;
+        break;
+    case USBX_DFU_STATE_DNBUSY:
+        if (now_us < dfu->busy_until_us) {
+            dfu->stats.early_polls++;
+            poll_timeout = remaining_ms(dfu->busy_until_us, now_us);
+        } else {
+            dfu->state = USBX_DFU_STATE_DNLOAD_IDLE;
+        }
+        break;
+    case USBX_DFU_STATE_MANIFEST_SYNC:
+        dfu->busy_until_us = now_us + dfu->config.manifest_timeout_ms * 1000ULL;
+        dfu->state = USBX_DFU_STATE_MANIFEST;
+        poll_timeout = dfu->config.manifest_timeout_ms;
+        break;
+    case USBX_DFU_STATE_MANIFEST:
+        if (now_us < dfu->busy_until_us) {
+            dfu->stats.early_polls++;
+            poll_timeout = remaining_ms(dfu->busy_until_us, now_us);
+        } else {
+            dfu->stats.manifested++;
+            dfu->state = dfu->config.manifestation_tolerant ? USBX_DFU_STATE_IDLE
+                                                            : USBX_DFU_STATE_MANIFEST_WAIT_RESET;
+        }
+        break;
+    default:
+        break;
+    }
+
+    response[0] = (unsigned char)dfu->status;
+    response[1] = (unsigned char)(poll_timeout & 0xff);
+    response[2] = (unsigned char)((poll_timeout >> 8) & 0xff);
+    response[3] = (unsigned char)((poll_timeout >> 16) & 0xff);
+    response[4] = (unsigned char)dfu->state;
+    response[5] = 0;    // iString
+}
+
+int usbx_sim_dfu_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                         uint64_t *retry_at_us) {
+    struct usbx_sim_dfu *dfu = cls;
+    unsigned char *setup = xfer->buffer;
+    unsigned char *data = xfer->buffer + USBX_CONTROL_SETUP_SIZE;
+    unsigned int value = setup[2] | setup[3] << 8;
+    size_t length = (size_t)(setup[6] | setup[7] << 8);
+    unsigned char response[USBX_DFU_STATUS_SIZE];
+    int status = USBX_TRANSFER_COMPLETED;
+    (void)retry_at_us;
+
+    if (xfer->length < USBX_CONTROL_SETUP_SIZE ||
+        length > (size_t)xfer->length - USBX_CONTROL_SETUP_SIZE) {
+        return USBX_TRANSFER_ERROR;
+    }
+    if (setup[0] == REQUEST_TYPE_SET_INTERFACE && setup[1] == REQUEST_SET_INTERFACE) {
+        xfer->actual_length = 0;
+        return USBX_TRANSFER_COMPLETED;
+    }
+
+    pthread_mutex_lock(&dfu->lock);
+    xfer->actual_length = 0;
+    if (setup[0] == USBX_DFU_REQUEST_OUT && setup[1] == USBX_DFU_DNLOAD) {
+        status = download(dfu, value, data, length);
+        xfer->actual_length = status == USBX_TRANSFER_COMPLETED ? (int)length : 0;
+    } else if (setup[0] == USBX_DFU_REQUEST_OUT && setup[1] == USBX_DFU_CLRSTATUS &&
+               dfu->state == USBX_DFU_STATE_ERROR) {
+        dfu->state = USBX_DFU_STATE_IDLE;
+        dfu->status = USBX_DFU_STATUS_OK;
+    } else if (setup[0] == USBX_DFU_REQUEST_OUT && setup[1] == USBX_DFU_ABORT &&
+               dfu->state != USBX_DFU_STATE_ERROR && dfu->state != USBX_DFU_STATE_DNBUSY &&
+               dfu->state != USBX_DFU_STATE_MANIFEST &&
+               dfu->state != USBX_DFU_STATE_MANIFEST_WAIT_RESET) {
+        dfu->state = USBX_DFU_STATE_IDLE;
+    } else if (setup[0] == USBX_DFU_REQUEST_IN && setup[1] == USBX_DFU_GETSTATUS) {
+        get_status(dfu, now_us, response);
+        xfer->actual_length = (int)(length < sizeof(response) ? length : sizeof(response));
+        memcpy(data, response, (size_t)xfer->actual_length);
+    } else if (setup[0] == USBX_DFU_REQUEST_IN && setup[1] == USBX_DFU_GETSTATE && length > 0) {
+        data[0] = (unsigned char)dfu->state;
+        xfer->actual_length = 1;
+    } else {
+        status = fail(dfu, USBX_DFU_STATUS_ERR_STALLEDPKT);
+    }
+    pthread_mutex_unlock(&dfu->lock);
+    return status;
+}
+
+void usbx_sim_dfu_get_stats(struct usbx_sim_dfu *dfu, struct usbx_sim_dfu_stats *stats) {
+    pthread_mutex_lock(&dfu->lock);
+    *stats = dfu->stats;
+    stats->state = dfu->state;
+    stats->image_size = dfu->image_size;
+    pthread_mutex_unlock(&dfu->lock);
+}
+
+const unsigned char *usbx_sim_dfu_image(struct usbx_sim_dfu *dfu, size_t *size) {
+    pthread_mutex_lock(&dfu->lock);
+    *size = dfu->image_size;
+    pthread_mutex_unlock(&dfu->lock);
+    return dfu->image;
+}
@@ -0,0 +1,353 @@
+/**
+ * @file sim_msc.c
+ * @brief Simulated Bulk-Only Transport mass-storage device for the in-process backend
+ *
+ * One logical unit backed by memory. The device follows the BOT phases: a
+ * CBW on the OUT pipe, the data phase in the direction the CBW announced,
+ * then the CSW on the IN pipe. An IN transfer arriving before the device
+ * has data is held (USBX_SIM_RETRY) as a real device would NAK it. A
+ * command that fails with data expected stalls the data pipe; an invalid
+ * CBW stalls both pipes until reset recovery.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_msc.h"
+#include "usbx_sim.h"
+#include "usbx_util.h"
+
+/** @brief How often a held transfer checks the device state again */
+#define POLL_INTERVAL_US 20
+
+/** @brief Default logical block length */
+#define DEFAULT_BLOCK_SIZE 512
+
+#define INQUIRY_SIZE 36
+#define SENSE_SIZE 18
+
+/** @brief Sense data reported by failed commands (0x00KKAAQQ) */
+#define SENSE_INVALID_OPCODE 0x052000U
+#define SENSE_LBA_OUT_OF_RANGE 0x052100U
+#define SENSE_LUN_NOT_SUPPORTED 0x052500U
+
+/** @brief Standard requests accepted on endpoint 0 */
+#define REQUEST_TYPE_ENDPOINT_OUT 0x02
+#define REQUEST_CLEAR_FEATURE 0x01
+#define REQUEST_TYPE_CLASS_OUT 0x21
+#define REQUEST_TYPE_CLASS_IN 0xa1
+
+enum sim_msc_phase {
+    PHASE_IDLE,         // waiting for a CBW
+    PHASE_DATA_OUT,
+    PHASE_DATA_IN,
+    PHASE_STATUS        // CSW ready
+};
+
+struct usbx_sim_msc {
+    struct usbx_sim_msc_config config;
+    pthread_mutex_t lock;
+    unsigned char *disk;
+    int phase;
+    int halted;                 // invalid CBW: pipes stay stalled until reset
+    int in_stalled;
+    int out_stalled;
+    uint32_t tag;
+    uint32_t expected;          // dCBWDataTransferLength
+    uint32_t transferred;       // bytes of the data phase moved so far
+    uint32_t data_length;       // bytes the device intends to move
+    unsigned char *data;        // data phase source or destination
+    int status;                 // bCSWStatus
+    uint32_t sense;
+    unsigned char response[INQUIRY_SIZE];
+    struct usbx_sim_msc_stats stats;
+};
+
+struct usbx_sim_msc *usbx_sim_msc_create(const struct usbx_sim_msc_config *config) {
+    if (!config || config->block_count == 0) {
+        return NULL;
+    }
+    struct usbx_sim_msc *msc = calloc(1, sizeof(*msc));
+    if (!msc) {
+        return NULL;
+    }
+    msc->config = *config;
+    if (msc->config.block_size == 0) {
+        msc->config.block_size = DEFAULT_BLOCK_SIZE;
+    }
+    msc->disk = calloc(msc->config.block_count, msc->config.block_size);
+    if (!msc->disk) {
+        free(msc);
+        return NULL;
+    }
+    pthread_mutex_init(&msc->lock, NULL);
+    msc->phase = PHASE_IDLE;
+    return msc;
+}
+
+void usbx_sim_msc_destroy(struct usbx_sim_msc *msc) {
+    if (!msc) {
+        return;
+    }
+    pthread_mutex_destroy(&msc->lock);
+    free(msc->disk);
+    free(msc);
+}
+
+/* Start a data phase in the CBW direction, never longer than the host expects (lock held) */
+static void start_data(struct usbx_sim_msc *msc, int in, unsigned char *data, uint32_t length) {
+    if (length > msc->expected) {
+        length = msc->expected;
+    }
+    msc->data = data;
+    msc->data_length = length;
+    msc->phase = length == 0 ? PHASE_STATUS : in ? PHASE_DATA_IN : PHASE_DATA_OUT;
+}
+
+/* Fail the command; a pending data phase stalls its pipe (lock held) */
+static void fail(struct usbx_sim_msc *msc, int in, uint32_t sense) {
+    msc->status = USBX_MSC_CSW_FAILED;
+    msc->sense = sense;
+    msc->stats.failed++;
+    if (msc->expected > 0) {
+        if (in) {
+            msc->in_stalled = 1;
+        } else {
+            msc->out_stalled = 1;
+        }
+    }
+    msc->phase = PHASE_STATUS;
+}
+
+/* Execute a valid CBW (lock held) */
+static void execute(struct usbx_sim_msc *msc, const unsigned char *cbw) {
+    int in = (cbw[12] & USBX_ENDPOINT_IN) != 0;
+    const unsigned char *cb = cbw + 15;
+    uint32_t block_size = msc->config.block_size;
+
+    msc->tag = usbx_get_le32(cbw + 4);
+    msc->expected = usbx_get_le32(cbw + 8);
+    msc->transferred = 0;
+    msc->status = USBX_MSC_CSW_PASSED;
+    msc->stats.commands++;
+
+    // REQUEST SENSE still answers for a missing LUN, reporting why it failed
+    if ((cbw[13] & 0x0f) != 0 && cb[0] != USBX_SCSI_REQUEST_SENSE) {
+        fail(msc, in, SENSE_LUN_NOT_SUPPORTED);
+        return;
+    }
+    switch (cb[0]) {
+    case USBX_SCSI_TEST_UNIT_READY:
+        start_data(msc, in, NULL, 0);
+        break;
+    case USBX_SCSI_INQUIRY:
+        memset(msc->response, 0, sizeof(msc->response));
+        msc->response[2] = 0x04;        // SPC-2
+        msc->response[3] = 0x02;        // response data format
+        msc->response[4] = INQUIRY_SIZE - 5;
+        memcpy(msc->response + 8, "usbX    Simulated disk  1.0 ", 28);
+        start_data(msc, in, msc->response, cb[4] < INQUIRY_SIZE ? cb[4] : INQUIRY_SIZE);
+        break;
+    case USBX_SCSI_REQUEST_SENSE:
+        memset(msc->response, 0, sizeof(msc->response));
+        msc->response[0] = 0x70;        // current error, fixed format
+        msc->response[2] = (unsigned char)(msc->sense >> 16);
+        msc->response[7] = SENSE_SIZE - 8;
+        msc->response[12] = (unsigned char)(msc->sense >> 8);
+        msc->response[13] = (unsigned char)msc->sense;
+        msc->sense = 0;
+        start_data(msc, in, msc->response, cb[4] < SENSE_SIZE ? cb[4] : SENSE_SIZE);
+        break;
+    case USBX_SCSI_READ_CAPACITY_10:
+        usbx_put_be32(msc->response, msc->config.block_count - 1);
+        usbx_put_be32(msc->response + 4, block_size);
+        start_data(msc, in, msc->response, 8);
+        break;
+    case USBX_SCSI_READ_10:
+    case USBX_SCSI_WRITE_10: {
+        uint32_t lba = usbx_get_be32(cb + 2);
+        uint32_t count = usbx_get_be16(cb + 7);
+        int read = cb[0] == USBX_SCSI_READ_10;
+        if (lba > msc->config.block_count || count > msc->config.block_count - lba) {
+            fail(msc, in, SENSE_LBA_OUT_OF_RANGE);
+            return;
+        }
+        uint64_t bytes = (uint64_t)count * block_size;
+        if (in != read || bytes > msc->expected) {
+            // Host and device disagree about the data phase (BOT cases 7, 8, 10, 13)
+            msc->status = USBX_MSC_CSW_PHASE_ERROR;
+            msc->phase = PHASE_STATUS;
+            return;
+        }
+        if (read) {
+            msc->stats.reads++;
+            msc->stats.blocks_read += count;
+        } else {
+            msc->stats.writes++;
+            msc->stats.blocks_written += count;
+        }
+        start_data(msc, in, msc->disk + (size_t)lba * block_size, (uint32_t)bytes);
+        break;
+    }
+    default:
+        fail(msc, in, SENSE_INVALID_OPCODE);
+        break;
+    }
+}
+
+/* Bulk OUT: a CBW or write data (lock held) */
+static int bulk_out(struct usbx_sim_msc *msc, struct usbx_transfer *xfer) {
+    if (msc->halted || msc->out_stalled) {
+        return USBX_TRANSFER_STALL;
+    }
+    if (msc->phase == PHASE_IDLE) {
+        if (xfer->length != USBX_MSC_CBW_SIZE ||
+            usbx_get_le32(xfer->buffer) != USBX_MSC_CBW_SIGNATURE || xfer->buffer[14] == 0 ||
+            xfer->buffer[14] > 16) {
+            msc->halted = 1;
+            msc->in_stalled = 1;
+            msc->out_stalled = 1;
+            msc->stats.invalid_cbws++;
+            return USBX_TRANSFER_STALL;
+        }
+        execute(msc, xfer->buffer);
+        xfer->actual_length = xfer->length;
+        return USBX_TRANSFER_COMPLETED;
+    }
+    if (msc->phase != PHASE_DATA_OUT) {
+        return USBX_SIM_RETRY;
+    }
+    uint32_t n = msc->data_length - msc->transferred;
+    if ((uint32_t)xfer->length < n) {
+        n = (uint32_t)xfer->length;
+    }
+    memcpy(msc->data + msc->transferred, xfer->buffer, n);
+    msc->transferred += n;
+    xfer->actual_length = (int)n;
+    if (msc->transferred == msc->data_length) {
+        msc->phase = PHASE_STATUS;
+    }
+    return USBX_TRANSFER_COMPLETED;
+}
+
+/* Bulk IN: read data or the CSW (lock held) */
+static int bulk_in(struct usbx_sim_msc *msc, struct usbx_transfer *xfer) {
+    if (msc->halted || msc->in_stalled) {
+        return USBX_TRANSFER_STALL;
+    }
+    if (msc->phase == PHASE_DATA_IN) {
+        uint32_t n = msc->data_length - msc->transferred;
+        if ((uint32_t)xfer->length < n) {
+            n = (uint32_t)xfer->length;
+        }
+        memcpy(xfer->buffer, msc->data + msc->transferred, n);
+        msc->transferred += n;
+        xfer->actual_length = (int)n;
+        if (msc->transferred == msc->data_length) {
+            msc->phase = PHASE_STATUS;
+        }
+        return USBX_TRANSFER_COMPLETED;
+    }
+    if (msc->phase != PHASE_STATUS) {
+        return USBX_SIM_RETRY;
+    }
+    if (xfer->length < USBX_MSC_CSW_SIZE) {
+        return USBX_TRANSFER_OVERFLOW;
+    }
+    usbx_put_le32(xfer->buffer, USBX_MSC_CSW_SIGNATURE);
+    usbx_put_le32(xfer->buffer + 4, msc->tag);
+    usbx_put_le32(xfer->buffer + 8, msc->expected - msc->transferred);
+    xfer->buffer[12] = (unsigned char)msc->status;
+    xfer->actual_length = USBX_MSC_CSW_SIZE;
+    msc->phase = PHASE_IDLE;
+    return USBX_TRANSFER_COMPLETED;
+}
+
+int usbx_sim_msc_bulk_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                              uint64_t *retry_at_us) {
+    struct usbx_sim_msc *msc = cls;
+
+    xfer->actual_length = 0;
+    pthread_mutex_lock(&msc->lock);
+    int status = xfer->endpoint & USBX_ENDPOINT_IN ? bulk_in(msc, xfer) : bulk_out(msc, xfer);
+    pthread_mutex_unlock(&msc->lock);
+    if (status == USBX_SIM_RETRY) {
+        *retry_at_us = now_us + POLL_INTERVAL_US;
+    }
+    return status;
+}
+
+int usbx_sim_msc_control_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                                 uint64_t *retry_at_us) {
+    struct usbx_sim_msc *msc = cls;
+    unsigned char *setup = xfer->buffer;
+    unsigned int value = setup[2] | setup[3] << 8;
+    unsigned int index = setup[4] | setup[5] << 8;
+    size_t length = (size_t)(setup[6] | setup[7] << 8);
+    int status = USBX_TRANSFER_COMPLETED;
+    (void)now_us;
+    (void)retry_at_us;
+
+    if (length > (size_t)xfer->length - USBX_CONTROL_SETUP_SIZE) {
+        return USBX_TRANSFER_ERROR;
+    }
+    xfer->actual_length = 0;
+    pthread_mutex_lock(&msc->lock);
+    if (setup[0] == REQUEST_TYPE_CLASS_OUT && setup[1] == USBX_MSC_REQUEST_RESET) {
+        // Reset clears the command state; the halts stay until CLEAR_FEATURE
+        msc->stats.resets++;
+        msc->halted = 0;
+        msc->phase = PHASE_IDLE;
+    } else if (setup[0] == REQUEST_TYPE_CLASS_IN && setup[1] == USBX_MSC_REQUEST_GET_MAX_LUN &&
+               length > 0) {
+        xfer->buffer[USBX_CONTROL_SETUP_SIZE] = 0;
+        xfer->actual_length = 1;
+    } else if (setup[0] == REQUEST_TYPE_ENDPOINT_OUT && setup[1] == REQUEST_CLEAR_FEATURE &&
+               value == 0) {
+        // An invalid CBW keeps both pipes stalled until reset recovery
+        if (!msc->halted && (index & USBX_ENDPOINT_IN)) {
+            msc->in_stalled = 0;
+        } else if (!msc->halted) {
+            msc->out_stalled = 0;
+        }
+    } else {
+        status = USBX_TRANSFER_STALL;
+    }
+    pthread_mutex_unlock(&msc->lock);
+    return status;
+}
+
+struct usbx_device *usbx_sim_msc_device_create(struct usbx_sim_msc *msc) {
+    struct usbx_sim_endpoint_config endpoints[2];
+    struct usbx_sim_config config;
+
+    memset(endpoints, 0, sizeof(endpoints));
+    endpoints[0].address = 0x81;
+    endpoints[1].address = 0x02;
+    for (int i = 0; i < 2; i++) {
+        endpoints[i].type = USBX_TRANSFER_TYPE_BULK;
+        endpoints[i].max_packet_size = 512;
+        endpoints[i].latency_us = msc->config.latency_us;
+        endpoints[i].handler = usbx_sim_msc_bulk_handler;
+        endpoints[i].handler_cls = msc;
+    }
+    memset(&config, 0, sizeof(config));
+    config.endpoints = endpoints;
+    config.num_endpoints = 2;
+    config.control_handler = usbx_sim_msc_control_handler;
+    config.control_cls = msc;
+    return usbx_sim_device_create(&config);
+}
+
+void usbx_sim_msc_get_stats(struct usbx_sim_msc *msc, struct usbx_sim_msc_stats *stats) {
+    pthread_mutex_lock(&msc->lock);
+    *stats = msc->stats;
+    pthread_mutex_unlock(&msc->lock);
+}
+
+unsigned char *usbx_sim_msc_disk(struct usbx_sim_msc *msc) {
+    return msc->disk;
+}
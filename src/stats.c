@@ -0,0 +1,185 @@
+/**
+ * @file stats.c
+ * @brief Always-on transfer statistics per handle and endpoint
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_stats.h"
+
+const uint64_t usbx_stats_latency_bounds_us[USBX_STATS_LATENCY_BUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000
+};
+
+struct usbx_stats {
+    struct usbx_stats_endpoint endpoints[USBX_STATS_ENDPOINTS];  // updated atomically
+};
+
+static const char *const status_names[USBX_STATS_STATUSES] = {
+    "completed", "error", "timed_out", "cancelled", "stall", "no_device", "overflow"
+};
+
+const char *usbx_stats_status_name(int status) {
+    if (status < 0 || status >= USBX_STATS_STATUSES) {
+        return "unknown";
+    }
+    return status_names[status];
+}
+
+/* Endpoint index: control, then OUT 1-15, then IN 1-15 */
+static int endpoint_slot(unsigned char endpoint) {
+    int number = endpoint & 0x0f;
+    if (number == 0) {
+        return 0;
+    }
+    return number + ((endpoint & USBX_ENDPOINT_IN) ? 16 : 0);
+}
+
+static int error_slot(int error) {
+    return error <= USBX_ERROR_IO && error >= USBX_ERROR_MISMATCH ? -error : 0;
+}
+
+static void add(uint64_t *counter, uint64_t value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+struct usbx_stats *usbx_stats_create(void) {
+    return calloc(1, sizeof(struct usbx_stats));
+}
+
+void usbx_stats_free(struct usbx_stats *stats) {
+    free(stats);
+}
+
+void usbx_stats_attach(struct usbx_stats *stats, struct usbx_device *dev) {
+    dev->stats = stats;
+    __atomic_or_fetch(&dev->taps, USBX_TAP_STATS, __ATOMIC_RELEASE);
+}
+
+void usbx_stats_detach(struct usbx_device *dev) {
+    __atomic_and_fetch(&dev->taps, ~USBX_TAP_STATS, __ATOMIC_RELEASE);
+}
+
+void usbx_stats_record(struct usbx_transfer *xfer, uint64_t now_us) {
+    struct usbx_stats_endpoint *ep = &xfer->dev->stats->endpoints[endpoint_slot(xfer->endpoint)];
+    int status = xfer->status;
+    uint64_t bytes = xfer->actual_length > 0 ? (uint64_t)xfer->actual_length : 0;
+
+    if (xfer->type == USBX_TRANSFER_TYPE_ISOCHRONOUS) {
+        bytes = 0;
+        for (int i = 0; i < xfer->num_iso_packets; i++) {
+            bytes += (uint64_t)xfer->iso_packets[i].actual_length;
+        }
+    }
+    add(&ep->transfers, 1);
+    add(&ep->bytes, bytes);
+    if (status >= 0 && status < USBX_STATS_STATUSES) {
+        add(&ep->statuses[status], 1);
+    }
+    if (status != USBX_TRANSFER_COMPLETED && status != USBX_TRANSFER_CANCELLED) {
+        add(&ep->errors[error_slot(usbx_status_to_error(status))], 1);
+    }
+
+    uint64_t latency = now_us > xfer->submit_us ? now_us - xfer->submit_us : 0;
+    int bucket = 0;
+    while (bucket < USBX_STATS_LATENCY_BUCKETS - 1 &&
+           latency > usbx_stats_latency_bounds_us[bucket]) {
+        bucket++;
+    }
+    add(&ep->latency_sum_us, latency);
+    add(&ep->latency[bucket], 1);
+}
+
+void usbx_stats_record_error(struct usbx_transfer *xfer, int error) {
+    struct usbx_stats_endpoint *ep = &xfer->dev->stats->endpoints[endpoint_slot(xfer->endpoint)];
+    add(&ep->submit_errors, 1);
+    add(&ep->errors[error_slot(error)], 1);
+}
+
+static uint64_t load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/* Snapshot one slot; returns 0 if it never saw traffic */
+static int snapshot(const struct usbx_stats_endpoint *src, struct usbx_stats_endpoint *dst) {
+    dst->transfers = load(&src->transfers);
+    dst->submit_errors = load(&src->submit_errors);
+    if (dst->transfers == 0 && dst->submit_errors == 0) {
+        return 0;
+    }
+    dst->bytes = load(&src->bytes);
+    dst->latency_sum_us = load(&src->latency_sum_us);
+    for (int i = 0; i < USBX_STATS_STATUSES; i++) {
+        dst->statuses[i] = load(&src->statuses[i]);
+    }
+    for (int i = 0; i < USBX_STATS_ERRORS; i++) {
+        dst->errors[i] = load(&src->errors[i]);
+    }
+    for (int i = 0; i < USBX_STATS_LATENCY_BUCKETS; i++) {
+        dst->latency[i] = load(&src->latency[i]);
+    }
+    return 1;
+}
+
+static void accumulate(struct usbx_stats_endpoint *total, const struct usbx_stats_endpoint *ep) {
+    total->transfers += ep->transfers;
+    total->bytes += ep->bytes;
+    total->submit_errors += ep->submit_errors;
+    total->latency_sum_us += ep->latency_sum_us;
+    for (int i = 0; i < USBX_STATS_STATUSES; i++) {
+        total->statuses[i] += ep->statuses[i];
+    }
+    for (int i = 0; i < USBX_STATS_ERRORS; i++) {
+        total->errors[i] += ep->errors[i];
+    }
+    for (int i = 0; i < USBX_STATS_LATENCY_BUCKETS; i++) {
+        total->latency[i] += ep->latency[i];
+    }
+}
+
+int usbx_stats_get(struct usbx_stats *stats, struct usbx_stats_endpoint *endpoints,
+                   struct usbx_stats_endpoint *total) {
+    int count = 0;
+
+    if (total) {
+        memset(total, 0, sizeof(*total));
+    }
+    // Slot order is address order: control, OUT 1-15, IN 1-15
+    for (int slot = 0; slot < USBX_STATS_ENDPOINTS; slot++) {
+        struct usbx_stats_endpoint *ep = &endpoints[count];
+        memset(ep, 0, sizeof(*ep));
+        if (!snapshot(&stats->endpoints[slot], ep)) {
+            continue;
+        }
+        ep->endpoint = (unsigned char)(slot < 16 ? slot : (slot - 16) | USBX_ENDPOINT_IN);
+        if (total) {
+            accumulate(total, ep);
+        }
+        count++;
+    }
+    return count;
+}
+
+uint64_t usbx_stats_latency_quantile_us(const struct usbx_stats_endpoint *counters,
+                                        unsigned int quantile) {
+    uint64_t completions = 0, seen = 0;
+    for (int i = 0; i < USBX_STATS_LATENCY_BUCKETS; i++) {
+        completions += counters->latency[i];
+    }
+    if (completions == 0) {
+        return 0;
+    }
+    // Smallest bucket holding at least quantile/1000 of the completions
+    uint64_t rank = (completions * quantile + 999) / 1000;
+    for (int i = 0; i < USBX_STATS_LATENCY_BUCKETS - 1; i++) {
+        seen += counters->latency[i];
+        if (seen >= rank && seen > 0) {
+            return usbx_stats_latency_bounds_us[i];
+        }
+    }
+    return usbx_stats_latency_bounds_us[USBX_STATS_LATENCY_BUCKETS - 2];
+}
@@ -0,0 +1,387 @@
+/**
+ * @file trace.c
+ * @brief Session recorder writing the trace format of usbx_trace.h
+ *
+ * Records are encoded into a scratch buffer and appended to a buffered
+ * stdio stream under one mutex, so the file order is the order in which
+ * events reached the recorder. Record kinds:
+ *
+ * - 'D' device: index, handle id
+ * - 'P' endpoint: device, address, type, wMaxPacketSize
+ * - 'S' submission: device, endpoint, type, flags, timeout, length, setup/OUT payload
+ * - 'C' completion: submission number, status, actual length, IN payload
+ * - 'E' failed submission: submission number, usbx_error
+ * - 'H' request: method, path, arguments, headers, body, HTTP status
+ *
+ * Submissions are numbered from 0 in file order; completions refer to
+ * that number, found through a table of the transfers in flight.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "uthash.h"
+#include "usbx_buf.h"
+#include "usbx_trace.h"
+#include "usbx_util.h"
+
+/** @brief Endpoint slots per device: 16 OUT then 16 IN */
+#define ENDPOINT_SLOTS 32
+
+/** @brief A transfer between its submission and completion records */
+struct inflight {
+    const struct usbx_transfer *xfer;  // key
+    uint64_t submission;
+    UT_hash_handle hh;
+};
+
+/** @brief A device being recorded */
+struct traced_device {
+    struct usbx_device *dev;     // NULL once detached
+    unsigned char endpoints[ENDPOINT_SLOTS];  // 'P' record written
+};
+
+struct recorder {
+    FILE *file;
+    size_t max_payload;
+    uint64_t start_us;
+    uint64_t submissions;
+    int write_error;
+    struct inflight *inflight;
+    struct traced_device *devices;
+    int num_devices;
+    struct usbx_buf record;      // scratch for the record being encoded
+};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct recorder *recorder = NULL;  // guarded by trace_lock
+static int recording = 0;                 // lock-free hint for usbx_trace_active()
+
+static void put_varint(struct usbx_buf *buf, uint64_t value) {
+    unsigned char bytes[10];
+    size_t length = 0;
+    do {
+        bytes[length] = (unsigned char)(value & 0x7f);
+        value >>= 7;
+        if (value) {
+            bytes[length] |= 0x80;
+        }
+        length++;
+    } while (value);
+    usbx_buf_append(buf, bytes, length);
+}
+
+static void put_signed(struct usbx_buf *buf, int64_t value) {
+    put_varint(buf, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+static void put_bytes(struct usbx_buf *buf, const void *data, size_t length) {
+    put_varint(buf, length);
+    usbx_buf_append(buf, data, length);
+}
+
+static void put_string(struct usbx_buf *buf, const char *text) {
+    put_bytes(buf, text ? text : "", text ? strlen(text) : 0);
+}
+
+/* Start a record in the scratch buffer (lock held) */
+static void begin_record(struct recorder *rec, char kind, uint64_t at_us) {
+    rec->record.length = 0;     // keep the allocation for the next record
+    usbx_buf_append(&rec->record, &kind, 1);
+    put_varint(&rec->record, at_us > rec->start_us ? at_us - rec->start_us : 0);
+}
+
+/* Append the scratch record to the file (lock held) */
+static void end_record(struct recorder *rec) {
+    if (rec->record.failed) {
+        rec->write_error = 1;
+        return;
+    }
+    if (fwrite(rec->record.data, 1, rec->record.length, rec->file) != rec->record.length) {
+        rec->write_error = 1;
+    }
+}
+
+/* Index of a traced device, or -1 (lock held) */
+static int find_device(const struct recorder *rec, const struct usbx_device *dev) {
+    for (int i = 0; i < rec->num_devices; i++) {
+        if (rec->devices[i].dev == dev) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int usbx_trace_start(const char *path, size_t max_payload) {
+    struct recorder *rec = calloc(1, sizeof(*rec));
+    if (!rec) {
+        return USBX_ERROR_NO_MEM;
+    }
+    rec->max_payload = max_payload ? max_payload : USBX_TRACE_DEFAULT_MAX_PAYLOAD;
+    usbx_buf_init(&rec->record);
+
+    pthread_mutex_lock(&trace_lock);
+    if (recorder) {
+        pthread_mutex_unlock(&trace_lock);
+        free(rec);
+        return USBX_ERROR_BUSY;
+    }
+    // Close-on-exec, so a successor started by a handoff does not inherit the file
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    rec->file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!rec->file) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        pthread_mutex_unlock(&trace_lock);
+        free(rec);
+        return USBX_ERROR_IO;
+    }
+    rec->start_us = usbx_now_us();
+    usbx_buf_append(&rec->record, "USBXTRC1", 8);
+    put_varint(&rec->record, USBX_TRACE_VERSION);
+    end_record(rec);
+    recorder = rec;
+    __atomic_store_n(&recording, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_lock);
+    return USBX_SUCCESS;
+}
+
+int usbx_trace_stop(void) {
+    pthread_mutex_lock(&trace_lock);
+    struct recorder *rec = recorder;
+    if (!rec) {
+        pthread_mutex_unlock(&trace_lock);
+        return USBX_ERROR_NOT_FOUND;
+    }
+    __atomic_store_n(&recording, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < rec->num_devices; i++) {
+        if (rec->devices[i].dev) {
+            __atomic_and_fetch(&rec->devices[i].dev->taps, ~USBX_TAP_TRACE, __ATOMIC_RELEASE);
+        }
+    }
+    recorder = NULL;
+    pthread_mutex_unlock(&trace_lock);
+
+    // Completions racing with the stop saw the tap bit cleared or found no recorder
+    int failed = rec->write_error;
+    if (fclose(rec->file) != 0) {
+        failed = 1;
+    }
+    struct inflight *entry, *tmp;
+    HASH_ITER(hh, rec->inflight, entry, tmp) {
+        HASH_DEL(rec->inflight, entry);
+        free(entry);
+    }
+    free(rec->devices);
+    usbx_buf_free(&rec->record);
+    free(rec);
+    return failed ? USBX_ERROR_IO : USBX_SUCCESS;
+}
+
+int usbx_trace_active(void) {
+    return __atomic_load_n(&recording, __ATOMIC_ACQUIRE);
+}
+
+void usbx_trace_attach(struct usbx_device *dev, int handle_id) {
+    if (!usbx_trace_active()) {
+        return;
+    }
+    pthread_mutex_lock(&trace_lock);
+    struct recorder *rec = recorder;
+    if (!rec || find_device(rec, dev) >= 0) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    struct traced_device *devices = realloc(rec->devices,
+                                            (size_t)(rec->num_devices + 1) * sizeof(*devices));
+    if (!devices) {
+        rec->write_error = 1;
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    rec->devices = devices;
+    int index = rec->num_devices++;
+    memset(&devices[index], 0, sizeof(devices[index]));
+    devices[index].dev = dev;
+
+    begin_record(rec, 'D', usbx_now_us());
+    put_varint(&rec->record, (uint64_t)index);
+    put_signed(&rec->record, handle_id);
+    end_record(rec);
+    __atomic_or_fetch(&dev->taps, USBX_TAP_TRACE, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void usbx_trace_detach(struct usbx_device *dev) {
+    if (!(__atomic_load_n(&dev->taps, __ATOMIC_ACQUIRE) & USBX_TAP_TRACE)) {
+        return;
+    }
+    __atomic_and_fetch(&dev->taps, ~USBX_TAP_TRACE, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&trace_lock);
+    if (recorder) {
+        int index = find_device(recorder, dev);
+        if (index >= 0) {
+            // Keep the slot so later devices keep their index
+            recorder->devices[index].dev = NULL;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* Write the 'P' record the first time an endpoint is used (lock held) */
+static void note_endpoint(struct recorder *rec, int device, const struct usbx_transfer *xfer) {
+    if (xfer->type == USBX_TRANSFER_TYPE_CONTROL) {
+        return;     // endpoint 0 exists on every device
+    }
+    int slot = (xfer->endpoint & 0x0f) + ((xfer->endpoint & USBX_ENDPOINT_IN) ? 16 : 0);
+    if (rec->devices[device].endpoints[slot]) {
+        return;
+    }
+    rec->devices[device].endpoints[slot] = 1;
+    int max_packet_size = usbx_get_max_packet_size(xfer->dev, xfer->endpoint);
+
+    begin_record(rec, 'P', usbx_now_us());
+    put_varint(&rec->record, (uint64_t)device);
+    put_varint(&rec->record, xfer->endpoint);
+    put_varint(&rec->record, xfer->type);
+    put_varint(&rec->record, max_packet_size > 0 ? (uint64_t)max_packet_size : 64);
+    end_record(rec);
+}
+
+/* Payload of a transfer event: setup and OUT data on submission, IN data on completion */
+static void put_payload(struct recorder *rec, const struct usbx_transfer *xfer, int event) {
+    const unsigned char *data = xfer->buffer;
+    size_t length = 0;
+    int in = (xfer->endpoint & USBX_ENDPOINT_IN) != 0;
+    int control = xfer->type == USBX_TRANSFER_TYPE_CONTROL;
+
+    if (event == USBX_TAP_SUBMIT) {
+        if (control) {
+            length = xfer->length >= USBX_CONTROL_SETUP_SIZE && (data[0] & USBX_ENDPOINT_IN)
+                     ? USBX_CONTROL_SETUP_SIZE : (size_t)xfer->length;
+        } else if (!in) {
+            length = (size_t)xfer->length;
+        }
+    } else if (xfer->actual_length > 0 &&
+               (control ? xfer->length >= USBX_CONTROL_SETUP_SIZE && (data[0] & USBX_ENDPOINT_IN)
+                        : in)) {
+        if (control) {
+            data += USBX_CONTROL_SETUP_SIZE;
+        }
+        length = (size_t)xfer->actual_length;
+    }
+    if (length > rec->max_payload) {
+        length = rec->max_payload;
+    }
+    put_bytes(&rec->record, data, length);
+}
+
+void usbx_trace_transfer(const struct usbx_transfer *xfer, int event, int error) {
+    if (xfer->type == USBX_TRANSFER_TYPE_ISOCHRONOUS) {
+        return;
+    }
+    uint64_t now = usbx_now_us();
+
+    pthread_mutex_lock(&trace_lock);
+    struct recorder *rec = recorder;
+    int device = rec ? find_device(rec, xfer->dev) : -1;
+    if (device < 0) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+
+    if (event == USBX_TAP_SUBMIT) {
+        // A transfer of a detached device may have left its address behind
+        struct inflight *entry;
+        HASH_FIND_PTR(rec->inflight, &xfer, entry);
+        if (entry) {
+            HASH_DEL(rec->inflight, entry);
+        } else {
+            entry = malloc(sizeof(*entry));
+        }
+        if (!entry) {
+            rec->write_error = 1;
+            pthread_mutex_unlock(&trace_lock);
+            return;
+        }
+        entry->xfer = xfer;
+        entry->submission = rec->submissions++;
+        HASH_ADD_PTR(rec->inflight, xfer, entry);
+        note_endpoint(rec, device, xfer);
+
+        begin_record(rec, 'S', now);
+        put_varint(&rec->record, (uint64_t)device);
+        put_varint(&rec->record, xfer->endpoint);
+        put_varint(&rec->record, xfer->type);
+        put_varint(&rec->record, xfer->flags);
+        put_varint(&rec->record, xfer->timeout);
+        put_varint(&rec->record, xfer->length > 0 ? (uint64_t)xfer->length : 0);
+        put_payload(rec, xfer, event);
+        end_record(rec);
+    } else {
+        // Transfers submitted before the device was attached have no submission record
+        struct inflight *entry;
+        HASH_FIND_PTR(rec->inflight, &xfer, entry);
+        if (entry) {
+            HASH_DEL(rec->inflight, entry);
+            begin_record(rec, event == USBX_TAP_ERROR ? 'E' : 'C', now);
+            put_varint(&rec->record, entry->submission);
+            if (event == USBX_TAP_ERROR) {
+                put_signed(&rec->record, error);
+            } else {
+                put_varint(&rec->record, (uint64_t)xfer->status);
+                put_varint(&rec->record, xfer->actual_length > 0 ? (uint64_t)xfer->actual_length : 0);
+                put_payload(rec, xfer, event);
+            }
+            end_record(rec);
+            free(entry);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void usbx_trace_request(const struct usbx_http_request *req, int status, uint64_t start_us) {
+    pthread_mutex_lock(&trace_lock);
+    struct recorder *rec = recorder;
+    if (!rec) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+
+    begin_record(rec, 'H', start_us);
+    put_string(&rec->record, req->method);
+    put_string(&rec->record, req->path);
+    put_varint(&rec->record, (uint64_t)req->num_args);
+    for (int i = 0; i < req->num_args; i++) {
+        put_string(&rec->record, req->args[i].name);
+        put_string(&rec->record, req->args[i].value);
+    }
+    // Credentials stay out of the trace
+    int num_headers = 0;
+    for (int i = 0; i < req->num_headers; i++) {
+        num_headers += strcasecmp(req->headers[i].name, "Authorization") != 0;
+    }
+    put_varint(&rec->record, (uint64_t)num_headers);
+    for (int i = 0; i < req->num_headers; i++) {
+        if (strcasecmp(req->headers[i].name, "Authorization") != 0) {
+            put_string(&rec->record, req->headers[i].name);
+            put_string(&rec->record, req->headers[i].value);
+        }
+    }
+    // Bodies are kept whole: a replay has to send the same request. The front end does not
+    // stream bodies while recording, so only a request already streaming when it began has none
+    put_bytes(&rec->record, req->body, req->body_length);
+    put_signed(&rec->record, status);
+    end_record(rec);
+    pthread_mutex_unlock(&trace_lock);
+}
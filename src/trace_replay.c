@@ -0,0 +1,957 @@
+/**
+ * @file trace_replay.c
+ * @brief Loading traces and replaying them against simulated devices
+ *
+ * Every recorded device becomes a simulated device with the recorded
+ * endpoints. Each endpoint serves a queue of the transfers recorded on it,
+ * in submission order: a transfer reaching the endpoint is matched against
+ * the next queued one, compared with it (length, setup and OUT data) and
+ * completed with its recorded status and IN data. At the recorded pace it
+ * is first held for the time the device took in the recording, measured
+ * from when the endpoint had finished the previous transfer. Transfers that
+ * never completed, timed out or (in request replays) were cancelled are
+ * held until the engine aborts them, as in the recording.
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_buf.h"
+#include "usbx_sim.h"
+#include "usbx_trace.h"
+#include "usbx_util.h"
+
+/** @brief Endpoint slots per device: control, then OUT 1-15 and IN 1-15 at 16 + n */
+#define ENDPOINT_SLOTS 32
+
+/** @brief How often a held transfer is looked at again */
+#define HOLD_RETRY_US 1000000
+
+/** @brief Bytes read from a response stream at a time */
+#define STREAM_CHUNK 16384
+
+/** @brief Outcome of a recorded submission */
+enum outcome {
+    OUTCOME_PENDING,             // no completion before the recording stopped
+    OUTCOME_COMPLETED,
+    OUTCOME_FAILED               // usbx_submit_transfer() failed
+};
+
+struct recorded_transfer {
+    uint64_t submit_us;
+    uint64_t complete_us;
+    uint64_t completions_before; // completion records preceding the submission
+    int device;
+    unsigned char endpoint;
+    unsigned char type;
+    unsigned int flags;
+    unsigned int timeout;
+    int length;
+    const unsigned char *out;    // setup and OUT data
+    size_t out_length;
+    int outcome;
+    int status;
+    int actual_length;
+    const unsigned char *in;     // IN data
+    size_t in_length;
+};
+
+struct recorded_endpoint {
+    int present;
+    unsigned char type;
+    int max_packet_size;
+};
+
+struct recorded_device {
+    int handle_id;
+    struct recorded_endpoint endpoints[ENDPOINT_SLOTS];
+};
+
+struct recorded_request {
+    uint64_t start_us;
+    size_t sequence;             // file order, to keep the sort stable
+    char *method;
+    char *path;
+    struct usbx_http_pair *args;
+    int num_args;
+    struct usbx_http_pair *headers;
+    int num_headers;
+    const unsigned char *body;
+    size_t body_length;
+    int status;
+};
+
+struct usbx_trace {
+    unsigned char *data;         // file contents; payloads point into it
+    struct recorded_device *devices;
+    int num_devices;
+    struct recorded_transfer *transfers;
+    size_t num_transfers;
+    struct recorded_request *requests;
+    size_t num_requests;
+    uint64_t completions;
+    uint64_t payload_bytes;
+    uint64_t duration_us;
+};
+
+/** @brief Read position in a trace file */
+struct cursor {
+    const unsigned char *p;
+    const unsigned char *end;
+    int bad;                     // truncated or malformed
+    int no_mem;                  // an allocation failed
+};
+
+static uint64_t get_varint(struct cursor *c) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (c->p >= c->end) {
+            break;
+        }
+        unsigned char byte = *c->p++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    c->bad = 1;
+    return 0;
+}
+
+static int64_t get_signed(struct cursor *c) {
+    uint64_t value = get_varint(c);
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static const unsigned char *get_bytes(struct cursor *c, size_t *length) {
+    uint64_t size = get_varint(c);
+    if (c->bad || size > (uint64_t)(c->end - c->p)) {
+        c->bad = 1;
+        c->p = c->end;
+        *length = 0;
+        return NULL;
+    }
+    const unsigned char *data = c->p;
+    c->p += size;
+    *length = (size_t)size;
+    return data;
+}
+
+/* Copy of a length-prefixed string, or NULL on failure (sets c->bad) */
+static char *get_string(struct cursor *c) {
+    size_t length;
+    const unsigned char *data = get_bytes(c, &length);
+    if (c->bad) {
+        return NULL;
+    }
+    char *text = malloc(length + 1);
+    if (!text) {
+        c->no_mem = 1;
+        return NULL;
+    }
+    memcpy(text, data, length);
+    text[length] = '\0';
+    return text;
+}
+
+/* Make room for one more element; returns 0 on allocation failure */
+static int grow(void **array, size_t *capacity, size_t count, size_t size) {
+    if (count < *capacity) {
+        return 1;
+    }
+    size_t wanted = *capacity ? *capacity * 2 : 16;
+    void *bigger = realloc(*array, wanted * size);
+    if (!bigger) {
+        return 0;
+    }
+    *array = bigger;
+    *capacity = wanted;
+    return 1;
+}
+
+static int endpoint_slot(unsigned char endpoint, unsigned char type) {
+    if (type == USBX_TRANSFER_TYPE_CONTROL) {
+        return 0;
+    }
+    return (endpoint & 0x0f) + ((endpoint & USBX_ENDPOINT_IN) ? 16 : 0);
+}
+
+static void free_pairs(struct usbx_http_pair *pairs, int count) {
+    for (int i = 0; i < count; i++) {
+        free((char *)pairs[i].name);
+        free((char *)pairs[i].value);
+    }
+    free(pairs);
+}
+
+/* Read the name/value pairs of an 'H' record */
+static struct usbx_http_pair *get_pairs(struct cursor *c, int *count) {
+    uint64_t wanted = get_varint(c);
+    *count = 0;
+    // Every pair takes at least two bytes
+    if (c->bad || wanted > (uint64_t)(c->end - c->p) / 2) {
+        c->bad = 1;
+        return NULL;
+    }
+    struct usbx_http_pair *pairs = calloc(wanted ? (size_t)wanted : 1, sizeof(*pairs));
+    if (!pairs) {
+        c->no_mem = 1;
+        return NULL;
+    }
+    for (; !c->bad && !c->no_mem && (uint64_t)*count < wanted; (*count)++) {
+        pairs[*count].name = get_string(c);
+        pairs[*count].value = get_string(c);
+    }
+    return pairs;
+}
+
+static void free_request(struct recorded_request *request) {
+    free(request->method);
+    free(request->path);
+    free_pairs(request->args, request->num_args);
+    free_pairs(request->headers, request->num_headers);
+}
+
+static int parse_request(struct usbx_trace *trace, struct cursor *c, uint64_t at_us) {
+    struct recorded_request *request = &trace->requests[trace->num_requests];
+    memset(request, 0, sizeof(*request));
+    request->start_us = at_us;
+    request->sequence = trace->num_requests;
+    request->method = get_string(c);
+    request->path = get_string(c);
+    request->args = get_pairs(c, &request->num_args);
+    request->headers = get_pairs(c, &request->num_headers);
+    request->body = get_bytes(c, &request->body_length);
+    request->status = (int)get_signed(c);
+    if (c->bad || c->no_mem) {
+        free_request(request);
+        return 0;
+    }
+    trace->payload_bytes += request->body_length;
+    trace->num_requests++;
+    return 1;
+}
+
+/* Parse one record; returns 0 if it is malformed or memory ran out (c->no_mem) */
+static int parse_record(struct usbx_trace *trace, struct cursor *c, size_t *capacities) {
+    int kind = *c->p++;
+    uint64_t at_us = get_varint(c);
+    if (at_us > trace->duration_us) {
+        trace->duration_us = at_us;
+    }
+
+    switch (kind) {
+    case 'D': {
+        uint64_t index = get_varint(c);
+        int64_t handle_id = get_signed(c);
+        if (c->bad || index != (uint64_t)trace->num_devices) {
+            return 0;
+        }
+        size_t count = (size_t)trace->num_devices;
+        if (!grow((void **)&trace->devices, &capacities[0], count, sizeof(*trace->devices))) {
+            c->no_mem = 1;
+            return 0;
+        }
+        memset(&trace->devices[count], 0, sizeof(trace->devices[count]));
+        trace->devices[count].handle_id = (int)handle_id;
+        trace->num_devices++;
+        return 1;
+    }
+    case 'P': {
+        uint64_t device = get_varint(c);
+        uint64_t endpoint = get_varint(c);
+        uint64_t type = get_varint(c);
+        uint64_t max_packet_size = get_varint(c);
+        if (c->bad || device >= (uint64_t)trace->num_devices || endpoint > 0xff ||
+            type > USBX_TRANSFER_TYPE_INTERRUPT || type == USBX_TRANSFER_TYPE_CONTROL ||
+            max_packet_size == 0 || max_packet_size > 65535) {
+            return 0;
+        }
+        struct recorded_endpoint *ep =
+            &trace->devices[device].endpoints[endpoint_slot((unsigned char)endpoint,
+                                                            (unsigned char)type)];
+        ep->present = 1;
+        ep->type = (unsigned char)type;
+        ep->max_packet_size = (int)max_packet_size;
+        return 1;
+    }
+    case 'S': {
+        if (!grow((void **)&trace->transfers, &capacities[1], trace->num_transfers,
+                  sizeof(*trace->transfers))) {
+            c->no_mem = 1;
+            return 0;
+        }
+        struct recorded_transfer *xfer = &trace->transfers[trace->num_transfers];
+        memset(xfer, 0, sizeof(*xfer));
+        xfer->submit_us = at_us;
+        xfer->completions_before = trace->completions;
+        uint64_t device = get_varint(c);
+        uint64_t endpoint = get_varint(c);
+        uint64_t type = get_varint(c);
+        uint64_t flags = get_varint(c);
+        uint64_t timeout = get_varint(c);
+        uint64_t length = get_varint(c);
+        xfer->out = get_bytes(c, &xfer->out_length);
+        if (c->bad || device >= (uint64_t)trace->num_devices || endpoint > 0xff ||
+            type > USBX_TRANSFER_TYPE_INTERRUPT || type == USBX_TRANSFER_TYPE_ISOCHRONOUS ||
+            flags > 0xffffffffULL || timeout > 0xffffffffULL || length > 0x7fffffff ||
+            xfer->out_length > length) {
+            return 0;
+        }
+        if (type != USBX_TRANSFER_TYPE_CONTROL &&
+            !trace->devices[device].endpoints[endpoint_slot((unsigned char)endpoint,
+                                                            (unsigned char)type)].present) {
+            return 0;
+        }
+        xfer->device = (int)device;
+        xfer->endpoint = (unsigned char)endpoint;
+        xfer->type = (unsigned char)type;
+        xfer->flags = (unsigned int)flags;
+        xfer->timeout = (unsigned int)timeout;
+        xfer->length = (int)length;
+        xfer->outcome = OUTCOME_PENDING;
+        trace->payload_bytes += xfer->out_length;
+        trace->num_transfers++;
+        return 1;
+    }
+    case 'C':
+    case 'E': {
+        uint64_t submission = get_varint(c);
+        if (c->bad || submission >= trace->num_transfers ||
+            trace->transfers[submission].outcome != OUTCOME_PENDING) {
+            return 0;
+        }
+        struct recorded_transfer *xfer = &trace->transfers[submission];
+        if (kind == 'E') {
+            get_signed(c);
+            if (c->bad) {
+                return 0;
+            }
+            xfer->outcome = OUTCOME_FAILED;
+            return 1;
+        }
+        uint64_t status = get_varint(c);
+        uint64_t actual_length = get_varint(c);
+        xfer->in = get_bytes(c, &xfer->in_length);
+        if (c->bad || status > USBX_TRANSFER_OVERFLOW || actual_length > (uint64_t)xfer->length ||
+            xfer->in_length > actual_length) {
+            return 0;
+        }
+        xfer->outcome = OUTCOME_COMPLETED;
+        xfer->complete_us = at_us;
+        xfer->status = (int)status;
+        xfer->actual_length = (int)actual_length;
+        trace->payload_bytes += xfer->in_length;
+        trace->completions++;
+        return 1;
+    }
+    case 'H':
+        if (!grow((void **)&trace->requests, &capacities[2], trace->num_requests,
+                  sizeof(*trace->requests))) {
+            c->no_mem = 1;
+            return 0;
+        }
+        return parse_request(trace, c, at_us);
+    default:
+        return 0;
+    }
+}
+
+static int compare_requests(const void *a, const void *b) {
+    const struct recorded_request *x = a;
+    const struct recorded_request *y = b;
+    if (x->start_us != y->start_us) {
+        return x->start_us < y->start_us ? -1 : 1;
+    }
+    return (x->sequence > y->sequence) - (x->sequence < y->sequence);
+}
+
+/* Whole file in a malloc'd buffer */
+static unsigned char *read_file(const char *path, size_t *size, int *error) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        *error = USBX_ERROR_IO;
+        return NULL;
+    }
+    struct usbx_buf buf;
+    usbx_buf_init(&buf);
+    char chunk[65536];
+    size_t length;
+    while ((length = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        usbx_buf_append(&buf, chunk, length);
+    }
+    int failed = ferror(file);
+    fclose(file);
+    if (failed || buf.failed) {
+        usbx_buf_free(&buf);
+        *error = failed ? USBX_ERROR_IO : USBX_ERROR_NO_MEM;
+        return NULL;
+    }
+    unsigned char *data = (unsigned char *)usbx_buf_detach(&buf, size);
+    if (!data) {
+        *error = USBX_ERROR_INVALID_PARAM;   // empty file
+    }
+    return data;
+}
+
+struct usbx_trace *usbx_trace_load(const char *path, int *error) {
+    int dummy;
+    if (!error) {
+        error = &dummy;
+    }
+    size_t size;
+    unsigned char *data = read_file(path, &size, error);
+    if (!data) {
+        return NULL;
+    }
+    struct usbx_trace *trace = calloc(1, sizeof(*trace));
+    if (!trace) {
+        free(data);
+        *error = USBX_ERROR_NO_MEM;
+        return NULL;
+    }
+    trace->data = data;
+
+    struct cursor c = {data, data + size, 0, 0};
+    if (size < 8 || memcmp(data, "USBXTRC1", 8) != 0) {
+        usbx_trace_free(trace);
+        *error = USBX_ERROR_INVALID_PARAM;
+        return NULL;
+    }
+    c.p += 8;
+    if (get_varint(&c) != USBX_TRACE_VERSION || c.bad) {
+        usbx_trace_free(trace);
+        *error = USBX_ERROR_INVALID_PARAM;
+        return NULL;
+    }
+    size_t capacities[3] = {0, 0, 0};
+    while (c.p < c.end) {
+        if (!parse_record(trace, &c, capacities)) {
+            // A recording cut short by a crash still replays up to its last whole record
+            if (!c.no_mem && c.p >= c.end) {
+                break;
+            }
+            usbx_trace_free(trace);
+            *error = c.no_mem ? USBX_ERROR_NO_MEM : USBX_ERROR_INVALID_PARAM;
+            return NULL;
+        }
+    }
+    if (trace->num_requests > 0) {
+        qsort(trace->requests, trace->num_requests, sizeof(*trace->requests), compare_requests);
+    }
+    return trace;
+}
+
+void usbx_trace_free(struct usbx_trace *trace) {
+    if (!trace) {
+        return;
+    }
+    for (size_t i = 0; i < trace->num_requests; i++) {
+        free_request(&trace->requests[i]);
+    }
+    free(trace->requests);
+    free(trace->transfers);
+    free(trace->devices);
+    free(trace->data);
+    free(trace);
+}
+
+void usbx_trace_get_info(const struct usbx_trace *trace, struct usbx_trace_info *info) {
+    info->devices = trace->num_devices;
+    info->requests = trace->num_requests;
+    info->transfers = trace->num_transfers;
+    info->payload_bytes = trace->payload_bytes;
+    info->duration_us = trace->duration_us;
+}
+
+struct replay;
+
+/** @brief Recorded transfers of one endpoint, consumed in order */
+struct replay_queue {
+    struct replay *replay;
+    size_t first;                // offset into replay->order
+    size_t count;
+    size_t next;                 // entries before this one are all taken
+    struct usbx_transfer *active;  // transfer matched to entry @c active_entry
+    size_t active_entry;
+    uint64_t ready_at_us;
+};
+
+struct replay_device {
+    struct usbx_device *dev;
+    int handle_id;               // handle of a request replay, 0 otherwise
+    struct replay_queue queues[ENDPOINT_SLOTS];
+};
+
+/** @brief A resubmitted transfer of a transfer replay */
+struct replay_transfer {
+    struct usbx_transfer xfer;
+    struct replay *replay;
+    const struct recorded_transfer *recorded;
+    int done;
+};
+
+struct replay {
+    const struct usbx_trace *trace;
+    unsigned int flags;
+    int hold_cancelled;          // cancellations come from the replayed requests
+    struct replay_device *devices;
+    size_t *order;               // transfer indices grouped by queue
+    uint64_t *service_us;        // device time of each entry of @c order
+    unsigned char *taken;        // entry of @c order consumed
+    uint64_t transfers;          // updated atomically by the endpoint threads
+    uint64_t status_mismatches;
+    uint64_t data_mismatches;
+    pthread_mutex_t lock;        // transfer replay completion counters
+    pthread_cond_t cond;
+    uint64_t completed;
+    uint64_t completed_recorded; // completions of transfers recorded as completed
+};
+
+static const struct recorded_transfer *queue_entry(const struct replay_queue *queue,
+                                                   size_t entry) {
+    return &queue->replay->trace->transfers[queue->replay->order[queue->first + entry]];
+}
+
+static void take_entry(struct replay_queue *queue, size_t entry) {
+    queue->replay->taken[queue->first + entry] = 1;
+    while (queue->next < queue->count && queue->replay->taken[queue->first + queue->next]) {
+        queue->next++;
+    }
+}
+
+static int is_control_in(const struct usbx_transfer *xfer) {
+    return xfer->length >= USBX_CONTROL_SETUP_SIZE && (xfer->buffer[0] & USBX_ENDPOINT_IN);
+}
+
+/* Whether a transfer matches its recording: same length, setup and OUT data */
+static int same_request(const struct recorded_transfer *recorded,
+                        const struct usbx_transfer *xfer) {
+    return xfer->length == recorded->length &&
+           memcmp(xfer->buffer, recorded->out, recorded->out_length) == 0;
+}
+
+/* Recorded transfers the device must not complete by itself */
+static int held(const struct replay *replay, const struct recorded_transfer *recorded) {
+    if (recorded->outcome == OUTCOME_PENDING || recorded->status == USBX_TRANSFER_TIMED_OUT) {
+        return 1;
+    }
+    return replay->hold_cancelled && (recorded->status == USBX_TRANSFER_CANCELLED ||
+                                      recorded->status == USBX_TRANSFER_NO_DEVICE);
+}
+
+/* Complete a transfer with the recorded actual length and IN data */
+static int complete_as_recorded(const struct recorded_transfer *recorded,
+                                struct usbx_transfer *xfer) {
+    int control = xfer->type == USBX_TRANSFER_TYPE_CONTROL;
+    unsigned char *data = xfer->buffer + (control ? USBX_CONTROL_SETUP_SIZE : 0);
+    int room = xfer->length - (control ? USBX_CONTROL_SETUP_SIZE : 0);
+    int actual = recorded->actual_length < room ? recorded->actual_length : room;
+    if (actual < 0) {
+        actual = 0;
+    }
+    if (control ? is_control_in(xfer) : (xfer->endpoint & USBX_ENDPOINT_IN) != 0) {
+        size_t kept = recorded->in_length < (size_t)actual ? recorded->in_length : (size_t)actual;
+        if (kept > 0) {
+            memcpy(data, recorded->in, kept);    // recorded->in is NULL when nothing was kept
+        }
+        // Data beyond the recorded payload limit reads as zeros
+        memset(data + kept, 0, (size_t)actual - kept);
+    }
+    xfer->actual_length = actual;
+    return recorded->status;
+}
+
+static int replay_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                          uint64_t *retry_at_us) {
+    struct replay_queue *queue = cls;
+    struct replay *replay = queue->replay;
+
+    if (queue->active != xfer) {
+        __atomic_add_fetch(&replay->transfers, 1, __ATOMIC_RELAXED);
+        if (queue->next >= queue->count) {
+            __atomic_add_fetch(&replay->data_mismatches, 1, __ATOMIC_RELAXED);
+            xfer->actual_length = 0;
+            return USBX_TRANSFER_STALL;
+        }
+        queue->active = xfer;
+        queue->active_entry = queue->next;
+        if (!same_request(queue_entry(queue, queue->next), xfer)) {
+            __atomic_add_fetch(&replay->data_mismatches, 1, __ATOMIC_RELAXED);
+        }
+        queue->ready_at_us = now_us;
+        if (replay->flags & USBX_REPLAY_REALTIME) {
+            queue->ready_at_us += replay->service_us[queue->first + queue->next];
+        }
+    }
+
+    const struct recorded_transfer *recorded = queue_entry(queue, queue->active_entry);
+    if (held(replay, recorded)) {
+        *retry_at_us = now_us + HOLD_RETRY_US;
+        return USBX_SIM_RETRY;
+    }
+    if (now_us < queue->ready_at_us) {
+        *retry_at_us = queue->ready_at_us;
+        return USBX_SIM_RETRY;
+    }
+    take_entry(queue, queue->active_entry);
+    queue->active = NULL;
+    return complete_as_recorded(recorded, xfer);
+}
+
+static void replay_aborted(void *cls, struct usbx_transfer *xfer) {
+    struct replay_queue *queue = cls;
+    struct replay *replay = queue->replay;
+    size_t entry = queue->active_entry;
+
+    if (queue->active == xfer) {
+        queue->active = NULL;
+    } else {
+        // Aborted before reaching the device: pair it with the next recorded abort
+        __atomic_add_fetch(&replay->transfers, 1, __ATOMIC_RELAXED);
+        for (entry = queue->next; entry < queue->count; entry++) {
+            if (!replay->taken[queue->first + entry] && held(replay, queue_entry(queue, entry))) {
+                break;
+            }
+        }
+        if (entry == queue->count) {
+            __atomic_add_fetch(&replay->data_mismatches, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    const struct recorded_transfer *recorded = queue_entry(queue, entry);
+    take_entry(queue, entry);
+    if (recorded->outcome == OUTCOME_COMPLETED && recorded->status != xfer->status) {
+        __atomic_add_fetch(&replay->status_mismatches, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Group the recorded transfers by endpoint and work out their device times */
+static int build_queues(struct replay *replay) {
+    const struct usbx_trace *trace = replay->trace;
+    size_t total = trace->num_transfers ? trace->num_transfers : 1;
+    replay->devices = calloc(trace->num_devices ? (size_t)trace->num_devices : 1,
+                             sizeof(*replay->devices));
+    replay->order = malloc(total * sizeof(*replay->order));
+    replay->service_us = malloc(total * sizeof(*replay->service_us));
+    replay->taken = calloc(total, 1);
+    if (!replay->devices || !replay->order || !replay->service_us || !replay->taken) {
+        return USBX_ERROR_NO_MEM;
+    }
+
+    for (size_t i = 0; i < trace->num_transfers; i++) {
+        const struct recorded_transfer *xfer = &trace->transfers[i];
+        if (xfer->outcome != OUTCOME_FAILED) {
+            replay->devices[xfer->device].queues[endpoint_slot(xfer->endpoint, xfer->type)].count++;
+        }
+    }
+    size_t offset = 0;
+    for (int d = 0; d < trace->num_devices; d++) {
+        for (int slot = 0; slot < ENDPOINT_SLOTS; slot++) {
+            struct replay_queue *queue = &replay->devices[d].queues[slot];
+            queue->replay = replay;
+            queue->first = offset;
+            offset += queue->count;
+            queue->count = 0;
+        }
+    }
+
+    uint64_t (*finished_us)[ENDPOINT_SLOTS] =
+        calloc(trace->num_devices ? (size_t)trace->num_devices : 1, sizeof(*finished_us));
+    if (!finished_us) {
+        return USBX_ERROR_NO_MEM;
+    }
+    for (size_t i = 0; i < trace->num_transfers; i++) {
+        const struct recorded_transfer *xfer = &trace->transfers[i];
+        if (xfer->outcome == OUTCOME_FAILED) {
+            continue;
+        }
+        int slot = endpoint_slot(xfer->endpoint, xfer->type);
+        struct replay_queue *queue = &replay->devices[xfer->device].queues[slot];
+        size_t at = queue->first + queue->count++;
+        replay->order[at] = i;
+
+        // The device starts on a transfer once it has arrived and the previous one is done
+        uint64_t *finished = &finished_us[xfer->device][slot];
+        uint64_t start = xfer->submit_us > *finished ? xfer->submit_us : *finished;
+        replay->service_us[at] = 0;
+        if (xfer->outcome == OUTCOME_COMPLETED) {
+            replay->service_us[at] = xfer->complete_us > start ? xfer->complete_us - start : 0;
+            *finished = xfer->complete_us;
+        }
+    }
+    free(finished_us);
+    return USBX_SUCCESS;
+}
+
+static int create_devices(struct replay *replay) {
+    const struct usbx_trace *trace = replay->trace;
+    for (int d = 0; d < trace->num_devices; d++) {
+        struct replay_device *device = &replay->devices[d];
+        struct usbx_sim_endpoint_config endpoints[ENDPOINT_SLOTS];
+        struct usbx_sim_config config;
+        memset(&config, 0, sizeof(config));
+        memset(endpoints, 0, sizeof(endpoints));
+
+        for (int slot = 1; slot < ENDPOINT_SLOTS; slot++) {
+            const struct recorded_endpoint *recorded = &trace->devices[d].endpoints[slot];
+            if (!recorded->present) {
+                continue;
+            }
+            struct usbx_sim_endpoint_config *ep = &endpoints[config.num_endpoints++];
+            ep->address = (unsigned char)(slot < 16 ? slot : USBX_ENDPOINT_IN | (slot - 16));
+            ep->type = recorded->type;
+            ep->max_packet_size = recorded->max_packet_size;
+            ep->handler = replay_handler;
+            ep->handler_cls = &device->queues[slot];
+            ep->aborted = replay_aborted;
+        }
+        config.endpoints = endpoints;
+        config.control_handler = replay_handler;
+        config.control_cls = &device->queues[0];
+        config.control_aborted = replay_aborted;
+
+        device->dev = usbx_sim_device_create(&config);
+        if (!device->dev) {
+            return USBX_ERROR_NO_MEM;
+        }
+    }
+    return USBX_SUCCESS;
+}
+
+/* Sleep until a recorded offset at the recorded pace */
+static void wait_for_offset(const struct replay *replay, uint64_t start_us, uint64_t at_us) {
+    if (!(replay->flags & USBX_REPLAY_REALTIME)) {
+        return;
+    }
+    uint64_t now = usbx_now_us();
+    if (start_us + at_us > now) {
+        usbx_sleep_us(start_us + at_us - now);
+    }
+}
+
+/* Path of a request with its recorded handle id replaced by the replay's */
+static void rewrite_path(const struct replay *replay, const char *path, struct usbx_buf *out) {
+    static const char prefix[] = "/handles/";
+    char *end;
+    if (strncmp(path, prefix, sizeof(prefix) - 1) == 0) {
+        long handle_id = strtol(path + sizeof(prefix) - 1, &end, 10);
+        for (int d = 0; end != path + sizeof(prefix) - 1 && d < replay->trace->num_devices; d++) {
+            if (replay->trace->devices[d].handle_id == handle_id) {
+                usbx_buf_printf(out, "%s%d%s", prefix, replay->devices[d].handle_id, end);
+                return;
+            }
+        }
+    }
+    usbx_buf_append(out, path, strlen(path));
+}
+
+static int replay_requests(struct replay *replay, struct usbx_replay_result *result) {
+    const struct usbx_trace *trace = replay->trace;
+    struct usbx_http_router *router = usbx_http_router_create();
+    char *chunk = malloc(STREAM_CHUNK);
+    if (!router || !chunk || usbx_api_register_all(router) < 0) {
+        usbx_http_router_destroy(router);
+        free(chunk);
+        return USBX_ERROR_NO_MEM;
+    }
+
+    uint64_t start = usbx_now_us();
+    for (size_t i = 0; i < trace->num_requests; i++) {
+        const struct recorded_request *recorded = &trace->requests[i];
+        // Devices are opened by the replay itself
+        if (strcmp(recorded->method, "POST") == 0 && strcmp(recorded->path, "/handles") == 0) {
+            continue;
+        }
+        wait_for_offset(replay, start, recorded->start_us);
+
+        struct usbx_buf path;
+        usbx_buf_init(&path);
+        rewrite_path(replay, recorded->path, &path);
+        if (path.failed) {
+            usbx_buf_free(&path);
+            continue;
+        }
+        struct usbx_http_request req;
+        memset(&req, 0, sizeof(req));
+        req.method = recorded->method;
+        req.path = path.data;
+        req.client_id = "replay";
+        req.args = recorded->args;
+        req.num_args = recorded->num_args;
+        req.headers = recorded->headers;
+        req.num_headers = recorded->num_headers;
+        req.body = recorded->body_length ? recorded->body : NULL;
+        req.body_length = recorded->body_length;
+
+        struct usbx_http_response resp;
+        usbx_http_dispatch(router, &req, &resp);
+        result->requests++;
+        if (resp.status != recorded->status) {
+            result->status_mismatches++;
+        }
+        uint64_t position = 0;
+        while (resp.reader) {
+            ssize_t length = resp.reader(resp.reader_cls, position, chunk, STREAM_CHUNK);
+            if (length <= 0) {
+                break;
+            }
+            position += (uint64_t)length;
+        }
+        usbx_http_response_free(&resp);
+        usbx_buf_free(&path);
+    }
+    free(chunk);
+    usbx_http_router_destroy(router);
+    return USBX_SUCCESS;
+}
+
+static void replay_transfer_done(struct usbx_transfer *xfer) {
+    struct replay_transfer *transfer = xfer->user_data;
+    struct replay *replay = transfer->replay;
+
+    pthread_mutex_lock(&replay->lock);
+    transfer->done = 1;
+    replay->completed++;
+    if (transfer->recorded->outcome == OUTCOME_COMPLETED) {
+        replay->completed_recorded++;
+    }
+    pthread_cond_broadcast(&replay->cond);
+    pthread_mutex_unlock(&replay->lock);
+}
+
+static int replay_transfers(struct replay *replay) {
+    const struct usbx_trace *trace = replay->trace;
+    size_t count = trace->num_transfers;
+    struct replay_transfer *transfers = calloc(count ? count : 1, sizeof(*transfers));
+    if (!transfers) {
+        return USBX_ERROR_NO_MEM;
+    }
+
+    uint64_t start = usbx_now_us();
+    uint64_t submitted = 0;
+    uint64_t expected = 0;       // transfers recorded as completed, to wait for
+    int result = USBX_SUCCESS;
+    for (size_t i = 0; i < count && result == USBX_SUCCESS; i++) {
+        const struct recorded_transfer *recorded = &trace->transfers[i];
+        if (recorded->outcome == OUTCOME_FAILED) {
+            continue;
+        }
+        // Submit once the completions that preceded it in the recording happened
+        pthread_mutex_lock(&replay->lock);
+        while (replay->completed < recorded->completions_before) {
+            pthread_cond_wait(&replay->cond, &replay->lock);
+        }
+        pthread_mutex_unlock(&replay->lock);
+        wait_for_offset(replay, start, recorded->submit_us);
+
+        struct replay_transfer *transfer = &transfers[i];
+        transfer->replay = replay;
+        transfer->recorded = recorded;
+        struct usbx_transfer *xfer = &transfer->xfer;
+        xfer->buffer = calloc(recorded->length ? (size_t)recorded->length : 1, 1);
+        if (!xfer->buffer) {
+            result = USBX_ERROR_NO_MEM;
+            break;
+        }
+        if (recorded->out_length > 0) {
+            memcpy(xfer->buffer, recorded->out, recorded->out_length);
+        }
+        xfer->dev = replay->devices[recorded->device].dev;
+        xfer->endpoint = recorded->endpoint;
+        xfer->type = recorded->type;
+        xfer->flags = recorded->flags;
+        xfer->timeout = recorded->timeout;
+        xfer->length = recorded->length;
+        xfer->callback = replay_transfer_done;
+        xfer->user_data = transfer;
+        result = usbx_submit_transfer(xfer);
+        if (result == USBX_SUCCESS) {
+            submitted++;
+            expected += recorded->outcome == OUTCOME_COMPLETED;
+        }
+    }
+
+    // Wait for what completed in the recording, then abort what never did
+    pthread_mutex_lock(&replay->lock);
+    while (replay->completed_recorded < expected) {
+        pthread_cond_wait(&replay->cond, &replay->lock);
+    }
+    pthread_mutex_unlock(&replay->lock);
+    for (size_t i = 0; i < count; i++) {
+        if (transfers[i].replay && transfers[i].recorded->outcome == OUTCOME_PENDING) {
+            usbx_cancel_transfer(&transfers[i].xfer);
+        }
+    }
+    pthread_mutex_lock(&replay->lock);
+    while (replay->completed < submitted) {
+        pthread_cond_wait(&replay->cond, &replay->lock);
+    }
+    pthread_mutex_unlock(&replay->lock);
+
+    for (size_t i = 0; i < count; i++) {
+        free(transfers[i].xfer.buffer);
+    }
+    free(transfers);
+    return result;
+}
+
+int usbx_trace_replay(const struct usbx_trace *trace, unsigned int flags,
+                      struct usbx_replay_result *result) {
+    struct replay replay;
+    memset(&replay, 0, sizeof(replay));
+    memset(result, 0, sizeof(*result));
+    replay.trace = trace;
+    replay.flags = flags;
+    replay.hold_cancelled = trace->num_requests > 0;
+    pthread_mutex_init(&replay.lock, NULL);
+    pthread_cond_init(&replay.cond, NULL);
+
+    uint64_t start = usbx_now_us();
+    int error = build_queues(&replay);
+    if (error == USBX_SUCCESS) {
+        error = create_devices(&replay);
+    }
+    if (error == USBX_SUCCESS && trace->num_requests > 0) {
+        for (int d = 0; d < trace->num_devices; d++) {
+            int handle_id = usbx_handle_add(replay.devices[d].dev, NULL);
+            if (handle_id < 0) {
+                error = handle_id;
+                break;
+            }
+            replay.devices[d].handle_id = handle_id;
+        }
+        if (error == USBX_SUCCESS) {
+            error = replay_requests(&replay, result);
+        }
+    } else if (error == USBX_SUCCESS) {
+        error = replay_transfers(&replay);
+    }
+
+    // Handles own their devices; the rest are destroyed here
+    for (int d = 0; replay.devices && d < trace->num_devices; d++) {
+        if (replay.devices[d].handle_id > 0) {
+            usbx_handle_remove(replay.devices[d].handle_id);
+        } else if (replay.devices[d].dev) {
+            usbx_device_destroy(replay.devices[d].dev);
+        }
+    }
+    result->elapsed_us = usbx_now_us() - start;
+    result->recorded_us = trace->duration_us;
+    result->transfers = replay.transfers;
+    result->status_mismatches += replay.status_mismatches;
+    result->data_mismatches = replay.data_mismatches;
+
+    pthread_cond_destroy(&replay.cond);
+    pthread_mutex_destroy(&replay.lock);
+    free(replay.taken);
+    free(replay.service_us);
+    free(replay.order);
+    free(replay.devices);
+    return error;
+}
@@ -0,0 +1,150 @@
+/**
+ * @file usbx.c
+ * @brief Library lifecycle and in-process requests (see usbx.h)
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#include <pthread.h>
+#include <string.h>
+#ifdef USE_DEPS
+#include <sys/time.h>
+#endif
+
+#include "usbx.h"
+#include "usbx_api.h"
+#include "usbx_config.h"
+#include "usbx_discovery.h"
+
+#define STRINGIFY(x) #x
+#define VERSION_STRING(major, minor, patch) \
+    STRINGIFY(major) "." STRINGIFY(minor) "." STRINGIFY(patch)
+
+static pthread_mutex_t lifecycle_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct usbx_http_router *router = NULL;
+
+#ifdef USE_DEPS
+static libusb_context *usb_context = NULL;
+static pthread_t events;
+
+/** @brief Cleared to stop the libusb event thread */
+static int events_running = 0;
+
+/* Drive libusb event handling so asynchronous transfers complete */
+static void *event_thread(void *arg) {
+    (void)arg;
+    while (__atomic_load_n(&events_running, __ATOMIC_ACQUIRE)) {
+        struct timeval tv = {0, 100000};
+        libusb_handle_events_timeout_completed(usb_context, &tv, NULL);
+    }
+    return NULL;
+}
+
+/* Open libusb, start its event thread and catalog its devices (lifecycle lock held) */
+static int start_usb(void) {
+    if (libusb_init(&usb_context) < 0) {
+        usb_context = NULL;
+        return USBX_ERROR_IO;
+    }
+    __atomic_store_n(&events_running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&events, NULL, event_thread, NULL) != 0) {
+        __atomic_store_n(&events_running, 0, __ATOMIC_RELEASE);
+        libusb_exit(usb_context);
+        usb_context = NULL;
+        return USBX_ERROR_NO_MEM;
+    }
+    usbx_api_set_libusb_context(usb_context);
+
+    // Serial numbers are read in the background; lookups fall back to a scan
+    struct usbx_discovery_source source;
+    usbx_discovery_libusb_source(&source, usb_context);
+    usbx_discovery_start(&source, usbx_config_current()->discovery_workers);
+    return USBX_SUCCESS;
+}
+
+/* Stop the event thread and close libusb, after every handle is closed */
+static void stop_usb(void) {
+    if (!usb_context) {
+        return;
+    }
+    usbx_discovery_stop();
+    __atomic_store_n(&events_running, 0, __ATOMIC_RELEASE);
+    pthread_join(events, NULL);
+    usbx_api_set_libusb_context(NULL);
+    libusb_exit(usb_context);
+    usb_context = NULL;
+}
+#endif
+
+const char *usbx_version(void) {
+    return VERSION_STRING(USBX_VERSION_MAJOR, USBX_VERSION_MINOR, USBX_VERSION_PATCH);
+}
+
+int usbx_init(unsigned int flags) {
+    pthread_mutex_lock(&lifecycle_lock);
+    if (router) {
+        pthread_mutex_unlock(&lifecycle_lock);
+        return USBX_ERROR_BUSY;
+    }
+    router = usbx_http_router_create();
+    if (!router || usbx_api_register_all(router) < 0) {
+        usbx_http_router_destroy(router);
+        router = NULL;
+        pthread_mutex_unlock(&lifecycle_lock);
+        return USBX_ERROR_NO_MEM;
+    }
+#ifdef USE_DEPS
+    if (!(flags & USBX_INIT_NO_USB)) {
+        int result = start_usb();
+        if (result != USBX_SUCCESS) {
+            usbx_http_router_destroy(router);
+            router = NULL;
+            pthread_mutex_unlock(&lifecycle_lock);
+            return result;
+        }
+    }
+#else
+    (void)flags;
+#endif
+    pthread_mutex_unlock(&lifecycle_lock);
+    return USBX_SUCCESS;
+}
+
+void usbx_shutdown(void) {
+    pthread_mutex_lock(&lifecycle_lock);
+    if (!router) {
+        pthread_mutex_unlock(&lifecycle_lock);
+        return;
+    }
+    // Close devices while the event thread still completes cancellations
+    usbx_handle_remove_all();
+#ifdef USE_DEPS
+    stop_usb();
+#endif
+    usbx_http_router_destroy(router);
+    router = NULL;
+    pthread_mutex_unlock(&lifecycle_lock);
+}
+
+struct usbx_http_router *usbx_router(void) {
+    return router;
+}
+
+int usbx_request(const char *method, const char *path, const struct usbx_http_pair *args,
+                 int num_args, const void *body, size_t body_length,
+                 struct usbx_http_response *resp) {
+    struct usbx_http_request req;
+
+    if (!router || !method || !path || num_args < 0 || (num_args > 0 && !args)) {
+        return USBX_ERROR_INVALID_PARAM;
+    }
+    memset(&req, 0, sizeof(req));
+    req.method = method;
+    req.path = path;
+    req.args = args;
+    req.num_args = num_args;
+    req.body = body;
+    req.body_length = body ? body_length : 0;
+    usbx_http_dispatch(router, &req, resp);
+    return USBX_SUCCESS;
+}
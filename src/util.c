@@ -0,0 +1,47 @@
+/**
+ * @file util.c
+ * @brief Small shared helpers (monotonic time, sleeping, waiting) for usbX modules
+ *
+ * @copyright GNU General Public License v3.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <time.h>
+
+#include "usbx_util.h"
+
+uint64_t usbx_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+void usbx_sleep_us(uint64_t usec) {
+    struct timespec req;
+    req.tv_sec = (time_t)(usec / 1000000ULL);
+    req.tv_nsec = (long)(usec % 1000000ULL) * 1000L;
+
+    // Restart after signals so callers always get at least the requested delay
+    while (nanosleep(&req, &req) < 0 && errno == EINTR) {
+    }
+}
+
+void usbx_cond_init_monotonic(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+void usbx_deadline_ms(struct timespec *ts, int timeout_ms) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += timeout_ms / 1000;
+    ts->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
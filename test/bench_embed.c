@@ -0,0 +1,209 @@
+/*
+ * Benchmark: in-process calls into libusbx versus loopback HTTP
+ *
+ * A 64-byte bulk IN read from a simulated device is made three ways: as a
+ * direct synchronous transfer, as a one-operation batch through
+ * usbx_request(), and as the same batch over a keep-alive HTTP connection
+ * to the library's router on 127.0.0.1. The difference between the rows
+ * is the cost of the REST layer and of the HTTP round trip; the loopback
+ * row needs a build with libmicrohttpd.
+ *
+ * Usage: bench_embed [calls] [port]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef USE_DEPS
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "usbx.h"
+#include "usbx_sim.h"
+#include "usbx_util.h"
+
+#define EP_IN 0x81
+#define BATCH "{\"operations\": [{\"op\": \"bulk\", \"endpoint\": 129, \"length\": 64}]}"
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *label, uint64_t *latencies, int calls, int failed) {
+    uint64_t total = 0;
+    for (int i = 0; i < calls; i++) {
+        total += latencies[i];
+    }
+    qsort(latencies, (size_t)calls, sizeof(*latencies), compare_u64);
+    printf("%-18s %10.2f %8llu %8llu %8llu %8d\n", label, (double)total / calls,
+           (unsigned long long)latencies[calls / 2],
+           (unsigned long long)latencies[(size_t)calls * 99 / 100],
+           (unsigned long long)latencies[calls - 1], failed);
+}
+
+static void run_direct(struct usbx_device *dev, uint64_t *latencies, int calls) {
+    unsigned char data[64];
+    int failed = 0;
+    for (int i = 0; i < calls; i++) {
+        int transferred = 0;
+        uint64_t start = usbx_now_us();
+        if (usbx_bulk_transfer(dev, EP_IN, data, sizeof(data), &transferred, 1000) !=
+            USBX_SUCCESS) {
+            failed++;
+        }
+        latencies[i] = usbx_now_us() - start;
+    }
+    report("direct transfer", latencies, calls, failed);
+}
+
+static void run_in_process(const char *path, uint64_t *latencies, int calls) {
+    int failed = 0;
+    for (int i = 0; i < calls; i++) {
+        struct usbx_http_response resp;
+        uint64_t start = usbx_now_us();
+        if (usbx_request("POST", path, NULL, 0, BATCH, strlen(BATCH), &resp) != USBX_SUCCESS ||
+            resp.status != 200) {
+            failed++;
+        }
+        usbx_http_response_free(&resp);
+        latencies[i] = usbx_now_us() - start;
+    }
+    report("usbx_request()", latencies, calls, failed);
+}
+
+#ifdef USE_DEPS
+/* Send one request and read its response; -1 on a connection error or non-200 status */
+static int http_call(int fd, const char *request, size_t length) {
+    char buf[4096];
+    size_t have = 0;
+
+    if (send(fd, request, length, 0) != (ssize_t)length) {
+        return -1;
+    }
+    for (;;) {
+        ssize_t got = recv(fd, buf + have, sizeof(buf) - 1 - have, 0);
+        if (got <= 0) {
+            return -1;
+        }
+        have += (size_t)got;
+        buf[have] = '\0';
+        char *end = strstr(buf, "\r\n\r\n");
+        char *field = strstr(buf, "Content-Length:");
+        if (!field) {
+            field = strstr(buf, "content-length:");
+        }
+        if (end && field && field < end) {
+            size_t body = strtoul(field + 15, NULL, 10);
+            size_t total = (size_t)(end + 4 - buf) + body;
+            while (have < total) {
+                if (total > sizeof(buf) - 1) {
+                    return -1;
+                }
+                got = recv(fd, buf + have, total - have, 0);
+                if (got <= 0) {
+                    return -1;
+                }
+                have += (size_t)got;
+            }
+            return strncmp(buf, "HTTP/1.1 200", 12) == 0 ? 0 : -1;
+        }
+        if (have == sizeof(buf) - 1) {
+            return -1;
+        }
+    }
+}
+
+static void run_loopback(const char *path, uint16_t port, uint64_t *latencies, int calls) {
+    char request[512];
+    int length = snprintf(request, sizeof(request),
+                          "POST %s HTTP/1.1\r\nHost: 127.0.0.1\r\n"
+                          "Content-Type: application/json\r\nContent-Length: %zu\r\n\r\n%s",
+                          path, strlen(BATCH), BATCH);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (usbx_http_server_start(usbx_router(), port) < 0) {
+        printf("%-18s cannot listen on port %u\n", "loopback HTTP", port);
+        return;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        printf("%-18s cannot connect to port %u\n", "loopback HTTP", port);
+    } else {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        int failed = 0;
+        for (int i = 0; i < calls; i++) {
+            uint64_t start = usbx_now_us();
+            if (http_call(fd, request, (size_t)length) < 0) {
+                failed++;
+            }
+            latencies[i] = usbx_now_us() - start;
+        }
+        report("loopback HTTP", latencies, calls, failed);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    usbx_http_server_stop();
+}
+#endif
+
+int main(int argc, char **argv) {
+    int calls = argc > 1 ? atoi(argv[1]) : 20000;
+    long port = argc > 2 ? atol(argv[2]) : 18093;
+    if (calls < 1 || port < 1 || port > 65535) {
+        fprintf(stderr, "Usage: %s [calls] [port]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct usbx_sim_endpoint_config endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.address = EP_IN;
+    endpoint.type = USBX_TRANSFER_TYPE_BULK;
+    endpoint.max_packet_size = 512;
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = &endpoint;
+    config.num_endpoints = 1;
+    uint64_t *latencies = malloc((size_t)calls * sizeof(*latencies));
+    if (!latencies || usbx_init(USBX_INIT_NO_USB) != USBX_SUCCESS) {
+        fprintf(stderr, "Error: benchmark setup failed\n");
+        return EXIT_FAILURE;
+    }
+    int id = usbx_handle_add(usbx_sim_device_create(&config), NULL);
+    struct usbx_handle *handle = usbx_handle_get(id);
+    if (!handle) {
+        fprintf(stderr, "Error: benchmark setup failed\n");
+        return EXIT_FAILURE;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/handles/%d/batch", id);
+
+    printf("=== libusbx %s: in-process versus HTTP (%d calls, 64-byte bulk IN, us) ===\n",
+           usbx_version(), calls);
+    printf("%-18s %10s %8s %8s %8s %8s\n", "path", "mean", "p50", "p99", "max", "failed");
+    run_direct(handle->dev, latencies, calls);
+    usbx_handle_put(handle);
+    run_in_process(path, latencies, calls);
+#ifdef USE_DEPS
+    run_loopback(path, (uint16_t)port, latencies, calls);
+#else
+    printf("%-18s skipped: built without libmicrohttpd\n", "loopback HTTP");
+#endif
+
+    free(latencies);
+    usbx_shutdown();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+/*
+ * Benchmark: transfer latency percentiles under injected faults
+ *
+ * Synchronous bulk IN transfers on a simulated device run first without
+ * rules, then with latency, jitter and a 1% tail, then with 1% injected
+ * stalls, and report p50/p99/p99.9/max latency per transfer. A final run
+ * unplugs the device and measures how long the first successful transfer
+ * takes after the rules are cleared. Needs a FAULT_INJECTION=1 build.
+ *
+ * Usage: bench_faults [transfers]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_fault.h"
+#include "usbx_sim.h"
+#include "usbx_util.h"
+
+#define EP_IN 0x81
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static struct usbx_device *create_device(void) {
+    struct usbx_sim_endpoint_config endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.address = EP_IN;
+    endpoint.type = USBX_TRANSFER_TYPE_BULK;
+    endpoint.max_packet_size = 512;
+    endpoint.overhead_us = 20;
+
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = &endpoint;
+    config.num_endpoints = 1;
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    if (!dev) {
+        fprintf(stderr, "Error: benchmark setup failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return dev;
+}
+
+static void run(const char *label, const struct usbx_fault_rule *rule, int transfers) {
+    struct usbx_device *dev = create_device();
+    uint64_t *latencies = malloc((size_t)transfers * sizeof(*latencies));
+    if (!latencies || (rule && usbx_fault_set_rule(dev, rule) != USBX_SUCCESS)) {
+        fprintf(stderr, "Error: benchmark setup failed\n");
+        exit(EXIT_FAILURE);
+    }
+    usbx_fault_seed(1);
+
+    unsigned char data[512];
+    int failed = 0;
+    for (int i = 0; i < transfers; i++) {
+        int transferred = 0;
+        uint64_t start = usbx_now_us();
+        if (usbx_bulk_transfer(dev, EP_IN, data, sizeof(data), &transferred, 1000) !=
+            USBX_SUCCESS) {
+            failed++;
+        }
+        latencies[i] = usbx_now_us() - start;
+    }
+    qsort(latencies, (size_t)transfers, sizeof(*latencies), compare_u64);
+    printf("%-22s %8llu %8llu %8llu %8llu %8d\n", label,
+           (unsigned long long)latencies[transfers / 2],
+           (unsigned long long)latencies[(size_t)transfers * 99 / 100],
+           (unsigned long long)latencies[(size_t)transfers * 999 / 1000],
+           (unsigned long long)latencies[transfers - 1], failed);
+    free(latencies);
+    usbx_device_destroy(dev);
+}
+
+static void run_recovery(void) {
+    struct usbx_device *dev = create_device();
+    unsigned char data[512];
+    int transferred = 0;
+
+    usbx_fault_disconnect(dev);
+    int rejected = usbx_bulk_transfer(dev, EP_IN, data, sizeof(data), &transferred, 1000);
+    uint64_t start = usbx_now_us();
+    usbx_fault_clear(dev);
+    int result = usbx_bulk_transfer(dev, EP_IN, data, sizeof(data), &transferred, 1000);
+    uint64_t elapsed = usbx_now_us() - start;
+    printf("\nUnplugged: %s; first transfer after clearing: %s in %llu us\n",
+           usbx_error_name(rejected), usbx_error_name(result), (unsigned long long)elapsed);
+    usbx_device_destroy(dev);
+}
+
+int main(int argc, char **argv) {
+    int transfers = argc > 1 ? atoi(argv[1]) : 5000;
+    if (transfers < 1) {
+        fprintf(stderr, "Usage: %s [transfers]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("=== Fault injection benchmark (%d transfers, latency in us) ===\n", transfers);
+    struct usbx_fault_rule rule;
+    usbx_fault_rule_init(&rule, EP_IN);
+    if (usbx_fault_set_rule(NULL, &rule) == USBX_ERROR_NOT_SUPPORTED) {
+        printf("Fault injection not compiled in; build with FAULT_INJECTION=1\n");
+        return EXIT_SUCCESS;
+    }
+
+    printf("%-22s %8s %8s %8s %8s %8s\n", "rule", "p50", "p99", "p99.9", "max", "failed");
+    run("none", NULL, transfers);
+    rule.latency_us = 100;
+    rule.jitter_us = 100;
+    rule.tail_ppm = 10000;
+    rule.tail_us = 5000;
+    run("100+100us, 1% +5ms", &rule, transfers);
+    usbx_fault_rule_init(&rule, EP_IN);
+    rule.error_ppm = 10000;
+    run("1% stalls", &rule, transfers);
+    run_recovery();
+    return EXIT_SUCCESS;
+}
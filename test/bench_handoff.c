@@ -0,0 +1,265 @@
+/*
+ * Benchmark: connection failures and service gap across a restart
+ *
+ * A client thread opens one short TCP connection after another to a small
+ * responder on 127.0.0.1 while the responder is replaced by a second
+ * process, two ways: by passing the listening socket with usbx_handoff.h,
+ * and by closing it and letting the successor bind the port again. For
+ * each it reports the connections made, those refused or reset, and the
+ * longest gap between two successful ones. With the handoff both processes
+ * accept from the same socket while they overlap, so nothing is refused.
+ *
+ * Usage: bench_handoff [duration_ms]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "usbx_backend.h"
+#include "usbx_handoff.h"
+#include "usbx_util.h"
+
+#define REPLY "pong\n"
+
+struct load {
+    uint16_t port;
+    volatile int stop;
+    unsigned long made;
+    unsigned long failed;
+    uint64_t max_gap_us;
+};
+
+struct responder {
+    int fd;
+    volatile int stop;
+};
+
+static void sleep_ms(int ms) {
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+static int listen_on(uint16_t port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    int on = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+static uint16_t bound_port(int fd) {
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+    getsockname(fd, (struct sockaddr *)&addr, &length);
+    return ntohs(addr.sin_port);
+}
+
+/* Answer every connection on fd until stopped or for duration_ms if positive */
+static void serve(int fd, volatile int *stop, int duration_ms) {
+    uint64_t end = usbx_now_us() + (uint64_t)duration_ms * 1000;
+    char buf[64];
+
+    while (!*stop && (duration_ms <= 0 || usbx_now_us() < end)) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, 10) <= 0) {
+            continue;
+        }
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            continue;
+        }
+        if (read(conn, buf, sizeof(buf)) > 0) {
+            send(conn, REPLY, sizeof(REPLY) - 1, MSG_NOSIGNAL);
+        }
+        close(conn);
+    }
+}
+
+static void *responder_thread(void *arg) {
+    struct responder *responder = arg;
+    serve(responder->fd, &responder->stop, 0);
+    return NULL;
+}
+
+static int exchange(uint16_t port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    char buf[sizeof(REPLY)];
+    size_t got = 0;
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        send(fd, "ping\n", 5, MSG_NOSIGNAL) != 5) {
+        close(fd);
+        return -1;
+    }
+    while (got < sizeof(REPLY) - 1) {
+        ssize_t n = read(fd, buf + got, sizeof(REPLY) - 1 - got);
+        if (n <= 0) {
+            break;
+        }
+        got += (size_t)n;
+    }
+    close(fd);
+    return got == sizeof(REPLY) - 1 ? 0 : -1;
+}
+
+static void *load_thread(void *arg) {
+    struct load *load = arg;
+    uint64_t last = usbx_now_us();
+
+    while (!load->stop) {
+        int result = exchange(load->port);
+        uint64_t now = usbx_now_us();
+        if (result == 0) {
+            load->made++;
+            if (now - last > load->max_gap_us) {
+                load->max_gap_us = now - last;
+            }
+            last = now;
+        } else {
+            load->failed++;
+        }
+    }
+    return NULL;
+}
+
+static void report(const char *label, const struct load *load) {
+    printf("%-20s %10lu %8lu %12.2f\n", label, load->made, load->failed,
+           (double)load->max_gap_us / 1000.0);
+}
+
+/* Replace the responder by passing its listening socket */
+static int run_handoff(int duration_ms) {
+    char path[108];
+    struct usbx_handoff handoff;
+    struct responder responder = {.fd = listen_on(0)};
+    struct load load = {0};
+    pthread_t serving, client;
+
+    snprintf(path, sizeof(path), "/tmp/usbx-bench-handoff.%ld.sock", (long)getpid());
+    if (responder.fd < 0 || usbx_handoff_listen(&handoff, path) != USBX_SUCCESS) {
+        return -1;
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        int fd, conn;
+        volatile int never = 0;
+        if (usbx_handoff_receive(path, &fd, 1, 5000, &conn) != 1) {
+            _exit(1);
+        }
+        usbx_handoff_ready(conn);
+        serve(fd, &never, duration_ms);
+        _exit(0);
+    }
+    load.port = bound_port(responder.fd);
+    pthread_create(&serving, NULL, responder_thread, &responder);
+    pthread_create(&client, NULL, load_thread, &load);
+
+    sleep_ms(duration_ms / 3);
+    int result = usbx_handoff_send(&handoff, &responder.fd, 1, 5000);
+    usbx_handoff_close(&handoff);
+    responder.stop = 1;             // the successor serves; stop accepting
+    pthread_join(serving, NULL);
+    close(responder.fd);
+    sleep_ms(duration_ms / 3);
+
+    load.stop = 1;
+    pthread_join(client, NULL);
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+    if (result != USBX_SUCCESS) {
+        return -1;
+    }
+    report("socket handoff", &load);
+    return 0;
+}
+
+/* Replace the responder by closing its socket and binding the port again */
+static int run_rebind(int duration_ms) {
+    struct responder responder = {.fd = listen_on(0)};
+    struct load load = {0};
+    pthread_t serving, client;
+    int go[2];
+
+    if (responder.fd < 0 || pipe(go) < 0) {
+        return -1;
+    }
+    load.port = bound_port(responder.fd);
+    pid_t child = fork();
+    if (child == 0) {
+        char byte;
+        volatile int never = 0;
+        close(responder.fd);
+        if (read(go[0], &byte, 1) != 1) {
+            _exit(1);
+        }
+        int fd = listen_on(load.port);
+        if (fd < 0) {
+            _exit(1);
+        }
+        serve(fd, &never, duration_ms);
+        _exit(0);
+    }
+    pthread_create(&serving, NULL, responder_thread, &responder);
+    pthread_create(&client, NULL, load_thread, &load);
+
+    sleep_ms(duration_ms / 3);
+    responder.stop = 1;
+    pthread_join(serving, NULL);
+    close(responder.fd);            // queued connections are reset here
+    ssize_t signalled = write(go[1], "g", 1);
+    sleep_ms(duration_ms / 3);
+
+    load.stop = 1;
+    pthread_join(client, NULL);
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+    close(go[0]);
+    close(go[1]);
+    if (signalled != 1) {
+        return -1;
+    }
+    report("close and rebind", &load);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int duration_ms = argc > 1 ? atoi(argv[1]) : 1500;
+
+    if (argc > 2 || duration_ms < 30) {
+        fprintf(stderr, "Usage: %s [duration_ms]\n", argv[0]);
+        return 1;
+    }
+    printf("=== Restart under load (%d ms, one connection at a time) ===\n", duration_ms);
+    printf("%-20s %10s %8s %12s\n", "restart", "requests", "failed", "max gap ms");
+    if (run_handoff(duration_ms) < 0 || run_rebind(duration_ms) < 0) {
+        fprintf(stderr, "Error: benchmark setup failed\n");
+        return 1;
+    }
+    return 0;
+}
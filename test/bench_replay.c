@@ -0,0 +1,134 @@
+/*
+ * Benchmark: replaying a recorded session as a repeatable workload
+ *
+ * Without arguments a synthetic session is recorded first: bulk uploads
+ * through the REST API to a simulated device with a USB 2.0 high-speed like
+ * timing model (40 MB/s, 250 us turnaround, 20 us per-transfer overhead).
+ * The trace is then replayed flat out and at the recorded pace, and the
+ * request rate and mismatch counts are reported. Given a trace file (for
+ * example one recorded with USBX_TRACE_FILE), that trace is replayed
+ * instead, flat out or with --realtime at the recorded pace.
+ *
+ * Usage: bench_replay [trace_file] [--realtime]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_sim.h"
+#include "usbx_trace.h"
+#include "usbx_util.h"
+
+#define SYNTHETIC_TRACE "/tmp/usbx_bench_replay.trace"
+#define UPLOADS 64
+#define UPLOAD_SIZE (256 * 1024)
+
+static void record_session(const char *path) {
+    struct usbx_sim_endpoint_config endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.address = 0x02;
+    endpoint.type = USBX_TRANSFER_TYPE_BULK;
+    endpoint.max_packet_size = 512;
+    endpoint.latency_us = 250;
+    endpoint.overhead_us = 20;
+    endpoint.bytes_per_sec = 40ULL * 1000 * 1000;
+
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = &endpoint;
+    config.num_endpoints = 1;
+
+    struct usbx_http_router *router = usbx_http_router_create();
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    unsigned char *body = malloc(UPLOAD_SIZE);
+    if (!router || usbx_api_register_all(router) < 0 || !dev || !body ||
+        usbx_trace_start(path, 0) != USBX_SUCCESS) {
+        fprintf(stderr, "Error: benchmark setup failed\n");
+        exit(EXIT_FAILURE);
+    }
+    int handle_id = usbx_handle_add(dev, NULL);
+    char upload_path[64];
+    snprintf(upload_path, sizeof(upload_path), "/handles/%d/bulk/0x02", handle_id);
+
+    for (int i = 0; i < UPLOADS; i++) {
+        usbx_sim_fill_pattern(body, UPLOAD_SIZE, (uint64_t)i * UPLOAD_SIZE);
+        struct usbx_http_request req;
+        memset(&req, 0, sizeof(req));
+        req.method = i % 8 == 7 ? "GET" : "PUT";
+        req.path = i % 8 == 7 ? "/handles" : upload_path;
+        req.body = i % 8 == 7 ? NULL : body;
+        req.body_length = i % 8 == 7 ? 0 : UPLOAD_SIZE;
+        struct usbx_http_response resp;
+        usbx_http_dispatch(router, &req, &resp);
+        usbx_http_response_free(&resp);
+        // Idle time between requests, as a client would leave
+        usbx_sleep_us(1000);
+    }
+    usbx_handle_remove(handle_id);
+    if (usbx_trace_stop() != USBX_SUCCESS) {
+        fprintf(stderr, "Error: recording failed\n");
+        exit(EXIT_FAILURE);
+    }
+    usbx_http_router_destroy(router);
+    free(body);
+}
+
+static void run_replay(const struct usbx_trace *trace, unsigned int flags) {
+    struct usbx_replay_result result;
+    int rc = usbx_trace_replay(trace, flags, &result);
+    if (rc != USBX_SUCCESS) {
+        fprintf(stderr, "Error: replay failed: %s\n", usbx_error_name(rc));
+        exit(EXIT_FAILURE);
+    }
+    double seconds = (double)result.elapsed_us / 1e6;
+    printf("%-10s %10.1f ms  %8.0f req/s  %8.0f xfer/s  speedup %6.2fx  "
+           "mismatches: %llu status, %llu data\n",
+           (flags & USBX_REPLAY_REALTIME) ? "paced" : "flat out", seconds * 1e3,
+           seconds > 0 ? (double)result.requests / seconds : 0.0,
+           seconds > 0 ? (double)result.transfers / seconds : 0.0,
+           result.elapsed_us ? (double)result.recorded_us / (double)result.elapsed_us : 0.0,
+           (unsigned long long)result.status_mismatches,
+           (unsigned long long)result.data_mismatches);
+}
+
+int main(int argc, char **argv) {
+    const char *path = NULL;
+    int realtime = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--realtime") == 0) {
+            realtime = 1;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (!path) {
+        record_session(SYNTHETIC_TRACE);
+    }
+
+    int error;
+    struct usbx_trace *trace = usbx_trace_load(path ? path : SYNTHETIC_TRACE, &error);
+    if (!trace) {
+        fprintf(stderr, "Error: cannot load trace: %s\n", usbx_error_name(error));
+        return EXIT_FAILURE;
+    }
+    struct usbx_trace_info info;
+    usbx_trace_get_info(trace, &info);
+    printf("=== Replay of %s ===\n", path ? path : "a synthetic upload session");
+    printf("%d devices, %llu requests, %llu transfers, %llu payload bytes, %.1f ms recorded\n\n",
+           info.devices, (unsigned long long)info.requests, (unsigned long long)info.transfers,
+           (unsigned long long)info.payload_bytes, (double)info.duration_us / 1e3);
+
+    if (!path || !realtime) {
+        run_replay(trace, 0);
+    }
+    if (!path || realtime) {
+        run_replay(trace, USBX_REPLAY_REALTIME);
+    }
+    usbx_trace_free(trace);
+    if (!path) {
+        remove(SYNTHETIC_TRACE);
+    }
+    return EXIT_SUCCESS;
+}
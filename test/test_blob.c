@@ -0,0 +1,295 @@
+/*
+ * Unit tests for the content-addressed blob store
+ *
+ * Each test works in its own temporary directory. Blob payloads use the
+ * simulator's reference pattern so a bulk OUT transfer straight from the
+ * store can be checked by the simulated sink.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "usbx_api.h"
+#include "usbx_blob.h"
+#include "usbx_sha256.h"
+#include "usbx_sim.h"
+
+#define EP_BULK_OUT 0x02
+
+static void make_directory(char *path) {
+    strcpy(path, "/tmp/usbx-blob-test-XXXXXX");
+    assert(mkdtemp(path) != NULL);
+}
+
+static void remove_directory(const char *path) {
+    char command[128];
+    snprintf(command, sizeof(command), "rm -rf '%s'", path);
+    assert(system(command) == 0);
+}
+
+/**
+ * Test 1: SHA-256 matches the FIPS 180-4 test vectors
+ */
+void test_sha256() {
+    printf("TEST: SHA-256 test vectors\n");
+    char hex[USBX_SHA256_HEX_SIZE];
+
+    usbx_sha256_hex("abc", 3, hex);
+    assert(strcmp(hex, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad") == 0);
+    usbx_sha256_hex("", 0, hex);
+    assert(strcmp(hex, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855") == 0);
+    const char *two_blocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    usbx_sha256_hex(two_blocks, strlen(two_blocks), hex);
+    assert(strcmp(hex, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1") == 0);
+
+    // Uneven updates give the same digest as one call
+    struct usbx_sha256 ctx;
+    unsigned char digest[USBX_SHA256_SIZE], expected[USBX_SHA256_SIZE];
+    unsigned char data[1000];
+    usbx_sim_fill_pattern(data, sizeof(data), 0);
+    usbx_sha256_init(&ctx);
+    usbx_sha256_update(&ctx, data, sizeof(data));
+    usbx_sha256_final(&ctx, expected);
+    usbx_sha256_init(&ctx);
+    for (size_t done = 0, step = 1; done < sizeof(data); done += step, step = step * 3 % 97 + 1) {
+        usbx_sha256_update(&ctx, data + done, step < sizeof(data) - done ? step : sizeof(data) - done);
+    }
+    usbx_sha256_final(&ctx, digest);
+    assert(memcmp(digest, expected, sizeof(digest)) == 0);
+    printf("✓ digests match\n");
+}
+
+/**
+ * Test 2: put, deduplicate, map and reopen
+ */
+void test_store() {
+    printf("TEST: blob store put, get and reopen\n");
+    char directory[64];
+    make_directory(directory);
+    struct usbx_blob_store *store = usbx_blob_store_open(directory, 0, NULL);
+    assert(store);
+
+    unsigned char image[100000];
+    usbx_sim_fill_pattern(image, sizeof(image), 0);
+    char hash[USBX_SHA256_HEX_SIZE], again[USBX_SHA256_HEX_SIZE];
+    assert(usbx_blob_put(store, image, sizeof(image), hash) == 1);
+    assert(usbx_blob_put(store, image, sizeof(image), again) == 0);
+    assert(strcmp(hash, again) == 0);
+
+    struct usbx_blob *blob = usbx_blob_get(store, hash);
+    assert(blob && usbx_blob_size(blob) == sizeof(image));
+    assert(memcmp(usbx_blob_data(blob), image, sizeof(image)) == 0);
+    usbx_blob_release(blob);
+    assert(usbx_blob_get(store, "00") == NULL);
+    assert(usbx_blob_get(store, "0000000000000000000000000000000000000000000000000000000000000000") == NULL);
+
+    assert(usbx_blob_put(store, "", 0, again) == 1);
+    blob = usbx_blob_get(store, again);
+    assert(blob && usbx_blob_size(blob) == 0);
+    usbx_blob_release(blob);
+
+    // A reopened store finds the blobs again and ignores stray files
+    usbx_blob_store_close(store);
+    char stray[128];
+    snprintf(stray, sizeof(stray), "%s/notes.txt", directory);
+    FILE *file = fopen(stray, "w");
+    assert(file);
+    fclose(file);
+    store = usbx_blob_store_open(directory, 0, NULL);
+    struct usbx_blob_stats stats;
+    usbx_blob_get_stats(store, &stats);
+    assert(stats.blobs == 2 && stats.bytes == sizeof(image));
+    blob = usbx_blob_get(store, hash);
+    assert(blob && memcmp(usbx_blob_data(blob), image, sizeof(image)) == 0);
+
+    // Removing a blob in use keeps the reader's mapping valid
+    assert(usbx_blob_remove(store, hash) == USBX_SUCCESS);
+    assert(usbx_blob_get(store, hash) == NULL);
+    assert(memcmp(usbx_blob_data(blob), image, sizeof(image)) == 0);
+    usbx_blob_release(blob);
+    assert(usbx_blob_remove(store, hash) == USBX_ERROR_NOT_FOUND);
+
+    usbx_blob_store_close(store);
+    remove_directory(directory);
+    printf("✓ deduplicated, mapped and re-indexed\n");
+}
+
+/**
+ * Test 3: the capacity evicts the least recently used unpinned blobs
+ */
+void test_eviction() {
+    printf("TEST: LRU eviction under the capacity\n");
+    char directory[64];
+    make_directory(directory);
+    struct usbx_blob_store *store = usbx_blob_store_open(directory, 3 * 1000, NULL);
+
+    unsigned char data[4 * 1000];
+    char hashes[5][USBX_SHA256_HEX_SIZE];
+    for (int i = 0; i < 3; i++) {
+        memset(data, i, 1000);
+        assert(usbx_blob_put(store, data, 1000, hashes[i]) == 1);
+    }
+
+    // Use blob 0 so blob 1 becomes the oldest, and pin blob 2
+    usbx_blob_release(usbx_blob_get(store, hashes[0]));
+    struct usbx_blob *pinned = usbx_blob_get(store, hashes[2]);
+    memset(data, 3, 1000);
+    assert(usbx_blob_put(store, data, 1000, hashes[3]) == 1);
+
+    struct usbx_blob *blob = usbx_blob_get(store, hashes[1]);
+    assert(blob == NULL);
+    blob = usbx_blob_get(store, hashes[0]);
+    assert(blob);
+    usbx_blob_release(blob);
+
+    // With blobs 0, 2 and 3 pinned nothing can be evicted until one is released
+    blob = usbx_blob_get(store, hashes[0]);
+    struct usbx_blob *third = usbx_blob_get(store, hashes[3]);
+    memset(data, 4, 1000);
+    assert(usbx_blob_put(store, data, 1000, hashes[4]) == USBX_ERROR_NO_MEM);
+    usbx_blob_release(third);
+    assert(usbx_blob_put(store, data, 1000, hashes[4]) == 1);
+    char oversized[USBX_SHA256_HEX_SIZE];
+    assert(usbx_blob_put(store, data, sizeof(data), oversized) == USBX_ERROR_OVERFLOW);
+
+    struct usbx_blob_stats stats;
+    usbx_blob_get_stats(store, &stats);
+    assert(stats.evictions == 2 && stats.bytes == 3000 && stats.misses == 1);
+
+    struct usbx_blob_info info[8];
+    assert(usbx_blob_list(store, info, 8) == 3);
+    assert(strcmp(info[0].hash, hashes[4]) == 0 && info[0].users == 0);
+
+    usbx_blob_release(blob);
+    usbx_blob_release(pinned);
+    usbx_blob_store_close(store);
+    remove_directory(directory);
+    printf("✓ oldest unpinned blobs evicted, pinned blobs kept\n");
+}
+
+static void request(struct usbx_http_router *router, const char *method, const char *path,
+                    const char *sha256, const void *body, size_t length,
+                    struct usbx_http_response *resp) {
+    struct usbx_http_pair args[1] = {{"sha256", sha256}};
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = method;
+    req.path = path;
+    req.args = args;
+    req.num_args = sha256 ? 1 : 0;
+    req.body = (const unsigned char *)body;
+    req.body_length = length;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+/**
+ * Test 4: upload once over REST, then stream to a device by hash
+ */
+void test_routes() {
+    printf("TEST: /blobs routes and blob-backed bulk OUT\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+
+    struct usbx_http_response resp;
+    request(router, "GET", "/blobs", NULL, NULL, 0, &resp);
+    assert(resp.status == 503);     // no store configured yet
+    usbx_http_response_free(&resp);
+
+    char directory[64];
+    make_directory(directory);
+    struct usbx_blob_store *store = usbx_blob_store_open(directory, 0, NULL);
+    usbx_api_set_blob_store(store);
+
+    size_t size = 1024 * 1024 + 100;
+    unsigned char *image = malloc(size);
+    usbx_sim_fill_pattern(image, size, 0);
+    char hash[USBX_SHA256_HEX_SIZE];
+    usbx_sha256_hex(image, size, hash);
+
+    request(router, "PUT", "/blobs", "00ff", image, size, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    request(router, "PUT", "/blobs", hash, image, size, &resp);
+    assert(resp.status == 201 && strstr(resp.body, hash));
+    usbx_http_response_free(&resp);
+    request(router, "PUT", "/blobs", NULL, image, size, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"created\": false"));
+    usbx_http_response_free(&resp);
+
+    char path[128];
+    snprintf(path, sizeof(path), "/blobs/%s", hash);
+    request(router, "GET", path, NULL, NULL, 0, &resp);
+    assert(resp.status == 200 && resp.reader);
+    char buffer[70000];
+    uint64_t pos = 0;
+    ssize_t n;
+    while ((n = resp.reader(resp.reader_cls, pos, buffer, sizeof(buffer))) > 0) {
+        assert(memcmp(buffer, image + pos, (size_t)n) == 0);
+        pos += (uint64_t)n;
+    }
+    assert(n == USBX_HTTP_END_OF_STREAM && pos == size);
+    usbx_http_response_free(&resp);
+
+    // A bulk OUT operation sends the blob without inlining it
+    struct usbx_sim_endpoint_config endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.address = EP_BULK_OUT;
+    endpoint.type = USBX_TRANSFER_TYPE_BULK;
+    endpoint.max_packet_size = 512;
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = &endpoint;
+    config.num_endpoints = 1;
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    int handle_id = usbx_handle_add(dev, NULL);
+
+    char batch_path[64], body[256];
+    snprintf(batch_path, sizeof(batch_path), "/handles/%d/batch", handle_id);
+    snprintf(body, sizeof(body), "{\"operations\": [{\"op\": \"bulk\", \"endpoint\": 2, "
+                                 "\"blob\": \"%s\"}]}", hash);
+    request(router, "POST", batch_path, NULL, body, strlen(body), &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"transferred\": 1048676"));
+    usbx_http_response_free(&resp);
+    struct usbx_sim_endpoint_stats stats;
+    usbx_sim_get_endpoint_stats(dev, EP_BULK_OUT, &stats);
+    assert(stats.bytes == size && stats.pattern_errors == 0);
+
+    snprintf(body, sizeof(body), "{\"operations\": [{\"op\": \"bulk\", \"endpoint\": 2, "
+                                 "\"blob\": \"%064d\"}]}", 0);
+    request(router, "POST", batch_path, NULL, body, strlen(body), &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+
+    request(router, "DELETE", path, NULL, NULL, 0, &resp);
+    assert(resp.status == 200);
+    usbx_http_response_free(&resp);
+    request(router, "GET", path, NULL, NULL, 0, &resp);
+    assert(resp.status == 404);
+    usbx_http_response_free(&resp);
+
+    usbx_handle_remove(handle_id);
+    usbx_api_set_blob_store(NULL);
+    usbx_blob_store_close(store);
+    remove_directory(directory);
+    free(image);
+    usbx_http_router_destroy(router);
+    printf("✓ uploaded once, verified, streamed to a device by hash\n");
+}
+
+int main() {
+    printf("=== Blob Store Tests ===\n\n");
+
+    test_sha256();
+    test_store();
+    test_eviction();
+    test_routes();
+
+    printf("\n=== All blob store tests passed ===\n");
+    return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * Unit tests for the per-device circuit breaker
+ *
+ * A simulated device whose bulk endpoint times out on demand feeds a
+ * breaker through its transfers: the breaker has to open on the failure
+ * rate of its window, admit one probe once the cooldown ends, and close or
+ * reopen on the probe's outcome. The REST test checks 503 with Retry-After
+ * for the failing handle while another handle keeps working.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_breaker.h"
+#include "usbx_sim.h"
+#include "usbx_util.h"
+
+#define EP_IN 0x81
+
+/* Complete transfers, or let them time out while *cls is set */
+static int endpoint_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                            uint64_t *retry_at_us) {
+    const int *failing = cls;
+    if (__atomic_load_n(failing, __ATOMIC_ACQUIRE)) {
+        *retry_at_us = now_us + 60000000ULL;
+        return USBX_SIM_RETRY;
+    }
+    memset(xfer->buffer, 0x5a, (size_t)xfer->length);
+    xfer->actual_length = xfer->length;
+    return USBX_TRANSFER_COMPLETED;
+}
+
+static struct usbx_device *create_device(int *failing) {
+    struct usbx_sim_endpoint_config endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.address = EP_IN;
+    endpoint.type = USBX_TRANSFER_TYPE_BULK;
+    endpoint.max_packet_size = 512;
+    endpoint.handler = endpoint_handler;
+    endpoint.handler_cls = failing;
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = &endpoint;
+    config.num_endpoints = 1;
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    assert(dev != NULL);
+    return dev;
+}
+
+static int read_in(struct usbx_device *dev) {
+    unsigned char data[64];
+    int transferred = 0;
+    return usbx_bulk_transfer(dev, EP_IN, data, sizeof(data), &transferred, 20);
+}
+
+/**
+ * Test 1: closed, open, half-open and back
+ */
+void test_state_machine() {
+    printf("TEST: Breaker states\n");
+    int failing = 0;
+    struct usbx_device *dev = create_device(&failing);
+    struct usbx_breaker *breaker = usbx_breaker_create();
+    struct usbx_breaker_config config;
+    struct usbx_breaker_stats stats;
+    unsigned int retry_after_ms = 0;
+
+    usbx_breaker_config_init(&config);
+    config.window_ms = 5000;
+    config.min_transfers = 4;
+    config.failure_pct = 50;
+    config.open_ms = 100;
+    assert(usbx_breaker_configure(breaker, &config) == USBX_SUCCESS);
+    usbx_breaker_attach(breaker, dev);
+
+    for (int i = 0; i < 3; i++) {
+        assert(read_in(dev) == USBX_SUCCESS);
+    }
+    failing = 1;
+    assert(read_in(dev) == USBX_ERROR_TIMEOUT);    // 1 of 4
+    assert(read_in(dev) == USBX_ERROR_TIMEOUT);    // 2 of 5
+    assert(usbx_breaker_admit(breaker, NULL));
+    assert(read_in(dev) == USBX_ERROR_TIMEOUT);    // 3 of 6: opens
+    assert(!usbx_breaker_admit(breaker, &retry_after_ms));
+    assert(retry_after_ms > 0 && retry_after_ms <= 100);
+    usbx_breaker_get_stats(breaker, &stats);
+    assert(stats.state == USBX_BREAKER_OPEN && stats.trips == 1);
+    assert(stats.transfers == 6 && stats.failures == 3);
+
+    // One probe after the cooldown; it fails and the breaker reopens
+    usbx_sleep_us(110000);
+    assert(usbx_breaker_admit(breaker, NULL));
+    assert(!usbx_breaker_admit(breaker, NULL));
+    assert(read_in(dev) == USBX_ERROR_TIMEOUT);
+    usbx_breaker_get_stats(breaker, &stats);
+    assert(stats.state == USBX_BREAKER_OPEN);
+
+    // The next probe succeeds and closes it
+    failing = 0;
+    usbx_sleep_us(110000);
+    assert(usbx_breaker_admit(breaker, NULL));
+    assert(read_in(dev) == USBX_SUCCESS);
+    assert(usbx_breaker_admit(breaker, NULL) && usbx_breaker_admit(breaker, NULL));
+    usbx_breaker_get_stats(breaker, &stats);
+    assert(stats.state == USBX_BREAKER_CLOSED && stats.transfers == 0);
+    assert(stats.trips == 1 && stats.probes == 2 && stats.rejected == 2);
+
+    // Disabled breakers admit everything
+    failing = 1;
+    config.enabled = 0;
+    usbx_breaker_configure(breaker, &config);
+    for (int i = 0; i < 6; i++) {
+        read_in(dev);
+    }
+    assert(usbx_breaker_admit(breaker, NULL));
+    usbx_breaker_detach(dev);
+    usbx_device_destroy(dev);
+    usbx_breaker_free(breaker);
+    printf("✓ opens at 50%% of 6 transfers, one probe per cooldown, closes on success\n");
+}
+
+static void dispatch(struct usbx_http_router *router, const char *method, const char *path,
+                     struct usbx_http_pair *args, int num_args, const char *body,
+                     struct usbx_http_response *resp) {
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = method;
+    req.path = path;
+    req.args = args;
+    req.num_args = num_args;
+    req.body = (const unsigned char *)body;
+    req.body_length = body ? strlen(body) : 0;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+static const char *header(const struct usbx_http_response *resp, const char *name) {
+    for (int i = 0; i < resp->num_headers; i++) {
+        if (strcmp(resp->headers[i].name, name) == 0) {
+            return resp->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Test 2: 503 with Retry-After for the failing handle only
+ */
+void test_routes() {
+    printf("TEST: 503 and /handles/{id}/breaker\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    int failing = 1, healthy = 0;
+    int bad_id = usbx_handle_add(create_device(&failing), NULL);
+    int good_id = usbx_handle_add(create_device(&healthy), NULL);
+    char breaker_path[64], bad_batch[64], good_batch[64];
+    snprintf(breaker_path, sizeof(breaker_path), "/handles/%d/breaker", bad_id);
+    snprintf(bad_batch, sizeof(bad_batch), "/handles/%d/batch", bad_id);
+    snprintf(good_batch, sizeof(good_batch), "/handles/%d/batch", good_id);
+    const char *body = "{\"operations\": [{\"op\": \"bulk\", \"endpoint\": 129, "
+                       "\"length\": 64, \"timeout\": 20}]}";
+    struct usbx_http_response resp;
+
+    struct usbx_http_pair bad[1] = {{"failure_pct", "0"}};
+    dispatch(router, "POST", breaker_path, bad, 1, NULL, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    struct usbx_http_pair args[2] = {{"min_transfers", "3"}, {"open_ms", "1500"}};
+    dispatch(router, "POST", breaker_path, args, 2, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"min_transfers\": 3"));
+    usbx_http_response_free(&resp);
+
+    for (int i = 0; i < 3; i++) {
+        dispatch(router, "POST", bad_batch, NULL, 0, body, &resp);
+        assert(resp.status == 200 && strstr(resp.body, "USBX_ERROR_TIMEOUT"));
+        usbx_http_response_free(&resp);
+    }
+    uint64_t start = usbx_now_us();
+    dispatch(router, "POST", bad_batch, NULL, 0, body, &resp);
+    assert(usbx_now_us() - start < 20000);
+    assert(resp.status == 503);
+    assert(header(&resp, "Retry-After") && strcmp(header(&resp, "Retry-After"), "2") == 0);
+    usbx_http_response_free(&resp);
+
+    dispatch(router, "POST", good_batch, NULL, 0, body, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"status\": \"USBX_SUCCESS\""));
+    usbx_http_response_free(&resp);
+
+    dispatch(router, "GET", breaker_path, NULL, 0, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"state\": \"open\""));
+    assert(strstr(resp.body, "\"rejected\": 1") && strstr(resp.body, "\"trips\": 1"));
+    usbx_http_response_free(&resp);
+
+    failing = 0;
+    dispatch(router, "DELETE", breaker_path, NULL, 0, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"state\": \"closed\""));
+    usbx_http_response_free(&resp);
+    dispatch(router, "POST", bad_batch, NULL, 0, body, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"status\": \"USBX_SUCCESS\""));
+    usbx_http_response_free(&resp);
+
+    usbx_handle_remove(bad_id);
+    usbx_handle_remove(good_id);
+    usbx_http_router_destroy(router);
+    printf("✓ failing handle shed with 503 and Retry-After, healthy handle unaffected\n");
+}
+
+int main() {
+    printf("=== Circuit Breaker Tests ===\n\n");
+    test_state_machine();
+    test_routes();
+    printf("\n=== All circuit breaker tests passed ===\n");
+    return 0;
+}
@@ -0,0 +1,300 @@
+/*
+ * Unit tests for the memory budget
+ *
+ * Reservations have to be tracked with their peak even when unlimited,
+ * refused at once when larger than the capacity, and queued in arrival
+ * order while the budget is exhausted: a small reservation that would fit
+ * must not overtake a waiting large one. A wait that runs out must fail
+ * and let the next waiter in. The REST test drives 503 with Retry-After
+ * and 413 for batches through the router, and /budget. Streams must
+ * reserve their buffers without waiting and return them when destroyed.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbx_api.h"
+#include "usbx_budget.h"
+#include "usbx_interrupt.h"
+#include "usbx_pubsub.h"
+#include "usbx_sim.h"
+
+static void sleep_ms(int ms) {
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+static void wait_for_waiting(unsigned int waiting) {
+    struct usbx_budget_stats stats;
+    for (int i = 0; i < 2000; i++) {
+        usbx_budget_get_stats(&stats);
+        if (stats.waiting == waiting) {
+            return;
+        }
+        sleep_ms(1);
+    }
+    assert(!"waiting count not reached");
+}
+
+/**
+ * Test 1: usage, peak and reservations larger than the capacity
+ */
+void test_reserve_release() {
+    printf("TEST: Reserve and release\n");
+    struct usbx_budget_stats stats;
+
+    assert(usbx_budget_reserve(1000) == USBX_SUCCESS);      // unlimited, still tracked
+    assert(usbx_budget_reserve(500) == USBX_SUCCESS);
+    usbx_budget_release(1000);
+    usbx_budget_get_stats(&stats);
+    assert(stats.capacity == 0 && stats.in_use == 500 && stats.peak == 1500);
+    assert(stats.wait_ms == USBX_BUDGET_DEFAULT_WAIT_MS && stats.reservations == 2);
+
+    assert(usbx_budget_configure(100, USBX_BUDGET_MAX_WAIT_MS + 1) == USBX_ERROR_INVALID_PARAM);
+    assert(usbx_budget_configure(1000, 0) == USBX_SUCCESS);
+    assert(usbx_budget_reserve(1001) == USBX_ERROR_NO_MEM);
+    assert(usbx_budget_reserve(500) == USBX_SUCCESS);
+    assert(usbx_budget_reserve(1) == USBX_ERROR_BUSY);       // full, no wait
+    usbx_budget_release(1000);
+    usbx_budget_get_stats(&stats);
+    assert(stats.in_use == 0 && stats.too_large == 1 && stats.timed_out == 1);
+    printf("✓ peak of 1500 tracked unlimited, 1001 of 1000 refused, full without wait\n");
+}
+
+struct reservation {
+    size_t bytes;
+    int result;
+    int done;
+};
+
+static void *reserve_thread(void *arg) {
+    struct reservation *r = arg;
+    r->result = usbx_budget_reserve(r->bytes);
+    __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * Test 2: waiters are admitted in arrival order as memory is released
+ */
+void test_fifo() {
+    printf("TEST: Waiting in arrival order\n");
+    struct reservation large = {.bytes = 30}, small = {.bytes = 10};
+    pthread_t threads[2];
+    struct usbx_budget_stats stats;
+
+    assert(usbx_budget_configure(100, 5000) == USBX_SUCCESS);
+    assert(usbx_budget_reserve(80) == USBX_SUCCESS);
+    assert(pthread_create(&threads[0], NULL, reserve_thread, &large) == 0);
+    wait_for_waiting(1);
+    assert(pthread_create(&threads[1], NULL, reserve_thread, &small) == 0);
+    wait_for_waiting(2);                    // 10 would fit but queues behind 30
+    sleep_ms(20);
+    assert(!__atomic_load_n(&small.done, __ATOMIC_ACQUIRE));
+
+    usbx_budget_release(10);                // 70 + 30 fits, 10 more does not
+    pthread_join(threads[0], NULL);
+    assert(large.result == USBX_SUCCESS);
+    wait_for_waiting(1);
+    usbx_budget_release(70);
+    pthread_join(threads[1], NULL);
+    assert(small.result == USBX_SUCCESS);
+
+    usbx_budget_get_stats(&stats);
+    assert(stats.in_use == 40 && stats.waited == 2);
+    assert(stats.max_wait_us >= 20000 && stats.wait_us >= stats.max_wait_us);
+    usbx_budget_release(40);
+    printf("✓ 30 then 10 admitted in order, waited up to %llu us\n",
+           (unsigned long long)stats.max_wait_us);
+}
+
+/**
+ * Test 3: a wait that runs out fails and lets the next waiter in
+ */
+void test_timeout() {
+    printf("TEST: Wait timeout\n");
+    struct reservation large = {.bytes = 30}, small = {.bytes = 10};
+    pthread_t threads[2];
+    struct usbx_budget_stats before, after;
+
+    usbx_budget_get_stats(&before);
+    assert(usbx_budget_configure(100, 50) == USBX_SUCCESS);
+    assert(usbx_budget_reserve(80) == USBX_SUCCESS);
+    assert(pthread_create(&threads[0], NULL, reserve_thread, &large) == 0);
+    wait_for_waiting(1);
+    assert(usbx_budget_configure(100, 5000) == USBX_SUCCESS);
+    assert(pthread_create(&threads[1], NULL, reserve_thread, &small) == 0);
+    wait_for_waiting(2);
+    // The large one ahead times out and must hand over to the small one
+    pthread_join(threads[0], NULL);
+    assert(large.result == USBX_ERROR_BUSY);
+    pthread_join(threads[1], NULL);
+    assert(small.result == USBX_SUCCESS);
+
+    usbx_budget_get_stats(&after);
+    assert(after.timed_out == before.timed_out + 1 && after.in_use == 90);
+    usbx_budget_release(90);
+    assert(usbx_budget_configure(0, USBX_BUDGET_DEFAULT_WAIT_MS) == USBX_SUCCESS);
+    printf("✓ refused after 50 ms, queue left intact\n");
+}
+
+static void dispatch(struct usbx_http_router *router, const char *method, const char *path,
+                     struct usbx_http_pair *args, int num_args, const char *body,
+                     struct usbx_http_response *resp) {
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = method;
+    req.path = path;
+    req.args = args;
+    req.num_args = num_args;
+    req.body = (const unsigned char *)body;
+    req.body_length = body ? strlen(body) : 0;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+static const char *header(const struct usbx_http_response *resp, const char *name) {
+    for (int i = 0; i < resp->num_headers; i++) {
+        if (strcmp(resp->headers[i].name, name) == 0) {
+            return resp->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Test 4: batches refused through the router, and /budget
+ */
+void test_routes() {
+    printf("TEST: 503, 413 and /budget\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    struct usbx_sim_endpoint_config endpoints[2];
+    memset(endpoints, 0, sizeof(endpoints));
+    endpoints[0].address = 0x81;
+    endpoints[0].type = USBX_TRANSFER_TYPE_BULK;
+    endpoints[0].max_packet_size = 512;
+    endpoints[1].address = 0x01;
+    endpoints[1].type = USBX_TRANSFER_TYPE_BULK;
+    endpoints[1].max_packet_size = 512;
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = endpoints;
+    config.num_endpoints = 2;
+    int id = usbx_handle_add(usbx_sim_device_create(&config), NULL);
+    char batch[64];
+    snprintf(batch, sizeof(batch), "/handles/%d/batch", id);
+    struct usbx_http_response resp;
+    const char *body = "{\"operations\": [{\"op\": \"bulk\", \"endpoint\": 1, "
+                       "\"data\": \"AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\"}, "
+                       "{\"op\": \"bulk\", \"endpoint\": 129, \"length\": 16}]}";
+
+    struct usbx_http_pair bad[1] = {{"wait_ms", "600001"}};
+    dispatch(router, "POST", "/budget", bad, 1, NULL, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    struct usbx_http_pair tight[2] = {{"capacity", "100"}, {"wait_ms", "0"}};
+    dispatch(router, "POST", "/budget", tight, 2, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"capacity\": 100, \"wait_ms\": 0"));
+    usbx_http_response_free(&resp);
+
+    // 25 bytes of payload plus 16 + 24 + 1 for the IN buffer and its base64
+    dispatch(router, "POST", batch, NULL, 0, body, &resp);
+    assert(resp.status == 200 && !strstr(resp.body, "USBX_ERROR"));
+    usbx_http_response_free(&resp);
+
+    assert(usbx_budget_reserve(90) == USBX_SUCCESS);
+    dispatch(router, "POST", batch, NULL, 0, body, &resp);
+    assert(resp.status == 503 && strcmp(header(&resp, "Retry-After"), "1") == 0);
+    assert(strstr(resp.body, "USBX_ERROR_BUSY"));
+    usbx_http_response_free(&resp);
+    dispatch(router, "GET", "/budget", NULL, 0, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"in_use\": 90, ") &&
+           strstr(resp.body, "\"utilization\": 0.9000"));
+    usbx_http_response_free(&resp);
+    usbx_budget_release(90);
+
+    struct usbx_http_pair small[1] = {{"capacity", "20"}};
+    dispatch(router, "POST", "/budget", small, 1, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"wait_ms\": 0"));
+    usbx_http_response_free(&resp);
+    dispatch(router, "POST", batch, NULL, 0, body, &resp);
+    assert(resp.status == 413 && strstr(resp.body, "USBX_ERROR_NO_MEM"));
+    usbx_http_response_free(&resp);
+
+    struct usbx_http_pair reset[2] = {{"capacity", "0"}, {"wait_ms", "5000"}};
+    dispatch(router, "POST", "/budget", reset, 2, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"in_use\": 0"));
+    usbx_http_response_free(&resp);
+
+    usbx_handle_remove(id);
+    usbx_http_router_destroy(router);
+    printf("✓ 503 with Retry-After while full, 413 when larger than the capacity\n");
+}
+
+/**
+ * Test 5: non-waiting reservations and the buffers of streams
+ */
+void test_streams() {
+    printf("TEST: Stream buffers\n");
+    struct usbx_budget_stats stats;
+    int error;
+
+    assert(usbx_budget_configure(1000, 5000) == USBX_SUCCESS);
+    assert(usbx_budget_try_reserve(600) == USBX_SUCCESS);
+    assert(usbx_budget_try_reserve(600) == USBX_ERROR_BUSY);
+    usbx_budget_get_stats(&stats);
+    assert(stats.in_use == 600 && stats.declined == 1 && stats.waiting == 0);
+    usbx_budget_release(600);
+
+    struct usbx_sim_endpoint_config endpoints[2];
+    memset(endpoints, 0, sizeof(endpoints));
+    endpoints[0].address = 0x81;
+    endpoints[0].type = USBX_TRANSFER_TYPE_INTERRUPT;
+    endpoints[0].max_packet_size = 64;
+    endpoints[1].address = 0x82;
+    endpoints[1].type = USBX_TRANSFER_TYPE_BULK;
+    endpoints[1].max_packet_size = 512;
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = endpoints;
+    config.num_endpoints = 2;
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+
+    // Streams are refused at once while their buffers do not fit ...
+    assert(!usbx_interrupt_poller_start(dev, 0x81, NULL, &error) && error == USBX_ERROR_NO_MEM);
+    assert(!usbx_pubsub_start(dev, 0x82, NULL, &error) && error == USBX_ERROR_NO_MEM);
+    usbx_budget_get_stats(&stats);
+    assert(stats.in_use == 0 && stats.waiting == 0);
+
+    // ... and hold them until they are destroyed
+    assert(usbx_budget_configure(0, USBX_BUDGET_DEFAULT_WAIT_MS) == USBX_SUCCESS);
+    struct usbx_interrupt_poller *poller = usbx_interrupt_poller_start(dev, 0x81, NULL, &error);
+    struct usbx_pubsub *pubsub = usbx_pubsub_start(dev, 0x82, NULL, &error);
+    assert(poller && pubsub);
+    usbx_budget_get_stats(&stats);
+    assert(stats.in_use > 0);
+    usbx_interrupt_poller_destroy(poller);
+    usbx_pubsub_destroy(pubsub);
+    usbx_budget_get_stats(&stats);
+    assert(stats.in_use == 0);
+
+    usbx_device_destroy(dev);
+    printf("✓ try-reserve never waits, stream buffers reserved while they run\n");
+}
+
+int main() {
+    printf("=== Memory Budget Tests ===\n\n");
+    test_reserve_release();
+    test_fifo();
+    test_timeout();
+    test_routes();
+    test_streams();
+    printf("\n=== All memory budget tests passed ===\n");
+    return 0;
+}
@@ -0,0 +1,293 @@
+/*
+ * Unit tests for usbmon-compatible capture
+ *
+ * Transfers on a simulated device are captured and the resulting pcap
+ * stream is parsed back: file header, usbmon headers of submissions and
+ * completions, setup packets and data snapshots. Further tests cover full
+ * thread rings and the capture routes.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_capture.h"
+#include "usbx_sim.h"
+
+/** @brief One parsed record */
+struct record {
+    char type;
+    unsigned char xfer_type;
+    unsigned char epnum;
+    unsigned char devnum;
+    uint16_t busnum;
+    char flag_setup;
+    char flag_data;
+    int32_t status;
+    uint32_t length;
+    uint32_t len_cap;
+    unsigned char setup[8];
+    const unsigned char *data;
+};
+
+static struct usbx_device *create_device(void) {
+    struct usbx_sim_endpoint_config endpoints[2];
+    memset(endpoints, 0, sizeof(endpoints));
+    endpoints[0].address = 0x81;
+    endpoints[1].address = 0x02;
+    for (int i = 0; i < 2; i++) {
+        endpoints[i].type = USBX_TRANSFER_TYPE_BULK;
+        endpoints[i].max_packet_size = 512;
+    }
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = endpoints;
+    config.num_endpoints = 2;
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    assert(dev != NULL);
+    return dev;
+}
+
+/* Read a whole limited capture stream */
+static size_t read_stream(struct usbx_capture_reader *reader, unsigned char *buffer,
+                          size_t size) {
+    size_t length = 0;
+    long n;
+    while ((n = usbx_capture_read(reader, buffer + length, size - length, 1000)) > 0) {
+        length += (size_t)n;
+    }
+    assert(n == USBX_ERROR_INTERRUPTED);
+    return length;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/* Parse the record at *offset and advance past it */
+static void parse_record(const unsigned char *stream, size_t *offset, struct record *rec) {
+    const unsigned char *p = stream + *offset;
+    uint32_t included = get_u32(p + 8);
+    const unsigned char *mon = p + USBX_CAPTURE_RECORD_HEADER_SIZE;
+    rec->type = (char)mon[8];
+    rec->xfer_type = mon[9];
+    rec->epnum = mon[10];
+    rec->devnum = mon[11];
+    memcpy(&rec->busnum, mon + 12, sizeof(rec->busnum));
+    rec->flag_setup = (char)mon[14];
+    rec->flag_data = (char)mon[15];
+    rec->status = (int32_t)get_u32(mon + 28);
+    rec->length = get_u32(mon + 32);
+    rec->len_cap = get_u32(mon + 36);
+    memcpy(rec->setup, mon + 40, sizeof(rec->setup));
+    rec->data = mon + USBX_CAPTURE_USBMON_SIZE;
+    assert(included == USBX_CAPTURE_USBMON_SIZE + rec->len_cap);
+    *offset += USBX_CAPTURE_RECORD_HEADER_SIZE + included;
+}
+
+/**
+ * Test 1: submissions and completions are recorded in usbmon format
+ */
+void test_records() {
+    printf("TEST: usbmon records\n");
+    struct usbx_device *dev = create_device();
+    struct usbx_capture_reader *reader = usbx_capture_reader_open(6, 0);
+    assert(reader != NULL && usbx_capture_reader_open(0, 0) == NULL);
+
+    // Nothing is recorded before capture is enabled
+    unsigned char data[600];
+    int transferred = 0;
+    assert(usbx_bulk_transfer(dev, 0x81, data, 100, &transferred, 1000) == USBX_SUCCESS);
+    struct usbx_capture_stats stats;
+    usbx_capture_get_stats(&stats);
+    assert(stats.records == 0 && stats.reading);
+
+    usbx_capture_enable(dev, 3, 7);
+    assert(usbx_capture_enabled(dev));
+    usbx_sim_fill_pattern(data, sizeof(data), 0);
+    assert(usbx_bulk_transfer(dev, 0x02, data, 600, &transferred, 1000) == USBX_SUCCESS);
+    assert(usbx_bulk_transfer(dev, 0x81, data, 64, &transferred, 1000) == USBX_SUCCESS);
+    unsigned char status[2];
+    assert(usbx_control_transfer(dev, 0x80, 0x00, 0, 0, status, 2, 1000) == USBX_ERROR_PIPE);
+    usbx_capture_disable(dev);
+    assert(usbx_bulk_transfer(dev, 0x81, data, 64, &transferred, 1000) == USBX_SUCCESS);
+
+    unsigned char *stream = malloc(65536);
+    size_t length = read_stream(reader, stream, 65536);
+    assert(get_u32(stream) == 0xa1b2c3d4 && get_u32(stream + 20) == USBX_CAPTURE_LINKTYPE);
+
+    struct record rec[6];
+    size_t offset = USBX_CAPTURE_FILE_HEADER_SIZE;
+    for (int i = 0; i < 6; i++) {
+        parse_record(stream, &offset, &rec[i]);
+        assert(rec[i].devnum == 7 && rec[i].busnum == 3);
+    }
+    assert(offset == length);
+
+    // Bulk OUT: data with the submission (cut to the 1024-byte snapshot length), none after
+    assert(rec[0].type == 'S' && rec[0].xfer_type == 3 && rec[0].epnum == 0x02);
+    assert(rec[0].status == -115 && rec[0].length == 600 && rec[0].len_cap == 600);
+    assert(rec[0].flag_setup == '-' && rec[0].flag_data == 0);
+    for (int i = 0; i < 600; i++) {
+        assert(rec[0].data[i] == usbx_sim_pattern_byte((uint64_t)i));
+    }
+    assert(rec[1].type == 'C' && rec[1].status == 0 && rec[1].length == 600 &&
+           rec[1].len_cap == 0 && rec[1].flag_data == '>');
+
+    // Bulk IN: the data comes with the completion
+    assert(rec[2].type == 'S' && rec[2].epnum == 0x81 && rec[2].len_cap == 0 &&
+           rec[2].flag_data == '<');
+    assert(rec[3].type == 'C' && rec[3].length == 64 && rec[3].len_cap == 64);
+    assert(rec[3].data[0] == usbx_sim_pattern_byte(100));
+
+    // Control IN: the setup packet with the submission, a stall as -EPIPE
+    const unsigned char setup[8] = {0x80, 0x00, 0, 0, 0, 0, 2, 0};
+    assert(rec[4].type == 'S' && rec[4].xfer_type == 2 && rec[4].epnum == 0x80);
+    assert(rec[4].flag_setup == 0 && memcmp(rec[4].setup, setup, 8) == 0);
+    assert(rec[5].type == 'C' && rec[5].status == -32);
+
+    usbx_capture_reader_close(reader);
+    usbx_capture_get_stats(&stats);
+    assert(stats.records == 6 && stats.delivered == 6 && !stats.reading);
+    usbx_device_destroy(dev);
+    free(stream);
+    printf("✓ bulk OUT/IN and control records with setup, data and status\n");
+}
+
+/**
+ * Test 2: a full thread ring drops records instead of blocking transfers
+ */
+void test_ring_full() {
+    printf("TEST: Full thread rings\n");
+    // Rings created from now on hold three 1 KiB completions
+    assert(usbx_capture_configure(4096, 65536) == USBX_ERROR_INVALID_PARAM);
+    assert(usbx_capture_configure(1, 1000) == USBX_SUCCESS);
+    struct usbx_device *dev = create_device();
+    usbx_capture_enable(dev, 0, 1);
+    struct usbx_capture_reader *reader = usbx_capture_reader_open(0, 300);
+    struct usbx_capture_stats before;
+    usbx_capture_get_stats(&before);
+
+    unsigned char data[1000];
+    int transferred = 0;
+    for (int i = 0; i < 20; i++) {
+        assert(usbx_bulk_transfer(dev, 0x81, data, sizeof(data), &transferred, 1000) ==
+               USBX_SUCCESS);
+    }
+    struct usbx_capture_stats after;
+    usbx_capture_get_stats(&after);
+    uint64_t dropped = after.dropped - before.dropped;
+    assert(dropped == 20 - 3 && after.records - before.records == 20 + 3);
+
+    // The stream still holds every submission and the completions that fit
+    unsigned char *stream = malloc(65536);
+    size_t length = read_stream(reader, stream, 65536);
+    size_t offset = USBX_CAPTURE_FILE_HEADER_SIZE;
+    int submissions = 0, completions = 0;
+    while (offset < length) {
+        struct record rec;
+        parse_record(stream, &offset, &rec);
+        submissions += rec.type == 'S';
+        completions += rec.type == 'C';
+        assert(rec.type == 'S' || rec.len_cap == 1000);
+    }
+    assert(offset == length && submissions == 20 && completions == 3);
+
+    usbx_capture_reader_close(reader);
+    assert(usbx_capture_configure(USBX_CAPTURE_DEFAULT_RING_SIZE,
+                                  USBX_CAPTURE_DEFAULT_SNAPLEN) == USBX_SUCCESS);
+    usbx_device_destroy(dev);
+    free(stream);
+    printf("✓ %llu completions dropped, the transfers were not delayed\n",
+           (unsigned long long)dropped);
+}
+
+static void request(struct usbx_http_router *router, const char *method, const char *path,
+                    struct usbx_http_pair *args, int num_args, struct usbx_http_response *resp) {
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = method;
+    req.path = path;
+    req.args = args;
+    req.num_args = num_args;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+/**
+ * Test 3: POST /handles/{id}/capture and GET /debug/capture
+ */
+void test_routes() {
+    printf("TEST: /handles/{id}/capture and /debug/capture\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    struct usbx_device *dev = create_device();
+    int handle_id = usbx_handle_add(dev, NULL);
+    char path[64];
+    snprintf(path, sizeof(path), "/handles/%d/capture", handle_id);
+    struct usbx_http_response resp;
+
+    struct usbx_http_pair bad[1] = {{"enabled", "yes"}};
+    request(router, "POST", path, bad, 1, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    request(router, "POST", path, NULL, 0, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"enabled\": true"));
+    usbx_http_response_free(&resp);
+    assert(usbx_capture_enabled(dev));
+
+    struct usbx_http_pair limit[1] = {{"count", "2"}};
+    struct usbx_http_response capture;
+    request(router, "GET", "/debug/capture", limit, 1, &capture);
+    assert(capture.status == 200 && capture.reader != NULL);
+    assert(strcmp(capture.content_type, "application/vnd.tcpdump.pcap") == 0);
+    request(router, "GET", "/debug/capture", NULL, 0, &resp);
+    assert(resp.status == 409);
+    usbx_http_response_free(&resp);
+
+    unsigned char data[32];
+    int transferred = 0;
+    assert(usbx_bulk_transfer(dev, 0x81, data, sizeof(data), &transferred, 1000) ==
+           USBX_SUCCESS);
+    unsigned char stream[4096];
+    size_t length = 0;
+    ssize_t n;
+    while ((n = capture.reader(capture.reader_cls, length, (char *)stream + length,
+                               sizeof(stream) - length)) >= 0) {
+        length += (size_t)n;
+    }
+    assert(n == USBX_HTTP_END_OF_STREAM);
+    size_t offset = USBX_CAPTURE_FILE_HEADER_SIZE;
+    struct record rec;
+    parse_record(stream, &offset, &rec);
+    assert(rec.type == 'S' && rec.devnum == handle_id % 128 && rec.busnum == 0);
+    parse_record(stream, &offset, &rec);
+    assert(rec.type == 'C' && rec.len_cap == 32 && offset == length);
+    usbx_http_response_free(&capture);
+
+    request(router, "GET", "/debug/capture/stats", NULL, 0, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"reading\": false"));
+    usbx_http_response_free(&resp);
+    struct usbx_http_pair off[1] = {{"enabled", "0"}};
+    request(router, "POST", path, off, 1, &resp);
+    assert(resp.status == 200 && !usbx_capture_enabled(dev));
+    usbx_http_response_free(&resp);
+
+    usbx_handle_remove(handle_id);
+    usbx_http_router_destroy(router);
+    printf("✓ toggle per handle, stream ends after count records, one stream at a time\n");
+}
+
+int main() {
+    printf("=== Capture Tests ===\n\n");
+
+    test_records();
+    test_ring_full();
+    test_routes();
+
+    printf("\n=== All capture tests passed ===\n");
+    return 0;
+}
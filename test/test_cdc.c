@@ -0,0 +1,327 @@
+/*
+ * Unit tests for CDC-ACM serial channels
+ *
+ * The simulated device loops everything written to it back on its IN
+ * endpoint, so writes, line batching and ring overruns can be checked
+ * without hardware. The route tests cover configuration, raw and event
+ * streams and writes.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_cdc.h"
+#include "usbx_sim.h"
+#include "usbx_util.h"
+
+/* Wait until the channel has received a number of bytes */
+static void wait_received(struct usbx_cdc *cdc, uint64_t count) {
+    struct usbx_cdc_stats stats;
+    for (int i = 0; i < 2000; i++) {
+        usbx_cdc_get_stats(cdc, &stats);
+        if (stats.received >= count) {
+            return;
+        }
+        usbx_sleep_us(1000);
+    }
+    assert(!"bytes never arrived");
+}
+
+/**
+ * Test 1: opening sends the line coding and control lines, changes reach the device
+ */
+void test_line_setup() {
+    printf("TEST: Line coding and control lines\n");
+    struct usbx_sim_cdc *sim = usbx_sim_cdc_create(4096);
+    struct usbx_device *dev = usbx_sim_cdc_device_create(sim, 64);
+    struct usbx_cdc_options opts;
+    usbx_cdc_options_init(&opts);
+    opts.coding.baud = 9600;
+    opts.coding.parity = USBX_CDC_PARITY_EVEN;
+    opts.coding.data_bits = 7;
+    opts.control_lines = USBX_CDC_CONTROL_DTR;
+    int error = 0;
+    struct usbx_cdc *cdc = usbx_cdc_open(dev, &opts, &error);
+    assert(cdc != NULL && error == USBX_SUCCESS);
+
+    struct usbx_sim_cdc_stats sim_stats;
+    usbx_sim_cdc_get_stats(sim, &sim_stats);
+    const unsigned char expected[USBX_CDC_LINE_CODING_SIZE] = {0x80, 0x25, 0, 0, 0, 2, 7};
+    assert(memcmp(sim_stats.line_coding, expected, sizeof(expected)) == 0);
+    assert(sim_stats.control_lines == USBX_CDC_CONTROL_DTR);
+
+    struct usbx_cdc_line_coding coding = opts.coding;
+    coding.baud = 1000000;
+    coding.stop_bits = 2;
+    assert(usbx_cdc_set_line_coding(cdc, &coding) == USBX_SUCCESS);
+    coding.data_bits = 9;
+    assert(usbx_cdc_set_line_coding(cdc, &coding) == USBX_ERROR_INVALID_PARAM);
+    assert(usbx_cdc_set_control_lines(cdc, USBX_CDC_CONTROL_DTR | USBX_CDC_CONTROL_RTS) ==
+           USBX_SUCCESS);
+    usbx_sim_cdc_get_stats(sim, &sim_stats);
+    assert(sim_stats.line_coding_requests == 2 && sim_stats.line_coding[0] == 0x40 &&
+           sim_stats.line_coding[2] == 0x0f && sim_stats.line_coding[4] == 2);
+    assert(sim_stats.control_lines == 3);
+
+    struct usbx_cdc_stats stats;
+    usbx_cdc_get_stats(cdc, &stats);
+    assert(stats.coding.baud == 1000000 && stats.control_lines == 3 && stats.running);
+
+    // Endpoints in the wrong direction are rejected before anything is sent
+    opts.in_endpoint = 0x02;
+    assert(usbx_cdc_open(dev, &opts, &error) == NULL && error == USBX_ERROR_INVALID_PARAM);
+
+    usbx_cdc_close(cdc);
+    usbx_device_destroy(dev);
+    usbx_sim_cdc_destroy(sim);
+    printf("✓ 9600 7E1 with DTR, then 1000000 baud with DTR and RTS\n");
+}
+
+/**
+ * Test 2: readers get complete lines, full batches or aged data
+ */
+void test_batching() {
+    printf("TEST: Line and batch flushing\n");
+    struct usbx_sim_cdc *sim = usbx_sim_cdc_create(4096);
+    struct usbx_device *dev = usbx_sim_cdc_device_create(sim, 64);
+    struct usbx_cdc *cdc = usbx_cdc_open(dev, NULL, NULL);
+    assert(cdc != NULL);
+
+    struct usbx_cdc_batch batch;
+    usbx_cdc_batch_init(&batch);
+    batch.batch_interval_ms = 10000;
+    struct usbx_cdc_reader lines;
+    usbx_cdc_reader_init(cdc, &lines, &batch, 0);
+    batch.flags = 0;
+    batch.batch_size = 8;
+    struct usbx_cdc_reader sized;
+    usbx_cdc_reader_init(cdc, &sized, &batch, 0);
+
+    char text[128];
+    usbx_sim_cdc_inject(sim, "abc\ndef", 7);
+    assert(usbx_cdc_read(cdc, &lines, (unsigned char *)text, sizeof(text), 1000) == 4);
+    assert(memcmp(text, "abc\n", 4) == 0);
+    assert(usbx_cdc_read(cdc, &lines, (unsigned char *)text, sizeof(text), 50) == 0);
+    assert(usbx_cdc_read(cdc, &sized, (unsigned char *)text, sizeof(text), 50) == 0);
+
+    // Written bytes loop back; 8 waiting bytes release everything to the sized reader
+    size_t transferred = 0;
+    assert(usbx_cdc_write(cdc, (const unsigned char *)"\nghi", 4, &transferred) ==
+           USBX_SUCCESS && transferred == 4);
+    assert(usbx_cdc_read(cdc, &lines, (unsigned char *)text, sizeof(text), 1000) == 4);
+    assert(memcmp(text, "def\n", 4) == 0);
+    assert(usbx_cdc_read(cdc, &sized, (unsigned char *)text, sizeof(text), 1000) == 11);
+    assert(memcmp(text, "abc\ndef\nghi", 11) == 0);
+
+    // "ghi" has no newline: it is released once it is batch_interval_ms old
+    struct usbx_cdc_reader aged;
+    batch.flags = USBX_CDC_FLUSH_NEWLINE;
+    batch.batch_interval_ms = 30;
+    usbx_cdc_reader_init(cdc, &aged, &batch, 3);
+    uint64_t start = usbx_now_us();
+    assert(usbx_cdc_read(cdc, &aged, (unsigned char *)text, sizeof(text), 1000) == 3);
+    assert(memcmp(text, "ghi", 3) == 0 && usbx_now_us() - start >= 25000);
+
+    struct usbx_sim_cdc_stats sim_stats;
+    usbx_sim_cdc_get_stats(sim, &sim_stats);
+    assert(sim_stats.received == 4 && sim_stats.zero_packets == 0);
+    assert(usbx_cdc_write(cdc, (const unsigned char *)"0123456789abcdef"
+                          "0123456789abcdef0123456789abcdef0123456789abcdef", 64,
+                          &transferred) == USBX_SUCCESS);
+    usbx_sim_cdc_get_stats(sim, &sim_stats);
+    assert(sim_stats.received == 68 && sim_stats.zero_packets == 1);
+
+    // After stop the rest comes out at once, then the reader sees the end
+    wait_received(cdc, 75);
+    usbx_cdc_stop(cdc);
+    assert(usbx_cdc_read(cdc, &lines, (unsigned char *)text, sizeof(text), 1000) == 64 + 3);
+    assert(usbx_cdc_read(cdc, &lines, (unsigned char *)text, sizeof(text), 1000) ==
+           USBX_ERROR_INTERRUPTED);
+
+    usbx_cdc_close(cdc);
+    usbx_device_destroy(dev);
+    usbx_sim_cdc_destroy(sim);
+    printf("✓ newline, size and age flushing; writes loop back\n");
+}
+
+/**
+ * Test 3: late readers replay history, slow readers lose the oldest bytes
+ */
+void test_ring() {
+    printf("TEST: History ring\n");
+    struct usbx_sim_cdc *sim = usbx_sim_cdc_create(64 * 1024);
+    struct usbx_device *dev = usbx_sim_cdc_device_create(sim, 512);
+    struct usbx_cdc_options opts;
+    usbx_cdc_options_init(&opts);
+    opts.ring_size = 8192;
+    struct usbx_cdc *cdc = usbx_cdc_open(dev, &opts, NULL);
+    assert(cdc != NULL);
+
+    struct usbx_cdc_batch batch;
+    usbx_cdc_batch_init(&batch);
+    batch.flags = 0;
+    struct usbx_cdc_reader slow;
+    usbx_cdc_reader_init(cdc, &slow, &batch, 0);
+
+    size_t length = 20000;
+    unsigned char *data = malloc(length), *copy = malloc(length);
+    usbx_sim_fill_pattern(data, length, 0);
+    assert(usbx_sim_cdc_inject(sim, data, length) == length);
+    wait_received(cdc, length);
+
+    struct usbx_cdc_stats stats;
+    usbx_cdc_get_stats(cdc, &stats);
+    assert(stats.received == length && stats.oldest == length - 8192);
+
+    // The slow reader skips what was overwritten and reads the rest in order
+    size_t total = 0;
+    long n;
+    while ((n = usbx_cdc_read(cdc, &slow, copy + total, length - total, 0)) > 0) {
+        total += (size_t)n;
+    }
+    assert(total == 8192 && slow.dropped == length - 8192);
+    assert(memcmp(copy, data + slow.dropped, total) == 0);
+
+    // A reader asking for 100 bytes of history starts there
+    struct usbx_cdc_reader late;
+    batch.batch_size = 1;
+    usbx_cdc_reader_init(cdc, &late, &batch, 100);
+    assert(late.cursor == length - 100);
+    assert(usbx_cdc_read(cdc, &late, copy, length, 0) == 100);
+    assert(memcmp(copy, data + length - 100, 100) == 0);
+    usbx_cdc_reader_init(cdc, &late, &batch, length);
+    assert(late.cursor == stats.oldest && late.dropped == 0);
+
+    usbx_cdc_close(cdc);
+    usbx_device_destroy(dev);
+    usbx_sim_cdc_destroy(sim);
+    free(data);
+    free(copy);
+    printf("✓ %zu bytes through an 8 KiB ring: %llu dropped, backlog replayed\n", length,
+           (unsigned long long)(length - 8192));
+}
+
+static void request(struct usbx_http_router *router, const char *method, const char *path,
+                    struct usbx_http_pair *args, int num_args, struct usbx_http_pair *headers,
+                    int num_headers, const char *body, struct usbx_http_response *resp) {
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = method;
+    req.path = path;
+    req.args = args;
+    req.num_args = num_args;
+    req.headers = headers;
+    req.num_headers = num_headers;
+    req.body = (const unsigned char *)body;
+    req.body_length = body ? strlen(body) : 0;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+/* Read a streaming response until it contains a string */
+static size_t read_until(struct usbx_http_response *resp, char *text, size_t length,
+                         size_t size, const char *needle) {
+    while (!strstr(text, needle)) {
+        ssize_t n = resp->reader(resp->reader_cls, length, text + length, size - length - 1);
+        assert(n >= 0);
+        length += (size_t)n;
+        text[length] = '\0';
+    }
+    return length;
+}
+
+/**
+ * Test 4: /handles/{id}/serial routes
+ */
+void test_routes() {
+    printf("TEST: /handles/{id}/serial\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    struct usbx_sim_cdc *sim = usbx_sim_cdc_create(4096);
+    int handle_id = usbx_handle_add(usbx_sim_cdc_device_create(sim, 64), NULL);
+    char path[64], data_path[64];
+    snprintf(path, sizeof(path), "/handles/%d/serial", handle_id);
+    snprintf(data_path, sizeof(data_path), "/handles/%d/serial/data", handle_id);
+    struct usbx_http_response resp;
+
+    request(router, "GET", path, NULL, 0, NULL, 0, NULL, &resp);
+    assert(resp.status == 404);
+    usbx_http_response_free(&resp);
+    struct usbx_http_pair bad[1] = {{"parity", "often"}};
+    request(router, "POST", path, bad, 1, NULL, 0, NULL, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    struct usbx_http_pair open_args[3] = {{"baud", "57600"}, {"stop_bits", "1.5"},
+                                          {"rts", "0"}};
+    request(router, "POST", path, open_args, 3, NULL, 0, NULL, &resp);
+    assert(resp.status == 201 && strstr(resp.body, "\"baud\": 57600") &&
+           strstr(resp.body, "\"stop_bits\": \"1.5\"") && strstr(resp.body, "\"rts\": false"));
+    usbx_http_response_free(&resp);
+    struct usbx_sim_cdc_stats sim_stats;
+    usbx_sim_cdc_get_stats(sim, &sim_stats);
+    assert(sim_stats.control_lines == USBX_CDC_CONTROL_DTR && sim_stats.line_coding[4] == 1);
+
+    struct usbx_http_pair change[1] = {{"parity", "odd"}};
+    request(router, "POST", path, change, 1, NULL, 0, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"parity\": \"odd\"") &&
+           strstr(resp.body, "\"baud\": 57600"));
+    usbx_http_response_free(&resp);
+
+    // A raw stream and an event stream of the same output
+    struct usbx_http_response raw, events;
+    struct usbx_http_pair accept[1] = {{"Accept", "text/event-stream"}};
+    request(router, "GET", data_path, NULL, 0, NULL, 0, NULL, &raw);
+    assert(raw.status == 200 && raw.reader != NULL);
+    request(router, "GET", data_path, NULL, 0, accept, 1, NULL, &events);
+    assert(events.status == 200 && strcmp(events.content_type, "text/event-stream") == 0);
+
+    request(router, "POST", data_path, NULL, 0, NULL, 0, "boot: \"ok\"\n", &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"transferred\": 11"));
+    usbx_http_response_free(&resp);
+
+    char text[4096] = "";
+    size_t length = read_until(&raw, text, 0, sizeof(text), "\n");
+    assert(length == 11 && strcmp(text, "boot: \"ok\"\n") == 0);
+    text[0] = '\0';
+    length = read_until(&events, text, 0, sizeof(text), "}\n\n");
+    assert(strstr(text, "event: data\ndata: {\"offset\": 0, \"dropped\": 0, "
+                        "\"text\": \"boot: \\\"ok\\\"\\n\"}\n\n") == text);
+
+    request(router, "GET", path, NULL, 0, NULL, 0, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"received\": 11") &&
+           strstr(resp.body, "\"sent\": 11"));
+    usbx_http_response_free(&resp);
+
+    // Closing the handle ends both streams
+    assert(usbx_handle_remove(handle_id) == USBX_SUCCESS);
+    ssize_t n;
+    while ((n = events.reader(events.reader_cls, length, text + length, 256)) >= 0) {
+        length += (size_t)n;
+        text[length] = '\0';
+        assert(length < sizeof(text) - 256);
+    }
+    assert(n == USBX_HTTP_END_OF_STREAM && strstr(text, "event: end\ndata: {\"code\": -10"));
+    while ((n = raw.reader(raw.reader_cls, 0, text, 256)) >= 0) {
+    }
+    assert(n == USBX_HTTP_END_OF_STREAM);
+    usbx_http_response_free(&raw);
+    usbx_http_response_free(&events);
+
+    usbx_sim_cdc_destroy(sim);
+    usbx_http_router_destroy(router);
+    printf("✓ configure, stream raw and as events, write\n");
+}
+
+int main() {
+    printf("=== CDC-ACM Serial Tests ===\n\n");
+
+    test_line_setup();
+    test_batching();
+    test_ring();
+    test_routes();
+
+    printf("\n=== All serial tests passed ===\n");
+    return 0;
+}
@@ -0,0 +1,408 @@
+/*
+ * Unit tests for HTTP content coding
+ *
+ * Covers Accept-Encoding negotiation, the streaming codecs, compressed
+ * streaming responses and compressed or streamed raw bulk uploads into the
+ * simulated pattern sink. Codec tests are skipped when the service is built
+ * without zlib.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_compress.h"
+#include "usbx_sim.h"
+
+#define EP_BULK_OUT 0x02
+
+static int have_gzip(void) {
+    return usbx_encoding_parse("gzip") == USBX_ENCODING_GZIP;
+}
+
+/* Run a whole buffer through a codec; returns a malloc'd result */
+static unsigned char *transcode(int encoding, int compress, const unsigned char *data,
+                                size_t length, size_t *out_length) {
+    struct usbx_zstream *z = usbx_zstream_create(encoding, compress, 6);
+    size_t capacity = length + 4096, used = 0;
+    unsigned char *result = malloc(capacity);
+    assert(z && result);
+
+    for (;;) {
+        if (capacity - used < 65536) {
+            capacity *= 2;
+            result = realloc(result, capacity);
+            assert(result);
+        }
+        unsigned char *out = result + used;
+        size_t out_left = capacity - used;
+        int status = usbx_zstream_process(z, &data, &length, &out, &out_left,
+                                          compress ? USBX_ZSTREAM_FINISH : USBX_ZSTREAM_RUN);
+        assert(status >= 0);
+        used = capacity - out_left;
+        if (status == 1 && length == 0) {
+            break;
+        }
+    }
+    usbx_zstream_destroy(z);
+    *out_length = used;
+    return result;
+}
+
+/**
+ * Test 1: coding names and Accept-Encoding negotiation
+ */
+void test_negotiate() {
+    printf("TEST: content coding negotiation\n");
+    assert(usbx_encoding_parse(NULL) == USBX_ENCODING_IDENTITY);
+    assert(usbx_encoding_parse(" identity ") == USBX_ENCODING_IDENTITY);
+    assert(usbx_encoding_parse("br") == USBX_ERROR_NOT_SUPPORTED);
+    assert(usbx_encoding_negotiate(NULL) == USBX_ENCODING_IDENTITY);
+    assert(usbx_encoding_negotiate("br, identity") == USBX_ENCODING_IDENTITY);
+    if (!have_gzip()) {
+        printf("✓ identity only (built without zlib)\n");
+        return;
+    }
+    assert(usbx_encoding_parse("GZIP") == USBX_ENCODING_GZIP);
+    assert(usbx_encoding_negotiate("gzip, deflate, br") == USBX_ENCODING_GZIP);
+    assert(usbx_encoding_negotiate("deflate;q=1.0, gzip;q=0.5") == USBX_ENCODING_GZIP);
+    assert(usbx_encoding_negotiate("gzip;q=0") == USBX_ENCODING_IDENTITY);
+    assert(usbx_encoding_negotiate("*") != USBX_ENCODING_IDENTITY);
+    assert(usbx_encoding_negotiate("gzip;q=0, *") != USBX_ENCODING_GZIP);
+    printf("✓ names, q-values and wildcards\n");
+}
+
+/**
+ * Test 2: gzip round trip, including concatenated members
+ */
+void test_codec() {
+    printf("TEST: gzip stream round trip\n");
+    if (!have_gzip()) {
+        printf("✓ skipped (built without zlib)\n");
+        return;
+    }
+    size_t size = 3 * 1024 * 1024 + 77;
+    unsigned char *data = malloc(size);
+    usbx_sim_fill_pattern(data, size, 0);
+
+    size_t compressed_length, decoded_length;
+    unsigned char *compressed = transcode(USBX_ENCODING_GZIP, 1, data, size,
+                                          &compressed_length);
+    assert(compressed_length < size);
+    unsigned char *decoded = transcode(USBX_ENCODING_GZIP, 0, compressed, compressed_length,
+                                       &decoded_length);
+    assert(decoded_length == size && memcmp(decoded, data, size) == 0);
+    free(decoded);
+
+    // Two members decode as their concatenation
+    unsigned char *twice = malloc(2 * compressed_length);
+    memcpy(twice, compressed, compressed_length);
+    memcpy(twice + compressed_length, compressed, compressed_length);
+    decoded = transcode(USBX_ENCODING_GZIP, 0, twice, 2 * compressed_length, &decoded_length);
+    assert(decoded_length == 2 * size && memcmp(decoded + size, data, size) == 0);
+    free(decoded);
+
+    // Corrupt input is reported
+    struct usbx_zstream *z = usbx_zstream_create(USBX_ENCODING_GZIP, 0, 0);
+    const unsigned char *in = (const unsigned char *)"definitely not gzip";
+    size_t in_left = 19, out_left = 64;
+    unsigned char out_buffer[64], *out = out_buffer;
+    assert(usbx_zstream_process(z, &in, &in_left, &out, &out_left, USBX_ZSTREAM_RUN) ==
+           USBX_ERROR_INVALID_PARAM);
+    usbx_zstream_destroy(z);
+
+    free(twice);
+    free(compressed);
+    free(data);
+    printf("✓ %zu bytes compressed to %zu and restored\n", size, compressed_length);
+}
+
+/** @brief Reader producing two bursts separated by two "nothing yet" calls */
+struct burst_source {
+    unsigned char data[50000];
+    int idle_calls;
+};
+
+static ssize_t burst_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    struct burst_source *source = cls;
+    size_t half = sizeof(source->data) / 2;
+
+    if (pos == half && source->idle_calls < 2) {
+        source->idle_calls++;
+        return 0;
+    }
+    if (pos >= sizeof(source->data)) {
+        return USBX_HTTP_END_OF_STREAM;
+    }
+    size_t end = pos < half ? half : sizeof(source->data);
+    size_t length = end - (size_t)pos < max ? end - (size_t)pos : max;
+    memcpy(buf, source->data + pos, length);
+    return (ssize_t)length;
+}
+
+/**
+ * Test 3: streaming responses are compressed and flushed while idle
+ */
+void test_response() {
+    printf("TEST: compressed streaming response\n");
+    struct usbx_http_pair headers[1] = {{"Accept-Encoding", "gzip"}};
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.headers = headers;
+    req.num_headers = 1;
+
+    struct burst_source source = {.idle_calls = 0};
+    usbx_sim_fill_pattern(source.data, sizeof(source.data), 0);
+    struct usbx_http_response resp;
+    memset(&resp, 0, sizeof(resp));
+    resp.status = 200;
+    usbx_http_set_reader(&resp, "application/octet-stream", burst_read, &source, NULL);
+
+    int encoding = usbx_compress_response(&req, &resp);
+    if (!have_gzip()) {
+        assert(encoding == USBX_ENCODING_IDENTITY && resp.reader == burst_read);
+        usbx_http_response_free(&resp);
+        printf("✓ left uncompressed (built without zlib)\n");
+        return;
+    }
+    assert(encoding == USBX_ENCODING_GZIP && resp.num_headers == 2);
+    assert(strcmp(resp.headers[0].name, "Content-Encoding") == 0);
+    assert(strcmp(resp.headers[0].value, "gzip") == 0);
+
+    // Read until the idle point; everything so far must decode on its own
+    unsigned char body[65536];
+    size_t length = 0;
+    ssize_t n;
+    while ((n = resp.reader(resp.reader_cls, length, (char *)body + length, 100)) > 0) {
+        length += (size_t)n;
+    }
+    assert(n == 0 && source.idle_calls == 2);
+    struct usbx_zstream *z = usbx_zstream_create(USBX_ENCODING_GZIP, 0, 0);
+    unsigned char decoded[sizeof(source.data)];
+    const unsigned char *in = body;
+    size_t in_left = length, out_left = sizeof(decoded);
+    unsigned char *out = decoded;
+    assert(usbx_zstream_process(z, &in, &in_left, &out, &out_left, USBX_ZSTREAM_RUN) == 0);
+    assert(sizeof(decoded) - out_left == sizeof(source.data) / 2);
+
+    while ((n = resp.reader(resp.reader_cls, length, (char *)body + length, 1000)) > 0) {
+        length += (size_t)n;
+    }
+    assert(n == USBX_HTTP_END_OF_STREAM);
+    in_left = length - (size_t)(in - body);
+    assert(usbx_zstream_process(z, &in, &in_left, &out, &out_left, USBX_ZSTREAM_RUN) == 1);
+    assert(out_left == 0 && memcmp(decoded, source.data, sizeof(decoded)) == 0);
+    usbx_zstream_destroy(z);
+    usbx_http_response_free(&resp);
+    printf("✓ %zu bytes streamed as %zu, flushed at the idle point\n", sizeof(source.data),
+           length);
+}
+
+static void upload(struct usbx_http_router *router, const char *path, const char *encoding,
+                   const unsigned char *body, size_t length, struct usbx_http_response *resp) {
+    struct usbx_http_pair headers[1] = {{"Content-Encoding", encoding}};
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = "PUT";
+    req.path = path;
+    req.headers = headers;
+    req.num_headers = encoding ? 1 : 0;
+    req.body = body;
+    req.body_length = length;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+/**
+ * Test 4: raw and gzip bulk uploads reach the device intact
+ */
+void test_upload() {
+    printf("TEST: PUT /handles/{id}/bulk/{ep}\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+
+    struct usbx_sim_endpoint_config endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.address = EP_BULK_OUT;
+    endpoint.type = USBX_TRANSFER_TYPE_BULK;
+    endpoint.max_packet_size = 512;
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = &endpoint;
+    config.num_endpoints = 1;
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    int handle_id = usbx_handle_add(dev, NULL);
+
+    size_t size = 5 * 1024 * 1024 + 300;
+    unsigned char *data = malloc(size);
+    usbx_sim_fill_pattern(data, size, 0);
+    char path[64];
+    snprintf(path, sizeof(path), "/handles/%d/bulk/2", handle_id);
+    struct usbx_http_response resp;
+    struct usbx_sim_endpoint_stats stats;
+
+    upload(router, path, NULL, data, 4096, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"transferred\": 4096"));
+    usbx_http_response_free(&resp);
+    upload(router, path, "br", data, 4096, &resp);
+    assert(resp.status == 415);
+    usbx_http_response_free(&resp);
+    snprintf(path, sizeof(path), "/handles/%d/bulk/0x81", handle_id);
+    upload(router, path, NULL, data, 4096, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+
+    if (have_gzip()) {
+        // The sink expects the pattern to continue at offset 4096
+        size_t compressed_length;
+        unsigned char *compressed = transcode(USBX_ENCODING_GZIP, 1, data + 4096, size - 4096,
+                                              &compressed_length);
+        snprintf(path, sizeof(path), "/handles/%d/bulk/2", handle_id);
+        upload(router, path, "gzip", compressed, compressed_length, &resp);
+        assert(resp.status == 200);
+        char expected[64];
+        snprintf(expected, sizeof(expected), "\"transferred\": %zu", size - 4096);
+        assert(strstr(resp.body, expected) && strstr(resp.body, "\"encoding\": \"gzip\""));
+        usbx_http_response_free(&resp);
+        usbx_sim_get_endpoint_stats(dev, EP_BULK_OUT, &stats);
+        assert(stats.bytes == size && stats.pattern_errors == 0);
+
+        // A truncated body is rejected after the complete chunks were sent
+        upload(router, path, "gzip", compressed, compressed_length / 2, &resp);
+        assert(resp.status == 400);
+        usbx_http_response_free(&resp);
+        free(compressed);
+    }
+
+    usbx_handle_remove(handle_id);
+    usbx_http_router_destroy(router);
+    free(data);
+    printf("✓ identity and gzip uploads delivered, bad codings rejected\n");
+}
+
+/** @brief Body that arrives in small pieces, optionally cut off by the client */
+struct piece_source {
+    const unsigned char *data;
+    size_t length;
+    size_t pos;
+    size_t piece;
+    int fail;                    /* the client goes away at the end of the data */
+};
+
+static long piece_read(void *cls, void *buf, size_t max) {
+    struct piece_source *source = cls;
+    size_t n = source->length - source->pos;
+
+    if (n == 0) {
+        return source->fail ? USBX_ERROR_IO : 0;
+    }
+    if (n > source->piece) {
+        n = source->piece;
+    }
+    if (n > max) {
+        n = max;
+    }
+    memcpy(buf, source->data + source->pos, n);
+    source->pos += n;
+    return (long)n;
+}
+
+static void upload_streamed(struct usbx_http_router *router, const char *path,
+                            const char *encoding, struct piece_source *source,
+                            struct usbx_http_response *resp) {
+    struct usbx_http_pair headers[1] = {{"Content-Encoding", encoding}};
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = "PUT";
+    req.path = path;
+    req.headers = headers;
+    req.num_headers = encoding ? 1 : 0;
+    req.body_source = piece_read;
+    req.body_cls = source;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+/**
+ * Test 5: bulk uploads read their body as it arrives
+ */
+void test_upload_streamed() {
+    printf("TEST: PUT /handles/{id}/bulk/{ep} with a streamed body\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    assert(usbx_http_route_streams_body(router, "PUT", "/handles/1/bulk/2"));
+    assert(!usbx_http_route_streams_body(router, "GET", "/devices"));
+
+    struct usbx_sim_endpoint_config endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.address = EP_BULK_OUT;
+    endpoint.type = USBX_TRANSFER_TYPE_BULK;
+    endpoint.max_packet_size = 512;
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = &endpoint;
+    config.num_endpoints = 1;
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    int handle_id = usbx_handle_add(dev, NULL);
+
+    size_t size = 3 * 1024 * 1024 + 300, first = 1024 * 1024 + 100;
+    unsigned char *data = malloc(size);
+    usbx_sim_fill_pattern(data, size, 0);
+    char path[64], expected[64];
+    snprintf(path, sizeof(path), "/handles/%d/bulk/2", handle_id);
+    struct usbx_http_response resp;
+    struct usbx_sim_endpoint_stats stats;
+
+    // Identity body in pieces smaller than a packet
+    struct piece_source source = {.data = data, .length = first, .piece = 1000};
+    upload_streamed(router, path, NULL, &source, &resp);
+    assert(resp.status == 200);
+    snprintf(expected, sizeof(expected), "\"received\": %zu", first);
+    assert(strstr(resp.body, expected));
+    snprintf(expected, sizeof(expected), "\"transferred\": %zu", first);
+    assert(strstr(resp.body, expected));
+    usbx_http_response_free(&resp);
+
+    if (have_gzip()) {
+        size_t compressed_length;
+        unsigned char *compressed = transcode(USBX_ENCODING_GZIP, 1, data + first, size - first,
+                                              &compressed_length);
+        source = (struct piece_source){.data = compressed, .length = compressed_length,
+                                       .piece = 777};
+        upload_streamed(router, path, "gzip", &source, &resp);
+        assert(resp.status == 200);
+        snprintf(expected, sizeof(expected), "\"received\": %zu", compressed_length);
+        assert(strstr(resp.body, expected));
+        snprintf(expected, sizeof(expected), "\"transferred\": %zu", size - first);
+        assert(strstr(resp.body, expected));
+        usbx_http_response_free(&resp);
+        usbx_sim_get_endpoint_stats(dev, EP_BULK_OUT, &stats);
+        assert(stats.bytes == size && stats.pattern_errors == 0);
+
+        // A client that goes away mid-body fails the upload
+        source = (struct piece_source){.data = compressed, .length = compressed_length / 2,
+                                       .piece = 4096, .fail = 1};
+        upload_streamed(router, path, "gzip", &source, &resp);
+        assert(resp.status == 400);
+        usbx_http_response_free(&resp);
+        free(compressed);
+    }
+
+    usbx_handle_remove(handle_id);
+    usbx_http_router_destroy(router);
+    free(data);
+    printf("✓ identity and gzip bodies sent as they arrived\n");
+}
+
+int main() {
+    printf("=== Content Coding Tests ===\n\n");
+
+    test_negotiate();
+    test_codec();
+    test_response();
+    test_upload();
+    test_upload_streamed();
+
+    printf("\n=== All content coding tests passed ===\n");
+    return 0;
+}
@@ -0,0 +1,348 @@
+/*
+ * Unit tests for the runtime configuration
+ *
+ * Settings parse from "key = value" lines with line-numbered errors and
+ * format back to text they accept. A change is applied to the memory
+ * budget, the quotas and the bulk, scheduler and interrupt defaults at once
+ * or not at all, and one that touches a startup-only setting is rejected.
+ * Replaced snapshots are freed after their grace period.
+ * A reload rebuilds the settings from the startup values and the file.
+ * Readers running alongside a stream of changes never see half of one,
+ * and /admin/config reports and changes the settings.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "usbx_api.h"
+#include "usbx_budget.h"
+#include "usbx_bulk.h"
+#include "usbx_config.h"
+#include "usbx_interrupt.h"
+#include "usbx_sched.h"
+#include "usbx_util.h"
+
+#define UPDATES 2000
+
+static char path[64];
+
+static void write_file(const char *text) {
+    FILE *file = fopen(path, "w");
+    assert(file);
+    fputs(text, file);
+    fclose(file);
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+static int update(const char *text, char *error) {
+    return usbx_config_update(text, strlen(text), error, 256);
+}
+
+/**
+ * Test 1: parsing, errors and formatting
+ */
+void test_parse() {
+    printf("TEST: Parse and format settings\n");
+    struct usbx_config config, copy;
+    char error[256], value[USBX_CONFIG_PATH_MAX], again[USBX_CONFIG_PATH_MAX];
+    const char *text = "# tuning\n\n  segment_size = 65536\r\n"
+                       "memory_budget_mb=64\nblob_dir = /tmp/usbx blobs  \n";
+
+    usbx_config_defaults(&config);
+    assert(config.version == 0 && config.segment_size == USBX_SEGMENT_DEFAULT_SIZE &&
+           config.port == USBX_DEFAULT_PORT);
+    assert(usbx_config_parse(&config, text, strlen(text), error, sizeof(error)) ==
+           USBX_SUCCESS);
+    assert(config.segment_size == 65536 && config.memory_budget == 64ULL * 1024 * 1024);
+    assert(strcmp(config.blob_dir, "/tmp/usbx blobs") == 0);
+
+    const char *unknown = "segment_size = 1\n\nsegment_sise = 2\n";
+    assert(usbx_config_parse(&config, unknown, strlen(unknown), error, sizeof(error)) ==
+           USBX_ERROR_NOT_FOUND);
+    assert(strcmp(error, "line 3: unknown setting 'segment_sise'") == 0);
+    const char *invalid[] = {"segment_in_flight = 0", "compression_level = 10", "port = -1",
+                             "segment_size = 12k", "quota_byte_burst = 99999999999999999999",
+                             "blob_dir =", "segment_size"};
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        assert(usbx_config_parse(&config, invalid[i], strlen(invalid[i]), error,
+                                 sizeof(error)) == USBX_ERROR_INVALID_PARAM);
+        assert(strncmp(error, "line 1: ", 8) == 0);
+    }
+
+    // Every setting formats to text it accepts
+    usbx_config_defaults(&copy);
+    for (int i = 0; i < usbx_config_num_keys(); i++) {
+        const struct usbx_config_key *key = usbx_config_key(i);
+        assert(usbx_config_format(&config, key->name, value, sizeof(value)) == USBX_SUCCESS);
+        assert(usbx_config_set(&copy, key->name, value) == USBX_SUCCESS);
+        usbx_config_format(&copy, key->name, again, sizeof(again));
+        assert(strcmp(value, again) == 0);
+    }
+    assert(usbx_config_key(usbx_config_num_keys()) == NULL);
+    assert(usbx_config_format(&config, "nope", value, sizeof(value)) == USBX_ERROR_NOT_FOUND);
+    printf("✓ %d settings round-trip, errors name the line\n", usbx_config_num_keys());
+}
+
+/**
+ * Test 2: updates apply entirely or not at all
+ */
+void test_update() {
+    printf("TEST: Atomic updates\n");
+    struct usbx_config startup;
+    struct usbx_config_stats stats;
+    struct usbx_segment_options opts;
+    struct usbx_budget_stats budget;
+    struct usbx_quota_limits quota;
+    struct usbx_sched_config sched;
+    struct usbx_interrupt_options interrupt;
+    char error[256];
+
+    usbx_config_defaults(&startup);
+    assert(usbx_config_start(&startup, NULL, error, sizeof(error)) == USBX_SUCCESS);
+    assert(usbx_config_current()->version == 1);
+
+    assert(update("segment_size = 65536\nsegment_in_flight = 8\ncompression_level = 7\n"
+                  "memory_budget_mb = 2\nquota_requests_per_sec = 50\nsched_max_in_flight = 2\n"
+                  "sched_quantum = 4096\ninterrupt_slots = 16\n", error) == USBX_SUCCESS);
+    const struct usbx_config *config = usbx_config_current();
+    assert(config->version == 2 && config->segment_size == 65536);
+    usbx_segment_options_init(&opts);
+    assert(opts.segment_size == 65536 && opts.max_in_flight == 8 &&
+           opts.timeout == USBX_SEGMENT_DEFAULT_TIMEOUT);
+    usbx_budget_get_stats(&budget);
+    usbx_quota_get_defaults(&quota);
+    assert(budget.capacity == 2 * 1024 * 1024 && quota.requests_per_sec == 50 &&
+           config->compression_level == 7);
+    usbx_sched_config_init(&sched);
+    usbx_interrupt_options_init(&interrupt);
+    assert(!sched.enabled && sched.max_in_flight == 2 && sched.quantum == 4096 &&
+           interrupt.slots == 16);
+
+    // One bad line rejects the good ones before it
+    assert(update("compression_level = 2\nsegment_in_flight = 65\n", error) ==
+           USBX_ERROR_INVALID_PARAM);
+    assert(strcmp(error, "line 2: invalid value for 'segment_in_flight'") == 0);
+    assert(usbx_config_current() == config);
+
+    // Startup-only settings may be repeated but not changed
+    assert(update("compression_level = 2\nport = 9000\n", error) == USBX_ERROR_NOT_SUPPORTED);
+    assert(strcmp(error, "'port' cannot change without a restart") == 0);
+    assert(usbx_config_current() == config);
+    assert(update("port = 8080\ncompression_level = 2\n", error) == USBX_SUCCESS);
+    assert(usbx_config_current()->version == 3 && usbx_config_current()->compression_level == 2);
+    assert(config->compression_level == 7);     // older snapshots stay intact
+
+    assert(usbx_config_reload(error, sizeof(error)) == USBX_ERROR_NOT_FOUND);
+    usbx_config_get_stats(&stats);
+    assert(stats.version == 3 && stats.applied == 3 && stats.rejected == 3);
+    assert(stats.retained == 3);
+
+    // A later change frees the snapshots whose grace period is over
+    sleep_ms(USBX_CONFIG_GRACE_MS + 100);
+    assert(update("compression_level = 3\n", error) == USBX_SUCCESS);
+    usbx_config_get_stats(&stats);
+    assert(stats.version == 4 && stats.retained == 2);
+
+    usbx_config_reset();
+    assert(usbx_config_current()->version == 0);
+    usbx_config_defaults(&startup);
+    assert(usbx_config_start(&startup, NULL, error, sizeof(error)) == USBX_SUCCESS);
+    usbx_config_reset();
+    printf("✓ partial and startup-only changes rejected as a whole\n");
+}
+
+/**
+ * Test 3: reloads rebuild the settings from the startup values and the file
+ */
+void test_reload() {
+    printf("TEST: Reload from file\n");
+    struct usbx_config startup;
+    char error[256];
+
+    usbx_config_defaults(&startup);
+    startup.drain_timeout_ms = 1234;            // e.g. from the environment
+    write_file("segment_timeout_ms = 250\ndiscovery_workers = 4\n");
+    assert(usbx_config_start(&startup, path, error, sizeof(error)) == USBX_SUCCESS);
+    const struct usbx_config *config = usbx_config_current();
+    assert(config->segment_timeout_ms == 250 && config->discovery_workers == 4 &&
+           config->drain_timeout_ms == 1234);
+
+    assert(update("drain_timeout_ms = 10\nsegment_size = 4096\n", error) == USBX_SUCCESS);
+    write_file("segment_timeout_ms = 500\ndiscovery_workers = 4\n");
+    assert(usbx_config_reload(error, sizeof(error)) == USBX_SUCCESS);
+    config = usbx_config_current();
+    assert(config->version == 3 && config->segment_timeout_ms == 500);
+    assert(config->drain_timeout_ms == 1234 && config->segment_size == USBX_SEGMENT_DEFAULT_SIZE);
+
+    // Dropping the line reverts discovery_workers to its startup value
+    write_file("segment_timeout_ms = 750\n");
+    assert(usbx_config_reload(error, sizeof(error)) == USBX_ERROR_NOT_SUPPORTED);
+    assert(strstr(error, "'discovery_workers'"));
+    write_file("segment_timeout_ms = 750\ndiscovery_workers = 4\nbogus = 1\n");
+    assert(usbx_config_reload(error, sizeof(error)) == USBX_ERROR_NOT_FOUND);
+    assert(strstr(error, path) && strstr(error, "line 3: unknown setting 'bogus'"));
+    unlink(path);
+    assert(usbx_config_reload(error, sizeof(error)) == USBX_ERROR_IO);
+    assert(usbx_config_current() == config);
+
+    assert(usbx_config_start(&startup, path, error, sizeof(error)) == USBX_ERROR_IO);
+    usbx_config_reset();
+    printf("✓ reload applied, then rejected for a startup-only change, a typo and no file\n");
+}
+
+struct reader {
+    int *stop;
+    unsigned long reads;
+    unsigned long torn;
+    uint64_t versions;
+};
+
+static void *read_loop(void *arg) {
+    struct reader *reader = arg;
+    uint64_t last = 0;
+
+    while (!__atomic_load_n(reader->stop, __ATOMIC_ACQUIRE)) {
+        const struct usbx_config *config = usbx_config_current();
+        // Every update below keeps these three in step
+        if (config->segment_size != (size_t)config->segment_timeout_ms * 512 ||
+            config->discovery_timeout_ms != config->segment_timeout_ms) {
+            reader->torn++;
+        }
+        if (config->version < last) {
+            reader->torn++;
+        }
+        if (config->version != last) {
+            reader->versions++;
+            last = config->version;
+        }
+        reader->reads++;
+    }
+    return NULL;
+}
+
+/**
+ * Test 4: lock-free readers never see half of a change
+ */
+void test_readers() {
+    printf("TEST: Readers during updates\n");
+    struct usbx_config startup;
+    struct reader readers[4];
+    pthread_t threads[4];
+    int stop = 0;
+    char text[128], error[256];
+
+    usbx_config_defaults(&startup);
+    startup.segment_timeout_ms = 1;
+    startup.segment_size = 512;
+    startup.discovery_timeout_ms = 1;
+    assert(usbx_config_start(&startup, NULL, error, sizeof(error)) == USBX_SUCCESS);
+    for (int i = 0; i < 4; i++) {
+        memset(&readers[i], 0, sizeof(readers[i]));
+        readers[i].stop = &stop;
+        assert(pthread_create(&threads[i], NULL, read_loop, &readers[i]) == 0);
+    }
+    uint64_t begin = usbx_now_us();
+    for (int i = 2; i < UPDATES + 2; i++) {
+        snprintf(text, sizeof(text), "discovery_timeout_ms = %d\nsegment_size = %d\n"
+                 "segment_timeout_ms = %d\n", i, i * 512, i);
+        assert(update(text, error) == USBX_SUCCESS);
+    }
+    uint64_t elapsed = usbx_now_us() - begin;
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    unsigned long reads = 0;
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        assert(readers[i].torn == 0);
+        reads += readers[i].reads;
+    }
+    assert(usbx_config_current()->version == UPDATES + 1);
+    usbx_config_reset();
+    printf("✓ %lu reads across %d updates (%.1f us each), none torn\n", reads, UPDATES,
+           (double)elapsed / UPDATES);
+}
+
+/**
+ * Test 5: /admin/config
+ */
+void test_routes() {
+    printf("TEST: /admin/config\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    struct usbx_http_request req;
+    struct usbx_http_response resp;
+    struct usbx_config startup;
+    char error[256];
+
+    assert(router && usbx_api_register_all(router) == 0);
+    usbx_config_defaults(&startup);
+    write_file("compression_level = 4\n");
+    assert(usbx_config_start(&startup, path, error, sizeof(error)) == USBX_SUCCESS);
+
+    memset(&req, 0, sizeof(req));
+    req.method = "GET";
+    req.path = "/admin/config";
+    usbx_http_dispatch(router, &req, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"version\": 1, ") &&
+           strstr(resp.body, "\"compression_level\": 4, ") &&
+           strstr(resp.body, "\"blob_dir\": \"" USBX_DEFAULT_BLOB_DIR "\"") &&
+           strstr(resp.body, "\"restart_required\": [\"port\", \"discovery_workers\", "
+                  "\"blob_dir\", \"blob_capacity_mb\"]"));
+    usbx_http_response_free(&resp);
+
+    req.method = "POST";
+    req.body = (const unsigned char *)"compression_level = 9\n";
+    req.body_length = strlen((const char *)req.body);
+    usbx_http_dispatch(router, &req, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"version\": 2, ") &&
+           strstr(resp.body, "\"compression_level\": 9, "));
+    usbx_http_response_free(&resp);
+
+    req.body = (const unsigned char *)"blob_capacity_mb = 1";
+    req.body_length = strlen((const char *)req.body);
+    usbx_http_dispatch(router, &req, &resp);
+    assert(resp.status == 409 && strstr(resp.body, "USBX_ERROR_NOT_SUPPORTED"));
+    usbx_http_response_free(&resp);
+    req.body = (const unsigned char *)"compression = 9";
+    req.body_length = strlen((const char *)req.body);
+    usbx_http_dispatch(router, &req, &resp);
+    assert(resp.status == 400 && strstr(resp.body, "unknown setting 'compression'"));
+    usbx_http_response_free(&resp);
+
+    // An empty body reloads the file
+    req.body = NULL;
+    req.body_length = 0;
+    usbx_http_dispatch(router, &req, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"version\": 3, ") &&
+           strstr(resp.body, "\"compression_level\": 4, "));
+    usbx_http_response_free(&resp);
+    unlink(path);
+    usbx_http_dispatch(router, &req, &resp);
+    assert(resp.status == 500 && strstr(resp.body, "USBX_ERROR_IO"));
+    usbx_http_response_free(&resp);
+
+    usbx_config_reset();
+    usbx_http_router_destroy(router);
+    printf("✓ reported, updated, rejected with 409 and 400, reloaded\n");
+}
+
+int main() {
+    printf("=== Runtime Configuration Tests ===\n\n");
+    snprintf(path, sizeof(path), "/tmp/usbx-test-config.%ld.conf", (long)getpid());
+    test_parse();
+    test_update();
+    test_reload();
+    test_readers();
+    test_routes();
+    printf("\n=== All runtime configuration tests passed ===\n");
+    return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * Unit tests for DFU firmware downloads
+ *
+ * Downloads run against the simulated DFU device, which counts status
+ * requests sent before bwPollTimeout elapsed. The route tests cover the
+ * JSON result, the server-sent event stream and images from the blob store.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "usbx_api.h"
+#include "usbx_blob.h"
+#include "usbx_dfu.h"
+#include "usbx_sim.h"
+
+#define POLL_TIMEOUT_MS 2
+#define MANIFEST_TIMEOUT_MS 10
+
+static struct usbx_device *create_device(struct usbx_sim_dfu *dfu) {
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.control_handler = usbx_sim_dfu_handler;
+    config.control_cls = dfu;
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    assert(dev != NULL);
+    return dev;
+}
+
+static struct usbx_sim_dfu *create_dfu(size_t capacity, unsigned int poll_timeout_ms,
+                                       int tolerant) {
+    struct usbx_sim_dfu_config config;
+    memset(&config, 0, sizeof(config));
+    config.capacity = capacity;
+    config.transfer_size = 2048;
+    config.poll_timeout_ms = poll_timeout_ms;
+    config.manifest_timeout_ms = MANIFEST_TIMEOUT_MS;
+    config.manifestation_tolerant = tolerant;
+    struct usbx_sim_dfu *dfu = usbx_sim_dfu_create(&config);
+    assert(dfu != NULL);
+    return dfu;
+}
+
+static int progress_calls;
+
+static void count_progress(void *cls, const struct usbx_dfu_progress *progress) {
+    (void)cls;
+    assert(progress->written <= progress->total);
+    progress_calls++;
+}
+
+/**
+ * Test 1: a download honours bwPollTimeout without polling early
+ */
+void test_download() {
+    printf("TEST: DFU download\n");
+    struct usbx_sim_dfu *dfu = create_dfu(1024 * 1024, POLL_TIMEOUT_MS, 1);
+    struct usbx_device *dev = create_device(dfu);
+
+    size_t size = 100 * 1024 + 17;
+    unsigned char *image = malloc(size);
+    usbx_sim_fill_pattern(image, size, 0);
+    struct usbx_dfu_options opts;
+    usbx_dfu_options_init(&opts);
+    struct usbx_dfu_progress progress;
+
+    int result = usbx_dfu_download(dev, image, size, &opts, count_progress, NULL, &progress);
+    assert(result == USBX_SUCCESS);
+    assert(progress.written == size && progress.blocks == 101 && progress_calls == 102);
+    assert(progress.state == USBX_DFU_STATE_IDLE);
+
+    struct usbx_sim_dfu_stats stats;
+    usbx_sim_dfu_get_stats(dfu, &stats);
+    assert(stats.early_polls == 0 && stats.manifested == 1 && stats.blocks == 101);
+    assert(stats.status_requests == progress.polls);
+    size_t received;
+    const unsigned char *copy = usbx_sim_dfu_image(dfu, &received);
+    assert(received == size && memcmp(copy, image, size) == 0);
+
+    // Each block waits one poll timeout, and not much longer
+    uint64_t minimum = 101ULL * POLL_TIMEOUT_MS * 1000 + MANIFEST_TIMEOUT_MS * 1000;
+    assert(progress.poll_wait_us >= minimum * 9 / 10);
+    assert(progress.elapsed_us < minimum * 3 + 200000);
+
+    printf("✓ %zu bytes in %u blocks, %u polls, %llu us waited of %llu us\n", size,
+           progress.blocks, progress.polls, (unsigned long long)progress.poll_wait_us,
+           (unsigned long long)progress.elapsed_us);
+
+    // Blocks larger than wTransferSize stall
+    opts.transfer_size = 4096;
+    assert(usbx_dfu_download(dev, image, size, &opts, NULL, NULL, &progress) == USBX_ERROR_PIPE);
+    usbx_sim_dfu_get_stats(dfu, &stats);
+    assert(stats.state == USBX_DFU_STATE_ERROR);
+
+    usbx_device_destroy(dev);
+    usbx_sim_dfu_destroy(dfu);
+    free(image);
+}
+
+/**
+ * Test 2: error recovery, device errors and manifestation without tolerance
+ */
+void test_states() {
+    printf("TEST: DFU state handling\n");
+    struct usbx_sim_dfu *dfu = create_dfu(8192, 0, 0);
+    struct usbx_device *dev = create_device(dfu);
+    unsigned char image[10000];
+    usbx_sim_fill_pattern(image, sizeof(image), 0);
+    struct usbx_dfu_progress progress;
+
+    // A zero-length download from dfuIDLE leaves the device in dfuERROR
+    assert(usbx_control_transfer(dev, USBX_DFU_REQUEST_OUT, USBX_DFU_DNLOAD, 0, 0, NULL, 0,
+                                 1000) == USBX_ERROR_PIPE);
+    assert(usbx_dfu_download(dev, image, 5000, NULL, NULL, NULL, &progress) == USBX_SUCCESS);
+    assert(progress.state == USBX_DFU_STATE_MANIFEST_WAIT_RESET);
+
+    // A block beyond the device's capacity stalls and leaves it in dfuERROR
+    struct usbx_sim_dfu_stats stats;
+    usbx_device_destroy(dev);
+    usbx_sim_dfu_destroy(dfu);
+    dfu = create_dfu(8192, 0, 1);
+    dev = create_device(dfu);
+    assert(usbx_dfu_download(dev, image, sizeof(image), NULL, NULL, NULL, &progress) ==
+           USBX_ERROR_PIPE);
+    usbx_sim_dfu_get_stats(dfu, &stats);
+    assert(stats.state == USBX_DFU_STATE_ERROR && progress.written == 8192);
+    assert(usbx_control_transfer(dev, USBX_DFU_REQUEST_OUT, USBX_DFU_CLRSTATUS, 0, 0, NULL, 0,
+                                 1000) == 0);
+
+    assert(usbx_dfu_download(dev, image, 100, NULL, NULL, NULL, &progress) == USBX_SUCCESS);
+    assert(usbx_dfu_download(NULL, image, 100, NULL, NULL, NULL, &progress) ==
+           USBX_ERROR_INVALID_PARAM);
+    usbx_device_destroy(dev);
+    usbx_sim_dfu_destroy(dfu);
+    printf("✓ dfuERROR cleared, capacity errors and manifest-wait-reset reported\n");
+}
+
+static void post(struct usbx_http_router *router, const char *path, const char *arg,
+                 const char *value, const char *accept, const unsigned char *body,
+                 size_t length, struct usbx_http_response *resp) {
+    struct usbx_http_pair args[1] = {{arg, value}};
+    struct usbx_http_pair headers[1] = {{"Accept", accept}};
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = "POST";
+    req.path = path;
+    req.args = args;
+    req.num_args = arg ? 1 : 0;
+    req.headers = headers;
+    req.num_headers = accept ? 1 : 0;
+    req.body = body;
+    req.body_length = length;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+/* Read a whole streaming response into a malloc'd string */
+static char *read_stream(struct usbx_http_response *resp) {
+    size_t capacity = 65536, length = 0;
+    char *text = malloc(capacity);
+    ssize_t n;
+    while ((n = resp->reader(resp->reader_cls, length, text + length, 256)) >= 0) {
+        length += (size_t)n;
+        if (capacity - length < 512) {
+            capacity *= 2;
+            text = realloc(text, capacity);
+        }
+    }
+    assert(n == USBX_HTTP_END_OF_STREAM);
+    text[length] = '\0';
+    return text;
+}
+
+/**
+ * Test 3: POST /handles/{id}/dfu with JSON and event stream responses
+ */
+void test_route() {
+    printf("TEST: POST /handles/{id}/dfu\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    struct usbx_sim_dfu *dfu = create_dfu(1024 * 1024, 20, 1);
+    int handle_id = usbx_handle_add(create_device(dfu), NULL);
+
+    size_t size = 24 * 1024;
+    unsigned char *image = malloc(size);
+    usbx_sim_fill_pattern(image, size, 0);
+    char path[64];
+    snprintf(path, sizeof(path), "/handles/%d/dfu", handle_id);
+    struct usbx_http_response resp, busy;
+
+    post(router, path, "transfer_size", "2048", NULL, image, 4096, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"written\": 4096") &&
+           strstr(resp.body, "\"state\": \"dfuIDLE\"") && strstr(resp.body, "\"code\": 0"));
+    usbx_http_response_free(&resp);
+
+    // A streamed download owns a copy of the body and the handle until it ends
+    post(router, path, NULL, NULL, "text/event-stream", image, size, &resp);
+    assert(resp.status == 200 && resp.reader != NULL);
+    memset(image, 0, size);
+    post(router, path, NULL, NULL, NULL, image, size, &busy);
+    assert(busy.status == 409);
+    usbx_http_response_free(&busy);
+    char *events = read_stream(&resp);
+    usbx_http_response_free(&resp);
+    assert(strstr(events, "event: progress") && strstr(events, "event: done"));
+    assert(strstr(events, "\"written\": 24576"));
+    free(events);
+
+    struct usbx_sim_dfu_stats stats;
+    usbx_sim_dfu_get_stats(dfu, &stats);
+    assert(stats.early_polls == 0 && stats.manifested == 2 && stats.image_size == size);
+    size_t received;
+    const unsigned char *copy = usbx_sim_dfu_image(dfu, &received);
+    for (size_t i = 0; i < size; i++) {
+        assert(copy[i] == usbx_sim_pattern_byte(i));
+    }
+
+    post(router, path, NULL, NULL, NULL, NULL, 0, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    post(router, path, "transfer_size", "0", NULL, image, 16, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+
+    // Images can come from the blob store
+    char directory[] = "/tmp/usbx-dfu-test-XXXXXX", hash[USBX_SHA256_HEX_SIZE];
+    assert(mkdtemp(directory) != NULL);
+    struct usbx_blob_store *store = usbx_blob_store_open(directory, 0, NULL);
+    usbx_sim_fill_pattern(image, size, 0);
+    assert(usbx_blob_put(store, image, 10000, hash) == 1);
+    post(router, path, "blob", hash, NULL, NULL, 0, &resp);
+    assert(resp.status == 503);
+    usbx_http_response_free(&resp);
+    usbx_api_set_blob_store(store);
+    post(router, path, "blob", hash, "text/event-stream", NULL, 0, &resp);
+    events = read_stream(&resp);
+    usbx_http_response_free(&resp);
+    assert(strstr(events, "event: done") && strstr(events, "\"written\": 10000"));
+    free(events);
+    memset(hash, '0', USBX_SHA256_HEX_SIZE - 1);
+    post(router, path, "blob", hash, NULL, NULL, 0, &resp);
+    assert(resp.status == 404);
+    usbx_http_response_free(&resp);
+    usbx_api_set_blob_store(NULL);
+    usbx_blob_store_close(store);
+    char command[64];
+    snprintf(command, sizeof(command), "rm -rf '%s'", directory);
+    assert(system(command) == 0);
+
+    usbx_handle_remove(handle_id);
+    usbx_sim_dfu_destroy(dfu);
+    usbx_http_router_destroy(router);
+    free(image);
+    printf("✓ JSON result, progress events, busy handle and blob images\n");
+}
+
+int main() {
+    printf("=== DFU Download Tests ===\n\n");
+
+    test_download();
+    test_states();
+    test_route();
+
+    printf("\n=== All DFU download tests passed ===\n");
+    return 0;
+}
@@ -0,0 +1,261 @@
+/*
+ * Unit tests for the background device catalog
+ *
+ * A simulated source lists devices on several buses and answers every
+ * serial number probe after a delay. Starting the catalog must return at
+ * once, the buses must be probed in parallel, and a lookup by serial
+ * number must wait only for the device it needs rather than for the rest
+ * of its bus. Devices attached or removed later are found by the rescan
+ * of a missed lookup, failed probes never match, and every device
+ * reference is released when the catalog stops.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbx_discovery.h"
+#include "usbx_util.h"
+
+#define MAX_FAKE 64
+
+struct fake_device {
+    struct usbx_device_info info;   // serial as the probe reports it
+    int present;
+    int fail;
+};
+
+struct fake_source {
+    pthread_mutex_t lock;
+    struct fake_device devices[MAX_FAKE];
+    int count;
+    int probe_ms;
+    int refs;
+};
+
+static void sleep_ms(int ms) {
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+static int fake_list(void *cls, struct usbx_discovery_device **devices) {
+    struct fake_source *fake = cls;
+    pthread_mutex_lock(&fake->lock);
+    *devices = calloc(MAX_FAKE, sizeof(**devices));
+    int n = 0;
+    for (int i = 0; i < fake->count; i++) {
+        if (fake->devices[i].present) {
+            (*devices)[n].info = fake->devices[i].info;
+            (*devices)[n].info.serial[0] = '\0';
+            (*devices)[n].ref = &fake->devices[i];
+            fake->refs++;
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&fake->lock);
+    return n;
+}
+
+static int fake_probe(void *cls, struct usbx_discovery_device *device) {
+    struct fake_source *fake = cls;
+    const struct fake_device *d = device->ref;
+    sleep_ms(fake->probe_ms);
+    if (d->fail) {
+        return USBX_ERROR_IO;
+    }
+    strcpy(device->info.serial, d->info.serial);
+    return USBX_SUCCESS;
+}
+
+static void fake_ref(void *cls, void *ref) {
+    struct fake_source *fake = cls;
+    (void)ref;
+    pthread_mutex_lock(&fake->lock);
+    fake->refs++;
+    pthread_mutex_unlock(&fake->lock);
+}
+
+static void fake_unref(void *cls, void *ref) {
+    struct fake_source *fake = cls;
+    (void)ref;
+    pthread_mutex_lock(&fake->lock);
+    fake->refs--;
+    pthread_mutex_unlock(&fake->lock);
+}
+
+static void fake_add(struct fake_source *fake, int bus, uint16_t pid, const char *serial) {
+    struct fake_device *d = &fake->devices[fake->count];
+    memset(d, 0, sizeof(*d));
+    d->info.vid = 0x1234;
+    d->info.pid = pid;
+    d->info.bus = bus;
+    d->info.address = fake->count + 1;
+    snprintf(d->info.serial, sizeof(d->info.serial), "%s", serial);
+    d->present = 1;
+    fake->count++;
+}
+
+static void start(struct fake_source *fake, unsigned int workers) {
+    struct usbx_discovery_source source = {.name = "fake", .list = fake_list,
+                                           .probe = fake_probe, .ref = fake_ref,
+                                           .unref = fake_unref, .cls = fake};
+    assert(usbx_discovery_start(&source, workers) == USBX_SUCCESS);
+}
+
+static void wait_complete(struct usbx_discovery_stats *stats) {
+    for (int i = 0; i < 5000; i++) {
+        usbx_discovery_get_stats(stats);
+        if (stats->complete) {
+            return;
+        }
+        sleep_ms(1);
+    }
+    assert(!"catalog did not complete");
+}
+
+/**
+ * Test 1: start returns at once and the buses are probed in parallel
+ */
+void test_parallel() {
+    printf("TEST: Buses probed in parallel\n");
+    struct fake_source fake = {.lock = PTHREAD_MUTEX_INITIALIZER, .probe_ms = 20};
+    struct usbx_discovery_device device;
+    struct usbx_discovery_stats stats;
+    char serial[16];
+
+    for (int i = 0; i < 24; i++) {
+        snprintf(serial, sizeof(serial), "SN%02d", i);
+        fake_add(&fake, 1 + i % 3, (uint16_t)(0x100 + i), serial);
+    }
+    uint64_t begin = usbx_now_us();
+    start(&fake, 8);
+    assert(usbx_now_us() - begin < 100000);     // well before the probes finish
+    assert(usbx_discovery_running());
+    struct usbx_discovery_source again = {.list = fake_list, .probe = fake_probe,
+                                          .ref = fake_ref, .unref = fake_unref, .cls = &fake};
+    assert(usbx_discovery_start(&again, 1) == USBX_ERROR_BUSY);
+
+    // No serial number needed: answered from the list
+    assert(usbx_discovery_find(0x1234, 0x117, NULL, 1000, &device) == USBX_SUCCESS);
+    assert(usbx_now_us() - begin < 100000);     // well before the probes finish
+    assert(device.info.bus == 1 + 23 % 3 && device.info.address == 24);
+    usbx_discovery_put(&device);
+    assert(device.ref == NULL);
+
+    wait_complete(&stats);
+    assert(stats.devices == 24 && stats.buses == 3 && stats.probed == 24 && stats.failed == 0);
+    // 8 devices per bus at 20 ms each; serially all 24 would take 480 ms
+    assert(stats.complete_us >= 160000 && stats.complete_us < 400000);
+    assert(usbx_discovery_find(0x1234, -1, "SN13", 1000, &device) == USBX_SUCCESS);
+    assert(device.info.pid == 0x10d && strcmp(device.info.serial, "SN13") == 0);
+    usbx_discovery_put(&device);
+
+    usbx_discovery_stop();
+    assert(fake.refs == 0 && !usbx_discovery_running());
+    assert(usbx_discovery_find(-1, -1, NULL, 10, &device) == USBX_ERROR_NOT_SUPPORTED);
+    printf("✓ 24 devices on 3 buses in %llu ms\n",
+           (unsigned long long)stats.complete_us / 1000);
+}
+
+/**
+ * Test 2: a lookup by serial number waits only for its own device
+ */
+void test_targeted() {
+    printf("TEST: Lookup waits for its device only\n");
+    struct fake_source fake = {.lock = PTHREAD_MUTEX_INITIALIZER, .probe_ms = 50};
+    struct usbx_discovery_device device;
+    struct usbx_discovery_stats stats;
+    char serial[16];
+
+    for (int i = 0; i < 10; i++) {
+        snprintf(serial, sizeof(serial), "SLOW%d", i);
+        fake_add(&fake, 1, (uint16_t)(0x200 + i), serial);
+    }
+    uint64_t begin = usbx_now_us();
+    start(&fake, 1);
+    // The worker reaches the last device of the bus after 500 ms
+    assert(usbx_discovery_find(0x1234, 0x209, "SLOW9", 2000, &device) == USBX_SUCCESS);
+    uint64_t elapsed = usbx_now_us() - begin;
+    assert(elapsed >= 50000 && elapsed < 250000);
+    usbx_discovery_put(&device);
+    assert(usbx_discovery_find(0x1234, 0x209, "OTHER", 2000, &device) == USBX_ERROR_NOT_FOUND);
+
+    usbx_discovery_get_stats(&stats);
+    assert(stats.probed_inline == 1 && !stats.complete);
+    wait_complete(&stats);
+    assert(stats.probed == 10);
+    usbx_discovery_stop();
+    assert(fake.refs == 0);
+    printf("✓ found in %llu ms instead of ~500 ms\n", (unsigned long long)elapsed / 1000);
+}
+
+/**
+ * Test 3: rescans find devices attached later; failed probes never match
+ */
+void test_rescan() {
+    printf("TEST: Rescan, removal and failed probes\n");
+    struct fake_source fake = {.lock = PTHREAD_MUTEX_INITIALIZER, .probe_ms = 1};
+    struct usbx_discovery_device device;
+    struct usbx_discovery_stats stats;
+
+    fake_add(&fake, 1, 0x300, "A");
+    fake_add(&fake, 2, 0x301, "B");
+    fake.devices[1].fail = 1;
+    start(&fake, 2);
+    wait_complete(&stats);
+    assert(stats.failed == 1 && stats.probed == 1 && stats.scans == 1);
+    assert(usbx_discovery_find(0x1234, 0x301, "B", 100, &device) == USBX_ERROR_NOT_FOUND);
+    assert(usbx_discovery_find(0x1234, 0x301, NULL, 100, &device) == USBX_SUCCESS);
+    usbx_discovery_put(&device);
+
+    pthread_mutex_lock(&fake.lock);
+    fake_add(&fake, 3, 0x302, "C");
+    fake.devices[0].present = 0;
+    pthread_mutex_unlock(&fake.lock);
+    assert(usbx_discovery_find(0x1234, 0x302, "C", 1000, &device) == USBX_SUCCESS);
+    assert(device.info.bus == 3);
+    usbx_discovery_put(&device);
+    assert(usbx_discovery_find(0x1234, 0x300, NULL, 100, &device) == USBX_ERROR_NOT_FOUND);
+
+    usbx_discovery_get_stats(&stats);
+    assert(stats.devices == 2 && stats.buses == 3 && stats.scans == 4 && stats.complete);
+    usbx_discovery_stop();
+    assert(fake.refs == 0);
+    printf("✓ attached device found after %u scans, removed one gone\n", stats.scans);
+}
+
+/**
+ * Test 4: a lookup gives up when its device is still being probed
+ */
+void test_timeout() {
+    printf("TEST: Lookup timeout\n");
+    struct fake_source fake = {.lock = PTHREAD_MUTEX_INITIALIZER, .probe_ms = 300};
+    struct usbx_discovery_device device;
+
+    fake_add(&fake, 1, 0x400, "HUNG");
+    start(&fake, 1);
+    sleep_ms(50);                   // the worker is probing it now
+    uint64_t begin = usbx_now_us();
+    assert(usbx_discovery_find(0x1234, 0x400, "HUNG", 50, &device) == USBX_ERROR_TIMEOUT);
+    assert(usbx_now_us() - begin < 200000);
+    assert(usbx_discovery_find(0x1234, 0x400, "HUNG", 1000, &device) == USBX_SUCCESS);
+    usbx_discovery_put(&device);
+    usbx_discovery_stop();
+    assert(fake.refs == 0);
+    printf("✓ timed out after 50 ms, found once the probe finished\n");
+}
+
+int main() {
+    printf("=== Device Discovery Tests ===\n\n");
+    test_parallel();
+    test_targeted();
+    test_rescan();
+    test_timeout();
+    printf("\n=== All device discovery tests passed ===\n");
+    return 0;
+}
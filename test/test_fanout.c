@@ -0,0 +1,392 @@
+/*
+ * Unit tests for operation batches and multi-device fan-out
+ *
+ * Runs against simulated devices: a vendor register behind control
+ * requests, a pattern source on bulk IN and a pattern sink on bulk OUT.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_buf.h"
+#include "usbx_codec.h"
+#include "usbx_json.h"
+#include "usbx_ops.h"
+#include "usbx_sim.h"
+#include "usbx_util.h"
+
+#define EP_BULK_IN 0x81
+#define EP_BULK_OUT 0x02
+#define REQUEST_READ 0x01
+#define REQUEST_WRITE 0x02
+#define DEVICES 6
+
+/** @brief Vendor register served on endpoint 0 */
+struct vendor_register {
+    unsigned char value[4];
+};
+
+static int control_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                           uint64_t *retry_at_us) {
+    struct vendor_register *reg = cls;
+    unsigned char *setup = xfer->buffer;
+    int length = setup[6] | setup[7] << 8;
+    (void)now_us;
+    (void)retry_at_us;
+
+    if ((setup[0] & 0x60) != 0x40) {
+        return USBX_TRANSFER_STALL;
+    }
+    if (setup[1] == REQUEST_READ && (setup[0] & USBX_ENDPOINT_IN)) {
+        xfer->actual_length = length < 4 ? length : 4;
+        memcpy(xfer->buffer + USBX_CONTROL_SETUP_SIZE, reg->value, (size_t)xfer->actual_length);
+        return USBX_TRANSFER_COMPLETED;
+    }
+    if (setup[1] == REQUEST_WRITE && !(setup[0] & USBX_ENDPOINT_IN) && length <= 4) {
+        memcpy(reg->value, xfer->buffer + USBX_CONTROL_SETUP_SIZE, (size_t)length);
+        xfer->actual_length = length;
+        return USBX_TRANSFER_COMPLETED;
+    }
+    return USBX_TRANSFER_STALL;
+}
+
+static struct usbx_device *create_device(struct vendor_register *reg) {
+    struct usbx_sim_endpoint_config endpoints[2];
+    memset(endpoints, 0, sizeof(endpoints));
+    endpoints[0].address = EP_BULK_IN;
+    endpoints[0].type = USBX_TRANSFER_TYPE_BULK;
+    endpoints[0].max_packet_size = 512;
+    endpoints[1].address = EP_BULK_OUT;
+    endpoints[1].type = USBX_TRANSFER_TYPE_BULK;
+    endpoints[1].max_packet_size = 512;
+
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = endpoints;
+    config.num_endpoints = 2;
+    config.control_handler = reg ? control_handler : NULL;
+    config.control_cls = reg;
+
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    assert(dev != NULL);
+    return dev;
+}
+
+static struct usbx_json *parse(const char *text) {
+    return usbx_json_parse(text, strlen(text), NULL);
+}
+
+/**
+ * Test 1: the JSON reader accepts RFC 8259 documents and rejects malformed ones
+ */
+void test_json() {
+    printf("TEST: JSON reader\n");
+    struct usbx_json *json = parse(" {\"a\": [1, -2.5e1, true, null], \"s\": \"x\\u00e9\\ud83d\\ude00\\n\","
+                                   " \"hex\": \"0x81\", \"o\": {}} ");
+    assert(json && json->type == USBX_JSON_OBJECT && json->length == 4);
+    const struct usbx_json *array = usbx_json_get(json, "a");
+    assert(array->type == USBX_JSON_ARRAY && array->length == 4);
+    assert(array->child->next->number == -25.0);
+    assert(usbx_json_bool(array->child->next->next, 0) == 1);
+    assert(array->child->next->next->next->type == USBX_JSON_NULL);
+    assert(strcmp(usbx_json_string(usbx_json_get(json, "s")), "x\xc3\xa9\xf0\x9f\x98\x80\n") == 0);
+
+    long long value;
+    assert(usbx_json_int(usbx_json_get(json, "hex"), &value) == 0 && value == 0x81);
+    assert(usbx_json_int(array->child->next, &value) == 0 && value == -25);
+    assert(usbx_json_get_int(json, "hex", 0, 0x80, 0, &value) == -1);
+    assert(usbx_json_get_int(json, "missing", 0, 10, 7, &value) == 0 && value == 7);
+    usbx_json_free(json);
+
+    json = parse("{\"x\": 1.5}");
+    assert(usbx_json_int(usbx_json_get(json, "x"), &value) == -1);
+    usbx_json_free(json);
+
+    static const char *const malformed[] = {
+        "", "{", "[1,]", "{\"a\" 1}", "{\"a\": 1,}", "[1] x", "\"\\ud800\"", "\"a\tb\"",
+        "tru", "-", "[01x]", "{1: 2}", "\"\\q\""
+    };
+    for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+        assert(parse(malformed[i]) == NULL);
+    }
+    char deep[2 * USBX_JSON_MAX_DEPTH + 3];
+    memset(deep, '[', USBX_JSON_MAX_DEPTH + 1);
+    memset(deep + USBX_JSON_MAX_DEPTH + 1, ']', USBX_JSON_MAX_DEPTH + 1);
+    deep[2 * USBX_JSON_MAX_DEPTH + 2] = '\0';
+    assert(parse(deep) == NULL);
+    printf("✓ values, escapes and error cases\n");
+}
+
+static int run_batch(struct usbx_device *dev, const char *operations, int stop_on_error,
+                     struct usbx_buf *out) {
+    struct usbx_json *json = parse(operations);
+    struct usbx_op_batch batch;
+    assert(usbx_op_batch_parse(json, stop_on_error, NULL, &batch, NULL) == 0);
+    usbx_json_free(json);
+    int result = usbx_op_batch_run(dev, &batch, NULL, out);
+    assert(!out->failed);
+    usbx_op_batch_free(&batch);
+    return result;
+}
+
+/**
+ * Test 2: a batch runs control, bulk and delay operations in order
+ */
+void test_batch() {
+    printf("TEST: operation batch on one device\n");
+    struct vendor_register reg = {{0}};
+    struct usbx_device *dev = create_device(&reg);
+
+    // 4 KiB of the bulk OUT pattern, base64-encoded
+    unsigned char pattern[4096];
+    usbx_sim_fill_pattern(pattern, sizeof(pattern), 0);
+    char encoded[sizeof(pattern) / 3 * 4 + 8];
+    usbx_base64_encode(pattern, sizeof(pattern), encoded);
+    char operations[sizeof(encoded) + 512];
+    snprintf(operations, sizeof(operations),
+             "[{\"op\": \"control\", \"request_type\": \"0x40\", \"request\": 2, "
+             "\"data\": \"3q2+7w==\"},"
+             " {\"op\": \"control\", \"request_type\": \"0xc0\", \"request\": 1, \"length\": 4},"
+             " {\"op\": \"bulk\", \"endpoint\": \"0x81\", \"length\": 3000},"
+             " {\"op\": \"bulk\", \"endpoint\": 2, \"data\": \"%s\"},"
+             " {\"op\": \"delay\", \"ms\": 5}]",
+             encoded);
+
+    struct usbx_buf out;
+    usbx_buf_init(&out);
+    assert(run_batch(dev, operations, 1, &out) == USBX_SUCCESS);
+    assert(memcmp(reg.value, "\xde\xad\xbe\xef", 4) == 0);
+
+    struct usbx_json *results = usbx_json_parse(out.data, out.length, NULL);
+    assert(results && results->type == USBX_JSON_ARRAY && results->length == 5);
+    const struct usbx_json *read = results->child->next;
+    assert(strcmp(usbx_json_string(usbx_json_get(read, "data")), "3q2+7w==") == 0);
+    const struct usbx_json *bulk_in = read->next;
+    long long transferred;
+    assert(usbx_json_get_int(bulk_in, "transferred", 0, 1 << 30, -1, &transferred) == 0 &&
+           transferred == 3000);
+    const char *data = usbx_json_string(usbx_json_get(bulk_in, "data"));
+    unsigned char decoded[3000];
+    assert(usbx_base64_decode(data, strlen(data), decoded) == 3000);
+    for (int i = 0; i < 3000; i++) {
+        assert(decoded[i] == usbx_sim_pattern_byte((uint64_t)i));
+    }
+    usbx_json_free(results);
+    usbx_buf_free(&out);
+
+    struct usbx_sim_endpoint_stats stats;
+    usbx_sim_get_endpoint_stats(dev, EP_BULK_OUT, &stats);
+    assert(stats.bytes == sizeof(pattern) && stats.pattern_errors == 0);
+
+    // A stalled request stops the batch unless stop_on_error is off
+    const char *stalling = "[{\"op\": \"control\", \"request_type\": \"0xc0\", \"request\": 9, "
+                           "\"length\": 1}, {\"op\": \"delay\", \"ms\": 0}]";
+    usbx_buf_init(&out);
+    assert(run_batch(dev, stalling, 1, &out) == USBX_ERROR_PIPE);
+    assert(strstr(out.data, "USBX_ERROR_PIPE") && !strstr(out.data, "\"delay\""));
+    usbx_buf_free(&out);
+    usbx_buf_init(&out);
+    assert(run_batch(dev, stalling, 0, &out) == USBX_ERROR_PIPE);
+    assert(strstr(out.data, "\"delay\""));
+    usbx_buf_free(&out);
+
+    static const char *const invalid[] = {
+        "[]", "[{\"op\": \"reset\"}]", "{\"op\": \"bulk\", \"endpoint\": 0, \"length\": 1}",
+        "{\"op\": \"bulk\", \"endpoint\": \"0x81\", \"data\": \"AA==\"}",
+        "{\"op\": \"bulk\", \"endpoint\": 2, \"length\": 4}",
+        "{\"op\": \"control\", \"request\": 1}",
+        "{\"op\": \"control\", \"request_type\": 64, \"request\": 1, \"data\": \"!!\"}",
+        "{\"op\": \"delay\", \"ms\": -1}"
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        struct usbx_json *json = parse(invalid[i]);
+        struct usbx_op_batch batch;
+        const char *message = NULL;
+        assert(usbx_op_batch_parse(json, 1, NULL, &batch, &message) == -1 && message);
+        usbx_json_free(json);
+    }
+
+    usbx_device_destroy(dev);
+    printf("✓ control, bulk and delay results in order\n");
+}
+
+static void post(struct usbx_http_router *router, const char *path, const char *body,
+                 struct usbx_http_response *resp) {
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = "POST";
+    req.path = path;
+    req.body = (const unsigned char *)body;
+    req.body_length = strlen(body);
+    usbx_http_dispatch(router, &req, resp);
+}
+
+/* Read a streaming response to the end */
+static void read_stream(struct usbx_http_response *resp, struct usbx_buf *out) {
+    char buffer[256];     // smaller than a line, so lines arrive in pieces
+    for (;;) {
+        ssize_t n = resp->reader(resp->reader_cls, out->length, buffer, sizeof(buffer));
+        if (n == USBX_HTTP_END_OF_STREAM) {
+            break;
+        }
+        assert(n >= 0);
+        usbx_buf_append(out, buffer, (size_t)n);
+    }
+}
+
+/**
+ * Test 3: the batch route runs on one handle
+ */
+void test_batch_route(struct usbx_http_router *router) {
+    printf("TEST: POST /handles/{id}/batch\n");
+    struct vendor_register reg = {{1, 2, 3, 4}};
+    struct usbx_device_info info = {0x1209, 0x0001, "BATCH", -1, -1};
+    int handle_id = usbx_handle_add(create_device(&reg), &info);
+    char path[64];
+    snprintf(path, sizeof(path), "/handles/%d/batch", handle_id);
+
+    struct usbx_http_response resp;
+    post(router, path, "not json", &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    post(router, path, "{\"operations\": [{\"op\": \"nope\"}]}", &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    post(router, "/handles/999999/batch", "{\"operations\": {\"op\": \"delay\"}}", &resp);
+    assert(resp.status == 404);
+    usbx_http_response_free(&resp);
+
+    post(router, path, "{\"operations\": [{\"op\": \"control\", \"request_type\": 192, "
+                       "\"request\": 1, \"length\": 4}]}", &resp);
+    assert(resp.status == 200);
+    assert(strstr(resp.body, "\"serial\": \"BATCH\""));
+    assert(strstr(resp.body, "\"status\": \"USBX_SUCCESS\""));
+    assert(strstr(resp.body, "\"data\": \"AQIDBA==\""));
+    usbx_http_response_free(&resp);
+
+    usbx_handle_remove(handle_id);
+    printf("✓ validation errors and a successful batch\n");
+}
+
+/**
+ * Test 4: fan-out runs on the selected devices in parallel and streams results
+ */
+void test_fanout(struct usbx_http_router *router) {
+    printf("TEST: POST /fanout across %d devices\n", DEVICES);
+    struct vendor_register regs[DEVICES];
+    int handles[DEVICES];
+    for (int i = 0; i < DEVICES; i++) {
+        struct usbx_device_info info = {0x1209, i == 5 ? 0x0002 : 0x0001, "", -1, -1};
+        snprintf(info.serial, sizeof(info.serial), "SN%d", i);
+        memset(&regs[i], i, sizeof(regs[i]));
+        // Device 4 has no vendor register, so its control request stalls
+        handles[i] = usbx_handle_add(create_device(i == 4 ? NULL : &regs[i]), &info);
+    }
+
+    struct usbx_http_response resp;
+    post(router, "/fanout", "{\"selector\": {}, \"operation\": {\"op\": \"delay\"}}", &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    post(router, "/fanout", "{\"selector\": {\"vid\": 1}, \"operation\": {\"op\": \"delay\"}}",
+         &resp);
+    assert(resp.status == 404);
+    usbx_http_response_free(&resp);
+
+    const char *request =
+        "{\"selector\": {\"vid\": \"0x1209\", \"pid\": 1, "
+        "\"serials\": [\"SN0\", \"SN1\", \"SN2\", \"SN3\", \"SN4\", \"SN5\", \"other\"]},"
+        " \"operations\": [{\"op\": \"delay\", \"ms\": 60},"
+        " {\"op\": \"control\", \"request_type\": \"0xc0\", \"request\": 1, \"length\": 4}],"
+        " \"parallelism\": 2}";
+    uint64_t start_us = usbx_now_us();
+    post(router, "/fanout", request, &resp);
+    assert(resp.status == 200 && resp.reader);
+    assert(strcmp(resp.content_type, "application/x-ndjson") == 0);
+
+    struct usbx_buf stream;
+    usbx_buf_init(&stream);
+    read_stream(&resp, &stream);
+    uint64_t elapsed_us = usbx_now_us() - start_us;
+    usbx_http_response_free(&resp);
+
+    // Five devices, two at a time: three rounds of the 60 ms delay
+    assert(elapsed_us >= 180000 && elapsed_us < 290000);
+
+    int lines = 0, seen = 0;
+    char *line = stream.data;
+    while (line && *line) {
+        char *end = strchr(line, '\n');
+        assert(end);
+        struct usbx_json *json = usbx_json_parse(line, (size_t)(end - line), NULL);
+        assert(json);
+        if (usbx_json_bool(usbx_json_get(json, "done"), 0)) {
+            long long succeeded, failed;
+            usbx_json_get_int(json, "succeeded", 0, 100, -1, &succeeded);
+            usbx_json_get_int(json, "failed", 0, 100, -1, &failed);
+            assert(succeeded == 4 && failed == 1 && end[1] == '\0');
+        } else {
+            long long id;
+            usbx_json_get_int(json, "handle_id", 0, 1 << 30, -1, &id);
+            int device = (int)(id - handles[0]);
+            assert(device >= 0 && device < 5 && !(seen & (1 << device)));
+            seen |= 1 << device;
+            const char *status = usbx_json_string(usbx_json_get(json, "status"));
+            assert(strcmp(status, device == 4 ? "USBX_ERROR_PIPE" : "USBX_SUCCESS") == 0);
+        }
+        usbx_json_free(json);
+        lines++;
+        line = end + 1;
+    }
+    assert(lines == 6 && seen == 0x1f);
+    usbx_buf_free(&stream);
+
+    // Closing the response early skips the devices not yet started
+    post(router, "/fanout", "{\"selector\": {\"pid\": 1}, \"parallelism\": 1, "
+                            "\"operations\": [{\"op\": \"delay\", \"ms\": 50}, "
+                            "{\"op\": \"control\", \"request_type\": \"0xc0\", "
+                            "\"request\": 1, \"length\": 4}]}", &resp);
+    assert(resp.status == 200);
+    char buffer[512];
+    ssize_t n;
+    while ((n = resp.reader(resp.reader_cls, 0, buffer, sizeof(buffer))) == 0) {
+    }
+    assert(n > 0 && strstr(buffer, "\"handle_id\""));
+    usbx_http_response_free(&resp);
+    usbx_sleep_us(200000);      // the in-flight device finishes, nothing else starts
+
+    uint64_t control_requests = 0;
+    for (int i = 0; i < 5; i++) {
+        struct usbx_handle *handle = usbx_handle_get(handles[i]);
+        struct usbx_sim_endpoint_stats stats;
+        assert(usbx_sim_get_endpoint_stats(handle->dev, 0, &stats) == USBX_SUCCESS);
+        control_requests += stats.transfers;
+        usbx_handle_put(handle);
+    }
+    // Four completed in the first request (device 4 stalls), then one or two
+    assert(control_requests >= 4 + 1 && control_requests <= 4 + 2);
+
+    for (int i = 0; i < DEVICES; i++) {
+        usbx_handle_remove(handles[i]);
+    }
+    printf("✓ 5 devices streamed in %llu ms, early close stops the rest\n",
+           (unsigned long long)(elapsed_us / 1000));
+}
+
+int main() {
+    printf("=== Batch and Fan-out Tests ===\n\n");
+
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+
+    test_json();
+    test_batch();
+    test_batch_route(router);
+    test_fanout(router);
+
+    usbx_http_router_destroy(router);
+    printf("\n=== All batch and fan-out tests passed ===\n");
+    return 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * Unit tests for fault and latency injection
+ *
+ * Rules are set on a simulated device and its transfers are checked for
+ * the injected latency, completion order, failures, timeouts and
+ * disconnects, then the same through the /handles/{id}/faults routes. In a
+ * build without USBX_FAULT_INJECTION only the disabled API is checked.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_fault.h"
+#include "usbx_sim.h"
+#include "usbx_util.h"
+
+static struct usbx_device *create_device(void) {
+    struct usbx_sim_endpoint_config endpoints[2];
+    memset(endpoints, 0, sizeof(endpoints));
+    endpoints[0].address = 0x81;
+    endpoints[1].address = 0x83;
+    for (int i = 0; i < 2; i++) {
+        endpoints[i].type = USBX_TRANSFER_TYPE_BULK;
+        endpoints[i].max_packet_size = 512;
+    }
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = endpoints;
+    config.num_endpoints = 2;
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    assert(dev != NULL);
+    return dev;
+}
+
+static void request(struct usbx_http_router *router, const char *method, const char *path,
+                    struct usbx_http_pair *args, int num_args, struct usbx_http_response *resp) {
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = method;
+    req.path = path;
+    req.args = args;
+    req.num_args = num_args;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+#ifdef USBX_FAULT_INJECTION
+
+#define ORDER_TRANSFERS 16
+
+/** @brief Completion order of asynchronous transfers */
+struct order {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int completed[ORDER_TRANSFERS];
+    int count;
+};
+
+static void order_cb(struct usbx_transfer *xfer) {
+    struct order *order = xfer->user_data;
+    pthread_mutex_lock(&order->lock);
+    order->completed[order->count++] = (int)(xfer->timeout - 1000);
+    pthread_cond_signal(&order->done);
+    pthread_mutex_unlock(&order->lock);
+}
+
+static int read_in(struct usbx_device *dev, unsigned char endpoint, unsigned int timeout) {
+    unsigned char data[64];
+    int transferred = 0;
+    return usbx_bulk_transfer(dev, endpoint, data, sizeof(data), &transferred, timeout);
+}
+
+/**
+ * Test 1: latency is added per endpoint and completions keep their order
+ */
+void test_latency() {
+    printf("TEST: Injected latency and completion order\n");
+    struct usbx_device *dev = create_device();
+    struct usbx_fault_rule rule;
+    usbx_fault_rule_init(&rule, 0x81);
+    rule.latency_us = 20000;
+    assert(usbx_fault_set_rule(dev, &rule) == USBX_SUCCESS);
+
+    uint64_t start = usbx_now_us();
+    assert(read_in(dev, 0x81, 1000) == USBX_SUCCESS);
+    uint64_t delayed_us = usbx_now_us() - start;
+    assert(delayed_us >= 20000);
+    start = usbx_now_us();
+    assert(read_in(dev, 0x83, 1000) == USBX_SUCCESS);
+    assert(usbx_now_us() - start < 20000);
+
+    // Jitter larger than the spacing of completions must not reorder them
+    rule.latency_us = 1000;
+    rule.jitter_us = 10000;
+    assert(usbx_fault_set_rule(dev, &rule) == USBX_SUCCESS);
+    struct order order;
+    memset(&order, 0, sizeof(order));
+    pthread_mutex_init(&order.lock, NULL);
+    usbx_cond_init_monotonic(&order.done);
+    static unsigned char buffers[ORDER_TRANSFERS][64];
+    struct usbx_transfer xfers[ORDER_TRANSFERS];
+    memset(xfers, 0, sizeof(xfers));
+    for (int i = 0; i < ORDER_TRANSFERS; i++) {
+        xfers[i].dev = dev;
+        xfers[i].endpoint = 0x81;
+        xfers[i].type = USBX_TRANSFER_TYPE_BULK;
+        xfers[i].buffer = buffers[i];
+        xfers[i].length = sizeof(buffers[i]);
+        xfers[i].timeout = 1000 + (unsigned int)i;  // doubles as the index
+        xfers[i].callback = order_cb;
+        xfers[i].user_data = &order;
+        assert(usbx_submit_transfer(&xfers[i]) == USBX_SUCCESS);
+    }
+    pthread_mutex_lock(&order.lock);
+    while (order.count < ORDER_TRANSFERS) {
+        pthread_cond_wait(&order.done, &order.lock);
+    }
+    pthread_mutex_unlock(&order.lock);
+    for (int i = 0; i < ORDER_TRANSFERS; i++) {
+        assert(order.completed[i] == i);
+        assert(xfers[i].status == USBX_TRANSFER_COMPLETED);
+    }
+
+    struct usbx_fault_stats stats;
+    assert(usbx_fault_get_stats(dev, &stats) == USBX_SUCCESS);
+    assert(stats.transfers == 2 + ORDER_TRANSFERS && stats.delayed == 1 + ORDER_TRANSFERS);
+    usbx_device_destroy(dev);
+    pthread_cond_destroy(&order.done);
+    pthread_mutex_destroy(&order.lock);
+    printf("✓ %llu us on the faulted endpoint, none on the other, order kept under jitter\n",
+           (unsigned long long)delayed_us);
+}
+
+/**
+ * Test 2: injected failures and latency turned into timeouts
+ */
+void test_errors() {
+    printf("TEST: Injected failures and timeouts\n");
+    struct usbx_device *dev = create_device();
+    struct usbx_fault_rule rule;
+    usbx_fault_rule_init(&rule, USBX_FAULT_ALL_ENDPOINTS);
+    rule.error_ppm = 1000000;
+    assert(usbx_fault_set_rule(dev, &rule) == USBX_SUCCESS);
+    assert(read_in(dev, 0x81, 1000) == USBX_ERROR_PIPE);
+    rule.error_status = USBX_TRANSFER_OVERFLOW;
+    assert(usbx_fault_set_rule(dev, &rule) == USBX_SUCCESS);
+    assert(read_in(dev, 0x83, 1000) == USBX_ERROR_OVERFLOW);
+
+    // An endpoint rule overrides the default
+    struct usbx_fault_rule slow;
+    usbx_fault_rule_init(&slow, 0x83);
+    slow.latency_us = 200000;
+    assert(usbx_fault_set_rule(dev, &slow) == USBX_SUCCESS);
+    uint64_t start = usbx_now_us();
+    assert(read_in(dev, 0x83, 30) == USBX_ERROR_TIMEOUT);
+    uint64_t elapsed = usbx_now_us() - start;
+    assert(elapsed >= 30000 && elapsed < 200000);
+
+    struct usbx_fault_rule rules[USBX_FAULT_MAX_RULES];
+    assert(usbx_fault_get_rules(dev, rules, USBX_FAULT_MAX_RULES) == 2);
+    assert(rules[0].endpoint == USBX_FAULT_ALL_ENDPOINTS && rules[1].endpoint == 0x83);
+    struct usbx_fault_stats stats;
+    usbx_fault_get_stats(dev, &stats);
+    assert(stats.errors == 2 && stats.timeouts == 1);
+
+    // A rule that injects nothing is removed
+    usbx_fault_rule_init(&rule, USBX_FAULT_ALL_ENDPOINTS);
+    assert(usbx_fault_set_rule(dev, &rule) == USBX_SUCCESS);
+    assert(usbx_fault_get_rules(dev, rules, USBX_FAULT_MAX_RULES) == 1);
+    rule.error_status = USBX_TRANSFER_COMPLETED;
+    rule.error_ppm = 1;
+    assert(usbx_fault_set_rule(dev, &rule) == USBX_ERROR_INVALID_PARAM);
+    usbx_device_destroy(dev);
+    printf("✓ stall and overflow injected, timeout after %llu us of 200000 us latency\n",
+           (unsigned long long)elapsed);
+}
+
+/**
+ * Test 3: a disconnect fails transfers until the rules are cleared
+ */
+void test_disconnect() {
+    printf("TEST: Disconnect and recovery\n");
+    struct usbx_device *dev = create_device();
+    struct usbx_fault_rule rule;
+    usbx_fault_rule_init(&rule, 0x81);
+    rule.disconnect_ppm = 1000000;
+    assert(usbx_fault_set_rule(dev, &rule) == USBX_SUCCESS);
+    assert(read_in(dev, 0x81, 1000) == USBX_ERROR_NO_DEVICE);
+    assert(read_in(dev, 0x83, 1000) == USBX_ERROR_NO_DEVICE);
+    struct usbx_fault_stats stats;
+    usbx_fault_get_stats(dev, &stats);
+    assert(stats.disconnected && stats.disconnects == 1 && stats.rejected == 1);
+
+    assert(usbx_fault_clear(dev) == USBX_SUCCESS);
+    assert(read_in(dev, 0x81, 1000) == USBX_SUCCESS);
+    usbx_fault_get_stats(dev, &stats);
+    assert(!stats.disconnected && stats.transfers == 0);
+
+    assert(usbx_fault_disconnect(dev) == USBX_SUCCESS);
+    assert(read_in(dev, 0x83, 1000) == USBX_ERROR_NO_DEVICE);
+    usbx_fault_clear(dev);
+    assert(read_in(dev, 0x83, 1000) == USBX_SUCCESS);
+    usbx_device_destroy(dev);
+    printf("✓ transfers fail with no device while unplugged and succeed after a clear\n");
+}
+
+/**
+ * Test 4: /handles/{id}/faults routes
+ */
+void test_routes() {
+    printf("TEST: /handles/{id}/faults\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    struct usbx_device *dev = create_device();
+    int handle_id = usbx_handle_add(dev, NULL);
+    char path[64], disconnect_path[80];
+    snprintf(path, sizeof(path), "/handles/%d/faults", handle_id);
+    snprintf(disconnect_path, sizeof(disconnect_path), "%s/disconnect", path);
+    struct usbx_http_response resp;
+
+    struct usbx_http_pair bad[1] = {{"error", "melted"}};
+    request(router, "POST", path, bad, 1, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    struct usbx_http_pair bad_rate[1] = {{"error_ppm", "2000000"}};
+    request(router, "POST", path, bad_rate, 1, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+
+    struct usbx_http_pair args[4] = {{"endpoint", "0x81"}, {"error_ppm", "1000000"},
+                                     {"error", "timeout"}, {"seed", "42"}};
+    request(router, "POST", path, args, 4, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"endpoint\": 129"));
+    assert(strstr(resp.body, "\"error\": \"timeout\""));
+    usbx_http_response_free(&resp);
+    assert(read_in(dev, 0x81, 1000) == USBX_ERROR_TIMEOUT);
+
+    request(router, "POST", disconnect_path, NULL, 0, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"disconnected\": true"));
+    usbx_http_response_free(&resp);
+    assert(read_in(dev, 0x83, 1000) == USBX_ERROR_NO_DEVICE);
+
+    request(router, "GET", path, NULL, 0, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"errors\": 1"));
+    assert(strstr(resp.body, "\"rejected\": 1"));
+    usbx_http_response_free(&resp);
+    request(router, "DELETE", path, NULL, 0, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"rules\": []"));
+    usbx_http_response_free(&resp);
+    assert(read_in(dev, 0x81, 1000) == USBX_SUCCESS);
+
+    usbx_handle_remove(handle_id);
+    usbx_http_router_destroy(router);
+    printf("✓ rules validated, set, reported and cleared per handle\n");
+}
+
+int main() {
+    printf("=== Fault Injection Tests ===\n\n");
+    test_latency();
+    test_errors();
+    test_disconnect();
+    test_routes();
+    printf("\n=== All fault injection tests passed ===\n");
+    return 0;
+}
+
+#else
+
+/**
+ * Test 1: without USBX_FAULT_INJECTION the API and routes are absent
+ */
+void test_disabled() {
+    printf("TEST: Injection compiled out\n");
+    struct usbx_device *dev = create_device();
+    struct usbx_fault_rule rule;
+    usbx_fault_rule_init(&rule, 0x81);
+    rule.latency_us = 1000;
+    assert(usbx_fault_set_rule(dev, &rule) == USBX_ERROR_NOT_SUPPORTED);
+    assert(usbx_fault_disconnect(dev) == USBX_ERROR_NOT_SUPPORTED);
+    assert(usbx_fault_parse_status("stall") == USBX_TRANSFER_STALL);
+
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    int handle_id = usbx_handle_add(dev, NULL);
+    char path[64];
+    snprintf(path, sizeof(path), "/handles/%d/faults", handle_id);
+    struct usbx_http_response resp;
+    request(router, "GET", path, NULL, 0, &resp);
+    assert(resp.status == 404);
+    usbx_http_response_free(&resp);
+    usbx_handle_remove(handle_id);
+    usbx_http_router_destroy(router);
+    printf("✓ functions return USBX_ERROR_NOT_SUPPORTED and no routes are registered\n");
+}
+
+int main() {
+    printf("=== Fault Injection Tests ===\n\n");
+    test_disabled();
+    printf("(build with FAULT_INJECTION=1 to run the injection tests)\n");
+    printf("\n=== All fault injection tests passed ===\n");
+    return 0;
+}
+
+#endif // USBX_FAULT_INJECTION
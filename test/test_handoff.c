@@ -0,0 +1,149 @@
+/*
+ * Unit tests for passing listening sockets to a successor process
+ *
+ * A forked successor receives a TCP listening socket, checks that it is
+ * bound to the same port, accepts a connection on it and answers ready.
+ * The predecessor must give up when no successor connects in time or when
+ * the successor hangs up before it is ready, and must reject paths that do
+ * not fit a unix socket address. The handoff socket is close-on-exec.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "usbx_backend.h"
+#include "usbx_handoff.h"
+#include "usbx_util.h"
+
+static char path[108];
+
+static int listen_loopback(uint16_t *port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t length = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(fd >= 0);
+    assert(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(fd, 8) == 0);
+    assert(getsockname(fd, (struct sockaddr *)&addr, &length) == 0);
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int port_of(int fd) {
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr *)&addr, &length) < 0) {
+        return -1;
+    }
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * Test 1: the successor serves on the socket it receives
+ */
+void test_handoff() {
+    printf("TEST: Successor receives the listening socket\n");
+    struct usbx_handoff handoff;
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    struct stat info;
+    uint16_t port, other;
+    int fds[2];
+    int status;
+
+    fds[0] = listen_loopback(&port);
+    fds[1] = listen_loopback(&other);
+    assert(usbx_handoff_listen(&handoff, path) == USBX_SUCCESS);
+    assert(stat(path, &info) == 0 && (info.st_mode & 077) == 0);
+    assert(fcntl(handoff.listener, F_GETFD) & FD_CLOEXEC);     // not inherited by the successor
+
+    pid_t child = fork();
+    if (child == 0) {
+        int received[1], conn;
+        // Only one slot: the second socket is closed on receipt
+        if (usbx_handoff_receive(path, received, 1, 2000, &conn) != 1 ||
+            port_of(received[0]) != port) {
+            _exit(1);
+        }
+        int client = accept(received[0], NULL, NULL);
+        if (client < 0 || write(client, "S", 1) != 1) {
+            _exit(2);
+        }
+        close(client);
+        _exit(usbx_handoff_ready(conn) == USBX_SUCCESS ? 0 : 3);
+    }
+    assert(child > 0);
+
+    // Queued before the handoff completes: the successor accepts it
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    char byte = 0;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    assert(connect(client, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(usbx_handoff_send(&handoff, fds, 2, 2000) == USBX_SUCCESS);
+    assert(read(client, &byte, 1) == 1 && byte == 'S');
+    close(client);
+
+    usbx_handoff_close(&handoff);
+    assert(access(path, F_OK) != 0);
+    assert(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    close(fds[0]);
+    close(fds[1]);
+    printf("✓ successor accepted on port %u\n", port);
+}
+
+/**
+ * Test 2: no successor, or one that hangs up, leaves the predecessor serving
+ */
+void test_failures() {
+    printf("TEST: Successor missing or failing\n");
+    struct usbx_handoff handoff;
+    uint16_t port;
+    int fd = listen_loopback(&port);
+    int status;
+
+    assert(usbx_handoff_listen(&handoff, path) == USBX_SUCCESS);
+    uint64_t begin = usbx_now_us();
+    assert(usbx_handoff_send(&handoff, &fd, 1, 50) == USBX_ERROR_TIMEOUT);
+    assert(usbx_now_us() - begin >= 50000);
+
+    pid_t child = fork();
+    if (child == 0) {
+        int received, conn;
+        _exit(usbx_handoff_receive(path, &received, 1, 2000, &conn) == 1 ? 0 : 1);
+    }
+    assert(usbx_handoff_send(&handoff, &fd, 1, 2000) == USBX_ERROR_IO);
+    assert(waitpid(child, &status, 0) == child && WEXITSTATUS(status) == 0);
+    usbx_handoff_close(&handoff);
+
+    int received, conn;
+    assert(usbx_handoff_receive(path, &received, 1, 50, &conn) == USBX_ERROR_IO);
+    assert(usbx_handoff_send(&handoff, &fd, 1, 50) == USBX_ERROR_INVALID_PARAM);
+    char long_path[200];
+    memset(long_path, 'x', sizeof(long_path) - 1);
+    long_path[sizeof(long_path) - 1] = '\0';
+    assert(usbx_handoff_listen(&handoff, long_path) == USBX_ERROR_INVALID_PARAM);
+    assert(port_of(fd) == port);    // still ours and still listening
+    close(fd);
+    printf("✓ timeout, hang-up and bad paths reported\n");
+}
+
+int main() {
+    printf("=== Socket Handoff Tests ===\n\n");
+    snprintf(path, sizeof(path), "/tmp/usbx-test-handoff.%ld.sock", (long)getpid());
+    test_handoff();
+    test_failures();
+    printf("\n=== All socket handoff tests passed ===\n");
+    return 0;
+}
@@ -0,0 +1,499 @@
+/*
+ * Unit tests for interrupt endpoint polling and its REST routes
+ *
+ * A simulated interrupt IN endpoint produces a numbered report every
+ * REPORT_PERIOD_US; the tests check fan-out to several subscribers, drop
+ * accounting for slow ones, error propagation, the removal of idle
+ * subscribers and the HTTP handlers, including the replacement of a
+ * poller that a stall or idleness has stopped.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbx_api.h"
+#include "usbx_codec.h"
+#include "usbx_interrupt.h"
+#include "usbx_sim.h"
+#include "usbx_util.h"
+
+#define EP_INT 0x81
+#define REPORT_SIZE 8
+#define REPORT_PERIOD_US 1000
+#define IDLE_MS 50
+
+/** @brief State of the simulated report source */
+struct report_source {
+    uint64_t next_at_us;
+    uint32_t counter;
+    uint32_t stall_after;        // 0 = never
+    int quiet;                   // send nothing
+};
+
+static int report_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                          uint64_t *retry_at_us) {
+    struct report_source *source = cls;
+
+    if (source->stall_after && source->counter == source->stall_after) {
+        return USBX_TRANSFER_STALL;
+    }
+    if (source->quiet) {
+        *retry_at_us = now_us + REPORT_PERIOD_US;
+        return USBX_SIM_RETRY;
+    }
+    if (source->next_at_us == 0) {
+        source->next_at_us = now_us;
+    }
+    if (now_us < source->next_at_us) {
+        *retry_at_us = source->next_at_us;
+        return USBX_SIM_RETRY;
+    }
+    source->next_at_us += REPORT_PERIOD_US;
+    memset(xfer->buffer, 0, REPORT_SIZE);
+    usbx_put_le32(xfer->buffer, source->counter++);
+    xfer->actual_length = REPORT_SIZE;
+    return USBX_TRANSFER_COMPLETED;
+}
+
+static struct usbx_device *create_device(struct report_source *source) {
+    struct usbx_sim_endpoint_config endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.address = EP_INT;
+    endpoint.type = USBX_TRANSFER_TYPE_INTERRUPT;
+    endpoint.max_packet_size = REPORT_SIZE;
+    endpoint.handler = report_handler;
+    endpoint.handler_cls = source;
+
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = &endpoint;
+    config.num_endpoints = 1;
+
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    assert(dev != NULL);
+    return dev;
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * Test 1: every subscriber sees every report, in order
+ */
+void test_fan_out() {
+    printf("TEST: reports fan out to all subscribers\n");
+    struct report_source source = {0, 0, 0, 0};
+    struct usbx_device *dev = create_device(&source);
+
+    struct usbx_interrupt_poller *poller = usbx_interrupt_poller_start(dev, EP_INT, NULL, NULL);
+    assert(poller != NULL);
+    int subscribers[3];
+    for (int i = 0; i < 3; i++) {
+        subscribers[i] = usbx_interrupt_subscribe(poller, 0);
+        assert(subscribers[i] > 0);
+    }
+
+    struct usbx_interrupt_report report;
+    for (int i = 0; i < 3; i++) {
+        uint64_t sequence = 0;
+        uint32_t counter = 0;
+        for (int n = 0; n < 50; n++) {
+            assert(usbx_interrupt_read(poller, subscribers[i], &report, 1000) == 1);
+            assert(report.length == REPORT_SIZE);
+            if (n > 0) {
+                assert(report.sequence == sequence + 1);
+                assert(usbx_get_le32(report.data) == counter + 1);
+            }
+            sequence = report.sequence;
+            counter = usbx_get_le32(report.data);
+        }
+    }
+
+    struct usbx_interrupt_stats stats;
+    usbx_interrupt_get_stats(poller, &stats);
+    assert(stats.running && stats.subscribers == 3);
+    assert(stats.reports >= 50);
+
+    struct usbx_interrupt_subscriber_stats sub_stats;
+    assert(usbx_interrupt_subscriber_stats(poller, subscribers[0], &sub_stats) == USBX_SUCCESS);
+    assert(sub_stats.delivered == 50 && sub_stats.dropped == 0);
+
+    assert(usbx_interrupt_unsubscribe(poller, subscribers[1]) == 2);
+    assert(usbx_interrupt_unsubscribe(poller, subscribers[1]) == USBX_ERROR_NOT_FOUND);
+    assert(usbx_interrupt_read(poller, subscribers[1], &report, 0) == USBX_ERROR_NOT_FOUND);
+
+    usbx_interrupt_poller_destroy(poller);
+    usbx_device_destroy(dev);
+    printf("✓ 3 subscribers received the same 50 reports\n");
+}
+
+/**
+ * Test 2: a subscriber that falls behind the ring loses reports, not the poller
+ */
+void test_slow_subscriber() {
+    printf("TEST: slow subscriber drops reports\n");
+    struct report_source source = {0, 0, 0, 0};
+    struct usbx_device *dev = create_device(&source);
+
+    struct usbx_interrupt_options opts;
+    usbx_interrupt_options_init(&opts);
+    opts.slots = 16;
+    struct usbx_interrupt_poller *poller = usbx_interrupt_poller_start(dev, EP_INT, &opts, NULL);
+    assert(poller != NULL);
+    int fast = usbx_interrupt_subscribe(poller, 0);
+    int slow = usbx_interrupt_subscribe(poller, 0);
+
+    struct usbx_interrupt_report report;
+    uint64_t fast_reports = 0;
+    uint64_t deadline = usbx_now_us() + 60 * REPORT_PERIOD_US;
+    while (usbx_now_us() < deadline) {
+        if (usbx_interrupt_read(poller, fast, &report, 10) == 1) {
+            fast_reports++;
+        }
+    }
+    // Freeze the ring: reports arriving between the read and the snapshot would add drops
+    usbx_interrupt_poller_stop(poller);
+
+    struct usbx_interrupt_subscriber_stats stats;
+    usbx_interrupt_subscriber_stats(poller, slow, &stats);
+    assert(stats.lag == 16);
+    assert(usbx_interrupt_read(poller, slow, &report, 0) == 1);
+    usbx_interrupt_subscriber_stats(poller, slow, &stats);
+    assert(stats.dropped > 0);
+    assert(stats.delivered == 1);
+    assert(report.sequence == stats.dropped);
+
+    usbx_interrupt_subscriber_stats(poller, fast, &stats);
+    assert(stats.dropped == 0);
+    assert(fast_reports > 30);
+
+    usbx_interrupt_poller_destroy(poller);
+    usbx_device_destroy(dev);
+    printf("✓ fast subscriber lost nothing, slow subscriber dropped its backlog\n");
+}
+
+/**
+ * Test 3: a stall ends polling; retained reports are still delivered first
+ */
+void test_stall_ends_polling() {
+    printf("TEST: endpoint stall ends polling\n");
+    struct report_source source = {0, 0, 5, 0};
+    struct usbx_device *dev = create_device(&source);
+
+    struct usbx_interrupt_poller *poller = usbx_interrupt_poller_start(dev, EP_INT, NULL, NULL);
+    assert(poller != NULL);
+    int subscriber = usbx_interrupt_subscribe(poller, USBX_INTERRUPT_DEFAULT_SLOTS);
+
+    struct usbx_interrupt_report report;
+    int reports = 0;
+    int result;
+    while ((result = usbx_interrupt_read(poller, subscriber, &report, 1000)) == 1) {
+        reports++;
+    }
+    assert(reports == 5);
+    assert(result == USBX_ERROR_PIPE);
+
+    struct usbx_interrupt_stats stats;
+    usbx_interrupt_get_stats(poller, &stats);
+    assert(stats.last_error == USBX_ERROR_PIPE);
+
+    usbx_interrupt_poller_destroy(poller);
+    usbx_device_destroy(dev);
+    printf("✓ 5 reports delivered, then %s\n", usbx_error_name(result));
+}
+
+/** @brief Reader blocked in one long read */
+struct blocked_read {
+    struct usbx_interrupt_poller *poller;
+    int subscriber;
+    int result;
+};
+
+static void *read_blocked(void *arg) {
+    struct blocked_read *blocked = arg;
+    struct usbx_interrupt_report report;
+    blocked->result = usbx_interrupt_read(blocked->poller, blocked->subscriber, &report,
+                                          6 * IDLE_MS);
+    return NULL;
+}
+
+/**
+ * Test 4: idle subscribers are removed, and polling stops with the last one
+ */
+void test_idle_subscribers() {
+    printf("TEST: idle subscribers expire\n");
+    struct report_source source = {0, 0, 0, 1};
+    struct usbx_device *dev = create_device(&source);
+
+    struct usbx_interrupt_options opts;
+    usbx_interrupt_options_init(&opts);
+    opts.idle_timeout_ms = IDLE_MS;
+    struct usbx_interrupt_poller *poller = usbx_interrupt_poller_start(dev, EP_INT, &opts, NULL);
+    assert(poller != NULL);
+    int idle = usbx_interrupt_subscribe(poller, 0);
+    struct blocked_read blocked = {poller, usbx_interrupt_subscribe(poller, 0), 0};
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, read_blocked, &blocked) == 0);
+
+    // A reader waiting on a quiet endpoint keeps its subscriber
+    sleep_ms(3 * IDLE_MS);
+    struct usbx_interrupt_stats stats;
+    struct usbx_interrupt_report report;
+    usbx_interrupt_get_stats(poller, &stats);
+    assert(stats.running && stats.subscribers == 1);
+    assert(usbx_interrupt_read(poller, idle, &report, 0) == USBX_ERROR_NOT_FOUND);
+    pthread_join(thread, NULL);
+    assert(blocked.result == 0);
+
+    // Nobody reads any more: the last one goes, and polling stops
+    sleep_ms(4 * IDLE_MS);
+    usbx_interrupt_get_stats(poller, &stats);
+    assert(!stats.running && stats.subscribers == 0);
+    assert(stats.last_error == USBX_ERROR_TIMEOUT);
+
+    usbx_interrupt_poller_destroy(poller);
+    usbx_device_destroy(dev);
+    printf("✓ idle subscriber removed after %d ms, polling stopped with the last\n", IDLE_MS);
+}
+
+/* Dispatch a request with at most one query argument */
+static void call(struct usbx_http_router *router, const char *method, const char *path,
+                 const char *arg, const char *value, struct usbx_http_response *resp) {
+    struct usbx_http_pair args[1] = {{arg, value}};
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = method;
+    req.path = path;
+    req.args = args;
+    req.num_args = arg ? 1 : 0;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+/**
+ * Test 5: REST routes for subscribers, long-poll and status
+ */
+void test_routes() {
+    printf("TEST: interrupt REST routes\n");
+    struct report_source source = {0, 0, 0, 0};
+    int handle_id = usbx_handle_add(create_device(&source), NULL);
+    assert(handle_id > 0);
+
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    struct usbx_http_response resp;
+    char path[128];
+
+    snprintf(path, sizeof(path), "/handles/%d/interrupts/0x81", handle_id);
+    call(router, "GET", path, NULL, NULL, &resp);
+    assert(resp.status == 404);
+    usbx_http_response_free(&resp);
+
+    snprintf(path, sizeof(path), "/handles/%d/interrupts/0x02/subscribers", handle_id);
+    call(router, "POST", path, NULL, NULL, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+
+    snprintf(path, sizeof(path), "/handles/%d/interrupts/0x81/subscribers", handle_id);
+    call(router, "POST", path, "slots", "64", &resp);
+    assert(resp.status == 201);
+    int subscriber = 0;
+    assert(sscanf(resp.body, "{\"subscriber\": %d}", &subscriber) == 1 && subscriber > 0);
+    usbx_http_response_free(&resp);
+
+    snprintf(path, sizeof(path), "/handles/%d/interrupts/0x81/subscribers/%d", handle_id,
+             subscriber);
+    call(router, "GET", path, "timeout", "1000", &resp);
+    assert(resp.status == 200);
+    assert(strstr(resp.body, "\"reports\": [{\"sequence\": 0,") != NULL);
+    assert(strstr(resp.body, "\"data\": \"AAAAAAAAAAA=\"") != NULL);
+    assert(strstr(resp.body, "\"counters\": {\"subscriber\": ") != NULL);
+    usbx_http_response_free(&resp);
+
+    snprintf(path, sizeof(path), "/handles/%d/interrupts/0x81", handle_id);
+    call(router, "GET", path, NULL, NULL, &resp);
+    assert(resp.status == 200);
+    assert(strstr(resp.body, "\"running\": true") != NULL);
+    assert(strstr(resp.body, "\"subscribers\": [{\"subscriber\": ") != NULL);
+    usbx_http_response_free(&resp);
+
+    call(router, "PUT", path, NULL, NULL, &resp);
+    assert(resp.status == 405);
+    usbx_http_response_free(&resp);
+
+    snprintf(path, sizeof(path), "/handles/%d/interrupts/0x81/subscribers/%d", handle_id,
+             subscriber);
+    call(router, "DELETE", path, NULL, NULL, &resp);
+    assert(resp.status == 200);
+    usbx_http_response_free(&resp);
+    call(router, "GET", path, "timeout", "0", &resp);
+    assert(resp.status == 404);     // the last subscriber left, so did the poller
+    usbx_http_response_free(&resp);
+
+    assert(usbx_handle_remove(handle_id) == USBX_SUCCESS);
+    usbx_http_router_destroy(router);
+    printf("✓ subscribe, long-poll, status and delete behave\n");
+}
+
+/* POST a subscriber and return its id */
+static int subscribe(struct usbx_http_router *router, const char *path, const char *arg,
+                     const char *value) {
+    struct usbx_http_response resp;
+    int subscriber = 0;
+    call(router, "POST", path, arg, value, &resp);
+    assert(resp.status == 201);
+    assert(sscanf(resp.body, "{\"subscriber\": %d}", &subscriber) == 1 && subscriber > 0);
+    usbx_http_response_free(&resp);
+    return subscriber;
+}
+
+/**
+ * Test 6: a poller stopped by a stall or by idleness is replaced by the next subscriber
+ */
+void test_restart() {
+    printf("TEST: stopped pollers are replaced\n");
+    struct report_source source = {0, 0, 3, 0};
+    int handle_id = usbx_handle_add(create_device(&source), NULL);
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    struct usbx_http_response resp;
+    char subscribers[96], path[128], status[96];
+    snprintf(subscribers, sizeof(subscribers), "/handles/%d/interrupts/0x81/subscribers",
+             handle_id);
+    snprintf(status, sizeof(status), "/handles/%d/interrupts/0x81", handle_id);
+
+    int stalled = subscribe(router, subscribers, NULL, NULL);
+    snprintf(path, sizeof(path), "%s/%d", subscribers, stalled);
+    call(router, "GET", path, "timeout", "1000", &resp);
+    while (resp.status == 200) {
+        usbx_http_response_free(&resp);
+        call(router, "GET", path, "timeout", "1000", &resp);
+    }
+    assert(strstr(resp.body, "USBX_ERROR_PIPE"));
+    usbx_http_response_free(&resp);
+
+    // The stall is cleared: a new subscriber gets a new poller and reports again
+    source.stall_after = 0;
+    int fresh = subscribe(router, subscribers, NULL, NULL);
+    call(router, "GET", status, NULL, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"running\": true"));
+    usbx_http_response_free(&resp);
+    call(router, "GET", path, "timeout", "0", &resp);
+    assert(resp.status == 404);     // removed with the stalled poller
+    usbx_http_response_free(&resp);
+    snprintf(path, sizeof(path), "%s/%d", subscribers, fresh);
+    call(router, "GET", path, "timeout", "1000", &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"reports\": [{\"sequence\": 0,"));
+    usbx_http_response_free(&resp);
+    call(router, "DELETE", path, NULL, NULL, &resp);
+    assert(resp.status == 200);
+    usbx_http_response_free(&resp);
+
+    // A subscriber that stops polling is removed, and its poller stops
+    subscribe(router, subscribers, "idle_timeout", "50");
+    sleep_ms(4 * IDLE_MS);
+    call(router, "GET", status, NULL, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"running\": false"));
+    assert(strstr(resp.body, "\"last_error\": \"USBX_ERROR_TIMEOUT\", \"subscribers\": []"));
+    usbx_http_response_free(&resp);
+    subscribe(router, subscribers, NULL, NULL);
+    call(router, "GET", status, NULL, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"running\": true"));
+    usbx_http_response_free(&resp);
+
+    assert(usbx_handle_remove(handle_id) == USBX_SUCCESS);
+    usbx_http_router_destroy(router);
+    printf("✓ replaced after a stall and after the last subscriber went idle\n");
+}
+
+/**
+ * Test 7: the event stream emits report events and ends when the handle closes
+ */
+void test_event_stream() {
+    printf("TEST: server-sent event stream\n");
+    struct report_source source = {0, 0, 0, 0};
+    int handle_id = usbx_handle_add(create_device(&source), NULL);
+
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    char path[128];
+    snprintf(path, sizeof(path), "/handles/%d/interrupts/129/events", handle_id);
+
+    struct usbx_http_response resp;
+    call(router, "GET", path, NULL, NULL, &resp);
+    assert(resp.status == 200 && resp.reader != NULL);
+    assert(strcmp(resp.content_type, "text/event-stream") == 0);
+
+    char text[8192];
+    size_t length = 0;
+    int events = 0;
+    while (events < 3) {
+        ssize_t n = resp.reader(resp.reader_cls, length, text + length, 64);
+        assert(n >= 0);
+        length += (size_t)n;
+        text[length] = '\0';
+        events = 0;
+        for (const char *p = text; (p = strstr(p, "event: report")) != NULL; p++) {
+            events++;
+        }
+    }
+    assert(strncmp(text, "id: 0\nevent: report\ndata: {\"sequence\": 0,", 40) == 0);
+
+    // Closing the handle stops the poller; the stream drains and ends
+    assert(usbx_handle_remove(handle_id) == USBX_SUCCESS);
+    ssize_t n;
+    while ((n = resp.reader(resp.reader_cls, length, text + length, 256)) >= 0) {
+        length += (size_t)n;
+        assert(length < sizeof(text) - 256);
+    }
+    assert(n == USBX_HTTP_END_OF_STREAM);
+    text[length] = '\0';
+    assert(strstr(text, "event: end\ndata: {\"code\": -10") != NULL);
+
+    usbx_http_response_free(&resp);  // releases the last handle reference
+    usbx_http_router_destroy(router);
+    printf("✓ %d report events, then an end event\n", events);
+}
+
+/**
+ * Test 8: base64 and hex codecs
+ */
+void test_codecs() {
+    printf("TEST: base64 and hex codecs\n");
+    const unsigned char data[] = {0x00, 0xff, 0x10, 0x80, 0x7f};
+    char text[16];
+    unsigned char back[8];
+
+    assert(usbx_base64_encoded_size(5) == 8);
+    assert(usbx_base64_encode(data, 5, text) == 8);
+    assert(strcmp(text, "AP8QgH8=") == 0);
+    assert(usbx_base64_decode(text, 8, back) == 5 && memcmp(back, data, 5) == 0);
+    assert(usbx_base64_decode("AP8*", 4, back) == -1);
+
+    usbx_hex_encode(data, 5, text);
+    assert(strcmp(text, "00ff10807f") == 0);
+    assert(usbx_hex_decode("00FF10807f", 10, back) == 5 && memcmp(back, data, 5) == 0);
+    assert(usbx_hex_decode("0g", 2, back) == -1);
+    printf("✓ codecs round trip\n");
+}
+
+int main() {
+    printf("=== Interrupt Polling Tests ===\n\n");
+
+    test_fan_out();
+    test_slow_subscriber();
+    test_stall_ends_polling();
+    test_idle_subscribers();
+    test_routes();
+    test_restart();
+    test_event_stream();
+    test_codecs();
+
+    printf("\n=== All interrupt polling tests passed ===\n");
+    return 0;
+}
@@ -0,0 +1,293 @@
+/*
+ * Unit tests for latency estimates and adaptive timeouts
+ *
+ * Simulated endpoints answer after a set delay or hang on demand. The
+ * tests check that a hung transfer is given up after a few typical
+ * latencies instead of the caller's timeout, that a slow control request
+ * keeps its own estimate and is not cut short, that the caller's timeout
+ * stays the upper bound, and the /handles/{id}/latency routes.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_latency.h"
+#include "usbx_sim.h"
+#include "usbx_util.h"
+
+#define EP_IN 0x81
+#define REQUEST_FAST 0x01
+#define REQUEST_SLOW 0x02
+
+/** @brief Answers after delay_us, or never while hang is set */
+struct delayed {
+    uint64_t delay_us;
+    int hang;
+    int pending;                 // endpoint thread only
+    uint64_t due_us;
+};
+
+static int answer(struct delayed *d, uint64_t delay_us, uint64_t now_us, uint64_t *retry_at_us) {
+    if (__atomic_load_n(&d->hang, __ATOMIC_ACQUIRE)) {
+        *retry_at_us = now_us + 60000000ULL;
+        return USBX_SIM_RETRY;
+    }
+    if (!d->pending) {
+        d->pending = 1;
+        d->due_us = now_us + delay_us;
+    }
+    if (now_us < d->due_us) {
+        *retry_at_us = d->due_us;
+        return USBX_SIM_RETRY;
+    }
+    d->pending = 0;
+    return USBX_TRANSFER_COMPLETED;
+}
+
+static int bulk_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                        uint64_t *retry_at_us) {
+    struct delayed *d = cls;
+    int status = answer(d, __atomic_load_n(&d->delay_us, __ATOMIC_ACQUIRE), now_us, retry_at_us);
+    if (status == USBX_TRANSFER_COMPLETED) {
+        memset(xfer->buffer, 0x5a, (size_t)xfer->length);
+        xfer->actual_length = xfer->length;
+    }
+    return status;
+}
+
+/* REQUEST_FAST answers after 1 ms, REQUEST_SLOW after 40 ms */
+static int control_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                           uint64_t *retry_at_us) {
+    uint64_t delay = xfer->buffer[1] == REQUEST_SLOW ? 40000 : 1000;
+    int status = answer(cls, delay, now_us, retry_at_us);
+    if (status == USBX_TRANSFER_COMPLETED) {
+        xfer->actual_length = 0;
+    }
+    return status;
+}
+
+static void aborted(void *cls, struct usbx_transfer *xfer) {
+    (void)xfer;
+    ((struct delayed *)cls)->pending = 0;
+}
+
+static struct usbx_device *create_device(struct delayed *bulk, struct delayed *control) {
+    struct usbx_sim_endpoint_config endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.address = EP_IN;
+    endpoint.type = USBX_TRANSFER_TYPE_BULK;
+    endpoint.max_packet_size = 512;
+    endpoint.handler = bulk_handler;
+    endpoint.handler_cls = bulk;
+    endpoint.aborted = aborted;
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = &endpoint;
+    config.num_endpoints = 1;
+    config.control_handler = control_handler;
+    config.control_cls = control;
+    config.control_aborted = aborted;
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    assert(dev != NULL);
+    return dev;
+}
+
+static int read_in(struct usbx_device *dev, unsigned int timeout) {
+    unsigned char data[64];
+    int transferred = 0;
+    return usbx_bulk_transfer(dev, EP_IN, data, sizeof(data), &transferred, timeout);
+}
+
+static int find_estimate(struct usbx_latency_table *table, unsigned char endpoint,
+                         uint8_t request, struct usbx_latency_estimate *out) {
+    struct usbx_latency_estimate estimates[8];
+    int count = usbx_latency_get_estimates(table, estimates, 8);
+    for (int i = 0; i < count && i < 8; i++) {
+        if (estimates[i].endpoint == endpoint && (endpoint != 0 || estimates[i].request == request)) {
+            *out = estimates[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Test 1: a hung bulk transfer is detected early, then the timeout backs off
+ */
+void test_hung_transfer() {
+    printf("TEST: Hung bulk transfer under an adaptive timeout\n");
+    struct delayed bulk = {.delay_us = 2000}, control = {0};
+    struct usbx_device *dev = create_device(&bulk, &control);
+    struct usbx_latency_table *table = usbx_latency_table_create();
+    struct usbx_latency_config config;
+    struct usbx_latency_estimate e;
+
+    usbx_latency_config_init(&config);
+    config.enabled = 1;
+    config.min_samples = 8;
+    config.min_timeout_ms = 50;
+    assert(usbx_latency_configure(table, &config) == USBX_SUCCESS);
+    config.multiplier = 0;
+    assert(usbx_latency_configure(table, &config) == USBX_ERROR_INVALID_PARAM);
+    usbx_latency_attach(table, dev);
+
+    for (int i = 0; i < 8; i++) {
+        assert(read_in(dev, 5000) == USBX_SUCCESS);
+    }
+    assert(find_estimate(table, EP_IN, 0, &e));
+    assert(e.samples == 8 && e.adapted == 0);
+    assert(e.mean_us >= 2000 && e.timeout_ms >= 50 && e.timeout_ms < 5000);
+    unsigned int adaptive = e.timeout_ms;
+
+    // The caller asked for 5 s; the estimate gives up much sooner
+    __atomic_store_n(&bulk.hang, 1, __ATOMIC_RELEASE);
+    uint64_t start = usbx_now_us();
+    assert(read_in(dev, 5000) == USBX_ERROR_TIMEOUT);
+    uint64_t elapsed_ms = (usbx_now_us() - start) / 1000;
+    assert(elapsed_ms >= adaptive && elapsed_ms < 1000);
+    assert(find_estimate(table, EP_IN, 0, &e));
+    assert(e.adapted == 1 && e.early_timeouts == 1 && e.backoff == 1);
+    assert(e.timeout_ms >= 2 * adaptive - 1 && e.samples == 8);
+
+    // An answer resets the backoff
+    __atomic_store_n(&bulk.hang, 0, __ATOMIC_RELEASE);
+    assert(read_in(dev, 5000) == USBX_SUCCESS);
+    assert(find_estimate(table, EP_IN, 0, &e));
+    assert(e.backoff == 0 && e.samples == 9 && e.adapted == 2);
+
+    usbx_latency_detach(dev);
+    usbx_device_destroy(dev);
+    usbx_latency_table_free(table);
+    printf("✓ hung transfer given up after %llu ms instead of 5000 ms\n",
+           (unsigned long long)elapsed_ms);
+}
+
+/**
+ * Test 2: control requests are estimated separately; the caller's timeout bounds
+ */
+void test_control_requests() {
+    printf("TEST: Control requests keep their own estimates\n");
+    struct delayed bulk = {0}, control = {0};
+    struct usbx_device *dev = create_device(&bulk, &control);
+    struct usbx_latency_table *table = usbx_latency_table_create();
+    struct usbx_latency_config config;
+    struct usbx_latency_estimate fast, slow;
+
+    usbx_latency_config_init(&config);
+    config.enabled = 1;
+    config.min_samples = 4;
+    config.min_timeout_ms = 20;
+    usbx_latency_configure(table, &config);
+    usbx_latency_attach(table, dev);
+
+    for (int i = 0; i < 4; i++) {
+        assert(usbx_control_transfer(dev, 0x40, REQUEST_FAST, 0, 0, NULL, 0, 5000) == 0);
+        assert(usbx_control_transfer(dev, 0x40, REQUEST_SLOW, 0, 0, NULL, 0, 5000) == 0);
+    }
+    assert(find_estimate(table, 0, REQUEST_FAST, &fast));
+    assert(find_estimate(table, 0, REQUEST_SLOW, &slow));
+    assert(fast.request_type == 0x40 && slow.request_type == 0x40);
+    assert(slow.mean_us >= 40000 && slow.timeout_ms >= 60);
+    assert(fast.timeout_ms < slow.timeout_ms);
+
+    // The slow request is not cut short by the fast request's latency
+    for (int i = 0; i < 4; i++) {
+        assert(usbx_control_transfer(dev, 0x40, REQUEST_SLOW, 0, 0, NULL, 0, 5000) == 0);
+    }
+    assert(find_estimate(table, 0, REQUEST_SLOW, &slow));
+    assert(slow.adapted == 4 && slow.early_timeouts == 0);
+
+    // A caller's timeout below the estimate is kept as it is
+    assert(usbx_control_transfer(dev, 0x40, REQUEST_SLOW, 0, 0, NULL, 0, 10) ==
+           USBX_ERROR_TIMEOUT);
+    assert(find_estimate(table, 0, REQUEST_SLOW, &slow));
+    assert(slow.adapted == 4 && slow.early_timeouts == 0);
+
+    // Disabled: estimates are still kept, timeouts are not touched
+    config.enabled = 0;
+    usbx_latency_configure(table, &config);
+    assert(usbx_control_transfer(dev, 0x40, REQUEST_FAST, 0, 0, NULL, 0, 5000) == 0);
+    assert(find_estimate(table, 0, REQUEST_FAST, &fast));
+    assert(fast.samples == 5 && fast.adapted == 0);
+    assert(usbx_latency_get_estimates(table, NULL, 0) == 2);
+
+    usbx_latency_detach(dev);
+    usbx_device_destroy(dev);
+    usbx_latency_table_free(table);
+    printf("✓ slow request timeout %u ms, fast request %u ms\n", slow.timeout_ms,
+           fast.timeout_ms);
+}
+
+static void dispatch(struct usbx_http_router *router, const char *method, const char *path,
+                     struct usbx_http_pair *args, int num_args, const char *body,
+                     struct usbx_http_response *resp) {
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = method;
+    req.path = path;
+    req.args = args;
+    req.num_args = num_args;
+    req.body = (const unsigned char *)body;
+    req.body_length = body ? strlen(body) : 0;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+/**
+ * Test 3: /handles/{id}/latency
+ */
+void test_routes() {
+    printf("TEST: /handles/{id}/latency\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    struct delayed bulk = {.delay_us = 1000}, control = {0};
+    int id = usbx_handle_add(create_device(&bulk, &control), NULL);
+    char path[64], batch[64];
+    snprintf(path, sizeof(path), "/handles/%d/latency", id);
+    snprintf(batch, sizeof(batch), "/handles/%d/batch", id);
+    struct usbx_http_response resp;
+
+    struct usbx_http_pair bad[1] = {{"min_samples", "0"}};
+    dispatch(router, "POST", path, bad, 1, NULL, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    struct usbx_http_pair args[3] = {{"enabled", "1"}, {"min_samples", "2"},
+                                     {"min_timeout_ms", "100"}};
+    dispatch(router, "POST", path, args, 3, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"enabled\": true"));
+    assert(strstr(resp.body, "\"min_timeout_ms\": 100") && strstr(resp.body, "\"estimates\": []"));
+    usbx_http_response_free(&resp);
+
+    const char *body = "{\"operations\": [{\"op\": \"bulk\", \"endpoint\": 129, \"length\": 64}, "
+                       "{\"op\": \"bulk\", \"endpoint\": 129, \"length\": 64}, "
+                       "{\"op\": \"bulk\", \"endpoint\": 129, \"length\": 64}]}";
+    dispatch(router, "POST", batch, NULL, 0, body, &resp);
+    assert(resp.status == 200 && !strstr(resp.body, "USBX_ERROR"));
+    usbx_http_response_free(&resp);
+
+    dispatch(router, "GET", path, NULL, 0, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "{\"endpoint\": 129, \"samples\": 3"));
+    assert(strstr(resp.body, "\"adapted\": 1") && strstr(resp.body, "\"early_timeouts\": 0"));
+    usbx_http_response_free(&resp);
+
+    dispatch(router, "DELETE", path, NULL, 0, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"estimates\": []"));
+    usbx_http_response_free(&resp);
+
+    usbx_handle_remove(id);
+    usbx_http_router_destroy(router);
+    printf("✓ settings, estimates and reset over REST\n");
+}
+
+int main() {
+    printf("=== Latency Estimate Tests ===\n\n");
+    test_hung_transfer();
+    test_control_requests();
+    test_routes();
+    printf("\n=== All latency estimate tests passed ===\n");
+    return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Unit tests for mass-storage block access
+ *
+ * Reads and writes run against the simulated Bulk-Only device, whose
+ * counters show how many SCSI commands the cache and read-ahead saved.
+ * The route tests cover geometry, block reads and writes and range errors.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_msc.h"
+#include "usbx_sim.h"
+
+#define BLOCK_SIZE 512
+#define BLOCK_COUNT 4096
+
+static struct usbx_sim_msc *create_sim(void) {
+    struct usbx_sim_msc_config config;
+    memset(&config, 0, sizeof(config));
+    config.block_size = BLOCK_SIZE;
+    config.block_count = BLOCK_COUNT;
+    config.latency_us = 50;
+    struct usbx_sim_msc *sim = usbx_sim_msc_create(&config);
+    assert(sim != NULL);
+    return sim;
+}
+
+/**
+ * Test 1: multi-block reads and writes reach the disk in large commands
+ */
+void test_read_write() {
+    printf("TEST: Block read/write\n");
+    struct usbx_sim_msc *sim = create_sim();
+    struct usbx_device *dev = usbx_sim_msc_device_create(sim);
+    int error = 0;
+    struct usbx_msc *msc = usbx_msc_open(dev, NULL, &error);
+    assert(msc != NULL && error == USBX_SUCCESS);
+
+    struct usbx_msc_stats stats;
+    usbx_msc_get_stats(msc, &stats);
+    assert(stats.block_size == BLOCK_SIZE && stats.block_count == BLOCK_COUNT);
+
+    size_t length = 3000 * BLOCK_SIZE;
+    unsigned char *data = malloc(length), *copy = malloc(length);
+    usbx_sim_fill_pattern(data, length, 0);
+    assert(usbx_msc_write(msc, 100, 3000, data) == USBX_SUCCESS);
+    assert(memcmp(usbx_sim_msc_disk(sim) + 100 * BLOCK_SIZE, data, length) == 0);
+    assert(usbx_msc_read(msc, 100, 3000, copy) == USBX_SUCCESS);
+    assert(memcmp(copy, data, length) == 0);
+
+    // 1.5 MiB in 1 MiB commands: two writes, and two reads for the aligned lines
+    struct usbx_sim_msc_stats sim_stats;
+    usbx_sim_msc_get_stats(sim, &sim_stats);
+    assert(sim_stats.writes == 2 && sim_stats.blocks_written == 3000);
+    assert(sim_stats.reads == 2 && sim_stats.failed == 0);
+
+    assert(usbx_msc_read(msc, BLOCK_COUNT - 1, 2, copy) == USBX_ERROR_INVALID_PARAM);
+    assert(usbx_msc_write(msc, BLOCK_COUNT, 1, data) == USBX_ERROR_INVALID_PARAM);
+    assert(usbx_msc_read(msc, BLOCK_COUNT - 1, 1, copy) == USBX_SUCCESS);
+
+    usbx_msc_close(msc);
+    usbx_device_destroy(dev);
+    usbx_sim_msc_destroy(sim);
+    free(data);
+    free(copy);
+    printf("✓ %zu bytes written and read back in %llu commands\n", length,
+           (unsigned long long)(sim_stats.reads + sim_stats.writes));
+}
+
+/**
+ * Test 2: sequential reads are served from read-ahead, writes keep the cache coherent
+ */
+void test_cache() {
+    printf("TEST: Read-ahead cache\n");
+    struct usbx_sim_msc *sim = create_sim();
+    struct usbx_device *dev = usbx_sim_msc_device_create(sim);
+    usbx_sim_fill_pattern(usbx_sim_msc_disk(sim), (size_t)BLOCK_COUNT * BLOCK_SIZE, 0);
+    struct usbx_msc_options opts;
+    usbx_msc_options_init(&opts);
+    opts.cache_size = 256 * 1024;
+    struct usbx_msc *msc = usbx_msc_open(dev, &opts, NULL);
+    assert(msc != NULL);
+
+    unsigned char block[8 * BLOCK_SIZE];
+    for (uint64_t lba = 0; lba < 1024; lba += 8) {
+        assert(usbx_msc_read(msc, lba, 8, block) == USBX_SUCCESS);
+        for (size_t i = 0; i < sizeof(block); i++) {
+            assert(block[i] == usbx_sim_pattern_byte(lba * BLOCK_SIZE + i));
+        }
+    }
+    struct usbx_msc_stats stats;
+    struct usbx_sim_msc_stats sim_stats;
+    usbx_msc_get_stats(msc, &stats);
+    usbx_sim_msc_get_stats(sim, &sim_stats);
+    assert(stats.cache_hits + stats.cache_misses == 1024);
+    assert(stats.cache_hits > stats.cache_misses && stats.read_ahead_blocks > 0);
+    assert(sim_stats.reads <= 8);
+    printf("✓ 128 reads of 8 blocks: %llu commands, %llu hits, %llu read ahead\n",
+           (unsigned long long)sim_stats.reads, (unsigned long long)stats.cache_hits,
+           (unsigned long long)stats.read_ahead_blocks);
+
+    // A write updates the cached copy
+    memset(block, 0xa5, BLOCK_SIZE);
+    assert(usbx_msc_write(msc, 1000, 1, block) == USBX_SUCCESS);
+    memset(block, 0, BLOCK_SIZE);
+    uint64_t reads = sim_stats.reads;
+    assert(usbx_msc_read(msc, 1000, 1, block) == USBX_SUCCESS);
+    usbx_sim_msc_get_stats(sim, &sim_stats);
+    assert(block[0] == 0xa5 && block[BLOCK_SIZE - 1] == 0xa5 && sim_stats.reads == reads);
+
+    // 256 KiB holds 8 lines: the first lines have been evicted
+    assert(usbx_msc_read(msc, 0, 1, block) == USBX_SUCCESS);
+    usbx_sim_msc_get_stats(sim, &sim_stats);
+    assert(sim_stats.reads == reads + 1 && block[0] == usbx_sim_pattern_byte(0));
+
+    usbx_msc_close(msc);
+    usbx_device_destroy(dev);
+    usbx_sim_msc_destroy(sim);
+    printf("✓ write-through and LRU eviction\n");
+}
+
+/**
+ * Test 3: reset recovery after an invalid CBW and failed commands
+ */
+void test_recovery() {
+    printf("TEST: Reset recovery\n");
+    struct usbx_sim_msc *sim = create_sim();
+    struct usbx_device *dev = usbx_sim_msc_device_create(sim);
+    struct usbx_msc_options opts;
+    usbx_msc_options_init(&opts);
+    opts.cache_size = 0;
+    struct usbx_msc *msc = usbx_msc_open(dev, &opts, NULL);
+    assert(msc != NULL);
+
+    // Garbage on the OUT pipe stalls both pipes until reset recovery
+    unsigned char garbage[USBX_MSC_CBW_SIZE];
+    int transferred = 0;
+    memset(garbage, 0x55, sizeof(garbage));
+    assert(usbx_bulk_transfer(dev, 0x02, garbage, sizeof(garbage), &transferred, 1000) ==
+           USBX_ERROR_PIPE);
+    unsigned char block[BLOCK_SIZE];
+    assert(usbx_msc_read(msc, 7, 1, block) == USBX_SUCCESS);
+
+    struct usbx_msc_stats stats;
+    struct usbx_sim_msc_stats sim_stats;
+    usbx_msc_get_stats(msc, &stats);
+    usbx_sim_msc_get_stats(sim, &sim_stats);
+    assert(stats.recoveries == 1 && sim_stats.resets == 1 && sim_stats.invalid_cbws == 1);
+    assert(stats.cache_hits == 0 && stats.cache_misses == 1);
+    usbx_msc_close(msc);
+
+    // A LUN the device does not have fails with sense data
+    int error = 0;
+    opts.lun = 1;
+    assert(usbx_msc_open(dev, &opts, &error) == NULL && error == USBX_ERROR_IO);
+    usbx_sim_msc_get_stats(sim, &sim_stats);
+    assert(sim_stats.failed == 3);
+    opts.lun = 0;
+    opts.in_endpoint = 0x02;
+    assert(usbx_msc_open(dev, &opts, &error) == NULL && error == USBX_ERROR_INVALID_PARAM);
+
+    usbx_device_destroy(dev);
+    usbx_sim_msc_destroy(sim);
+    printf("✓ invalid CBW recovered, unknown LUN rejected\n");
+}
+
+static void request(struct usbx_http_router *router, const char *method, const char *path,
+                    struct usbx_http_pair *args, int num_args, const unsigned char *body,
+                    size_t length, struct usbx_http_response *resp) {
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = method;
+    req.path = path;
+    req.args = args;
+    req.num_args = num_args;
+    req.body = body;
+    req.body_length = length;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+/**
+ * Test 4: GET/PUT /handles/{id}/blocks
+ */
+void test_route() {
+    printf("TEST: GET/PUT /handles/{id}/blocks\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    struct usbx_sim_msc *sim = create_sim();
+    int handle_id = usbx_handle_add(usbx_sim_msc_device_create(sim), NULL);
+    char path[64];
+    snprintf(path, sizeof(path), "/handles/%d/blocks", handle_id);
+    struct usbx_http_response resp;
+
+    struct usbx_http_pair bad_endpoint[1] = {{"in", "0x02"}};
+    request(router, "GET", path, bad_endpoint, 1, NULL, 0, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    request(router, "GET", path, NULL, 0, NULL, 0, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"block_size\": 512") &&
+           strstr(resp.body, "\"block_count\": 4096"));
+    usbx_http_response_free(&resp);
+
+    unsigned char data[4 * BLOCK_SIZE];
+    usbx_sim_fill_pattern(data, sizeof(data), 3);
+    struct usbx_http_pair write_args[1] = {{"lba", "10"}};
+    request(router, "PUT", path, write_args, 1, data, sizeof(data), &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"count\": 4"));
+    usbx_http_response_free(&resp);
+    request(router, "PUT", path, write_args, 1, data, 100, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+
+    struct usbx_http_pair read_args[2] = {{"lba", "10"}, {"count", "4"}};
+    request(router, "GET", path, read_args, 2, NULL, 0, &resp);
+    assert(resp.status == 200 && resp.body_length == sizeof(data));
+    assert(strcmp(resp.content_type, "application/octet-stream") == 0);
+    assert(memcmp(resp.body, data, sizeof(data)) == 0);
+    usbx_http_response_free(&resp);
+
+    struct usbx_http_pair outside[2] = {{"lba", "4095"}, {"count", "2"}};
+    request(router, "GET", path, outside, 2, NULL, 0, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    struct usbx_http_pair too_many[2] = {{"lba", "0"}, {"count", "-1"}};
+    request(router, "GET", path, too_many, 2, NULL, 0, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+
+    usbx_handle_remove(handle_id);
+    usbx_sim_msc_destroy(sim);
+    usbx_http_router_destroy(router);
+    printf("✓ geometry, block reads and writes, range errors\n");
+}
+
+int main() {
+    printf("=== Mass-Storage Tests ===\n\n");
+
+    test_read_write();
+    test_cache();
+    test_recovery();
+    test_route();
+
+    printf("\n=== All mass-storage tests passed ===\n");
+    return 0;
+}
@@ -0,0 +1,273 @@
+/*
+ * Unit tests for shared bulk IN streams
+ *
+ * Runs against the simulated backend, whose bulk IN endpoint produces the
+ * reference pattern, so every subscriber can check its bytes by stream
+ * offset.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_pubsub.h"
+#include "usbx_sim.h"
+#include "usbx_util.h"
+
+#define EP_IN 0x82
+#define PACKET 512
+#define CHUNK (16 * 1024)
+
+static struct usbx_device *create_device(unsigned int latency_us, uint64_t bytes_per_sec) {
+    struct usbx_sim_endpoint_config endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.address = EP_IN;
+    endpoint.type = USBX_TRANSFER_TYPE_BULK;
+    endpoint.max_packet_size = PACKET;
+    endpoint.latency_us = latency_us;
+    endpoint.bytes_per_sec = bytes_per_sec;
+
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = &endpoint;
+    config.num_endpoints = 1;
+
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    assert(dev != NULL);
+    return dev;
+}
+
+static struct usbx_pubsub *start(struct usbx_device *dev) {
+    struct usbx_pubsub_options opts;
+    usbx_pubsub_options_init(&opts);
+    opts.chunk_size = CHUNK;
+    struct usbx_pubsub *pubsub = usbx_pubsub_start(dev, EP_IN, &opts, NULL);
+    assert(pubsub != NULL);
+    return pubsub;
+}
+
+/* Read @p total bytes and check them against the pattern from @p offset */
+static void read_checked(struct usbx_pubsub *pubsub, int subscriber, uint64_t offset,
+                         size_t total) {
+    unsigned char buffer[5000];     // deliberately not a chunk multiple
+    size_t done = 0;
+
+    while (done < total) {
+        size_t want = total - done < sizeof(buffer) ? total - done : sizeof(buffer);
+        long n = usbx_pubsub_read(pubsub, subscriber, buffer, want, 1000);
+        assert(n > 0);
+        for (long i = 0; i < n; i++) {
+            assert(buffer[i] == usbx_sim_pattern_byte(offset + done + (size_t)i));
+        }
+        done += (size_t)n;
+    }
+}
+
+struct reader_args {
+    struct usbx_pubsub *pubsub;
+    int subscriber;
+};
+
+static void *reader_thread(void *arg) {
+    struct reader_args *args = arg;
+    read_checked(args->pubsub, args->subscriber, 0, 1024 * 1024);
+    return NULL;
+}
+
+/**
+ * Test 1: concurrent subscribers share one device stream
+ */
+void test_shared_stream() {
+    printf("TEST: three subscribers share one device stream\n");
+    struct usbx_device *dev = create_device(20000, 0);   // nothing arrives before we subscribe
+    struct usbx_pubsub *pubsub = start(dev);
+
+    pthread_t threads[3];
+    struct reader_args args[3];
+    for (int i = 0; i < 3; i++) {
+        args[i].pubsub = pubsub;
+        args[i].subscriber = usbx_pubsub_subscribe(pubsub, USBX_PUBSUB_BOUNDED, 256 * 1024);
+        assert(args[i].subscriber > 0);
+    }
+    for (int i = 0; i < 3; i++) {
+        assert(pthread_create(&threads[i], NULL, reader_thread, &args[i]) == 0);
+    }
+    for (int i = 0; i < 3; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    struct usbx_pubsub_stats stats;
+    usbx_pubsub_get_stats(pubsub, &stats);
+    usbx_pubsub_destroy(pubsub);
+
+    struct usbx_sim_endpoint_stats sim;
+    usbx_sim_get_endpoint_stats(dev, EP_IN, &sim);
+    assert(sim.bytes >= stats.bytes);
+    assert(stats.bytes >= 1024 * 1024);
+    assert(stats.bytes < 3 * 1024 * 1024);   // read from the device once, not per subscriber
+    usbx_device_destroy(dev);
+    printf("✓ 3 MiB delivered from %llu device bytes\n", (unsigned long long)stats.bytes);
+}
+
+/**
+ * Test 2: a slow drop-policy subscriber loses old data but stays in sync
+ */
+void test_drop_policy() {
+    printf("TEST: drop policy skips old data\n");
+    struct usbx_device *dev = create_device(20000, 0);
+    struct usbx_pubsub *pubsub = start(dev);
+    int fast = usbx_pubsub_subscribe(pubsub, USBX_PUBSUB_BOUNDED, 256 * 1024);
+    int slow = usbx_pubsub_subscribe(pubsub, USBX_PUBSUB_DROP, 64 * 1024);
+
+    read_checked(pubsub, fast, 0, 2 * 1024 * 1024);
+
+    struct usbx_pubsub_subscriber_stats sub;
+    assert(usbx_pubsub_subscriber_stats(pubsub, slow, &sub) == USBX_SUCCESS);
+    assert(sub.dropped > 0);
+    assert(sub.backlog <= 64 * 1024);
+    assert(sub.dropped % CHUNK == 0);
+    uint64_t dropped = sub.dropped;
+
+    // The chain only retains what the slow subscriber may still read
+    struct usbx_pubsub_stats stats;
+    usbx_pubsub_get_stats(pubsub, &stats);
+    assert(stats.retained_bytes <= 256 * 1024 + (USBX_PUBSUB_DEFAULT_IN_FLIGHT + 1) * CHUNK);
+
+    read_checked(pubsub, slow, dropped, CHUNK);
+    usbx_pubsub_destroy(pubsub);
+    usbx_device_destroy(dev);
+    printf("✓ slow subscriber dropped %llu bytes and resumed in sync\n",
+           (unsigned long long)dropped);
+}
+
+/**
+ * Test 3: a disconnect-policy subscriber is cut off
+ */
+void test_disconnect_policy() {
+    printf("TEST: disconnect policy ends the subscription\n");
+    struct usbx_device *dev = create_device(20000, 0);
+    struct usbx_pubsub *pubsub = start(dev);
+    int fast = usbx_pubsub_subscribe(pubsub, USBX_PUBSUB_BOUNDED, 256 * 1024);
+    int slow = usbx_pubsub_subscribe(pubsub, USBX_PUBSUB_DISCONNECT, 64 * 1024);
+
+    read_checked(pubsub, fast, 0, 1024 * 1024);
+
+    unsigned char buffer[64];
+    assert(usbx_pubsub_read(pubsub, slow, buffer, sizeof(buffer), 0) == USBX_ERROR_OVERFLOW);
+    struct usbx_pubsub_subscriber_stats sub;
+    usbx_pubsub_subscriber_stats(pubsub, slow, &sub);
+    assert(sub.disconnected && sub.dropped > 64 * 1024 && sub.backlog == 0);
+    assert(usbx_pubsub_unsubscribe(pubsub, slow) == 1);
+    assert(usbx_pubsub_read(pubsub, slow, buffer, sizeof(buffer), 0) == USBX_ERROR_NOT_FOUND);
+
+    usbx_pubsub_destroy(pubsub);
+    usbx_device_destroy(dev);
+    printf("✓ slow subscriber disconnected, fast subscriber unaffected\n");
+}
+
+/**
+ * Test 4: a bounded subscriber pauses the publisher until it catches up
+ */
+void test_bounded_policy() {
+    printf("TEST: bounded policy throttles the publisher\n");
+    struct usbx_device *dev = create_device(0, 0);
+    struct usbx_pubsub *pubsub = start(dev);
+    int sub = usbx_pubsub_subscribe(pubsub, USBX_PUBSUB_BOUNDED, 128 * 1024);
+
+    usbx_sleep_us(50000);
+    struct usbx_pubsub_stats stats;
+    usbx_pubsub_get_stats(pubsub, &stats);
+    assert(stats.paused && stats.pauses == 1);
+    assert(stats.bytes <= 128 * 1024 + USBX_PUBSUB_DEFAULT_IN_FLIGHT * CHUNK);
+    uint64_t paused_at = stats.bytes;
+
+    read_checked(pubsub, sub, 0, (size_t)paused_at + 512 * 1024);
+    usbx_pubsub_get_stats(pubsub, &stats);
+    assert(stats.bytes > paused_at);
+
+    struct usbx_pubsub_subscriber_stats sub_stats;
+    usbx_pubsub_subscriber_stats(pubsub, sub, &sub_stats);
+    assert(sub_stats.dropped == 0);
+    usbx_pubsub_destroy(pubsub);
+    usbx_device_destroy(dev);
+    printf("✓ paused at %llu bytes, resumed without loss\n", (unsigned long long)paused_at);
+}
+
+static void call(struct usbx_http_router *router, const char *path, const char *policy,
+                 struct usbx_http_response *resp) {
+    struct usbx_http_pair args[1] = {{"policy", policy}};
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = "GET";
+    req.path = path;
+    req.args = args;
+    req.num_args = policy ? 1 : 0;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+/**
+ * Test 5: REST streams share one publisher and release it when closed
+ */
+void test_routes() {
+    printf("TEST: shared stream REST routes\n");
+    int handle_id = usbx_handle_add(create_device(20000, 0), NULL);
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+
+    char data_path[64], status_path[64];
+    snprintf(data_path, sizeof(data_path), "/handles/%d/streams/0x82/data", handle_id);
+    snprintf(status_path, sizeof(status_path), "/handles/%d/streams/0x82", handle_id);
+
+    struct usbx_http_response bad, first, second, status;
+    call(router, data_path, "sometimes", &bad);
+    assert(bad.status == 400);
+    usbx_http_response_free(&bad);
+
+    call(router, data_path, "bounded", &first);
+    call(router, data_path, NULL, &second);
+    assert(first.status == 200 && first.reader && second.reader);
+    assert(strcmp(first.content_type, "application/octet-stream") == 0);
+
+    char buffer[4096];
+    uint64_t pos = 0;
+    while (pos < 64 * 1024) {
+        ssize_t n = first.reader(first.reader_cls, pos, buffer, sizeof(buffer));
+        assert(n >= 0);
+        for (ssize_t i = 0; i < n; i++) {
+            assert((unsigned char)buffer[i] == usbx_sim_pattern_byte(pos + (uint64_t)i));
+        }
+        pos += (uint64_t)n;
+    }
+
+    call(router, status_path, NULL, &status);
+    assert(status.status == 200);
+    assert(strstr(status.body, "\"policy\": \"bounded\"") != NULL);
+    assert(strstr(status.body, "\"policy\": \"drop\"") != NULL);
+    usbx_http_response_free(&status);
+
+    usbx_http_response_free(&first);
+    usbx_http_response_free(&second);
+    call(router, status_path, NULL, &status);
+    assert(status.status == 404);   // last subscriber gone, publisher released
+    usbx_http_response_free(&status);
+
+    usbx_handle_remove(handle_id);
+    usbx_http_router_destroy(router);
+    printf("✓ two HTTP subscribers on one publisher\n");
+}
+
+int main() {
+    printf("=== Shared Bulk Stream Tests ===\n\n");
+
+    test_shared_stream();
+    test_drop_policy();
+    test_disconnect_policy();
+    test_bounded_policy();
+    test_routes();
+
+    printf("\n=== All shared bulk stream tests passed ===\n");
+    return 0;
+}
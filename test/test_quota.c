@@ -0,0 +1,344 @@
+/*
+ * Unit tests for per-client quotas
+ *
+ * Request buckets have to admit a burst, refuse the next request with a
+ * wait matching the rate and refill over time, independently per client.
+ * Bytes charged past the byte burst have to hold off the client's next
+ * request until the debt is paid, and transfers are charged what they
+ * moved on completion, on devices without taps too. Concurrent admissions
+ * must never exceed the burst, also while new clients grow the table.
+ * The REST test drives 429 and Retry-After through the router,
+ * with bytes charged by the transfers of a batch. Keys without limits of
+ * their own must be charged to the peer address.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbx_api.h"
+#include "usbx_quota.h"
+#include "usbx_sha256.h"
+#include "usbx_sim.h"
+
+#define THREADS 8
+#define ATTEMPTS 100
+#define CLIENTS_PER_THREAD 40
+
+static void sleep_ms(int ms) {
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+static const struct usbx_quota_usage *find_usage(const struct usbx_quota_usage *usage, int count,
+                                                 const char *client) {
+    char hex[USBX_SHA256_HEX_SIZE];
+    usbx_sha256_hex(client, strlen(client), hex);
+    for (int i = 0; i < count; i++) {
+        if (strncmp(usage[i].fingerprint, hex, USBX_QUOTA_FINGERPRINT_SIZE - 1) == 0) {
+            return &usage[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Test 1: request buckets per client
+ */
+void test_request_rate() {
+    printf("TEST: Request rate per client\n");
+    struct usbx_quota_limits limits = {.requests_per_sec = 10, .request_burst = 2};
+    unsigned int retry_after_ms = 0;
+
+    assert(usbx_quota_admit("a", NULL, &retry_after_ms) == USBX_SUCCESS);   // unlimited
+    assert(usbx_quota_current() == NULL && usbx_quota_get_usage(NULL, 0) == 0);
+    usbx_quota_set_defaults(&limits);
+
+    assert(usbx_quota_admit("a", NULL, &retry_after_ms) == USBX_SUCCESS);
+    assert(usbx_quota_current() != NULL);
+    assert(usbx_quota_admit("a", NULL, &retry_after_ms) == USBX_SUCCESS);
+    assert(usbx_quota_admit("a", NULL, &retry_after_ms) == USBX_ERROR_BUSY);
+    assert(retry_after_ms > 0 && retry_after_ms <= 100 && usbx_quota_current() == NULL);
+    assert(usbx_quota_admit("b", NULL, &retry_after_ms) == USBX_SUCCESS);
+    assert(usbx_quota_admit(NULL, NULL, &retry_after_ms) == USBX_SUCCESS);
+    sleep_ms(110);
+    assert(usbx_quota_admit("a", NULL, &retry_after_ms) == USBX_SUCCESS);
+
+    // A client of its own: unlimited while the defaults stay
+    struct usbx_quota_limits unlimited = {0};
+    assert(usbx_quota_set_client("a", &unlimited) == USBX_SUCCESS);
+    for (int i = 0; i < 20; i++) {
+        assert(usbx_quota_admit("a", NULL, &retry_after_ms) == USBX_SUCCESS);
+    }
+    assert(usbx_quota_clear_client("a") == USBX_SUCCESS);
+    assert(usbx_quota_clear_client("a") == USBX_ERROR_NOT_FOUND);
+    assert(usbx_quota_admit("a", NULL, &retry_after_ms) == USBX_ERROR_BUSY);
+
+    struct usbx_quota_usage usage[4];
+    assert(usbx_quota_get_usage(usage, 4) == 2);
+    const struct usbx_quota_usage *a = find_usage(usage, 2, "a");
+    assert(a && a->admitted == 23 && a->rejected == 2 && !a->custom);
+    assert(a->limits.requests_per_sec == 10 && a->retry_after_ms > 0);
+    assert(strlen(a->fingerprint) == USBX_QUOTA_FINGERPRINT_SIZE - 1);
+    usbx_quota_reset();
+    printf("✓ burst of 2, refused for <= 100 ms, refilled, per-client override\n");
+}
+
+/**
+ * Test 2: bytes past the burst hold off the next request
+ */
+void test_byte_debt() {
+    printf("TEST: Bandwidth debt\n");
+    struct usbx_quota_limits limits = {.bytes_per_sec = 1000, .byte_burst = 1000};
+    unsigned int retry_after_ms = 0;
+    assert(usbx_quota_set_client("c", &limits) == USBX_SUCCESS);
+
+    assert(usbx_quota_admit("c", NULL, &retry_after_ms) == USBX_SUCCESS);
+    usbx_quota_charge(1000);
+    assert(usbx_quota_admit("c", NULL, &retry_after_ms) == USBX_SUCCESS);
+    usbx_quota_charge(2000);          // 2 s in debt
+    assert(usbx_quota_admit("c", NULL, &retry_after_ms) == USBX_ERROR_BUSY);
+    assert(retry_after_ms > 1900 && retry_after_ms <= 2000);
+    usbx_quota_charge(1000);          // not charged: refused requests charge nobody
+    assert(usbx_quota_admit("d", NULL, &retry_after_ms) == USBX_SUCCESS);
+
+    struct usbx_quota_usage usage[4];
+    assert(usbx_quota_get_usage(usage, 4) == 2);
+    const struct usbx_quota_usage *c = find_usage(usage, 2, "c");
+    assert(c && c->custom && c->bytes == 3000 && c->admitted == 2 && c->rejected == 1);
+    assert(c->retry_after_ms > 1900 && c->retry_after_ms <= 2000);
+
+    // A transfer on a device without taps is charged too, for the bytes it moved
+    struct usbx_sim_endpoint_config endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.address = 0x81;
+    endpoint.type = USBX_TRANSFER_TYPE_BULK;
+    endpoint.max_packet_size = 512;
+    endpoint.message_size = 48;
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = &endpoint;
+    config.num_endpoints = 1;
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    unsigned char data[64];
+    assert(dev && dev->taps == 0);
+    assert(usbx_quota_admit("d", NULL, &retry_after_ms) == USBX_SUCCESS);
+    assert(usbx_bulk_transfer(dev, 0x81, data, sizeof(data), NULL, 1000) == USBX_SUCCESS);
+    assert(usbx_bulk_transfer(dev, 0x82, data, sizeof(data), NULL, 1000) < 0);   // refused
+    assert(usbx_quota_get_usage(usage, 4) == 2);
+    const struct usbx_quota_usage *d = find_usage(usage, 2, "d");
+    assert(d && d->bytes == 48);
+    usbx_device_destroy(dev);
+
+    usbx_quota_set_current(NULL);
+    usbx_quota_reset();
+    printf("✓ 3000 bytes against 1000 B/s with a 1000 B burst: refused for ~2 s\n");
+    printf("✓ transfers charged on a device without taps, for the bytes they moved\n");
+}
+
+struct hammer_args {
+    int thread;
+    int *admitted;
+};
+
+static void *hammer(void *arg) {
+    struct hammer_args *args = arg;
+    unsigned int retry_after_ms;
+    char client[32];
+    for (int i = 0; i < ATTEMPTS; i++) {
+        if (usbx_quota_admit("shared", NULL, &retry_after_ms) == USBX_SUCCESS) {
+            __atomic_fetch_add(args->admitted, 1, __ATOMIC_RELAXED);
+        }
+        // New clients grow the table under the other threads' lookups
+        if (i < CLIENTS_PER_THREAD) {
+            snprintf(client, sizeof(client), "client-%d-%d", args->thread, i);
+            assert(usbx_quota_admit(client, NULL, &retry_after_ms) == USBX_SUCCESS);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Test 3: concurrent admissions stay within the burst
+ */
+void test_concurrent() {
+    printf("TEST: Concurrent admissions\n");
+    struct usbx_quota_limits limits = {.requests_per_sec = 1, .request_burst = 50};
+    pthread_t threads[THREADS];
+    struct hammer_args args[THREADS];
+    int admitted = 0;
+
+    usbx_quota_set_defaults(&limits);
+    for (int i = 0; i < THREADS; i++) {
+        args[i] = (struct hammer_args){.thread = i, .admitted = &admitted};
+        assert(pthread_create(&threads[i], NULL, hammer, &args[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    // One more token may have been refilled while the threads ran
+    assert(admitted >= 50 && admitted <= 51);
+    assert(usbx_quota_get_usage(NULL, 0) == THREADS * CLIENTS_PER_THREAD + 1);
+    unsigned int retry_after_ms;
+    assert(usbx_quota_admit("client-3-7", NULL, &retry_after_ms) == USBX_SUCCESS);
+    struct usbx_quota_usage usage[THREADS * CLIENTS_PER_THREAD + 1];
+    assert(usbx_quota_get_usage(usage, THREADS * CLIENTS_PER_THREAD + 1) ==
+           THREADS * CLIENTS_PER_THREAD + 1);
+    assert(find_usage(usage, THREADS * CLIENTS_PER_THREAD + 1, "client-3-7")->admitted == 2);
+    usbx_quota_reset();
+    printf("✓ %d of %d admitted while %d clients were added\n", admitted, THREADS * ATTEMPTS,
+           THREADS * CLIENTS_PER_THREAD);
+}
+
+static void dispatch(struct usbx_http_router *router, const char *method, const char *path,
+                     const char *client, struct usbx_http_pair *args, int num_args,
+                     const char *body, struct usbx_http_response *resp) {
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = method;
+    req.path = path;
+    req.client_id = client;
+    req.args = args;
+    req.num_args = num_args;
+    req.body = (const unsigned char *)body;
+    req.body_length = body ? strlen(body) : 0;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+static const char *header(const struct usbx_http_response *resp, const char *name) {
+    for (int i = 0; i < resp->num_headers; i++) {
+        if (strcmp(resp->headers[i].name, name) == 0) {
+            return resp->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Test 4: 429 with Retry-After through the router, and /quotas
+ */
+void test_routes() {
+    printf("TEST: 429 and /quotas\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    struct usbx_sim_endpoint_config endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.address = 0x81;
+    endpoint.type = USBX_TRANSFER_TYPE_BULK;
+    endpoint.max_packet_size = 512;
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = &endpoint;
+    config.num_endpoints = 1;
+    int id = usbx_handle_add(usbx_sim_device_create(&config), NULL);
+    char batch[64];
+    snprintf(batch, sizeof(batch), "/handles/%d/batch", id);
+    struct usbx_http_response resp;
+
+    struct usbx_http_pair bad[1] = {{"requests_per_sec", "-1"}};
+    dispatch(router, "POST", "/quotas", "admin", bad, 1, NULL, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    struct usbx_http_pair slow[3] = {{"client", "key-1"}, {"requests_per_sec", "1"},
+                                     {"request_burst", "1"}};
+    dispatch(router, "POST", "/quotas", "admin", slow, 3, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"custom\": true, \"requests_per_sec\": 1, "
+                                        "\"request_burst\": 1, \"bytes_per_sec\": 0"));
+    assert(!strstr(resp.body, "key-1"));
+    usbx_http_response_free(&resp);
+
+    dispatch(router, "GET", "/quotas", "key-1", NULL, 0, NULL, &resp);
+    assert(resp.status == 200);
+    usbx_http_response_free(&resp);
+    dispatch(router, "GET", "/quotas", "key-1", NULL, 0, NULL, &resp);
+    assert(resp.status == 429 && header(&resp, "Retry-After"));
+    assert(strcmp(header(&resp, "Retry-After"), "1") == 0);
+    usbx_http_response_free(&resp);
+    dispatch(router, "GET", "/quotas", "key-2", NULL, 0, NULL, &resp);
+    assert(resp.status == 200);
+    usbx_http_response_free(&resp);
+
+    // 128 bytes of transfers against 64 B/s: the next request waits ~1 s
+    struct usbx_http_pair narrow[3] = {{"client", "key-2"}, {"bytes_per_sec", "64"},
+                                       {"byte_burst", "64"}};
+    dispatch(router, "POST", "/quotas", "admin", narrow, 3, NULL, &resp);
+    assert(resp.status == 200);
+    usbx_http_response_free(&resp);
+    const char *body = "{\"operations\": [{\"op\": \"bulk\", \"endpoint\": 129, \"length\": 64}, "
+                       "{\"op\": \"bulk\", \"endpoint\": 129, \"length\": 64}]}";
+    dispatch(router, "POST", batch, "key-2", NULL, 0, body, &resp);
+    assert(resp.status == 200);
+    usbx_http_response_free(&resp);
+    assert(usbx_quota_current() == NULL);
+    dispatch(router, "POST", batch, "key-2", NULL, 0, body, &resp);
+    assert(resp.status == 429 && strcmp(header(&resp, "Retry-After"), "1") == 0);
+    assert(strstr(resp.body, "USBX_ERROR_BUSY"));
+    usbx_http_response_free(&resp);
+
+    dispatch(router, "GET", "/quotas", "admin", NULL, 0, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"bytes\": 128"));
+    usbx_http_response_free(&resp);
+    struct usbx_http_pair clear[1] = {{"client", "key-2"}};
+    dispatch(router, "DELETE", "/quotas", "admin", clear, 1, NULL, &resp);
+    assert(resp.status == 200);
+    usbx_http_response_free(&resp);
+    dispatch(router, "DELETE", "/quotas", "admin", clear, 1, NULL, &resp);
+    assert(resp.status == 404);
+    usbx_http_response_free(&resp);
+    dispatch(router, "POST", batch, "key-2", NULL, 0, body, &resp);
+    assert(resp.status == 200);
+    usbx_http_response_free(&resp);
+
+    usbx_handle_remove(id);
+    usbx_http_router_destroy(router);
+    usbx_quota_reset();
+    printf("✓ Retry-After on request and bandwidth quotas, limits set and cleared\n");
+}
+
+/**
+ * Test 5: keys without limits of their own are charged to the peer address
+ */
+void test_identity() {
+    printf("TEST: Client identity\n");
+    struct usbx_quota_limits limits = {.requests_per_sec = 1, .request_burst = 2};
+    struct usbx_quota_limits own = {.requests_per_sec = 1, .request_burst = 1};
+    unsigned int retry_after_ms = 0;
+    char key[32];
+
+    usbx_quota_set_defaults(&limits);
+    assert(usbx_quota_set_client("key-1", &own) == USBX_SUCCESS);
+    for (int i = 0; i < 3; i++) {
+        snprintf(key, sizeof(key), "made-up-%d", i);
+        assert(usbx_quota_admit(key, "10.0.0.1", &retry_after_ms) ==
+               (i < 2 ? USBX_SUCCESS : USBX_ERROR_BUSY));
+    }
+    assert(usbx_quota_admit("key-1", "10.0.0.1", &retry_after_ms) == USBX_SUCCESS);
+    assert(usbx_quota_admit("key-1", "10.0.0.1", &retry_after_ms) == USBX_ERROR_BUSY);
+    assert(usbx_quota_admit("made-up-0", "10.0.0.2", &retry_after_ms) == USBX_SUCCESS);
+
+    struct usbx_quota_usage usage[4];
+    assert(usbx_quota_get_usage(usage, 4) == 3);
+    const struct usbx_quota_usage *address = find_usage(usage, 3, "10.0.0.1");
+    assert(address && address->admitted == 2 && address->rejected == 1 && !address->custom);
+    const struct usbx_quota_usage *key_1 = find_usage(usage, 3, "key-1");
+    assert(key_1 && key_1->admitted == 1 && key_1->rejected == 1 && key_1->custom);
+    assert(find_usage(usage, 3, "10.0.0.2") && !find_usage(usage, 3, "made-up-0"));
+    usbx_quota_reset();
+    printf("✓ made-up keys share their address's bucket, configured keys have their own\n");
+}
+
+int main() {
+    printf("=== Quota Tests ===\n\n");
+    test_request_rate();
+    test_byte_debt();
+    test_concurrent();
+    test_routes();
+    test_identity();
+    printf("\n=== All quota tests passed ===\n");
+    return 0;
+}
@@ -0,0 +1,356 @@
+/*
+ * Unit tests for stall recovery and timeout retries
+ *
+ * A simulated device halts its bulk endpoints on demand, lets transfers
+ * time out, and clears halts on CLEAR_FEATURE(ENDPOINT_HALT). Batches run
+ * against it under retry policies check clear-and-retry, bounded timeout
+ * retries with backoff, the idempotency rules and the counters, then the
+ * /handles/{id}/retry routes.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_buf.h"
+#include "usbx_json.h"
+#include "usbx_ops.h"
+#include "usbx_retry.h"
+#include "usbx_sim.h"
+#include "usbx_util.h"
+
+#define EP_IN 0x81
+#define EP_OUT 0x02
+
+/** @brief Misbehaviour of one simulated endpoint */
+struct endpoint_state {
+    int halted;                  // stalls until cleared
+    int stall_next;              // halt on this many upcoming transfers
+    int timeout_next;            // never complete this many upcoming transfers
+    size_t partial;              // bytes accepted before a stall
+    int transfers;
+};
+
+/** @brief Device state shared by the handlers */
+struct device_state {
+    struct endpoint_state in, out;
+    int clear_halts;
+    int control_stall_next;
+    int control_requests;
+};
+
+static int endpoint_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                            uint64_t *retry_at_us) {
+    struct endpoint_state *ep = cls;
+    ep->transfers++;
+    if (ep->timeout_next > 0) {
+        ep->timeout_next--;
+        *retry_at_us = now_us + 60000000ULL;    // past any deadline
+        return USBX_SIM_RETRY;
+    }
+    if (ep->stall_next > 0) {
+        ep->stall_next--;
+        ep->halted = 1;
+    }
+    if (ep->halted) {
+        xfer->actual_length = (int)(ep->partial < (size_t)xfer->length ? ep->partial
+                                                                        : (size_t)xfer->length);
+        return USBX_TRANSFER_STALL;
+    }
+    if (xfer->endpoint & USBX_ENDPOINT_IN) {
+        usbx_sim_fill_pattern(xfer->buffer, (size_t)xfer->length, 0);
+    }
+    xfer->actual_length = xfer->length;
+    return USBX_TRANSFER_COMPLETED;
+}
+
+static int control_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                           uint64_t *retry_at_us) {
+    struct device_state *state = cls;
+    const unsigned char *setup = xfer->buffer;
+    (void)now_us;
+    (void)retry_at_us;
+    if (setup[0] == 0x02 && setup[1] == 0x01 && setup[2] == 0 && setup[3] == 0) {
+        state->clear_halts++;
+        if (setup[4] == EP_IN) {
+            state->in.halted = 0;
+        } else if (setup[4] == EP_OUT) {
+            state->out.halted = 0;
+        }
+        xfer->actual_length = 0;
+        return USBX_TRANSFER_COMPLETED;
+    }
+    state->control_requests++;
+    if (state->control_stall_next > 0) {
+        state->control_stall_next--;
+        return USBX_TRANSFER_STALL;
+    }
+    xfer->actual_length = 0;
+    return USBX_TRANSFER_COMPLETED;
+}
+
+static struct usbx_device *create_device(struct device_state *state) {
+    struct usbx_sim_endpoint_config endpoints[2];
+    memset(state, 0, sizeof(*state));
+    memset(endpoints, 0, sizeof(endpoints));
+    endpoints[0].address = EP_IN;
+    endpoints[0].handler_cls = &state->in;
+    endpoints[1].address = EP_OUT;
+    endpoints[1].handler_cls = &state->out;
+    for (int i = 0; i < 2; i++) {
+        endpoints[i].type = USBX_TRANSFER_TYPE_BULK;
+        endpoints[i].max_packet_size = 512;
+        endpoints[i].handler = endpoint_handler;
+    }
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = endpoints;
+    config.num_endpoints = 2;
+    config.control_handler = control_handler;
+    config.control_cls = state;
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    assert(dev != NULL);
+    return dev;
+}
+
+/* Parse and run operations; returns the batch status and leaves the results in @p out */
+static int run(struct usbx_device *dev, struct usbx_retry_table *retry, const char *operations,
+               struct usbx_buf *out) {
+    struct usbx_json *json = usbx_json_parse(operations, strlen(operations), NULL);
+    struct usbx_op_batch batch;
+    const char *message = NULL;
+    assert(json);
+    int parsed = usbx_op_batch_parse(json, 1, NULL, &batch, &message);
+    usbx_json_free(json);
+    assert(parsed == 0);
+    usbx_buf_init(out);
+    int result = usbx_op_batch_run(dev, &batch, retry, out);
+    assert(!out->failed);
+    usbx_buf_append(out, "", 1);
+    usbx_op_batch_free(&batch);
+    return result;
+}
+
+static const char *const read_in = "{\"op\": \"bulk\", \"endpoint\": 129, \"length\": 512, "
+                                   "\"timeout\": 30}";
+
+/**
+ * Test 1: a stalled endpoint is cleared and the operation repeated
+ */
+void test_stall_recovery() {
+    printf("TEST: Clear-halt and retry on stall\n");
+    struct device_state state;
+    struct usbx_device *dev = create_device(&state);
+    struct usbx_retry_table *retry = usbx_retry_table_create();
+    struct usbx_buf out;
+
+    state.in.stall_next = 1;
+    assert(run(dev, retry, read_in, &out) == USBX_ERROR_PIPE);
+    assert(!strstr(out.data, "retries"));
+    usbx_buf_free(&out);
+    assert(state.in.halted && state.clear_halts == 0);
+
+    struct usbx_retry_policy policy;
+    usbx_retry_policy_init(&policy, EP_IN);
+    policy.stall_retries = 2;
+    assert(usbx_retry_set(retry, &policy) == USBX_SUCCESS);
+    assert(run(dev, retry, read_in, &out) == USBX_SUCCESS);
+    assert(strstr(out.data, "\"retries\": 1"));
+    usbx_buf_free(&out);
+    assert(!state.in.halted && state.clear_halts == 1);
+
+    // An endpoint that halts again every time gives up after the limit
+    state.in.stall_next = 3;
+    assert(run(dev, retry, read_in, &out) == USBX_ERROR_PIPE);
+    assert(strstr(out.data, "\"retries\": 2"));
+    usbx_buf_free(&out);
+
+    struct usbx_retry_stats stats;
+    usbx_retry_get_stats(retry, EP_IN, &stats);
+    assert(stats.stall_retries == 3 && stats.clear_halts == 3);
+    assert(stats.recovered == 1 && stats.exhausted == 1);
+    usbx_retry_get_stats(retry, EP_OUT, &stats);
+    assert(stats.stall_retries == 0);
+    usbx_retry_table_free(retry);
+    usbx_device_destroy(dev);
+    printf("✓ one clear-halt recovers a stall, repeated stalls give up after 2 retries\n");
+}
+
+/**
+ * Test 2: timeouts are retried a bounded number of times with backoff
+ */
+void test_timeout_retry() {
+    printf("TEST: Timeout retries with backoff\n");
+    struct device_state state;
+    struct usbx_device *dev = create_device(&state);
+    struct usbx_retry_table *retry = usbx_retry_table_create();
+    struct usbx_retry_policy policy;
+    struct usbx_buf out;
+
+    usbx_retry_policy_init(&policy, USBX_RETRY_ALL_ENDPOINTS);
+    policy.timeout_retries = 3;
+    policy.backoff_ms = 10;
+    policy.max_backoff_ms = 20;
+    assert(usbx_retry_set(retry, &policy) == USBX_SUCCESS);
+
+    state.in.timeout_next = 2;
+    uint64_t start = usbx_now_us();
+    assert(run(dev, retry, read_in, &out) == USBX_SUCCESS);
+    uint64_t elapsed = usbx_now_us() - start;
+    assert(strstr(out.data, "\"retries\": 2"));
+    usbx_buf_free(&out);
+    assert(elapsed >= 2 * 30000 + 10000 + 20000);
+
+    state.in.timeout_next = 10;
+    assert(run(dev, retry, read_in, &out) == USBX_ERROR_TIMEOUT);
+    usbx_buf_free(&out);
+    assert(state.in.transfers == 3 + 4);
+
+    struct usbx_retry_stats stats;
+    usbx_retry_get_stats(retry, USBX_RETRY_ALL_ENDPOINTS, &stats);
+    assert(stats.timeout_retries == 5 && stats.recovered == 1 && stats.exhausted == 1);
+    assert(stats.clear_halts == 0);
+    usbx_retry_table_free(retry);
+    usbx_device_destroy(dev);
+    printf("✓ recovered after 2 timeouts in %llu us, gave up after 3 retries\n",
+           (unsigned long long)elapsed);
+}
+
+/**
+ * Test 3: operations that moved data or have side effects need an idempotency flag
+ */
+void test_idempotency() {
+    printf("TEST: Idempotency rules\n");
+    struct device_state state;
+    struct usbx_device *dev = create_device(&state);
+    struct usbx_retry_table *retry = usbx_retry_table_create();
+    struct usbx_retry_policy policy;
+    struct usbx_buf out;
+
+    usbx_retry_policy_init(&policy, USBX_RETRY_ALL_ENDPOINTS);
+    policy.stall_retries = 1;
+    assert(usbx_retry_set(retry, &policy) == USBX_SUCCESS);
+
+    // 100 bytes went out before the stall: repeating would send them twice
+    const char *write = "{\"op\": \"bulk\", \"endpoint\": 2, \"data\": \"AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA\"}";
+    state.out.stall_next = 1;
+    state.out.partial = 100;
+    assert(run(dev, retry, write, &out) == USBX_ERROR_PIPE);
+    usbx_buf_free(&out);
+    assert(state.clear_halts == 0);
+
+    // The operation says it is safe
+    char idempotent[512];
+    snprintf(idempotent, sizeof(idempotent), "%.*s, \"idempotent\": true}",
+             (int)strlen(write) - 1, write);
+    assert(state.out.halted);
+    assert(run(dev, retry, write, &out) == USBX_ERROR_PIPE);     // still unsafe
+    usbx_buf_free(&out);
+    assert(run(dev, retry, idempotent, &out) == USBX_SUCCESS);
+    assert(strstr(out.data, "\"retries\": 1"));
+    usbx_buf_free(&out);
+
+    // Control requests need the control flag
+    const char *control = "{\"op\": \"control\", \"request_type\": 64, \"request\": 1}";
+    state.control_stall_next = 1;
+    assert(run(dev, retry, control, &out) == USBX_ERROR_PIPE);
+    usbx_buf_free(&out);
+    policy.idempotent = USBX_RETRY_CONTROL;
+    assert(usbx_retry_set(retry, &policy) == USBX_SUCCESS);
+    state.control_stall_next = 1;
+    int clear_halts = state.clear_halts;
+    assert(run(dev, retry, control, &out) == USBX_SUCCESS);
+    usbx_buf_free(&out);
+    assert(state.clear_halts == clear_halts);   // endpoint 0 recovers by itself
+
+    struct usbx_retry_stats stats;
+    usbx_retry_get_stats(retry, USBX_RETRY_ALL_ENDPOINTS, &stats);
+    assert(stats.unsafe == 3 && stats.recovered == 2);
+    usbx_retry_table_free(retry);
+    usbx_device_destroy(dev);
+    printf("✓ partial OUT and control retried only when declared idempotent\n");
+}
+
+static void request(struct usbx_http_router *router, const char *method, const char *path,
+                    struct usbx_http_pair *args, int num_args, struct usbx_http_response *resp) {
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = method;
+    req.path = path;
+    req.args = args;
+    req.num_args = num_args;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+/**
+ * Test 4: /handles/{id}/retry routes and batches on the handle
+ */
+void test_routes() {
+    printf("TEST: /handles/{id}/retry\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    struct device_state state;
+    struct usbx_device *dev = create_device(&state);
+    int handle_id = usbx_handle_add(dev, NULL);
+    char path[64], batch_path[64];
+    snprintf(path, sizeof(path), "/handles/%d/retry", handle_id);
+    snprintf(batch_path, sizeof(batch_path), "/handles/%d/batch", handle_id);
+    struct usbx_http_response resp;
+
+    struct usbx_http_pair bad[1] = {{"idempotent", "in,sideways"}};
+    request(router, "POST", path, bad, 1, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    struct usbx_http_pair too_many[1] = {{"stall_retries", "100"}};
+    request(router, "POST", path, too_many, 1, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+
+    struct usbx_http_pair args[3] = {{"endpoint", "0x81"}, {"stall_retries", "1"},
+                                     {"idempotent", "in,out"}};
+    request(router, "POST", path, args, 3, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"endpoint\": 129"));
+    assert(strstr(resp.body, "\"idempotent\": [\"in\", \"out\"]"));
+    usbx_http_response_free(&resp);
+
+    state.in.stall_next = 1;
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    char body[128];
+    snprintf(body, sizeof(body), "{\"operations\": [%s]}", read_in);
+    req.method = "POST";
+    req.path = batch_path;
+    req.body = (const unsigned char *)body;
+    req.body_length = strlen(body);
+    usbx_http_dispatch(router, &req, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"status\": \"USBX_SUCCESS\""));
+    assert(strstr(resp.body, "\"retries\": 1"));
+    usbx_http_response_free(&resp);
+
+    request(router, "GET", path, NULL, 0, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"clear_halts\": 1"));
+    assert(strstr(resp.body, "\"recovered\": 1"));
+    usbx_http_response_free(&resp);
+    request(router, "DELETE", path, NULL, 0, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"policies\": []"));
+    assert(strstr(resp.body, "\"clear_halts\": 0"));
+    usbx_http_response_free(&resp);
+
+    usbx_handle_remove(handle_id);
+    usbx_http_router_destroy(router);
+    printf("✓ policies validated, applied to batches, reported and cleared per handle\n");
+}
+
+int main() {
+    printf("=== Retry Policy Tests ===\n\n");
+    test_stall_recovery();
+    test_timeout_retry();
+    test_idempotency();
+    test_routes();
+    printf("\n=== All retry policy tests passed ===\n");
+    return 0;
+}
@@ -0,0 +1,435 @@
+/*
+ * Unit tests for fair sharing of a device between clients
+ *
+ * One slot is held by a transfer the simulated device keeps pending while
+ * clients queue up behind it. Once it is let go, the order in which the
+ * device sees the queued transfers has to follow the weights, with the
+ * control transfer first. Further tests cover a queued transfer running
+ * out of time, disabling the scheduler with waiters, the
+ * /handles/{id}/scheduler routes, and a control request still completing
+ * while a serial channel and two interrupt pollers keep transfers pending.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "usbx_api.h"
+#include "usbx_sched.h"
+#include "usbx_sim.h"
+#include "usbx_util.h"
+
+#define EP_IN 0x81
+#define HOLD_LENGTH 32           // transfers of this length wait while hold is set
+#define HEAVY_LENGTH 64          // client "heavy"
+#define LIGHT_LENGTH 63          // client "light"
+#define QUEUED 6                 // transfers each bulk client queues
+
+struct device_log {
+    int hold;
+    char order[64];              // 'H', 'h' (heavy, light) or 'C' per admitted transfer
+    int count;
+};
+
+static void log_transfer(struct device_log *log, char c) {
+    int i = __atomic_fetch_add(&log->count, 1, __ATOMIC_ACQ_REL);
+    if (i < (int)sizeof(log->order) - 1) {
+        log->order[i] = c;
+    }
+}
+
+static int bulk_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                        uint64_t *retry_at_us) {
+    struct device_log *log = cls;
+    if (xfer->length == HOLD_LENGTH) {
+        if (__atomic_load_n(&log->hold, __ATOMIC_ACQUIRE)) {
+            *retry_at_us = now_us + 1000;
+            return USBX_SIM_RETRY;
+        }
+    } else {
+        log_transfer(log, xfer->length == HEAVY_LENGTH ? 'H' : 'h');
+    }
+    memset(xfer->buffer, 0x5a, (size_t)xfer->length);
+    xfer->actual_length = xfer->length;
+    return USBX_TRANSFER_COMPLETED;
+}
+
+static int control_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                           uint64_t *retry_at_us) {
+    (void)now_us;
+    (void)retry_at_us;
+    log_transfer(cls, 'C');
+    xfer->actual_length = 0;
+    return USBX_TRANSFER_COMPLETED;
+}
+
+/* Endpoint with nothing to say, like an idle console or a quiet interrupt pipe */
+static int quiet_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                         uint64_t *retry_at_us) {
+    (void)cls;
+    (void)xfer;
+    *retry_at_us = now_us + 1000;
+    return USBX_SIM_RETRY;
+}
+
+static struct usbx_device *create_device(struct device_log *log) {
+    struct usbx_sim_endpoint_config endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.address = EP_IN;
+    endpoint.type = USBX_TRANSFER_TYPE_BULK;
+    endpoint.max_packet_size = 512;
+    endpoint.handler = bulk_handler;
+    endpoint.handler_cls = log;
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = &endpoint;
+    config.num_endpoints = 1;
+    config.control_handler = control_handler;
+    config.control_cls = log;
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    assert(dev != NULL);
+    return dev;
+}
+
+/** @brief One submitting thread */
+struct submitter {
+    pthread_t thread;
+    struct usbx_device *dev;
+    const char *client;
+    int length;                  // 0 for a control transfer
+    unsigned int timeout;
+    int result;
+};
+
+static void *submit(void *arg) {
+    struct submitter *s = arg;
+    unsigned char data[HEAVY_LENGTH];
+    int transferred = 0;
+
+    usbx_sched_set_client(s->client);
+    if (s->length == 0) {
+        s->result = usbx_control_transfer(s->dev, 0xc0, 0x01, 0, 0, NULL, 0, s->timeout);
+    } else {
+        s->result = usbx_bulk_transfer(s->dev, EP_IN, data, s->length, &transferred, s->timeout);
+    }
+    return NULL;
+}
+
+static void start(struct submitter *s, struct usbx_device *dev, const char *client, int length,
+                  unsigned int timeout) {
+    s->dev = dev;
+    s->client = client;
+    s->length = length;
+    s->timeout = timeout;
+    assert(pthread_create(&s->thread, NULL, submit, s) == 0);
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = ms * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+/* Wait until the scheduler shows the given number of transfers in flight and queued */
+static void wait_for(struct usbx_sched *sched, unsigned int in_flight, unsigned int queued) {
+    struct usbx_sched_stats stats;
+    for (int i = 0; i < 2000; i++) {
+        usbx_sched_get_stats(sched, &stats, NULL, 0);
+        if (stats.in_flight == in_flight && stats.queued == queued) {
+            return;
+        }
+        sleep_ms(1);
+    }
+    assert(!"scheduler did not reach the expected state");
+}
+
+static const struct usbx_sched_client_stats *find_client(const struct usbx_sched_client_stats *clients,
+                                                         int count, const char *client) {
+    char fingerprint[USBX_SCHED_FINGERPRINT_SIZE];
+    usbx_sched_fingerprint(client, fingerprint);
+    for (int i = 0; i < count; i++) {
+        if (strcmp(clients[i].fingerprint, fingerprint) == 0) {
+            return &clients[i];
+        }
+    }
+    return NULL;
+}
+
+static void enable(struct usbx_sched *sched, unsigned int max_in_flight, unsigned int quantum) {
+    struct usbx_sched_config config;
+    usbx_sched_config_init(&config);
+    config.enabled = 1;
+    config.max_in_flight = max_in_flight;
+    config.quantum = quantum;
+    assert(usbx_sched_configure(sched, &config) == USBX_SUCCESS);
+}
+
+/**
+ * Test 1: queued transfers are admitted by weight, control transfers first
+ */
+void test_weighted_order() {
+    printf("TEST: Weighted order with control first\n");
+    struct device_log log = {.hold = 1};
+    struct usbx_device *dev = create_device(&log);
+    struct usbx_sched *sched = usbx_sched_create();
+    struct submitter holder, heavy[QUEUED], light[QUEUED], control;
+    usbx_sched_attach(sched, dev);
+    enable(sched, 1, HEAVY_LENGTH);
+    assert(usbx_sched_set_weight(sched, "heavy", 3) == USBX_SUCCESS);
+    assert(usbx_sched_set_weight(sched, "heavy", 0) == USBX_ERROR_INVALID_PARAM);
+
+    // Without a client the scheduler is bypassed and nothing is counted
+    unsigned char data[HEAVY_LENGTH];
+    int transferred = 0;
+    assert(usbx_bulk_transfer(dev, EP_IN, data, HEAVY_LENGTH, &transferred, 1000) == USBX_SUCCESS);
+    log.count = 0;
+
+    start(&holder, dev, "holder", HOLD_LENGTH, 0);
+    wait_for(sched, 1, 0);
+    for (int i = 0; i < QUEUED; i++) {
+        start(&heavy[i], dev, "heavy", HEAVY_LENGTH, 0);
+    }
+    wait_for(sched, 1, QUEUED);
+    for (int i = 0; i < QUEUED; i++) {
+        start(&light[i], dev, "light", LIGHT_LENGTH, 0);
+    }
+    wait_for(sched, 1, 2 * QUEUED);
+    start(&control, dev, "light", 0, 0);
+    wait_for(sched, 1, 2 * QUEUED + 1);
+
+    __atomic_store_n(&log.hold, 0, __ATOMIC_RELEASE);
+    pthread_join(holder.thread, NULL);
+    pthread_join(control.thread, NULL);
+    for (int i = 0; i < QUEUED; i++) {
+        pthread_join(heavy[i].thread, NULL);
+        pthread_join(light[i].thread, NULL);
+        assert(heavy[i].result == USBX_SUCCESS && light[i].result == USBX_SUCCESS);
+    }
+    assert(holder.result == USBX_SUCCESS && control.result == USBX_SUCCESS);
+    assert(log.count == 2 * QUEUED + 1);
+    // Three heavy transfers per light one until heavy runs dry
+    assert(strcmp(log.order, "CHHHhHHHhhhhh") == 0);
+
+    struct usbx_sched_stats stats;
+    struct usbx_sched_client_stats clients[8];
+    int count = usbx_sched_get_stats(sched, &stats, clients, 8);
+    assert(count == 3 && stats.clients == 3 && stats.in_flight == 0 && stats.queued == 0);
+    assert(stats.control_first == 1);
+    const struct usbx_sched_client_stats *h = find_client(clients, count, "heavy");
+    const struct usbx_sched_client_stats *l = find_client(clients, count, "light");
+    assert(h && h->weight == 3 && h->admitted == QUEUED && h->waited == QUEUED);
+    assert(h->bytes == QUEUED * HEAVY_LENGTH && h->max_queued == QUEUED && h->queued == 0);
+    assert(l && l->weight == 1 && l->admitted == QUEUED + 1 && l->max_queued == QUEUED + 1);
+    assert(h->max_wait_us > 0 && h->wait_us >= h->max_wait_us && h->expired == 0);
+
+    usbx_sched_detach(dev);
+    usbx_device_destroy(dev);
+    usbx_sched_free(sched);
+    printf("✓ %s: control first, then 3:1 by weight\n", log.order);
+}
+
+/**
+ * Test 2: a queued transfer fails after its timeout; disabling admits waiters
+ */
+void test_expiry_and_disable() {
+    printf("TEST: Queue timeout and disabling with waiters\n");
+    struct device_log log = {.hold = 1};
+    struct usbx_device *dev = create_device(&log);
+    struct usbx_sched *sched = usbx_sched_create();
+    struct submitter holder, late, waiter;
+    usbx_sched_attach(sched, dev);
+    enable(sched, 1, USBX_SCHED_DEFAULT_QUANTUM);
+
+    start(&holder, dev, "holder", HOLD_LENGTH, 0);
+    wait_for(sched, 1, 0);
+    uint64_t begin = usbx_now_us();
+    start(&late, dev, "late", HEAVY_LENGTH, 30);
+    pthread_join(late.thread, NULL);
+    assert(late.result == USBX_ERROR_TIMEOUT && usbx_now_us() - begin >= 30000);
+    assert(log.count == 0);
+
+    start(&waiter, dev, "late", HEAVY_LENGTH, 0);
+    wait_for(sched, 1, 1);
+    struct usbx_sched_config config;
+    usbx_sched_get_config(sched, &config);
+    config.enabled = 0;
+    assert(usbx_sched_configure(sched, &config) == USBX_SUCCESS);
+    // Admitted at once; the device itself still answers in order
+    wait_for(sched, 2, 0);
+
+    struct usbx_sched_stats stats;
+    struct usbx_sched_client_stats clients[4];
+    int count = usbx_sched_get_stats(sched, &stats, clients, 4);
+    const struct usbx_sched_client_stats *l = find_client(clients, count, "late");
+    assert(l && l->expired == 1 && l->admitted == 1 && l->queued == 0);
+
+    __atomic_store_n(&log.hold, 0, __ATOMIC_RELEASE);
+    pthread_join(holder.thread, NULL);
+    pthread_join(waiter.thread, NULL);
+    assert(holder.result == USBX_SUCCESS && waiter.result == USBX_SUCCESS && log.count == 1);
+    usbx_sched_get_stats(sched, &stats, NULL, 0);
+    assert(stats.in_flight == 0);
+    config.max_in_flight = 0;
+    assert(usbx_sched_configure(sched, &config) == USBX_ERROR_INVALID_PARAM);
+
+    usbx_sched_detach(dev);
+    usbx_device_destroy(dev);
+    usbx_sched_free(sched);
+    printf("✓ expired after 30 ms, waiter admitted when disabled\n");
+}
+
+static void dispatch(struct usbx_http_router *router, const char *method, const char *path,
+                     struct usbx_http_pair *args, int num_args, const char *body,
+                     struct usbx_http_response *resp) {
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = method;
+    req.path = path;
+    req.args = args;
+    req.num_args = num_args;
+    req.client_id = "key-1";
+    req.body = (const unsigned char *)body;
+    req.body_length = body ? strlen(body) : 0;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+/**
+ * Test 3: /handles/{id}/scheduler
+ */
+void test_routes() {
+    printf("TEST: /handles/{id}/scheduler\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    struct device_log log = {.hold = 0};
+    int id = usbx_handle_add(create_device(&log), NULL);
+    char path[64], batch[64], client[160], fingerprint[USBX_SCHED_FINGERPRINT_SIZE];
+    snprintf(path, sizeof(path), "/handles/%d/scheduler", id);
+    snprintf(batch, sizeof(batch), "/handles/%d/batch", id);
+    struct usbx_http_response resp;
+
+    dispatch(router, "GET", path, NULL, 0, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"enabled\": false, \"max_in_flight\": 4"));
+    usbx_http_response_free(&resp);
+    struct usbx_http_pair zero[1] = {{"max_in_flight", "0"}};
+    dispatch(router, "POST", path, zero, 1, NULL, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    struct usbx_http_pair lone[1] = {{"client", "key-2"}};
+    dispatch(router, "POST", path, lone, 1, NULL, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    struct usbx_http_pair heavy[2] = {{"client", "key-2"}, {"weight", "101"}};
+    dispatch(router, "POST", path, heavy, 2, NULL, &resp);
+    assert(resp.status == 400);
+    usbx_http_response_free(&resp);
+    struct usbx_http_pair args[5] = {{"enabled", "1"}, {"max_in_flight", "2"},
+                                      {"quantum", "4096"}, {"client", "key-2"}, {"weight", "5"}};
+    dispatch(router, "POST", path, args, 5, NULL, &resp);
+    assert(resp.status == 200);
+    assert(strstr(resp.body, "\"enabled\": true, \"max_in_flight\": 2, \"quantum\": 4096"));
+    usbx_sched_fingerprint("key-2", fingerprint);
+    snprintf(client, sizeof(client), "{\"client\": \"%s\", \"weight\": 5, \"queued\": 0",
+             fingerprint);
+    assert(strstr(resp.body, client));
+    usbx_http_response_free(&resp);
+
+    // Transfers of a request are counted for the request's client
+    const char *body = "{\"operations\": [{\"op\": \"bulk\", \"endpoint\": 129, \"length\": 64}, "
+                       "{\"op\": \"bulk\", \"endpoint\": 129, \"length\": 64}]}";
+    dispatch(router, "POST", batch, NULL, 0, body, &resp);
+    assert(resp.status == 200);
+    usbx_http_response_free(&resp);
+    assert(usbx_sched_client() == NULL);
+    dispatch(router, "GET", path, NULL, 0, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"in_flight\": 0, \"queued\": 0"));
+    usbx_sched_fingerprint("key-1", fingerprint);
+    snprintf(client, sizeof(client), "{\"client\": \"%s\", \"weight\": 1, \"queued\": 0, "
+             "\"max_queued\": 0, \"admitted\": 2, \"bytes\": 128", fingerprint);
+    assert(strstr(resp.body, client));
+    assert(!strstr(resp.body, "key-1"));
+    usbx_http_response_free(&resp);
+
+    usbx_handle_remove(id);
+    dispatch(router, "GET", path, NULL, 0, NULL, &resp);
+    assert(resp.status == 404);
+    usbx_http_response_free(&resp);
+    usbx_http_router_destroy(router);
+    printf("✓ settings, weights and per-client counters\n");
+}
+
+/**
+ * Test 4: streams started by requests take no slots from control requests
+ */
+void test_streams_bypass() {
+    printf("TEST: serial channel and interrupt polling bypass the scheduler\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    struct device_log log = {.hold = 0};
+    struct usbx_sim_endpoint_config endpoints[4];
+    const unsigned char addresses[4] = {0x81, 0x02, 0x83, 0x84};
+    memset(endpoints, 0, sizeof(endpoints));
+    for (int i = 0; i < 4; i++) {
+        endpoints[i].address = addresses[i];
+        endpoints[i].type = i < 2 ? USBX_TRANSFER_TYPE_BULK : USBX_TRANSFER_TYPE_INTERRUPT;
+        endpoints[i].max_packet_size = i < 2 ? 512 : 64;
+        endpoints[i].handler = quiet_handler;
+    }
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = endpoints;
+    config.num_endpoints = 4;
+    config.control_handler = control_handler;
+    config.control_cls = &log;
+    int id = usbx_handle_add(usbx_sim_device_create(&config), NULL);
+    char path[64];
+    struct usbx_http_response resp;
+
+    struct usbx_http_pair enable[1] = {{"enabled", "1"}};
+    snprintf(path, sizeof(path), "/handles/%d/scheduler", id);
+    dispatch(router, "POST", path, enable, 1, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"max_in_flight\": 4"));
+    usbx_http_response_free(&resp);
+
+    // Two bulk IN reads and two polls on each interrupt endpoint: six pending transfers
+    snprintf(path, sizeof(path), "/handles/%d/serial", id);
+    dispatch(router, "POST", path, NULL, 0, NULL, &resp);
+    assert(resp.status == 201);
+    usbx_http_response_free(&resp);
+    snprintf(path, sizeof(path), "/handles/%d/interrupts/0x83/subscribers", id);
+    dispatch(router, "POST", path, NULL, 0, NULL, &resp);
+    assert(resp.status == 201);
+    usbx_http_response_free(&resp);
+    snprintf(path, sizeof(path), "/handles/%d/interrupts/0x84/subscribers", id);
+    dispatch(router, "POST", path, NULL, 0, NULL, &resp);
+    assert(resp.status == 201);
+    usbx_http_response_free(&resp);
+
+    const char *body = "{\"operations\": [{\"op\": \"control\", \"request_type\": \"0xc0\", "
+                       "\"request\": 1, \"length\": 4, \"timeout\": 1000}]}";
+    snprintf(path, sizeof(path), "/handles/%d/batch", id);
+    dispatch(router, "POST", path, NULL, 0, body, &resp);
+    assert(resp.status == 200);
+    usbx_http_response_free(&resp);
+    snprintf(path, sizeof(path), "/handles/%d/scheduler", id);
+    dispatch(router, "GET", path, NULL, 0, NULL, &resp);
+    assert(resp.status == 200 && strstr(resp.body, "\"in_flight\": 0, \"queued\": 0"));
+    usbx_http_response_free(&resp);
+
+    usbx_handle_remove(id);
+    usbx_http_router_destroy(router);
+    printf("✓ control request completed with six stream transfers pending\n");
+}
+
+int main() {
+    printf("=== Fair Scheduling Tests ===\n\n");
+    test_weighted_order();
+    test_expiry_and_disable();
+    test_routes();
+    test_streams_bypass();
+    printf("\n=== All fair scheduling tests passed ===\n");
+    return 0;
+}
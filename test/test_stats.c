@@ -0,0 +1,194 @@
+/*
+ * Unit tests for transfer statistics
+ *
+ * A simulated device answers, stalls or hangs on demand; the counters of
+ * its endpoints have to follow: completions by status, bytes, errors by
+ * code, refused submissions and the latency histogram. The REST test reads
+ * them back through /handles/{id}/stats and the Prometheus export.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_sim.h"
+#include "usbx_stats.h"
+#include "usbx_util.h"
+
+#define EP_IN 0x81
+
+enum behaviour { ANSWER = 0, STALL, HANG };
+
+static int endpoint_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                            uint64_t *retry_at_us) {
+    switch (__atomic_load_n((int *)cls, __ATOMIC_ACQUIRE)) {
+    case STALL:
+        return USBX_TRANSFER_STALL;
+    case HANG:
+        *retry_at_us = now_us + 60000000ULL;
+        return USBX_SIM_RETRY;
+    default:
+        memset(xfer->buffer, 0x5a, (size_t)xfer->length);
+        xfer->actual_length = xfer->length;
+        return USBX_TRANSFER_COMPLETED;
+    }
+}
+
+static struct usbx_device *create_device(int *behaviour) {
+    struct usbx_sim_endpoint_config endpoint;
+    memset(&endpoint, 0, sizeof(endpoint));
+    endpoint.address = EP_IN;
+    endpoint.type = USBX_TRANSFER_TYPE_BULK;
+    endpoint.max_packet_size = 512;
+    endpoint.handler = endpoint_handler;
+    endpoint.handler_cls = behaviour;
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = &endpoint;
+    config.num_endpoints = 1;
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    assert(dev != NULL);
+    return dev;
+}
+
+static int read_in(struct usbx_device *dev, unsigned char endpoint) {
+    unsigned char data[64];
+    int transferred = 0;
+    return usbx_bulk_transfer(dev, endpoint, data, sizeof(data), &transferred, 20);
+}
+
+/**
+ * Test 1: counters follow completions, failures and refused submissions
+ */
+void test_counters() {
+    printf("TEST: Endpoint counters\n");
+    int behaviour = ANSWER;
+    struct usbx_device *dev = create_device(&behaviour);
+    struct usbx_stats *stats = usbx_stats_create();
+    struct usbx_stats_endpoint endpoints[USBX_STATS_ENDPOINTS], total;
+    usbx_stats_attach(stats, dev);
+
+    assert(usbx_stats_get(stats, endpoints, &total) == 0 && total.transfers == 0);
+    for (int i = 0; i < 10; i++) {
+        assert(read_in(dev, EP_IN) == USBX_SUCCESS);
+    }
+    behaviour = STALL;
+    assert(read_in(dev, EP_IN) == USBX_ERROR_PIPE);
+    behaviour = HANG;
+    assert(read_in(dev, EP_IN) == USBX_ERROR_TIMEOUT);
+    // No control handler: every request stalls; 0x82 does not exist
+    assert(usbx_control_transfer(dev, 0xc0, 0x01, 0, 0, NULL, 0, 100) == USBX_ERROR_PIPE);
+    assert(read_in(dev, 0x82) == USBX_ERROR_NOT_FOUND);
+
+    assert(usbx_stats_get(stats, endpoints, &total) == 3);
+    assert(endpoints[0].endpoint == 0x00 && endpoints[1].endpoint == 0x81);
+    assert(endpoints[2].endpoint == 0x82);
+    const struct usbx_stats_endpoint *in = &endpoints[1];
+    assert(in->transfers == 12 && in->bytes == 640);
+    assert(in->statuses[USBX_TRANSFER_COMPLETED] == 10 && in->statuses[USBX_TRANSFER_STALL] == 1);
+    assert(in->statuses[USBX_TRANSFER_TIMED_OUT] == 1);
+    assert(in->errors[-USBX_ERROR_PIPE] == 1 && in->errors[-USBX_ERROR_TIMEOUT] == 1);
+    uint64_t completions = 0;
+    for (int i = 0; i < USBX_STATS_LATENCY_BUCKETS; i++) {
+        completions += in->latency[i];
+    }
+    assert(completions == 12 && in->latency_sum_us >= 20000);
+    // The timed-out read took at least 20 ms, the answers far less
+    assert(usbx_stats_latency_quantile_us(in, 500) < 20000);
+    assert(usbx_stats_latency_quantile_us(in, 1000) >= 20000);
+    assert(endpoints[0].transfers == 1 && endpoints[0].statuses[USBX_TRANSFER_STALL] == 1);
+    assert(endpoints[2].transfers == 0 && endpoints[2].submit_errors == 1);
+    assert(endpoints[2].errors[-USBX_ERROR_NOT_FOUND] == 1);
+    assert(total.transfers == 13 && total.submit_errors == 1 && total.bytes == 640);
+
+    usbx_stats_detach(dev);
+    assert(read_in(dev, EP_IN) == USBX_ERROR_TIMEOUT);
+    usbx_stats_get(stats, endpoints, &total);
+    assert(total.transfers == 13);
+    usbx_device_destroy(dev);
+    usbx_stats_free(stats);
+    printf("✓ statuses, bytes, error codes, refused submissions and latency buckets\n");
+}
+
+static void dispatch(struct usbx_http_router *router, const char *method, const char *path,
+                     const char *body, struct usbx_http_response *resp) {
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = method;
+    req.path = path;
+    req.body = (const unsigned char *)body;
+    req.body_length = body ? strlen(body) : 0;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+/**
+ * Test 2: /handles/{id}/stats and /metrics
+ */
+void test_routes() {
+    printf("TEST: /handles/{id}/stats and /metrics\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    int behaviour = ANSWER;
+    struct usbx_device_info info = {.vid = 0x1234, .pid = 0x5678, .serial = "SN\"1",
+                                    .bus = 1, .address = 2};
+    int id = usbx_handle_add(create_device(&behaviour), &info);
+    char path[64], batch[64], line[160];
+    snprintf(path, sizeof(path), "/handles/%d/stats", id);
+    snprintf(batch, sizeof(batch), "/handles/%d/batch", id);
+    struct usbx_http_response resp;
+
+    const char *body = "{\"operations\": [{\"op\": \"bulk\", \"endpoint\": 129, \"length\": 64}, "
+                       "{\"op\": \"bulk\", \"endpoint\": 129, \"length\": 64}]}";
+    dispatch(router, "POST", batch, body, &resp);
+    assert(resp.status == 200);
+    usbx_http_response_free(&resp);
+    behaviour = STALL;
+    dispatch(router, "POST", batch, body, &resp);      // stops after the first stall
+    usbx_http_response_free(&resp);
+
+    dispatch(router, "GET", path, NULL, &resp);
+    assert(resp.status == 200);
+    assert(strstr(resp.body, "\"transfers\": 3, \"bytes\": 128"));
+    assert(strstr(resp.body, "\"errors\": {\"USBX_ERROR_PIPE\": 1}"));
+    assert(strstr(resp.body, "\"endpoints\": [{\"endpoint\": 129, \"transfers\": 3"));
+    assert(strstr(resp.body, "\"latency_bounds_us\": [100, 250,"));
+    usbx_http_response_free(&resp);
+
+    dispatch(router, "GET", "/metrics", NULL, &resp);
+    assert(resp.status == 200 && strncmp(resp.content_type, "text/plain", 10) == 0);
+    assert(strstr(resp.body, "# TYPE usbx_transfers_total counter\n"));
+    snprintf(line, sizeof(line), "usbx_handle_info{handle=\"%d\",vid=\"0x1234\",pid=\"0x5678\","
+             "serial=\"SN\\\"1\",backend=\"sim\"} 1\n", id);
+    assert(strstr(resp.body, line));
+    snprintf(line, sizeof(line), "usbx_transfers_total{handle=\"%d\",endpoint=\"0x81\","
+             "status=\"stall\"} 1\n", id);
+    assert(strstr(resp.body, line));
+    snprintf(line, sizeof(line), "usbx_transfer_errors_total{handle=\"%d\",endpoint=\"0x81\","
+             "error=\"USBX_ERROR_PIPE\"} 1\n", id);
+    assert(strstr(resp.body, line));
+    snprintf(line, sizeof(line), "usbx_transfer_latency_seconds_bucket{handle=\"%d\","
+             "le=\"+Inf\"} 3\n", id);
+    assert(strstr(resp.body, line));
+    snprintf(line, sizeof(line), "usbx_transfer_latency_seconds_count{handle=\"%d\"} 3\n", id);
+    assert(strstr(resp.body, line));
+    usbx_http_response_free(&resp);
+
+    usbx_handle_remove(id);
+    dispatch(router, "GET", path, NULL, &resp);
+    assert(resp.status == 404);
+    usbx_http_response_free(&resp);
+    usbx_http_router_destroy(router);
+    printf("✓ JSON counters and Prometheus families\n");
+}
+
+int main() {
+    printf("=== Transfer Statistics Tests ===\n\n");
+    test_counters();
+    test_routes();
+    printf("\n=== All transfer statistics tests passed ===\n");
+    return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * Unit tests for session recording and replay
+ *
+ * Sessions on simulated devices are recorded, loaded back and replayed:
+ * direct transfers (resubmitted in their recorded order, flat out and at
+ * the recorded pace) and REST requests (dispatched again with the handle
+ * ids rewritten). Altered and damaged trace files are detected.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbx_api.h"
+#include "usbx_sim.h"
+#include "usbx_trace.h"
+
+#define TRACE_PATH "/tmp/usbx_test_trace.bin"
+
+/* Control IN requests answer with wValue repeated */
+static int control_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                           uint64_t *retry_at_us) {
+    (void)cls;
+    (void)now_us;
+    (void)retry_at_us;
+    int length = xfer->length - USBX_CONTROL_SETUP_SIZE;
+    if (xfer->buffer[0] & USBX_ENDPOINT_IN) {
+        memset(xfer->buffer + USBX_CONTROL_SETUP_SIZE, xfer->buffer[2], (size_t)length);
+    }
+    xfer->actual_length = length;
+    return USBX_TRANSFER_COMPLETED;
+}
+
+static struct usbx_device *create_device(uint64_t bytes_per_sec) {
+    struct usbx_sim_endpoint_config endpoints[2];
+    memset(endpoints, 0, sizeof(endpoints));
+    endpoints[0].address = 0x81;
+    endpoints[1].address = 0x02;
+    for (int i = 0; i < 2; i++) {
+        endpoints[i].type = USBX_TRANSFER_TYPE_BULK;
+        endpoints[i].max_packet_size = 512;
+        endpoints[i].bytes_per_sec = bytes_per_sec;
+    }
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = endpoints;
+    config.num_endpoints = 2;
+    config.control_handler = control_handler;
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    assert(dev != NULL);
+    return dev;
+}
+
+static void request(struct usbx_http_router *router, const char *method, const char *path,
+                    const unsigned char *body, size_t body_length,
+                    struct usbx_http_response *resp) {
+    struct usbx_http_request req;
+    memset(&req, 0, sizeof(req));
+    req.method = method;
+    req.path = path;
+    req.body = body;
+    req.body_length = body_length;
+    usbx_http_dispatch(router, &req, resp);
+}
+
+/**
+ * Test 1: Direct transfers replay without mismatches, flat out and in real time
+ */
+void test_transfer_replay() {
+    printf("TEST: transfer replay\n");
+    // 2 MB/s: every 4 KiB transfer takes about 2 ms on the recorded device
+    struct usbx_device *dev = create_device(2000000);
+    assert(usbx_trace_start(TRACE_PATH, 0) == USBX_SUCCESS);
+    assert(usbx_trace_start(TRACE_PATH, 0) == USBX_ERROR_BUSY);
+    int handle_id = usbx_handle_add(dev, NULL);
+
+    unsigned char data[4096];
+    int transferred;
+    assert(usbx_control_transfer(dev, 0xc0, 0x01, 0x5a, 0, data, 16, 1000) == 16);
+    for (int i = 0; i < 10; i++) {
+        usbx_sim_fill_pattern(data, sizeof(data), (uint64_t)i * sizeof(data));
+        assert(usbx_bulk_transfer(dev, 0x02, data, sizeof(data), &transferred, 1000) ==
+               USBX_SUCCESS);
+        assert(usbx_bulk_transfer(dev, 0x81, data, sizeof(data), &transferred, 1000) ==
+               USBX_SUCCESS);
+    }
+    assert(usbx_handle_remove(handle_id) == USBX_SUCCESS);
+    assert(usbx_trace_stop() == USBX_SUCCESS);
+    assert(usbx_trace_stop() == USBX_ERROR_NOT_FOUND);
+
+    int error;
+    struct usbx_trace *trace = usbx_trace_load(TRACE_PATH, &error);
+    assert(trace != NULL);
+    struct usbx_trace_info info;
+    usbx_trace_get_info(trace, &info);
+    assert(info.devices == 1 && info.requests == 0 && info.transfers == 21);
+    assert(info.payload_bytes == 8 + 16 + 20 * sizeof(data));
+
+    struct usbx_replay_result fast, paced;
+    assert(usbx_trace_replay(trace, 0, &fast) == USBX_SUCCESS);
+    assert(fast.transfers == 21 && fast.status_mismatches == 0 && fast.data_mismatches == 0);
+    assert(usbx_trace_replay(trace, USBX_REPLAY_REALTIME, &paced) == USBX_SUCCESS);
+    assert(paced.transfers == 21 && paced.status_mismatches == 0 && paced.data_mismatches == 0);
+    assert(paced.elapsed_us >= paced.recorded_us / 2);
+    assert(fast.elapsed_us < paced.elapsed_us);
+    usbx_trace_free(trace);
+    printf("✓ 21 transfers, recorded %llu us, replayed in %llu us flat out, %llu us paced\n",
+           (unsigned long long)paced.recorded_us, (unsigned long long)fast.elapsed_us,
+           (unsigned long long)paced.elapsed_us);
+}
+
+/* Offset of the last occurrence of a byte string in a buffer, or -1 */
+static long find_last(const unsigned char *data, size_t size, const unsigned char *needle,
+                      size_t length) {
+    for (long i = (long)(size - length); i >= 0; i--) {
+        if (memcmp(data + i, needle, length) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Test 2: REST requests replay against new handles; altered OUT data is detected
+ */
+void test_request_replay() {
+    printf("TEST: request replay\n");
+    struct usbx_http_router *router = usbx_http_router_create();
+    assert(router && usbx_api_register_all(router) == 0);
+    assert(usbx_trace_start(TRACE_PATH, 0) == USBX_SUCCESS);
+    int handle_id = usbx_handle_add(create_device(0), NULL);
+
+    static unsigned char body[3000];
+    usbx_sim_fill_pattern(body, sizeof(body), 0);
+    char path[64];
+    snprintf(path, sizeof(path), "/handles/%d/bulk/0x02", handle_id);
+    struct usbx_http_response resp;
+    request(router, "PUT", path, body, sizeof(body), &resp);
+    assert(resp.status == 200);
+    usbx_http_response_free(&resp);
+    request(router, "GET", "/handles", NULL, 0, &resp);
+    assert(resp.status == 200);
+    usbx_http_response_free(&resp);
+    request(router, "PUT", "/handles/9999/bulk/0x02", body, 16, &resp);
+    assert(resp.status == 404);
+    usbx_http_response_free(&resp);
+    assert(usbx_trace_stop() == USBX_SUCCESS);
+    usbx_handle_remove(handle_id);
+    usbx_http_router_destroy(router);
+
+    struct usbx_trace *trace = usbx_trace_load(TRACE_PATH, NULL);
+    assert(trace != NULL);
+    struct usbx_trace_info info;
+    usbx_trace_get_info(trace, &info);
+    assert(info.devices == 1 && info.requests == 3 && info.transfers >= 1);
+    struct usbx_replay_result result;
+    assert(usbx_trace_replay(trace, 0, &result) == USBX_SUCCESS);
+    assert(result.requests == 3 && result.transfers == info.transfers);
+    assert(result.status_mismatches == 0 && result.data_mismatches == 0);
+    usbx_trace_free(trace);
+
+    // Change one byte of the first request body: the upload no longer matches
+    FILE *file = fopen(TRACE_PATH, "rb");
+    assert(file);
+    static unsigned char contents[65536];
+    size_t size = fread(contents, 1, sizeof(contents), file);
+    fclose(file);
+    long at = find_last(contents, size, body, sizeof(body));
+    assert(at > 0);
+    contents[at + 100] ^= 0xff;
+    file = fopen(TRACE_PATH, "wb");
+    assert(file && fwrite(contents, 1, size, file) == size);
+    fclose(file);
+
+    trace = usbx_trace_load(TRACE_PATH, NULL);
+    assert(trace != NULL);
+    assert(usbx_trace_replay(trace, 0, &result) == USBX_SUCCESS);
+    assert(result.requests == 3 && result.status_mismatches == 0 && result.data_mismatches == 1);
+    usbx_trace_free(trace);
+    printf("✓ 3 requests replayed on a new handle, altered upload detected\n");
+}
+
+/**
+ * Test 3: Damaged files
+ */
+void test_damaged_files() {
+    printf("TEST: damaged trace files\n");
+    int error = 0;
+    assert(usbx_trace_load("/nonexistent/trace.bin", &error) == NULL && error == USBX_ERROR_IO);
+
+    // Truncated in the middle of the last record: everything before it loads
+    FILE *file = fopen(TRACE_PATH, "rb");
+    assert(file);
+    static unsigned char contents[65536];
+    size_t size = fread(contents, 1, sizeof(contents), file);
+    fclose(file);
+    file = fopen(TRACE_PATH, "wb");
+    assert(file && fwrite(contents, 1, size - 3, file) == size - 3);
+    fclose(file);
+    struct usbx_trace *trace = usbx_trace_load(TRACE_PATH, &error);
+    assert(trace != NULL);
+    struct usbx_trace_info info;
+    usbx_trace_get_info(trace, &info);
+    assert(info.requests == 2);
+    usbx_trace_free(trace);
+
+    // Unknown record kind
+    contents[9] = 'Z';
+    file = fopen(TRACE_PATH, "wb");
+    assert(file && fwrite(contents, 1, size, file) == size);
+    fclose(file);
+    error = 0;
+    assert(usbx_trace_load(TRACE_PATH, &error) == NULL && error == USBX_ERROR_INVALID_PARAM);
+
+    // Not a trace
+    memcpy(contents, "GARBAGE!", 8);
+    file = fopen(TRACE_PATH, "wb");
+    assert(file && fwrite(contents, 1, size, file) == size);
+    fclose(file);
+    error = 0;
+    assert(usbx_trace_load(TRACE_PATH, &error) == NULL && error == USBX_ERROR_INVALID_PARAM);
+    remove(TRACE_PATH);
+    printf("✓ truncated trace keeps its whole records, corrupt ones are rejected\n");
+}
+
+int main() {
+    printf("=== Trace Tests ===\n\n");
+
+    test_transfer_replay();
+    test_request_replay();
+    test_damaged_files();
+
+    printf("\n=== All trace tests passed ===\n");
+    return 0;
+}
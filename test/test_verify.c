@@ -0,0 +1,266 @@
+/*
+ * Unit tests for readback verification
+ *
+ * Checks CRC-32C against published vectors and the portable
+ * implementation, then runs verify operations against the simulated
+ * pattern source, a message-framed source and a control request.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "usbx_blob.h"
+#include "usbx_buf.h"
+#include "usbx_codec.h"
+#include "usbx_crc32c.h"
+#include "usbx_json.h"
+#include "usbx_ops.h"
+#include "usbx_sim.h"
+#include "usbx_util.h"
+
+#define EP_STREAM_IN 0x81
+#define EP_MESSAGE_IN 0x82
+#define MESSAGE_SIZE 100000
+#define REQUEST_VERSION 0x07
+
+static const char version_string[] = "usbX firmware 1.2.3";
+
+static int control_handler(void *cls, struct usbx_transfer *xfer, uint64_t now_us,
+                           uint64_t *retry_at_us) {
+    unsigned char *setup = xfer->buffer;
+    int length = setup[6] | setup[7] << 8;
+    (void)cls;
+    (void)now_us;
+    (void)retry_at_us;
+
+    if (setup[0] != 0xc0 || setup[1] != REQUEST_VERSION) {
+        return USBX_TRANSFER_STALL;
+    }
+    xfer->actual_length = length < (int)strlen(version_string) ? length
+                                                                : (int)strlen(version_string);
+    memcpy(xfer->buffer + USBX_CONTROL_SETUP_SIZE, version_string, (size_t)xfer->actual_length);
+    return USBX_TRANSFER_COMPLETED;
+}
+
+static struct usbx_device *create_device(void) {
+    struct usbx_sim_endpoint_config endpoints[2];
+    memset(endpoints, 0, sizeof(endpoints));
+    endpoints[0].address = EP_STREAM_IN;
+    endpoints[0].type = USBX_TRANSFER_TYPE_BULK;
+    endpoints[0].max_packet_size = 512;
+    endpoints[1].address = EP_MESSAGE_IN;
+    endpoints[1].type = USBX_TRANSFER_TYPE_BULK;
+    endpoints[1].max_packet_size = 512;
+    endpoints[1].message_size = MESSAGE_SIZE;
+
+    struct usbx_sim_config config;
+    memset(&config, 0, sizeof(config));
+    config.endpoints = endpoints;
+    config.num_endpoints = 2;
+    config.control_handler = control_handler;
+    struct usbx_device *dev = usbx_sim_device_create(&config);
+    assert(dev != NULL);
+    return dev;
+}
+
+/* Parse and run operations; returns the batch status and leaves the results in @p out */
+static int run(struct usbx_device *dev, struct usbx_blob_store *blobs, const char *operations,
+               struct usbx_buf *out) {
+    struct usbx_json *json = usbx_json_parse(operations, strlen(operations), NULL);
+    struct usbx_op_batch batch;
+    const char *message = NULL;
+    assert(json);
+    int parsed = usbx_op_batch_parse(json, 1, blobs, &batch, &message);
+    usbx_json_free(json);
+    if (parsed < 0) {
+        return -1000;
+    }
+    usbx_buf_init(out);
+    int result = usbx_op_batch_run(dev, &batch, NULL, out);
+    usbx_op_batch_free(&batch);
+    return result;
+}
+
+/* Hex digest of the pattern stream between two offsets */
+static void pattern_digest(int algorithm, uint64_t offset, size_t length, char *hex) {
+    unsigned char *data = malloc(length);
+    usbx_sim_fill_pattern(data, length, offset);
+    if (algorithm == USBX_DIGEST_CRC32C) {
+        snprintf(hex, 9, "%08x", usbx_crc32c(0, data, length));
+    } else {
+        usbx_sha256_hex(data, length, hex);
+    }
+    free(data);
+}
+
+/**
+ * Test 1: CRC-32C vectors, and accelerated against portable
+ */
+void test_crc32c() {
+    printf("TEST: CRC-32C (%s)\n", usbx_crc32c_implementation());
+    unsigned char data[100000];
+
+    assert(usbx_crc32c(0, "123456789", 9) == 0xe3069283);
+    memset(data, 0, 32);
+    assert(usbx_crc32c(0, data, 32) == 0x8a9136aa);    // RFC 3720 B.4
+    memset(data, 0xff, 32);
+    assert(usbx_crc32c(0, data, 32) == 0x62a8ab43);
+    for (int i = 0; i < 32; i++) {
+        data[i] = (unsigned char)i;
+    }
+    assert(usbx_crc32c(0, data, 32) == 0x46dd794e);
+
+    srand(58);
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (unsigned char)rand();
+    }
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t length = 0; length + offset <= sizeof(data); length = length * 2 + 3) {
+            assert(usbx_crc32c(0, data + offset, length) ==
+                   usbx_crc32c_portable(0, data + offset, length));
+        }
+    }
+    uint32_t crc = usbx_crc32c(0, data, 777);
+    assert(usbx_crc32c(crc, data + 777, sizeof(data) - 777) ==
+           usbx_crc32c_portable(0, data, sizeof(data)));
+    printf("✓ vectors match, accelerated path agrees with the table (sha256: %s)\n",
+           usbx_sha256_implementation());
+}
+
+/**
+ * Test 2: bulk and control verify against expected digests
+ */
+void test_verify() {
+    printf("TEST: verify operations\n");
+    struct usbx_device *dev = create_device();
+    struct usbx_buf out;
+    char request[512], sha[USBX_SHA256_HEX_SIZE], crc[9];
+
+    // 5 MiB + 123 bytes from the endless pattern source, checked with SHA-256
+    size_t length = 5 * 1024 * 1024 + 123;
+    pattern_digest(USBX_DIGEST_SHA256, 0, length, sha);
+    snprintf(request, sizeof(request), "{\"op\": \"verify\", \"endpoint\": \"0x81\", "
+                                       "\"length\": %zu, \"expect\": \"%s\"}", length, sha);
+    assert(run(dev, NULL, request, &out) == USBX_SUCCESS);
+    assert(strstr(out.data, "\"match\": true") && strstr(out.data, sha));
+    assert(!strstr(out.data, "\"data\""));
+    usbx_buf_free(&out);
+
+    // The next 1 MiB with CRC-32C; uppercase hex is accepted
+    pattern_digest(USBX_DIGEST_CRC32C, length, 1024 * 1024, crc);
+    for (char *c = crc; *c; c++) {
+        *c = (char)(*c >= 'a' ? *c - 'a' + 'A' : *c);
+    }
+    snprintf(request, sizeof(request), "{\"op\": \"verify\", \"endpoint\": 129, "
+                                       "\"length\": 1048576, \"algorithm\": \"crc32c\", "
+                                       "\"expect\": \"%s\"}", crc);
+    assert(run(dev, NULL, request, &out) == USBX_SUCCESS);
+    assert(strstr(out.data, "\"algorithm\": \"crc32c\"") && strstr(out.data, "\"match\": true"));
+    usbx_buf_free(&out);
+
+    // A wrong digest fails the operation and stops the batch
+    snprintf(request, sizeof(request), "[{\"op\": \"verify\", \"endpoint\": 129, \"length\": 64, "
+                                       "\"algorithm\": \"crc32c\", \"expect\": \"00000000\"}, "
+                                       "{\"op\": \"delay\", \"ms\": 1}]");
+    assert(run(dev, NULL, request, &out) == USBX_ERROR_MISMATCH);
+    assert(strstr(out.data, "\"match\": false") && !strstr(out.data, "\"index\": 1"));
+    usbx_buf_free(&out);
+
+    // Without an expectation only the digest is returned
+    assert(run(dev, NULL, "{\"op\": \"verify\", \"endpoint\": 129, \"length\": 0}", &out) ==
+           USBX_SUCCESS);
+    assert(strstr(out.data, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855") &&
+           strstr(out.data, "\"match\": null"));
+    usbx_buf_free(&out);
+
+    // A short packet ends the range like a bulk read
+    pattern_digest(USBX_DIGEST_SHA256, 0, MESSAGE_SIZE, sha);
+    snprintf(request, sizeof(request), "{\"op\": \"verify\", \"endpoint\": \"0x82\", "
+                                       "\"length\": 1048576, \"expect\": \"%s\"}", sha);
+    assert(run(dev, NULL, request, &out) == USBX_SUCCESS);
+    assert(strstr(out.data, "\"transferred\": 100000"));
+    usbx_buf_free(&out);
+
+    // Control readback
+    snprintf(crc, sizeof(crc), "%08x", usbx_crc32c(0, version_string, strlen(version_string)));
+    snprintf(request, sizeof(request), "{\"op\": \"verify\", \"request_type\": 192, "
+                                       "\"request\": 7, \"length\": 64, "
+                                       "\"algorithm\": \"crc32c\", \"expect\": \"%s\"}", crc);
+    assert(run(dev, NULL, request, &out) == USBX_SUCCESS);
+    assert(strstr(out.data, "\"match\": true") && strstr(out.data, "\"transferred\": 19"));
+    usbx_buf_free(&out);
+
+    static const char *const invalid[] = {
+        "{\"op\": \"verify\", \"endpoint\": 2, \"length\": 4}",
+        "{\"op\": \"verify\", \"endpoint\": 129}",
+        "{\"op\": \"verify\", \"endpoint\": 129, \"length\": 4, \"algorithm\": \"md5\"}",
+        "{\"op\": \"verify\", \"endpoint\": 129, \"length\": 4, \"expect\": \"abcd\"}",
+        "{\"op\": \"verify\", \"request_type\": 64, \"request\": 7, \"length\": 4}",
+        "{\"op\": \"verify\", \"endpoint\": 129, \"blob\": \"00\"}",
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        assert(run(dev, NULL, invalid[i], &out) == -1000);
+    }
+
+    usbx_device_destroy(dev);
+    printf("✓ digests, mismatches, short packets and control reads\n");
+}
+
+/**
+ * Test 3: the expected digest can come from a stored blob
+ */
+void test_verify_blob() {
+    printf("TEST: verify against a stored blob\n");
+    char directory[] = "/tmp/usbx-verify-test-XXXXXX";
+    assert(mkdtemp(directory) != NULL);
+    struct usbx_blob_store *store = usbx_blob_store_open(directory, 0, NULL);
+    struct usbx_device *dev = create_device();
+
+    // The image a freshly opened stream source will return
+    size_t size = 2 * 1024 * 1024 + 5;
+    unsigned char *image = malloc(size);
+    usbx_sim_fill_pattern(image, size, 0);
+    char hash[USBX_SHA256_HEX_SIZE], request[256];
+    assert(usbx_blob_put(store, image, size, hash) == 1);
+
+    struct usbx_buf out;
+    snprintf(request, sizeof(request), "{\"op\": \"verify\", \"endpoint\": 129, \"blob\": \"%s\"}",
+             hash);
+    assert(run(dev, store, request, &out) == USBX_SUCCESS);
+    assert(strstr(out.data, "\"match\": true") && strstr(out.data, "\"transferred\": 2097157"));
+    usbx_buf_free(&out);
+
+    // CRC-32C of the blob is computed from its mapping; the source has moved on
+    snprintf(request, sizeof(request), "{\"op\": \"verify\", \"endpoint\": 129, \"blob\": \"%s\", "
+                                       "\"algorithm\": \"crc32c\"}", hash);
+    assert(run(dev, store, request, &out) == USBX_ERROR_MISMATCH);
+    usbx_buf_free(&out);
+
+    snprintf(request, sizeof(request), "{\"op\": \"verify\", \"endpoint\": 129, \"blob\": \"%s\", "
+                                       "\"length\": 5}", hash);
+    assert(run(dev, store, request, &out) == -1000);
+
+    usbx_device_destroy(dev);
+    usbx_blob_store_close(store);
+    char command[64];
+    snprintf(command, sizeof(command), "rm -rf '%s'", directory);
+    assert(system(command) == 0);
+    free(image);
+    printf("✓ blob hash and CRC used as the expected digest\n");
+}
+
+int main() {
+    printf("=== Readback Verification Tests ===\n\n");
+
+    test_crc32c();
+    test_verify();
+    test_verify_blob();
+
+    printf("\n=== All readback verification tests passed ===\n");
+    return 0;
+}